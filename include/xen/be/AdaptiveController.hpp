@@ -0,0 +1,233 @@
+/*
+ *  Adaptive poller controller
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef XENBE_ADAPTIVECONTROLLER_HPP_
+#define XENBE_ADAPTIVECONTROLLER_HPP_
+
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Exception.hpp"
+#include "Log.hpp"
+#include "RingPoller.hpp"
+#include "Utils.hpp"
+
+namespace XenBackend {
+
+/***************************************************************************//**
+ * Exception generated by AdaptiveController.
+ * @ingroup backend
+ ******************************************************************************/
+class AdaptiveControllerException : public Exception
+{
+	using Exception::Exception;
+};
+
+/***************************************************************************//**
+ * Adaptive controller bounds and steps.
+ * @ingroup backend
+ ******************************************************************************/
+struct AdaptiveConfig
+{
+	/**
+	 * Control period
+	 */
+	std::chrono::milliseconds period = std::chrono::milliseconds(100);
+
+	/**
+	 * Poller idle timeout (spin budget) bounds and additive step
+	 */
+	std::chrono::microseconds minIdleTimeout = std::chrono::microseconds(10);
+	std::chrono::microseconds maxIdleTimeout = std::chrono::microseconds(2000);
+	std::chrono::microseconds idleTimeoutStep = std::chrono::microseconds(50);
+
+	/**
+	 * Ring batch size bounds and additive step
+	 */
+	size_t minBatch = 4;
+	size_t maxBatch = 256;
+	size_t batchStep = 8;
+
+	/**
+	 * Multiplicative decrease factor of all knobs
+	 */
+	double decrease = 0.5;
+
+	/**
+	 * Target of the estimated queueing delay of requests in rings
+	 */
+	std::chrono::microseconds targetLatency = std::chrono::microseconds(200);
+
+	/**
+	 * Number of last decisions kept in the statistics
+	 */
+	size_t maxDecisions = 64;
+};
+
+/***************************************************************************//**
+ * Knob change made by the adaptive controller.
+ * @ingroup backend
+ ******************************************************************************/
+struct AdaptiveDecision
+{
+	/**
+	 * Time since the controller is created
+	 */
+	std::chrono::milliseconds time;
+
+	/**
+	 * Changed knob: "idle-timeout" or "batch:<port>"
+	 */
+	std::string knob;
+
+	int64_t oldValue;
+	int64_t newValue;
+
+	std::string reason;
+};
+
+/***************************************************************************//**
+ * Ring load observed by the adaptive controller in the last period.
+ * @ingroup backend
+ ******************************************************************************/
+struct AdaptiveRingStats
+{
+	evtchn_port_t port;
+
+	/**
+	 * Requests per second
+	 */
+	double arrivalRate;
+
+	/**
+	 * Mean number of available requests per consume pass
+	 */
+	double occupancy;
+
+	/**
+	 * Queueing delay estimate: number of passes a request waits in the
+	 * ring (occupancy / batch size) times the mean poller pass time
+	 */
+	std::chrono::microseconds latency;
+
+	size_t maxBatch;
+};
+
+/***************************************************************************//**
+ * Adaptive controller statistics.
+ * @ingroup backend
+ ******************************************************************************/
+struct AdaptiveStats
+{
+	uint64_t updates;
+	std::chrono::microseconds idleTimeout;
+	std::vector<AdaptiveRingStats> rings;
+	std::vector<AdaptiveDecision> decisions;
+};
+
+/***************************************************************************//**
+ * Adjusts the knobs of the poller and its ring buffers to the load.
+ *
+ * Each period the controller samples the load counters of the rings
+ * serviced by the poller and adjusts the knobs with AIMD rules within the
+ * configured bounds:
+ *
+ * - idle timeout (spin budget, the frontend notifications are off while
+ *   the poller spins): increased by the step when the poller slept although
+ *   requests arrive closer than the max timeout, decreased by the factor
+ *   when the arrivals are rarer than the max timeout;
+ * - ring batch size: increased by the step when each pass leaves requests
+ *   in the ring and all rings meet the latency target, decreased by the
+ *   factor when another ring misses the target while this ring uses full
+ *   batches.
+ *
+ * Each change is logged and kept in the statistics with its reason.
+ * @ingroup backend
+ ******************************************************************************/
+class AdaptiveController
+{
+public:
+
+	/**
+	 * @param[in] poller poller to control
+	 * @param[in] config bounds and steps
+	 */
+	AdaptiveController(RingPollerPtr poller,
+					   const AdaptiveConfig& config = AdaptiveConfig());
+	AdaptiveController(const AdaptiveController&) = delete;
+	AdaptiveController& operator=(AdaptiveController const&) = delete;
+	~AdaptiveController();
+
+	/**
+	 * Starts periodic updates
+	 */
+	void start();
+
+	/**
+	 * Stops periodic updates
+	 */
+	void stop();
+
+	/**
+	 * Samples the load and adjusts the knobs. Is called periodically after
+	 * start().
+	 */
+	void update();
+
+	/**
+	 * Returns controller statistics
+	 */
+	AdaptiveStats getStats() const;
+
+private:
+
+	typedef std::chrono::steady_clock::time_point TimePoint;
+
+	RingPollerPtr mPoller;
+	AdaptiveConfig mConfig;
+
+	Timer mTimer;
+
+	mutable std::mutex mMutex;
+
+	TimePoint mStartTime;
+	TimePoint mLastTime;
+	RingPollerStats mLastPollerStats;
+	uint64_t mUpdates;
+
+	std::unordered_map<RingBufferBase*, RingLoadStats> mLastLoad;
+	std::vector<AdaptiveRingStats> mRingStats;
+	std::deque<AdaptiveDecision> mDecisions;
+
+	Log mLog;
+
+	void updateBatches(const std::vector<RingBufferPtr>& rings);
+	void updateIdleTimeout(double arrivalRate, uint64_t sleeps);
+	void addDecision(const std::string& knob, int64_t oldValue,
+					 int64_t newValue, const std::string& reason);
+};
+
+}
+
+#endif /* XENBE_ADAPTIVECONTROLLER_HPP_ */
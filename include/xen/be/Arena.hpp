@@ -0,0 +1,184 @@
+/*
+ *  Arena allocator
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef XENBE_ARENA_HPP_
+#define XENBE_ARENA_HPP_
+
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace XenBackend {
+
+/***************************************************************************//**
+ * Arena statistics.
+ * @ingroup backend
+ ******************************************************************************/
+struct ArenaStats
+{
+	/**
+	 * Number of allocated chunks
+	 */
+	size_t chunks;
+
+	/**
+	 * Bytes of the allocated chunks
+	 */
+	size_t reservedBytes;
+
+	/**
+	 * Bytes handed out, including alignment padding
+	 */
+	size_t usedBytes;
+
+	/**
+	 * Number of allocations
+	 */
+	uint64_t allocations;
+
+	/**
+	 * Number of allocations not yet deallocated
+	 */
+	uint64_t liveAllocations;
+};
+
+/***************************************************************************//**
+ * Bump allocator for objects sharing one lifetime.
+ *
+ * Memory is carved from page aligned chunks mapped apart from the heap,
+ * deallocation only counts the allocations. All chunks are unmapped at once
+ * when the arena is destroyed. Allocations larger than a quarter of the chunk
+ * get a chunk of their own. Alignment up to the page size is supported.
+ *
+ * The arena is usually referenced through ArenaAllocator instances, so it
+ * lives as long as the objects allocated from it.
+ * @ingroup backend
+ ******************************************************************************/
+class Arena
+{
+public:
+
+	/**
+	 * @param[in] chunkSize chunk size
+	 */
+	explicit Arena(size_t chunkSize = 16384);
+	Arena(const Arena&) = delete;
+	Arena& operator=(Arena const&) = delete;
+	~Arena();
+
+	/**
+	 * Allocates memory
+	 * @param[in] size      size
+	 * @param[in] alignment alignment, power of two
+	 */
+	void* allocate(size_t size, size_t alignment);
+
+	/**
+	 * Deallocates memory. The memory is not reused till the arena is
+	 * destroyed.
+	 * @param[in] data memory allocated by allocate()
+	 */
+	void deallocate(void* data);
+
+	/**
+	 * Returns statistics
+	 */
+	ArenaStats getStats() const;
+
+private:
+
+	size_t mChunkSize;
+
+	mutable std::mutex mMutex;
+	std::vector<std::pair<void*, size_t>> mChunks;
+	uint8_t* mCurrent;
+	size_t mLeft;
+	ArenaStats mStats;
+
+	void* allocateChunk(size_t size);
+};
+
+typedef std::shared_ptr<Arena> ArenaPtr;
+
+/***************************************************************************//**
+ * Standard allocator serving the allocations from Arena.
+ *
+ * @code
+ * ArenaPtr arena(new Arena());
+ *
+ * auto ring = std::allocate_shared<RingBuffer>(
+ *         ArenaAllocator<RingBuffer>(arena), domId, port, ref);
+ * @endcode
+ * @ingroup backend
+ ******************************************************************************/
+template<typename T>
+class ArenaAllocator
+{
+public:
+
+	typedef T value_type;
+
+	/**
+	 * @param[in] arena arena
+	 */
+	explicit ArenaAllocator(ArenaPtr arena) : mArena(arena) {}
+
+	template<typename U>
+	ArenaAllocator(const ArenaAllocator<U>& other) : mArena(other.mArena) {}
+
+	template<typename U>
+	struct rebind
+	{
+		typedef ArenaAllocator<U> other;
+	};
+
+	T* allocate(size_t n)
+	{
+		return static_cast<T*>(mArena->allocate(n * sizeof(T), alignof(T)));
+	}
+
+	void deallocate(T* data, size_t)
+	{
+		mArena->deallocate(data);
+	}
+
+	template<typename U>
+	bool operator==(const ArenaAllocator<U>& other) const
+	{
+		return mArena == other.mArena;
+	}
+
+	template<typename U>
+	bool operator!=(const ArenaAllocator<U>& other) const
+	{
+		return mArena != other.mArena;
+	}
+
+private:
+
+	template<typename U> friend class ArenaAllocator;
+
+	ArenaPtr mArena;
+};
+
+}
+
+#endif /* XENBE_ARENA_HPP_ */
@@ -26,8 +26,10 @@
 #include <atomic>
 #include <list>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "Exception.hpp"
 #include "FrontendHandlerBase.hpp"
@@ -83,6 +85,15 @@ class BackendException : public Exception
  * When the backend instance is created, it should be started by calling start()
  * method. The backend will process frontends till stop() method is called.
  *
+ * The running frontend handlers can be retrieved by getFrontendHandlers() in
+ * order to tune them, setConnectCallback() allows tuning the handlers on
+ * each connect (see TuningConfig).
+ *
+ * If the Xen store connection is lost, it is restored by XenStore. Then the
+ * frontends model is resynced with the Xen store: handlers of new frontends
+ * are added and handlers of removed ones are deleted. The recovery time is
+ * returned by getXenStoreStats().
+ *
  * @snippet ExampleBackend.cpp main
  *
  * @ingroup backend
@@ -123,6 +134,23 @@ public:
 	 */
 	domid_t getDomId() const { return mDomId; }
 
+	/**
+	 * Returns currently added frontend handlers
+	 */
+	std::vector<FrontendHandlerPtr> getFrontendHandlers() const;
+
+	/**
+	 * Sets connect callback to the current and all further frontend
+	 * handlers.
+	 * @param[in] callback connect callback
+	 */
+	void setConnectCallback(FrontendHandlerBase::ConnectCallback callback);
+
+	/**
+	 * Returns Xen store connection recovery statistics
+	 */
+	XenStoreStats getXenStoreStats() const { return mXenStore.getStats(); }
+
 protected:
 
 	XenStore mXenStore;
@@ -150,6 +178,8 @@ private:
 	std::string mFrontendsPath;
 	std::list<domid_t> mDomainList;
 	std::list<FrontendHandlerPtr> mFrontendHandlers;
+	FrontendHandlerBase::ConnectCallback mConnectCallback;
+	mutable std::mutex mHandlersMutex;
 
 	Log mLog;
 
@@ -158,6 +188,7 @@ private:
 	void frontendPathChanged(const std::string& path, domid_t domId,
 							 uint16_t devId);
 	FrontendHandlerPtr getFrontendHandler(domid_t domId, uint16_t devId);
+	void onReconnect();
 	void onError(const std::exception& e);
 };
 
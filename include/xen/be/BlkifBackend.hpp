@@ -0,0 +1,365 @@
+/*
+ *  Xen block device backend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef XENBE_BLKIFBACKEND_HPP_
+#define XENBE_BLKIFBACKEND_HPP_
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+extern "C" {
+#include <xenctrl.h>
+#include <xen/io/blkif.h>
+}
+
+#include "BackendBase.hpp"
+#include "Exception.hpp"
+#include "FrontendHandlerBase.hpp"
+#include "IoRing.hpp"
+#include "Log.hpp"
+#include "RingBufferBase.hpp"
+#include "XenGnttab.hpp"
+
+namespace XenBackend {
+
+/***************************************************************************//**
+ * @defgroup blkif Block device backend
+ * Ready to use blkif backend built on the library primitives.
+ ******************************************************************************/
+
+/***************************************************************************//**
+ * Exception generated by blkif backend.
+ * @ingroup blkif
+ ******************************************************************************/
+class BlkifException : public Exception
+{
+	using Exception::Exception;
+};
+
+/***************************************************************************//**
+ * Blkif backend configuration.
+ * @ingroup blkif
+ ******************************************************************************/
+struct BlkifConfig
+{
+	/**
+	 * Max number of queues (rings) per frontend
+	 */
+	unsigned int maxQueues = 4;
+
+	/**
+	 * Max ring page order (ring size is 2^order pages)
+	 */
+	unsigned int maxRingPageOrder = 4;
+
+	/**
+	 * Max number of segments in an indirect request
+	 */
+	unsigned int maxIndirectSegments = 256;
+
+	/**
+	 * Enables persistent grants
+	 */
+	bool persistentGrants = true;
+
+	/**
+	 * Max number of persistently mapped grants per queue
+	 */
+	unsigned int maxPersistentGrants = 1056;
+
+	/**
+	 * Max number of I/O operations in flight per queue
+	 */
+	unsigned int ioDepth = 128;
+};
+
+/***************************************************************************//**
+ * Blkif queue statistics.
+ * @ingroup blkif
+ ******************************************************************************/
+struct BlkifStats
+{
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t flushes;
+	uint64_t discards;
+	uint64_t errors;
+	uint64_t readSectors;
+	uint64_t writtenSectors;
+	uint64_t persistentHits;
+	uint64_t persistentMaps;
+	uint64_t responses;
+	uint64_t responseBatches;
+};
+
+/***************************************************************************//**
+ * Block device image (file or block device) served by the blkif backend.
+ * @ingroup blkif
+ ******************************************************************************/
+class BlkifImage
+{
+public:
+
+	/**
+	 * @param[in] path     path to the file or block device
+	 * @param[in] readOnly opens the image in read only mode
+	 */
+	BlkifImage(const std::string& path, bool readOnly);
+	BlkifImage(const BlkifImage&) = delete;
+	BlkifImage& operator=(BlkifImage const&) = delete;
+	~BlkifImage();
+
+	/**
+	 * Returns image file descriptor
+	 */
+	int getFd() const { return mFd; }
+
+	/**
+	 * Returns image size in 512 bytes sectors
+	 */
+	uint64_t getSectors() const { return mSectors; }
+
+	/**
+	 * Returns <i>true</i> if the image is read only
+	 */
+	bool isReadOnly() const { return mReadOnly; }
+
+	/**
+	 * Returns physical sector size
+	 */
+	unsigned int getPhysicalSectorSize() const { return mPhysSectorSize; }
+
+	/**
+	 * Returns <i>true</i> if discard (punching holes) is supported
+	 */
+	bool isDiscardSupported() const { return mDiscardSupported; }
+
+private:
+
+	int mFd;
+	uint64_t mSectors;
+	bool mReadOnly;
+	unsigned int mPhysSectorSize;
+	bool mDiscardSupported;
+	Log mLog;
+
+	void init(const std::string& path);
+	void release();
+};
+
+typedef std::shared_ptr<BlkifImage> BlkifImagePtr;
+
+/***************************************************************************//**
+ * Blkif ring buffer (one queue).
+ *
+ * Requests are mapped and passed to IoRing as vectored I/O directly on the
+ * mapped grant pages. All I/O queued while handling one ring notification is
+ * submitted with one system call. Responses of all completions reaped
+ * together are pushed to the frontend with at most one notification.
+ *
+ * If persistent grants are negotiated, data pages stay mapped till the
+ * frontend is disconnected (up to BlkifConfig::maxPersistentGrants pages).
+ * The pages are accounted in GrantBudget: under pressure the least recently
+ * used pages not referenced by the requests in flight are unmapped.
+ * @ingroup blkif
+ ******************************************************************************/
+class BlkifRingBuffer : public RingBufferInBase<blkif_back_ring, blkif_sring,
+												blkif_request, blkif_response>
+{
+public:
+
+	/**
+	 * @param[in] domId            frontend domain id
+	 * @param[in] devId            frontend device id
+	 * @param[in] port             event channel port number
+	 * @param[in] refs             ring grant references
+	 * @param[in] image            block device image
+	 * @param[in] config           backend configuration
+	 * @param[in] persistentGrants <i>true</i> if persistent grants are
+	 *                             negotiated
+	 */
+	BlkifRingBuffer(domid_t domId, uint16_t devId, evtchn_port_t port,
+					const GrantRefs& refs,
+					BlkifImagePtr image, const BlkifConfig& config,
+					bool persistentGrants);
+	~BlkifRingBuffer();
+
+	/**
+	 * Returns queue statistics
+	 */
+	BlkifStats getStats() const;
+
+private:
+
+	static const unsigned int cSectorShift = 9;
+	static const unsigned int cSectorsPerPage = XC_PAGE_SIZE >> cSectorShift;
+	static const unsigned int cSegmentsPerIndirectPage =
+		XC_PAGE_SIZE / sizeof(blkif_request_segment);
+
+	struct Request
+	{
+		uint64_t id;
+		uint8_t operation;
+		uint64_t sectors;
+		std::vector<iovec> iov;
+		std::unique_ptr<XenGnttabBuffer> buffer;
+		std::vector<grant_ref_t> persistentRefs;
+	};
+
+	struct PersistentPage
+	{
+		std::unique_ptr<XenGnttabBuffer> buffer;
+		std::list<grant_ref_t>::iterator lru;
+		unsigned int users;
+	};
+
+	typedef std::unique_ptr<Request> RequestPtr;
+
+	domid_t mDomId;
+	BlkifImagePtr mImage;
+	BlkifConfig mConfig;
+	bool mPersistentGrants;
+
+	GrantAccount mGrantAccount;
+
+	std::mutex mPersistentMutex;
+	std::unordered_map<grant_ref_t, PersistentPage> mPersistentPages;
+	// most recently used first
+	std::list<grant_ref_t> mPersistentLru;
+
+	std::mutex mResponseMutex;
+	bool mResponsesQueued;
+
+	mutable std::mutex mStatsMutex;
+	BlkifStats mStats;
+
+	IoRing mIoRing;
+
+	Log mLog;
+
+	void processRequest(const blkif_request& req) override;
+	void onRequestsProcessed() override;
+
+	void processReadWrite(uint8_t operation, uint64_t id, uint64_t sector,
+						  const blkif_request_segment* segs, size_t numSegs);
+	void processIndirect(const blkif_request& req);
+	void processDiscard(const blkif_request& req);
+	void processFlush(const blkif_request& req);
+
+	void mapSegments(Request& request, const blkif_request_segment* segs,
+					 size_t numSegs);
+	uint8_t* getPersistentPage(grant_ref_t ref);
+	void releasePersistentPages(Request& request);
+	size_t evictPersistentPages(size_t numPages);
+
+	void onComplete(Request* request, int result);
+	void sendStatus(uint64_t id, uint8_t operation, int16_t status);
+	void flushResponses();
+};
+
+typedef std::shared_ptr<BlkifRingBuffer> BlkifRingBufferPtr;
+
+/***************************************************************************//**
+ * Blkif frontend handler.
+ *
+ * Advertises backend features, negotiates multi-page rings, multiple queues,
+ * persistent grants and indirect descriptors with the frontend and serves
+ * the image specified by the backend <i>params</i> entry.
+ * @ingroup blkif
+ ******************************************************************************/
+class BlkifFrontendHandler : public FrontendHandlerBase
+{
+public:
+
+	/**
+	 * @param[in] devName device name
+	 * @param[in] beDomId backend domain id
+	 * @param[in] feDomId frontend domain id
+	 * @param[in] devId   device id
+	 * @param[in] config  backend configuration
+	 */
+	BlkifFrontendHandler(const std::string& devName, domid_t beDomId,
+						 domid_t feDomId, uint16_t devId,
+						 const BlkifConfig& config = BlkifConfig());
+	~BlkifFrontendHandler();
+
+	/**
+	 * Returns statistics of all queues
+	 */
+	std::vector<BlkifStats> getStats();
+
+protected:
+
+	void onBind() override;
+	void onClosing() override;
+
+private:
+
+	BlkifConfig mConfig;
+	BlkifImagePtr mImage;
+	std::vector<BlkifRingBufferPtr> mQueues;
+	std::mutex mQueuesMutex;
+
+	Log mLog;
+
+	void writeFeatures();
+	void writeImageInfo();
+	GrantRefs readRingRefs(const std::string& path, unsigned int order);
+};
+
+/***************************************************************************//**
+ * Blkif backend.
+ *
+ * Creates BlkifFrontendHandler for each new vbd frontend.
+ *
+ * @code
+ * BlkifBackend backend;
+ *
+ * backend.start();
+ * @endcode
+ * @ingroup blkif
+ ******************************************************************************/
+class BlkifBackend : public BackendBase
+{
+public:
+
+	/**
+	 * @param[in] name    optional backend name
+	 * @param[in] config  backend configuration
+	 * @param[in] devName device name
+	 */
+	BlkifBackend(const std::string& name = "BlkifBackend",
+				 const BlkifConfig& config = BlkifConfig(),
+				 const std::string& devName = "vbd");
+
+private:
+
+	BlkifConfig mConfig;
+
+	void onNewFrontend(domid_t domId, uint16_t devId) override;
+};
+
+}
+
+#endif /* XENBE_BLKIFBACKEND_HPP_ */
@@ -0,0 +1,290 @@
+/*
+ *  Xen console backend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef XENBE_CONSOLEBACKEND_HPP_
+#define XENBE_CONSOLEBACKEND_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/uio.h>
+
+extern "C" {
+#include <xenctrl.h>
+#include <xen/io/console.h>
+}
+
+#include "BackendBase.hpp"
+#include "Exception.hpp"
+#include "FrontendHandlerBase.hpp"
+#include "Log.hpp"
+#include "RingBufferBase.hpp"
+#include "Utils.hpp"
+
+namespace XenBackend {
+
+/***************************************************************************//**
+ * @defgroup console Console backend
+ * Ready to use console backend: guest output is written to a log file and
+ * a pty, pty input is passed to the guest.
+ ******************************************************************************/
+
+/***************************************************************************//**
+ * Exception generated by console backend.
+ * @ingroup console
+ ******************************************************************************/
+class ConsoleException : public Exception
+{
+	using Exception::Exception;
+};
+
+/***************************************************************************//**
+ * Console backend configuration.
+ * @ingroup console
+ ******************************************************************************/
+struct ConsoleConfig
+{
+	/**
+	 * Directory for guest output logs, no log if empty
+	 */
+	std::string logDir;
+
+	/**
+	 * Creates pty for the console, its name is written to the backend
+	 * <i>tty</i> entry
+	 */
+	bool pty = true;
+
+	/**
+	 * Time to wait after the guest notification before the output is
+	 * handled. The guest usually notifies on each write, the delay lets
+	 * it put more lines into the ring, so they are handled by one write.
+	 */
+	std::chrono::microseconds coalesceDelay = std::chrono::microseconds(500);
+};
+
+/***************************************************************************//**
+ * Console ring statistics.
+ * @ingroup console
+ ******************************************************************************/
+struct ConsoleStats
+{
+	uint64_t events;
+	uint64_t outBytes;
+	uint64_t inBytes;
+	uint64_t writes;
+	uint64_t notifications;
+};
+
+/***************************************************************************//**
+ * Console byte ring.
+ *
+ * Handles the xencons_interface layout: the guest writes to the out array
+ * and the backend writes to the in array. The ring content is accessed as
+ * iovec spans, so the data goes to and from host fds with single readv()
+ * and writev() calls even if it wraps around.
+ *
+ * The guest output is written to all added outputs when the guest
+ * notifies. The guest is notified once per batch when input is produced or
+ * output is consumed, as xenconsoled does.
+ * @ingroup console
+ ******************************************************************************/
+class ConsoleRing : public RingBufferBase
+{
+public:
+
+	/**
+	 * @param[in] domId  frontend domain id
+	 * @param[in] port   event channel port number
+	 * @param[in] ref    console interface grant reference
+	 * @param[in] config backend configuration
+	 */
+	ConsoleRing(domid_t domId, evtchn_port_t port, grant_ref_t ref,
+				const ConsoleConfig& config = ConsoleConfig());
+	~ConsoleRing();
+
+	/**
+	 * Adds output fd, should be called before start()
+	 */
+	void addOutput(int fd);
+
+	/**
+	 * Starts the thread which passes data from the fd to the guest
+	 */
+	void setInput(int fd);
+
+	/**
+	 * Returns spans of the guest output which is not consumed yet
+	 * @param[out] iov   spans
+	 * @param[out] count number of spans
+	 * @return size of the output
+	 */
+	size_t getOutSpans(iovec* iov, int& count);
+	void consumeOut(size_t size);
+
+	/**
+	 * Returns spans of the free space of the in ring
+	 * @param[out] iov   spans
+	 * @param[out] count number of spans
+	 * @return size of the free space
+	 */
+	size_t getInSpans(iovec* iov, int& count);
+	void produceIn(size_t size);
+
+	/**
+	 * Copies the data to the in ring
+	 * @return number of copied bytes
+	 */
+	size_t writeIn(const void* data, size_t size);
+
+	/**
+	 * Reads the fd directly to the in ring
+	 * @return number of read bytes
+	 */
+	size_t readIn(int fd);
+
+	/**
+	 * Sends the notification if the ring indexes are moved since the last
+	 * flush
+	 */
+	void flush();
+
+	/**
+	 * Returns ring statistics
+	 */
+	ConsoleStats getStats() const;
+
+private:
+
+	ConsoleConfig mConfig;
+	xencons_interface* mIntf;
+	std::vector<int> mOutputs;
+	std::atomic_bool mNotifyPending;
+
+	int mInput;
+	std::mutex mInMutex;
+	std::condition_variable mInCondVar;
+	bool mTerminate;
+	std::unique_ptr<PollFd> mInputPoll;
+	std::thread mInputThread;
+
+	std::atomic<uint64_t> mEvents;
+	std::atomic<uint64_t> mOutBytes;
+	std::atomic<uint64_t> mInBytes;
+	std::atomic<uint64_t> mWrites;
+	std::atomic<uint64_t> mNotifications;
+
+	void onReceiveIndication() override;
+
+	void drainOut();
+	void writeOutput(int fd, iovec* iov, int count, size_t size);
+	void inputThread();
+	size_t getInFree();
+};
+
+typedef std::shared_ptr<ConsoleRing> ConsoleRingPtr;
+
+/***************************************************************************//**
+ * Console frontend handler.
+ * @ingroup console
+ ******************************************************************************/
+class ConsoleFrontendHandler : public FrontendHandlerBase
+{
+public:
+
+	/**
+	 * @param[in] devName device name
+	 * @param[in] beDomId backend domain id
+	 * @param[in] feDomId frontend domain id
+	 * @param[in] devId   device id
+	 * @param[in] config  backend configuration
+	 */
+	ConsoleFrontendHandler(const std::string& devName, domid_t beDomId,
+						   domid_t feDomId, uint16_t devId,
+						   const ConsoleConfig& config = ConsoleConfig());
+	~ConsoleFrontendHandler();
+
+	/**
+	 * Returns ring statistics
+	 */
+	ConsoleStats getStats();
+
+protected:
+
+	void onBind() override;
+	void onClosing() override;
+
+private:
+
+	ConsoleConfig mConfig;
+	ConsoleRingPtr mRing;
+	std::mutex mRingMutex;
+	int mLogFd;
+	int mPtyMaster;
+	int mPtySlave;
+
+	Log mLog;
+
+	void openLog();
+	void openPty();
+	void closeFds();
+};
+
+/***************************************************************************//**
+ * Console backend.
+ *
+ * Creates ConsoleFrontendHandler for each new console frontend.
+ *
+ * @code
+ * ConsoleBackend backend;
+ *
+ * backend.start();
+ * @endcode
+ * @ingroup console
+ ******************************************************************************/
+class ConsoleBackend : public BackendBase
+{
+public:
+
+	/**
+	 * @param[in] name    optional backend name
+	 * @param[in] config  backend configuration
+	 * @param[in] devName device name
+	 */
+	ConsoleBackend(const std::string& name = "ConsoleBackend",
+				   const ConsoleConfig& config = ConsoleConfig(),
+				   const std::string& devName = "console");
+
+private:
+
+	ConsoleConfig mConfig;
+
+	void onNewFrontend(domid_t domId, uint16_t devId) override;
+};
+
+}
+
+#endif /* XENBE_CONSOLEBACKEND_HPP_ */
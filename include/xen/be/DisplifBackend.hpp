@@ -0,0 +1,491 @@
+/*
+ *  Xen displif backend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef XENBE_DISPLIFBACKEND_HPP_
+#define XENBE_DISPLIFBACKEND_HPP_
+
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <xenctrl.h>
+#include <xen/io/displif.h>
+}
+
+#include "BackendBase.hpp"
+#include "Exception.hpp"
+#include "FrontendHandlerBase.hpp"
+#include "Log.hpp"
+#include "RingBufferBase.hpp"
+#include "XenGnttab.hpp"
+
+namespace XenBackend {
+
+/***************************************************************************//**
+ * @defgroup displif Display backend
+ * Ready to use displif backend built on the library primitives.
+ ******************************************************************************/
+
+/***************************************************************************//**
+ * Exception generated by displif backend.
+ * @ingroup displif
+ ******************************************************************************/
+class DisplifException : public Exception
+{
+	using Exception::Exception;
+};
+
+/***************************************************************************//**
+ * Displif backend configuration.
+ * @ingroup displif
+ ******************************************************************************/
+struct DisplifConfig
+{
+	/**
+	 * Exports display buffers as dma-bufs if the sink supports them
+	 */
+	bool dmaBuf = true;
+
+	/**
+	 * Tile size used to find damaged regions when the frame is copied
+	 */
+	unsigned int tileWidth = 64;
+	unsigned int tileHeight = 16;
+};
+
+/***************************************************************************//**
+ * Displif statistics.
+ * @ingroup displif
+ ******************************************************************************/
+struct DisplifStats
+{
+	uint64_t flips;
+	uint64_t dmaBufFlips;
+	uint64_t dirtyRects;
+	uint64_t copiedBytes;
+	uint64_t flipEvents;
+	uint64_t eventBatches;
+};
+
+/***************************************************************************//**
+ * Rectangle in pixels.
+ * @ingroup displif
+ ******************************************************************************/
+struct DisplifRect
+{
+	uint32_t x;
+	uint32_t y;
+	uint32_t width;
+	uint32_t height;
+};
+
+/***************************************************************************//**
+ * Displayed part of the framebuffer.
+ * @ingroup displif
+ ******************************************************************************/
+struct DisplifFrame
+{
+	/**
+	 * First pixel of the frame, nullptr if the buffer is not mapped
+	 */
+	const uint8_t* data;
+
+	/**
+	 * Offset of the first pixel in the dma-buf
+	 */
+	size_t offset;
+
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t bpp;
+	uint32_t pixelFormat;
+};
+
+/***************************************************************************//**
+ * Finds damaged regions of the frame.
+ *
+ * The frame is split into tiles, the hash of each tile is compared with the
+ * hash of the previous frame. Adjacent damaged tiles are merged into
+ * rectangles. The first frame and the frame of different size are damaged
+ * completely.
+ * @ingroup displif
+ ******************************************************************************/
+class DisplifDamage
+{
+public:
+
+	/**
+	 * @param[in] tileWidth  tile width in pixels
+	 * @param[in] tileHeight tile height in pixels
+	 */
+	DisplifDamage(unsigned int tileWidth = 64, unsigned int tileHeight = 16);
+
+	/**
+	 * Returns damaged rectangles of the frame and remembers it
+	 */
+	std::vector<DisplifRect> update(const DisplifFrame& frame);
+
+	/**
+	 * Makes the next frame completely damaged
+	 */
+	void reset();
+
+private:
+
+	unsigned int mTileWidth;
+	unsigned int mTileHeight;
+
+	uint32_t mWidth;
+	uint32_t mHeight;
+	uint32_t mBpp;
+	bool mFull;
+	std::vector<uint64_t> mHashes;
+
+	uint64_t hashTile(const DisplifFrame& frame, uint32_t x, uint32_t y,
+					  uint32_t width, uint32_t height);
+	void addRect(std::vector<DisplifRect>& rects, const DisplifRect& rect);
+};
+
+/***************************************************************************//**
+ * Output of the displayed frames.
+ *
+ * The methods are called from the ring thread of the connector, so they may
+ * be called concurrently for different connectors.
+ * @ingroup displif
+ ******************************************************************************/
+class DisplifSink
+{
+public:
+
+	virtual ~DisplifSink() {}
+
+	/**
+	 * Returns true if the sink scans out dma-bufs. In this case display
+	 * buffers are exported as dma-bufs and presentDmaBuf() is called on page
+	 * flip. Buffers which can't be exported are copied with update().
+	 */
+	virtual bool supportsDmaBuf() const { return false; }
+
+	/**
+	 * Presents the frame from the dma-buf without copy
+	 * @param[in] connector connector index
+	 * @param[in] fd        dma-buf fd, valid till the buffer is destroyed
+	 * @param[in] frame     frame, data is nullptr
+	 */
+	virtual void presentDmaBuf(unsigned int connector, int fd,
+							   const DisplifFrame& frame) {}
+
+	/**
+	 * Copies damaged rectangles of the frame
+	 * @param[in] connector connector index
+	 * @param[in] frame     mapped frame
+	 * @param[in] rects     damaged rectangles, not empty
+	 */
+	virtual void update(unsigned int connector, const DisplifFrame& frame,
+						const std::vector<DisplifRect>& rects) = 0;
+
+	/**
+	 * Is called when the connector is disabled
+	 */
+	virtual void disable(unsigned int connector) {}
+};
+
+typedef std::shared_ptr<DisplifSink> DisplifSinkPtr;
+
+/***************************************************************************//**
+ * Software sink. Keeps the frame of each connector in memory and copies
+ * damaged rectangles only. Can be used without GPU, e.g. to serve the
+ * frames over network.
+ * @ingroup displif
+ ******************************************************************************/
+class DisplifSoftwareSink : public DisplifSink
+{
+public:
+
+	void update(unsigned int connector, const DisplifFrame& frame,
+				const std::vector<DisplifRect>& rects) override;
+	void disable(unsigned int connector) override;
+
+	/**
+	 * Returns the copy of the connector frame, rows are packed
+	 * @param[in]  connector connector index
+	 * @param[out] width     frame width
+	 * @param[out] height    frame height
+	 * @return frame data, empty if the connector is disabled
+	 */
+	std::vector<uint8_t> getFrame(unsigned int connector, uint32_t& width,
+								  uint32_t& height);
+
+	/**
+	 * Returns number of copied bytes
+	 */
+	uint64_t getCopiedBytes();
+
+private:
+
+	struct Frame
+	{
+		uint32_t width;
+		uint32_t height;
+		uint32_t bpp;
+		std::vector<uint8_t> data;
+	};
+
+	std::mutex mMutex;
+	std::map<unsigned int, Frame> mFrames;
+	uint64_t mCopiedBytes = 0;
+};
+
+/***************************************************************************//**
+ * Event ring buffer of the displif connector.
+ * @ingroup displif
+ ******************************************************************************/
+typedef RingBufferOutBase<xendispl_event_page, xendispl_evt>
+	DisplifEventRingBuffer;
+
+typedef std::shared_ptr<DisplifEventRingBuffer> DisplifEventRingBufferPtr;
+
+/***************************************************************************//**
+ * Displif connector.
+ *
+ * Display buffers are mapped (or exported as dma-bufs) once when created.
+ * On page flip the dma-buf is passed to the sink or the damaged rectangles
+ * are copied. Page flip events are queued and sent together after the
+ * batch of requests is handled.
+ * @ingroup displif
+ ******************************************************************************/
+class DisplifConnector
+{
+public:
+
+	/**
+	 * @param[in] domId  frontend domain id
+	 * @param[in] index  connector index
+	 * @param[in] width  connector width
+	 * @param[in] height connector height
+	 * @param[in] sink   sink
+	 * @param[in] config backend configuration
+	 */
+	DisplifConnector(domid_t domId, unsigned int index, uint32_t width,
+					 uint32_t height, DisplifSinkPtr sink,
+					 const DisplifConfig& config);
+	~DisplifConnector();
+
+	/**
+	 * Sets the event ring buffer used to send page flip events
+	 */
+	void setEventRing(DisplifEventRingBufferPtr eventRing);
+
+	/**
+	 * Handles the request
+	 * @param[in]  req request
+	 * @param[out] rsp response, the status is set by this method
+	 */
+	void processRequest(const xendispl_req& req, xendispl_resp& rsp);
+
+	/**
+	 * Sends queued page flip events with one notification
+	 */
+	void flushEvents();
+
+	/**
+	 * Returns statistics
+	 */
+	DisplifStats getStats();
+
+private:
+
+	static const size_t cGrefsPerDirPage =
+		(XC_PAGE_SIZE - offsetof(xendispl_page_directory, gref)) /
+		sizeof(grant_ref_t);
+
+	struct Buffer
+	{
+		uint32_t width;
+		uint32_t height;
+		uint32_t bpp;
+		uint32_t stride;
+		size_t offset;
+		std::unique_ptr<XenGnttabBuffer> mapped;
+		std::unique_ptr<XenGnttabDmaBufferExporter> exported;
+	};
+
+	typedef std::shared_ptr<Buffer> BufferPtr;
+
+	struct Framebuffer
+	{
+		BufferPtr buffer;
+		uint32_t width;
+		uint32_t height;
+		uint32_t pixelFormat;
+	};
+
+	domid_t mDomId;
+	unsigned int mIndex;
+	uint32_t mWidth;
+	uint32_t mHeight;
+	DisplifSinkPtr mSink;
+	DisplifConfig mConfig;
+	DisplifEventRingBufferPtr mEventRing;
+
+	std::map<uint64_t, BufferPtr> mBuffers;
+	std::map<uint64_t, Framebuffer> mFramebuffers;
+
+	uint64_t mFbCookie;
+	DisplifRect mMode;
+	DisplifDamage mDamage;
+
+	uint16_t mEventId;
+	size_t mQueuedEvents;
+	DisplifStats mStats;
+
+	std::mutex mMutex;
+	Log mLog;
+
+	int createBuffer(const xendispl_dbuf_create_req& req);
+	int destroyBuffer(const xendispl_dbuf_destroy_req& req);
+	int attachFramebuffer(const xendispl_fb_attach_req& req);
+	int detachFramebuffer(const xendispl_fb_detach_req& req);
+	int setConfig(const xendispl_set_config_req& req);
+	int pageFlip(const xendispl_page_flip_req& req);
+
+	GrantRefs readDirectory(grant_ref_t dirRef, size_t numPages);
+	void present(const Framebuffer& fb);
+	void disable();
+};
+
+typedef std::shared_ptr<DisplifConnector> DisplifConnectorPtr;
+
+/***************************************************************************//**
+ * Displif request ring buffer of the connector.
+ * @ingroup displif
+ ******************************************************************************/
+class DisplifRingBuffer : public RingBufferInBase<xen_displif_back_ring,
+												  xen_displif_sring,
+												  xendispl_req, xendispl_resp>
+{
+public:
+
+	/**
+	 * @param[in] domId     frontend domain id
+	 * @param[in] port      event channel port number
+	 * @param[in] ref       ring grant reference
+	 * @param[in] connector connector the requests are passed to
+	 */
+	DisplifRingBuffer(domid_t domId, evtchn_port_t port, grant_ref_t ref,
+					  DisplifConnectorPtr connector);
+
+private:
+
+	DisplifConnectorPtr mConnector;
+
+	void processRequest(const xendispl_req& req) override;
+	void onRequestsProcessed() override;
+};
+
+/***************************************************************************//**
+ * Displif frontend handler.
+ *
+ * Reads the connectors of the frontend and connects their rings.
+ * @ingroup displif
+ ******************************************************************************/
+class DisplifFrontendHandler : public FrontendHandlerBase
+{
+public:
+
+	/**
+	 * @param[in] devName device name
+	 * @param[in] beDomId backend domain id
+	 * @param[in] feDomId frontend domain id
+	 * @param[in] devId   device id
+	 * @param[in] config  backend configuration
+	 */
+	DisplifFrontendHandler(const std::string& devName, domid_t beDomId,
+						   domid_t feDomId, uint16_t devId,
+						   const DisplifConfig& config = DisplifConfig());
+	~DisplifFrontendHandler();
+
+	/**
+	 * Returns statistics of all connectors
+	 */
+	DisplifStats getStats();
+
+protected:
+
+	void onBind() override;
+	void onClosing() override;
+
+	/**
+	 * Creates the sink, may be overridden to provide custom output
+	 */
+	virtual DisplifSinkPtr createSink();
+
+private:
+
+	DisplifConfig mConfig;
+	DisplifSinkPtr mSink;
+	std::vector<DisplifConnectorPtr> mConnectors;
+	std::mutex mConnectorsMutex;
+
+	Log mLog;
+
+	void createConnector(unsigned int index, const std::string& path);
+};
+
+/***************************************************************************//**
+ * Displif backend.
+ *
+ * Creates DisplifFrontendHandler for each new vdispl frontend.
+ *
+ * @code
+ * DisplifBackend backend;
+ *
+ * backend.start();
+ * @endcode
+ * @ingroup displif
+ ******************************************************************************/
+class DisplifBackend : public BackendBase
+{
+public:
+
+	/**
+	 * @param[in] name    optional backend name
+	 * @param[in] config  backend configuration
+	 * @param[in] devName device name
+	 */
+	DisplifBackend(const std::string& name = "DisplifBackend",
+				   const DisplifConfig& config = DisplifConfig(),
+				   const std::string& devName = "vdispl");
+
+private:
+
+	DisplifConfig mConfig;
+
+	void onNewFrontend(domid_t domId, uint16_t devId) override;
+};
+
+}
+
+#endif /* XENBE_DISPLIFBACKEND_HPP_ */
@@ -21,6 +21,8 @@
 #ifndef XENBE_FRONTENDHANDLERBASE_HPP_
 #define XENBE_FRONTENDHANDLERBASE_HPP_
 
+#include <chrono>
+#include <functional>
 #include <list>
 #include <memory>
 #include <mutex>
@@ -32,7 +34,10 @@ extern "C" {
 #include <xen/io/xenbus.h>
 }
 
+#include "Arena.hpp"
 #include "RingBufferBase.hpp"
+#include "RingPoller.hpp"
+#include "RingScheduler.hpp"
 #include "XenEvtchn.hpp"
 #include "Exception.hpp"
 #include "XenStore.hpp"
@@ -52,6 +57,69 @@ class FrontendHandlerException : public Exception
 class BackendBase;
 class XenStore;
 
+/***************************************************************************//**
+ * Connect latency breakdown of the frontend handler.
+ *
+ * Each field keeps the duration of the last connect phase:
+ * InitWait -> Initialised -> onBind() -> Connected.
+ * @ingroup backend
+ ******************************************************************************/
+struct ConnectStats
+{
+	/**
+	 * Backend InitWait till the frontend is initialized. It is zero if the
+	 * frontend is initialized before the backend goes to InitWait.
+	 */
+	std::chrono::microseconds initWait;
+
+	/**
+	 * Frontend initialized till onBind() is done.
+	 */
+	std::chrono::microseconds bind;
+
+	/**
+	 * onBind() is done till the backend Connected state is written.
+	 */
+	std::chrono::microseconds connect;
+
+	/**
+	 * Sum of all phases.
+	 */
+	std::chrono::microseconds total;
+
+	/**
+	 * Number of completed connects.
+	 */
+	uint32_t numConnects;
+};
+
+/***************************************************************************//**
+ * Statistics of one queue created by FrontendHandlerBase::addQueues().
+ * @ingroup backend
+ ******************************************************************************/
+struct QueueStats
+{
+	/**
+	 * Queue index
+	 */
+	unsigned int index;
+
+	/**
+	 * Core the queue is processed on, negative if not bound
+	 */
+	int cpu;
+
+	/**
+	 * Event channel port
+	 */
+	evtchn_port_t port;
+
+	/**
+	 * Number of received notifications
+	 */
+	uint64_t events;
+};
+
 /***************************************************************************//**
  * Handles the connected frontend.
  *
@@ -84,6 +152,11 @@ class XenStore;
  * addRingBuffer() method in order to allow the frontend handler to monitor
  * their states.
  *
+ * Each state change event costs one Xen store read: the existence check is
+ * combined with the read and the backend state entry existence is cached, so
+ * setBackendState() issues only the write. The connect latency is split into
+ * phases and can be retrieved by getConnectStats().
+ *
  * If the client desires to change the default state machine behavior, it may
  * override some of onState...() methods. These methods are called when the
  * frontend goes to appropriate state:
@@ -114,11 +187,42 @@ class XenStore;
  *
  * @snippet ExampleBackend.cpp onBind
  *
+ * Multi-queue protocols (blkif, netif) may use addQueues() instead: it reads
+ * "multi-queue-num-queues" and calls the factory for each "queue-N" frontend
+ * subdirectory (or for the frontend directory itself when there is one
+ * queue). If the cores are set with setQueueCpus(), each queue is processed
+ * on its own core, otherwise the queues run on any core.
+ *
+ * If pollers are set with setPollers(), pollable ring buffers added after
+ * that are serviced by the least loaded poller instead of their event
+ * channel threads. The pollers may be shared between frontend handlers.
+ *
+ * If a scheduler is set with setScheduler(), pollable ring buffers are
+ * serviced by its workers in the earliest deadline first order of the given
+ * latency class instead. The scheduler takes precedence over the pollers.
+ *
+ * The connect callback set by setConnectCallback() is called after onBind()
+ * on each connect. It may tune the just created ring buffers returned by
+ * getRingBuffers() before the frontend is notified.
+ *
+ * If the arena is enabled with setArenaChunkSize(), each connect gets its own
+ * Arena and the objects created by makeShared() in onBind() are allocated from
+ * it. The handler drops the arena on close, its chunks are freed at once when
+ * the last object allocated from it is destroyed. It keeps the connection
+ * objects of frontends which come and go out of the long living heap.
+ *
  * @ingroup backend
  ******************************************************************************/
 class FrontendHandlerBase
 {
 public:
+
+	/**
+	 * Callback which is called when the frontend is bound, before the
+	 * backend goes to the connected state
+	 */
+	typedef std::function<void(FrontendHandlerBase&)> ConnectCallback;
+
 	/**
 	 * @param[in] name                optional frontend name
 	 * @param[in] devName             device name
@@ -162,6 +266,79 @@ public:
 	 */
 	xenbus_state getBackendState() const { return mBackendState; }
 
+	/**
+	 * Returns connect latency breakdown of the last connect.
+	 */
+	ConnectStats getConnectStats() const;
+
+	/**
+	 * Sets cores to bind the queues to: queue N is processed on
+	 * cpus[N % cpus.size()]. The running queues are rebound immediately.
+	 * @param[in] cpus core numbers, empty list means any core
+	 */
+	void setQueueCpus(const std::vector<int>& cpus);
+
+	/**
+	 * Returns statistics of the queues created by addQueues().
+	 */
+	std::vector<QueueStats> getQueueStats() const;
+
+	/**
+	 * Sets pollers to service the ring buffers. Takes effect on the next
+	 * connect.
+	 * @param[in] pollers pollers, empty list means the event mode
+	 */
+	void setPollers(const std::vector<RingPollerPtr>& pollers);
+
+	/**
+	 * Returns pollers set by setPollers()
+	 */
+	std::vector<RingPollerPtr> getPollers() const;
+
+	/**
+	 * Sets scheduler to service the ring buffers. Takes effect on the next
+	 * connect.
+	 * @param[in] scheduler    scheduler, nullptr means the event mode
+	 * @param[in] latencyClass latency class of the frontend, returned by
+	 * RingScheduler::addClass()
+	 */
+	void setScheduler(RingSchedulerPtr scheduler, int latencyClass = 0);
+
+	/**
+	 * Returns scheduler set by setScheduler()
+	 */
+	RingSchedulerPtr getScheduler() const;
+
+	/**
+	 * Returns latency class set by setScheduler()
+	 */
+	int getLatencyClass() const;
+
+	/**
+	 * Returns ring buffers of the current connection in the order they are
+	 * added.
+	 */
+	std::vector<RingBufferPtr> getRingBuffers() const;
+
+	/**
+	 * Sets callback called on each connect.
+	 * @param[in] callback connect callback
+	 */
+	void setConnectCallback(ConnectCallback callback);
+
+	/**
+	 * Sets chunk size of the per connection arena. Takes effect on the next
+	 * connect.
+	 * @param[in] chunkSize chunk size, 0 disables the arena
+	 */
+	void setArenaChunkSize(size_t chunkSize);
+
+	/**
+	 * Returns statistics of the arena of the current connection, zero if
+	 * there is no arena.
+	 */
+	ArenaStats getArenaStats() const;
+
 	/**
 	 * Starts frontend handling
 	 */
@@ -195,6 +372,47 @@ protected:
 	 */
 	void addRingBuffer(RingBufferPtr ringBuffer);
 
+	/**
+	 * Creates the connection object from the connection arena if it is
+	 * enabled, otherwise from the heap. Should be called from onBind().
+	 * @param[in] args object constructor arguments
+	 */
+	template<typename T, typename... Args>
+	std::shared_ptr<T> makeShared(Args&&... args)
+	{
+		if (mArena)
+		{
+			return std::allocate_shared<T>(ArenaAllocator<T>(mArena),
+										   std::forward<Args>(args)...);
+		}
+
+		// plain new keeps the class specific operator new if there is one
+		return std::shared_ptr<T>(new T(std::forward<Args>(args)...));
+	}
+
+	/**
+	 * Creates the ring buffer of one queue
+	 * @param[in] index queue index
+	 * @param[in] path  frontend xen store path of the queue
+	 */
+	typedef std::function<RingBufferPtr(unsigned int index,
+										const std::string& path)> QueueFactory;
+
+	/**
+	 * Advertises the max number of queues to the frontend.
+	 * @param[in] maxQueues max number of queues
+	 */
+	void writeMaxQueues(unsigned int maxQueues);
+
+	/**
+	 * Creates the queues requested by the frontend, binds each of them to
+	 * a core and adds them as ring buffers. Should be called from onBind().
+	 * @param[in] maxQueues max number of queues
+	 * @param[in] factory   creates the ring buffer of the queue
+	 * @return number of created queues
+	 */
+	unsigned int addQueues(unsigned int maxQueues, QueueFactory factory);
+
 	/**
 	 * Sets backend state.
 	 * @param[in] state new state to set
@@ -249,6 +467,7 @@ protected:
 private:
 
 	typedef void(FrontendHandlerBase::*StateFn)();
+	typedef std::chrono::steady_clock::time_point TimePoint;
 
 	domid_t mBeDomId;
 	domid_t mFeDomId;
@@ -259,6 +478,7 @@ private:
 
 	xenbus_state mBackendState;
 	xenbus_state mFrontendState;
+	bool mBeStateExists;
 
 	XenStore mXenStore;
 
@@ -266,18 +486,36 @@ private:
 	std::string mXsFrontendPath;
 
 	std::vector<RingBufferPtr> mRingBuffers;
+	std::vector<RingBufferPtr> mQueues;
+	std::vector<int> mQueueCpus;
+	std::vector<RingPollerPtr> mPollers;
+	std::vector<std::pair<RingPollerPtr, RingBufferPtr>> mPolledRings;
+	RingSchedulerPtr mScheduler;
+	int mLatencyClass;
+	std::vector<std::pair<RingSchedulerPtr, RingBufferPtr>> mScheduledRings;
+	ConnectCallback mConnectCallback;
+	size_t mArenaChunkSize;
+	ArenaPtr mArena;
 
 	std::mutex mMutex;
 
+	TimePoint mInitWaitTime;
+	TimePoint mFeInitializedTime;
+	ConnectStats mConnectStats;
+	mutable std::mutex mStatsMutex;
+
 	AsyncContext mAsyncContext;
 
 	Log mLog;
 
+	int getQueueCpu(unsigned int index);
 	void initXenStorePathes();
 	void init();
 	void release();
+	void connect();
 	void frontendStateChanged();
 	void backendStateChanged();
+	void onReconnect();
 	void onFrontendStateChanged(xenbus_state state);
 	void onBackendStateChanged(xenbus_state state);
 	void onError(const std::exception& e);
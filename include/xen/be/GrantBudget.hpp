@@ -0,0 +1,296 @@
+/*
+ *  Mapped grant pages budget
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef XENBE_GRANTBUDGET_HPP_
+#define XENBE_GRANTBUDGET_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <vector>
+
+extern "C" {
+#include <xenctrl.h>
+}
+
+#include "Log.hpp"
+
+namespace XenBackend {
+
+/***************************************************************************//**
+ * Limits of mapped grant pages, 0 means unlimited.
+ * @ingroup xen
+ ******************************************************************************/
+struct GrantLimits
+{
+	/**
+	 * Max number of pages mapped by the process
+	 */
+	size_t maxPages = 0;
+
+	/**
+	 * Max number of pages mapped from one domain
+	 */
+	size_t maxDomainPages = 0;
+
+	/**
+	 * Max number of pages mapped through the accounts of one frontend
+	 */
+	size_t maxFrontendPages = 0;
+};
+
+/***************************************************************************//**
+ * Mapped grant pages usage.
+ * @ingroup xen
+ ******************************************************************************/
+struct GrantUsage
+{
+	/**
+	 * Number of mapped pages
+	 */
+	size_t pages;
+
+	/**
+	 * Max number of pages mapped at the same time
+	 */
+	size_t peakPages;
+
+	/**
+	 * Number of pages unmapped by the cache eviction
+	 */
+	uint64_t evictedPages;
+
+	/**
+	 * Number of mappings refused because of the limits
+	 */
+	uint64_t rejections;
+};
+
+/***************************************************************************//**
+ * Accounts the grant pages mapped by one owner, usually a cache of
+ * persistent mappings, on behalf of a frontend.
+ *
+ * Pages are accounted by passing the account to XenGnttabBuffer. The owner
+ * which keeps mappings cached may set the evict callback: under pressure the
+ * budget calls it for the coldest accounts, the ones touched least recently.
+ * The callback should unmap not used pages and return their number.
+ *
+ * The callback is called from the thread which maps the pages. It may be the
+ * thread mapping through the same account, which can hold the owner locks
+ * at this time. So the callback must not block: it should try to take the
+ * locks it needs and return 0 if they are busy, then the budget goes on with
+ * the next account.
+ *
+ * The account should outlive the buffers accounted to it.
+ * @ingroup xen
+ ******************************************************************************/
+class GrantAccount
+{
+public:
+
+	/**
+	 * Evicts cached pages
+	 * @param[in] numPages number of pages to evict
+	 * @return number of evicted pages
+	 */
+	typedef std::function<size_t(size_t numPages)> EvictCallback;
+
+	/**
+	 * @param[in] domId frontend domain id
+	 * @param[in] devId frontend device id
+	 */
+	GrantAccount(domid_t domId, uint16_t devId);
+	GrantAccount(const GrantAccount&) = delete;
+	GrantAccount& operator=(GrantAccount const&) = delete;
+	~GrantAccount();
+
+	/**
+	 * Sets the evict callback. nullptr waits for the running eviction.
+	 * The callback must not block, see the class description.
+	 * @param[in] evictCallback evict callback
+	 */
+	void setEvictCallback(EvictCallback evictCallback);
+
+	/**
+	 * Marks the cached pages as used.
+	 */
+	void touch()
+	{
+		mLastUse = std::chrono::steady_clock::now().time_since_epoch().count();
+	}
+
+	/**
+	 * Returns frontend domain id
+	 */
+	domid_t getDomId() const { return mDomId; }
+
+	/**
+	 * Returns frontend device id
+	 */
+	uint16_t getDevId() const { return mDevId; }
+
+	/**
+	 * Returns number of pages mapped through the account
+	 */
+	size_t getPages() const { return mPages; }
+
+private:
+
+	friend class GrantBudget;
+
+	domid_t mDomId;
+	uint16_t mDevId;
+	std::atomic<size_t> mPages;
+	std::atomic<int64_t> mLastUse;
+
+	std::mutex mEvictMutex;
+	EvictCallback mEvictCallback;
+};
+
+/***************************************************************************//**
+ * Process wide budget of mapped grant pages.
+ *
+ * gntdev limits the number of grant pages mapped by the process. The budget
+ * accounts each page mapped by XenGnttabBuffer per domain and, if the buffer
+ * is mapped through GrantAccount, per frontend. When a mapping would exceed
+ * a limit, cached pages of the coldest accounts in the limit scope are evicted
+ * first. If it doesn't free enough pages, the mapping fails with
+ * XenGnttabException (ENOMEM) at the budget check instead of failing in
+ * gntdev.
+ *
+ * While no limit is set, the pages are not accounted and mapping doesn't take
+ * the budget lock. So the limits and the usage cover only the pages mapped
+ * after the limits are set. The usage of a domain or a frontend is dropped
+ * when all its accounted pages are unmapped.
+ *
+ * @code
+ * GrantLimits limits;
+ *
+ * limits.maxPages = 65536;
+ * limits.maxFrontendPages = 8192;
+ *
+ * GrantBudget::getInstance().setLimits(limits);
+ * @endcode
+ * @ingroup xen
+ ******************************************************************************/
+class GrantBudget
+{
+public:
+
+	/**
+	 * Returns the process budget
+	 */
+	static GrantBudget& getInstance();
+
+	/**
+	 * Sets limits. Already mapped pages are not evicted. The pages mapped
+	 * while no limit was set are not accounted.
+	 * @param[in] limits limits
+	 */
+	void setLimits(const GrantLimits& limits);
+
+	/**
+	 * Returns limits
+	 */
+	GrantLimits getLimits() const;
+
+	/**
+	 * Returns usage of the process
+	 */
+	GrantUsage getUsage() const;
+
+	/**
+	 * Returns usage of the domain
+	 * @param[in] domId domain id
+	 */
+	GrantUsage getDomainUsage(domid_t domId) const;
+
+	/**
+	 * Returns usage of the frontend accounts
+	 * @param[in] domId frontend domain id
+	 * @param[in] devId frontend device id
+	 */
+	GrantUsage getFrontendUsage(domid_t domId, uint16_t devId) const;
+
+private:
+
+	friend class GrantAccount;
+	friend class XenGnttabBuffer;
+
+	static const int cMaxEvictPasses = 2;
+
+	enum class Scope
+	{
+		FRONTEND,
+		DOMAIN,
+		PROCESS
+	};
+
+	GrantBudget();
+	GrantBudget(const GrantBudget&) = delete;
+	GrantBudget& operator=(GrantBudget const&) = delete;
+
+	struct Usage
+	{
+		size_t pages = 0;
+		size_t peakPages = 0;
+		uint64_t evictedPages = 0;
+		uint64_t rejections = 0;
+
+		void add(size_t count);
+		GrantUsage get() const;
+	};
+
+	std::atomic_bool mLimited;
+
+	mutable std::mutex mMutex;
+	GrantLimits mLimits;
+	Usage mUsage;
+	std::map<domid_t, Usage> mDomains;
+	std::map<uint32_t, Usage> mFrontends;
+	std::vector<GrantAccount*> mAccounts;
+
+	Log mLog;
+
+	static uint32_t getFrontendKey(domid_t domId, uint16_t devId)
+	{
+		return (static_cast<uint32_t>(domId) << 16) | devId;
+	}
+
+	bool acquire(domid_t domId, GrantAccount* account, size_t count,
+				 bool& accounted);
+	void release(domid_t domId, GrantAccount* account, size_t count,
+				 bool accounted);
+	void addAccount(GrantAccount* account);
+	void removeAccount(GrantAccount* account);
+	size_t getExcess(domid_t domId, GrantAccount* account, size_t count,
+					 Scope& scope);
+	bool isInScope(GrantAccount* candidate, domid_t domId,
+				   GrantAccount* account, Scope scope) const;
+	size_t evict(domid_t domId, GrantAccount* account, Scope scope,
+				 size_t numPages);
+	void reject(domid_t domId, GrantAccount* account);
+};
+
+}
+
+#endif /* XENBE_GRANTBUDGET_HPP_ */
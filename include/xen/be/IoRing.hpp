@@ -0,0 +1,225 @@
+/*
+ *  Asynchronous file I/O ring
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef XENBE_IORING_HPP_
+#define XENBE_IORING_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "Exception.hpp"
+#include "Log.hpp"
+#include "Utils.hpp"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace XenBackend {
+
+/***************************************************************************//**
+ * Exception generated by IoRing.
+ * @ingroup backend
+ ******************************************************************************/
+class IoRingException : public Exception
+{
+	using Exception::Exception;
+};
+
+/***************************************************************************//**
+ * Asynchronous file I/O based on Linux io_uring.
+ *
+ * Operations are queued by readv(), writev(), fsync() and discard() and
+ * passed to the kernel in one system call by submit(). Completions are reaped
+ * in a separate thread: the completion callback of each operation is called
+ * with the operation result (number of bytes or negative errno) and then the
+ * batch callback is called once for all completions reaped together. It allows
+ * the client to batch its own notifications.
+ *
+ * If io_uring is not supported by the kernel, the operations are performed
+ * synchronously on submit() in the caller context.
+ *
+ * @code
+ * IoRing ioRing(128, [] { flushResponses(); });
+ *
+ * ioRing.start();
+ *
+ * ioRing.readv(fd, iov, iovcnt, offset, [] (int result) { ... });
+ * ioRing.submit();
+ * @endcode
+ * @ingroup backend
+ ******************************************************************************/
+class IoRing
+{
+public:
+
+	/**
+	 * Callback which is called when the operation is completed
+	 */
+	typedef std::function<void(int result)> Callback;
+
+	/**
+	 * Callback which is called after a batch of completions is handled
+	 */
+	typedef std::function<void()> BatchCallback;
+
+	/**
+	 * @param[in] depth         max number of operations in flight
+	 * @param[in] batchCallback callback called after a batch of completions
+	 * @param[in] errorCallback callback called on completion thread error
+	 */
+	explicit IoRing(unsigned int depth = 128,
+					BatchCallback batchCallback = nullptr,
+					ErrorCallback errorCallback = nullptr);
+	IoRing(const IoRing&) = delete;
+	IoRing& operator=(IoRing const&) = delete;
+	~IoRing();
+
+	/**
+	 * Starts completion handling
+	 */
+	void start();
+
+	/**
+	 * Waits for operations in flight and stops completion handling
+	 */
+	void stop();
+
+	/**
+	 * Queues vectored read
+	 * @param[in] fd       file descriptor
+	 * @param[in] iov      io vectors, should be valid till completion
+	 * @param[in] iovcnt   number of io vectors
+	 * @param[in] offset   file offset
+	 * @param[in] callback completion callback
+	 */
+	void readv(int fd, const iovec* iov, int iovcnt, off_t offset,
+			   Callback callback);
+
+	/**
+	 * Queues vectored write
+	 * @param[in] fd       file descriptor
+	 * @param[in] iov      io vectors, should be valid till completion
+	 * @param[in] iovcnt   number of io vectors
+	 * @param[in] offset   file offset
+	 * @param[in] callback completion callback
+	 */
+	void writev(int fd, const iovec* iov, int iovcnt, off_t offset,
+				Callback callback);
+
+	/**
+	 * Queues file sync
+	 * @param[in] fd       file descriptor
+	 * @param[in] callback completion callback
+	 */
+	void fsync(int fd, Callback callback);
+
+	/**
+	 * Queues discarding (punching hole) of the file range
+	 * @param[in] fd       file descriptor
+	 * @param[in] offset   file offset
+	 * @param[in] length   range length
+	 * @param[in] callback completion callback
+	 */
+	void discard(int fd, off_t offset, off_t length, Callback callback);
+
+	/**
+	 * Passes all queued operations to the kernel
+	 */
+	void submit();
+
+	/**
+	 * Returns <i>true</i> if operations are performed asynchronously
+	 */
+	bool isAsync() const { return mFd >= 0; }
+
+	/**
+	 * Returns number of operations in flight
+	 */
+	unsigned int getInFlight() const { return mInFlight; }
+
+private:
+
+	struct Operation
+	{
+		uint8_t opcode;
+		int fd;
+		const iovec* iov;
+		int iovcnt;
+		off_t offset;
+		off_t length;
+		Callback callback;
+	};
+
+	unsigned int mDepth;
+	BatchCallback mBatchCallback;
+	ErrorCallback mErrorCallback;
+	Log mLog;
+
+	int mFd;
+	int mEventFd;
+
+	void* mSqPtr;
+	size_t mSqSize;
+	void* mCqPtr;
+	size_t mCqSize;
+	io_uring_sqe* mSqes;
+	size_t mSqesSize;
+
+	unsigned* mSqHead;
+	unsigned* mSqTail;
+	unsigned* mSqMask;
+	unsigned* mSqArray;
+	unsigned* mCqHead;
+	unsigned* mCqTail;
+	unsigned* mCqMask;
+	io_uring_cqe* mCqes;
+
+	unsigned int mNumQueued;
+	std::atomic_uint mInFlight;
+	std::vector<Callback> mCallbacks;
+	std::vector<unsigned int> mFreeSlots;
+	std::vector<Operation> mSyncOperations;
+
+	std::atomic_bool mStarted;
+	std::mutex mMutex;
+	std::condition_variable mCondVar;
+	std::thread mThread;
+	std::unique_ptr<PollFd> mPollFd;
+
+	void init();
+	void release();
+	void queue(Operation&& operation);
+	void submitSync();
+	int performSync(const Operation& operation);
+	void reapCompletions();
+	void completionThread();
+};
+
+}
+
+#endif /* XENBE_IORING_HPP_ */
@@ -232,6 +232,8 @@ public:
 		std::vector<std::pair<std::string,
 							  LogLevel>>& logMaskItems = getLogMaskItems();
 
+		logMaskItems.clear();
+
 		for(auto item : items)
 		{
 			size_t sepPos = 0;
@@ -0,0 +1,595 @@
+/*
+ *  Xen network device backend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef XENBE_NETIFBACKEND_HPP_
+#define XENBE_NETIFBACKEND_HPP_
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <xenctrl.h>
+#include <xen/io/netif.h>
+}
+
+#include "BackendBase.hpp"
+#include "Exception.hpp"
+#include "FrontendHandlerBase.hpp"
+#include "Log.hpp"
+#include "RingBufferBase.hpp"
+#include "Utils.hpp"
+#include "XenGnttab.hpp"
+
+namespace XenBackend {
+
+/***************************************************************************//**
+ * @defgroup netif Network device backend
+ * Ready to use netif backend built on the library primitives.
+ ******************************************************************************/
+
+/***************************************************************************//**
+ * Exception generated by netif backend.
+ * @ingroup netif
+ ******************************************************************************/
+class NetifException : public Exception
+{
+	using Exception::Exception;
+};
+
+/***************************************************************************//**
+ * Netif backend configuration.
+ * @ingroup netif
+ ******************************************************************************/
+struct NetifConfig
+{
+	/**
+	 * Host side data path
+	 */
+	enum DeviceType
+	{
+		TAP,
+		PACKET_SOCKET
+	};
+
+	/**
+	 * Max number of queues (ring pairs) per frontend
+	 */
+	unsigned int maxQueues = 4;
+
+	/**
+	 * Host side data path type
+	 */
+	DeviceType deviceType = TAP;
+
+	/**
+	 * Interface name. For TAP the default is vif<domid>.<devid>, for
+	 * PACKET_SOCKET it is the existing interface (veth, bridge port etc.)
+	 * to attach to.
+	 */
+	std::string ifName;
+
+	/**
+	 * Max number of packets read from the device in one batch
+	 */
+	unsigned int rxBatch = 64;
+
+	/**
+	 * Max number of packets taken from the tx ring before they are copied
+	 * and sent to the device
+	 */
+	unsigned int txBatch = 64;
+
+	/**
+	 * Enables checksum and segmentation offload
+	 */
+	bool offload = true;
+};
+
+/***************************************************************************//**
+ * Netif queue statistics.
+ * @ingroup netif
+ ******************************************************************************/
+struct NetifStats
+{
+	uint64_t txPackets;
+	uint64_t txBytes;
+	uint64_t txErrors;
+	uint64_t rxPackets;
+	uint64_t rxBytes;
+	uint64_t rxDropped;
+	uint64_t grantCopies;
+	uint64_t copyBatches;
+};
+
+/***************************************************************************//**
+ * Virtio net header (legacy layout) used by TAP and packet sockets for
+ * checksum and segmentation offload. Defined here as linux/virtio_net.h
+ * can't be compiled as C++.
+ * @ingroup netif
+ ******************************************************************************/
+struct NetifVnetHdr
+{
+	static const uint8_t cFlagNeedsCsum = 1;
+	static const uint8_t cFlagDataValid = 2;
+
+	static const uint8_t cGsoNone = 0;
+	static const uint8_t cGsoTcpV4 = 1;
+	static const uint8_t cGsoUdp = 3;
+	static const uint8_t cGsoTcpV6 = 4;
+
+	uint8_t flags;
+	uint8_t gsoType;
+	uint16_t hdrLen;
+	uint16_t gsoSize;
+	uint16_t csumStart;
+	uint16_t csumOffset;
+};
+
+/***************************************************************************//**
+ * Packet passed between netif queues and the host device.
+ * @ingroup netif
+ ******************************************************************************/
+struct NetifPacket
+{
+	NetifVnetHdr hdr;
+	uint8_t* data;
+	size_t size;
+};
+
+/***************************************************************************//**
+ * Result of parsing packet headers.
+ * @ingroup netif
+ ******************************************************************************/
+struct NetifFlowInfo
+{
+	/**
+	 * Offset of the L3 header
+	 */
+	size_t l3Offset;
+
+	/**
+	 * Offset of the L4 header
+	 */
+	size_t l4Offset;
+
+	/**
+	 * L4 header length (0 if L4 header is not parsed)
+	 */
+	size_t l4Length;
+
+	/**
+	 * Ethernet protocol of the L3 header
+	 */
+	uint16_t l3Proto;
+
+	/**
+	 * IP protocol of the L4 header
+	 */
+	uint8_t l4Proto;
+
+	/**
+	 * Flow hash
+	 */
+	uint32_t hash;
+};
+
+/***************************************************************************//**
+ * Packet header parser.
+ * Extracts L3/L4 headers location and calculates the hash of the flow
+ * (addresses, protocol and ports). The hash is used to select the queue for
+ * the packet so packets of one flow are never reordered.
+ * @ingroup netif
+ ******************************************************************************/
+class NetifFlow
+{
+public:
+
+	/**
+	 * Parses Ethernet, IPv4/IPv6 and TCP/UDP headers
+	 * @param[in]  data packet data
+	 * @param[in]  size packet size
+	 * @param[out] info parse result
+	 * @return <i>false</i> if the packet is not IP or is truncated
+	 */
+	static bool parse(const uint8_t* data, size_t size, NetifFlowInfo& info);
+
+	/**
+	 * Returns flow hash of the packet (0 for not IP packets)
+	 * @param[in] data packet data
+	 * @param[in] size packet size
+	 */
+	static uint32_t getHash(const uint8_t* data, size_t size);
+};
+
+/***************************************************************************//**
+ * Host side device of the netif backend.
+ * Received packets are passed to the callback in batches from the device
+ * thread. send() may be called from any thread.
+ * @ingroup netif
+ ******************************************************************************/
+class NetifDevice
+{
+public:
+
+	/**
+	 * Callback which is called when packets are received from the device
+	 */
+	typedef std::function<void(const NetifPacket* packets, size_t count)>
+		ReceiveCallback;
+
+	virtual ~NetifDevice() {}
+
+	/**
+	 * Starts receiving packets
+	 * @param[in] callback receive callback
+	 */
+	virtual void start(ReceiveCallback callback) = 0;
+
+	/**
+	 * Stops receiving packets. The callback is not called after this
+	 * method returns.
+	 */
+	virtual void stop() = 0;
+
+	/**
+	 * Sends packets to the device
+	 * @param[in] packets packets
+	 * @param[in] count   number of packets
+	 * @return number of packets sent
+	 */
+	virtual size_t send(const NetifPacket* packets, size_t count) = 0;
+
+	/**
+	 * Sets offloads the frontend is able to receive
+	 * @param[in] csum partial checksum
+	 * @param[in] tso4 TCP over IPv4 segmentation
+	 * @param[in] tso6 TCP over IPv6 segmentation
+	 */
+	virtual void setOffload(bool csum, bool tso4, bool tso6) {}
+};
+
+typedef std::shared_ptr<NetifDevice> NetifDevicePtr;
+
+/***************************************************************************//**
+ * Base class of file descriptor based devices.
+ * Packets are prefixed by virtio net header. The receive thread reads all
+ * available packets (up to the batch size) before calling the callback.
+ * @ingroup netif
+ ******************************************************************************/
+class NetifFdDevice : public NetifDevice
+{
+public:
+
+	/**
+	 * Max packet size (GSO packets included)
+	 */
+	static const size_t cMaxPacketSize = 65536 + 64;
+
+	/**
+	 * @param[in] name  device name for logging
+	 * @param[in] batch max number of packets received at once
+	 */
+	NetifFdDevice(const std::string& name, unsigned int batch);
+	~NetifFdDevice();
+
+	void start(ReceiveCallback callback) override;
+	void stop() override;
+	size_t send(const NetifPacket* packets, size_t count) override;
+
+protected:
+
+	/**
+	 * Device file descriptor, should be opened by the derived class in
+	 * non blocking mode
+	 */
+	int mFd;
+
+	/**
+	 * Reads one packet
+	 * @return number of bytes read, 0 if the packet should be skipped or
+	 * negative value if there are no more packets
+	 */
+	virtual ssize_t receive(iovec* iov, int count);
+
+	Log mLog;
+
+private:
+
+	unsigned int mBatch;
+	std::vector<NetifPacket> mPackets;
+	std::vector<uint8_t> mBuffer;
+	ReceiveCallback mCallback;
+	std::unique_ptr<PollFd> mPollFd;
+	std::thread mThread;
+
+	void run();
+};
+
+/***************************************************************************//**
+ * TAP device data path.
+ * Creates the TAP interface with virtio net header, brings it up and
+ * configures offloads negotiated with the frontend.
+ * @ingroup netif
+ ******************************************************************************/
+class NetifTapDevice : public NetifFdDevice
+{
+public:
+
+	/**
+	 * @param[in] ifName interface name
+	 * @param[in] batch  max number of packets received at once
+	 */
+	NetifTapDevice(const std::string& ifName, unsigned int batch);
+	~NetifTapDevice();
+
+	void setOffload(bool csum, bool tso4, bool tso6) override;
+
+private:
+
+	std::string mIfName;
+
+	void init();
+	void release();
+};
+
+/***************************************************************************//**
+ * AF_PACKET socket data path.
+ * Attaches to the existing interface (for example, one end of veth pair).
+ * @ingroup netif
+ ******************************************************************************/
+class NetifPacketSocketDevice : public NetifFdDevice
+{
+public:
+
+	/**
+	 * @param[in] ifName interface name
+	 * @param[in] batch  max number of packets received at once
+	 */
+	NetifPacketSocketDevice(const std::string& ifName, unsigned int batch);
+	~NetifPacketSocketDevice();
+
+protected:
+
+	ssize_t receive(iovec* iov, int count) override;
+
+private:
+
+	std::string mIfName;
+
+	void init();
+	void release();
+};
+
+/***************************************************************************//**
+ * Netif queue: tx and rx ring pair with shared event channel.
+ *
+ * The tx ring is handled by the ring buffer thread. Packets are copied from
+ * the frontend pages with one batched grant copy per ring notification (or
+ * per NetifConfig::txBatch packets), sent to the device and completed with
+ * one response push.
+ *
+ * Packets received from the device are delivered by deliver() to the
+ * frontend rx buffers with one batched grant copy and one notification per
+ * device batch. Packets which do not fit into posted rx buffers are dropped.
+ * @ingroup netif
+ ******************************************************************************/
+class NetifQueue : public RingBufferInBase<netif_tx_back_ring, netif_tx_sring,
+										   netif_tx_request, netif_tx_response>
+{
+public:
+
+	/**
+	 * Offloads negotiated with the frontend
+	 */
+	struct Features
+	{
+		bool sg = false;
+		bool gso4 = false;
+		bool gso6 = false;
+		bool csum = true;
+	};
+
+	/**
+	 * @param[in] domId    frontend domain id
+	 * @param[in] port     event channel port number
+	 * @param[in] txRef    tx ring grant reference
+	 * @param[in] rxRef    rx ring grant reference
+	 * @param[in] device   host device
+	 * @param[in] features frontend features
+	 * @param[in] config   backend configuration
+	 */
+	NetifQueue(domid_t domId, evtchn_port_t port, grant_ref_t txRef,
+			   grant_ref_t rxRef, NetifDevicePtr device,
+			   const Features& features, const NetifConfig& config);
+	~NetifQueue();
+
+	/**
+	 * Delivers packets received from the device to the frontend
+	 * @param[in] packets packets
+	 * @param[in] count   number of packets
+	 */
+	void deliver(const NetifPacket* const* packets, size_t count);
+
+	/**
+	 * Returns queue statistics
+	 */
+	NetifStats getStats() const;
+
+private:
+
+	static const size_t cMaxTxSlots = XEN_NETIF_NR_SLOTS_MIN;
+
+	struct TxPacket
+	{
+		NetifPacket packet;
+		std::vector<uint8_t> buffer;
+		std::vector<netif_tx_request> slots;
+		size_t numExtras;
+		size_t firstCopy;
+		size_t numCopies;
+		uint8_t gsoType;
+		uint16_t gsoSize;
+		bool valid;
+	};
+
+	struct RxSlot
+	{
+		netif_rx_response rsp;
+		size_t copy;
+		bool extra;
+		netif_extra_info info;
+	};
+
+	domid_t mDomId;
+	NetifDevicePtr mDevice;
+	Features mFeatures;
+	NetifConfig mConfig;
+
+	std::vector<TxPacket> mTxPackets;
+	size_t mNumTxPackets;
+	unsigned int mPendingExtras;
+	bool mTxInProgress;
+	XenGnttabCopy mTxCopy;
+	std::vector<NetifPacket> mTxSend;
+
+	XenGnttabBuffer mRxBuffer;
+	netif_rx_back_ring mRxRing;
+	std::mutex mRxMutex;
+	XenGnttabCopy mRxCopy;
+	std::vector<RxSlot> mRxSlots;
+
+	mutable std::mutex mStatsMutex;
+	NetifStats mStats;
+
+	Log mLog;
+
+	void processRequest(const netif_tx_request& req) override;
+	void onRequestsProcessed() override;
+
+	void startPacket(const netif_tx_request& req);
+	void processExtra(const netif_extra_info& extra);
+	void completePacket();
+	bool setupTxHeader(TxPacket& packet);
+	void flushTx();
+
+	RING_IDX queueRx(const NetifPacket& packet, RING_IDX available);
+	uint16_t getRxFlags(const NetifPacket& packet);
+};
+
+typedef std::shared_ptr<NetifQueue> NetifQueuePtr;
+
+/***************************************************************************//**
+ * Netif frontend handler.
+ *
+ * Advertises backend features, negotiates queues and offloads with the
+ * frontend and connects the queues to the host device. Packets from the
+ * device are spread over the queues by the flow hash.
+ * @ingroup netif
+ ******************************************************************************/
+class NetifFrontendHandler : public FrontendHandlerBase
+{
+public:
+
+	/**
+	 * @param[in] devName device name
+	 * @param[in] beDomId backend domain id
+	 * @param[in] feDomId frontend domain id
+	 * @param[in] devId   device id
+	 * @param[in] config  backend configuration
+	 */
+	NetifFrontendHandler(const std::string& devName, domid_t beDomId,
+						 domid_t feDomId, uint16_t devId,
+						 const NetifConfig& config = NetifConfig());
+	~NetifFrontendHandler();
+
+	/**
+	 * Returns statistics of all queues
+	 */
+	std::vector<NetifStats> getStats();
+
+protected:
+
+	void onBind() override;
+	void onClosing() override;
+
+	/**
+	 * Creates host device, may be overridden to provide custom data path
+	 */
+	virtual NetifDevicePtr createDevice();
+
+	/**
+	 * Returns backend configuration
+	 */
+	const NetifConfig& getConfig() const { return mConfig; }
+
+private:
+
+	NetifConfig mConfig;
+	NetifDevicePtr mDevice;
+	std::vector<NetifQueuePtr> mQueues;
+	std::mutex mQueuesMutex;
+	std::vector<std::vector<const NetifPacket*>> mDispatch;
+
+	Log mLog;
+
+	void writeFeatures();
+	NetifQueue::Features readFeatures();
+	void onDeviceReceive(const NetifPacket* packets, size_t count);
+};
+
+/***************************************************************************//**
+ * Netif backend.
+ *
+ * Creates NetifFrontendHandler for each new vif frontend.
+ *
+ * @code
+ * NetifBackend backend;
+ *
+ * backend.start();
+ * @endcode
+ * @ingroup netif
+ ******************************************************************************/
+class NetifBackend : public BackendBase
+{
+public:
+
+	/**
+	 * @param[in] name    optional backend name
+	 * @param[in] config  backend configuration
+	 * @param[in] devName device name
+	 */
+	NetifBackend(const std::string& name = "NetifBackend",
+				 const NetifConfig& config = NetifConfig(),
+				 const std::string& devName = "vif");
+
+private:
+
+	NetifConfig mConfig;
+
+	void onNewFrontend(domid_t domId, uint16_t devId) override;
+};
+
+}
+
+#endif /* XENBE_NETIFBACKEND_HPP_ */
@@ -0,0 +1,631 @@
+/*
+ *  Xen 9pfs backend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef XENBE_P9FSBACKEND_HPP_
+#define XENBE_P9FSBACKEND_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/uio.h>
+
+extern "C" {
+#include <xenctrl.h>
+#include <xen/io/9pfs.h>
+}
+
+#include "BackendBase.hpp"
+#include "Exception.hpp"
+#include "FrontendHandlerBase.hpp"
+#include "Log.hpp"
+#include "RingBufferBase.hpp"
+#include "Utils.hpp"
+#include "XenGnttab.hpp"
+
+namespace XenBackend {
+
+/***************************************************************************//**
+ * @defgroup p9fs 9pfs backend
+ * Ready to use 9pfs (9P2000.L over Xen 9pfs transport) backend built on the
+ * library primitives.
+ ******************************************************************************/
+
+/***************************************************************************//**
+ * Exception generated by 9pfs backend. The error code is returned to the
+ * frontend in Rlerror.
+ * @ingroup p9fs
+ ******************************************************************************/
+class P9fsException : public Exception
+{
+	using Exception::Exception;
+};
+
+/***************************************************************************//**
+ * 9pfs backend configuration.
+ * @ingroup p9fs
+ ******************************************************************************/
+struct P9fsConfig
+{
+	/**
+	 * Max number of rings per frontend
+	 */
+	unsigned int maxRings = 2;
+
+	/**
+	 * Max ring page order
+	 */
+	unsigned int maxRingPageOrder = 9;
+
+	/**
+	 * Number of worker threads per ring
+	 */
+	unsigned int workers = 4;
+
+	/**
+	 * Max number of cached path lookups
+	 */
+	size_t lookupCacheSize = 4096;
+
+	/**
+	 * Time a cached path lookup is valid. The host may change the exported
+	 * directory behind the backend, so entries are not kept forever.
+	 */
+	std::chrono::milliseconds lookupCacheTtl = std::chrono::milliseconds(1000);
+};
+
+/***************************************************************************//**
+ * 9pfs ring statistics.
+ * @ingroup p9fs
+ ******************************************************************************/
+struct P9fsStats
+{
+	uint64_t requests;
+	uint64_t errors;
+	uint64_t reads;
+	uint64_t readBytes;
+	uint64_t writes;
+	uint64_t writtenBytes;
+	uint64_t zeroCopyReads;
+	uint64_t maxInFlight;
+};
+
+/***************************************************************************//**
+ * 9P message types (9P2000.L subset).
+ * @ingroup p9fs
+ ******************************************************************************/
+enum P9fsType : uint8_t
+{
+	P9_RLERROR = 7,
+	P9_TSTATFS = 8,
+	P9_RSTATFS,
+	P9_TLOPEN = 12,
+	P9_RLOPEN,
+	P9_TLCREATE = 14,
+	P9_RLCREATE,
+	P9_TGETATTR = 24,
+	P9_RGETATTR,
+	P9_TSETATTR = 26,
+	P9_RSETATTR,
+	P9_TREADDIR = 40,
+	P9_RREADDIR,
+	P9_TFSYNC = 50,
+	P9_RFSYNC,
+	P9_TMKDIR = 72,
+	P9_RMKDIR,
+	P9_TRENAMEAT = 74,
+	P9_RRENAMEAT,
+	P9_TUNLINKAT = 76,
+	P9_RUNLINKAT,
+	P9_TVERSION = 100,
+	P9_RVERSION,
+	P9_TATTACH = 104,
+	P9_RATTACH,
+	P9_TFLUSH = 108,
+	P9_RFLUSH,
+	P9_TWALK = 110,
+	P9_RWALK,
+	P9_TREAD = 116,
+	P9_RREAD,
+	P9_TWRITE = 118,
+	P9_RWRITE,
+	P9_TCLUNK = 120,
+	P9_RCLUNK,
+	P9_TREMOVE = 122,
+	P9_RREMOVE
+};
+
+/***************************************************************************//**
+ * 9P unique file id.
+ * @ingroup p9fs
+ ******************************************************************************/
+struct P9fsQid
+{
+	static const uint8_t cTypeDir = 0x80;
+	static const uint8_t cTypeSymlink = 0x02;
+	static const uint8_t cTypeFile = 0x00;
+
+	uint8_t type;
+	uint32_t version;
+	uint64_t path;
+};
+
+/***************************************************************************//**
+ * 9P message decoder. Throws P9fsException if the message is truncated.
+ * @ingroup p9fs
+ ******************************************************************************/
+class P9fsReader
+{
+public:
+
+	/**
+	 * @param[in] data message data
+	 * @param[in] size message size
+	 */
+	P9fsReader(const uint8_t* data, size_t size) :
+		mData(data), mSize(size), mPos(0) {}
+
+	uint8_t readU8();
+	uint16_t readU16();
+	uint32_t readU32();
+	uint64_t readU64();
+	std::string readString();
+	P9fsQid readQid();
+
+	/**
+	 * Returns number of not read bytes
+	 */
+	size_t getRemaining() const { return mSize - mPos; }
+
+private:
+
+	const uint8_t* mData;
+	size_t mSize;
+	size_t mPos;
+
+	const uint8_t* get(size_t size);
+};
+
+/***************************************************************************//**
+ * 9P message encoder.
+ * @ingroup p9fs
+ ******************************************************************************/
+class P9fsWriter
+{
+public:
+
+	/**
+	 * Size of the message header: size[4] type[1] tag[2]
+	 */
+	static const size_t cHeaderSize = 7;
+
+	/**
+	 * @param[out] buffer buffer the message is appended to
+	 */
+	explicit P9fsWriter(std::vector<uint8_t>& buffer) : mBuffer(buffer) {}
+
+	/**
+	 * Starts the message, the size is set by end()
+	 */
+	void begin(uint8_t type, uint16_t tag);
+	void end();
+
+	void writeU8(uint8_t value);
+	void writeU16(uint16_t value);
+	void writeU32(uint32_t value);
+	void writeU64(uint64_t value);
+	void writeString(const std::string& value);
+	void writeQid(const P9fsQid& qid);
+	void writeData(const void* data, size_t size);
+
+	/**
+	 * Returns current message size
+	 */
+	size_t size() const { return mBuffer.size(); }
+
+	/**
+	 * Writes the value at the given position (used to patch counters)
+	 */
+	void setU32(size_t pos, uint32_t value);
+
+	/**
+	 * Encodes header into the given memory
+	 */
+	static void encodeHeader(uint8_t* dst, uint32_t size, uint8_t type,
+							 uint16_t tag);
+
+private:
+
+	std::vector<uint8_t>& mBuffer;
+};
+
+/***************************************************************************//**
+ * Cache of path lookups.
+ *
+ * Keeps qids of walked paths so a repeated walk doesn't stat each path
+ * component. Entries expire after P9fsConfig::lookupCacheTtl and are
+ * dropped by the operations which remove or rename files.
+ * @ingroup p9fs
+ ******************************************************************************/
+class P9fsLookupCache
+{
+public:
+
+	/**
+	 * @param[in] maxSize max number of entries
+	 * @param[in] ttl     entry life time
+	 */
+	P9fsLookupCache(size_t maxSize, std::chrono::milliseconds ttl);
+
+	bool get(const std::string& path, P9fsQid& qid);
+	void put(const std::string& path, const P9fsQid& qid);
+
+	/**
+	 * Drops the path and all paths below it
+	 */
+	void invalidate(const std::string& path);
+
+	uint64_t getHits() const { return mHits; }
+	uint64_t getMisses() const { return mMisses; }
+
+private:
+
+	struct Entry
+	{
+		P9fsQid qid;
+		std::chrono::steady_clock::time_point expire;
+	};
+
+	size_t mMaxSize;
+	std::chrono::milliseconds mTtl;
+	std::unordered_map<std::string, Entry> mEntries;
+	std::atomic<uint64_t> mHits;
+	std::atomic<uint64_t> mMisses;
+	std::mutex mMutex;
+};
+
+/***************************************************************************//**
+ * 9P session: fid table and file system operations on the exported
+ * directory. The session is shared by all rings of the frontend and its
+ * methods may be called concurrently.
+ *
+ * Paths of fids are kept relative to the exported directory. Walking above
+ * the exported directory is not possible. Symbolic links inside the exported
+ * directory can't be walked (ELOOP), so fid paths never resolve outside of
+ * it. They can still be removed or renamed.
+ * @ingroup p9fs
+ ******************************************************************************/
+class P9fsSession
+{
+public:
+
+	/**
+	 * @param[in] root   exported directory
+	 * @param[in] config backend configuration
+	 */
+	P9fsSession(const std::string& root, const P9fsConfig& config);
+	~P9fsSession();
+
+	/**
+	 * Starts new session: all fids are clunked
+	 * @param[in] msize max message size requested by the frontend
+	 * @return negotiated max message size
+	 */
+	uint32_t version(uint32_t msize);
+
+	/**
+	 * Returns negotiated max message size
+	 */
+	uint32_t getMsize() const { return mMsize; }
+
+	P9fsQid attach(uint32_t fid);
+	std::vector<P9fsQid> walk(uint32_t fid, uint32_t newFid,
+							  const std::vector<std::string>& names);
+	P9fsQid open(uint32_t fid, uint32_t flags);
+	P9fsQid create(uint32_t fid, const std::string& name, uint32_t flags,
+				   uint32_t mode);
+	P9fsQid mkdir(uint32_t dirFid, const std::string& name, uint32_t mode);
+	void getattr(uint32_t fid, struct stat& st, P9fsQid& qid);
+	void setattr(uint32_t fid, uint32_t valid, uint32_t mode, uint32_t uid,
+				 uint32_t gid, uint64_t size, const timespec& atime,
+				 const timespec& mtime);
+	void statfs(uint32_t fid, struct statvfs& st);
+	void fsync(uint32_t fid);
+	void unlinkat(uint32_t dirFid, const std::string& name, uint32_t flags);
+	void renameat(uint32_t oldDirFid, const std::string& oldName,
+				  uint32_t newDirFid, const std::string& newName);
+	void clunk(uint32_t fid);
+	void remove(uint32_t fid);
+
+	/**
+	 * Returns number of bytes which will be read from the regular file or
+	 * -1 if the size can't be predicted
+	 */
+	ssize_t getReadSize(uint32_t fid, uint64_t offset, uint32_t count);
+
+	/**
+	 * Reads the opened file into iov
+	 */
+	size_t readv(uint32_t fid, uint64_t offset, const iovec* iov, int count);
+
+	/**
+	 * Writes iov into the opened file
+	 */
+	size_t writev(uint32_t fid, uint64_t offset, const iovec* iov, int count);
+
+	/**
+	 * Encodes directory entries starting from offset into the writer, up to
+	 * count bytes
+	 */
+	void readdir(uint32_t fid, uint64_t offset, uint32_t count,
+				 P9fsWriter& writer);
+
+	/**
+	 * Returns lookup cache
+	 */
+	const P9fsLookupCache& getLookupCache() const { return mLookupCache; }
+
+	/**
+	 * Converts stat to qid
+	 */
+	static P9fsQid toQid(const struct stat& st);
+
+private:
+
+	struct Fid
+	{
+		std::string path;
+		int fd = -1;
+		DIR* dir = nullptr;
+		std::mutex mutex;
+
+		~Fid();
+	};
+
+	typedef std::shared_ptr<Fid> FidPtr;
+
+	std::string mRoot;
+	std::atomic<uint32_t> mMsize;
+	std::unordered_map<uint32_t, FidPtr> mFids;
+	std::mutex mFidsMutex;
+	P9fsLookupCache mLookupCache;
+
+	Log mLog;
+
+	FidPtr getFid(uint32_t fid);
+	FidPtr getOpenedFid(uint32_t fid);
+	void addFid(uint32_t fid, FidPtr fidPtr);
+	std::string hostPath(const std::string& path) const;
+	std::string childPath(const std::string& dir,
+						  const std::string& name) const;
+	P9fsQid lookup(const std::string& path);
+};
+
+typedef std::shared_ptr<P9fsSession> P9fsSessionPtr;
+
+/***************************************************************************//**
+ * 9pfs ring (data interface and flex data ring).
+ *
+ * Requests are parsed on the ring thread and passed to the worker pool.
+ * Requests with the same fid are handled in order, others in parallel.
+ *
+ * Write payload is passed to pwritev() straight from the out ring, the ring
+ * space is released when the write is done. Read data of regular files is
+ * read with preadv() straight into the space reserved in the in ring. If the
+ * file gets shorter while it is read, the response keeps the reserved size
+ * and its count field tells the number of bytes read.
+ * Responses are made visible to the frontend in the reservation order.
+ * @ingroup p9fs
+ ******************************************************************************/
+class P9fsRing : public RingBufferBase
+{
+public:
+
+	/**
+	 * @param[in] domId   frontend domain id
+	 * @param[in] port    event channel port number
+	 * @param[in] ref     data interface grant reference
+	 * @param[in] session 9P session
+	 * @param[in] config  backend configuration
+	 */
+	P9fsRing(domid_t domId, evtchn_port_t port, grant_ref_t ref,
+			 P9fsSessionPtr session, const P9fsConfig& config);
+	~P9fsRing();
+
+	/**
+	 * Returns ring statistics
+	 */
+	P9fsStats getStats() const;
+
+private:
+
+	// size[4] type[1] tag[2] fid[4] offset[8] count[4]
+	static const size_t cWriteHeaderSize = 23;
+	// size[4] type[1] tag[2] count[4]
+	static const size_t cReadHeaderSize = 11;
+
+	struct Request
+	{
+		uint8_t type;
+		uint16_t tag;
+		std::vector<uint8_t> body;
+		RING_IDX payload;
+		uint32_t payloadSize;
+		uint64_t outId;
+		bool holdsOut;
+	};
+
+	typedef std::shared_ptr<Request> RequestPtr;
+
+	/*
+	 * Ring space which is released in order: the ring index is advanced
+	 * only when all earlier entries are done.
+	 */
+	class OrderedRelease
+	{
+	public:
+
+		OrderedRelease() : mBase(0) {}
+
+		uint64_t add(RING_IDX end);
+		bool done(uint64_t id, RING_IDX& end);
+
+	private:
+
+		std::deque<std::pair<RING_IDX, bool>> mEntries;
+		uint64_t mBase;
+	};
+
+	P9fsSessionPtr mSession;
+	P9fsConfig mConfig;
+
+	xen_9pfs_data_intf* mIntf;
+	std::unique_ptr<XenGnttabBuffer> mData;
+	uint8_t* mIn;
+	uint8_t* mOut;
+	RING_IDX mRingSize;
+	RING_IDX mOutParsed;
+
+	std::mutex mOutMutex;
+	OrderedRelease mOutRelease;
+
+	std::mutex mInMutex;
+	std::condition_variable mInCondVar;
+	OrderedRelease mInRelease;
+	RING_IDX mInReserved;
+	bool mTerminate;
+
+	size_t mInFlight;
+	mutable std::mutex mStatsMutex;
+	P9fsStats mStats;
+
+	ThreadPool mPool;
+
+	void onReceiveIndication() override;
+
+	void dispatch(RequestPtr request);
+	void processRequest(RequestPtr request);
+	void processMessage(const Request& request, P9fsReader& reader,
+						P9fsWriter& writer);
+	bool processRead(const Request& request);
+	void processWrite(const Request& request, P9fsWriter& writer);
+	uint32_t getMaxCount(uint32_t count);
+
+	void sendResponse(const std::vector<uint8_t>& rsp);
+	RING_IDX reserve(size_t size, uint64_t& id);
+	void commit(uint64_t id);
+	bool releaseOut(uint64_t id);
+
+	void copyFromOut(RING_IDX index, void* data, size_t size);
+	void copyToIn(RING_IDX index, const void* data, size_t size);
+	int getIov(uint8_t* ring, RING_IDX index, size_t size, iovec* iov);
+};
+
+typedef std::shared_ptr<P9fsRing> P9fsRingPtr;
+
+/***************************************************************************//**
+ * 9pfs frontend handler.
+ *
+ * Advertises the transport version, max rings and ring order and exports
+ * the directory specified by the backend <i>path</i> entry.
+ * @ingroup p9fs
+ ******************************************************************************/
+class P9fsFrontendHandler : public FrontendHandlerBase
+{
+public:
+
+	/**
+	 * @param[in] devName device name
+	 * @param[in] beDomId backend domain id
+	 * @param[in] feDomId frontend domain id
+	 * @param[in] devId   device id
+	 * @param[in] config  backend configuration
+	 */
+	P9fsFrontendHandler(const std::string& devName, domid_t beDomId,
+						domid_t feDomId, uint16_t devId,
+						const P9fsConfig& config = P9fsConfig());
+	~P9fsFrontendHandler();
+
+	/**
+	 * Returns statistics of all rings
+	 */
+	std::vector<P9fsStats> getStats();
+
+protected:
+
+	void onBind() override;
+	void onClosing() override;
+
+private:
+
+	P9fsConfig mConfig;
+	P9fsSessionPtr mSession;
+	std::vector<P9fsRingPtr> mRings;
+	std::mutex mRingsMutex;
+
+	Log mLog;
+
+	void writeFeatures();
+};
+
+/***************************************************************************//**
+ * 9pfs backend.
+ *
+ * Creates P9fsFrontendHandler for each new 9pfs frontend.
+ *
+ * @code
+ * P9fsBackend backend;
+ *
+ * backend.start();
+ * @endcode
+ * @ingroup p9fs
+ ******************************************************************************/
+class P9fsBackend : public BackendBase
+{
+public:
+
+	/**
+	 * @param[in] name    optional backend name
+	 * @param[in] config  backend configuration
+	 * @param[in] devName device name
+	 */
+	P9fsBackend(const std::string& name = "P9fsBackend",
+				const P9fsConfig& config = P9fsConfig(),
+				const std::string& devName = "9pfs");
+
+private:
+
+	P9fsConfig mConfig;
+
+	void onNewFrontend(domid_t domId, uint16_t devId) override;
+};
+
+}
+
+#endif /* XENBE_P9FSBACKEND_HPP_ */
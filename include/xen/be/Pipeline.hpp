@@ -0,0 +1,444 @@
+/*
+ *  Staged request pipeline
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef XENBE_PIPELINE_HPP_
+#define XENBE_PIPELINE_HPP_
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Exception.hpp"
+#include "Log.hpp"
+
+namespace XenBackend {
+
+/***************************************************************************//**
+ * Exception generated by Pipeline.
+ * @ingroup backend
+ ******************************************************************************/
+class PipelineException : public Exception
+{
+	using Exception::Exception;
+};
+
+/***************************************************************************//**
+ * Pipeline stage configuration.
+ * @ingroup backend
+ ******************************************************************************/
+struct StageConfig
+{
+	/**
+	 * Stage name used in logs and statistics
+	 */
+	std::string name;
+
+	/**
+	 * Number of stage threads
+	 */
+	size_t numThreads = 1;
+
+	/**
+	 * Max number of items waiting in the stage queue
+	 */
+	size_t queueSize = 64;
+
+	/**
+	 * Max number of items passed to the stage handler at once
+	 */
+	size_t batchSize = 1;
+};
+
+/***************************************************************************//**
+ * Pipeline stage statistics.
+ * @ingroup backend
+ ******************************************************************************/
+struct StageStats
+{
+	std::string name;
+
+	/**
+	 * Number of items and batches handled by the stage
+	 */
+	uint64_t items;
+	uint64_t batches;
+
+	/**
+	 * Current and max number of items in the stage queue
+	 */
+	size_t queued;
+	size_t maxQueued;
+
+	/**
+	 * Number of times the previous stage (or the ring buffer for the first
+	 * stage) waited for the free space in the full queue
+	 */
+	uint64_t blocked;
+
+	/**
+	 * Mean time an item waits in the stage queue
+	 */
+	std::chrono::microseconds queueTime;
+
+	/**
+	 * Mean time the stage handler takes per batch
+	 */
+	std::chrono::microseconds serviceTime;
+};
+
+/***************************************************************************//**
+ * Staged pipeline in the SEDA style.
+ *
+ * Request handling is split into stages (e.g. decode, map grants, execute,
+ * respond). Each stage has a bounded queue and its own threads, takes
+ * items in batches and passes the items left in the batch to the next
+ * stage. A stage handler may remove items from the batch, e.g. the
+ * requests failed validation which are responded at once.
+ *
+ * Pushing to the full queue blocks: a stage waits for the next one, and
+ * push() called from RingBufferInBase::processRequest() stops ring
+ * consumption till the first stage has space, so the frontend sees the full
+ * ring. The queue and service times of each stage are measured, so the
+ * bottleneck stage can be found and tuned separately.
+ *
+ * Items are handled in order only by stages with one thread. The last stage
+ * usually puts the response with RingBufferInBase::queueResponse(), so the
+ * ring buffer should enable the concurrent responses.
+ *
+ * @code
+ * Pipeline<RequestPtr>::Stage decode, execute;
+ *
+ * decode.config.name = "decode";
+ * decode.config.batchSize = 8;
+ * decode.handler = decodeRequests;
+ *
+ * execute.config.name = "execute";
+ * execute.config.numThreads = 4;
+ * execute.handler = executeRequests;
+ *
+ * Pipeline<RequestPtr> pipeline({decode, execute});
+ *
+ * pipeline.start();
+ *
+ * // in processRequest()
+ * pipeline.push(RequestPtr(new Request(req)));
+ * @endcode
+ * @ingroup backend
+ ******************************************************************************/
+template<typename Item>
+class Pipeline
+{
+public:
+
+	/**
+	 * Stage handler
+	 * @param[in,out] batch items to handle, items left in the batch are
+	 * passed to the next stage
+	 */
+	typedef std::function<void(std::vector<Item>& batch)> Handler;
+
+	/**
+	 * Stage description
+	 */
+	struct Stage
+	{
+		StageConfig config;
+		Handler handler;
+	};
+
+	/**
+	 * @param[in] stages pipeline stages in the processing order
+	 */
+	explicit Pipeline(const std::vector<Stage>& stages) :
+		mLog("Pipeline")
+	{
+		if (stages.empty())
+		{
+			throw PipelineException("No pipeline stages", EINVAL);
+		}
+
+		for (auto& stage : stages)
+		{
+			if (!stage.config.numThreads || !stage.config.queueSize ||
+				!stage.config.batchSize || !stage.handler)
+			{
+				throw PipelineException("Invalid stage: " + stage.config.name,
+										EINVAL);
+			}
+
+			mStages.emplace_back(new StageQueue(stage));
+		}
+
+		for (size_t i = 0; i + 1 < mStages.size(); i++)
+		{
+			mStages[i]->next = mStages[i + 1].get();
+		}
+	}
+
+	Pipeline(const Pipeline&) = delete;
+	Pipeline& operator=(Pipeline const&) = delete;
+
+	~Pipeline()
+	{
+		stop();
+	}
+
+	/**
+	 * Starts stage threads
+	 */
+	void start()
+	{
+		for (auto& stage : mStages)
+		{
+			stage->terminate = false;
+
+			for (size_t i = 0; i < stage->config.numThreads; i++)
+			{
+				stage->threads.emplace_back(&Pipeline::run, this, stage.get());
+			}
+		}
+
+		LOG(mLog, DEBUG) << "Start pipeline, stages: " << mStages.size();
+	}
+
+	/**
+	 * Stops stage threads. Queued items are passed through all stages
+	 * before.
+	 */
+	void stop()
+	{
+		// stages are stopped in order, so each stage drains into the next
+		// one before the next one is terminated
+
+		for (auto& stage : mStages)
+		{
+			{
+				std::lock_guard<std::mutex> lock(stage->mutex);
+
+				stage->terminate = true;
+			}
+
+			stage->notEmpty.notify_all();
+
+			for (auto& thread : stage->threads)
+			{
+				thread.join();
+			}
+
+			stage->threads.clear();
+		}
+	}
+
+	/**
+	 * Puts the item to the first stage. Blocks while the first stage queue
+	 * is full.
+	 */
+	void push(Item item)
+	{
+		mStages.front()->push(std::move(item));
+	}
+
+	/**
+	 * Returns statistics of all stages
+	 */
+	std::vector<StageStats> getStats() const
+	{
+		std::vector<StageStats> stats;
+
+		for (auto& stage : mStages)
+		{
+			stats.push_back(stage->getStats());
+		}
+
+		return stats;
+	}
+
+private:
+
+	typedef std::chrono::steady_clock::time_point TimePoint;
+
+	struct Entry
+	{
+		Item item;
+		TimePoint time;
+	};
+
+	struct StageQueue
+	{
+		StageConfig config;
+		Handler handler;
+		StageQueue* next;
+
+		std::deque<Entry> queue;
+		bool terminate;
+		std::vector<std::thread> threads;
+
+		mutable std::mutex mutex;
+		std::condition_variable notEmpty;
+		std::condition_variable notFull;
+
+		StageStats stats;
+		std::chrono::nanoseconds queueTime;
+		std::chrono::nanoseconds serviceTime;
+
+		explicit StageQueue(const Stage& stage) :
+			config(stage.config),
+			handler(stage.handler),
+			next(nullptr),
+			terminate(true),
+			stats(),
+			queueTime(std::chrono::nanoseconds::zero()),
+			serviceTime(std::chrono::nanoseconds::zero())
+		{
+			stats.name = config.name;
+		}
+
+		void push(Item item)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+
+			if (queue.size() >= config.queueSize)
+			{
+				stats.blocked++;
+
+				notFull.wait(lock, [this] {
+					return queue.size() < config.queueSize;
+				});
+			}
+
+			queue.push_back({std::move(item),
+							 std::chrono::steady_clock::now()});
+
+			if (queue.size() > stats.maxQueued)
+			{
+				stats.maxQueued = queue.size();
+			}
+
+			notEmpty.notify_one();
+		}
+
+		StageStats getStats() const
+		{
+			using std::chrono::duration_cast;
+			using std::chrono::microseconds;
+
+			std::lock_guard<std::mutex> lock(mutex);
+
+			StageStats result = stats;
+
+			result.queued = queue.size();
+			result.queueTime = stats.items ?
+				duration_cast<microseconds>(queueTime / stats.items) :
+				microseconds::zero();
+			result.serviceTime = stats.batches ?
+				duration_cast<microseconds>(serviceTime / stats.batches) :
+				microseconds::zero();
+
+			return result;
+		}
+	};
+
+	std::vector<std::unique_ptr<StageQueue>> mStages;
+
+	Log mLog;
+
+	void run(StageQueue* stage)
+	{
+		std::vector<Item> batch;
+		std::chrono::nanoseconds queueTime;
+
+		while (true)
+		{
+			batch.clear();
+			queueTime = std::chrono::nanoseconds::zero();
+
+			{
+				std::unique_lock<std::mutex> lock(stage->mutex);
+
+				stage->notEmpty.wait(lock, [stage] {
+					return !stage->queue.empty() || stage->terminate;
+				});
+
+				if (stage->queue.empty())
+				{
+					return;
+				}
+
+				auto now = std::chrono::steady_clock::now();
+
+				while (!stage->queue.empty() &&
+					   batch.size() < stage->config.batchSize)
+				{
+					queueTime += now - stage->queue.front().time;
+
+					batch.push_back(std::move(stage->queue.front().item));
+
+					stage->queue.pop_front();
+				}
+			}
+
+			stage->notFull.notify_all();
+
+			auto startTime = std::chrono::steady_clock::now();
+			auto numItems = batch.size();
+
+			try
+			{
+				stage->handler(batch);
+			}
+			catch(const std::exception& e)
+			{
+				LOG(mLog, ERROR) << "Stage " << stage->config.name << ": "
+								 << e.what();
+
+				batch.clear();
+			}
+
+			auto serviceTime = std::chrono::steady_clock::now() - startTime;
+
+			{
+				std::lock_guard<std::mutex> lock(stage->mutex);
+
+				stage->stats.items += numItems;
+				stage->stats.batches++;
+				stage->queueTime += queueTime;
+				stage->serviceTime += serviceTime;
+			}
+
+			if (stage->next)
+			{
+				for (auto& item : batch)
+				{
+					stage->next->push(std::move(item));
+				}
+			}
+		}
+	}
+};
+
+}
+
+#endif /* XENBE_PIPELINE_HPP_ */
@@ -0,0 +1,508 @@
+/*
+ *  Xen pvcalls backend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef XENBE_PVCALLSBACKEND_HPP_
+#define XENBE_PVCALLSBACKEND_HPP_
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/uio.h>
+
+extern "C" {
+#include <xenctrl.h>
+#include <xenevtchn.h>
+#include <xen/io/pvcalls.h>
+}
+
+#include "BackendBase.hpp"
+#include "Exception.hpp"
+#include "FrontendHandlerBase.hpp"
+#include "Log.hpp"
+#include "RingBufferBase.hpp"
+#include "XenGnttab.hpp"
+
+namespace XenBackend {
+
+/***************************************************************************//**
+ * @defgroup pvcalls PV calls backend
+ * Ready to use pvcalls backend: guest TCP sockets are backed by host
+ * sockets, data is moved between the per socket data rings and the host
+ * sockets by a small set of epoll loops shared by all frontends.
+ ******************************************************************************/
+
+/***************************************************************************//**
+ * Exception generated by pvcalls backend. The error code is returned to the
+ * frontend in the command response.
+ * @ingroup pvcalls
+ ******************************************************************************/
+class PvcallsException : public Exception
+{
+	using Exception::Exception;
+};
+
+/***************************************************************************//**
+ * pvcalls backend configuration.
+ * @ingroup pvcalls
+ ******************************************************************************/
+struct PvcallsConfig
+{
+	/**
+	 * Number of epoll loops shared by all frontends
+	 */
+	unsigned int numLoops = 2;
+
+	/**
+	 * Max data ring page order
+	 */
+	unsigned int maxPageOrder = 4;
+
+	/**
+	 * Max number of epoll events handled per wakeup
+	 */
+	unsigned int maxEvents = 64;
+};
+
+/***************************************************************************//**
+ * pvcalls frontend statistics.
+ * @ingroup pvcalls
+ ******************************************************************************/
+struct PvcallsStats
+{
+	uint64_t commands;
+	uint64_t errors;
+	uint64_t sockets;
+	uint64_t sentBytes;
+	uint64_t receivedBytes;
+};
+
+/***************************************************************************//**
+ * epoll loop.
+ *
+ * Runs one thread which waits for host socket events and for notifications
+ * of all event channels bound to the loop. All event channels share one
+ * event channel handle, so a loop costs one thread and one descriptor
+ * regardless of the number of data rings.
+ *
+ * Callbacks and posted tasks are called on the loop thread. Methods other
+ * than post() and sync() should be called on the loop thread only.
+ * @ingroup pvcalls
+ ******************************************************************************/
+class PvcallsEventLoop
+{
+public:
+
+	/**
+	 * Is called with epoll events of the file descriptor
+	 */
+	typedef std::function<void(uint32_t events)> FdCallback;
+
+	/**
+	 * Is called when the event channel is notified
+	 */
+	typedef std::function<void()> PortCallback;
+
+	typedef std::function<void()> Task;
+
+	/**
+	 * @param[in] maxEvents max number of events handled per wakeup
+	 */
+	explicit PvcallsEventLoop(unsigned int maxEvents = 64);
+	PvcallsEventLoop(const PvcallsEventLoop&) = delete;
+	PvcallsEventLoop& operator=(PvcallsEventLoop const&) = delete;
+	~PvcallsEventLoop();
+
+	/**
+	 * Calls the task on the loop thread. Tasks are called in the order
+	 * they are posted.
+	 * @param task task, should not throw
+	 */
+	void post(Task task);
+
+	/**
+	 * Waits till all tasks posted before are done
+	 */
+	void sync();
+
+	/**
+	 * Adds the file descriptor to the loop
+	 * @param[in] fd       file descriptor
+	 * @param[in] events   epoll events
+	 * @param[in] callback callback
+	 */
+	void addFd(int fd, uint32_t events, FdCallback callback);
+
+	/**
+	 * Removes the file descriptor from the loop
+	 */
+	void removeFd(int fd);
+
+	/**
+	 * Binds the event channel
+	 * @param[in] domId    frontend domain id
+	 * @param[in] port     remote port
+	 * @param[in] callback callback
+	 * @return local port
+	 */
+	evtchn_port_t bindPort(domid_t domId, evtchn_port_t port,
+						   PortCallback callback);
+
+	/**
+	 * Unbinds the event channel
+	 * @param[in] port local port
+	 */
+	void unbindPort(evtchn_port_t port);
+
+	/**
+	 * Notifies the event channel
+	 * @param[in] port local port
+	 */
+	void notifyPort(evtchn_port_t port);
+
+private:
+
+	unsigned int mMaxEvents;
+	int mEpollFd;
+	int mWakeFd;
+	xenevtchn_handle* mHandle;
+	int mEvtchnFd;
+
+	std::unordered_map<int, FdCallback> mFds;
+	std::unordered_map<evtchn_port_t, PortCallback> mPorts;
+
+	std::mutex mTasksMutex;
+	std::deque<Task> mTasks;
+	bool mTerminate;
+
+	std::thread mThread;
+	Log mLog;
+
+	void init();
+	void release();
+	void run();
+	void runTasks();
+	void handlePort();
+};
+
+typedef std::shared_ptr<PvcallsEventLoop> PvcallsEventLoopPtr;
+
+/***************************************************************************//**
+ * Mapped data ring of an active socket.
+ *
+ * The frontend writes to the out ring and the backend writes to the in
+ * ring. getIov() returns the ring memory as iovec, so the data goes
+ * straight from the ring to the socket and back.
+ * @ingroup pvcalls
+ ******************************************************************************/
+class PvcallsDataRing
+{
+public:
+
+	/**
+	 * @param[in] domId        frontend domain id
+	 * @param[in] ref          data interface grant reference
+	 * @param[in] port         remote event channel port
+	 * @param[in] loop         loop the event channel is bound to
+	 * @param[in] maxPageOrder max ring page order
+	 * @param[in] callback     is called when the frontend notifies the ring
+	 */
+	PvcallsDataRing(domid_t domId, grant_ref_t ref, evtchn_port_t port,
+					PvcallsEventLoop& loop, unsigned int maxPageOrder,
+					PvcallsEventLoop::PortCallback callback);
+	~PvcallsDataRing();
+
+	pvcalls_data_intf* getIntf() { return mIntf; }
+	uint8_t* getIn() { return mIn; }
+	uint8_t* getOut() { return mOut; }
+
+	/**
+	 * Returns size of each in and out ring
+	 */
+	RING_IDX getSize() const { return mSize; }
+
+	/**
+	 * Fills iovec with the ring memory starting at the index
+	 * @return number of used iovec entries
+	 */
+	int getIov(uint8_t* ring, RING_IDX index, size_t size, iovec* iov) const;
+
+	void notify();
+
+private:
+
+	PvcallsEventLoop& mLoop;
+	XenGnttabBuffer mIntfBuffer;
+	pvcalls_data_intf* mIntf;
+	std::unique_ptr<XenGnttabBuffer> mData;
+	uint8_t* mIn;
+	uint8_t* mOut;
+	RING_IDX mSize;
+	evtchn_port_t mPort;
+};
+
+class PvcallsCommandRing;
+
+/***************************************************************************//**
+ * Socket of the frontend backed by a host socket.
+ *
+ * All operations except creation are performed on the loop thread the
+ * socket belongs to.
+ * @ingroup pvcalls
+ ******************************************************************************/
+class PvcallsSocket
+{
+public:
+
+	/**
+	 * @param[in] id    socket id assigned by the frontend
+	 * @param[in] fd    host socket
+	 * @param[in] loop  loop the socket belongs to
+	 * @param[in] owner command ring the socket belongs to
+	 */
+	PvcallsSocket(uint64_t id, int fd, PvcallsEventLoop& loop,
+				  PvcallsCommandRing& owner);
+	PvcallsSocket(const PvcallsSocket&) = delete;
+	PvcallsSocket& operator=(PvcallsSocket const&) = delete;
+	~PvcallsSocket();
+
+	uint64_t getId() const { return mId; }
+	PvcallsEventLoop& getLoop() { return mLoop; }
+
+	void connect(const xen_pvcalls_request& req);
+	void bind(const xen_pvcalls_request& req);
+	void listen(const xen_pvcalls_request& req);
+	void accept(const xen_pvcalls_request& req);
+	void poll(const xen_pvcalls_request& req);
+
+	/**
+	 * Removes the socket from the loop and closes it. Pending accept and
+	 * poll are answered with -EINTR.
+	 */
+	void close();
+
+private:
+
+	enum class State
+	{
+		CREATED,
+		CONNECTING,
+		CONNECTED,
+		BOUND,
+		LISTENING,
+		CLOSED
+	};
+
+	uint64_t mId;
+	int mFd;
+	PvcallsEventLoop& mLoop;
+	PvcallsCommandRing& mOwner;
+	State mState;
+	bool mInClosed;
+	bool mOutClosed;
+	std::unique_ptr<PvcallsDataRing> mRing;
+
+	bool mAcceptPending;
+	xen_pvcalls_request mAcceptReq;
+	bool mPollPending;
+	xen_pvcalls_request mPollReq;
+	xen_pvcalls_request mConnectReq;
+
+	Log mLog;
+
+	void attach(int fd, grant_ref_t ref, evtchn_port_t port);
+	void onSocketEvent(uint32_t events);
+	void onListenEvent(uint32_t events);
+	void onConnected(int error);
+	void doAccept();
+	void transfer();
+	void receive();
+	void send();
+	void respond(const xen_pvcalls_request& req, int32_t ret);
+};
+
+typedef std::shared_ptr<PvcallsSocket> PvcallsSocketPtr;
+
+/***************************************************************************//**
+ * pvcalls command ring.
+ *
+ * Processes socket commands of the frontend. Commands which operate on a
+ * socket are posted to the socket loop, so the ring thread never blocks on
+ * a host socket and commands of one socket are done in order. Responses of
+ * connect, accept and poll are sent from the loop when the host socket is
+ * ready.
+ * @ingroup pvcalls
+ ******************************************************************************/
+class PvcallsCommandRing : public RingBufferInBase<xen_pvcalls_back_ring,
+												   xen_pvcalls_sring,
+												   xen_pvcalls_request,
+												   xen_pvcalls_response>
+{
+public:
+
+	/**
+	 * @param[in] domId  frontend domain id
+	 * @param[in] port   event channel port number
+	 * @param[in] ref    ring grant reference
+	 * @param[in] loops  loops the sockets are distributed over
+	 * @param[in] config backend configuration
+	 */
+	PvcallsCommandRing(domid_t domId, evtchn_port_t port, grant_ref_t ref,
+					   const std::vector<PvcallsEventLoopPtr>& loops,
+					   const PvcallsConfig& config);
+	~PvcallsCommandRing();
+
+	/**
+	 * Returns frontend statistics
+	 */
+	PvcallsStats getStats();
+
+	domid_t getDomId() const { return mDomId; }
+	const PvcallsConfig& getConfig() const { return mConfig; }
+
+	/**
+	 * Sends the response, may be called from any thread
+	 */
+	void respond(const xen_pvcalls_request& req, int32_t ret);
+
+	/**
+	 * Registers the socket created by accept
+	 * @return false if the id is already used
+	 */
+	bool addSocket(PvcallsSocketPtr socket);
+	bool hasSocket(uint64_t id);
+
+	void addSentBytes(size_t size) { mSentBytes += size; }
+	void addReceivedBytes(size_t size) { mReceivedBytes += size; }
+
+private:
+
+	domid_t mDomId;
+	std::vector<PvcallsEventLoopPtr> mLoops;
+	PvcallsConfig mConfig;
+	size_t mNextLoop;
+
+	std::mutex mSocketsMutex;
+	std::unordered_map<uint64_t, PvcallsSocketPtr> mSockets;
+
+	std::mutex mResponseMutex;
+
+	std::atomic<uint64_t> mCommands;
+	std::atomic<uint64_t> mErrors;
+	std::atomic<uint64_t> mSentBytes;
+	std::atomic<uint64_t> mReceivedBytes;
+
+	void processRequest(const xen_pvcalls_request& req) override;
+
+	void createSocket(const xen_pvcalls_request& req);
+	void releaseSocket(PvcallsSocketPtr socket,
+					   const xen_pvcalls_request& req);
+	PvcallsSocketPtr getSocket(uint64_t id);
+};
+
+typedef std::shared_ptr<PvcallsCommandRing> PvcallsCommandRingPtr;
+
+/***************************************************************************//**
+ * pvcalls frontend handler.
+ * @ingroup pvcalls
+ ******************************************************************************/
+class PvcallsFrontendHandler : public FrontendHandlerBase
+{
+public:
+
+	/**
+	 * @param[in] devName device name
+	 * @param[in] beDomId backend domain id
+	 * @param[in] feDomId frontend domain id
+	 * @param[in] devId   device id
+	 * @param[in] loops   loops shared by the frontends
+	 * @param[in] config  backend configuration
+	 */
+	PvcallsFrontendHandler(const std::string& devName, domid_t beDomId,
+						   domid_t feDomId, uint16_t devId,
+						   const std::vector<PvcallsEventLoopPtr>& loops,
+						   const PvcallsConfig& config = PvcallsConfig());
+	~PvcallsFrontendHandler();
+
+	/**
+	 * Returns frontend statistics
+	 */
+	PvcallsStats getStats();
+
+protected:
+
+	void onBind() override;
+	void onClosing() override;
+
+private:
+
+	std::vector<PvcallsEventLoopPtr> mLoops;
+	PvcallsConfig mConfig;
+	PvcallsCommandRingPtr mRing;
+	std::mutex mRingMutex;
+
+	Log mLog;
+
+	void writeFeatures();
+};
+
+/***************************************************************************//**
+ * pvcalls backend.
+ *
+ * Creates the epoll loops and PvcallsFrontendHandler for each new pvcalls
+ * frontend.
+ *
+ * @code
+ * PvcallsBackend backend;
+ *
+ * backend.start();
+ * @endcode
+ * @ingroup pvcalls
+ ******************************************************************************/
+class PvcallsBackend : public BackendBase
+{
+public:
+
+	/**
+	 * @param[in] name    optional backend name
+	 * @param[in] config  backend configuration
+	 * @param[in] devName device name
+	 */
+	PvcallsBackend(const std::string& name = "PvcallsBackend",
+				   const PvcallsConfig& config = PvcallsConfig(),
+				   const std::string& devName = "pvcalls");
+
+private:
+
+	PvcallsConfig mConfig;
+	std::vector<PvcallsEventLoopPtr> mLoops;
+
+	void onNewFrontend(domid_t domId, uint16_t devId) override;
+};
+
+}
+
+#endif /* XENBE_PVCALLSBACKEND_HPP_ */
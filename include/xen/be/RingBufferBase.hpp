@@ -21,7 +21,15 @@
 #ifndef XENBE_RINGBUFFERBASE_HPP_
 #define XENBE_RINGBUFFERBASE_HPP_
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
 #include <mutex>
+#include <unordered_map>
+#include <vector>
 
 extern "C" {
 #include <xenctrl.h>
@@ -32,6 +40,7 @@ extern "C" {
 #include "Exception.hpp"
 #include "XenGnttab.hpp"
 #include "Log.hpp"
+#include "Utils.hpp"
 
 namespace XenBackend {
 
@@ -44,8 +53,62 @@ class RingBufferException : public Exception
 	using Exception::Exception;
 };
 
+/***************************************************************************//**
+ * Request load counters of the ring buffer.
+ * @ingroup backend
+ ******************************************************************************/
+struct RingLoadStats
+{
+	/**
+	 * Number of consumed requests
+	 */
+	uint64_t requests;
+
+	/**
+	 * Number of consume passes which found requests
+	 */
+	uint64_t passes;
+
+	/**
+	 * Sum of requests available at the start of each pass
+	 */
+	uint64_t occupancy;
+};
+
+/***************************************************************************//**
+ * Error counters of the ring buffer.
+ * @ingroup backend
+ ******************************************************************************/
+struct RingErrorStats
+{
+	/**
+	 * Number of hot path errors
+	 */
+	uint64_t errors;
+
+	/**
+	 * Number of failure episodes, each one is reported to the error callback
+	 */
+	uint64_t episodes;
+
+	/**
+	 * Error code of the last error, 0 if there was no error
+	 */
+	int lastError;
+};
+
 /***************************************************************************//**
  * Interface to implement custom ring buffer.
+ *
+ * Consume, response and notify paths don't throw: they return the error code
+ * and account the error. Consecutive errors of the same source form a failure
+ * episode, which is reported to the error callback once, on the first error.
+ * The episode ends on the first success of the source.
+ *
+ * The state written on the hot paths is grouped into blocks aligned to the
+ * cache line, so the threads consuming requests, sending responses and
+ * events on different cores don't invalidate each other's lines. Ring
+ * buffers are allocated by the class operator new with this alignment.
  * @ingroup backend
  ******************************************************************************/
 class RingBufferBase
@@ -58,8 +121,22 @@ public:
 	 * @param ref   grant table reference
 	 */
 	RingBufferBase(domid_t domId, evtchn_port_t port, grant_ref_t ref);
+
+	/**
+	 * @param domId frontend domain id
+	 * @param port  event channel port number
+	 * @param refs  grant table references of multi-page ring buffer
+	 */
+	RingBufferBase(domid_t domId, evtchn_port_t port, const GrantRefs& refs);
 	virtual ~RingBufferBase();
 
+	/**
+	 * Allocates the ring buffer aligned to the cache line: before C++17
+	 * operator new doesn't respect the extended alignment.
+	 */
+	static void* operator new(size_t size);
+	static void operator delete(void* ptr) noexcept;
+
 	/**
 	 * Starts ring buffer handling.
 	 */
@@ -86,6 +163,81 @@ public:
 	 */
 	void setErrorCallback(ErrorCallback errorCallback);
 
+	/**
+	 * Binds ring buffer handling to the CPU core. Can be changed on the
+	 * started ring buffer.
+	 * @param cpu core number, negative value means any core
+	 */
+	void setCpu(int cpu) { mEventChannel.setCpu(cpu); }
+
+	/**
+	 * Returns the core the ring buffer handling is bound to
+	 */
+	int getCpu() const { return mEventChannel.getCpu(); }
+
+	/**
+	 * Returns number of received notifications
+	 */
+	uint64_t getNumEvents() const { return mEventChannel.getNumEvents(); }
+
+	/**
+	 * Returns request load counters
+	 */
+	RingLoadStats getLoadStats() const;
+
+	/**
+	 * Returns hot path error counters
+	 */
+	RingErrorStats getErrorStats() const;
+
+	/**
+	 * Sets max number of requests consumed per poll() pass, so one busy
+	 * ring buffer doesn't delay the others serviced by the same poller.
+	 * @param maxBatch max number of requests, 0 means unlimited
+	 */
+	void setMaxBatch(size_t maxBatch) { mMaxBatch = maxBatch; }
+
+	/**
+	 * Returns max number of requests consumed per poll() pass
+	 */
+	size_t getMaxBatch() const { return mMaxBatch; }
+
+	/**
+	 * Returns true if the ring buffer can be serviced by a poller
+	 */
+	virtual bool isPollable() const { return false; }
+
+	/**
+	 * Callback which wakes the poller servicing the ring buffer
+	 */
+	typedef std::function<void()> WakeCallback;
+
+	/**
+	 * Switches the ring buffer to the polling mode: requests are processed
+	 * by poll() called from a poller thread and the event channel
+	 * notification only calls the wake callback. Should be called before
+	 * start(). It may be called while the event channel runs: when it
+	 * returns, the previous callback is neither running nor called again.
+	 * It must not be called from the wake callback.
+	 * @param wakeCallback wake callback, nullptr switches back to the event
+	 * mode
+	 */
+	void setWakeCallback(WakeCallback wakeCallback);
+
+	/**
+	 * Processes available requests without re-enabling the frontend
+	 * notifications. Errors are reported to the error callback and disable
+	 * further polling of the ring buffer.
+	 * @return true if any request was processed
+	 */
+	bool poll();
+
+	/**
+	 * Re-enables the frontend notifications before the poller goes idle.
+	 * @return true if new requests arrived meanwhile
+	 */
+	bool prepareSleep();
+
 protected:
 
 	/**
@@ -95,6 +247,93 @@ protected:
 	 */
 	virtual void onReceiveIndication() = 0;
 
+	/**
+	 * Is called by poll(). Should process available requests, leaving the
+	 * frontend notifications disabled.
+	 * @return true if any request was processed
+	 */
+	virtual bool onPoll() { return false; }
+
+	/**
+	 * Is called by prepareSleep(). Should re-enable the frontend
+	 * notifications.
+	 * @return true if new requests arrived meanwhile
+	 */
+	virtual bool onPrepareSleep() { return false; }
+
+	/**
+	 * Is called by stop() after the event channel is stopped.
+	 */
+	virtual void onStop() {}
+
+	/**
+	 * Source of the hot path errors
+	 */
+	enum class ErrorSource
+	{
+		CONSUME,
+		NOTIFY,
+		PROCESS
+	};
+
+	/**
+	 * Reports the error to the error callback or logs it.
+	 */
+	void onError(const std::exception& e);
+
+	/**
+	 * Accounts the hot path error. The first error of the episode is
+	 * reported to the error callback.
+	 * @param source  error source
+	 * @param errCode error code
+	 * @param msg     error message
+	 */
+	void reportError(ErrorSource source, int errCode,
+					 const char* msg) noexcept;
+
+	/**
+	 * Accounts the hot path error caught as the exception.
+	 * @param source error source
+	 * @param e      exception
+	 */
+	void reportError(ErrorSource source, const std::exception& e) noexcept;
+
+	/**
+	 * Ends the failure episode of the source, if any.
+	 * @param source error source
+	 */
+	void clearError(ErrorSource source) noexcept
+	{
+		if (mErrorEpisodes[static_cast<int>(source)].load(
+				std::memory_order_relaxed))
+		{
+			endErrorEpisode(source);
+		}
+	}
+
+	/**
+	 * Notifies the frontend. Failure is reported with reportError().
+	 * @return 0 on success, error code otherwise
+	 */
+	int notify() noexcept;
+
+	/**
+	 * Stops servicing the ring buffer by the poller.
+	 */
+	void disablePolling() noexcept { mPollError = true; }
+
+	/**
+	 * Accounts one consume pass in the load counters.
+	 * @param occupancy number of available requests
+	 * @param consumed  number of consumed requests
+	 */
+	void accountPass(size_t occupancy, size_t consumed)
+	{
+		mRequests += consumed;
+		mPasses++;
+		mOccupancy += occupancy;
+	}
+
 	/**
 	 * Event channel.
 	 */
@@ -107,12 +346,78 @@ protected:
 
 	Log mLog;
 
+	/**
+	 * Max number of requests consumed per poll() pass. Starts the block
+	 * written by the thread servicing the ring buffer on each pass.
+	 */
+	alignas(Utils::cCacheLineSize) std::atomic<size_t> mMaxBatch;
+
 private:
 
-	evtchn_port_t mPort;
+	std::atomic_bool mPollError;
+
+	std::atomic<uint64_t> mRequests;
+	std::atomic<uint64_t> mPasses;
+	std::atomic<uint64_t> mOccupancy;
+
+	// read mostly, the error state is written on errors only
+	alignas(Utils::cCacheLineSize) evtchn_port_t mPort;
 	grant_ref_t mRef;
 
+	// the event channel thread calls the wake callback with the mutex locked
+	std::mutex mWakeMutex;
+	WakeCallback mWakeCallback;
+	ErrorCallback mErrorCallback;
+
+	static const int cNumErrorSources = 3;
+
+	std::atomic_bool mErrorEpisodes[cNumErrorSources];
+	std::atomic<uint64_t> mErrors;
+	std::atomic<uint64_t> mEpisodes;
+	std::atomic<uint64_t> mSuppressed[cNumErrorSources];
+	std::atomic<int> mLastError;
+
 	void onIndication();
+	void onPollError(const std::exception& e);
+	void initErrorEpisodes();
+	bool accountError(ErrorSource source, int errCode) noexcept;
+	void endErrorEpisode(ErrorSource source) noexcept;
+};
+
+/***************************************************************************//**
+ * Request dispatch statistics of the input ring buffer.
+ * @ingroup backend
+ ******************************************************************************/
+struct DispatchStats
+{
+	/**
+	 * Number of requests processed on the event thread
+	 */
+	uint64_t inlineRequests;
+
+	/**
+	 * Number of requests processed by the executor
+	 */
+	uint64_t offloadedRequests;
+
+	/**
+	 * Number of requests classified as inline but offloaded to keep the
+	 * order with the offloaded requests of the same key
+	 */
+	uint64_t orderedOffloads;
+
+	/**
+	 * Mean and max time of inline processRequest()
+	 */
+	std::chrono::microseconds inlineLatency;
+	std::chrono::microseconds maxInlineLatency;
+
+	/**
+	 * Mean and max time from dispatching the offloaded request till its
+	 * processRequest() is done
+	 */
+	std::chrono::microseconds offloadLatency;
+	std::chrono::microseconds maxOffloadLatency;
 };
 
 /***************************************************************************//**
@@ -136,6 +441,15 @@ private:
  *
  * @snippet ExampleBackend.cpp processRequest
  *
+ * By default all requests are processed on the event thread. With
+ * setDispatcher() each request is classified: cheap requests are processed
+ * inline and slow ones are passed to the executor thread pool. Requests
+ * with the same ordering key are processed in order: offloaded requests of
+ * one key run one by one, and a request classified as inline is offloaded
+ * too while requests of its key are in flight. In this mode processRequest()
+ * may be called from several threads, responses are pushed by the ring
+ * buffer after each offloaded request.
+ *
  * @ingroup backend
  ******************************************************************************/
 template<typename Ring, typename Page, typename Req, typename Rsp>
@@ -156,6 +470,68 @@ public:
 		BACK_RING_INIT(&mRing, static_cast<Page*>(mBuffer.get()), size);
 	}
 
+	/**
+	 * @param[in] domId    frontend domain id
+	 * @param[in] port     event channel port number
+	 * @param[in] refs     ring buffer ref numbers of multi-page ring buffer
+	 */
+	RingBufferInBase(domid_t domId, evtchn_port_t port,
+					 const GrantRefs& refs) :
+		RingBufferBase(domId, port, refs)
+	{
+		BACK_RING_INIT(&mRing, static_cast<Page*>(mBuffer.get()),
+					   mBuffer.size());
+	}
+
+	~RingBufferInBase()
+	{
+		waitOffloaded();
+	}
+
+	bool isPollable() const override { return true; }
+
+	/**
+	 * Classifies the request
+	 * @param[in]  req request
+	 * @param[out] key ordering key, zero by default
+	 * @return true if the request should be offloaded to the executor
+	 */
+	typedef std::function<bool(const Req& req, uint64_t& key)> Classifier;
+
+	/**
+	 * Enables the hybrid dispatch. Should be called before start().
+	 * @param[in] executor   thread pool for offloaded requests, may be
+	 * shared between ring buffers
+	 * @param[in] classifier request classifier
+	 */
+	void setDispatcher(std::shared_ptr<ThreadPool> executor,
+					   Classifier classifier)
+	{
+		mExecutor = executor;
+		mClassifier = classifier;
+		mConcurrentResponses = true;
+	}
+
+	/**
+	 * Returns request dispatch statistics
+	 */
+	DispatchStats getDispatchStats() const
+	{
+		std::lock_guard<std::mutex> lock(mDispatchMutex);
+
+		DispatchStats stats;
+
+		stats.inlineRequests = mInline.count;
+		stats.offloadedRequests = mOffloaded.count;
+		stats.orderedOffloads = mOrderedOffloads;
+		stats.inlineLatency = mInline.mean();
+		stats.maxInlineLatency = toUs(mInline.max);
+		stats.offloadLatency = mOffloaded.mean();
+		stats.maxOffloadLatency = toUs(mOffloaded.max);
+
+		return stats;
+	}
+
 protected:
 
 	/**
@@ -166,68 +542,433 @@ protected:
 	 */
 	virtual void processRequest(const Req& req) = 0;
 
+	/**
+	 * Is called when all available requests are consumed.
+	 * May be overridden in a derived class to flush work batched in
+	 * processRequest().
+	 */
+	virtual void onRequestsProcessed() {}
+
+	/**
+	 * Enables locking of queueResponse() and pushResponses(). Should be
+	 * called before start() if responses are put from threads other than
+	 * the event thread, e.g. from the Pipeline stages.
+	 */
+	void setConcurrentResponses()
+	{
+		mConcurrentResponses = true;
+	}
+
 	/**
 	 * Sends the response to the frontend
 	 * @param rsp response
+	 * @return 0 on success, error code if the frontend can't be notified
+	 */
+	int sendResponse(const Rsp& rsp) noexcept
+	{
+		queueResponse(rsp);
+
+		return pushResponses();
+	}
+
+	/**
+	 * Puts the response into the ring without making it visible to the
+	 * frontend. Used to batch responses: the frontend sees all queued
+	 * responses and gets at most one notification on pushResponses().
+	 * @param rsp response
 	 */
-	void sendResponse(const Rsp& rsp)
+	void queueResponse(const Rsp& rsp) noexcept
 	{
-		bool notify = false;
+		std::unique_lock<std::mutex> lock(mResponseMutex, std::defer_lock);
+
+		if (mConcurrentResponses)
+		{
+			lock.lock();
+		}
 
 		*RING_GET_RESPONSE(&mRing, mRing.rsp_prod_pvt) = rsp;
 
 		mRing.rsp_prod_pvt++;
 
-		RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&mRing, notify);
+		mRspProdPvt.store(mRing.rsp_prod_pvt, std::memory_order_release);
+	}
+
+	/**
+	 * Makes queued responses visible to the frontend and notifies it
+	 * if required.
+	 * @return 0 on success, error code if the frontend can't be notified
+	 */
+	int pushResponses() noexcept
+	{
+		std::unique_lock<std::mutex> lock(mResponseMutex, std::defer_lock);
 
-		if (notify)
+		if (mConcurrentResponses)
 		{
-			mEventChannel.notify();
+			lock.lock();
 		}
+
+		bool needNotify = false;
+
+		RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&mRing, needNotify);
+
+		return needNotify ? notify() : 0;
 	}
 
 private:
 
-	Ring mRing;
+	typedef std::chrono::steady_clock::time_point TimePoint;
 
-	void onReceiveIndication()
+	struct Latency
 	{
-		int numPendingRequests = 0;
+		uint64_t count = 0;
+		std::chrono::nanoseconds total = std::chrono::nanoseconds::zero();
+		std::chrono::nanoseconds max = std::chrono::nanoseconds::zero();
 
-		do {
-			Req req;
+		void add(std::chrono::nanoseconds time)
+		{
+			count++;
+			total += time;
+
+			if (time > max)
+			{
+				max = time;
+			}
+		}
+
+		std::chrono::microseconds mean() const
+		{
+			return count ? toUs(total / count) :
+						   std::chrono::microseconds::zero();
+		}
+	};
 
-			auto rc = mRing.req_cons;
-			auto rp = mRing.sring->req_prod;
+	// consumer block: req_cons is written by the thread servicing the ring
+	// buffer. rsp_prod_pvt is written by the threads sending responses, the
+	// consumer reads its copy published in mRspProdPvt.
+	alignas(Utils::cCacheLineSize) Ring mRing;
 
-			xen_rmb();
+	std::shared_ptr<ThreadPool> mExecutor;
+	Classifier mClassifier;
 
-			if (RING_REQUEST_PROD_OVERFLOW(&mRing, rp))
+	bool mConcurrentResponses = false;
+
+	// taken by the workers sending responses of offloaded requests
+	alignas(Utils::cCacheLineSize) std::mutex mResponseMutex;
+	std::atomic<RING_IDX> mRspProdPvt {0};
+
+	// dispatch block: written by the consumer and the workers
+	alignas(Utils::cCacheLineSize) mutable std::mutex mDispatchMutex;
+	std::condition_variable mDispatchCondVar;
+	std::unordered_map<uint64_t, size_t> mKeysInFlight;
+	size_t mNumInFlight = 0;
+	uint64_t mOrderedOffloads = 0;
+	Latency mInline;
+	Latency mOffloaded;
+
+	static std::chrono::microseconds toUs(std::chrono::nanoseconds time)
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(time);
+	}
+
+	void onStop() override
+	{
+		waitOffloaded();
+	}
+
+	void waitOffloaded()
+	{
+		std::unique_lock<std::mutex> lock(mDispatchMutex);
+
+		mDispatchCondVar.wait(lock, [this] { return mNumInFlight == 0; });
+	}
+
+	void dispatchRequest(const Req& req) noexcept
+	{
+		try
+		{
+			if (mClassifier)
+			{
+				dispatchClassified(req);
+			}
+			else
+			{
+				processRequest(req);
+
+				clearError(ErrorSource::PROCESS);
+			}
+		}
+		catch(const std::exception& e)
+		{
+			reportError(ErrorSource::PROCESS, e);
+		}
+	}
+
+	void dispatchClassified(const Req& req)
+	{
+		uint64_t key = 0;
+		bool offload = mClassifier(req, key);
+		auto startTime = std::chrono::steady_clock::now();
+
+		{
+			std::lock_guard<std::mutex> lock(mDispatchMutex);
+
+			if (!offload && mKeysInFlight.count(key))
 			{
-				throw RingBufferException("Ring buffer producer overflow", EIO);
+				offload = true;
+
+				mOrderedOffloads++;
 			}
 
-			while (rc != rp)
+			if (offload)
 			{
+				mKeysInFlight[key]++;
+				mNumInFlight++;
+			}
+		}
 
-				if (RING_REQUEST_CONS_OVERFLOW(&mRing, rc))
-				{
-					throw RingBufferException("Ring buffer consumer overflow", EIO);
-				}
+		if (!offload)
+		{
+			processRequest(req);
 
-				req = *RING_GET_REQUEST(&mRing, rc);
+			clearError(ErrorSource::PROCESS);
 
-				mRing.req_cons = ++rc;
+			auto time = std::chrono::steady_clock::now() - startTime;
 
-				xen_mb();
+			std::lock_guard<std::mutex> lock(mDispatchMutex);
 
-				processRequest(req);
+			mInline.add(time);
+
+			return;
+		}
+
+		// keys of different ring buffers sharing the executor don't
+		// serialize each other
+		auto poolKey = key ^ reinterpret_cast<uintptr_t>(this);
+
+		mExecutor->call(poolKey, [this, req, key, startTime] {
+			processOffloaded(req, key, startTime);
+		});
+	}
+
+	void processOffloaded(const Req& req, uint64_t key, TimePoint startTime)
+	{
+		try
+		{
+			processRequest(req);
+
+			clearError(ErrorSource::PROCESS);
+		}
+		catch(const std::exception& e)
+		{
+			reportError(ErrorSource::PROCESS, e);
+		}
+
+		pushResponses();
+
+		auto time = std::chrono::steady_clock::now() - startTime;
+
+		std::lock_guard<std::mutex> lock(mDispatchMutex);
+
+		mOffloaded.add(time);
+
+		if (--mKeysInFlight[key] == 0)
+		{
+			mKeysInFlight.erase(key);
+		}
+
+		if (--mNumInFlight == 0)
+		{
+			mDispatchCondVar.notify_all();
+		}
+	}
+
+	void onReceiveIndication()
+	{
+		int numPendingRequests = 0;
+
+		do {
+			size_t consumed = 0;
+
+			if (consumeRequests(0, consumed) != 0)
+			{
+				return;
 			}
 
-			RING_FINAL_CHECK_FOR_REQUESTS(&mRing, numPendingRequests);
+			onRequestsProcessed();
+
+			numPendingRequests = finalCheckForRequests();
 		}
 		while (numPendingRequests);
 	}
+
+	bool onPoll() override
+	{
+		size_t consumed = 0;
+
+		// req_event is not updated, so the frontend doesn't notify while
+		// the ring is polled
+		if (consumeRequests(mMaxBatch, consumed) != 0)
+		{
+			// the ring is broken by the frontend, polling it again would
+			// only repeat the error
+			disablePolling();
+
+			return false;
+		}
+
+		if (!consumed)
+		{
+			return false;
+		}
+
+		onRequestsProcessed();
+
+		return true;
+	}
+
+	bool onPrepareSleep() override
+	{
+		return finalCheckForRequests();
+	}
+
+	// The Xen ring macros below read rsp_prod_pvt which may be written
+	// concurrently by the workers, they are repeated with its published copy.
+
+	unsigned int getUnconsumedRequests() const
+	{
+		unsigned int req = mRing.sring->req_prod - mRing.req_cons;
+		unsigned int rsp = RING_SIZE(&mRing) -
+			(mRing.req_cons - mRspProdPvt.load(std::memory_order_acquire));
+
+		return req < rsp ? req : rsp;
+	}
+
+	// RING_FINAL_CHECK_FOR_REQUESTS
+	int finalCheckForRequests()
+	{
+		auto numPendingRequests = getUnconsumedRequests();
+
+		if (numPendingRequests)
+		{
+			return numPendingRequests;
+		}
+
+		mRing.sring->req_event = mRing.req_cons + 1;
+
+		xen_mb();
+
+		return getUnconsumedRequests();
+	}
+
+	int consumeRequests(size_t maxBatch, size_t& consumed) noexcept
+	{
+		Req req;
+
+		auto rc = mRing.req_cons;
+		auto rp = mRing.sring->req_prod;
+
+		xen_rmb();
+
+		// the frontend produced the requests up to rp after it had seen
+		// the responses, so the value read after rp suits the overflow checks
+		auto rspProdPvt = mRspProdPvt.load(std::memory_order_acquire);
+
+		consumed = 0;
+
+		if (rc == rp)
+		{
+			return 0;
+		}
+
+		// RING_REQUEST_PROD_OVERFLOW
+		if (rp - rspProdPvt > RING_SIZE(&mRing))
+		{
+			reportError(ErrorSource::CONSUME, EIO,
+						"Ring buffer producer overflow");
+
+			return EIO;
+		}
+
+		size_t occupancy = rp - rc;
+
+		consumed = occupancy;
+
+		if (maxBatch && occupancy > maxBatch)
+		{
+			consumed = maxBatch;
+			rp = rc + consumed;
+		}
+
+		accountPass(occupancy, consumed);
+
+		while (rc != rp)
+		{
+
+			// RING_REQUEST_CONS_OVERFLOW
+			if (rc - rspProdPvt >= RING_SIZE(&mRing))
+			{
+				reportError(ErrorSource::CONSUME, EIO,
+							"Ring buffer consumer overflow");
+
+				return EIO;
+			}
+
+			req = *RING_GET_REQUEST(&mRing, rc);
+
+			mRing.req_cons = ++rc;
+
+			xen_mb();
+
+			dispatchRequest(req);
+		}
+
+		clearError(ErrorSource::CONSUME);
+
+		return 0;
+	}
+};
+
+/***************************************************************************//**
+ * Event lanes of RingBufferOutBase.
+ * @ingroup backend
+ ******************************************************************************/
+enum class EventLane
+{
+	BULK,
+	URGENT
+};
+
+/***************************************************************************//**
+ * Statistics of one RingBufferOutBase event lane.
+ * @ingroup backend
+ ******************************************************************************/
+struct EventLaneStats
+{
+	/**
+	 * Number of events made visible to the frontend
+	 */
+	uint64_t events;
+
+	/**
+	 * Number of events refused because there was no space
+	 */
+	uint64_t dropped;
+
+	/**
+	 * Number of urgent events waiting for space in the backend queue
+	 */
+	size_t pending;
+
+	/**
+	 * Average time from accepting the event till it is visible to the
+	 * frontend. Measured only if the lanes are enabled.
+	 */
+	std::chrono::microseconds avgDelay;
+
+	/**
+	 * Max time from accepting the event till it is visible to the frontend
+	 */
+	std::chrono::microseconds maxDelay;
 };
 
 /***************************************************************************//**
@@ -250,6 +991,15 @@ private:
  *
  * @snippet ExampleBackend.cpp onSomeEvent
  *
+ * Events are sent in one FIFO by default. setUrgentReserve() enables two
+ * lanes: urgent events (hot unplug, errors) are sent with EventLane::URGENT.
+ * The last ring slots are reserved for them, bulk events are refused with
+ * ENOSPC once only the reserve is free. If the ring is full, urgent events
+ * wait in a bounded backend queue. The queue is drained into the ring before
+ * any bulk event on the next send or flushEvents(), so urgent events are
+ * never overtaken by bulk ones. getLaneStats() reports the events, drops and
+ * the delay from accepting the event till it is visible to the frontend.
+ *
  * @ingroup backend
  ******************************************************************************/
 template<typename Page,typename Event>
@@ -270,7 +1020,8 @@ public:
 		mPage(static_cast<Page*>(mBuffer.get())),
 		mEventBuffer(reinterpret_cast<Event*>(
 				static_cast<uint8_t*>(mBuffer.get()) + offset)),
-		mNumEvents(size/sizeof(Event))
+		mNumEvents(size/sizeof(Event)),
+		mNumQueued(0)
 	{
 		mPage->in_prod = mPage->in_cons;
 
@@ -280,32 +1031,97 @@ public:
 	/**
 	 * Sends the event to the frontend
 	 * @param event event to the frontend
+	 * @param lane  event lane
+	 * @return 0 on success, ENOSPC if the ring is full, error code if the
+	 * frontend can't be notified
 	 */
-	void sendEvent(const Event& event)
+	int sendEvent(const Event& event,
+				  EventLane lane = EventLane::BULK) noexcept
 	{
 		std::lock_guard<std::mutex> lock(mMutex);
 
-		if (static_cast<int>(mPage->in_prod - mPage->in_cons) >= mNumEvents)
-		{
-			LOG(mLog, WARNING) << "Ring buffer overflow, port: " << getPort()
-							   <<", prod: " << mPage->in_prod
-							   << ", cons: " << mPage->in_cons;
+		// urgent events drained by the failed put are pushed as well
+		bool put = putEvent(event, lane);
+		int ret = pushEvents();
 
-			return;
+		return put ? ret : ENOSPC;
+	}
+
+	/**
+	 * Puts the event into the ring without making it visible to the
+	 * frontend. Used to batch events: the frontend sees all queued events
+	 * and gets one notification on flushEvents().
+	 * @param event event to the frontend
+	 * @param lane  event lane
+	 * @return false if the ring is full
+	 */
+	bool queueEvent(const Event& event,
+					EventLane lane = EventLane::BULK) noexcept
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+
+		return putEvent(event, lane);
+	}
+
+	/**
+	 * Moves the waiting urgent events into the ring, makes queued events
+	 * visible to the frontend and notifies it
+	 * @return 0 on success, error code if the frontend can't be notified
+	 */
+	int flushEvents() noexcept
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+
+		drainUrgent();
+
+		return pushEvents();
+	}
+
+	/**
+	 * Enables the event lanes
+	 * @param[in] reservedSlots ring slots usable only by urgent events
+	 * @param[in] maxPending    max number of urgent events waiting in the
+	 * backend queue when the ring is full
+	 */
+	void setUrgentReserve(int reservedSlots, size_t maxPending = 64)
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
+
+		if (reservedSlots < 0 || reservedSlots >= mNumEvents)
+		{
+			throw RingBufferException("Invalid number of reserved slots",
+									  EINVAL);
 		}
 
-		LOG(mLog, DEBUG) << "Send event, port: " << getPort()
-						 <<", prod: " << mPage->in_prod
-						 << ", cons: " << mPage->in_cons
-						 << ", num events: " << mNumEvents;
+		mReservedSlots = reservedSlots;
+		mMaxPending = maxPending;
 
-		mEventBuffer[mPage->in_prod % mNumEvents] = event;
+		if (mAcceptTimes.empty())
+		{
+			mAcceptTimes.resize(mNumEvents);
+			mSlotLanes.resize(mNumEvents);
+		}
+	}
 
-		mPage->in_prod++;
+	/**
+	 * Returns statistics of the lane
+	 * @param[in] lane event lane
+	 */
+	EventLaneStats getLaneStats(EventLane lane) const
+	{
+		std::lock_guard<std::mutex> lock(mMutex);
 
-		xen_wmb();
+		auto& counters = mLanes[static_cast<int>(lane)];
+		EventLaneStats stats;
 
-		mEventChannel.notify();
+		stats.events = counters.events;
+		stats.dropped = counters.dropped;
+		stats.pending = lane == EventLane::URGENT ? mPending.size() : 0;
+		stats.avgDelay = std::chrono::microseconds(
+				counters.measured ? counters.totalDelay / counters.measured : 0);
+		stats.maxDelay = std::chrono::microseconds(counters.maxDelay);
+
+		return stats;
 	}
 
 protected:
@@ -314,11 +1130,191 @@ protected:
 
 private:
 
+	// read only after construction
 	Page* mPage;
 	Event* mEventBuffer;
 	int mNumEvents;
 
-	std::mutex mMutex;
+	typedef std::chrono::steady_clock::time_point TimePoint;
+
+	struct LaneCounters
+	{
+		uint64_t events = 0;
+		uint64_t dropped = 0;
+		uint64_t measured = 0;
+		uint64_t totalDelay = 0;
+		uint64_t maxDelay = 0;
+	};
+
+	// producer block: written by the threads sending events
+	alignas(Utils::cCacheLineSize) mutable std::mutex mMutex;
+	int mNumQueued;
+	bool mOverflow = false;
+
+	int mReservedSlots = 0;
+	size_t mMaxPending = 0;
+	std::deque<std::pair<Event, TimePoint>> mPending;
+	std::vector<TimePoint> mAcceptTimes;
+	std::vector<EventLane> mSlotLanes;
+	LaneCounters mLanes[2];
+
+	bool putEvent(const Event& event, EventLane lane) noexcept
+	{
+		// urgent events are never overtaken: bulk ones wait till the
+		// backend queue is drained
+		if (!drainUrgent())
+		{
+			return lane == EventLane::URGENT ? addPending(event) :
+											   dropEvent(lane);
+		}
+
+		int reserve = lane == EventLane::BULK ? mReservedSlots : 0;
+
+		if (!putRing(event, lane, TimePoint(), reserve))
+		{
+			return lane == EventLane::URGENT ? addPending(event) :
+											   dropEvent(lane);
+		}
+
+		return true;
+	}
+
+	bool drainUrgent() noexcept
+	{
+		while (!mPending.empty())
+		{
+			if (!putRing(mPending.front().first, EventLane::URGENT,
+						 mPending.front().second, 0))
+			{
+				return false;
+			}
+
+			mPending.pop_front();
+		}
+
+		return true;
+	}
+
+	bool addPending(const Event& event) noexcept
+	{
+		if (mPending.size() >= mMaxPending)
+		{
+			return dropEvent(EventLane::URGENT);
+		}
+
+		try
+		{
+			mPending.emplace_back(event, std::chrono::steady_clock::now());
+		}
+		catch(const std::bad_alloc&)
+		{
+			return dropEvent(EventLane::URGENT);
+		}
+
+		return true;
+	}
+
+	bool dropEvent(EventLane lane) noexcept
+	{
+		mLanes[static_cast<int>(lane)].dropped++;
+
+		return false;
+	}
+
+	bool putRing(const Event& event, EventLane lane, TimePoint acceptTime,
+				 int reserve) noexcept
+	{
+		uint32_t prod = mPage->in_prod + mNumQueued;
+
+		if (static_cast<int>(prod - mPage->in_cons) >= mNumEvents - reserve)
+		{
+			// the frontend doesn't consume events, logging each dropped one
+			// would only load the backend
+			if (!mOverflow)
+			{
+				LOG(mLog, WARNING) << "Ring buffer overflow, port: "
+								   << getPort() << ", prod: " << prod
+								   << ", cons: " << mPage->in_cons;
+
+				mOverflow = true;
+			}
+
+			return false;
+		}
+
+		mOverflow = false;
+
+		LOG(mLog, DEBUG) << "Send event, port: " << getPort()
+						 <<", prod: " << prod
+						 << ", cons: " << mPage->in_cons
+						 << ", num events: " << mNumEvents;
+
+		mEventBuffer[prod % mNumEvents] = event;
+
+		// the delay is measured only if the lanes are enabled, it costs
+		// a clock read per event
+		if (!mAcceptTimes.empty())
+		{
+			mAcceptTimes[prod % mNumEvents] = acceptTime == TimePoint() ?
+					std::chrono::steady_clock::now() : acceptTime;
+			mSlotLanes[prod % mNumEvents] = lane;
+		}
+		else
+		{
+			mLanes[static_cast<int>(lane)].events++;
+		}
+
+		mNumQueued++;
+
+		return true;
+	}
+
+	void accountDelays() noexcept
+	{
+		auto now = std::chrono::steady_clock::now();
+		uint32_t prod = mPage->in_prod;
+
+		for (int i = 0; i < mNumQueued; i++, prod++)
+		{
+			auto& counters = mLanes[static_cast<int>(
+					mSlotLanes[prod % mNumEvents])];
+			uint64_t delay = std::chrono::duration_cast<
+					std::chrono::microseconds>(
+							now - mAcceptTimes[prod % mNumEvents]).count();
+
+			counters.events++;
+			counters.measured++;
+			counters.totalDelay += delay;
+
+			if (delay > counters.maxDelay)
+			{
+				counters.maxDelay = delay;
+			}
+		}
+	}
+
+	int pushEvents() noexcept
+	{
+		if (!mNumQueued)
+		{
+			return 0;
+		}
+
+		if (!mAcceptTimes.empty())
+		{
+			accountDelays();
+		}
+
+		xen_wmb();
+
+		mPage->in_prod += mNumQueued;
+
+		mNumQueued = 0;
+
+		xen_wmb();
+
+		return notify();
+	}
 };
 
 typedef std::shared_ptr<RingBufferBase> RingBufferPtr;
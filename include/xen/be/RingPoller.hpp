@@ -0,0 +1,215 @@
+/*
+ *  Ring buffer poller
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef XENBE_RINGPOLLER_HPP_
+#define XENBE_RINGPOLLER_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Log.hpp"
+#include "RingBufferBase.hpp"
+
+namespace XenBackend {
+
+/***************************************************************************//**
+ * Poller statistics.
+ * @ingroup backend
+ ******************************************************************************/
+struct RingPollerStats
+{
+	/**
+	 * Core the poller thread is bound to, negative if not bound
+	 */
+	int cpu;
+
+	/**
+	 * Number of serviced ring buffers
+	 */
+	size_t numRings;
+
+	/**
+	 * Number of passes over the ring buffers
+	 */
+	uint64_t polls;
+
+	/**
+	 * Number of passes which processed requests
+	 */
+	uint64_t busyPolls;
+
+	/**
+	 * Number of times the poller went idle
+	 */
+	uint64_t sleeps;
+
+	/**
+	 * Time spent in passes which processed requests
+	 */
+	std::chrono::microseconds busyTime;
+
+	/**
+	 * Time since the poller is started
+	 */
+	std::chrono::microseconds runTime;
+
+	/**
+	 * Busy time to run time ratio
+	 */
+	double utilization;
+};
+
+/***************************************************************************//**
+ * Services many ring buffers from one pinned thread without event channels.
+ *
+ * The poller thread round-robins over the added ring buffers and checks
+ * their producer indexes directly. While the rings are polled, the frontend
+ * notifications stay disabled. When no requests arrive during the idle
+ * timeout, the poller re-enables the notifications of all rings and sleeps
+ * till any of their event channels wakes it up.
+ *
+ * Ring buffers should be added before they are started and removed before
+ * they are stopped. Only pollable ring buffers (RingBufferInBase) can be
+ * added.
+ *
+ * @code
+ * RingPollerPtr poller(new RingPoller(2));
+ *
+ * poller->start();
+ *
+ * poller->addRing(ringBuffer);
+ *
+ * ringBuffer->start();
+ * @endcode
+ * @ingroup backend
+ ******************************************************************************/
+class RingPoller
+{
+public:
+
+	/**
+	 * @param[in] cpu         core to bind the poller thread to, negative
+	 * value means any core
+	 * @param[in] idleTimeout time without requests after which the poller
+	 * goes idle
+	 */
+	explicit RingPoller(int cpu = -1,
+						std::chrono::microseconds idleTimeout =
+								std::chrono::microseconds(200));
+	RingPoller(const RingPoller&) = delete;
+	RingPoller& operator=(RingPoller const&) = delete;
+	~RingPoller();
+
+	/**
+	 * Starts the poller thread
+	 */
+	void start();
+
+	/**
+	 * Stops the poller thread
+	 */
+	void stop();
+
+	/**
+	 * Adds the ring buffer and switches it to the polling mode
+	 * @param[in] ringBuffer ring buffer
+	 */
+	void addRing(RingBufferPtr ringBuffer);
+
+	/**
+	 * Removes the ring buffer. When it returns, the ring buffer is not
+	 * accessed by the poller.
+	 * @param[in] ringBuffer ring buffer
+	 */
+	void removeRing(RingBufferPtr ringBuffer);
+
+	/**
+	 * Returns number of serviced ring buffers
+	 */
+	size_t getNumRings() const;
+
+	/**
+	 * Returns serviced ring buffers
+	 */
+	std::vector<RingBufferPtr> getRings() const;
+
+	/**
+	 * Sets time without requests after which the poller goes idle
+	 */
+	void setIdleTimeout(std::chrono::microseconds idleTimeout)
+	{
+		mIdleTimeoutUs = idleTimeout.count();
+	}
+
+	/**
+	 * Returns time without requests after which the poller goes idle
+	 */
+	std::chrono::microseconds getIdleTimeout() const
+	{
+		return std::chrono::microseconds(mIdleTimeoutUs);
+	}
+
+	/**
+	 * Returns poller statistics
+	 */
+	RingPollerStats getStats() const;
+
+private:
+
+	typedef std::chrono::steady_clock::time_point TimePoint;
+
+	int mCpu;
+	std::atomic<int64_t> mIdleTimeoutUs;
+
+	std::vector<RingBufferPtr> mRings;
+	mutable std::mutex mMutex;
+
+	std::atomic_bool mTerminate;
+	bool mWakeup;
+	std::mutex mWakeMutex;
+	std::condition_variable mCondVar;
+
+	std::thread mThread;
+
+	TimePoint mStartTime;
+	std::atomic<uint64_t> mPolls;
+	std::atomic<uint64_t> mBusyPolls;
+	std::atomic<uint64_t> mSleeps;
+	std::atomic<uint64_t> mBusyTimeNs;
+
+	Log mLog;
+
+	void wake();
+	bool pollRings();
+	bool prepareSleep();
+	void sleep();
+	void run();
+};
+
+typedef std::shared_ptr<RingPoller> RingPollerPtr;
+
+}
+
+#endif /* XENBE_RINGPOLLER_HPP_ */
@@ -0,0 +1,300 @@
+/*
+ *  Ring buffer scheduler
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef XENBE_RINGSCHEDULER_HPP_
+#define XENBE_RINGSCHEDULER_HPP_
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "Log.hpp"
+#include "RingBufferBase.hpp"
+
+namespace XenBackend {
+
+/***************************************************************************//**
+ * Latency class statistics.
+ * @ingroup backend
+ ******************************************************************************/
+struct LatencyClassStats
+{
+	/**
+	 * Class name
+	 */
+	std::string name;
+
+	/**
+	 * Deadline budget
+	 */
+	std::chrono::microseconds deadline;
+
+	/**
+	 * Number of ring buffers in the class
+	 */
+	size_t numRings;
+
+	/**
+	 * Number of passes which processed requests
+	 */
+	uint64_t passes;
+
+	/**
+	 * Number of passes which processed requests after the deadline
+	 */
+	uint64_t misses;
+
+	/**
+	 * Average time from the wake up to the start of the pass
+	 */
+	std::chrono::microseconds avgWait;
+
+	/**
+	 * Max time the pass finished after the deadline
+	 */
+	std::chrono::microseconds maxLateness;
+};
+
+/***************************************************************************//**
+ * Scheduler statistics.
+ * @ingroup backend
+ ******************************************************************************/
+struct RingSchedulerStats
+{
+	/**
+	 * Number of worker threads
+	 */
+	size_t numWorkers;
+
+	/**
+	 * Number of serviced ring buffers
+	 */
+	size_t numRings;
+
+	/**
+	 * Number of ring buffers waiting for a worker
+	 */
+	size_t pending;
+
+	/**
+	 * Number of passes over the ring buffers
+	 */
+	uint64_t dispatches;
+
+	/**
+	 * Statistics per latency class in the order the classes are added
+	 */
+	std::vector<LatencyClassStats> classes;
+};
+
+/***************************************************************************//**
+ * Services ring buffers of many frontends from a shared set of worker threads
+ * in the earliest deadline first order.
+ *
+ * Each ring buffer is tagged with a latency class which defines its deadline
+ * budget. When the event channel of an idle ring buffer fires, the ring gets
+ * the deadline of the event time plus the budget and is queued. A free worker
+ * takes the queued ring with the earliest deadline and processes up to
+ * RingBufferBase::getMaxBatch() requests in one pass. If the pass processed
+ * requests, the ring is queued again with a new deadline, so a busy ring
+ * doesn't hold a worker while other rings wait. Otherwise the frontend
+ * notifications are re-enabled and the ring waits for the next event.
+ *
+ * A pass which processed requests and finished after the deadline is counted
+ * as a miss of the ring's class.
+ *
+ * Ring buffers should be added before they are started and removed before
+ * they are stopped. Only pollable ring buffers (RingBufferInBase) can be
+ * added.
+ *
+ * @code
+ * RingSchedulerPtr scheduler(new RingScheduler(2));
+ *
+ * auto interactive = scheduler->addClass("interactive",
+ *                                        std::chrono::microseconds(100));
+ * auto bulk = scheduler->addClass("bulk", std::chrono::milliseconds(5));
+ *
+ * scheduler->start();
+ *
+ * scheduler->addRing(ringBuffer, interactive);
+ *
+ * ringBuffer->start();
+ * @endcode
+ * @ingroup backend
+ ******************************************************************************/
+class RingScheduler
+{
+public:
+
+	/**
+	 * @param[in] numWorkers number of worker threads
+	 * @param[in] cpus       cores to bind the workers to: worker N is bound
+	 * to cpus[N % cpus.size()], empty list means any core
+	 */
+	explicit RingScheduler(size_t numWorkers = 1,
+						   const std::vector<int>& cpus = {});
+	RingScheduler(const RingScheduler&) = delete;
+	RingScheduler& operator=(RingScheduler const&) = delete;
+	~RingScheduler();
+
+	/**
+	 * Starts the worker threads
+	 */
+	void start();
+
+	/**
+	 * Stops the worker threads
+	 */
+	void stop();
+
+	/**
+	 * Adds latency class
+	 * @param[in] name     class name
+	 * @param[in] deadline deadline budget
+	 * @return class id to be passed to addRing()
+	 */
+	int addClass(const std::string& name, std::chrono::microseconds deadline);
+
+	/**
+	 * Changes deadline budget of the class. The ring buffers already queued
+	 * keep their deadlines.
+	 * @param[in] latencyClass class id
+	 * @param[in] deadline     deadline budget
+	 */
+	void setDeadline(int latencyClass, std::chrono::microseconds deadline);
+
+	/**
+	 * Returns number of latency classes
+	 */
+	size_t getNumClasses() const;
+
+	/**
+	 * Adds the ring buffer and switches it to the polling mode
+	 * @param[in] ringBuffer   ring buffer
+	 * @param[in] latencyClass class id returned by addClass()
+	 */
+	void addRing(RingBufferPtr ringBuffer, int latencyClass);
+
+	/**
+	 * Removes the ring buffer. When it returns, the ring buffer is not
+	 * accessed by the workers and its wake callback is not called.
+	 * @param[in] ringBuffer ring buffer
+	 */
+	void removeRing(RingBufferPtr ringBuffer);
+
+	/**
+	 * Returns number of serviced ring buffers
+	 */
+	size_t getNumRings() const;
+
+	/**
+	 * Returns scheduler statistics
+	 */
+	RingSchedulerStats getStats() const;
+
+private:
+
+	typedef std::chrono::steady_clock::time_point TimePoint;
+
+	enum class State
+	{
+		IDLE,
+		QUEUED,
+		RUNNING
+	};
+
+	struct Entry
+	{
+		RingBufferPtr ring;
+		int latencyClass;
+		State state;
+		bool rearm;
+		bool removed;
+		TimePoint release;
+		TimePoint deadline;
+	};
+
+	typedef std::shared_ptr<Entry> EntryPtr;
+
+	struct Job
+	{
+		TimePoint deadline;
+		uint64_t seq;
+		EntryPtr entry;
+
+		bool operator<(const Job& other) const
+		{
+			// std::priority_queue pops the largest element first
+			if (deadline != other.deadline)
+			{
+				return deadline > other.deadline;
+			}
+
+			return seq > other.seq;
+		}
+	};
+
+	struct Class
+	{
+		std::string name;
+		std::chrono::microseconds deadline;
+		size_t numRings;
+		uint64_t passes;
+		uint64_t misses;
+		std::chrono::nanoseconds waitTime;
+		std::chrono::nanoseconds maxLateness;
+	};
+
+	size_t mNumWorkers;
+	std::vector<int> mCpus;
+
+	mutable std::mutex mMutex;
+	std::condition_variable mCondVar;
+	std::condition_variable mIdleCondVar;
+	bool mTerminate;
+
+	std::vector<Class> mClasses;
+	std::unordered_map<RingBufferBase*, EntryPtr> mEntries;
+	std::priority_queue<Job> mQueue;
+	uint64_t mSeq;
+	uint64_t mDispatches;
+
+	std::vector<std::thread> mThreads;
+
+	Log mLog;
+
+	void wake(EntryPtr entry);
+	void queue(EntryPtr entry, TimePoint now);
+	void dequeue(EntryPtr entry);
+	void account(Entry& entry, TimePoint start, TimePoint end);
+	void run();
+};
+
+typedef std::shared_ptr<RingScheduler> RingSchedulerPtr;
+
+}
+
+#endif /* XENBE_RINGSCHEDULER_HPP_ */
@@ -0,0 +1,536 @@
+/*
+ *  Xen sound device backend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef XENBE_SNDIFBACKEND_HPP_
+#define XENBE_SNDIFBACKEND_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <xenctrl.h>
+#include <xen/io/sndif.h>
+}
+
+#include "BackendBase.hpp"
+#include "Exception.hpp"
+#include "FrontendHandlerBase.hpp"
+#include "Log.hpp"
+#include "RingBufferBase.hpp"
+#include "Utils.hpp"
+#include "XenGnttab.hpp"
+
+namespace XenBackend {
+
+/***************************************************************************//**
+ * @defgroup sndif Sound device backend
+ * Ready to use sndif backend built on the library primitives.
+ ******************************************************************************/
+
+/***************************************************************************//**
+ * Exception generated by sndif backend.
+ * @ingroup sndif
+ ******************************************************************************/
+class SndifException : public Exception
+{
+	using Exception::Exception;
+};
+
+/***************************************************************************//**
+ * Sndif backend configuration.
+ * @ingroup sndif
+ ******************************************************************************/
+struct SndifConfig
+{
+	/**
+	 * Mixer rate. Streams are not resampled, so the frontend is allowed to
+	 * open streams with this rate only.
+	 */
+	unsigned int rate = 48000;
+
+	/**
+	 * Mixer channels. Mono streams are duplicated to all channels.
+	 */
+	unsigned int channels = 2;
+
+	/**
+	 * Mixer output format (XENSND_PCM_FORMAT_...)
+	 */
+	uint8_t format = XENSND_PCM_FORMAT_S16_LE;
+
+	/**
+	 * Number of frames mixed on each period clock tick
+	 */
+	unsigned int periodFrames = 480;
+
+	/**
+	 * File the mixed output is written to
+	 */
+	std::string sinkPath = "/dev/null";
+
+	/**
+	 * Runs the period clock thread with SCHED_FIFO priority if permitted
+	 */
+	bool realtime = false;
+};
+
+/***************************************************************************//**
+ * Sndif statistics.
+ * @ingroup sndif
+ ******************************************************************************/
+struct SndifStats
+{
+	uint64_t periods;
+	uint64_t missedPeriods;
+	uint64_t maxLatenessUs;
+	uint64_t underruns;
+	uint64_t posEvents;
+	uint64_t eventBatches;
+};
+
+/***************************************************************************//**
+ * PCM format conversion and mixing.
+ *
+ * Samples are converted to float, mixed and converted back. The inner loops
+ * operate on 16 bytes vectors (GCC vector extensions), which are compiled to
+ * SSE or NEON instructions depending on the target.
+ * @ingroup sndif
+ ******************************************************************************/
+class SndifMixer
+{
+public:
+
+	/**
+	 * Returns bit mask of supported formats (1 << XENSND_PCM_FORMAT_...)
+	 */
+	static uint64_t getFormats();
+
+	/**
+	 * Returns sample size in bytes or 0 if the format is not supported
+	 * @param[in] format XENSND_PCM_FORMAT_...
+	 */
+	static size_t getSampleSize(uint8_t format);
+
+	/**
+	 * Converts samples to float in range [-1.0, 1.0)
+	 * @param[in]  format  source format
+	 * @param[in]  src     source samples
+	 * @param[out] dst     converted samples
+	 * @param[in]  samples number of samples
+	 */
+	static void toFloat(uint8_t format, const void* src, float* dst,
+						size_t samples);
+
+	/**
+	 * Converts float samples to the format, out of range samples are
+	 * clipped
+	 * @param[in]  format  destination format
+	 * @param[in]  src     float samples
+	 * @param[out] dst     converted samples
+	 * @param[in]  samples number of samples
+	 */
+	static void fromFloat(uint8_t format, const float* src, void* dst,
+						  size_t samples);
+
+	/**
+	 * Adds samples to the accumulator
+	 * @param[in,out] acc     accumulator
+	 * @param[in]     src     samples to add
+	 * @param[in]     samples number of samples
+	 */
+	static void mix(float* acc, const float* src, size_t samples);
+};
+
+/***************************************************************************//**
+ * Low jitter period clock.
+ *
+ * Unlike Timer, which sleeps on a condition variable for a relative time,
+ * the clock is driven by timerfd with absolute CLOCK_MONOTONIC deadlines.
+ * The period doesn't drift with the callback execution time and a late
+ * wake up doesn't shift next deadlines. If periods are missed, the callback
+ * is called for each of them so the stream positions stay in time.
+ * @ingroup sndif
+ ******************************************************************************/
+class SndifPeriodClock
+{
+public:
+
+	typedef std::function<void()> Callback;
+
+	/**
+	 * @param[in] callback called on each period
+	 * @param[in] realtime run the clock thread with SCHED_FIFO priority
+	 */
+	SndifPeriodClock(Callback callback, bool realtime = false);
+	SndifPeriodClock(const SndifPeriodClock&) = delete;
+	SndifPeriodClock& operator=(SndifPeriodClock const&) = delete;
+	~SndifPeriodClock();
+
+	/**
+	 * Starts the clock
+	 * @param[in] period clock period
+	 */
+	void start(std::chrono::nanoseconds period);
+
+	/**
+	 * Stops the clock. The callback is not called after this method returns.
+	 */
+	void stop();
+
+	/**
+	 * Returns number of periods (callback calls)
+	 */
+	uint64_t getPeriods() const { return mPeriods; }
+
+	/**
+	 * Returns number of periods which were handled late by one period or
+	 * more
+	 */
+	uint64_t getMissedPeriods() const { return mMissedPeriods; }
+
+	/**
+	 * Returns max wake up lateness
+	 */
+	std::chrono::microseconds getMaxLateness() const
+	{
+		return std::chrono::microseconds(mMaxLatenessUs);
+	}
+
+private:
+
+	Callback mCallback;
+	bool mRealtime;
+	int mFd;
+	std::chrono::nanoseconds mPeriod;
+	std::unique_ptr<PollFd> mPollFd;
+	std::thread mThread;
+
+	uint64_t mDeadline;
+
+	std::atomic<uint64_t> mPeriods;
+	std::atomic<uint64_t> mMissedPeriods;
+	std::atomic<uint64_t> mMaxLatenessUs;
+
+	Log mLog;
+
+	void run();
+	void setRealtime();
+};
+
+/***************************************************************************//**
+ * Output of the mixed playback streams.
+ * @ingroup sndif
+ ******************************************************************************/
+class SndifSink
+{
+public:
+
+	virtual ~SndifSink() {}
+
+	/**
+	 * Writes one period of mixed samples. Is called from the period clock
+	 * thread and must not block for longer than the period.
+	 * @param[in] data samples in SndifConfig::format
+	 * @param[in] size size in bytes
+	 */
+	virtual void write(const void* data, size_t size) = 0;
+};
+
+typedef std::shared_ptr<SndifSink> SndifSinkPtr;
+
+/***************************************************************************//**
+ * File sink. Writes raw samples to the file, the file may be a FIFO or a
+ * device (e.g. /dev/null).
+ * @ingroup sndif
+ ******************************************************************************/
+class SndifFileSink : public SndifSink
+{
+public:
+
+	/**
+	 * @param[in] path file path
+	 */
+	explicit SndifFileSink(const std::string& path);
+	SndifFileSink(const SndifFileSink&) = delete;
+	SndifFileSink& operator=(SndifFileSink const&) = delete;
+	~SndifFileSink();
+
+	void write(const void* data, size_t size) override;
+
+private:
+
+	int mFd;
+	std::string mPath;
+	Log mLog;
+};
+
+/***************************************************************************//**
+ * Event ring buffer of the sndif stream.
+ * @ingroup sndif
+ ******************************************************************************/
+typedef RingBufferOutBase<xensnd_event_page, xensnd_evt> SndifEventRingBuffer;
+
+typedef std::shared_ptr<SndifEventRingBuffer> SndifEventRingBufferPtr;
+
+/***************************************************************************//**
+ * Sndif stream (one PCM substream of the frontend).
+ *
+ * On open the PCM buffer is mapped once from the gref directory. Playback
+ * samples are taken by the mixer directly from the mapped buffer, capture
+ * samples are written into it, so no copy is made on read and write
+ * requests. Position events are queued when at least one frontend period is
+ * passed and flushed together after the mixer period is done.
+ * @ingroup sndif
+ ******************************************************************************/
+class SndifStream
+{
+public:
+
+	/**
+	 * @param[in] domId    frontend domain id
+	 * @param[in] playback <i>true</i> for playback stream
+	 * @param[in] config   backend configuration
+	 */
+	SndifStream(domid_t domId, bool playback, const SndifConfig& config);
+	~SndifStream();
+
+	/**
+	 * Returns <i>true</i> for playback stream
+	 */
+	bool isPlayback() const { return mPlayback; }
+
+	/**
+	 * Sets the event ring buffer used to send position events
+	 * @param[in] eventRing event ring buffer
+	 */
+	void setEventRing(SndifEventRingBufferPtr eventRing);
+
+	/**
+	 * Handles the request
+	 * @param[in]  req request
+	 * @param[out] rsp response, the status is set by this method
+	 */
+	void processRequest(const xensnd_req& req, xensnd_resp& rsp);
+
+	/**
+	 * Adds one mixer period of the running playback stream to the
+	 * accumulator
+	 * @param[in,out] acc     float accumulator (frames * mixer channels)
+	 * @param[in]     scratch scratch buffer of the same size
+	 * @param[in]     frames  number of frames
+	 */
+	void mixPeriod(float* acc, float* scratch, size_t frames);
+
+	/**
+	 * Produces one mixer period of the running capture stream
+	 * @param[in] frames number of frames
+	 */
+	void capturePeriod(size_t frames);
+
+	/**
+	 * Sends queued position events with one notification
+	 * @return number of sent events
+	 */
+	size_t flushEvents();
+
+	/**
+	 * Returns number of underruns
+	 */
+	uint64_t getUnderruns() const;
+
+private:
+
+	static const size_t cGrefsPerDirPage =
+		(XC_PAGE_SIZE - offsetof(xensnd_page_directory, gref)) /
+		sizeof(grant_ref_t);
+
+	domid_t mDomId;
+	bool mPlayback;
+	SndifConfig mConfig;
+	SndifEventRingBufferPtr mEventRing;
+
+	std::unique_ptr<XenGnttabBuffer> mBuffer;
+	size_t mBufferSize;
+	size_t mPeriodSize;
+	uint8_t mFormat;
+	unsigned int mChannels;
+	size_t mFrameSize;
+
+	bool mRunning;
+	uint64_t mWritten;
+	uint64_t mPosition;
+	uint64_t mEventPosition;
+	size_t mQueuedEvents;
+	uint16_t mEventId;
+	uint64_t mUnderruns;
+
+	mutable std::mutex mMutex;
+	Log mLog;
+
+	int open(const xensnd_open_req& req);
+	void close();
+	int write(const xensnd_rw_req& req);
+	int read(const xensnd_rw_req& req);
+	int trigger(const xensnd_trigger_req& req);
+	void queryHwParam(const xensnd_query_hw_param& req,
+					  xensnd_query_hw_param& rsp);
+
+	GrantRefs readDirectory(grant_ref_t dirRef, size_t numPages);
+	void advance(size_t bytes);
+	void queueEvent();
+	void reset();
+};
+
+typedef std::shared_ptr<SndifStream> SndifStreamPtr;
+
+/***************************************************************************//**
+ * Sndif request ring buffer of the stream.
+ * @ingroup sndif
+ ******************************************************************************/
+class SndifRingBuffer : public RingBufferInBase<xen_sndif_back_ring,
+												xen_sndif_sring, xensnd_req,
+												xensnd_resp>
+{
+public:
+
+	/**
+	 * @param[in] domId  frontend domain id
+	 * @param[in] port   event channel port number
+	 * @param[in] ref    ring grant reference
+	 * @param[in] stream stream the requests are passed to
+	 */
+	SndifRingBuffer(domid_t domId, evtchn_port_t port, grant_ref_t ref,
+					SndifStreamPtr stream);
+
+private:
+
+	SndifStreamPtr mStream;
+
+	void processRequest(const xensnd_req& req) override;
+};
+
+/***************************************************************************//**
+ * Sndif frontend handler.
+ *
+ * Reads the streams of all PCM devices of the frontend, connects their
+ * rings and mixes the running playback streams into the sink on the period
+ * clock. Position events of all streams are sent after the period is mixed.
+ * @ingroup sndif
+ ******************************************************************************/
+class SndifFrontendHandler : public FrontendHandlerBase
+{
+public:
+
+	/**
+	 * @param[in] devName device name
+	 * @param[in] beDomId backend domain id
+	 * @param[in] feDomId frontend domain id
+	 * @param[in] devId   device id
+	 * @param[in] config  backend configuration
+	 */
+	SndifFrontendHandler(const std::string& devName, domid_t beDomId,
+						 domid_t feDomId, uint16_t devId,
+						 const SndifConfig& config = SndifConfig());
+	~SndifFrontendHandler();
+
+	/**
+	 * Returns statistics
+	 */
+	SndifStats getStats();
+
+protected:
+
+	void onBind() override;
+	void onClosing() override;
+
+	/**
+	 * Creates the sink, may be overridden to provide custom output
+	 */
+	virtual SndifSinkPtr createSink();
+
+	/**
+	 * Returns backend configuration
+	 */
+	const SndifConfig& getConfig() const { return mConfig; }
+
+private:
+
+	SndifConfig mConfig;
+	SndifSinkPtr mSink;
+	std::vector<SndifStreamPtr> mStreams;
+	std::mutex mStreamsMutex;
+
+	std::vector<float> mAcc;
+	std::vector<float> mScratch;
+	std::vector<uint8_t> mOutput;
+
+	uint64_t mPosEvents;
+	uint64_t mEventBatches;
+
+	SndifPeriodClock mClock;
+
+	Log mLog;
+
+	void createStream(const std::string& path);
+	void onPeriod();
+};
+
+/***************************************************************************//**
+ * Sndif backend.
+ *
+ * Creates SndifFrontendHandler for each new vsnd frontend.
+ *
+ * @code
+ * SndifBackend backend;
+ *
+ * backend.start();
+ * @endcode
+ * @ingroup sndif
+ ******************************************************************************/
+class SndifBackend : public BackendBase
+{
+public:
+
+	/**
+	 * @param[in] name    optional backend name
+	 * @param[in] config  backend configuration
+	 * @param[in] devName device name
+	 */
+	SndifBackend(const std::string& name = "SndifBackend",
+				 const SndifConfig& config = SndifConfig(),
+				 const std::string& devName = "vsnd");
+
+private:
+
+	SndifConfig mConfig;
+
+	void onNewFrontend(domid_t domId, uint16_t devId) override;
+};
+
+}
+
+#endif /* XENBE_SNDIFBACKEND_HPP_ */
@@ -0,0 +1,296 @@
+/*
+ *  Staging buffer pool
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef XENBE_STAGINGPOOL_HPP_
+#define XENBE_STAGINGPOOL_HPP_
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "Log.hpp"
+
+namespace XenBackend {
+
+/***************************************************************************//**
+ * Statistics of one size class of StagingPool.
+ * @ingroup backend
+ ******************************************************************************/
+struct StagingClassStats
+{
+	/**
+	 * Buffer size of the class
+	 */
+	size_t size;
+
+	/**
+	 * Number of allocations served from the free lists
+	 */
+	uint64_t hits;
+
+	/**
+	 * Number of allocations which carved a new buffer or fell back to the
+	 * system allocator
+	 */
+	uint64_t misses;
+
+	/**
+	 * Number of pool buffers in use
+	 */
+	size_t inUse;
+
+	/**
+	 * Number of pool buffers in the free lists
+	 */
+	size_t free;
+};
+
+/***************************************************************************//**
+ * Statistics of StagingPool.
+ *
+ * Hit rate is hits / (hits + misses), occupancy is inUseBytes / reservedBytes.
+ * @ingroup backend
+ ******************************************************************************/
+struct StagingStats
+{
+	/**
+	 * Per size class statistics
+	 */
+	std::vector<StagingClassStats> classes;
+
+	/**
+	 * Sum of the class hits
+	 */
+	uint64_t hits;
+
+	/**
+	 * Sum of the class misses
+	 */
+	uint64_t misses;
+
+	/**
+	 * Number of allocations served by the system allocator: larger than the
+	 * largest class or over the reserve limit
+	 */
+	uint64_t fallbacks;
+
+	/**
+	 * Bytes of the mapped chunks
+	 */
+	size_t reservedBytes;
+
+	/**
+	 * Bytes of the pool buffers in use
+	 */
+	size_t inUseBytes;
+
+	/**
+	 * Number of mapped chunks
+	 */
+	size_t chunks;
+
+	/**
+	 * Number of chunks backed by huge pages
+	 */
+	size_t hugeChunks;
+};
+
+/***************************************************************************//**
+ * Local buffer taken from StagingPool. Returns the buffer to the pool when
+ * destroyed.
+ * @ingroup backend
+ ******************************************************************************/
+class StagingBuffer
+{
+public:
+
+	StagingBuffer() : mData(nullptr), mSize(0), mClass(-1), mNode(0) {}
+	StagingBuffer(StagingBuffer&& other) noexcept;
+	StagingBuffer& operator=(StagingBuffer&& other) noexcept;
+	StagingBuffer(const StagingBuffer&) = delete;
+	StagingBuffer& operator=(StagingBuffer const&) = delete;
+	~StagingBuffer() { release(); }
+
+	/**
+	 * Returns buffer data, nullptr if the buffer is empty
+	 */
+	void* get() const { return mData; }
+
+	/**
+	 * Returns requested size
+	 */
+	size_t size() const { return mSize; }
+
+	/**
+	 * Returns the pool size class, negative if the buffer is allocated by
+	 * the system allocator
+	 */
+	int getClass() const { return mClass; }
+
+	/**
+	 * Returns the buffer to the pool
+	 */
+	void release();
+
+private:
+
+	friend class StagingPool;
+
+	StagingBuffer(void* data, size_t size, int sizeClass, int node) :
+		mData(data), mSize(size), mClass(sizeClass), mNode(node) {}
+
+	void* mData;
+	size_t mSize;
+	int mClass;
+	int mNode;
+};
+
+/***************************************************************************//**
+ * Process wide pool of local buffers used to stage the data copied from or
+ * to the grant pages.
+ *
+ * The buffers are carved from 2 MiB chunks mapped with huge pages if
+ * hugetlbfs pages are reserved, otherwise with transparent huge pages
+ * advised. Each NUMA node has its own chunks and free lists: the buffer is
+ * carved from the node the allocating thread runs on and the chunk is
+ * populated by that thread, so the first touch places it on the node.
+ *
+ * Buffers come in fixed size classes matched to PV segment sizes: one page,
+ * a blkif request of BLKIF_MAX_SEGMENTS_PER_REQUEST pages, a netif packet and
+ * a max 9pfs message. The request is rounded up to the class. Each thread
+ * keeps a small free list per class, released buffers of other nodes and
+ * the free list overflow go back to the node free lists. Larger requests and
+ * requests over the reserve limit are served by the system allocator.
+ *
+ * @code
+ * auto buffer = StagingPool::getInstance().alloc(size);
+ *
+ * memcpy(buffer.get(), pages.get(), size);
+ * @endcode
+ * @ingroup backend
+ ******************************************************************************/
+class StagingPool
+{
+public:
+
+	/**
+	 * Number of size classes
+	 */
+	static const int cNumClasses = 4;
+
+	/**
+	 * Returns the process pool
+	 */
+	static StagingPool& getInstance();
+
+	/**
+	 * Returns the buffer of the size class fitting the size
+	 * @param[in] size required size
+	 */
+	StagingBuffer alloc(size_t size);
+
+	/**
+	 * Sets max bytes of the mapped chunks. Already mapped chunks are kept.
+	 * @param[in] maxReserved max bytes
+	 */
+	void setMaxReserved(size_t maxReserved);
+
+	/**
+	 * Returns max bytes of the mapped chunks
+	 */
+	size_t getMaxReserved() const { return mMaxReserved; }
+
+	/**
+	 * Returns buffer size of the size class
+	 * @param[in] sizeClass size class
+	 */
+	static size_t getClassSize(int sizeClass);
+
+	/**
+	 * Returns statistics
+	 */
+	StagingStats getStats() const;
+
+private:
+
+	friend class StagingBuffer;
+
+	static const size_t cChunkSize = 2 * 1024 * 1024;
+	static const size_t cDefaultMaxReserved = 64 * 1024 * 1024;
+	static const size_t cThreadCacheBytes = 1024 * 1024;
+
+	struct Node
+	{
+		std::mutex mutex;
+		std::vector<void*> freeLists[cNumClasses];
+		uint8_t* chunk = nullptr;
+		size_t chunkLeft = 0;
+	};
+
+	struct ClassCounters
+	{
+		std::atomic<uint64_t> hits;
+		std::atomic<uint64_t> misses;
+		std::atomic<size_t> inUse;
+		std::atomic<size_t> free;
+	};
+
+	struct ThreadCache
+	{
+		int node;
+		std::vector<void*> lists[cNumClasses];
+
+		explicit ThreadCache(int node) : node(node) {}
+		~ThreadCache();
+	};
+
+	StagingPool();
+	StagingPool(const StagingPool&) = delete;
+	StagingPool& operator=(StagingPool const&) = delete;
+
+	std::vector<std::unique_ptr<Node>> mNodes;
+	ClassCounters mCounters[cNumClasses];
+
+	std::atomic<size_t> mMaxReserved;
+	std::atomic<size_t> mReserved;
+	std::atomic<size_t> mChunks;
+	std::atomic<size_t> mHugeChunks;
+	std::atomic<uint64_t> mFallbacks;
+	std::atomic_bool mHugeWarned;
+
+	Log mLog;
+
+	static int getSizeClass(size_t size);
+	static size_t getCacheSize(int sizeClass);
+	int getCurrentNode() const;
+	ThreadCache& getThreadCache();
+	StagingBuffer allocFallback(size_t size, int sizeClass);
+	void* allocFromNode(int sizeClass, int node);
+	void carve(Node& node, int sizeClass);
+	bool mapChunk(Node& node);
+	void free(void* data, int sizeClass, int node);
+	void flush(std::vector<void*>& list, int sizeClass, int node,
+			   size_t count);
+};
+
+}
+
+#endif /* XENBE_STAGINGPOOL_HPP_ */
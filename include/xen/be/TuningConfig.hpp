@@ -0,0 +1,219 @@
+/*
+ *  Runtime tuning configuration
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef XENBE_TUNINGCONFIG_HPP_
+#define XENBE_TUNINGCONFIG_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "BackendBase.hpp"
+#include "Exception.hpp"
+#include "FrontendHandlerBase.hpp"
+#include "Log.hpp"
+#include "Utils.hpp"
+#include "XenStore.hpp"
+
+namespace XenBackend {
+
+/***************************************************************************//**
+ * Exception generated by TuningConfig.
+ * @ingroup backend
+ ******************************************************************************/
+class TuningConfigException : public Exception
+{
+	using Exception::Exception;
+};
+
+/***************************************************************************//**
+ * Tuning knobs of the backend which can be changed without restart.
+ *
+ * The configuration is read from a local file and optionally from a Xen store
+ * subtree. The file consists of "key = value" lines grouped into scope
+ * sections, '#' starts a comment:
+ *
+ * @code
+ * # backend wide
+ * log-level = info
+ * poller-idle-timeout = 100
+ *
+ * [dom-5]
+ * ring-max-batch = 32
+ *
+ * [dom-5/dev-0]
+ * queue-cpus = 2,3
+ *
+ * [dom-5/dev-0/ring-1]
+ * ring-cpu = 4
+ * @endcode
+ *
+ * The Xen store subtree uses the same layout: global keys are placed directly
+ * in the subtree, scoped keys in the "dom-N", "dom-N/dev-M" and
+ * "dom-N/dev-M/ring-K" subdirectories. Xen store values override the file
+ * values of the same scope, the value of the most specific scope is used.
+ * Rings are numbered in the order they are added by the frontend handler.
+ *
+ * Knobs:
+ *
+ * <table>
+ * <tr><th>Key                 <th>Max scope <th>Applied by
+ * <tr><td>log-level           <td>global    <td>Log::setLogLevel()
+ * <tr><td>log-mask            <td>global    <td>Log::setLogMask()
+ * <tr><td>poller-idle-timeout <td>dev       <td>RingPoller::setIdleTimeout()
+ *                                               of the handler pollers, us
+ * <tr><td>queue-cpus          <td>dev       <td>
+ *                                    FrontendHandlerBase::setQueueCpus()
+ * <tr><td>ring-max-batch      <td>ring      <td>RingBufferBase::setMaxBatch()
+ * <tr><td>ring-cpu            <td>ring      <td>RingBufferBase::setCpu()
+ * </table>
+ *
+ * Log settings are taken by the log instances created after they are
+ * applied. Removed knobs keep their last applied values.
+ *
+ * The configuration is applied to the handlers of the backend passed to
+ * attach(): to the running ones at once and to each handler on connect,
+ * before the frontend is notified. After start() the file is checked for
+ * modification periodically and the Xen store subtree is watched; on change
+ * the configuration is reloaded and applied again. The file should be replaced
+ * atomically (written to a temporary file and renamed), otherwise a partially
+ * written file may be applied. Unknown keys and invalid values fail the
+ * initial load with the exception, on reload they are logged and the previous
+ * configuration is kept.
+ *
+ * @code
+ * TuningConfig config("/etc/xen/vbd-tuning.conf",
+ *                     "/local/domain/0/tuning/vbd");
+ *
+ * config.attach(backend);
+ * config.start();
+ * @endcode
+ * @ingroup backend
+ ******************************************************************************/
+class TuningConfig
+{
+public:
+
+	/**
+	 * Loads the configuration.
+	 * @param[in] fileName configuration file name, empty if not used
+	 * @param[in] xsPath   Xen store subtree path, empty if not used
+	 */
+	TuningConfig(const std::string& fileName,
+				 const std::string& xsPath = "");
+	TuningConfig(const TuningConfig&) = delete;
+	TuningConfig& operator=(TuningConfig const&) = delete;
+	~TuningConfig();
+
+	/**
+	 * Starts monitoring the configuration sources for changes
+	 * @param[in] period file check period
+	 */
+	void start(std::chrono::milliseconds period =
+					std::chrono::milliseconds(1000));
+
+	/**
+	 * Stops monitoring the configuration sources
+	 */
+	void stop();
+
+	/**
+	 * Reads the configuration sources and applies the changed configuration
+	 * to the attached backends.
+	 * @return <i>true</i> if the new configuration is applied
+	 */
+	bool reload();
+
+	/**
+	 * Applies the configuration to the backend handlers and to handlers
+	 * connected later. The configuration should be destroyed before the
+	 * backend.
+	 * @param[in] backend backend
+	 */
+	void attach(BackendBase& backend);
+
+	/**
+	 * Applies the configuration to the frontend handler and its rings
+	 * @param[in] frontendHandler frontend handler
+	 */
+	void apply(FrontendHandlerBase& frontendHandler);
+
+	/**
+	 * Returns the value of the most specific scope
+	 * @param[in]  key   knob name
+	 * @param[out] value knob value
+	 * @param[in]  domId frontend domain id, negative for the global scope
+	 * @param[in]  devId frontend device id, negative for the domain scope
+	 * @param[in]  ring  ring index, negative for the device scope
+	 * @return <i>true</i> if the knob is set
+	 */
+	bool getValue(const std::string& key, std::string& value,
+				  int domId = -1, int devId = -1, int ring = -1) const;
+
+	/**
+	 * Returns number of applied reloads
+	 */
+	uint64_t getNumReloads() const { return mNumReloads; }
+
+private:
+
+	typedef std::map<std::string, std::string> Values;
+	typedef std::map<std::string, Values> Scopes;
+
+	std::string mFileName;
+	std::string mXsPath;
+
+	std::unique_ptr<XenStore> mXenStore;
+	Timer mTimer;
+
+	struct stat mFileStat;
+
+	mutable std::mutex mMutex;
+	Scopes mScopes;
+	std::vector<BackendBase*> mBackends;
+	std::atomic<uint64_t> mNumReloads;
+
+	Log mLog;
+
+	Scopes load();
+	void readFile(Scopes& scopes);
+	void readXenStore(Scopes& scopes, const std::string& path,
+					  const std::string& scope);
+	void setValue(Scopes& scopes, const std::string& scope,
+				  const std::string& key, const std::string& value);
+	void applyGlobal();
+	void applyHandler(FrontendHandlerBase& frontendHandler);
+	bool findValue(const std::string& key, std::string& value,
+				   int domId, int devId, int ring) const;
+	bool isFileChanged();
+	void onFileTimer();
+	void onXenStoreChanged();
+	void onError(const std::exception& e);
+};
+
+}
+
+#endif /* XENBE_TUNINGCONFIG_HPP_ */
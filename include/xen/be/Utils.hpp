@@ -26,6 +26,8 @@
 #include <list>
 #include <string>
 #include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include <poll.h>
 #include <unistd.h>
@@ -64,6 +66,19 @@ public:
 	 * Returns lib xenbe version
 	 */
 	static std::string getVersion();
+
+	/**
+	 * Binds the thread to the CPU core
+	 * @param[in] thread thread to bind
+	 * @param[in] cpu    core number
+	 * @return 0 on success or error number
+	 */
+	static int setThreadCpu(std::thread& thread, int cpu);
+
+	/**
+	 * Cache line size used to keep data written by different cores apart
+	 */
+	static constexpr size_t cCacheLineSize = 64;
 };
 
 /***************************************************************************//**
@@ -159,6 +174,67 @@ private:
 	void run();
 };
 
+/***************************************************************************//**
+ * Implements thread pool
+ *
+ * This class allows to call functions on a fixed number of worker threads.
+ * Functions added with the same key are called one by one in the order they
+ * were added, functions with different keys may be called in parallel.
+ *
+ * @ingroup backend
+ ******************************************************************************/
+class ThreadPool
+{
+public:
+
+	typedef std::function<void()> Task;
+
+	/**
+	 * @param numThreads number of worker threads
+	 */
+	explicit ThreadPool(size_t numThreads);
+	~ThreadPool();
+
+	/**
+	 * Stops worker threads. Tasks which are not started yet are dropped.
+	 */
+	void stop();
+
+	/**
+	 * Adds a function to be called on any worker thread
+	 * @param task callback, should not throw
+	 */
+	void call(Task task);
+
+	/**
+	 * Adds a function to be called after all functions with the same key
+	 * @param key   serialization key
+	 * @param task  callback, should not throw
+	 */
+	void call(uint64_t key, Task task);
+
+	/**
+	 * Waits till all added functions are done
+	 */
+	void wait();
+
+private:
+
+	bool mTerminate;
+	size_t mNumPending;
+	std::mutex mMutex;
+	std::condition_variable mCondVar;
+	std::condition_variable mIdleCondVar;
+	std::vector<std::thread> mThreads;
+
+	std::list<Task> mTasks;
+	std::unordered_map<uint64_t, std::list<Task>> mKeyedTasks;
+
+	void run();
+	void runKeyed(uint64_t key);
+	void done();
+};
+
 /***************************************************************************//**
  * Implements timer
  *
@@ -56,8 +56,8 @@ public:
 	~XenInterface();
 
 	/**
-	 * Returns all domains info
-	 * @param[out] infos
+	 * Returns all domains info sorted by domain id
+	 * @param[out] infos domains info, the vector capacity is reused
 	 */
 	void getDomainsInfo(std::vector<xc_domaininfo_t>& infos);
 
@@ -22,8 +22,14 @@
 #define XENBE_XENEVTCHN_HPP_
 
 #include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <thread>
+#include <vector>
+
+#include <sched.h>
 
 extern "C" {
 #include <xenctrl.h>
@@ -50,11 +56,137 @@ class XenEvtchnException : public Exception
 	using Exception::Exception;
 };
 
+/***************************************************************************//**
+ * Event channel handle with its event thread.
+ * The handle is opened and the thread is created once, then the handle is
+ * reused by XenEvtchn instances through XenEvtchnPool: the thread waits
+ * parked between the event loops.
+ * @ingroup xen
+ ******************************************************************************/
+class XenEvtchnHandle
+{
+public:
+
+	XenEvtchnHandle();
+	XenEvtchnHandle(const XenEvtchnHandle&) = delete;
+	XenEvtchnHandle& operator=(XenEvtchnHandle const&) = delete;
+	~XenEvtchnHandle();
+
+	/**
+	 * Returns xen event channel handle
+	 */
+	xenevtchn_handle* get() const { return mHandle; }
+
+	/**
+	 * Returns poll of the handle file descriptor
+	 */
+	PollFd& getPollFd() { return *mPollFd; }
+
+	/**
+	 * Returns the event thread
+	 */
+	std::thread& getThread() { return mThread; }
+
+	/**
+	 * Runs the event loop on the event thread
+	 * @param[in] loop event loop, should return when the poll is stopped
+	 */
+	void run(std::function<void()> loop);
+
+	/**
+	 * Stops the poll and waits for the event loop returns
+	 */
+	void stop();
+
+	/**
+	 * Restores the CPU affinity the event thread is created with
+	 */
+	void resetCpu();
+
+private:
+
+	xenevtchn_handle* mHandle;
+	std::unique_ptr<PollFd> mPollFd;
+	cpu_set_t mCpuSet;
+
+	std::mutex mMutex;
+	std::condition_variable mCondVar;
+	std::function<void()> mLoop;
+	bool mTerminate;
+	std::thread mThread;
+
+	void init();
+	void release();
+	void eventThread();
+};
+
+/***************************************************************************//**
+ * Pool of idle event channel handles.
+ * XenEvtchn takes the handle from the pool and returns it back when
+ * destroyed, so recreating the event channels on frontend reconnect doesn't
+ * open the handle and create the event thread again. The handle is returned
+ * only if its event loop is stopped cleanly. The pool is shared by all
+ * backends of the process.
+ * @ingroup xen
+ ******************************************************************************/
+class XenEvtchnPool
+{
+public:
+
+	/**
+	 * Default max number of idle handles
+	 */
+	static const size_t cDefaultMaxSize = 16;
+
+	/**
+	 * Returns the process pool
+	 */
+	static XenEvtchnPool& getInstance();
+
+	/**
+	 * Sets max number of idle handles, extra handles are closed.
+	 * @param[in] maxSize max number of idle handles, 0 disables the pool
+	 */
+	void setMaxSize(size_t maxSize);
+
+	/**
+	 * Returns max number of idle handles
+	 */
+	size_t getMaxSize() const;
+
+	/**
+	 * Returns number of idle handles
+	 */
+	size_t getSize() const;
+
+	/**
+	 * Returns number of handles taken from the pool
+	 */
+	uint64_t getNumReused() const;
+
+private:
+
+	friend class XenEvtchn;
+
+	XenEvtchnPool();
+	XenEvtchnPool(const XenEvtchnPool&) = delete;
+	XenEvtchnPool& operator=(XenEvtchnPool const&) = delete;
+
+	mutable std::mutex mMutex;
+	size_t mMaxSize;
+	uint64_t mNumReused;
+	std::vector<std::unique_ptr<XenEvtchnHandle>> mHandles;
+
+	std::unique_ptr<XenEvtchnHandle> acquire();
+	void release(std::unique_ptr<XenEvtchnHandle> handle);
+};
+
 /***************************************************************************//**
  * Implements xen event channel.
  * XenEvtchn instance binds port and waits for the bound channel is notified.
  * When the channel is notified it calls the callback function passed as
- * argument to the XenEvtchn constructor.
+ * argument to the XenEvtchn constructor. The handle and the event thread are
+ * taken from XenEvtchnPool.
  *
  * @code
  * void eventChannelCbk()
@@ -108,6 +240,13 @@ public:
 	 */
 	void notify();
 
+	/**
+	 * Notifies the event channel without throwing. Intended for hot paths
+	 * which handle the error themselves.
+	 * @return 0 on success, error code otherwise
+	 */
+	int tryNotify() noexcept;
+
 	/**
 	 * Returns event channel port
 	 */
@@ -119,21 +258,41 @@ public:
 	 */
 	void setErrorCallback(ErrorCallback errorCallback);
 
+	/**
+	 * Binds the event thread to the CPU core. The running thread is rebound
+	 * immediately, negative value takes effect on the next start().
+	 * @param cpu core number, negative value means any core
+	 */
+	void setCpu(int cpu);
+
+	/**
+	 * Returns the core the event thread is bound to or negative value
+	 */
+	int getCpu() const { return mCpu; }
+
+	/**
+	 * Returns number of received events
+	 */
+	uint64_t getNumEvents() const { return mNumEvents; }
+
 private:
 
 	xenevtchn_port_or_error_t mPort;
-	xenevtchn_handle *mHandle;
+	std::unique_ptr<XenEvtchnHandle> mHandle;
 	Callback mCallback;
 	ErrorCallback mErrorCallback;
 	std::atomic_bool mStarted;
+	std::atomic<int> mCpu;
+	std::atomic<uint64_t> mNumEvents;
+	// the event loop is stopped by stop() and the handle can be reused
+	std::atomic_bool mReusable;
 	Log mLog;
 
 	std::mutex mMutex;
-	std::thread mThread;
-	std::unique_ptr<PollFd> mPollFd;
 
 	void init(domid_t domId, evtchn_port_t port);
 	void release();
+	void bindCpu();
 	void eventThread();
 };
 
@@ -27,9 +27,11 @@
 extern "C" {
 #include <xenctrl.h>
 #include <xengnttab.h>
+#include <xen/grant_table.h>
 }
 
 #include "Exception.hpp"
+#include "GrantBudget.hpp"
 #include "Log.hpp"
 
 namespace XenBackend {
@@ -54,6 +56,7 @@ class XenGnttab
 private:
 
 	friend class XenGnttabBuffer;
+	friend class XenGnttabCopy;
 	friend class XenGnttabDmaBufferExporter;
 	friend class XenGnttabDmaBufferImporter;
 
@@ -75,7 +78,8 @@ private:
  * Gran table buffer.
  * XenGnttabBuffer instance maps grant table reference(s) into local linear
  * buffer when constructed. Then address and size of the linear buffer can
- * be accessible by get() and size() methods.
+ * be accessible by get() and size() methods. Mapped pages are accounted in
+ * GrantBudget, optionally on behalf of the frontend account.
  * @code
  * XenGnttabBuffer buffer(domId, ref);
  *
@@ -91,21 +95,25 @@ class XenGnttabBuffer
 public:
 
 	/**
-	 * @param[in] domId domain id
-	 * @param[in] ref   grant reference id
-	 * @param[in] prot  same flag as in mmap()
+	 * @param[in] domId   domain id
+	 * @param[in] ref     grant reference id
+	 * @param[in] prot    same flag as in mmap()
+	 * @param[in] account grant account the pages are mapped through
 	 */
 	XenGnttabBuffer(domid_t domId, grant_ref_t ref,
-					int prot = PROT_READ | PROT_WRITE);
+					int prot = PROT_READ | PROT_WRITE,
+					GrantAccount* account = nullptr);
 
 	/**
-	 * @param[in] domId domain id
-	 * @param[in] refs  array of grant reference ids
-	 * @param[in] count number of grant refgerence ids
-	 * @param[in] prot  same flag as in mmap()
+	 * @param[in] domId   domain id
+	 * @param[in] refs    array of grant reference ids
+	 * @param[in] count   number of grant refgerence ids
+	 * @param[in] prot    same flag as in mmap()
+	 * @param[in] account grant account the pages are mapped through
 	 */
 	XenGnttabBuffer(domid_t domId, const grant_ref_t* refs, size_t count,
-					int prot = PROT_READ | PROT_WRITE);
+					int prot = PROT_READ | PROT_WRITE,
+					GrantAccount* account = nullptr);
 	XenGnttabBuffer(const XenGnttabBuffer&) = delete;
 	XenGnttabBuffer& operator=(XenGnttabBuffer const&) = delete;
 	~XenGnttabBuffer();
@@ -124,6 +132,9 @@ private:
 	void* mBuffer;
 	xengnttab_handle* mHandle;
 	size_t mCount;
+	domid_t mDomId;
+	GrantAccount* mAccount;
+	bool mAccounted;
 	Log mLog;
 
 
@@ -216,6 +227,86 @@ private:
 	void release();
 };
 
+/***************************************************************************//**
+ * Batched grant copy.
+ * XenGnttabCopy collects copy operations between local buffers and foreign
+ * grant pages and performs all of them with one xengnttab_grant_copy() call
+ * on copy(). It avoids mapping and unmapping the pages for small transfers.
+ * Each operation should not cross the foreign page boundary.
+ *
+ * @code
+ * XenGnttabCopy copier;
+ *
+ * auto index = copier.fromRef(domId, ref, offset, data, size);
+ *
+ * copier.copy();
+ *
+ * if (copier.getStatus(index) != GNTST_okay) { ... }
+ *
+ * copier.clear();
+ * @endcode
+ * @ingroup xen
+ ******************************************************************************/
+class XenGnttabCopy
+{
+public:
+
+	XenGnttabCopy();
+	XenGnttabCopy(const XenGnttabCopy&) = delete;
+	XenGnttabCopy& operator=(XenGnttabCopy const&) = delete;
+
+	/**
+	 * Queues copying from the foreign page to the local buffer
+	 * @param[in] domId  foreign domain id
+	 * @param[in] ref    grant reference
+	 * @param[in] offset offset inside the foreign page
+	 * @param[in] dst    local buffer
+	 * @param[in] len    number of bytes to copy
+	 * @return index of the operation
+	 */
+	size_t fromRef(domid_t domId, grant_ref_t ref, uint16_t offset,
+				   void* dst, uint16_t len);
+
+	/**
+	 * Queues copying from the local buffer to the foreign page
+	 * @param[in] domId  foreign domain id
+	 * @param[in] ref    grant reference
+	 * @param[in] offset offset inside the foreign page
+	 * @param[in] src    local buffer
+	 * @param[in] len    number of bytes to copy
+	 * @return index of the operation
+	 */
+	size_t toRef(domid_t domId, grant_ref_t ref, uint16_t offset,
+				 const void* src, uint16_t len);
+
+	/**
+	 * Performs all queued operations
+	 */
+	void copy();
+
+	/**
+	 * Returns status of the performed operation (GNTST_okay on success)
+	 * @param[in] index index of the operation
+	 */
+	int16_t getStatus(size_t index) const { return mSegments[index].status; }
+
+	/**
+	 * Returns number of queued operations
+	 */
+	size_t size() const { return mSegments.size(); }
+
+	/**
+	 * Removes all operations
+	 */
+	void clear() { mSegments.clear(); }
+
+private:
+
+	xengnttab_handle* mHandle;
+	std::vector<xengnttab_grant_copy_segment_t> mSegments;
+	Log mLog;
+};
+
 }
 
 #endif /* XENBE_XENGNTTAB_HPP_ */
@@ -21,11 +21,15 @@
 #ifndef XENBE_XENSTAT_HPP_
 #define XENBE_XENSTAT_HPP_
 
+#include <chrono>
+#include <functional>
+#include <mutex>
 #include <vector>
 
 #include "Exception.hpp"
 #include "XenCtrl.hpp"
 #include "Log.hpp"
+#include "Utils.hpp"
 
 namespace XenBackend {
 
@@ -38,14 +42,106 @@ class XenStatException : public Exception
 	using Exception::Exception;
 };
 
+/***************************************************************************//**
+ * Domain statistics of the last XenStat sample.
+ * @ingroup xen
+ ******************************************************************************/
+struct DomainStats
+{
+	domid_t domId;
+
+	/**
+	 * XEN_DOMINF_* flags
+	 */
+	uint32_t flags;
+
+	/**
+	 * Total CPU time, ns
+	 */
+	uint64_t cpuTime;
+
+	/**
+	 * Number of pages
+	 */
+	uint64_t totPages;
+
+	/**
+	 * Number of online vCPUs
+	 */
+	uint32_t numVcpus;
+
+	/**
+	 * CPU time per wall time since the previous sample, 1.0 is one busy core
+	 */
+	double cpuUsage;
+
+	/**
+	 * Number of pages change since the previous sample and its rate per
+	 * second
+	 */
+	int64_t pagesDelta;
+	double pagesRate;
+
+	/**
+	 * Number of online vCPUs change since the previous sample
+	 */
+	int32_t vcpusDelta;
+
+	/**
+	 * State flags (dying, shutdown, paused) changed since the previous sample
+	 */
+	uint32_t changedFlags;
+};
+
+/***************************************************************************//**
+ * Domain change detected by XenStat.
+ * @ingroup xen
+ ******************************************************************************/
+struct DomainChange
+{
+	enum class Event
+	{
+		CREATED,
+		DESTROYED,
+		STATE_CHANGED,
+		VCPUS_CHANGED,
+		MEMORY_CHANGED
+	};
+
+	Event event;
+
+	/**
+	 * Domain statistics, the last known ones for the destroyed domain
+	 */
+	DomainStats stats;
+};
+
 /***************************************************************************//**
  * Provides different Xen domains statistics.
+ *
+ * Each sample() reads the info of all domains into the reused buffer and
+ * updates the cached snapshot. The snapshot keeps the raw counters and their
+ * deltas and rates against the previous sample. Changes (domain created or
+ * destroyed, state flags, vCPUs or memory changed) are passed to the change
+ * callback after the snapshot is updated.
+ *
+ * After start() the domains are sampled periodically, so getSnapshot() and
+ * getDomainStats() return current data without the hypercall.
+ * getRunningDoms() and getExistingDoms() sample the domains on each call.
  * @ingroup xen
  ******************************************************************************/
 class XenStat
 {
 public:
+
+	/**
+	 * Callback which is called for each detected change
+	 */
+	typedef std::function<void(const DomainChange& change)> ChangeCallback;
+
 	XenStat();
+	XenStat(const XenStat&) = delete;
+	XenStat& operator=(XenStat const&) = delete;
 	~XenStat();
 
 	/**
@@ -58,10 +154,70 @@ public:
 	 */
 	std::vector<domid_t> getExistingDoms();
 
+	/**
+	 * Reads domains info and updates the snapshot
+	 */
+	void sample();
+
+	/**
+	 * Starts periodic sampling
+	 * @param[in] period sampling period
+	 */
+	void start(std::chrono::milliseconds period);
+
+	/**
+	 * Stops periodic sampling
+	 */
+	void stop();
+
+	/**
+	 * Returns statistics of all domains sorted by domain id
+	 */
+	std::vector<DomainStats> getSnapshot() const;
+
+	/**
+	 * Returns statistics of the domain
+	 * @param[in]  domId domain id
+	 * @param[out] stats domain statistics
+	 * @return <i>false</i> if the domain is not found in the snapshot
+	 */
+	bool getDomainStats(domid_t domId, DomainStats& stats) const;
+
+	/**
+	 * Sets callback called for each detected change
+	 * @param[in] callback change callback
+	 */
+	void setChangeCallback(ChangeCallback callback);
+
+	/**
+	 * Returns number of samples
+	 */
+	uint64_t getNumSamples() const;
+
 private:
 
+	typedef std::chrono::steady_clock::time_point TimePoint;
+
 	XenInterface mInterface;
+
+	std::vector<xc_domaininfo_t> mInfos;
+	std::vector<DomainStats> mSnapshot;
+	std::vector<DomainStats> mPrevSnapshot;
+	std::vector<DomainChange> mChanges;
+	ChangeCallback mChangeCallback;
+	TimePoint mSampleTime;
+	uint64_t mNumSamples;
+
+	std::mutex mSampleMutex;
+	mutable std::mutex mMutex;
+
+	Timer mTimer;
+
 	Log mLog;
+
+	void update(double period);
+	void addChange(DomainChange::Event event, const DomainStats& stats);
+	void onTimer();
 };
 
 }
@@ -22,8 +22,11 @@
 #define XENBE_XENSTORE_HPP_
 
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
 #include <list>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
@@ -50,8 +53,44 @@ class XenStoreException : public Exception
 	using Exception::Exception;
 };
 
+/***************************************************************************//**
+ * Xen store connection recovery statistics.
+ * @ingroup xen
+ ******************************************************************************/
+struct XenStoreStats
+{
+	/**
+	 * Number of restored connections
+	 */
+	uint64_t reconnects;
+
+	/**
+	 * Number of failed reconnect attempts
+	 */
+	uint64_t failedAttempts;
+
+	/**
+	 * Connection loss till the watches are set, for the last restored
+	 * connection. Updated before the reconnect callback is called.
+	 */
+	std::chrono::microseconds lastRecoveryTime;
+
+	/**
+	 * Max recovery time
+	 */
+	std::chrono::microseconds maxRecoveryTime;
+};
+
 /***************************************************************************//**
  * Provides Xen Store functionality.
+ *
+ * When the watches connection fails (poll error or hang up, e.g. xenstored
+ * is restarted), the connection is reopened with exponential backoff and all
+ * watches are set again. Watch events raised while the connection was lost
+ * are not delivered, so the reconnect callback is called after the watches
+ * are restored to resync the state of the client. Requests issued from other
+ * threads during reconnect fail with XenStoreException as usual. The error
+ * callback is called only if reconnect is disabled.
  * @ingroup xen
  ******************************************************************************/
 class XenStore
@@ -63,6 +102,11 @@ public:
 	 */
 	typedef std::function<void(const std::string& path)> WatchCallback;
 
+	/**
+	 * Callback which is called when the connection is restored
+	 */
+	typedef std::function<void()> ReconnectCallback;
+
 	/**
 	 * @param errorCallback callback called on XS watches error
 	 */
@@ -98,6 +142,24 @@ public:
 	 */
 	std::string readString(const std::string& path);
 
+	/**
+	 * Reads XS entry as integer if it exists.
+	 * Combines checkIfExist() and readInt() into one Xen store request.
+	 * @param[in]  path  path to the entry
+	 * @param[out] value integer value
+	 * @return <i>true</i> if the entry exists and the value is read
+	 */
+	bool readIntIfExist(const std::string& path, int& value);
+
+	/**
+	 * Reads XS entry as string if it exists.
+	 * Combines checkIfExist() and readString() into one Xen store request.
+	 * @param[in]  path  path to the entry
+	 * @param[out] value string value
+	 * @return <i>true</i> if the entry exists and the value is read
+	 */
+	bool readStringIfExist(const std::string& path, std::string& value);
+
 	/**
 	 * Writes integer value into XS entry.
 	 * @param path  path to the entry
@@ -168,23 +230,64 @@ public:
 	 */
 	void stop();
 
+	/**
+	 * Sets the callback called from the watches thread when the connection
+	 * is restored.
+	 * @param[in] reconnectCallback reconnect callback
+	 */
+	void setReconnectCallback(ReconnectCallback reconnectCallback);
+
+	/**
+	 * Sets reconnect backoff: the first attempt is done at once, then the
+	 * delay starts from the min delay and doubles till the max one.
+	 * Zero max delay disables reconnect.
+	 * @param[in] minDelay min delay between attempts
+	 * @param[in] maxDelay max delay between attempts
+	 */
+	void setReconnectDelay(std::chrono::milliseconds minDelay,
+						   std::chrono::milliseconds maxDelay);
+
+	/**
+	 * Returns connection recovery statistics
+	 */
+	XenStoreStats getStats() const;
+
 private:
 
-	xs_handle*	mXsHandle;
+	static const std::chrono::milliseconds cMinReconnectDelay;
+	static const std::chrono::milliseconds cMaxReconnectDelay;
+
+	// the handle is replaced on reconnect while other threads may use it
+	std::shared_ptr<xs_handle> mXsHandle;
 	ErrorCallback mErrorCallback;
+	ReconnectCallback mReconnectCallback;
 	std::atomic_bool mStarted;
+	bool mStopping;
+	std::chrono::milliseconds mMinReconnectDelay;
+	std::chrono::milliseconds mMaxReconnectDelay;
+	XenStoreStats mStats;
 	Log mLog;
 
 	std::unordered_map<std::string, WatchCallback> mWatches;
 
 	std::thread mThread;
-	std::mutex mMutex;
+	mutable std::mutex mMutex;
+	std::condition_variable mCondVar;
 
 	std::unique_ptr<PollFd> mPollFd;
 
 	void init();
 	void release();
 
+	std::shared_ptr<xs_handle> getHandle() const
+	{
+		return std::atomic_load(&mXsHandle);
+	}
+
+	static std::shared_ptr<xs_handle> openHandle();
+	bool waitWatch();
+	bool reconnect();
+	bool restoreConnection();
 	void watchesThread();
 	std::string readXsWatch(std::string& token);
 	WatchCallback getWatchCallback(const std::string& path);
@@ -0,0 +1,247 @@
+/*
+ *  Xen vchan wrapper
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef XENBE_XENVCHAN_HPP_
+#define XENBE_XENVCHAN_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include <sys/uio.h>
+
+extern "C" {
+#include <xenctrl.h>
+#include <xen/io/libxenvchan.h>
+}
+
+#include "Exception.hpp"
+#include "Log.hpp"
+#include "XenEvtchn.hpp"
+#include "XenGnttab.hpp"
+
+namespace XenBackend {
+
+/***************************************************************************//**
+ * Exception generated by XenVchan.
+ * @ingroup xen
+ ******************************************************************************/
+class XenVchanException : public Exception
+{
+	using Exception::Exception;
+};
+
+/***************************************************************************//**
+ * Vchan statistics.
+ * @ingroup xen
+ ******************************************************************************/
+struct XenVchanStats
+{
+	uint64_t bytesRead;
+	uint64_t bytesWritten;
+	uint64_t events;
+	uint64_t notifications;
+};
+
+/***************************************************************************//**
+ * Byte stream channel compatible with libxenvchan.
+ *
+ * The peer domain exports the vchan interface page and the ring pages, this
+ * side maps them by the interface grant reference and binds the event
+ * channel. The peer gets the data from the left ring and puts its data to
+ * the right ring. Rings of order 10 and 11 are placed in the interface page,
+ * bigger rings use separate pages listed in the interface grants.
+ *
+ * The ring content is accessed as iovec spans, so it can be passed directly
+ * to readv() / writev() or filled in place. The peer is notified only if it
+ * has requested it, i.e. when it waits on the empty or full ring.
+ *
+ * @code
+ * XenVchan vchan(domId, ref, port);
+ *
+ * vchan.start();
+ *
+ * iovec iov[2];
+ * int count;
+ *
+ * if (vchan.waitRead(1, 1000))
+ * {
+ *     auto size = vchan.getReadSpans(iov, count);
+ *
+ *     writev(fd, iov, count);
+ *
+ *     vchan.consume(size);
+ * }
+ * @endcode
+ * @ingroup xen
+ ******************************************************************************/
+class XenVchan
+{
+public:
+
+	/**
+	 * Callback which is called when the peer notifies
+	 */
+	typedef std::function<void()> Callback;
+
+	/**
+	 * @param[in] domId         peer domain id
+	 * @param[in] ref           vchan interface grant reference
+	 * @param[in] port          event channel port number
+	 * @param[in] callback      callback called on the peer notification
+	 * @param[in] errorCallback callback called on event channel error
+	 */
+	XenVchan(domid_t domId, grant_ref_t ref, evtchn_port_t port,
+			 Callback callback = nullptr,
+			 ErrorCallback errorCallback = nullptr);
+	XenVchan(const XenVchan&) = delete;
+	XenVchan& operator=(XenVchan const&) = delete;
+	~XenVchan();
+
+	/**
+	 * Starts listening to the peer notifications
+	 */
+	void start();
+
+	/**
+	 * Stops listening to the peer notifications
+	 */
+	void stop();
+
+	/**
+	 * Returns true if the peer has not closed the channel
+	 */
+	bool isOpen() const;
+
+	/**
+	 * Returns size of the data which can be read
+	 */
+	size_t getReadSize() const;
+
+	/**
+	 * Returns size of the free space which can be written
+	 */
+	size_t getWriteSize() const;
+
+	/**
+	 * Returns ring sizes
+	 */
+	size_t getReadRingSize() const { return mRead.size; }
+	size_t getWriteRingSize() const { return mWrite.size; }
+
+	/**
+	 * Returns spans of the data which can be read
+	 * @param[out] iov   spans
+	 * @param[out] count number of spans
+	 * @return size of the data
+	 */
+	size_t getReadSpans(iovec* iov, int& count);
+
+	/**
+	 * Releases the read data to the peer
+	 */
+	void consume(size_t size);
+
+	/**
+	 * Returns spans of the free space
+	 * @param[out] iov   spans
+	 * @param[out] count number of spans
+	 * @return size of the free space
+	 */
+	size_t getWriteSpans(iovec* iov, int& count);
+
+	/**
+	 * Passes the written data to the peer
+	 */
+	void produce(size_t size);
+
+	/**
+	 * Copies available data, doesn't block
+	 * @return number of copied bytes
+	 */
+	size_t read(void* data, size_t size);
+
+	/**
+	 * Copies the data to the free space, doesn't block
+	 * @return number of copied bytes
+	 */
+	size_t write(const void* data, size_t size);
+
+	/**
+	 * Waits till the data of the size can be read or the peer closes
+	 * @return true if the data can be read
+	 */
+	bool waitRead(size_t size, int timeoutMs);
+
+	/**
+	 * Waits till the free space of the size can be written or the peer
+	 * closes
+	 * @return true if the data can be written
+	 */
+	bool waitWrite(size_t size, int timeoutMs);
+
+	/**
+	 * Returns vchan statistics
+	 */
+	XenVchanStats getStats() const;
+
+private:
+
+	struct Ring
+	{
+		ring_shared* shared;
+		uint8_t* buffer;
+		size_t size;
+		std::unique_ptr<XenGnttabBuffer> pages;
+	};
+
+	XenGnttabBuffer mIntfBuffer;
+	vchan_interface* mIntf;
+	Ring mRead;
+	Ring mWrite;
+	Callback mCallback;
+
+	std::mutex mMutex;
+	std::condition_variable mCondVar;
+
+	std::atomic<uint64_t> mBytesRead;
+	std::atomic<uint64_t> mBytesWritten;
+	std::atomic<uint64_t> mEvents;
+	std::atomic<uint64_t> mNotifications;
+
+	Log mLog;
+
+	XenEvtchn mEventChannel;
+
+	void initRing(domid_t domId, Ring& ring, ring_shared* shared,
+				  uint16_t order, const grant_ref_t* refs);
+	void requestNotify(uint8_t bit);
+	void sendNotify(uint8_t bit);
+	void onEvent();
+
+	size_t getUsed(const Ring& ring) const;
+	int getSpans(const Ring& ring, uint32_t index, size_t size, iovec* iov);
+};
+
+}
+
+#endif /* XENBE_XENVCHAN_HPP_ */
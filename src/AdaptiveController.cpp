@@ -0,0 +1,298 @@
+/*
+ *  Adaptive poller controller
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include "AdaptiveController.hpp"
+
+#include <algorithm>
+#include <sstream>
+
+using std::chrono::duration;
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::lock_guard;
+using std::max;
+using std::min;
+using std::mutex;
+using std::string;
+using std::stringstream;
+using std::to_string;
+using std::unordered_map;
+using std::vector;
+
+namespace XenBackend {
+
+/*******************************************************************************
+ * AdaptiveController
+ ******************************************************************************/
+
+AdaptiveController::AdaptiveController(RingPollerPtr poller,
+									   const AdaptiveConfig& config) :
+	mPoller(poller),
+	mConfig(config),
+	mTimer([this] { update(); }, true),
+	mStartTime(steady_clock::now()),
+	mLastTime(mStartTime),
+	mLastPollerStats(mPoller->getStats()),
+	mUpdates(0),
+	mLog("AdaptiveController")
+{
+	if (mConfig.minIdleTimeout > mConfig.maxIdleTimeout ||
+		mConfig.minBatch == 0 || mConfig.minBatch > mConfig.maxBatch ||
+		mConfig.decrease <= 0.0 || mConfig.decrease >= 1.0)
+	{
+		throw AdaptiveControllerException("Invalid controller bounds", EINVAL);
+	}
+}
+
+AdaptiveController::~AdaptiveController()
+{
+	stop();
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+void AdaptiveController::start()
+{
+	mTimer.start(mConfig.period);
+}
+
+void AdaptiveController::stop()
+{
+	mTimer.stop();
+}
+
+void AdaptiveController::update()
+{
+	lock_guard<mutex> lock(mMutex);
+
+	auto now = steady_clock::now();
+	double period = duration<double>(now - mLastTime).count();
+
+	if (period <= 0.0)
+	{
+		return;
+	}
+
+	mLastTime = now;
+
+	auto rings = mPoller->getRings();
+	auto pollerStats = mPoller->getStats();
+	unordered_map<RingBufferBase*, RingLoadStats> load;
+	double arrivalRate = 0.0;
+
+	auto busyPolls = pollerStats.busyPolls - mLastPollerStats.busyPolls;
+	double passTime = busyPolls ?
+		static_cast<double>((pollerStats.busyTime -
+							 mLastPollerStats.busyTime).count()) / busyPolls :
+		0.0;
+
+	mRingStats.clear();
+
+	for (auto& ring : rings)
+	{
+		auto cur = ring->getLoadStats();
+		auto prev = mLastLoad.count(ring.get()) ?
+					mLastLoad[ring.get()] : RingLoadStats();
+
+		load[ring.get()] = cur;
+
+		AdaptiveRingStats stats;
+
+		auto requests = cur.requests - prev.requests;
+		auto passes = cur.passes - prev.passes;
+
+		stats.port = ring->getPort();
+		stats.maxBatch = ring->getMaxBatch();
+		stats.arrivalRate = requests / period;
+		stats.occupancy = passes ?
+			static_cast<double>(cur.occupancy - prev.occupancy) / passes : 0.0;
+
+		// unlimited batch takes all available requests in one pass
+		double waitPasses = stats.maxBatch ?
+							stats.occupancy / stats.maxBatch : 1.0;
+
+		stats.latency = microseconds(stats.occupancy > 0.0 ?
+			static_cast<int64_t>(max(waitPasses, 1.0) * passTime) : 0);
+
+		arrivalRate += stats.arrivalRate;
+
+		mRingStats.push_back(stats);
+	}
+
+	mLastLoad.swap(load);
+
+	updateBatches(rings);
+	updateIdleTimeout(arrivalRate,
+					  pollerStats.sleeps - mLastPollerStats.sleeps);
+
+	mLastPollerStats = pollerStats;
+	mUpdates++;
+}
+
+AdaptiveStats AdaptiveController::getStats() const
+{
+	lock_guard<mutex> lock(mMutex);
+
+	AdaptiveStats stats;
+
+	stats.updates = mUpdates;
+	stats.idleTimeout = mPoller->getIdleTimeout();
+	stats.rings = mRingStats;
+	stats.decisions.assign(mDecisions.begin(), mDecisions.end());
+
+	return stats;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void AdaptiveController::updateBatches(const vector<RingBufferPtr>& rings)
+{
+	int lateRing = -1;
+
+	for (size_t i = 0; i < mRingStats.size(); i++)
+	{
+		if (mRingStats[i].latency > mConfig.targetLatency)
+		{
+			lateRing = i;
+		}
+	}
+
+	for (size_t i = 0; i < rings.size(); i++)
+	{
+		auto& stats = mRingStats[i];
+		auto batch = stats.maxBatch;
+		// unlimited batch starts from the upper bound
+		auto newBatch = batch ? min(max(batch, mConfig.minBatch),
+									mConfig.maxBatch) : mConfig.maxBatch;
+		string knob = "batch:" + to_string(stats.port);
+		stringstream reason;
+
+		// batch is saturated if requests are left in the ring after passes
+		bool saturated = stats.occupancy > batch;
+
+		if (newBatch != batch)
+		{
+			reason << "out of bounds";
+		}
+		else if (saturated && lateRing >= 0 &&
+				 static_cast<size_t>(lateRing) != i)
+		{
+			newBatch = max(mConfig.minBatch,
+						   static_cast<size_t>(batch * mConfig.decrease));
+
+			reason << "ring " << mRingStats[lateRing].port
+				   << " latency " << mRingStats[lateRing].latency.count()
+				   << " us is above target";
+		}
+		else if (saturated && lateRing < 0)
+		{
+			newBatch = min(mConfig.maxBatch, batch + mConfig.batchStep);
+
+			reason << "occupancy " << stats.occupancy
+				   << " is above batch size";
+		}
+
+		if (newBatch != batch)
+		{
+			rings[i]->setMaxBatch(newBatch);
+
+			stats.maxBatch = newBatch;
+
+			addDecision(knob, batch, newBatch, reason.str());
+		}
+	}
+}
+
+void AdaptiveController::updateIdleTimeout(double arrivalRate,
+										   uint64_t sleeps)
+{
+	auto idleTimeout = mPoller->getIdleTimeout();
+	auto newIdleTimeout = idleTimeout;
+	stringstream reason;
+
+	// mean gap between arrivals of all rings
+	double gap = arrivalRate > 0.0 ? 1e6 / arrivalRate : 0.0;
+
+	if (arrivalRate > 0.0 && sleeps &&
+		gap < mConfig.maxIdleTimeout.count())
+	{
+		newIdleTimeout = min(mConfig.maxIdleTimeout,
+							 idleTimeout + mConfig.idleTimeoutStep);
+
+		reason << sleeps << " sleeps while arrivals are "
+			   << static_cast<int64_t>(gap) << " us apart";
+	}
+	else if (arrivalRate == 0.0 || gap > mConfig.maxIdleTimeout.count())
+	{
+		newIdleTimeout = max(mConfig.minIdleTimeout,
+							 microseconds(static_cast<int64_t>(
+									idleTimeout.count() * mConfig.decrease)));
+
+		reason << "arrival rate " << static_cast<int64_t>(arrivalRate)
+			   << " req/s is low";
+	}
+
+	if (newIdleTimeout < mConfig.minIdleTimeout ||
+		newIdleTimeout > mConfig.maxIdleTimeout)
+	{
+		newIdleTimeout = min(max(newIdleTimeout, mConfig.minIdleTimeout),
+							 mConfig.maxIdleTimeout);
+
+		reason.str("out of bounds");
+	}
+
+	if (newIdleTimeout != idleTimeout)
+	{
+		mPoller->setIdleTimeout(newIdleTimeout);
+
+		addDecision("idle-timeout", idleTimeout.count(),
+					newIdleTimeout.count(), reason.str());
+	}
+}
+
+void AdaptiveController::addDecision(const string& knob, int64_t oldValue,
+									 int64_t newValue, const string& reason)
+{
+	AdaptiveDecision decision;
+
+	decision.time = duration_cast<milliseconds>(mLastTime - mStartTime);
+	decision.knob = knob;
+	decision.oldValue = oldValue;
+	decision.newValue = newValue;
+	decision.reason = reason;
+
+	LOG(mLog, INFO) << "Set " << knob << ": " << oldValue << " -> "
+					<< newValue << ", " << reason;
+
+	mDecisions.push_back(decision);
+
+	while (mDecisions.size() > mConfig.maxDecisions)
+	{
+		mDecisions.pop_front();
+	}
+}
+
+}
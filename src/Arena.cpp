@@ -0,0 +1,135 @@
+/*
+ *  Arena allocator
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include "Arena.hpp"
+
+#include <new>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+using std::lock_guard;
+using std::mutex;
+using std::pair;
+
+namespace XenBackend {
+
+/*******************************************************************************
+ * Arena
+ ******************************************************************************/
+
+Arena::Arena(size_t chunkSize) :
+	mChunkSize(chunkSize),
+	mCurrent(nullptr),
+	mLeft(0),
+	mStats()
+{
+}
+
+Arena::~Arena()
+{
+	for (auto& chunk : mChunks)
+	{
+		munmap(chunk.first, chunk.second);
+	}
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+void* Arena::allocate(size_t size, size_t alignment)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	mStats.allocations++;
+	mStats.liveAllocations++;
+
+	if (size > mChunkSize / 4)
+	{
+		mStats.usedBytes += size;
+
+		return allocateChunk(size);
+	}
+
+	auto padding = -reinterpret_cast<uintptr_t>(mCurrent) & (alignment - 1);
+
+	if (!mCurrent || padding + size > mLeft)
+	{
+		mCurrent = static_cast<uint8_t*>(allocateChunk(mChunkSize));
+		mLeft = mChunkSize;
+		padding = 0;
+	}
+
+	auto data = mCurrent + padding;
+
+	mCurrent += padding + size;
+	mLeft -= padding + size;
+
+	mStats.usedBytes += padding + size;
+
+	return data;
+}
+
+void Arena::deallocate(void*)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	mStats.liveAllocations--;
+}
+
+ArenaStats Arena::getStats() const
+{
+	lock_guard<mutex> lock(mMutex);
+
+	return mStats;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void* Arena::allocateChunk(size_t size)
+{
+	// chunks are mapped, not taken from the heap: freed chunks return to the
+	// system instead of leaving holes between long living heap objects
+	size_t pageSize = sysconf(_SC_PAGESIZE);
+
+	size = (size + pageSize - 1) & ~(pageSize - 1);
+
+	mChunks.reserve(mChunks.size() + 1);
+
+	auto chunk = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+					  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (chunk == MAP_FAILED)
+	{
+		throw std::bad_alloc();
+	}
+
+	mChunks.push_back(pair<void*, size_t>(chunk, size));
+
+	mStats.chunks++;
+	mStats.reservedBytes += size;
+
+	return chunk;
+}
+
+}
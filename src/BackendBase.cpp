@@ -28,7 +28,9 @@
 using std::bind;
 using std::find_if;
 using std::list;
+using std::lock_guard;
 using std::make_pair;
+using std::mutex;
 using std::unique_ptr;
 using std::pair;
 using std::placeholders::_1;
@@ -86,6 +88,8 @@ BackendBase::BackendBase(const string& name, const string& deviceName) :
 	mFrontendsPath = mXenStore.getDomainPath(mDomId) + "/backend/" +
 					 mDeviceName;
 
+	mXenStore.setReconnectCallback(bind(&BackendBase::onReconnect, this));
+
 	LOG(mLog, DEBUG) << "Create backend, device: " << deviceName << ", "
 					 << "dom Id: " << mDomId;
 }
@@ -94,11 +98,13 @@ BackendBase::~BackendBase()
 {
 	stop();
 
-	for(auto frontend : mFrontendHandlers)
+	for(auto frontend : getFrontendHandlers())
 	{
 		frontend->stop();
 	}
 
+	lock_guard<mutex> lock(mHandlersMutex);
+
 	mFrontendHandlers.clear();
 
 	LOG(mLog, DEBUG) << "Delete";
@@ -123,6 +129,27 @@ void BackendBase::stop()
 	mXenStore.stop();
 }
 
+vector<FrontendHandlerPtr> BackendBase::getFrontendHandlers() const
+{
+	lock_guard<mutex> lock(mHandlersMutex);
+
+	return vector<FrontendHandlerPtr>(mFrontendHandlers.begin(),
+									  mFrontendHandlers.end());
+}
+
+void BackendBase::setConnectCallback(
+		FrontendHandlerBase::ConnectCallback callback)
+{
+	lock_guard<mutex> lock(mHandlersMutex);
+
+	mConnectCallback = callback;
+
+	for (auto frontend : mFrontendHandlers)
+	{
+		frontend->setConnectCallback(callback);
+	}
+}
+
 /*******************************************************************************
  * Protected
  ******************************************************************************/
@@ -144,9 +171,29 @@ void BackendBase::addFrontendHandler(FrontendHandlerPtr frontendHandler)
 					   bind(&BackendBase::frontendPathChanged, this,
 							_1, domId, devId));
 
-	frontendHandler->start();
+	// the handler is listed before it is started, so setConnectCallback()
+	// can't miss it
+
+	{
+		lock_guard<mutex> lock(mHandlersMutex);
+
+		frontendHandler->setConnectCallback(mConnectCallback);
 
-	mFrontendHandlers.push_back(frontendHandler);
+		mFrontendHandlers.push_back(frontendHandler);
+	}
+
+	try
+	{
+		frontendHandler->start();
+	}
+	catch(const std::exception&)
+	{
+		lock_guard<mutex> lock(mHandlersMutex);
+
+		mFrontendHandlers.remove(frontendHandler);
+
+		throw;
+	}
 }
 
 /*******************************************************************************
@@ -225,6 +272,8 @@ void BackendBase::frontendPathChanged(const string& path, domid_t domId,
 
 			frontendHandler->stop();
 
+			lock_guard<mutex> lock(mHandlersMutex);
+
 			mFrontendHandlers.remove(frontendHandler);
 		}
 	}
@@ -233,6 +282,8 @@ void BackendBase::frontendPathChanged(const string& path, domid_t domId,
 FrontendHandlerPtr BackendBase::getFrontendHandler(domid_t domId,
 												   uint16_t devId)
 {
+	lock_guard<mutex> lock(mHandlersMutex);
+
 	auto it = find_if(mFrontendHandlers.begin(), mFrontendHandlers.end(),
 					  [&](FrontendHandlerPtr frontend) {
 							return (frontend->getDomId() == domId) &&
@@ -246,6 +297,36 @@ FrontendHandlerPtr BackendBase::getFrontendHandler(domid_t domId,
 	return FrontendHandlerPtr();
 }
 
+void BackendBase::onReconnect()
+{
+	// domains and frontends added or removed while the connection was lost
+	// are not watched, the model is compared with the current Xen store state
+
+	if (mXenStore.checkIfExist(mFrontendsPath))
+	{
+		domainListChanged(mFrontendsPath);
+	}
+
+	auto domainList = mDomainList;
+
+	for (auto domId : domainList)
+	{
+		deviceListChanged(mFrontendsPath + "/" + to_string(domId), domId);
+	}
+
+	for (auto frontendHandler : getFrontendHandlers())
+	{
+		auto domId = frontendHandler->getDomId();
+		auto devId = frontendHandler->getDevId();
+
+		frontendPathChanged(mFrontendsPath + "/" + to_string(domId) + "/" +
+							to_string(devId), domId, devId);
+	}
+
+	LOG(mLog, INFO) << "Resync frontends, domains: " << mDomainList.size()
+					<< ", frontends: " << getFrontendHandlers().size();
+}
+
 void BackendBase::onError(const std::exception& e)
 {
 	LOG(mLog, ERROR) << e.what();
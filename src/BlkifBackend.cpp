@@ -0,0 +1,904 @@
+/*
+ *  Xen block device backend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include "BlkifBackend.hpp"
+
+#include <cstring>
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "StagingPool.hpp"
+#include "Utils.hpp"
+#include "XenStore.hpp"
+
+using std::lock_guard;
+using std::move;
+using std::mutex;
+using std::string;
+using std::to_string;
+using std::try_to_lock;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+
+namespace XenBackend {
+
+/*******************************************************************************
+ * BlkifImage
+ ******************************************************************************/
+
+BlkifImage::BlkifImage(const string& path, bool readOnly) :
+	mFd(-1),
+	mSectors(0),
+	mReadOnly(readOnly),
+	mPhysSectorSize(512),
+	mDiscardSupported(false),
+	mLog("BlkifImage")
+{
+	try
+	{
+		init(path);
+	}
+	catch(const std::exception& e)
+	{
+		release();
+
+		throw;
+	}
+}
+
+BlkifImage::~BlkifImage()
+{
+	release();
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void BlkifImage::init(const string& path)
+{
+	int flags = (mReadOnly ? O_RDONLY : O_RDWR) | O_CLOEXEC;
+
+	// grant pages are page aligned so direct I/O can be used to bypass the
+	// backend page cache, fallback to buffered I/O if not supported
+	mFd = open(path.c_str(), flags | O_DIRECT);
+
+	if (mFd < 0 && errno == EINVAL)
+	{
+		mFd = open(path.c_str(), flags);
+	}
+
+	if (mFd < 0)
+	{
+		throw BlkifException("Can't open image: " + path, errno);
+	}
+
+	struct stat st;
+
+	if (fstat(mFd, &st) < 0)
+	{
+		throw BlkifException("Can't stat image: " + path, errno);
+	}
+
+	if (S_ISBLK(st.st_mode))
+	{
+		uint64_t size = 0;
+
+		if (ioctl(mFd, BLKGETSIZE64, &size) < 0)
+		{
+			throw BlkifException("Can't get block device size: " + path,
+								 errno);
+		}
+
+		int physSectorSize = 0;
+
+		if (ioctl(mFd, BLKPBSZGET, &physSectorSize) == 0 && physSectorSize > 0)
+		{
+			mPhysSectorSize = physSectorSize;
+		}
+
+		mSectors = size >> 9;
+	}
+	else
+	{
+		mSectors = st.st_size >> 9;
+		mDiscardSupported = !mReadOnly;
+	}
+
+	LOG(mLog, DEBUG) << "Open image: " << path << ", sectors: " << mSectors
+					 << ", read only: " << mReadOnly;
+}
+
+void BlkifImage::release()
+{
+	if (mFd >= 0)
+	{
+		close(mFd);
+	}
+}
+
+/*******************************************************************************
+ * BlkifRingBuffer
+ ******************************************************************************/
+
+BlkifRingBuffer::BlkifRingBuffer(domid_t domId, uint16_t devId,
+								 evtchn_port_t port, const GrantRefs& refs,
+								 BlkifImagePtr image,
+								 const BlkifConfig& config,
+								 bool persistentGrants) :
+	RingBufferInBase<blkif_back_ring, blkif_sring, blkif_request,
+					 blkif_response>(domId, port, refs),
+	mDomId(domId),
+	mImage(image),
+	mConfig(config),
+	mPersistentGrants(persistentGrants),
+	mGrantAccount(domId, devId),
+	mResponsesQueued(false),
+	mStats(),
+	mIoRing(config.ioDepth, [this] { flushResponses(); }),
+	mLog("BlkifRing")
+{
+	if (mPersistentGrants)
+	{
+		mGrantAccount.setEvictCallback([this] (size_t numPages) {
+			return evictPersistentPages(numPages);
+		});
+	}
+
+	mIoRing.start();
+
+	LOG(mLog, DEBUG) << "Create blkif ring, port: " << port
+					 << ", pages: " << refs.size()
+					 << ", persistent grants: " << mPersistentGrants
+					 << ", async: " << mIoRing.isAsync();
+}
+
+BlkifRingBuffer::~BlkifRingBuffer()
+{
+	mGrantAccount.setEvictCallback(nullptr);
+
+	// no new requests should be processed while waiting for in flight I/O
+
+	stop();
+
+	mIoRing.stop();
+
+	LOG(mLog, DEBUG) << "Delete blkif ring, port: " << getPort()
+					 << ", persistent pages: " << mPersistentPages.size();
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+BlkifStats BlkifRingBuffer::getStats() const
+{
+	lock_guard<mutex> lock(mStatsMutex);
+
+	return mStats;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void BlkifRingBuffer::processRequest(const blkif_request& req)
+{
+	DLOG(mLog, DEBUG) << "Request, id: " << req.id
+					  << ", op: " << static_cast<int>(req.operation)
+					  << ", sector: " << req.sector_number;
+
+	try
+	{
+		switch(req.operation)
+		{
+		case BLKIF_OP_READ:
+		case BLKIF_OP_WRITE:
+			if (req.nr_segments > BLKIF_MAX_SEGMENTS_PER_REQUEST)
+			{
+				throw BlkifException("Too many segments", EINVAL);
+			}
+
+			processReadWrite(req.operation, req.id, req.sector_number,
+							 req.seg, req.nr_segments);
+			break;
+
+		case BLKIF_OP_INDIRECT:
+			processIndirect(req);
+			break;
+
+		case BLKIF_OP_FLUSH_DISKCACHE:
+			processFlush(req);
+			break;
+
+		case BLKIF_OP_DISCARD:
+			processDiscard(req);
+			break;
+
+		default:
+			LOG(mLog, WARNING) << "Unsupported operation: "
+							   << static_cast<int>(req.operation);
+
+			sendStatus(req.id, req.operation, BLKIF_RSP_EOPNOTSUPP);
+			break;
+		}
+	}
+	catch(const std::exception& e)
+	{
+		LOG(mLog, ERROR) << "Request " << req.id << " failed: " << e.what();
+
+		{
+			lock_guard<mutex> lock(mStatsMutex);
+
+			mStats.errors++;
+		}
+
+		// the response of the indirect request carries the operation the
+		// frontend waits for
+		auto operation = req.operation == BLKIF_OP_INDIRECT ?
+			reinterpret_cast<const blkif_request_indirect&>(req).indirect_op :
+			req.operation;
+
+		sendStatus(req.id, operation, BLKIF_RSP_ERROR);
+	}
+}
+
+void BlkifRingBuffer::onRequestsProcessed()
+{
+	// pass all I/O collected from the ring to the kernel at once
+
+	mIoRing.submit();
+
+	flushResponses();
+}
+
+void BlkifRingBuffer::processReadWrite(uint8_t operation, uint64_t id,
+									   uint64_t sector,
+									   const blkif_request_segment* segs,
+									   size_t numSegs)
+{
+	if (numSegs == 0)
+	{
+		throw BlkifException("No segments", EINVAL);
+	}
+
+	if (operation == BLKIF_OP_WRITE && mImage->isReadOnly())
+	{
+		throw BlkifException("Write to read only image", EROFS);
+	}
+
+	RequestPtr request(new Request());
+
+	request->id = id;
+	request->operation = operation;
+	request->sectors = 0;
+
+	auto ptr = request.get();
+	auto callback = [this, ptr] (int result) { onComplete(ptr, result); };
+	auto offset = static_cast<off_t>(sector << cSectorShift);
+
+	try
+	{
+		mapSegments(*request, segs, numSegs);
+
+		auto size = mImage->getSectors();
+
+		// the sector comes from the frontend, the sum may wrap around
+		if (sector > size || request->sectors > size - sector)
+		{
+			throw BlkifException("Access beyond end of image", ENOSPC);
+		}
+
+		if (operation == BLKIF_OP_READ)
+		{
+			mIoRing.readv(mImage->getFd(), ptr->iov.data(), ptr->iov.size(),
+						  offset, callback);
+		}
+		else
+		{
+			mIoRing.writev(mImage->getFd(), ptr->iov.data(), ptr->iov.size(),
+						   offset, callback);
+		}
+	}
+	catch(const std::exception& e)
+	{
+		releasePersistentPages(*request);
+
+		throw;
+	}
+
+	// owned by the completion callback from now on
+	request.release();
+}
+
+void BlkifRingBuffer::processIndirect(const blkif_request& req)
+{
+	auto& indirect = reinterpret_cast<const blkif_request_indirect&>(req);
+
+	if (indirect.indirect_op != BLKIF_OP_READ &&
+		indirect.indirect_op != BLKIF_OP_WRITE)
+	{
+		throw BlkifException("Invalid indirect operation", EINVAL);
+	}
+
+	size_t numSegs = indirect.nr_segments;
+	size_t numPages = (numSegs + cSegmentsPerIndirectPage - 1) /
+					  cSegmentsPerIndirectPage;
+
+	if (numSegs == 0 || numSegs > mConfig.maxIndirectSegments ||
+		numPages > BLKIF_MAX_INDIRECT_PAGES_PER_REQUEST)
+	{
+		throw BlkifException("Invalid number of indirect segments", EINVAL);
+	}
+
+	// segment descriptors are copied out to avoid the frontend changing them
+	// while the request is being handled
+
+	auto segsBuffer = StagingPool::getInstance().alloc(
+			numSegs * sizeof(blkif_request_segment));
+	auto segs = static_cast<blkif_request_segment*>(segsBuffer.get());
+
+	{
+		XenGnttabBuffer pages(mDomId, indirect.indirect_grefs, numPages,
+							  PROT_READ, &mGrantAccount);
+
+		memcpy(segs, pages.get(), segsBuffer.size());
+	}
+
+	// as blkback does, the response carries the operation of the segments:
+	// blkfront checks it against the one it submitted
+	processReadWrite(indirect.indirect_op, indirect.id, indirect.sector_number,
+					 segs, numSegs);
+}
+
+void BlkifRingBuffer::processDiscard(const blkif_request& req)
+{
+	auto& discard = reinterpret_cast<const blkif_request_discard&>(req);
+
+	if (!mImage->isDiscardSupported())
+	{
+		sendStatus(discard.id, discard.operation, BLKIF_RSP_EOPNOTSUPP);
+
+		return;
+	}
+
+	auto size = mImage->getSectors();
+
+	if (discard.sector_number > size ||
+		discard.nr_sectors > size - discard.sector_number)
+	{
+		throw BlkifException("Discard beyond end of image", ENOSPC);
+	}
+
+	RequestPtr request(new Request());
+
+	request->id = discard.id;
+	request->operation = discard.operation;
+	request->sectors = discard.nr_sectors;
+
+	auto ptr = request.get();
+
+	mIoRing.discard(mImage->getFd(),
+					static_cast<off_t>(discard.sector_number << cSectorShift),
+					static_cast<off_t>(discard.nr_sectors << cSectorShift),
+					[this, ptr] (int result) { onComplete(ptr, result); });
+
+	request.release();
+}
+
+void BlkifRingBuffer::processFlush(const blkif_request& req)
+{
+	RequestPtr request(new Request());
+
+	request->id = req.id;
+	request->operation = req.operation;
+	request->sectors = 0;
+
+	auto ptr = request.get();
+
+	mIoRing.fsync(mImage->getFd(),
+				  [this, ptr] (int result) { onComplete(ptr, result); });
+
+	request.release();
+}
+
+void BlkifRingBuffer::mapSegments(Request& request,
+								  const blkif_request_segment* segs,
+								  size_t numSegs)
+{
+	vector<uint8_t*> pages(numSegs, nullptr);
+	GrantRefs refs;
+
+	for (size_t i = 0; i < numSegs; i++)
+	{
+		if (segs[i].first_sect > segs[i].last_sect ||
+			segs[i].last_sect >= cSectorsPerPage)
+		{
+			throw BlkifException("Invalid segment", EINVAL);
+		}
+
+		if (mPersistentGrants)
+		{
+			pages[i] = getPersistentPage(segs[i].gref);
+
+			if (pages[i])
+			{
+				// the page can't be evicted till the request is completed
+				request.persistentRefs.push_back(segs[i].gref);
+			}
+		}
+
+		if (!pages[i])
+		{
+			refs.push_back(segs[i].gref);
+		}
+	}
+
+	// not persistent pages are mapped with one call and unmapped when
+	// the request is completed
+
+	uint8_t* buffer = nullptr;
+
+	if (refs.size())
+	{
+		int prot = request.operation == BLKIF_OP_READ ?
+				   PROT_READ | PROT_WRITE : PROT_READ;
+
+		request.buffer.reset(new XenGnttabBuffer(mDomId, refs.data(),
+												 refs.size(), prot,
+												 &mGrantAccount));
+
+		buffer = static_cast<uint8_t*>(request.buffer->get());
+	}
+
+	request.iov.reserve(numSegs);
+
+	for (size_t i = 0; i < numSegs; i++)
+	{
+		if (!pages[i])
+		{
+			pages[i] = buffer;
+			buffer += XC_PAGE_SIZE;
+		}
+
+		auto base = pages[i] + (segs[i].first_sect << cSectorShift);
+		size_t len = (segs[i].last_sect - segs[i].first_sect + 1) <<
+					 cSectorShift;
+
+		// merge contiguous segments to reduce number of io vectors
+		if (request.iov.size() &&
+			static_cast<uint8_t*>(request.iov.back().iov_base) +
+			request.iov.back().iov_len == base)
+		{
+			request.iov.back().iov_len += len;
+		}
+		else
+		{
+			request.iov.push_back({base, len});
+		}
+
+		request.sectors += len >> cSectorShift;
+	}
+}
+
+uint8_t* BlkifRingBuffer::getPersistentPage(grant_ref_t ref)
+{
+	mGrantAccount.touch();
+
+	{
+		lock_guard<mutex> lock(mPersistentMutex);
+
+		auto it = mPersistentPages.find(ref);
+
+		if (it != mPersistentPages.end())
+		{
+			auto& page = it->second;
+
+			mPersistentLru.splice(mPersistentLru.begin(), mPersistentLru,
+								  page.lru);
+			page.users++;
+
+			lock_guard<mutex> statsLock(mStatsMutex);
+
+			mStats.persistentHits++;
+
+			return static_cast<uint8_t*>(page.buffer->get());
+		}
+
+		if (mPersistentPages.size() >= mConfig.maxPersistentGrants)
+		{
+			return nullptr;
+		}
+	}
+
+	// mapped without the lock: the budget may evict pages of this ring to
+	// fit the new one. Pages are added by the event thread only, so the ref
+	// can't be added meanwhile.
+	unique_ptr<XenGnttabBuffer> buffer(
+			new XenGnttabBuffer(mDomId, ref, PROT_READ | PROT_WRITE,
+								&mGrantAccount));
+
+	auto address = static_cast<uint8_t*>(buffer->get());
+
+	{
+		lock_guard<mutex> lock(mPersistentMutex);
+
+		mPersistentLru.push_front(ref);
+
+		auto& page = mPersistentPages[ref];
+
+		page.buffer = move(buffer);
+		page.lru = mPersistentLru.begin();
+		page.users = 1;
+	}
+
+	lock_guard<mutex> lock(mStatsMutex);
+
+	mStats.persistentMaps++;
+
+	return address;
+}
+
+void BlkifRingBuffer::releasePersistentPages(Request& request)
+{
+	if (request.persistentRefs.empty())
+	{
+		return;
+	}
+
+	lock_guard<mutex> lock(mPersistentMutex);
+
+	for (auto ref : request.persistentRefs)
+	{
+		mPersistentPages[ref].users--;
+	}
+
+	request.persistentRefs.clear();
+}
+
+size_t BlkifRingBuffer::evictPersistentPages(size_t numPages)
+{
+	vector<unique_ptr<XenGnttabBuffer>> evicted;
+
+	{
+		// the budget calls it from any mapping thread, the one holding
+		// the lock included: the cache is skipped instead of waiting
+		unique_lock<mutex> lock(mPersistentMutex, try_to_lock);
+
+		if (!lock.owns_lock())
+		{
+			return 0;
+		}
+
+		auto it = mPersistentLru.end();
+
+		while (it != mPersistentLru.begin() && evicted.size() < numPages)
+		{
+			--it;
+
+			auto pageIt = mPersistentPages.find(*it);
+
+			if (pageIt->second.users)
+			{
+				continue;
+			}
+
+			evicted.push_back(move(pageIt->second.buffer));
+
+			mPersistentPages.erase(pageIt);
+
+			it = mPersistentLru.erase(it);
+		}
+	}
+
+	DLOG(mLog, DEBUG) << "Evict persistent pages, port: " << getPort()
+					  << ", requested: " << numPages
+					  << ", evicted: " << evicted.size();
+
+	// unmapped without the lock
+	return evicted.size();
+}
+
+void BlkifRingBuffer::onComplete(Request* request, int result)
+{
+	RequestPtr ptr(request);
+
+	releasePersistentPages(*request);
+
+	int16_t status = BLKIF_RSP_OKAY;
+
+	{
+		lock_guard<mutex> lock(mStatsMutex);
+
+		switch(request->operation)
+		{
+		case BLKIF_OP_READ:
+			mStats.reads++;
+			mStats.readSectors += request->sectors;
+			break;
+
+		case BLKIF_OP_WRITE:
+			mStats.writes++;
+			mStats.writtenSectors += request->sectors;
+			break;
+
+		case BLKIF_OP_FLUSH_DISKCACHE:
+			mStats.flushes++;
+			break;
+
+		case BLKIF_OP_DISCARD:
+			mStats.discards++;
+			break;
+		}
+
+		if (result < 0 || ((request->operation == BLKIF_OP_READ ||
+							request->operation == BLKIF_OP_WRITE) &&
+						   static_cast<uint64_t>(result) !=
+						   request->sectors << cSectorShift))
+		{
+			mStats.errors++;
+
+			status = BLKIF_RSP_ERROR;
+		}
+	}
+
+	if (status != BLKIF_RSP_OKAY)
+	{
+		LOG(mLog, ERROR) << "Request " << request->id << " failed, result: "
+						 << result;
+	}
+
+	sendStatus(request->id, request->operation, status);
+}
+
+void BlkifRingBuffer::sendStatus(uint64_t id, uint8_t operation,
+								 int16_t status)
+{
+	blkif_response rsp {};
+
+	rsp.id = id;
+	rsp.operation = operation;
+	rsp.status = status;
+
+	lock_guard<mutex> lock(mResponseMutex);
+
+	queueResponse(rsp);
+
+	mResponsesQueued = true;
+
+	lock_guard<mutex> statsLock(mStatsMutex);
+
+	mStats.responses++;
+}
+
+void BlkifRingBuffer::flushResponses()
+{
+	lock_guard<mutex> lock(mResponseMutex);
+
+	if (!mResponsesQueued)
+	{
+		return;
+	}
+
+	mResponsesQueued = false;
+
+	pushResponses();
+
+	lock_guard<mutex> statsLock(mStatsMutex);
+
+	mStats.responseBatches++;
+}
+
+/*******************************************************************************
+ * BlkifFrontendHandler
+ ******************************************************************************/
+
+BlkifFrontendHandler::BlkifFrontendHandler(const string& devName,
+										   domid_t beDomId, domid_t feDomId,
+										   uint16_t devId,
+										   const BlkifConfig& config) :
+	FrontendHandlerBase("BlkifFrontend", devName, beDomId, feDomId, devId),
+	mConfig(config),
+	mLog("BlkifFrontend")
+{
+	writeFeatures();
+}
+
+BlkifFrontendHandler::~BlkifFrontendHandler()
+{
+	stop();
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+vector<BlkifStats> BlkifFrontendHandler::getStats()
+{
+	lock_guard<mutex> lock(mQueuesMutex);
+
+	vector<BlkifStats> stats;
+
+	for (auto queue : mQueues)
+	{
+		stats.push_back(queue->getStats());
+	}
+
+	return stats;
+}
+
+/*******************************************************************************
+ * Protected
+ ******************************************************************************/
+
+void BlkifFrontendHandler::onBind()
+{
+	auto& xenStore = getXenStore();
+	auto fePath = getXsFrontendPath();
+	auto bePath = getXsBackendPath();
+
+	int value = 0;
+	unsigned int order = 0;
+
+	if (xenStore.readIntIfExist(fePath + "/ring-page-order", value))
+	{
+		order = value;
+	}
+
+	if (order > mConfig.maxRingPageOrder)
+	{
+		throw BlkifException("Invalid ring page order: " + to_string(order),
+							 EINVAL);
+	}
+
+	bool persistentGrants = mConfig.persistentGrants &&
+		xenStore.readIntIfExist(fePath + "/feature-persistent", value) &&
+		value;
+
+	string mode;
+
+	xenStore.readStringIfExist(bePath + "/mode", mode);
+
+	mImage.reset(new BlkifImage(xenStore.readString(bePath + "/params"),
+								mode.find('w') == string::npos));
+
+	LOG(mLog, DEBUG) << Utils::logDomId(getDomId(), getDevId())
+					 << "Bind, ring page order: " << order
+					 << ", persistent grants: " << persistentGrants;
+
+	lock_guard<mutex> lock(mQueuesMutex);
+
+	addQueues(mConfig.maxQueues,
+			  [this, &xenStore, order, persistentGrants]
+			  (unsigned int, const string& path) {
+		auto refs = readRingRefs(path, order);
+		evtchn_port_t port = xenStore.readUint(path + "/event-channel");
+
+		auto queue = makeShared<BlkifRingBuffer>(getDomId(), getDevId(),
+												 port, refs, mImage, mConfig,
+												 persistentGrants);
+
+		mQueues.push_back(queue);
+
+		return queue;
+	});
+
+	writeImageInfo();
+}
+
+void BlkifFrontendHandler::onClosing()
+{
+	lock_guard<mutex> lock(mQueuesMutex);
+
+	mQueues.clear();
+
+	mImage.reset();
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void BlkifFrontendHandler::writeFeatures()
+{
+	auto& xenStore = getXenStore();
+	auto bePath = getXsBackendPath();
+
+	xenStore.writeUint(bePath + "/max-ring-page-order",
+					   mConfig.maxRingPageOrder);
+	writeMaxQueues(mConfig.maxQueues);
+	xenStore.writeUint(bePath + "/feature-persistent",
+					   mConfig.persistentGrants);
+	xenStore.writeUint(bePath + "/feature-max-indirect-segments",
+					   mConfig.maxIndirectSegments);
+	xenStore.writeUint(bePath + "/feature-flush-cache", 1);
+}
+
+void BlkifFrontendHandler::writeImageInfo()
+{
+	auto& xenStore = getXenStore();
+	auto bePath = getXsBackendPath();
+
+	xenStore.writeString(bePath + "/sectors", to_string(mImage->getSectors()));
+	xenStore.writeUint(bePath + "/info",
+					   mImage->isReadOnly() ? VDISK_READONLY : 0);
+	xenStore.writeUint(bePath + "/sector-size", 512);
+	xenStore.writeUint(bePath + "/physical-sector-size",
+					   mImage->getPhysicalSectorSize());
+	xenStore.writeUint(bePath + "/feature-discard",
+					   mImage->isDiscardSupported());
+
+	if (mImage->isDiscardSupported())
+	{
+		xenStore.writeUint(bePath + "/discard-granularity", XC_PAGE_SIZE);
+		xenStore.writeUint(bePath + "/discard-alignment", 0);
+	}
+}
+
+GrantRefs BlkifFrontendHandler::readRingRefs(const string& path,
+											 unsigned int order)
+{
+	auto& xenStore = getXenStore();
+
+	GrantRefs refs;
+
+	if (order == 0)
+	{
+		refs.push_back(xenStore.readUint(path + "/ring-ref"));
+
+		return refs;
+	}
+
+	for (unsigned int i = 0; i < (1u << order); i++)
+	{
+		refs.push_back(xenStore.readUint(path + "/ring-ref" + to_string(i)));
+	}
+
+	return refs;
+}
+
+/*******************************************************************************
+ * BlkifBackend
+ ******************************************************************************/
+
+BlkifBackend::BlkifBackend(const string& name, const BlkifConfig& config,
+						   const string& devName) :
+	BackendBase(name, devName),
+	mConfig(config)
+{
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void BlkifBackend::onNewFrontend(domid_t domId, uint16_t devId)
+{
+	addFrontendHandler(FrontendHandlerPtr(
+			new BlkifFrontendHandler(getDeviceName(), getDomId(), domId,
+									 devId, mConfig)));
+}
+
+}
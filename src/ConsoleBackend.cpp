@@ -0,0 +1,598 @@
+/*
+ *  Xen console backend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include "ConsoleBackend.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "XenStore.hpp"
+
+using std::exception;
+using std::lock_guard;
+using std::min;
+using std::mutex;
+using std::string;
+using std::this_thread::sleep_for;
+using std::thread;
+using std::to_string;
+using std::unique_lock;
+
+namespace XenBackend {
+
+namespace {
+
+int getIov(char* ring, size_t ringSize, XENCONS_RING_IDX index, size_t size,
+		   iovec* iov)
+{
+	auto offset = index & (ringSize - 1);
+	auto first = min<size_t>(size, ringSize - offset);
+
+	iov[0].iov_base = &ring[offset];
+	iov[0].iov_len = first;
+
+	if (first == size)
+	{
+		return 1;
+	}
+
+	iov[1].iov_base = ring;
+	iov[1].iov_len = size - first;
+
+	return 2;
+}
+
+}
+
+/*******************************************************************************
+ * ConsoleRing
+ ******************************************************************************/
+
+ConsoleRing::ConsoleRing(domid_t domId, evtchn_port_t port, grant_ref_t ref,
+						 const ConsoleConfig& config) :
+	RingBufferBase(domId, port, ref),
+	mConfig(config),
+	mIntf(static_cast<xencons_interface*>(mBuffer.get())),
+	mNotifyPending(false),
+	mInput(-1),
+	mTerminate(false),
+	mEvents(0),
+	mOutBytes(0),
+	mInBytes(0),
+	mWrites(0),
+	mNotifications(0)
+{
+}
+
+ConsoleRing::~ConsoleRing()
+{
+	stop();
+
+	{
+		lock_guard<mutex> lock(mInMutex);
+
+		mTerminate = true;
+	}
+
+	mInCondVar.notify_all();
+
+	if (mInputPoll)
+	{
+		mInputPoll->stop();
+	}
+
+	if (mInputThread.joinable())
+	{
+		mInputThread.join();
+	}
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+void ConsoleRing::addOutput(int fd)
+{
+	mOutputs.push_back(fd);
+}
+
+void ConsoleRing::setInput(int fd)
+{
+	if (mInputThread.joinable())
+	{
+		throw ConsoleException("Input is already set", EPERM);
+	}
+
+	mInput = fd;
+	mInputPoll.reset(new PollFd(fd, POLLIN));
+
+	mInputThread = thread(&ConsoleRing::inputThread, this);
+}
+
+size_t ConsoleRing::getOutSpans(iovec* iov, int& count)
+{
+	XENCONS_RING_IDX cons = mIntf->out_cons;
+	XENCONS_RING_IDX prod = mIntf->out_prod;
+
+	xen_rmb();
+
+	size_t size = prod - cons;
+
+	if (size > sizeof(mIntf->out))
+	{
+		throw ConsoleException("Out ring producer overflow", EIO);
+	}
+
+	count = size ? getIov(mIntf->out, sizeof(mIntf->out), cons, size, iov) : 0;
+
+	return size;
+}
+
+void ConsoleRing::consumeOut(size_t size)
+{
+	XENCONS_RING_IDX cons = mIntf->out_cons;
+
+	xen_mb();
+
+	mIntf->out_cons = cons + size;
+
+	mOutBytes += size;
+
+	// the guest may wait for free space even if the ring is not full
+	mNotifyPending = true;
+}
+
+size_t ConsoleRing::getInSpans(iovec* iov, int& count)
+{
+	XENCONS_RING_IDX cons = mIntf->in_cons;
+	XENCONS_RING_IDX prod = mIntf->in_prod;
+
+	xen_mb();
+
+	size_t used = prod - cons;
+
+	if (used > sizeof(mIntf->in))
+	{
+		throw ConsoleException("In ring consumer overflow", EIO);
+	}
+
+	auto size = sizeof(mIntf->in) - used;
+
+	count = size ? getIov(mIntf->in, sizeof(mIntf->in), prod, size, iov) : 0;
+
+	return size;
+}
+
+void ConsoleRing::produceIn(size_t size)
+{
+	xen_wmb();
+
+	mIntf->in_prod += size;
+
+	mInBytes += size;
+
+	mNotifyPending = true;
+}
+
+size_t ConsoleRing::writeIn(const void* data, size_t size)
+{
+	lock_guard<mutex> lock(mInMutex);
+
+	iovec iov[2];
+	int count;
+
+	size = min(size, getInSpans(iov, count));
+
+	auto src = static_cast<const uint8_t*>(data);
+	size_t copied = 0;
+
+	for (int i = 0; i < count && copied < size; i++)
+	{
+		auto chunk = min(iov[i].iov_len, size - copied);
+
+		memcpy(iov[i].iov_base, &src[copied], chunk);
+
+		copied += chunk;
+	}
+
+	if (size)
+	{
+		produceIn(size);
+	}
+
+	return size;
+}
+
+size_t ConsoleRing::readIn(int fd)
+{
+	lock_guard<mutex> lock(mInMutex);
+
+	iovec iov[2];
+	int count;
+
+	if (getInSpans(iov, count) == 0)
+	{
+		return 0;
+	}
+
+	auto ret = readv(fd, iov, count);
+
+	if (ret < 0)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+		{
+			return 0;
+		}
+
+		throw ConsoleException("Can't read input", errno);
+	}
+
+	if (ret > 0)
+	{
+		produceIn(ret);
+	}
+
+	return ret;
+}
+
+void ConsoleRing::flush()
+{
+	if (mNotifyPending.exchange(false))
+	{
+		notify();
+
+		mNotifications++;
+	}
+}
+
+ConsoleStats ConsoleRing::getStats() const
+{
+	ConsoleStats stats;
+
+	stats.events = mEvents;
+	stats.outBytes = mOutBytes;
+	stats.inBytes = mInBytes;
+	stats.writes = mWrites;
+	stats.notifications = mNotifications;
+
+	return stats;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void ConsoleRing::onReceiveIndication()
+{
+	mEvents++;
+
+	if (mConfig.coalesceDelay.count())
+	{
+		sleep_for(mConfig.coalesceDelay);
+	}
+
+	drainOut();
+
+	// the guest notifies also when it consumes input
+
+	{
+		lock_guard<mutex> lock(mInMutex);
+	}
+
+	mInCondVar.notify_all();
+
+	flush();
+}
+
+void ConsoleRing::drainOut()
+{
+	while (true)
+	{
+		iovec iov[2];
+		int count;
+
+		auto size = getOutSpans(iov, count);
+
+		if (size == 0)
+		{
+			break;
+		}
+
+		for (auto fd : mOutputs)
+		{
+			// writeOutput() changes iov
+			iovec fdIov[2] = { iov[0], iov[1] };
+
+			writeOutput(fd, fdIov, count, size);
+		}
+
+		consumeOut(size);
+	}
+}
+
+void ConsoleRing::writeOutput(int fd, iovec* iov, int count, size_t size)
+{
+	while (size)
+	{
+		auto ret = writev(fd, iov, count);
+
+		mWrites++;
+
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			// the output is dropped if nobody reads it, the guest should
+			// not be blocked by a slow reader
+
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				LOG(mLog, ERROR) << "Can't write output: " << strerror(errno);
+			}
+
+			return;
+		}
+
+		size -= ret;
+
+		while (count && static_cast<size_t>(ret) >= iov->iov_len)
+		{
+			ret -= iov->iov_len;
+			iov++;
+			count--;
+		}
+
+		if (count)
+		{
+			iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + ret;
+			iov->iov_len -= ret;
+		}
+	}
+}
+
+void ConsoleRing::inputThread()
+{
+	try
+	{
+		while (mInputPoll->poll())
+		{
+			{
+				unique_lock<mutex> lock(mInMutex);
+
+				// wait till the guest consumes input
+
+				mInCondVar.wait(lock, [this] {
+					return mTerminate || getInFree() > 0;
+				});
+
+				if (mTerminate)
+				{
+					break;
+				}
+			}
+
+			readIn(mInput);
+
+			flush();
+		}
+	}
+	catch(const exception& e)
+	{
+		LOG(mLog, ERROR) << e.what();
+	}
+}
+
+size_t ConsoleRing::getInFree()
+{
+	iovec iov[2];
+	int count;
+
+	return getInSpans(iov, count);
+}
+
+/*******************************************************************************
+ * ConsoleFrontendHandler
+ ******************************************************************************/
+
+ConsoleFrontendHandler::ConsoleFrontendHandler(const string& devName,
+											   domid_t beDomId,
+											   domid_t feDomId, uint16_t devId,
+											   const ConsoleConfig& config) :
+	FrontendHandlerBase("ConsoleFrontend", devName, beDomId, feDomId, devId),
+	mConfig(config),
+	mLogFd(-1),
+	mPtyMaster(-1),
+	mPtySlave(-1),
+	mLog("ConsoleFrontend")
+{
+}
+
+ConsoleFrontendHandler::~ConsoleFrontendHandler()
+{
+	stop();
+
+	closeFds();
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+ConsoleStats ConsoleFrontendHandler::getStats()
+{
+	lock_guard<mutex> lock(mRingMutex);
+
+	if (!mRing)
+	{
+		return ConsoleStats {};
+	}
+
+	return mRing->getStats();
+}
+
+/*******************************************************************************
+ * Protected
+ ******************************************************************************/
+
+void ConsoleFrontendHandler::onBind()
+{
+	auto& xenStore = getXenStore();
+	auto fePath = getXsFrontendPath();
+
+	evtchn_port_t port = xenStore.readUint(fePath + "/port");
+	grant_ref_t ref = xenStore.readUint(fePath + "/ring-ref");
+
+	LOG(mLog, DEBUG) << Utils::logDomId(getDomId(), getDevId())
+					 << "Bind, ref: " << ref << ", port: " << port;
+
+	lock_guard<mutex> lock(mRingMutex);
+
+	mRing.reset(new ConsoleRing(getDomId(), port, ref, mConfig));
+
+	if (!mConfig.logDir.empty())
+	{
+		openLog();
+
+		mRing->addOutput(mLogFd);
+	}
+
+	if (mConfig.pty)
+	{
+		openPty();
+
+		mRing->addOutput(mPtyMaster);
+		mRing->setInput(mPtyMaster);
+	}
+
+	addRingBuffer(mRing);
+}
+
+void ConsoleFrontendHandler::onClosing()
+{
+	lock_guard<mutex> lock(mRingMutex);
+
+	mRing.reset();
+
+	closeFds();
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void ConsoleFrontendHandler::openLog()
+{
+	auto path = mConfig.logDir + "/guest-" + to_string(getDomId()) + "-" +
+				to_string(getDevId()) + ".log";
+
+	mLogFd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+				  0644);
+
+	if (mLogFd < 0)
+	{
+		throw ConsoleException("Can't open log: " + path, errno);
+	}
+}
+
+void ConsoleFrontendHandler::openPty()
+{
+	mPtyMaster = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+
+	if (mPtyMaster < 0)
+	{
+		throw ConsoleException("Can't open pty", errno);
+	}
+
+	if (grantpt(mPtyMaster) < 0 || unlockpt(mPtyMaster) < 0)
+	{
+		throw ConsoleException("Can't unlock pty", errno);
+	}
+
+	string name = ptsname(mPtyMaster);
+
+	// keep the slave open, otherwise the master gets hangup when the last
+	// client closes it
+
+	mPtySlave = open(name.c_str(), O_RDWR | O_NOCTTY | O_CLOEXEC);
+
+	if (mPtySlave < 0)
+	{
+		throw ConsoleException("Can't open pty slave: " + name, errno);
+	}
+
+	termios attr;
+
+	if (tcgetattr(mPtySlave, &attr) == 0)
+	{
+		cfmakeraw(&attr);
+
+		tcsetattr(mPtySlave, TCSAFLUSH, &attr);
+	}
+
+	getXenStore().writeString(getXsBackendPath() + "/tty", name);
+
+	LOG(mLog, DEBUG) << Utils::logDomId(getDomId(), getDevId())
+					 << "Pty: " << name;
+}
+
+void ConsoleFrontendHandler::closeFds()
+{
+	for (auto fd : { &mLogFd, &mPtyMaster, &mPtySlave })
+	{
+		if (*fd >= 0)
+		{
+			::close(*fd);
+
+			*fd = -1;
+		}
+	}
+}
+
+/*******************************************************************************
+ * ConsoleBackend
+ ******************************************************************************/
+
+ConsoleBackend::ConsoleBackend(const string& name, const ConsoleConfig& config,
+							   const string& devName) :
+	BackendBase(name, devName),
+	mConfig(config)
+{
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void ConsoleBackend::onNewFrontend(domid_t domId, uint16_t devId)
+{
+	addFrontendHandler(FrontendHandlerPtr(
+			new ConsoleFrontendHandler(getDeviceName(), getDomId(), domId,
+									   devId, mConfig)));
+}
+
+}
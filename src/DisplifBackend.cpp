@@ -0,0 +1,879 @@
+/*
+ *  Xen displif backend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include "DisplifBackend.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "Utils.hpp"
+#include "XenStore.hpp"
+
+using std::all_of;
+using std::exception;
+using std::lock_guard;
+using std::min;
+using std::mutex;
+using std::stoul;
+using std::string;
+using std::to_string;
+using std::vector;
+
+namespace XenBackend {
+
+/*******************************************************************************
+ * DisplifDamage
+ ******************************************************************************/
+
+DisplifDamage::DisplifDamage(unsigned int tileWidth, unsigned int tileHeight) :
+	mTileWidth(tileWidth ? tileWidth : 1),
+	mTileHeight(tileHeight ? tileHeight : 1),
+	mWidth(0),
+	mHeight(0),
+	mBpp(0),
+	mFull(true)
+{
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+vector<DisplifRect> DisplifDamage::update(const DisplifFrame& frame)
+{
+	auto cols = (frame.width + mTileWidth - 1) / mTileWidth;
+	auto rows = (frame.height + mTileHeight - 1) / mTileHeight;
+
+	if (frame.width != mWidth || frame.height != mHeight ||
+		frame.bpp != mBpp)
+	{
+		mWidth = frame.width;
+		mHeight = frame.height;
+		mBpp = frame.bpp;
+
+		mHashes.assign(cols * rows, 0);
+
+		mFull = true;
+	}
+
+	vector<DisplifRect> rects;
+
+	for (uint32_t row = 0; row < rows; row++)
+	{
+		uint32_t y = row * mTileHeight;
+		uint32_t height = min(mTileHeight, frame.height - y);
+		int64_t start = -1;
+
+		// one extra column closes the damaged span at the row end
+
+		for (uint32_t col = 0; col <= cols; col++)
+		{
+			bool damaged = false;
+
+			if (col < cols)
+			{
+				uint32_t x = col * mTileWidth;
+				auto& hash = mHashes[row * cols + col];
+				auto newHash = hashTile(frame, x, y,
+										min(mTileWidth, frame.width - x),
+										height);
+
+				damaged = mFull || newHash != hash;
+
+				hash = newHash;
+			}
+
+			if (damaged && start < 0)
+			{
+				start = col;
+			}
+			else if (!damaged && start >= 0)
+			{
+				uint32_t x = start * mTileWidth;
+
+				addRect(rects, {x, y, min(col * mTileWidth, frame.width) - x,
+								height});
+
+				start = -1;
+			}
+		}
+	}
+
+	mFull = false;
+
+	return rects;
+}
+
+void DisplifDamage::reset()
+{
+	mFull = true;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+uint64_t DisplifDamage::hashTile(const DisplifFrame& frame, uint32_t x,
+								 uint32_t y, uint32_t width, uint32_t height)
+{
+	const uint64_t cPrime = 0x100000001b3ULL;
+
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	size_t pixelSize = (frame.bpp + 7) / 8;
+	size_t lineSize = width * pixelSize;
+
+	for (uint32_t i = 0; i < height; i++)
+	{
+		auto line = frame.data + (y + i) * static_cast<size_t>(frame.stride) +
+					x * pixelSize;
+		size_t j = 0;
+
+		// word at a time, the tile is read on each flip
+
+		for (; j + sizeof(uint64_t) <= lineSize; j += sizeof(uint64_t))
+		{
+			uint64_t word;
+
+			memcpy(&word, &line[j], sizeof(word));
+
+			hash = (hash ^ word) * cPrime;
+			hash ^= hash >> 29;
+		}
+
+		for (; j < lineSize; j++)
+		{
+			hash = (hash ^ line[j]) * cPrime;
+		}
+	}
+
+	return hash;
+}
+
+void DisplifDamage::addRect(vector<DisplifRect>& rects,
+							const DisplifRect& rect)
+{
+	// extend the rectangle of the tile rows above if it has the same span
+
+	for (auto it = rects.rbegin(); it != rects.rend(); ++it)
+	{
+		if (it->y + it->height < rect.y)
+		{
+			break;
+		}
+
+		if (it->y + it->height == rect.y && it->x == rect.x &&
+			it->width == rect.width)
+		{
+			it->height += rect.height;
+
+			return;
+		}
+	}
+
+	rects.push_back(rect);
+}
+
+/*******************************************************************************
+ * DisplifSoftwareSink
+ ******************************************************************************/
+
+void DisplifSoftwareSink::update(unsigned int connector,
+								 const DisplifFrame& frame,
+								 const vector<DisplifRect>& rects)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	auto& dst = mFrames[connector];
+	size_t pixelSize = (frame.bpp + 7) / 8;
+
+	if (dst.width != frame.width || dst.height != frame.height ||
+		dst.bpp != frame.bpp)
+	{
+		dst.width = frame.width;
+		dst.height = frame.height;
+		dst.bpp = frame.bpp;
+		dst.data.assign(frame.width * frame.height * pixelSize, 0);
+	}
+
+	size_t dstStride = frame.width * pixelSize;
+
+	for (auto& rect : rects)
+	{
+		size_t lineSize = rect.width * pixelSize;
+
+		for (uint32_t y = rect.y; y < rect.y + rect.height; y++)
+		{
+			memcpy(&dst.data[y * dstStride + rect.x * pixelSize],
+				   &frame.data[y * static_cast<size_t>(frame.stride) +
+							   rect.x * pixelSize], lineSize);
+		}
+
+		mCopiedBytes += lineSize * rect.height;
+	}
+}
+
+void DisplifSoftwareSink::disable(unsigned int connector)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	mFrames.erase(connector);
+}
+
+vector<uint8_t> DisplifSoftwareSink::getFrame(unsigned int connector,
+											  uint32_t& width,
+											  uint32_t& height)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	auto it = mFrames.find(connector);
+
+	if (it == mFrames.end())
+	{
+		width = height = 0;
+
+		return vector<uint8_t>();
+	}
+
+	width = it->second.width;
+	height = it->second.height;
+
+	return it->second.data;
+}
+
+uint64_t DisplifSoftwareSink::getCopiedBytes()
+{
+	lock_guard<mutex> lock(mMutex);
+
+	return mCopiedBytes;
+}
+
+/*******************************************************************************
+ * DisplifConnector
+ ******************************************************************************/
+
+const size_t DisplifConnector::cGrefsPerDirPage;
+
+DisplifConnector::DisplifConnector(domid_t domId, unsigned int index,
+								   uint32_t width, uint32_t height,
+								   DisplifSinkPtr sink,
+								   const DisplifConfig& config) :
+	mDomId(domId),
+	mIndex(index),
+	mWidth(width),
+	mHeight(height),
+	mSink(sink),
+	mConfig(config),
+	mFbCookie(0),
+	mMode {},
+	mDamage(config.tileWidth, config.tileHeight),
+	mEventId(0),
+	mQueuedEvents(0),
+	mStats {},
+	mLog("DisplifConnector")
+{
+}
+
+DisplifConnector::~DisplifConnector()
+{
+	lock_guard<mutex> lock(mMutex);
+
+	disable();
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+void DisplifConnector::setEventRing(DisplifEventRingBufferPtr eventRing)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	mEventRing = eventRing;
+}
+
+void DisplifConnector::processRequest(const xendispl_req& req,
+									  xendispl_resp& rsp)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	rsp.id = req.id;
+	rsp.operation = req.operation;
+	rsp.status = 0;
+
+	try
+	{
+		switch(req.operation)
+		{
+		case XENDISPL_OP_DBUF_CREATE:
+			rsp.status = createBuffer(req.op.dbuf_create);
+			break;
+
+		case XENDISPL_OP_DBUF_DESTROY:
+			rsp.status = destroyBuffer(req.op.dbuf_destroy);
+			break;
+
+		case XENDISPL_OP_FB_ATTACH:
+			rsp.status = attachFramebuffer(req.op.fb_attach);
+			break;
+
+		case XENDISPL_OP_FB_DETACH:
+			rsp.status = detachFramebuffer(req.op.fb_detach);
+			break;
+
+		case XENDISPL_OP_SET_CONFIG:
+			rsp.status = setConfig(req.op.set_config);
+			break;
+
+		case XENDISPL_OP_PG_FLIP:
+			rsp.status = pageFlip(req.op.pg_flip);
+			break;
+
+		default:
+			rsp.status = -ENOTSUP;
+			break;
+		}
+	}
+	catch(const Exception& e)
+	{
+		LOG(mLog, ERROR) << e.what();
+
+		rsp.status = -e.getErrno();
+	}
+
+	DLOG(mLog, DEBUG) << "Request, connector: " << mIndex << ", operation: "
+					  << static_cast<int>(req.operation)
+					  << ", status: " << rsp.status;
+}
+
+void DisplifConnector::flushEvents()
+{
+	lock_guard<mutex> lock(mMutex);
+
+	if (!mQueuedEvents || !mEventRing)
+	{
+		return;
+	}
+
+	mEventRing->flushEvents();
+
+	mStats.flipEvents += mQueuedEvents;
+	mStats.eventBatches++;
+
+	mQueuedEvents = 0;
+}
+
+DisplifStats DisplifConnector::getStats()
+{
+	lock_guard<mutex> lock(mMutex);
+
+	return mStats;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+int DisplifConnector::createBuffer(const xendispl_dbuf_create_req& req)
+{
+	if (req.flags & XENDISPL_DBUF_FLG_REQ_ALLOC)
+	{
+		// be-alloc is not advertised
+		return -EOPNOTSUPP;
+	}
+
+	if (mBuffers.count(req.dbuf_cookie))
+	{
+		return -EEXIST;
+	}
+
+	BufferPtr buffer(new Buffer());
+
+	buffer->width = req.width;
+	buffer->height = req.height;
+	buffer->bpp = req.bpp;
+	buffer->stride = (static_cast<uint64_t>(req.width) * req.bpp + 7) / 8;
+	buffer->offset = req.data_ofs;
+
+	if (!req.width || !req.height || !req.bpp || req.bpp > 32 ||
+		buffer->offset + static_cast<uint64_t>(buffer->stride) * req.height >
+		req.buffer_sz)
+	{
+		return -EINVAL;
+	}
+
+	auto numPages = (req.buffer_sz + XC_PAGE_SIZE - 1) / XC_PAGE_SIZE;
+	auto refs = readDirectory(req.gref_directory, numPages);
+
+	if (mConfig.dmaBuf && mSink->supportsDmaBuf())
+	{
+		try
+		{
+			buffer->exported.reset(new XenGnttabDmaBufferExporter(mDomId,
+																  refs));
+		}
+		catch(const exception& e)
+		{
+			LOG(mLog, WARNING) << "Can't export dma-buf, fallback to copy: "
+							   << e.what();
+		}
+	}
+
+	// the buffer is mapped once, page flips use the mapping
+
+	if (!buffer->exported)
+	{
+		buffer->mapped.reset(new XenGnttabBuffer(mDomId, refs.data(),
+												 refs.size(), PROT_READ));
+	}
+
+	mBuffers[req.dbuf_cookie] = buffer;
+
+	return 0;
+}
+
+int DisplifConnector::destroyBuffer(const xendispl_dbuf_destroy_req& req)
+{
+	auto it = mBuffers.find(req.dbuf_cookie);
+
+	if (it == mBuffers.end())
+	{
+		return -ENOENT;
+	}
+
+	for (auto& fb : mFramebuffers)
+	{
+		if (fb.second.buffer == it->second)
+		{
+			return -EBUSY;
+		}
+	}
+
+	mBuffers.erase(it);
+
+	return 0;
+}
+
+int DisplifConnector::attachFramebuffer(const xendispl_fb_attach_req& req)
+{
+	auto it = mBuffers.find(req.dbuf_cookie);
+
+	if (it == mBuffers.end())
+	{
+		return -ENOENT;
+	}
+
+	if (mFramebuffers.count(req.fb_cookie))
+	{
+		return -EEXIST;
+	}
+
+	if (!req.width || !req.height || req.width > it->second->width ||
+		req.height > it->second->height)
+	{
+		return -EINVAL;
+	}
+
+	mFramebuffers[req.fb_cookie] = {it->second, req.width, req.height,
+									req.pixel_format};
+
+	return 0;
+}
+
+int DisplifConnector::detachFramebuffer(const xendispl_fb_detach_req& req)
+{
+	if (!mFramebuffers.erase(req.fb_cookie))
+	{
+		return -ENOENT;
+	}
+
+	if (mFbCookie == req.fb_cookie)
+	{
+		disable();
+	}
+
+	return 0;
+}
+
+int DisplifConnector::setConfig(const xendispl_set_config_req& req)
+{
+	if (!req.fb_cookie || !req.width || !req.height)
+	{
+		disable();
+
+		return 0;
+	}
+
+	auto it = mFramebuffers.find(req.fb_cookie);
+
+	if (it == mFramebuffers.end())
+	{
+		return -ENOENT;
+	}
+
+	auto& fb = it->second;
+
+	if (req.width > mWidth || req.height > mHeight ||
+		static_cast<uint64_t>(req.x) + req.width > fb.width ||
+		static_cast<uint64_t>(req.y) + req.height > fb.height)
+	{
+		return -EINVAL;
+	}
+
+	mFbCookie = req.fb_cookie;
+	mMode = {req.x, req.y, req.width, req.height};
+
+	mDamage.reset();
+
+	return 0;
+}
+
+int DisplifConnector::pageFlip(const xendispl_page_flip_req& req)
+{
+	auto it = mFramebuffers.find(req.fb_cookie);
+
+	if (it == mFramebuffers.end())
+	{
+		return -ENOENT;
+	}
+
+	if (!mFbCookie)
+	{
+		return -EINVAL;
+	}
+
+	present(it->second);
+
+	mStats.flips++;
+
+	if (mEventRing)
+	{
+		xendispl_evt evt {};
+
+		evt.id = mEventId++;
+		evt.type = XENDISPL_EVT_PG_FLIP;
+		evt.op.pg_flip.fb_cookie = req.fb_cookie;
+
+		// the event is made visible by flushEvents() after the batch
+
+		if (mEventRing->queueEvent(evt))
+		{
+			mQueuedEvents++;
+		}
+	}
+
+	return 0;
+}
+
+GrantRefs DisplifConnector::readDirectory(grant_ref_t dirRef, size_t numPages)
+{
+	GrantRefs refs;
+
+	while (refs.size() < numPages)
+	{
+		if (dirRef == 0)
+		{
+			throw DisplifException("Gref directory is too short", EINVAL);
+		}
+
+		XenGnttabBuffer dirBuffer(mDomId, dirRef, PROT_READ);
+
+		auto dir = static_cast<const xendispl_page_directory*>(
+			dirBuffer.get());
+		auto count = min(cGrefsPerDirPage, numPages - refs.size());
+
+		refs.insert(refs.end(), dir->gref, dir->gref + count);
+
+		dirRef = dir->gref_dir_next_page;
+	}
+
+	return refs;
+}
+
+void DisplifConnector::present(const Framebuffer& fb)
+{
+	auto& buffer = *fb.buffer;
+
+	DisplifFrame frame {};
+
+	frame.offset = buffer.offset + mMode.y * static_cast<size_t>(buffer.stride) +
+				   mMode.x * ((buffer.bpp + 7) / 8);
+	frame.width = min(mMode.width, fb.width - min(mMode.x, fb.width));
+	frame.height = min(mMode.height, fb.height - min(mMode.y, fb.height));
+	frame.stride = buffer.stride;
+	frame.bpp = buffer.bpp;
+	frame.pixelFormat = fb.pixelFormat;
+
+	if (!frame.width || !frame.height)
+	{
+		return;
+	}
+
+	if (buffer.exported)
+	{
+		mSink->presentDmaBuf(mIndex, buffer.exported->getFd(), frame);
+
+		mStats.dmaBufFlips++;
+
+		return;
+	}
+
+	frame.data = static_cast<const uint8_t*>(buffer.mapped->get()) +
+				 frame.offset;
+
+	auto rects = mDamage.update(frame);
+
+	if (rects.empty())
+	{
+		return;
+	}
+
+	mSink->update(mIndex, frame, rects);
+
+	size_t pixelSize = (frame.bpp + 7) / 8;
+
+	for (auto& rect : rects)
+	{
+		mStats.copiedBytes += rect.width * rect.height * pixelSize;
+	}
+
+	mStats.dirtyRects += rects.size();
+}
+
+void DisplifConnector::disable()
+{
+	if (mFbCookie)
+	{
+		mSink->disable(mIndex);
+	}
+
+	mFbCookie = 0;
+	mMode = {};
+
+	mDamage.reset();
+}
+
+/*******************************************************************************
+ * DisplifRingBuffer
+ ******************************************************************************/
+
+DisplifRingBuffer::DisplifRingBuffer(domid_t domId, evtchn_port_t port,
+									 grant_ref_t ref,
+									 DisplifConnectorPtr connector) :
+	RingBufferInBase<xen_displif_back_ring, xen_displif_sring, xendispl_req,
+					 xendispl_resp>(domId, port, ref),
+	mConnector(connector)
+{
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void DisplifRingBuffer::processRequest(const xendispl_req& req)
+{
+	xendispl_resp rsp {};
+
+	mConnector->processRequest(req, rsp);
+
+	queueResponse(rsp);
+}
+
+void DisplifRingBuffer::onRequestsProcessed()
+{
+	pushResponses();
+
+	// page flip events go after the responses
+
+	mConnector->flushEvents();
+}
+
+/*******************************************************************************
+ * DisplifFrontendHandler
+ ******************************************************************************/
+
+DisplifFrontendHandler::DisplifFrontendHandler(const string& devName,
+											   domid_t beDomId,
+											   domid_t feDomId,
+											   uint16_t devId,
+											   const DisplifConfig& config) :
+	FrontendHandlerBase("DisplifFrontend", devName, beDomId, feDomId, devId),
+	mConfig(config),
+	mLog("DisplifFrontend")
+{
+	getXenStore().writeString(getXsBackendPath() + "/" +
+							  XENDISPL_FIELD_BE_VERSIONS,
+							  XENDISPL_PROTOCOL_VERSION);
+}
+
+DisplifFrontendHandler::~DisplifFrontendHandler()
+{
+	stop();
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+DisplifStats DisplifFrontendHandler::getStats()
+{
+	lock_guard<mutex> lock(mConnectorsMutex);
+
+	DisplifStats stats {};
+
+	for (auto connector : mConnectors)
+	{
+		auto connectorStats = connector->getStats();
+
+		stats.flips += connectorStats.flips;
+		stats.dmaBufFlips += connectorStats.dmaBufFlips;
+		stats.dirtyRects += connectorStats.dirtyRects;
+		stats.copiedBytes += connectorStats.copiedBytes;
+		stats.flipEvents += connectorStats.flipEvents;
+		stats.eventBatches += connectorStats.eventBatches;
+	}
+
+	return stats;
+}
+
+/*******************************************************************************
+ * Protected
+ ******************************************************************************/
+
+void DisplifFrontendHandler::onBind()
+{
+	auto& xenStore = getXenStore();
+	auto fePath = getXsFrontendPath();
+
+	auto version = xenStore.readString(fePath + "/" +
+									   XENDISPL_FIELD_FE_VERSION);
+
+	if (version != XENDISPL_PROTOCOL_VERSION)
+	{
+		throw DisplifException("Unsupported protocol version: " + version,
+							   EINVAL);
+	}
+
+	auto isIndex = [] (const string& name)
+		{ return !name.empty() &&
+				 all_of(name.begin(), name.end(), ::isdigit); };
+
+	lock_guard<mutex> lock(mConnectorsMutex);
+
+	mSink = createSink();
+
+	// <frontend>/<connector>
+
+	for (auto& connector : xenStore.readDirectory(fePath))
+	{
+		if (isIndex(connector))
+		{
+			createConnector(stoul(connector), fePath + "/" + connector);
+		}
+	}
+
+	if (mConnectors.empty())
+	{
+		throw DisplifException("No connectors found", EINVAL);
+	}
+
+	LOG(mLog, DEBUG) << Utils::logDomId(getDomId(), getDevId())
+					 << "Bind, connectors: " << mConnectors.size();
+}
+
+void DisplifFrontendHandler::onClosing()
+{
+	lock_guard<mutex> lock(mConnectorsMutex);
+
+	mConnectors.clear();
+
+	mSink.reset();
+}
+
+DisplifSinkPtr DisplifFrontendHandler::createSink()
+{
+	return DisplifSinkPtr(new DisplifSoftwareSink());
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void DisplifFrontendHandler::createConnector(unsigned int index,
+											 const string& path)
+{
+	auto& xenStore = getXenStore();
+
+	auto resolution = xenStore.readString(path + "/" +
+										  XENDISPL_FIELD_RESOLUTION);
+
+	unsigned int width = 0, height = 0;
+
+	if (sscanf(resolution.c_str(), "%u" XENDISPL_RESOLUTION_SEPARATOR "%u",
+			   &width, &height) != 2 || !width || !height)
+	{
+		throw DisplifException("Invalid resolution: " + resolution, EINVAL);
+	}
+
+	auto connector = makeShared<DisplifConnector>(
+			getDomId(), index, width, height, mSink, mConfig);
+
+	auto eventRing = makeShared<DisplifEventRingBuffer>(
+			getDomId(),
+			xenStore.readUint(path + "/" + XENDISPL_FIELD_EVT_CHANNEL),
+			xenStore.readUint(path + "/" + XENDISPL_FIELD_EVT_RING_REF),
+			XENDISPL_IN_RING_OFFS, XENDISPL_IN_RING_SIZE);
+
+	connector->setEventRing(eventRing);
+
+	addRingBuffer(eventRing);
+
+	addRingBuffer(makeShared<DisplifRingBuffer>(
+			getDomId(),
+			xenStore.readUint(path + "/" + XENDISPL_FIELD_REQ_CHANNEL),
+			xenStore.readUint(path + "/" + XENDISPL_FIELD_REQ_RING_REF),
+			connector));
+
+	mConnectors.push_back(connector);
+}
+
+/*******************************************************************************
+ * DisplifBackend
+ ******************************************************************************/
+
+DisplifBackend::DisplifBackend(const string& name, const DisplifConfig& config,
+							   const string& devName) :
+	BackendBase(name, devName),
+	mConfig(config)
+{
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void DisplifBackend::onNewFrontend(domid_t domId, uint16_t devId)
+{
+	addFrontendHandler(FrontendHandlerPtr(
+			new DisplifFrontendHandler(getDeviceName(), getDomId(), domId,
+									   devId, mConfig)));
+}
+
+}
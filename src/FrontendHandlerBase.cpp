@@ -33,9 +33,13 @@ extern "C" {
 #include "Utils.hpp"
 
 using std::bind;
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::steady_clock;
 using std::find;
 using std::lock_guard;
 using std::make_pair;
+using std::min_element;
 using std::mutex;
 using std::placeholders::_1;
 using std::stoi;
@@ -61,12 +65,19 @@ FrontendHandlerBase::FrontendHandlerBase(const string& name,
 	mDevName(devName),
 	mBackendState(XenbusStateUnknown),
 	mFrontendState(XenbusStateUnknown),
+	mBeStateExists(false),
 	mXenStore(bind(&FrontendHandlerBase::onError, this, _1)),
+	mLatencyClass(0),
+	mArenaChunkSize(0),
+	mConnectStats(),
 	mLog(name.empty() ? "FrontendHandler" : name)
 {
 	LOG(mLog, DEBUG) << Utils::logDomId(mFeDomId, mDevId)
 					 << "Create frontend handler";
 
+	mXenStore.setReconnectCallback(bind(&FrontendHandlerBase::onReconnect,
+										this));
+
 	init();
 }
 
@@ -108,6 +119,121 @@ void FrontendHandlerBase::stop()
 	mAsyncContext.stop();
 }
 
+ConnectStats FrontendHandlerBase::getConnectStats() const
+{
+	lock_guard<mutex> lock(mStatsMutex);
+
+	return mConnectStats;
+}
+
+void FrontendHandlerBase::setQueueCpus(const vector<int>& cpus)
+{
+	lock_guard<mutex> lock(mStatsMutex);
+
+	mQueueCpus = cpus;
+
+	if (mQueueCpus.empty())
+	{
+		return;
+	}
+
+	// rebind the running queues, the cleared list is applied on the next
+	// connect
+
+	for (unsigned int i = 0; i < mQueues.size(); i++)
+	{
+		mQueues[i]->setCpu(mQueueCpus[i % mQueueCpus.size()]);
+	}
+}
+
+void FrontendHandlerBase::setPollers(const vector<RingPollerPtr>& pollers)
+{
+	lock_guard<mutex> lock(mMutex);
+	lock_guard<mutex> statsLock(mStatsMutex);
+
+	mPollers = pollers;
+}
+
+vector<RingPollerPtr> FrontendHandlerBase::getPollers() const
+{
+	lock_guard<mutex> lock(mStatsMutex);
+
+	return mPollers;
+}
+
+void FrontendHandlerBase::setScheduler(RingSchedulerPtr scheduler,
+									   int latencyClass)
+{
+	lock_guard<mutex> lock(mMutex);
+	lock_guard<mutex> statsLock(mStatsMutex);
+
+	mScheduler = scheduler;
+	mLatencyClass = latencyClass;
+}
+
+RingSchedulerPtr FrontendHandlerBase::getScheduler() const
+{
+	lock_guard<mutex> lock(mStatsMutex);
+
+	return mScheduler;
+}
+
+int FrontendHandlerBase::getLatencyClass() const
+{
+	lock_guard<mutex> lock(mStatsMutex);
+
+	return mLatencyClass;
+}
+
+vector<RingBufferPtr> FrontendHandlerBase::getRingBuffers() const
+{
+	lock_guard<mutex> lock(mStatsMutex);
+
+	return mRingBuffers;
+}
+
+void FrontendHandlerBase::setConnectCallback(ConnectCallback callback)
+{
+	lock_guard<mutex> lock(mStatsMutex);
+
+	mConnectCallback = callback;
+}
+
+void FrontendHandlerBase::setArenaChunkSize(size_t chunkSize)
+{
+	lock_guard<mutex> lock(mStatsMutex);
+
+	mArenaChunkSize = chunkSize;
+}
+
+ArenaStats FrontendHandlerBase::getArenaStats() const
+{
+	lock_guard<mutex> lock(mStatsMutex);
+
+	return mArena ? mArena->getStats() : ArenaStats();
+}
+
+vector<QueueStats> FrontendHandlerBase::getQueueStats() const
+{
+	lock_guard<mutex> lock(mStatsMutex);
+
+	vector<QueueStats> stats;
+
+	for (unsigned int i = 0; i < mQueues.size(); i++)
+	{
+		QueueStats queueStats;
+
+		queueStats.index = i;
+		queueStats.cpu = mQueues[i]->getCpu();
+		queueStats.port = mQueues[i]->getPort();
+		queueStats.events = mQueues[i]->getNumEvents();
+
+		stats.push_back(queueStats);
+	}
+
+	return stats;
+}
+
 /*******************************************************************************
  * Protected
  ******************************************************************************/
@@ -120,11 +246,78 @@ void FrontendHandlerBase::addRingBuffer(RingBufferPtr ringBuffer)
 					<< ringBuffer->getPort();
 
 	ringBuffer->setErrorCallback(bind(&FrontendHandlerBase::onError, this, _1));
+
+	if (mScheduler && ringBuffer->isPollable())
+	{
+		mScheduler->addRing(ringBuffer, mLatencyClass);
+
+		mScheduledRings.push_back(make_pair(mScheduler, ringBuffer));
+	}
+	else if (!mPollers.empty() && ringBuffer->isPollable())
+	{
+		auto poller = *min_element(mPollers.begin(), mPollers.end(),
+								   [](const RingPollerPtr& a,
+									  const RingPollerPtr& b)
+								   { return a->getNumRings() <
+											b->getNumRings(); });
+
+		poller->addRing(ringBuffer);
+
+		mPolledRings.push_back(make_pair(poller, ringBuffer));
+	}
+
 	ringBuffer->start();
 
+	lock_guard<mutex> lock(mStatsMutex);
+
 	mRingBuffers.push_back(ringBuffer);
 }
 
+void FrontendHandlerBase::writeMaxQueues(unsigned int maxQueues)
+{
+	mXenStore.writeUint(mXsBackendPath + "/multi-queue-max-queues", maxQueues);
+}
+
+unsigned int FrontendHandlerBase::addQueues(unsigned int maxQueues,
+											QueueFactory factory)
+{
+	int value = 0;
+	unsigned int numQueues = 1;
+
+	if (mXenStore.readIntIfExist(mXsFrontendPath + "/multi-queue-num-queues",
+								 value))
+	{
+		numQueues = value;
+	}
+
+	if (value < 0 || numQueues == 0 || numQueues > maxQueues)
+	{
+		throw FrontendHandlerException("Invalid number of queues: " +
+									   to_string(value), EINVAL);
+	}
+
+	for (unsigned int i = 0; i < numQueues; i++)
+	{
+		string path = numQueues == 1 ? mXsFrontendPath :
+					  mXsFrontendPath + "/queue-" + to_string(i);
+
+		auto queue = factory(i, path);
+
+		queue->setCpu(getQueueCpu(i));
+
+		addRingBuffer(queue);
+
+		lock_guard<mutex> lock(mStatsMutex);
+
+		mQueues.push_back(queue);
+	}
+
+	LOG(mLog, INFO) << Utils::logDomId(mFeDomId, mDevId)
+					<< "Add queues: " << numQueues;
+
+	return numQueues;
+}
+
 void FrontendHandlerBase::setBackendState(xenbus_state state)
 {
 	if (state == mBackendState)
@@ -138,7 +331,14 @@ void FrontendHandlerBase::setBackendState(xenbus_state state)
 
 	mBackendState = state;
 
-	if (mXenStore.checkIfExist(mBeStatePath))
+	if (state == XenbusStateInitWait)
+	{
+		mInitWaitTime = steady_clock::now();
+	}
+
+	// existence is tracked by init() and backendStateChanged(), no need to
+	// check it with an additional request
+	if (mBeStateExists)
 	{
 		mXenStore.writeInt(mBeStatePath, state);
 	}
@@ -180,9 +380,7 @@ void FrontendHandlerBase::onStateInitialized()
 	if (mBackendState == XenbusStateInitialising ||
 		mBackendState == XenbusStateInitWait)
 	{
-		onBind();
-
-		setBackendState(XenbusStateConnected);
+		connect();
 	}
 }
 
@@ -191,9 +389,7 @@ void FrontendHandlerBase::onStateConnected()
 	if (mBackendState == XenbusStateInitialising ||
 		mBackendState == XenbusStateInitWait)
 	{
-		onBind();
-
-		setBackendState(XenbusStateConnected);
+		connect();
 	}
 }
 
@@ -229,6 +425,20 @@ void FrontendHandlerBase::onStateReconfigured()
  * Private
  ******************************************************************************/
 
+int FrontendHandlerBase::getQueueCpu(unsigned int index)
+{
+	lock_guard<mutex> lock(mStatsMutex);
+
+	// without the configured cores the queues of all frontends would start
+	// from the same core, the kernel balances them better
+	if (mQueueCpus.empty())
+	{
+		return -1;
+	}
+
+	return mQueueCpus[index % mQueueCpus.size()];
+}
+
 void FrontendHandlerBase::initXenStorePathes()
 {
 	stringstream ss;
@@ -253,9 +463,13 @@ void FrontendHandlerBase::init()
 {
 	initXenStorePathes();
 
-	if (mXenStore.checkIfExist(mBeStatePath))
+	int state;
+
+	mBeStateExists = mXenStore.readIntIfExist(mBeStatePath, state);
+
+	if (mBeStateExists)
 	{
-		mBackendState = static_cast<xenbus_state>(mXenStore.readInt(mBeStatePath));
+		mBackendState = static_cast<xenbus_state>(state);
 
 		if (mBackendState != XenbusStateClosed)
 		{
@@ -267,6 +481,7 @@ void FrontendHandlerBase::init()
 		}
 	}
 
+	// the backend watch moves the backend from Initialising to InitWait
 	mBackendState = XenbusStateUnknown;
 }
 
@@ -274,24 +489,117 @@ void FrontendHandlerBase::release()
 {
 	// stop is required to prevent calling processRequest during deletion
 
+	// the event channels still run, the removal waits for a wake callback
+	// being called and the rings go back to the event mode till stopped
+
+	for (auto& polledRing : mPolledRings)
+	{
+		polledRing.first->removeRing(polledRing.second);
+	}
+
+	mPolledRings.clear();
+
+	for (auto& scheduledRing : mScheduledRings)
+	{
+		scheduledRing.first->removeRing(scheduledRing.second);
+	}
+
+	mScheduledRings.clear();
+
 	for(auto ringBuffer : mRingBuffers)
 	{
 		ringBuffer->stop();
 	}
 
+	lock_guard<mutex> lock(mStatsMutex);
+
 	mRingBuffers.clear();
+	mQueues.clear();
+
+	// the objects still referenced by the client keep the arena alive
+	mArena.reset();
+}
+
+void FrontendHandlerBase::connect()
+{
+	auto initWaitTime = mInitWaitTime;
+	auto feInitializedTime = mFeInitializedTime;
+
+	if (feInitializedTime == TimePoint())
+	{
+		feInitializedTime = steady_clock::now();
+	}
+
+	{
+		lock_guard<mutex> lock(mStatsMutex);
+
+		if (mArenaChunkSize)
+		{
+			mArena.reset(new Arena(mArenaChunkSize));
+		}
+	}
+
+	onBind();
+
+	ConnectCallback connectCallback;
+
+	{
+		lock_guard<mutex> lock(mStatsMutex);
+
+		connectCallback = mConnectCallback;
+	}
+
+	if (connectCallback)
+	{
+		connectCallback(*this);
+	}
+
+	auto bindTime = steady_clock::now();
+
+	setBackendState(XenbusStateConnected);
+
+	auto connectTime = steady_clock::now();
+
+	lock_guard<mutex> lock(mStatsMutex);
+
+	if (initWaitTime != TimePoint() && initWaitTime < feInitializedTime)
+	{
+		mConnectStats.initWait = duration_cast<microseconds>(
+				feInitializedTime - initWaitTime);
+	}
+	else
+	{
+		mConnectStats.initWait = microseconds::zero();
+	}
+
+	mConnectStats.bind = duration_cast<microseconds>(bindTime -
+													 feInitializedTime);
+	mConnectStats.connect = duration_cast<microseconds>(connectTime -
+														bindTime);
+	mConnectStats.total = mConnectStats.initWait + mConnectStats.bind +
+						  mConnectStats.connect;
+	mConnectStats.numConnects++;
+
+	LOG(mLog, INFO) << Utils::logDomId(mFeDomId, mDevId)
+					<< "Connected in " << mConnectStats.total.count()
+					<< " us, init wait: " << mConnectStats.initWait.count()
+					<< " us, bind: " << mConnectStats.bind.count()
+					<< " us, connect: " << mConnectStats.connect.count()
+					<< " us";
 }
 
 void FrontendHandlerBase::frontendStateChanged()
 {
 	lock_guard<mutex> lock(mMutex);
 
-	if (!mXenStore.checkIfExist(mFeStatePath))
+	int value;
+
+	if (!mXenStore.readIntIfExist(mFeStatePath, value))
 	{
 		return;
 	}
 
-	auto state = static_cast<xenbus_state>(mXenStore.readInt(mFeStatePath));
+	auto state = static_cast<xenbus_state>(value);
 
 	if (state == mFrontendState)
 	{
@@ -300,6 +608,11 @@ void FrontendHandlerBase::frontendStateChanged()
 
 	mFrontendState = state;
 
+	if (state == XenbusStateInitialised || state == XenbusStateConnected)
+	{
+		mFeInitializedTime = steady_clock::now();
+	}
+
 	LOG(mLog, INFO) << Utils::logDomId(mFeDomId, mDevId)
 					<< "Frontend state changed to: "
 					<< Utils::logState(state);
@@ -311,12 +624,16 @@ void FrontendHandlerBase::backendStateChanged()
 {
 	lock_guard<mutex> lock(mMutex);
 
-	if (!mXenStore.checkIfExist(mBeStatePath))
+	int value;
+
+	mBeStateExists = mXenStore.readIntIfExist(mBeStatePath, value);
+
+	if (!mBeStateExists)
 	{
 		return;
 	}
 
-	auto state = static_cast<xenbus_state>(mXenStore.readInt(mBeStatePath));
+	auto state = static_cast<xenbus_state>(value);
 
 	if (state == mBackendState)
 	{
@@ -369,6 +686,16 @@ void FrontendHandlerBase::onBackendStateChanged(xenbus_state state)
 	}
 }
 
+void FrontendHandlerBase::onReconnect()
+{
+	LOG(mLog, INFO) << Utils::logDomId(mFeDomId, mDevId)
+					<< "Resync states";
+
+	// the state changes made while the connection was lost are not watched
+	backendStateChanged();
+	frontendStateChanged();
+}
+
 void FrontendHandlerBase::onError(const std::exception& e)
 {
 	LOG(mLog, ERROR) << Utils::logDomId(mFeDomId, mDevId) << e.what();
@@ -381,6 +708,12 @@ void FrontendHandlerBase::close(xenbus_state stateAfterClose)
 {
 	LOG(mLog, INFO) << "Close";
 
+	mInitWaitTime = TimePoint();
+	mFeInitializedTime = TimePoint();
+
+	// all state writes below are issued back to back without existence
+	// checks; each transition is still written separately as the frontend
+	// has to observe Closing and Closed
 	if (mBackendState != XenbusStateClosed)
 	{
 		setBackendState(XenbusStateClosing);
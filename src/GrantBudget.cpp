@@ -0,0 +1,476 @@
+/*
+ *  Mapped grant pages budget
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include "GrantBudget.hpp"
+
+#include <algorithm>
+
+using std::find;
+using std::lock_guard;
+using std::map;
+using std::mutex;
+using std::pair;
+using std::sort;
+using std::try_to_lock;
+using std::unique_lock;
+using std::vector;
+
+namespace XenBackend {
+
+namespace {
+
+template<typename Key, typename Usage>
+size_t getPages(const map<Key, Usage>& usages, Key key)
+{
+	auto it = usages.find(key);
+
+	return it != usages.end() ? it->second.pages : 0;
+}
+
+template<typename Key, typename Usage>
+void releasePages(map<Key, Usage>& usages, Key key, size_t count)
+{
+	auto it = usages.find(key);
+
+	if (it == usages.end())
+	{
+		return;
+	}
+
+	it->second.pages -= count;
+
+	// the domains and the frontends come and go, the maps keep the ones
+	// which have pages mapped
+	if (!it->second.pages)
+	{
+		usages.erase(it);
+	}
+}
+
+}
+
+/*******************************************************************************
+ * GrantAccount
+ ******************************************************************************/
+
+GrantAccount::GrantAccount(domid_t domId, uint16_t devId) :
+	mDomId(domId),
+	mDevId(devId),
+	mPages(0),
+	mLastUse(0)
+{
+	touch();
+
+	GrantBudget::getInstance().addAccount(this);
+}
+
+GrantAccount::~GrantAccount()
+{
+	GrantBudget::getInstance().removeAccount(this);
+
+	// wait for the eviction started before the account is removed
+	lock_guard<mutex> lock(mEvictMutex);
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+void GrantAccount::setEvictCallback(EvictCallback evictCallback)
+{
+	lock_guard<mutex> lock(mEvictMutex);
+
+	mEvictCallback = evictCallback;
+}
+
+/*******************************************************************************
+ * GrantBudget
+ ******************************************************************************/
+
+GrantBudget::GrantBudget() :
+	mLimited(false),
+	mLog("GrantBudget")
+{
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+GrantBudget& GrantBudget::getInstance()
+{
+	static GrantBudget budget;
+
+	return budget;
+}
+
+void GrantBudget::setLimits(const GrantLimits& limits)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	mLimits = limits;
+	mLimited = mLimits.maxPages || mLimits.maxDomainPages ||
+			   mLimits.maxFrontendPages;
+
+	LOG(mLog, INFO) << "Set limits, pages: " << mLimits.maxPages
+					<< ", domain pages: " << mLimits.maxDomainPages
+					<< ", frontend pages: " << mLimits.maxFrontendPages;
+}
+
+GrantLimits GrantBudget::getLimits() const
+{
+	lock_guard<mutex> lock(mMutex);
+
+	return mLimits;
+}
+
+GrantUsage GrantBudget::getUsage() const
+{
+	lock_guard<mutex> lock(mMutex);
+
+	return mUsage.get();
+}
+
+GrantUsage GrantBudget::getDomainUsage(domid_t domId) const
+{
+	lock_guard<mutex> lock(mMutex);
+
+	auto it = mDomains.find(domId);
+
+	return it != mDomains.end() ? it->second.get() : Usage().get();
+}
+
+GrantUsage GrantBudget::getFrontendUsage(domid_t domId, uint16_t devId) const
+{
+	lock_guard<mutex> lock(mMutex);
+
+	auto it = mFrontends.find(getFrontendKey(domId, devId));
+
+	return it != mFrontends.end() ? it->second.get() : Usage().get();
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void GrantBudget::Usage::add(size_t count)
+{
+	pages += count;
+
+	if (pages > peakPages)
+	{
+		peakPages = pages;
+	}
+}
+
+GrantUsage GrantBudget::Usage::get() const
+{
+	GrantUsage usage;
+
+	usage.pages = pages;
+	usage.peakPages = peakPages;
+	usage.evictedPages = evictedPages;
+	usage.rejections = rejections;
+
+	return usage;
+}
+
+bool GrantBudget::acquire(domid_t domId, GrantAccount* account, size_t count,
+						  bool& accounted)
+{
+	// without limits there is nothing to check, the pages are not accounted
+	// to keep the budget lock and the maps out of every mapping
+	if (!mLimited)
+	{
+		if (account)
+		{
+			account->mPages += count;
+		}
+
+		accounted = false;
+
+		return true;
+	}
+
+	for (int pass = 0; ; pass++)
+	{
+		Scope scope;
+		size_t excess;
+
+		{
+			lock_guard<mutex> lock(mMutex);
+
+			excess = getExcess(domId, account, count, scope);
+
+			if (!excess)
+			{
+				mUsage.add(count);
+				mDomains[domId].add(count);
+
+				if (account)
+				{
+					mFrontends[getFrontendKey(account->mDomId,
+											  account->mDevId)].add(count);
+
+					account->mPages += count;
+				}
+
+				accounted = true;
+
+				return true;
+			}
+
+			if (pass == cMaxEvictPasses)
+			{
+				reject(domId, account);
+
+				return false;
+			}
+		}
+
+		// pages are unmapped by the callbacks without the budget lock, so
+		// the limits are checked again: other threads may take them meanwhile
+		if (!evict(domId, account, scope, excess))
+		{
+			lock_guard<mutex> lock(mMutex);
+
+			reject(domId, account);
+
+			return false;
+		}
+	}
+}
+
+void GrantBudget::release(domid_t domId, GrantAccount* account, size_t count,
+						  bool accounted)
+{
+	if (!accounted)
+	{
+		if (account)
+		{
+			account->mPages -= count;
+		}
+
+		return;
+	}
+
+	lock_guard<mutex> lock(mMutex);
+
+	mUsage.pages -= count;
+
+	releasePages(mDomains, domId, count);
+
+	if (account)
+	{
+		releasePages(mFrontends, getFrontendKey(account->mDomId,
+												account->mDevId), count);
+
+		account->mPages -= count;
+	}
+}
+
+void GrantBudget::addAccount(GrantAccount* account)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	mAccounts.push_back(account);
+}
+
+void GrantBudget::removeAccount(GrantAccount* account)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	mAccounts.erase(find(mAccounts.begin(), mAccounts.end(), account));
+}
+
+size_t GrantBudget::getExcess(domid_t domId, GrantAccount* account,
+							  size_t count, Scope& scope)
+{
+	// the narrowest scope first: evicting own pages doesn't hurt others
+
+	if (account && mLimits.maxFrontendPages)
+	{
+		auto pages = getPages(mFrontends, getFrontendKey(account->mDomId,
+														 account->mDevId));
+
+		if (pages + count > mLimits.maxFrontendPages)
+		{
+			scope = Scope::FRONTEND;
+
+			return pages + count - mLimits.maxFrontendPages;
+		}
+	}
+
+	if (mLimits.maxDomainPages)
+	{
+		auto pages = getPages(mDomains, domId);
+
+		if (pages + count > mLimits.maxDomainPages)
+		{
+			scope = Scope::DOMAIN;
+
+			return pages + count - mLimits.maxDomainPages;
+		}
+	}
+
+	if (mLimits.maxPages && mUsage.pages + count > mLimits.maxPages)
+	{
+		scope = Scope::PROCESS;
+
+		return mUsage.pages + count - mLimits.maxPages;
+	}
+
+	return 0;
+}
+
+bool GrantBudget::isInScope(GrantAccount* candidate, domid_t domId,
+							GrantAccount* account, Scope scope) const
+{
+	switch(scope)
+	{
+	case Scope::FRONTEND:
+		return candidate->mDomId == account->mDomId &&
+			   candidate->mDevId == account->mDevId;
+
+	case Scope::DOMAIN:
+		return candidate->mDomId == domId;
+
+	default:
+		return true;
+	}
+}
+
+size_t GrantBudget::evict(domid_t domId, GrantAccount* account, Scope scope,
+						  size_t numPages)
+{
+	unique_lock<mutex> lock(mMutex);
+
+	// last use time is sampled once, the owners keep touching the accounts
+	vector<pair<int64_t, GrantAccount*>> candidates;
+
+	for (auto candidate : mAccounts)
+	{
+		if (candidate->mPages && isInScope(candidate, domId, account, scope))
+		{
+			candidates.emplace_back(candidate->mLastUse, candidate);
+		}
+	}
+
+	sort(candidates.begin(), candidates.end());
+
+	size_t evicted = 0;
+
+	for (auto& item : candidates)
+	{
+		auto candidate = item.second;
+
+		if (evicted >= numPages)
+		{
+			break;
+		}
+
+		// the account may be deleted while the budget is unlocked
+		if (find(mAccounts.begin(), mAccounts.end(), candidate) ==
+			mAccounts.end())
+		{
+			continue;
+		}
+
+		// the account being evicted by another thread is skipped, waiting
+		// for it here could deadlock with its callback releasing the pages
+		unique_lock<mutex> evictLock(candidate->mEvictMutex, try_to_lock);
+
+		if (!evictLock.owns_lock() || !candidate->mEvictCallback)
+		{
+			continue;
+		}
+
+		auto key = getFrontendKey(candidate->mDomId, candidate->mDevId);
+		auto candidateDomId = candidate->mDomId;
+
+		lock.unlock();
+
+		size_t count = 0;
+
+		try
+		{
+			count = candidate->mEvictCallback(numPages - evicted);
+		}
+		catch(const std::exception& e)
+		{
+			LOG(mLog, ERROR) << "Eviction failed: " << e.what();
+		}
+
+		evictLock.unlock();
+
+		lock.lock();
+
+		evicted += count;
+
+		mUsage.evictedPages += count;
+
+		// the usage is dropped if the evicted pages were the last ones
+		auto domain = mDomains.find(candidateDomId);
+
+		if (domain != mDomains.end())
+		{
+			domain->second.evictedPages += count;
+		}
+
+		auto frontend = mFrontends.find(key);
+
+		if (frontend != mFrontends.end())
+		{
+			frontend->second.evictedPages += count;
+		}
+	}
+
+	DLOG(mLog, DEBUG) << "Evict pages, dom: " << domId
+					  << ", requested: " << numPages
+					  << ", evicted: " << evicted;
+
+	return evicted;
+}
+
+void GrantBudget::reject(domid_t domId, GrantAccount* account)
+{
+	// the usage is kept for the owners of the mapped pages only
+	mUsage.rejections++;
+
+	auto domain = mDomains.find(domId);
+
+	if (domain != mDomains.end())
+	{
+		domain->second.rejections++;
+	}
+
+	if (account)
+	{
+		auto frontend = mFrontends.find(getFrontendKey(account->mDomId,
+													   account->mDevId));
+
+		if (frontend != mFrontends.end())
+		{
+			frontend->second.rejections++;
+		}
+	}
+}
+
+}
@@ -0,0 +1,540 @@
+/*
+ *  Asynchronous file I/O ring
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include "IoRing.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using std::lock_guard;
+using std::move;
+using std::mutex;
+using std::thread;
+using std::unique_lock;
+using std::vector;
+
+namespace XenBackend {
+
+/*******************************************************************************
+ * Static
+ ******************************************************************************/
+
+static unsigned loadAcquire(const unsigned* p)
+{
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static void storeRelease(unsigned* p, unsigned value)
+{
+	__atomic_store_n(p, value, __ATOMIC_RELEASE);
+}
+
+/*******************************************************************************
+ * IoRing
+ ******************************************************************************/
+
+IoRing::IoRing(unsigned int depth, BatchCallback batchCallback,
+			   ErrorCallback errorCallback) :
+	mDepth(depth),
+	mBatchCallback(batchCallback),
+	mErrorCallback(errorCallback),
+	mLog("IoRing"),
+	mFd(-1),
+	mEventFd(-1),
+	mSqPtr(MAP_FAILED),
+	mSqSize(0),
+	mCqPtr(MAP_FAILED),
+	mCqSize(0),
+	mSqes(nullptr),
+	mSqesSize(0),
+	mNumQueued(0),
+	mInFlight(0),
+	mStarted(false)
+{
+	try
+	{
+		init();
+	}
+	catch(const std::exception& e)
+	{
+		release();
+
+		throw;
+	}
+}
+
+IoRing::~IoRing()
+{
+	stop();
+	release();
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+void IoRing::start()
+{
+	DLOG(mLog, DEBUG) << "Start";
+
+	if (mStarted)
+	{
+		throw IoRingException("IoRing is already started", EPERM);
+	}
+
+	mStarted = true;
+
+	if (isAsync())
+	{
+		mThread = thread(&IoRing::completionThread, this);
+	}
+}
+
+void IoRing::stop()
+{
+	if (!mStarted)
+	{
+		return;
+	}
+
+	DLOG(mLog, DEBUG) << "Stop";
+
+	submit();
+
+	{
+		unique_lock<mutex> lock(mMutex);
+
+		if (mThread.joinable())
+		{
+			mCondVar.wait(lock, [this] { return mInFlight == 0; });
+		}
+	}
+
+	if (mPollFd)
+	{
+		mPollFd->stop();
+	}
+
+	if (mThread.joinable())
+	{
+		mThread.join();
+	}
+
+	mStarted = false;
+}
+
+void IoRing::readv(int fd, const iovec* iov, int iovcnt, off_t offset,
+				   Callback callback)
+{
+	queue({IORING_OP_READV, fd, iov, iovcnt, offset, 0, callback});
+}
+
+void IoRing::writev(int fd, const iovec* iov, int iovcnt, off_t offset,
+					Callback callback)
+{
+	queue({IORING_OP_WRITEV, fd, iov, iovcnt, offset, 0, callback});
+}
+
+void IoRing::fsync(int fd, Callback callback)
+{
+	queue({IORING_OP_FSYNC, fd, nullptr, 0, 0, 0, callback});
+}
+
+void IoRing::discard(int fd, off_t offset, off_t length, Callback callback)
+{
+	queue({IORING_OP_FALLOCATE, fd, nullptr, 0, offset, length, callback});
+}
+
+void IoRing::submit()
+{
+	if (!isAsync())
+	{
+		submitSync();
+
+		return;
+	}
+
+	lock_guard<mutex> lock(mMutex);
+
+	while (mNumQueued)
+	{
+		auto ret = syscall(__NR_io_uring_enter, mFd, mNumQueued, 0, 0,
+						   nullptr, 0);
+
+		if (ret < 0)
+		{
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+			{
+				continue;
+			}
+
+			throw IoRingException("Can't submit io_uring entries", errno);
+		}
+
+		mNumQueued -= ret;
+	}
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void IoRing::init()
+{
+	io_uring_params params {};
+
+	mFd = syscall(__NR_io_uring_setup, mDepth, &params);
+
+	if (mFd < 0)
+	{
+		LOG(mLog, WARNING) << "io_uring is not available ("
+						   << strerror(errno)
+						   << "), use synchronous operations";
+
+		return;
+	}
+
+	mSqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	mCqSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+	mSqPtr = mmap(nullptr, mSqSize, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_SQ_RING);
+
+	if (mSqPtr == MAP_FAILED)
+	{
+		throw IoRingException("Can't map io_uring SQ ring", errno);
+	}
+
+	mCqPtr = mmap(nullptr, mCqSize, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_CQ_RING);
+
+	if (mCqPtr == MAP_FAILED)
+	{
+		throw IoRingException("Can't map io_uring CQ ring", errno);
+	}
+
+	mSqesSize = params.sq_entries * sizeof(io_uring_sqe);
+
+	auto sqes = mmap(nullptr, mSqesSize, PROT_READ | PROT_WRITE,
+					 MAP_SHARED | MAP_POPULATE, mFd, IORING_OFF_SQES);
+
+	if (sqes == MAP_FAILED)
+	{
+		throw IoRingException("Can't map io_uring SQEs", errno);
+	}
+
+	mSqes = static_cast<io_uring_sqe*>(sqes);
+
+	auto sq = static_cast<uint8_t*>(mSqPtr);
+	auto cq = static_cast<uint8_t*>(mCqPtr);
+
+	mSqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+	mSqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+	mSqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+	mSqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+	mCqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+	mCqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+	mCqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+	mCqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+	mEventFd = eventfd(0, EFD_CLOEXEC);
+
+	if (mEventFd < 0)
+	{
+		throw IoRingException("Can't create eventfd", errno);
+	}
+
+	if (syscall(__NR_io_uring_register, mFd, IORING_REGISTER_EVENTFD,
+				&mEventFd, 1) < 0)
+	{
+		throw IoRingException("Can't register io_uring eventfd", errno);
+	}
+
+	// limit in flight operations by the CQ size to avoid CQ overflow
+	mDepth = std::min(params.sq_entries, params.cq_entries);
+
+	mCallbacks.resize(mDepth);
+	mFreeSlots.reserve(mDepth);
+
+	for (unsigned int i = 0; i < mDepth; i++)
+	{
+		mFreeSlots.push_back(mDepth - i - 1);
+	}
+
+	mPollFd.reset(new PollFd(mEventFd, POLLIN));
+
+	DLOG(mLog, DEBUG) << "Create io ring, depth: " << mDepth;
+}
+
+void IoRing::release()
+{
+	if (mSqes)
+	{
+		munmap(mSqes, mSqesSize);
+	}
+
+	if (mCqPtr != MAP_FAILED)
+	{
+		munmap(mCqPtr, mCqSize);
+	}
+
+	if (mSqPtr != MAP_FAILED)
+	{
+		munmap(mSqPtr, mSqSize);
+	}
+
+	if (mEventFd >= 0)
+	{
+		close(mEventFd);
+	}
+
+	if (mFd >= 0)
+	{
+		close(mFd);
+
+		DLOG(mLog, DEBUG) << "Delete io ring";
+	}
+}
+
+void IoRing::queue(Operation&& operation)
+{
+	if (!isAsync())
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		mSyncOperations.push_back(move(operation));
+
+		return;
+	}
+
+	unique_lock<mutex> lock(mMutex);
+
+	if (mFreeSlots.empty() && mNumQueued)
+	{
+		lock.unlock();
+
+		submit();
+
+		lock.lock();
+	}
+
+	mCondVar.wait(lock, [this] { return !mFreeSlots.empty(); });
+
+	auto slot = mFreeSlots.back();
+
+	mFreeSlots.pop_back();
+
+	mCallbacks[slot] = move(operation.callback);
+
+	auto tail = *mSqTail;
+	auto index = tail & *mSqMask;
+	auto sqe = &mSqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+
+	sqe->opcode = operation.opcode;
+	sqe->fd = operation.fd;
+	sqe->user_data = slot;
+
+	switch(operation.opcode)
+	{
+	case IORING_OP_READV:
+	case IORING_OP_WRITEV:
+		sqe->addr = reinterpret_cast<uint64_t>(operation.iov);
+		sqe->len = operation.iovcnt;
+		sqe->off = operation.offset;
+		break;
+
+	case IORING_OP_FSYNC:
+		// flush should cover all writes submitted before it
+		sqe->flags = IOSQE_IO_DRAIN;
+		break;
+
+	case IORING_OP_FALLOCATE:
+		sqe->off = operation.offset;
+		sqe->addr = operation.length;
+		sqe->len = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+		break;
+
+	default:
+		break;
+	}
+
+	mSqArray[index] = index;
+
+	storeRelease(mSqTail, tail + 1);
+
+	mNumQueued++;
+	mInFlight++;
+}
+
+void IoRing::submitSync()
+{
+	vector<Operation> operations;
+
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		operations.swap(mSyncOperations);
+	}
+
+	if (operations.empty())
+	{
+		return;
+	}
+
+	for (auto& operation : operations)
+	{
+		auto result = performSync(operation);
+
+		if (operation.callback)
+		{
+			operation.callback(result);
+		}
+	}
+
+	if (mBatchCallback)
+	{
+		mBatchCallback();
+	}
+}
+
+int IoRing::performSync(const Operation& operation)
+{
+	ssize_t ret = 0;
+
+	switch(operation.opcode)
+	{
+	case IORING_OP_READV:
+		ret = preadv(operation.fd, operation.iov, operation.iovcnt,
+					 operation.offset);
+		break;
+
+	case IORING_OP_WRITEV:
+		ret = pwritev(operation.fd, operation.iov, operation.iovcnt,
+					  operation.offset);
+		break;
+
+	case IORING_OP_FSYNC:
+		ret = ::fsync(operation.fd);
+		break;
+
+	case IORING_OP_FALLOCATE:
+		ret = fallocate(operation.fd,
+						FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+						operation.offset, operation.length);
+		break;
+
+	default:
+		errno = EINVAL;
+		ret = -1;
+		break;
+	}
+
+	return ret < 0 ? -errno : ret;
+}
+
+void IoRing::reapCompletions()
+{
+	auto head = *mCqHead;
+	auto tail = loadAcquire(mCqTail);
+
+	if (head == tail)
+	{
+		return;
+	}
+
+	while (head != tail)
+	{
+		auto cqe = &mCqes[head & *mCqMask];
+		auto slot = static_cast<unsigned int>(cqe->user_data);
+		auto result = cqe->res;
+
+		Callback callback;
+
+		{
+			lock_guard<mutex> lock(mMutex);
+
+			callback = move(mCallbacks[slot]);
+
+			mFreeSlots.push_back(slot);
+		}
+
+		head++;
+
+		storeRelease(mCqHead, head);
+
+		if (callback)
+		{
+			callback(result);
+		}
+
+		mInFlight--;
+	}
+
+	if (mBatchCallback)
+	{
+		mBatchCallback();
+	}
+
+	lock_guard<mutex> lock(mMutex);
+
+	mCondVar.notify_all();
+}
+
+void IoRing::completionThread()
+{
+	try
+	{
+		while(mPollFd->poll())
+		{
+			eventfd_t value;
+
+			if (eventfd_read(mEventFd, &value) < 0 && errno != EAGAIN)
+			{
+				throw IoRingException("Can't read eventfd", errno);
+			}
+
+			reapCompletions();
+		}
+	}
+	catch(const std::exception& e)
+	{
+		if (mErrorCallback)
+		{
+			mErrorCallback(e);
+		}
+		else
+		{
+			LOG(mLog, ERROR) << e.what();
+		}
+	}
+}
+
+}
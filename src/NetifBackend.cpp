@@ -0,0 +1,1366 @@
+/*
+ *  Xen network device backend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include "NetifBackend.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/if_tun.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "XenStore.hpp"
+
+using std::lock_guard;
+using std::max;
+using std::min;
+using std::mutex;
+using std::string;
+using std::swap;
+using std::thread;
+using std::to_string;
+using std::vector;
+
+namespace XenBackend {
+
+const uint8_t NetifVnetHdr::cFlagNeedsCsum;
+const uint8_t NetifVnetHdr::cFlagDataValid;
+const uint8_t NetifVnetHdr::cGsoNone;
+const uint8_t NetifVnetHdr::cGsoTcpV4;
+const uint8_t NetifVnetHdr::cGsoUdp;
+const uint8_t NetifVnetHdr::cGsoTcpV6;
+
+const size_t NetifFdDevice::cMaxPacketSize;
+
+/*******************************************************************************
+ * NetifFlow
+ ******************************************************************************/
+
+static uint16_t getBe16(const uint8_t* data)
+{
+	return (data[0] << 8) | data[1];
+}
+
+static uint32_t hashBytes(uint32_t hash, const uint8_t* data, size_t size)
+{
+	// FNV-1a
+	for (size_t i = 0; i < size; i++)
+	{
+		hash = (hash ^ data[i]) * 16777619u;
+	}
+
+	return hash;
+}
+
+bool NetifFlow::parse(const uint8_t* data, size_t size, NetifFlowInfo& info)
+{
+	info = NetifFlowInfo();
+
+	if (size < ETH_HLEN)
+	{
+		return false;
+	}
+
+	size_t offset = ETH_HLEN;
+	uint16_t proto = getBe16(&data[offset - 2]);
+
+	if (proto == ETH_P_8021Q || proto == ETH_P_8021AD)
+	{
+		if (size < offset + 4)
+		{
+			return false;
+		}
+
+		proto = getBe16(&data[offset + 2]);
+		offset += 4;
+	}
+
+	info.l3Offset = offset;
+	info.l3Proto = proto;
+
+	uint32_t hash = 2166136261u;
+	bool hasPorts = true;
+
+	if (proto == ETH_P_IP)
+	{
+		if (size < offset + 20)
+		{
+			return false;
+		}
+
+		size_t ihl = (data[offset] & 0x0F) * 4;
+
+		if (ihl < 20 || size < offset + ihl)
+		{
+			return false;
+		}
+
+		info.l4Proto = data[offset + 9];
+		info.l4Offset = offset + ihl;
+
+		// addresses
+		hash = hashBytes(hash, &data[offset + 12], 8);
+
+		// only the first fragment contains L4 header
+		hasPorts = (getBe16(&data[offset + 6]) & 0x1FFF) == 0;
+	}
+	else if (proto == ETH_P_IPV6)
+	{
+		if (size < offset + 40)
+		{
+			return false;
+		}
+
+		info.l4Proto = data[offset + 6];
+		info.l4Offset = offset + 40;
+
+		hash = hashBytes(hash, &data[offset + 8], 32);
+	}
+	else
+	{
+		return false;
+	}
+
+	hash = hashBytes(hash, &info.l4Proto, 1);
+
+	if (hasPorts && info.l4Proto == IPPROTO_TCP &&
+		size >= info.l4Offset + 20)
+	{
+		size_t doff = (data[info.l4Offset + 12] >> 4) * 4;
+
+		if (doff >= 20 && size >= info.l4Offset + doff)
+		{
+			info.l4Length = doff;
+		}
+	}
+	else if (hasPorts && info.l4Proto == IPPROTO_UDP &&
+			 size >= info.l4Offset + 8)
+	{
+		info.l4Length = 8;
+	}
+
+	if (info.l4Length)
+	{
+		hash = hashBytes(hash, &data[info.l4Offset], 4);
+	}
+
+	info.hash = hash;
+
+	return true;
+}
+
+uint32_t NetifFlow::getHash(const uint8_t* data, size_t size)
+{
+	NetifFlowInfo info;
+
+	if (!parse(data, size, info))
+	{
+		return 0;
+	}
+
+	return info.hash;
+}
+
+/*******************************************************************************
+ * NetifFdDevice
+ ******************************************************************************/
+
+NetifFdDevice::NetifFdDevice(const string& name, unsigned int batch) :
+	mFd(-1),
+	mLog(name),
+	mBatch(max(batch, 1u)),
+	mPackets(mBatch),
+	mBuffer(mBatch * cMaxPacketSize)
+{
+	for (size_t i = 0; i < mBatch; i++)
+	{
+		mPackets[i].data = &mBuffer[i * cMaxPacketSize];
+	}
+}
+
+NetifFdDevice::~NetifFdDevice()
+{
+	stop();
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+void NetifFdDevice::start(ReceiveCallback callback)
+{
+	mCallback = callback;
+
+	mPollFd.reset(new PollFd(mFd, POLLIN));
+
+	mThread = thread(&NetifFdDevice::run, this);
+}
+
+void NetifFdDevice::stop()
+{
+	if (mPollFd)
+	{
+		mPollFd->stop();
+	}
+
+	if (mThread.joinable())
+	{
+		mThread.join();
+	}
+
+	mPollFd.reset();
+}
+
+size_t NetifFdDevice::send(const NetifPacket* packets, size_t count)
+{
+	size_t sent = 0;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		iovec iov[2] = {
+			{ const_cast<NetifVnetHdr*>(&packets[i].hdr),
+			  sizeof(NetifVnetHdr) },
+			{ packets[i].data, packets[i].size }
+		};
+
+		if (writev(mFd, iov, 2) < 0)
+		{
+			DLOG(mLog, WARNING) << "Can't send packet, size: "
+								<< packets[i].size << ", error: " << errno;
+
+			continue;
+		}
+
+		sent++;
+	}
+
+	return sent;
+}
+
+/*******************************************************************************
+ * Protected
+ ******************************************************************************/
+
+ssize_t NetifFdDevice::receive(iovec* iov, int count)
+{
+	auto len = readv(mFd, iov, count);
+
+	if (len < 0)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			return -1;
+		}
+
+		if (errno == EINTR)
+		{
+			return 0;
+		}
+
+		throw NetifException("Can't receive packet", errno);
+	}
+
+	return len;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void NetifFdDevice::run()
+{
+	try
+	{
+		while (mPollFd->poll())
+		{
+			size_t count = 0;
+
+			// read everything available to hand over packets in one batch
+			while (count < mBatch)
+			{
+				auto& packet = mPackets[count];
+
+				iovec iov[2] = {
+					{ &packet.hdr, sizeof(NetifVnetHdr) },
+					{ packet.data, cMaxPacketSize }
+				};
+
+				auto len = receive(iov, 2);
+
+				if (len < 0)
+				{
+					break;
+				}
+
+				if (static_cast<size_t>(len) <= sizeof(NetifVnetHdr))
+				{
+					continue;
+				}
+
+				packet.size = len - sizeof(NetifVnetHdr);
+
+				count++;
+			}
+
+			if (count)
+			{
+				mCallback(mPackets.data(), count);
+			}
+		}
+	}
+	catch(const std::exception& e)
+	{
+		LOG(mLog, ERROR) << e.what();
+	}
+}
+
+/*******************************************************************************
+ * NetifTapDevice
+ ******************************************************************************/
+
+NetifTapDevice::NetifTapDevice(const string& ifName, unsigned int batch) :
+	NetifFdDevice("NetifTap", batch),
+	mIfName(ifName)
+{
+	try
+	{
+		init();
+	}
+	catch(const std::exception& e)
+	{
+		release();
+
+		throw;
+	}
+}
+
+NetifTapDevice::~NetifTapDevice()
+{
+	stop();
+
+	release();
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+void NetifTapDevice::setOffload(bool csum, bool tso4, bool tso6)
+{
+	unsigned int flags = 0;
+
+	// segmentation offload requires checksum offload
+	if (csum)
+	{
+		flags |= TUN_F_CSUM;
+
+		if (tso4)
+		{
+			flags |= TUN_F_TSO4;
+		}
+
+		if (tso6)
+		{
+			flags |= TUN_F_TSO6;
+		}
+	}
+
+	if (ioctl(mFd, TUNSETOFFLOAD, flags) < 0)
+	{
+		throw NetifException("Can't set offload: " + mIfName, errno);
+	}
+
+	LOG(mLog, DEBUG) << "Set offload, if: " << mIfName << ", csum: " << csum
+					 << ", tso4: " << tso4 << ", tso6: " << tso6;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void NetifTapDevice::init()
+{
+	mFd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+	if (mFd < 0)
+	{
+		throw NetifException("Can't open tun device", errno);
+	}
+
+	ifreq ifr {};
+
+	ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
+	strncpy(ifr.ifr_name, mIfName.c_str(), IFNAMSIZ - 1);
+
+	if (ioctl(mFd, TUNSETIFF, &ifr) < 0)
+	{
+		throw NetifException("Can't create tap: " + mIfName, errno);
+	}
+
+	mIfName = ifr.ifr_name;
+
+	int hdrSize = sizeof(NetifVnetHdr);
+
+	if (ioctl(mFd, TUNSETVNETHDRSZ, &hdrSize) < 0)
+	{
+		throw NetifException("Can't set vnet header size: " + mIfName, errno);
+	}
+
+	// hotplug scripts usually do it, but the interface should be up to
+	// pass packets
+	int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+	if (sock >= 0)
+	{
+		if (ioctl(sock, SIOCGIFFLAGS, &ifr) == 0 && !(ifr.ifr_flags & IFF_UP))
+		{
+			ifr.ifr_flags |= IFF_UP;
+
+			if (ioctl(sock, SIOCSIFFLAGS, &ifr) < 0)
+			{
+				LOG(mLog, WARNING) << "Can't bring up: " << mIfName;
+			}
+		}
+
+		close(sock);
+	}
+
+	LOG(mLog, DEBUG) << "Create tap: " << mIfName;
+}
+
+void NetifTapDevice::release()
+{
+	if (mFd >= 0)
+	{
+		close(mFd);
+
+		mFd = -1;
+
+		LOG(mLog, DEBUG) << "Delete tap: " << mIfName;
+	}
+}
+
+/*******************************************************************************
+ * NetifPacketSocketDevice
+ ******************************************************************************/
+
+NetifPacketSocketDevice::NetifPacketSocketDevice(const string& ifName,
+												 unsigned int batch) :
+	NetifFdDevice("NetifPacketSocket", batch),
+	mIfName(ifName)
+{
+	try
+	{
+		init();
+	}
+	catch(const std::exception& e)
+	{
+		release();
+
+		throw;
+	}
+}
+
+NetifPacketSocketDevice::~NetifPacketSocketDevice()
+{
+	stop();
+
+	release();
+}
+
+/*******************************************************************************
+ * Protected
+ ******************************************************************************/
+
+ssize_t NetifPacketSocketDevice::receive(iovec* iov, int count)
+{
+	sockaddr_ll addr {};
+	msghdr msg {};
+
+	msg.msg_name = &addr;
+	msg.msg_namelen = sizeof(addr);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = count;
+
+	auto len = recvmsg(mFd, &msg, 0);
+
+	if (len < 0)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			return -1;
+		}
+
+		if (errno == EINTR)
+		{
+			return 0;
+		}
+
+		throw NetifException("Can't receive packet", errno);
+	}
+
+	// packets sent by the host to the interface are not for the frontend
+	if (addr.sll_pkttype == PACKET_OUTGOING)
+	{
+		return 0;
+	}
+
+	return len;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void NetifPacketSocketDevice::init()
+{
+	mFd = socket(AF_PACKET, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC,
+				 htons(ETH_P_ALL));
+
+	if (mFd < 0)
+	{
+		throw NetifException("Can't create packet socket", errno);
+	}
+
+	int enable = 1;
+
+	if (setsockopt(mFd, SOL_PACKET, PACKET_VNET_HDR, &enable,
+				   sizeof(enable)) < 0)
+	{
+		throw NetifException("Can't enable vnet header", errno);
+	}
+
+	sockaddr_ll addr {};
+
+	addr.sll_family = AF_PACKET;
+	addr.sll_protocol = htons(ETH_P_ALL);
+	addr.sll_ifindex = if_nametoindex(mIfName.c_str());
+
+	if (addr.sll_ifindex == 0)
+	{
+		throw NetifException("Interface not found: " + mIfName, ENODEV);
+	}
+
+	if (bind(mFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+	{
+		throw NetifException("Can't bind packet socket: " + mIfName, errno);
+	}
+
+	LOG(mLog, DEBUG) << "Attach to: " << mIfName;
+}
+
+void NetifPacketSocketDevice::release()
+{
+	if (mFd >= 0)
+	{
+		close(mFd);
+
+		mFd = -1;
+	}
+}
+
+/*******************************************************************************
+ * NetifQueue
+ ******************************************************************************/
+
+NetifQueue::NetifQueue(domid_t domId, evtchn_port_t port, grant_ref_t txRef,
+					   grant_ref_t rxRef, NetifDevicePtr device,
+					   const Features& features, const NetifConfig& config) :
+	RingBufferInBase<netif_tx_back_ring, netif_tx_sring, netif_tx_request,
+					 netif_tx_response>(domId, port, txRef),
+	mDomId(domId),
+	mDevice(device),
+	mFeatures(features),
+	mConfig(config),
+	mTxPackets(max(config.txBatch, 1u)),
+	mNumTxPackets(0),
+	mPendingExtras(0),
+	mTxInProgress(false),
+	mRxBuffer(domId, rxRef),
+	mStats(),
+	mLog("NetifQueue")
+{
+	BACK_RING_INIT(&mRxRing, static_cast<netif_rx_sring*>(mRxBuffer.get()),
+				   XC_PAGE_SIZE);
+
+	LOG(mLog, DEBUG) << "Create netif queue, port: " << port
+					 << ", sg: " << mFeatures.sg
+					 << ", gso4: " << mFeatures.gso4
+					 << ", gso6: " << mFeatures.gso6
+					 << ", csum: " << mFeatures.csum;
+}
+
+NetifQueue::~NetifQueue()
+{
+	stop();
+
+	LOG(mLog, DEBUG) << "Delete netif queue, port: " << getPort();
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+void NetifQueue::deliver(const NetifPacket* const* packets, size_t count)
+{
+	lock_guard<mutex> lock(mRxMutex);
+
+	mRxSlots.clear();
+
+	auto rp = mRxRing.sring->req_prod;
+
+	xen_rmb();
+
+	RING_IDX available = min(rp - mRxRing.req_cons, RING_SIZE(&mRxRing));
+	uint64_t delivered = 0, bytes = 0, dropped = 0;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		auto used = queueRx(*packets[i], available);
+
+		if (!used)
+		{
+			dropped++;
+
+			continue;
+		}
+
+		available -= used;
+		delivered++;
+		bytes += packets[i]->size;
+	}
+
+	if (mRxSlots.size())
+	{
+		bool copied = true;
+
+		try
+		{
+			mRxCopy.copy();
+		}
+		catch(const std::exception& e)
+		{
+			LOG(mLog, ERROR) << e.what();
+
+			copied = false;
+		}
+
+		for (auto& slot : mRxSlots)
+		{
+			auto rsp = RING_GET_RESPONSE(&mRxRing, mRxRing.rsp_prod_pvt);
+
+			if (slot.extra)
+			{
+				memcpy(rsp, &slot.info, sizeof(slot.info));
+			}
+			else
+			{
+				*rsp = slot.rsp;
+
+				if (!copied || mRxCopy.getStatus(slot.copy) != GNTST_okay)
+				{
+					rsp->status = NETIF_RSP_ERROR;
+				}
+			}
+
+			mRxRing.rsp_prod_pvt++;
+		}
+
+		bool needNotify = false;
+
+		RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&mRxRing, needNotify);
+
+		if (needNotify)
+		{
+			notify();
+		}
+	}
+
+	lock_guard<mutex> statsLock(mStatsMutex);
+
+	mStats.rxPackets += delivered;
+	mStats.rxBytes += bytes;
+	mStats.rxDropped += dropped;
+
+	if (mRxCopy.size())
+	{
+		mStats.grantCopies += mRxCopy.size();
+		mStats.copyBatches++;
+	}
+
+	mRxCopy.clear();
+}
+
+NetifStats NetifQueue::getStats() const
+{
+	lock_guard<mutex> lock(mStatsMutex);
+
+	return mStats;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void NetifQueue::processRequest(const netif_tx_request& req)
+{
+	// the packet is: first slot (total size), optional extra info slots and
+	// fragment slots chained by more data flag
+
+	if (mPendingExtras)
+	{
+		processExtra(reinterpret_cast<const netif_extra_info&>(req));
+	}
+	else if (mTxInProgress)
+	{
+		mTxPackets[mNumTxPackets].slots.push_back(req);
+	}
+	else
+	{
+		startPacket(req);
+	}
+
+	auto& packet = mTxPackets[mNumTxPackets];
+
+	if (!mPendingExtras && !(packet.slots.back().flags & NETTXF_more_data))
+	{
+		completePacket();
+	}
+}
+
+void NetifQueue::onRequestsProcessed()
+{
+	flushTx();
+}
+
+void NetifQueue::startPacket(const netif_tx_request& req)
+{
+	auto& packet = mTxPackets[mNumTxPackets];
+
+	if (packet.buffer.empty())
+	{
+		packet.buffer.resize(XEN_NETIF_MAX_TX_SIZE);
+	}
+
+	packet.slots.assign(1, req);
+	packet.numExtras = 0;
+	packet.firstCopy = 0;
+	packet.numCopies = 0;
+	packet.gsoType = XEN_NETIF_GSO_TYPE_NONE;
+	packet.gsoSize = 0;
+	packet.valid = req.size >= ETH_HLEN;
+
+	mTxInProgress = true;
+	mPendingExtras = req.flags & NETTXF_extra_info ? 1 : 0;
+}
+
+void NetifQueue::processExtra(const netif_extra_info& extra)
+{
+	auto& packet = mTxPackets[mNumTxPackets];
+
+	packet.numExtras++;
+
+	if (extra.type == XEN_NETIF_EXTRA_TYPE_GSO)
+	{
+		packet.gsoType = extra.u.gso.type;
+		packet.gsoSize = extra.u.gso.size;
+
+		if (packet.gsoSize == 0 ||
+			(packet.gsoType != XEN_NETIF_GSO_TYPE_TCPV4 &&
+			 packet.gsoType != XEN_NETIF_GSO_TYPE_TCPV6))
+		{
+			packet.valid = false;
+		}
+	}
+
+	if (!(extra.flags & XEN_NETIF_EXTRA_FLAG_MORE))
+	{
+		mPendingExtras = 0;
+	}
+}
+
+void NetifQueue::completePacket()
+{
+	auto& packet = mTxPackets[mNumTxPackets];
+
+	mTxInProgress = false;
+
+	// the first slot contains the size of the whole packet, so its own data
+	// size is known only when all fragments are collected
+
+	size_t rest = 0;
+
+	for (size_t i = 1; i < packet.slots.size(); i++)
+	{
+		rest += packet.slots[i].size;
+	}
+
+	if (rest > packet.slots[0].size || packet.slots.size() > cMaxTxSlots)
+	{
+		packet.valid = false;
+	}
+
+	packet.firstCopy = mTxCopy.size();
+	packet.packet.size = 0;
+
+	for (size_t i = 0; packet.valid && i < packet.slots.size(); i++)
+	{
+		auto& slot = packet.slots[i];
+		uint16_t size = i ? slot.size : packet.slots[0].size - rest;
+
+		if (slot.offset + size > XC_PAGE_SIZE)
+		{
+			packet.valid = false;
+
+			break;
+		}
+
+		if (size)
+		{
+			mTxCopy.fromRef(mDomId, slot.gref, slot.offset,
+							&packet.buffer[packet.packet.size], size);
+
+			packet.numCopies++;
+		}
+
+		packet.packet.size += size;
+	}
+
+	mNumTxPackets++;
+
+	if (mNumTxPackets == mTxPackets.size())
+	{
+		flushTx();
+	}
+}
+
+bool NetifQueue::setupTxHeader(TxPacket& packet)
+{
+	auto& hdr = packet.packet.hdr;
+	auto flags = packet.slots[0].flags;
+
+	memset(&hdr, 0, sizeof(hdr));
+
+	hdr.gsoType = NetifVnetHdr::cGsoNone;
+
+	packet.packet.data = packet.buffer.data();
+
+	if (!(flags & NETTXF_csum_blank) &&
+		packet.gsoType == XEN_NETIF_GSO_TYPE_NONE)
+	{
+		if (flags & NETTXF_data_validated)
+		{
+			hdr.flags = NetifVnetHdr::cFlagDataValid;
+		}
+
+		return true;
+	}
+
+	// partial checksum: the device needs the checksum location
+
+	NetifFlowInfo info;
+
+	if (!NetifFlow::parse(packet.packet.data, packet.packet.size, info) ||
+		!info.l4Length)
+	{
+		return false;
+	}
+
+	hdr.flags = NetifVnetHdr::cFlagNeedsCsum;
+	hdr.csumStart = info.l4Offset;
+
+	if (info.l4Proto == IPPROTO_TCP)
+	{
+		hdr.csumOffset = 16;
+	}
+	else if (info.l4Proto == IPPROTO_UDP)
+	{
+		hdr.csumOffset = 6;
+	}
+	else
+	{
+		return false;
+	}
+
+	if (packet.gsoType != XEN_NETIF_GSO_TYPE_NONE)
+	{
+		if (info.l4Proto != IPPROTO_TCP)
+		{
+			return false;
+		}
+
+		hdr.gsoType = packet.gsoType == XEN_NETIF_GSO_TYPE_TCPV4 ?
+					   NetifVnetHdr::cGsoTcpV4 : NetifVnetHdr::cGsoTcpV6;
+		hdr.gsoSize = packet.gsoSize;
+		hdr.hdrLen = info.l4Offset + info.l4Length;
+	}
+
+	return true;
+}
+
+void NetifQueue::flushTx()
+{
+	if (!mNumTxPackets)
+	{
+		return;
+	}
+
+	bool copied = true;
+
+	try
+	{
+		mTxCopy.copy();
+	}
+	catch(const std::exception& e)
+	{
+		LOG(mLog, ERROR) << e.what();
+
+		copied = false;
+	}
+
+	mTxSend.clear();
+
+	uint64_t bytes = 0, errors = 0;
+
+	for (size_t i = 0; i < mNumTxPackets; i++)
+	{
+		auto& packet = mTxPackets[i];
+
+		for (size_t j = 0; packet.valid && j < packet.numCopies; j++)
+		{
+			if (!copied ||
+				mTxCopy.getStatus(packet.firstCopy + j) != GNTST_okay)
+			{
+				packet.valid = false;
+			}
+		}
+
+		if (packet.valid && !setupTxHeader(packet))
+		{
+			packet.valid = false;
+		}
+
+		if (packet.valid)
+		{
+			mTxSend.push_back(packet.packet);
+
+			bytes += packet.packet.size;
+		}
+		else
+		{
+			errors++;
+		}
+	}
+
+	if (mTxSend.size())
+	{
+		mDevice->send(mTxSend.data(), mTxSend.size());
+	}
+
+	{
+		lock_guard<mutex> lock(mStatsMutex);
+
+		mStats.txPackets += mTxSend.size();
+		mStats.txBytes += bytes;
+		mStats.txErrors += errors;
+		mStats.grantCopies += mTxCopy.size();
+		mStats.copyBatches++;
+	}
+
+	// one response per slot, extra info slots are completed with null status
+
+	for (size_t i = 0; i < mNumTxPackets; i++)
+	{
+		auto& packet = mTxPackets[i];
+		int16_t status = packet.valid ? NETIF_RSP_OKAY : NETIF_RSP_ERROR;
+
+		for (size_t j = 0; j < packet.slots.size(); j++)
+		{
+			queueResponse({ packet.slots[j].id, status });
+
+			for (size_t k = 0; j == 0 && k < packet.numExtras; k++)
+			{
+				queueResponse({ 0, NETIF_RSP_NULL });
+			}
+		}
+	}
+
+	pushResponses();
+
+	// keep the packet which is being collected at the first place
+	if (mTxInProgress)
+	{
+		swap(mTxPackets[0], mTxPackets[mNumTxPackets]);
+	}
+
+	mNumTxPackets = 0;
+
+	mTxCopy.clear();
+}
+
+RING_IDX NetifQueue::queueRx(const NetifPacket& packet, RING_IDX available)
+{
+	bool gso = packet.hdr.gsoType != NetifVnetHdr::cGsoNone;
+	RING_IDX numChunks = (packet.size + XC_PAGE_SIZE - 1) / XC_PAGE_SIZE;
+	RING_IDX numSlots = numChunks + (gso ? 1 : 0);
+
+	if (!packet.size || numSlots > available ||
+		(numChunks > 1 && !mFeatures.sg))
+	{
+		return 0;
+	}
+
+	uint8_t gsoType = XEN_NETIF_GSO_TYPE_NONE;
+
+	if (packet.hdr.gsoType == NetifVnetHdr::cGsoTcpV4 && mFeatures.gso4)
+	{
+		gsoType = XEN_NETIF_GSO_TYPE_TCPV4;
+	}
+	else if (packet.hdr.gsoType == NetifVnetHdr::cGsoTcpV6 &&
+			 mFeatures.gso6)
+	{
+		gsoType = XEN_NETIF_GSO_TYPE_TCPV6;
+	}
+
+	if (gso && gsoType == XEN_NETIF_GSO_TYPE_NONE)
+	{
+		return 0;
+	}
+
+	size_t offset = 0;
+
+	for (RING_IDX i = 0; i < numChunks; i++)
+	{
+		auto req = *RING_GET_REQUEST(&mRxRing, mRxRing.req_cons);
+
+		mRxRing.req_cons++;
+
+		uint16_t len = min(packet.size - offset, size_t(XC_PAGE_SIZE));
+
+		RxSlot slot {};
+
+		slot.rsp.id = req.id;
+		slot.rsp.offset = 0;
+		slot.rsp.status = len;
+		slot.copy = mRxCopy.toRef(mDomId, req.gref, 0, packet.data + offset,
+								  len);
+
+		if (i + 1 < numChunks)
+		{
+			slot.rsp.flags |= NETRXF_more_data;
+		}
+
+		if (i == 0)
+		{
+			slot.rsp.flags |= getRxFlags(packet);
+		}
+
+		mRxSlots.push_back(slot);
+
+		offset += len;
+
+		// GSO info follows the first data slot
+		if (i == 0 && gso)
+		{
+			mRxSlots.back().rsp.flags |= NETRXF_extra_info;
+
+			mRxRing.req_cons++;
+
+			RxSlot extra {};
+
+			extra.extra = true;
+			extra.info.type = XEN_NETIF_EXTRA_TYPE_GSO;
+			extra.info.u.gso.type = gsoType;
+			extra.info.u.gso.size = packet.hdr.gsoSize;
+
+			mRxSlots.push_back(extra);
+		}
+	}
+
+	return numSlots;
+}
+
+uint16_t NetifQueue::getRxFlags(const NetifPacket& packet)
+{
+	if (packet.hdr.flags & NetifVnetHdr::cFlagNeedsCsum)
+	{
+		return NETRXF_csum_blank | NETRXF_data_validated;
+	}
+
+	if (packet.hdr.flags & NetifVnetHdr::cFlagDataValid)
+	{
+		return NETRXF_data_validated;
+	}
+
+	return 0;
+}
+
+/*******************************************************************************
+ * NetifFrontendHandler
+ ******************************************************************************/
+
+NetifFrontendHandler::NetifFrontendHandler(const string& devName,
+										   domid_t beDomId, domid_t feDomId,
+										   uint16_t devId,
+										   const NetifConfig& config) :
+	FrontendHandlerBase("NetifFrontend", devName, beDomId, feDomId, devId),
+	mConfig(config),
+	mLog("NetifFrontend")
+{
+	writeFeatures();
+}
+
+NetifFrontendHandler::~NetifFrontendHandler()
+{
+	stop();
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+vector<NetifStats> NetifFrontendHandler::getStats()
+{
+	lock_guard<mutex> lock(mQueuesMutex);
+
+	vector<NetifStats> stats;
+
+	for (auto queue : mQueues)
+	{
+		stats.push_back(queue->getStats());
+	}
+
+	return stats;
+}
+
+/*******************************************************************************
+ * Protected
+ ******************************************************************************/
+
+void NetifFrontendHandler::onBind()
+{
+	auto& xenStore = getXenStore();
+	auto fePath = getXsFrontendPath();
+
+	int value = 0;
+
+	if (!xenStore.readIntIfExist(fePath + "/request-rx-copy", value) ||
+		!value)
+	{
+		throw NetifException("Frontend doesn't support rx copy", EINVAL);
+	}
+
+	auto features = readFeatures();
+
+	mDevice = createDevice();
+
+	mDevice->setOffload(features.csum, features.gso4, features.gso6);
+
+	lock_guard<mutex> lock(mQueuesMutex);
+
+	auto numQueues = addQueues(mConfig.maxQueues,
+							   [this, &xenStore, &features]
+							   (unsigned int, const string& path) {
+		int port;
+
+		if (!xenStore.readIntIfExist(path + "/event-channel", port))
+		{
+			throw NetifException("Split event channels are not supported",
+								 EINVAL);
+		}
+
+		auto queue = makeShared<NetifQueue>(
+				getDomId(), port, xenStore.readUint(path + "/tx-ring-ref"),
+				xenStore.readUint(path + "/rx-ring-ref"), mDevice, features,
+				mConfig);
+
+		mQueues.push_back(queue);
+
+		return queue;
+	});
+
+	LOG(mLog, DEBUG) << Utils::logDomId(getDomId(), getDevId())
+					 << "Bind, queues: " << numQueues;
+
+	mDispatch.resize(numQueues);
+
+	mDevice->start([this] (const NetifPacket* packets, size_t count)
+				   { onDeviceReceive(packets, count); });
+}
+
+void NetifFrontendHandler::onClosing()
+{
+	// the device thread delivers packets to the queues
+	if (mDevice)
+	{
+		mDevice->stop();
+	}
+
+	lock_guard<mutex> lock(mQueuesMutex);
+
+	mQueues.clear();
+
+	mDevice.reset();
+}
+
+NetifDevicePtr NetifFrontendHandler::createDevice()
+{
+	auto ifName = mConfig.ifName;
+
+	if (mConfig.deviceType == NetifConfig::PACKET_SOCKET)
+	{
+		if (ifName.empty())
+		{
+			throw NetifException("Interface name is not set", EINVAL);
+		}
+
+		return NetifDevicePtr(new NetifPacketSocketDevice(ifName,
+														  mConfig.rxBatch));
+	}
+
+	if (ifName.empty())
+	{
+		ifName = "vif" + to_string(getDomId()) + "." + to_string(getDevId());
+	}
+
+	return NetifDevicePtr(new NetifTapDevice(ifName, mConfig.rxBatch));
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void NetifFrontendHandler::writeFeatures()
+{
+	auto& xenStore = getXenStore();
+	auto bePath = getXsBackendPath();
+
+	xenStore.writeUint(bePath + "/feature-sg", 1);
+	xenStore.writeUint(bePath + "/feature-gso-tcpv4", mConfig.offload);
+	xenStore.writeUint(bePath + "/feature-gso-tcpv6", mConfig.offload);
+	xenStore.writeUint(bePath + "/feature-ipv6-csum-offload", 1);
+	xenStore.writeUint(bePath + "/feature-rx-copy", 1);
+	xenStore.writeUint(bePath + "/feature-rx-flip", 0);
+	writeMaxQueues(mConfig.maxQueues);
+}
+
+NetifQueue::Features NetifFrontendHandler::readFeatures()
+{
+	auto& xenStore = getXenStore();
+	auto fePath = getXsFrontendPath();
+
+	NetifQueue::Features features;
+	int value = 0;
+
+	features.sg = xenStore.readIntIfExist(fePath + "/feature-sg", value) &&
+				  value;
+
+	// the device offload covers IPv4 and IPv6 together
+	features.csum = mConfig.offload &&
+		!(xenStore.readIntIfExist(fePath + "/feature-no-csum-offload",
+								  value) && value) &&
+		xenStore.readIntIfExist(fePath + "/feature-ipv6-csum-offload",
+								value) && value;
+
+	features.gso4 = features.csum && features.sg &&
+		xenStore.readIntIfExist(fePath + "/feature-gso-tcpv4", value) &&
+		value;
+
+	features.gso6 = features.csum && features.sg &&
+		xenStore.readIntIfExist(fePath + "/feature-gso-tcpv6", value) &&
+		value;
+
+	return features;
+}
+
+void NetifFrontendHandler::onDeviceReceive(const NetifPacket* packets,
+										   size_t count)
+{
+	lock_guard<mutex> lock(mQueuesMutex);
+
+	if (mQueues.empty())
+	{
+		return;
+	}
+
+	// packets of one flow always go to the same queue
+
+	for (size_t i = 0; i < count; i++)
+	{
+		auto index = mQueues.size() == 1 ? 0 :
+			NetifFlow::getHash(packets[i].data, packets[i].size) %
+			mQueues.size();
+
+		mDispatch[index].push_back(&packets[i]);
+	}
+
+	for (size_t i = 0; i < mQueues.size(); i++)
+	{
+		if (mDispatch[i].empty())
+		{
+			continue;
+		}
+
+		try
+		{
+			mQueues[i]->deliver(mDispatch[i].data(), mDispatch[i].size());
+		}
+		catch(const std::exception& e)
+		{
+			LOG(mLog, ERROR) << e.what();
+		}
+
+		mDispatch[i].clear();
+	}
+}
+
+/*******************************************************************************
+ * NetifBackend
+ ******************************************************************************/
+
+NetifBackend::NetifBackend(const string& name, const NetifConfig& config,
+						   const string& devName) :
+	BackendBase(name, devName),
+	mConfig(config)
+{
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void NetifBackend::onNewFrontend(domid_t domId, uint16_t devId)
+{
+	addFrontendHandler(FrontendHandlerPtr(
+			new NetifFrontendHandler(getDeviceName(), getDomId(), domId,
+									 devId, mConfig)));
+}
+
+}
@@ -0,0 +1,1867 @@
+/*
+ *  Xen 9pfs backend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include "P9fsBackend.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "StagingPool.hpp"
+#include "XenStore.hpp"
+
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::exception;
+using std::lock_guard;
+using std::max;
+using std::min;
+using std::mutex;
+using std::string;
+using std::to_string;
+using std::unique_lock;
+using std::vector;
+
+namespace XenBackend {
+
+namespace {
+
+const uint32_t cSetattrMode = 0x00000001;
+const uint32_t cSetattrUid = 0x00000002;
+const uint32_t cSetattrGid = 0x00000004;
+const uint32_t cSetattrSize = 0x00000008;
+const uint32_t cSetattrAtime = 0x00000010;
+const uint32_t cSetattrMtime = 0x00000020;
+const uint32_t cSetattrAtimeSet = 0x00000080;
+const uint32_t cSetattrMtimeSet = 0x00000100;
+
+const uint64_t cGetattrBasic = 0x000007ff;
+
+const uint32_t cStatfsType = 0x01021997;
+
+const size_t cMaxWalkNames = 16;
+
+const char* cProtocolVersion = "9P2000.L";
+
+int toOpenFlags(uint32_t flags)
+{
+	// 9P2000.L flags have Linux values
+
+	return flags & (O_ACCMODE | O_TRUNC | O_APPEND | O_SYNC | O_DSYNC);
+}
+
+void throwErrno(const string& msg)
+{
+	throw P9fsException(msg, errno);
+}
+
+}
+
+const uint8_t P9fsQid::cTypeDir;
+const uint8_t P9fsQid::cTypeSymlink;
+const uint8_t P9fsQid::cTypeFile;
+
+const size_t P9fsWriter::cHeaderSize;
+
+const size_t P9fsRing::cWriteHeaderSize;
+const size_t P9fsRing::cReadHeaderSize;
+
+/*******************************************************************************
+ * P9fsReader
+ ******************************************************************************/
+
+uint8_t P9fsReader::readU8()
+{
+	return *get(sizeof(uint8_t));
+}
+
+uint16_t P9fsReader::readU16()
+{
+	uint16_t value;
+
+	memcpy(&value, get(sizeof(value)), sizeof(value));
+
+	return value;
+}
+
+uint32_t P9fsReader::readU32()
+{
+	uint32_t value;
+
+	memcpy(&value, get(sizeof(value)), sizeof(value));
+
+	return value;
+}
+
+uint64_t P9fsReader::readU64()
+{
+	uint64_t value;
+
+	memcpy(&value, get(sizeof(value)), sizeof(value));
+
+	return value;
+}
+
+string P9fsReader::readString()
+{
+	auto size = readU16();
+
+	return string(reinterpret_cast<const char*>(get(size)), size);
+}
+
+P9fsQid P9fsReader::readQid()
+{
+	P9fsQid qid;
+
+	qid.type = readU8();
+	qid.version = readU32();
+	qid.path = readU64();
+
+	return qid;
+}
+
+const uint8_t* P9fsReader::get(size_t size)
+{
+	if (getRemaining() < size)
+	{
+		throw P9fsException("Truncated message", EPROTO);
+	}
+
+	auto data = &mData[mPos];
+
+	mPos += size;
+
+	return data;
+}
+
+/*******************************************************************************
+ * P9fsWriter
+ ******************************************************************************/
+
+void P9fsWriter::begin(uint8_t type, uint16_t tag)
+{
+	mBuffer.clear();
+	mBuffer.resize(cHeaderSize);
+
+	encodeHeader(mBuffer.data(), cHeaderSize, type, tag);
+}
+
+void P9fsWriter::end()
+{
+	setU32(0, mBuffer.size());
+}
+
+void P9fsWriter::writeU8(uint8_t value)
+{
+	writeData(&value, sizeof(value));
+}
+
+void P9fsWriter::writeU16(uint16_t value)
+{
+	writeData(&value, sizeof(value));
+}
+
+void P9fsWriter::writeU32(uint32_t value)
+{
+	writeData(&value, sizeof(value));
+}
+
+void P9fsWriter::writeU64(uint64_t value)
+{
+	writeData(&value, sizeof(value));
+}
+
+void P9fsWriter::writeString(const string& value)
+{
+	writeU16(value.size());
+	writeData(value.data(), value.size());
+}
+
+void P9fsWriter::writeQid(const P9fsQid& qid)
+{
+	writeU8(qid.type);
+	writeU32(qid.version);
+	writeU64(qid.path);
+}
+
+void P9fsWriter::writeData(const void* data, size_t size)
+{
+	auto bytes = static_cast<const uint8_t*>(data);
+
+	mBuffer.insert(mBuffer.end(), bytes, bytes + size);
+}
+
+void P9fsWriter::setU32(size_t pos, uint32_t value)
+{
+	memcpy(&mBuffer[pos], &value, sizeof(value));
+}
+
+void P9fsWriter::encodeHeader(uint8_t* dst, uint32_t size, uint8_t type,
+							  uint16_t tag)
+{
+	memcpy(dst, &size, sizeof(size));
+	dst[sizeof(size)] = type;
+	memcpy(&dst[sizeof(size) + sizeof(type)], &tag, sizeof(tag));
+}
+
+/*******************************************************************************
+ * P9fsLookupCache
+ ******************************************************************************/
+
+P9fsLookupCache::P9fsLookupCache(size_t maxSize, milliseconds ttl) :
+	mMaxSize(maxSize),
+	mTtl(ttl),
+	mHits(0),
+	mMisses(0)
+{
+}
+
+bool P9fsLookupCache::get(const string& path, P9fsQid& qid)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	auto it = mEntries.find(path);
+
+	if (it != mEntries.end() && it->second.expire > steady_clock::now())
+	{
+		qid = it->second.qid;
+		mHits++;
+
+		return true;
+	}
+
+	if (it != mEntries.end())
+	{
+		mEntries.erase(it);
+	}
+
+	mMisses++;
+
+	return false;
+}
+
+void P9fsLookupCache::put(const string& path, const P9fsQid& qid)
+{
+	if (!mMaxSize)
+	{
+		return;
+	}
+
+	lock_guard<mutex> lock(mMutex);
+
+	auto now = steady_clock::now();
+
+	if (mEntries.size() >= mMaxSize)
+	{
+		for (auto it = mEntries.begin(); it != mEntries.end();)
+		{
+			if (it->second.expire <= now)
+			{
+				it = mEntries.erase(it);
+			}
+			else
+			{
+				++it;
+			}
+		}
+	}
+
+	// all entries are fresh: start from scratch rather than track LRU order
+
+	if (mEntries.size() >= mMaxSize)
+	{
+		mEntries.clear();
+	}
+
+	mEntries[path] = {qid, now + mTtl};
+}
+
+void P9fsLookupCache::invalidate(const string& path)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	auto prefix = path + "/";
+
+	for (auto it = mEntries.begin(); it != mEntries.end();)
+	{
+		auto& key = it->first;
+
+		if (path.empty() || key == path ||
+			key.compare(0, prefix.size(), prefix) == 0)
+		{
+			it = mEntries.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+}
+
+/*******************************************************************************
+ * P9fsSession
+ ******************************************************************************/
+
+P9fsSession::P9fsSession(const string& root, const P9fsConfig& config) :
+	mRoot(root),
+	mMsize(0),
+	mLookupCache(config.lookupCacheSize, config.lookupCacheTtl),
+	mLog("P9fsSession")
+{
+	struct stat st;
+
+	if (stat(mRoot.c_str(), &st) < 0)
+	{
+		throwErrno("Can't access exported directory: " + mRoot);
+	}
+
+	if (!S_ISDIR(st.st_mode))
+	{
+		throw P9fsException("Not a directory: " + mRoot, ENOTDIR);
+	}
+
+	LOG(mLog, DEBUG) << "Export: " << mRoot;
+}
+
+P9fsSession::~P9fsSession()
+{
+}
+
+P9fsSession::Fid::~Fid()
+{
+	if (dir)
+	{
+		closedir(dir);
+	}
+
+	if (fd >= 0)
+	{
+		close(fd);
+	}
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+uint32_t P9fsSession::version(uint32_t msize)
+{
+	lock_guard<mutex> lock(mFidsMutex);
+
+	mFids.clear();
+	mMsize = msize;
+
+	LOG(mLog, DEBUG) << "Version, msize: " << msize;
+
+	return msize;
+}
+
+P9fsQid P9fsSession::attach(uint32_t fid)
+{
+	auto qid = lookup("");
+
+	addFid(fid, FidPtr(new Fid()));
+
+	return qid;
+}
+
+vector<P9fsQid> P9fsSession::walk(uint32_t fid, uint32_t newFid,
+								  const vector<string>& names)
+{
+	if (names.size() > cMaxWalkNames)
+	{
+		throw P9fsException("Too many walk names", EINVAL);
+	}
+
+	auto path = getFid(fid)->path;
+	vector<P9fsQid> qids;
+
+	for (auto& name : names)
+	{
+		string next;
+
+		if (name == "..")
+		{
+			auto pos = path.rfind('/');
+
+			next = pos == string::npos ? "" : path.substr(0, pos);
+		}
+		else if (name == ".")
+		{
+			next = path;
+		}
+		else
+		{
+			next = childPath(path, name);
+		}
+
+		try
+		{
+			qids.push_back(lookup(next));
+		}
+		catch(const P9fsException&)
+		{
+			// the first element is not found: error, otherwise partial walk
+
+			if (qids.empty())
+			{
+				throw;
+			}
+
+			return qids;
+		}
+
+		path = next;
+	}
+
+	FidPtr fidPtr(new Fid());
+
+	fidPtr->path = path;
+
+	addFid(newFid, fidPtr);
+
+	return qids;
+}
+
+P9fsQid P9fsSession::open(uint32_t fid, uint32_t flags)
+{
+	auto fidPtr = getFid(fid);
+
+	lock_guard<mutex> lock(fidPtr->mutex);
+
+	if (fidPtr->fd >= 0)
+	{
+		throw P9fsException("Fid is already opened", EINVAL);
+	}
+
+	auto path = hostPath(fidPtr->path);
+	struct stat st;
+
+	if (lstat(path.c_str(), &st) < 0)
+	{
+		throwErrno("Can't stat " + fidPtr->path);
+	}
+
+	if (S_ISDIR(st.st_mode))
+	{
+		fidPtr->fd = ::open(path.c_str(),
+							O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	}
+	else
+	{
+		fidPtr->fd = ::open(path.c_str(),
+							toOpenFlags(flags) | O_NOFOLLOW | O_CLOEXEC);
+	}
+
+	if (fidPtr->fd < 0)
+	{
+		throwErrno("Can't open " + fidPtr->path);
+	}
+
+	return toQid(st);
+}
+
+P9fsQid P9fsSession::create(uint32_t fid, const string& name, uint32_t flags,
+							uint32_t mode)
+{
+	auto path = childPath(getFid(fid)->path, name);
+
+	FidPtr fidPtr(new Fid());
+
+	fidPtr->path = path;
+	fidPtr->fd = ::open(hostPath(path).c_str(),
+						toOpenFlags(flags) | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+						mode & 07777);
+
+	if (fidPtr->fd < 0)
+	{
+		throwErrno("Can't create " + path);
+	}
+
+	mLookupCache.invalidate(path);
+
+	struct stat st;
+
+	if (fstat(fidPtr->fd, &st) < 0)
+	{
+		throwErrno("Can't stat " + path);
+	}
+
+	// the directory fid becomes the fid of the created file
+
+	addFid(fid, fidPtr);
+
+	return toQid(st);
+}
+
+P9fsQid P9fsSession::mkdir(uint32_t dirFid, const string& name, uint32_t mode)
+{
+	auto path = childPath(getFid(dirFid)->path, name);
+
+	if (::mkdir(hostPath(path).c_str(), mode & 07777) < 0)
+	{
+		throwErrno("Can't create directory " + path);
+	}
+
+	mLookupCache.invalidate(path);
+
+	return lookup(path);
+}
+
+void P9fsSession::getattr(uint32_t fid, struct stat& st, P9fsQid& qid)
+{
+	auto fidPtr = getFid(fid);
+
+	int ret = 0;
+
+	{
+		lock_guard<mutex> lock(fidPtr->mutex);
+
+		if (fidPtr->fd >= 0)
+		{
+			ret = fstat(fidPtr->fd, &st);
+		}
+		else
+		{
+			ret = lstat(hostPath(fidPtr->path).c_str(), &st);
+		}
+	}
+
+	if (ret < 0)
+	{
+		throwErrno("Can't stat " + fidPtr->path);
+	}
+
+	qid = toQid(st);
+}
+
+void P9fsSession::setattr(uint32_t fid, uint32_t valid, uint32_t mode,
+						  uint32_t uid, uint32_t gid, uint64_t size,
+						  const timespec& atime, const timespec& mtime)
+{
+	auto fidPtr = getFid(fid);
+	auto path = hostPath(fidPtr->path);
+
+	if ((valid & cSetattrMode) && chmod(path.c_str(), mode & 07777) < 0)
+	{
+		throwErrno("Can't change mode of " + fidPtr->path);
+	}
+
+	if ((valid & (cSetattrUid | cSetattrGid)) &&
+		lchown(path.c_str(),
+			   valid & cSetattrUid ? uid : static_cast<uid_t>(-1),
+			   valid & cSetattrGid ? gid : static_cast<gid_t>(-1)) < 0)
+	{
+		throwErrno("Can't change owner of " + fidPtr->path);
+	}
+
+	if (valid & cSetattrSize)
+	{
+		auto fd = ::open(path.c_str(), O_WRONLY | O_NOFOLLOW | O_CLOEXEC);
+
+		if (fd < 0)
+		{
+			throwErrno("Can't truncate " + fidPtr->path);
+		}
+
+		auto ret = ftruncate(fd, size);
+
+		close(fd);
+
+		if (ret < 0)
+		{
+			throwErrno("Can't truncate " + fidPtr->path);
+		}
+	}
+
+	if (valid & (cSetattrAtime | cSetattrMtime))
+	{
+		timespec times[2];
+
+		times[0].tv_sec = 0;
+		times[0].tv_nsec = !(valid & cSetattrAtime) ? UTIME_OMIT :
+						   !(valid & cSetattrAtimeSet) ? UTIME_NOW : 0;
+		times[1].tv_sec = 0;
+		times[1].tv_nsec = !(valid & cSetattrMtime) ? UTIME_OMIT :
+						   !(valid & cSetattrMtimeSet) ? UTIME_NOW : 0;
+
+		if (valid & cSetattrAtime && valid & cSetattrAtimeSet)
+		{
+			times[0] = atime;
+		}
+
+		if (valid & cSetattrMtime && valid & cSetattrMtimeSet)
+		{
+			times[1] = mtime;
+		}
+
+		if (utimensat(AT_FDCWD, path.c_str(), times,
+					  AT_SYMLINK_NOFOLLOW) < 0)
+		{
+			throwErrno("Can't set times of " + fidPtr->path);
+		}
+	}
+}
+
+void P9fsSession::statfs(uint32_t fid, struct statvfs& st)
+{
+	auto fidPtr = getFid(fid);
+
+	if (statvfs(hostPath(fidPtr->path).c_str(), &st) < 0)
+	{
+		throwErrno("Can't stat file system of " + fidPtr->path);
+	}
+}
+
+void P9fsSession::fsync(uint32_t fid)
+{
+	auto fidPtr = getOpenedFid(fid);
+
+	if (::fsync(fidPtr->fd) < 0)
+	{
+		throwErrno("Can't sync " + fidPtr->path);
+	}
+}
+
+void P9fsSession::unlinkat(uint32_t dirFid, const string& name, uint32_t flags)
+{
+	auto path = childPath(getFid(dirFid)->path, name);
+
+	if (::unlinkat(AT_FDCWD, hostPath(path).c_str(), flags & AT_REMOVEDIR) < 0)
+	{
+		throwErrno("Can't remove " + path);
+	}
+
+	mLookupCache.invalidate(path);
+}
+
+void P9fsSession::renameat(uint32_t oldDirFid, const string& oldName,
+						   uint32_t newDirFid, const string& newName)
+{
+	auto oldPath = childPath(getFid(oldDirFid)->path, oldName);
+	auto newPath = childPath(getFid(newDirFid)->path, newName);
+
+	if (rename(hostPath(oldPath).c_str(), hostPath(newPath).c_str()) < 0)
+	{
+		throwErrno("Can't rename " + oldPath);
+	}
+
+	mLookupCache.invalidate(oldPath);
+	mLookupCache.invalidate(newPath);
+}
+
+void P9fsSession::clunk(uint32_t fid)
+{
+	lock_guard<mutex> lock(mFidsMutex);
+
+	if (!mFids.erase(fid))
+	{
+		throw P9fsException("Unknown fid: " + to_string(fid), EBADF);
+	}
+}
+
+void P9fsSession::remove(uint32_t fid)
+{
+	auto fidPtr = getFid(fid);
+
+	// the fid is clunked even if remove fails
+
+	clunk(fid);
+
+	auto path = hostPath(fidPtr->path);
+	struct stat st;
+
+	if (lstat(path.c_str(), &st) < 0)
+	{
+		throwErrno("Can't stat " + fidPtr->path);
+	}
+
+	if ((S_ISDIR(st.st_mode) ? rmdir(path.c_str()) : unlink(path.c_str())) < 0)
+	{
+		throwErrno("Can't remove " + fidPtr->path);
+	}
+
+	mLookupCache.invalidate(fidPtr->path);
+}
+
+ssize_t P9fsSession::getReadSize(uint32_t fid, uint64_t offset,
+								 uint32_t count)
+{
+	auto fidPtr = getOpenedFid(fid);
+	struct stat st;
+
+	if (fstat(fidPtr->fd, &st) < 0 || !S_ISREG(st.st_mode))
+	{
+		return -1;
+	}
+
+	if (offset >= static_cast<uint64_t>(st.st_size))
+	{
+		return 0;
+	}
+
+	return min<uint64_t>(count, st.st_size - offset);
+}
+
+size_t P9fsSession::readv(uint32_t fid, uint64_t offset, const iovec* iov,
+						  int count)
+{
+	auto fidPtr = getOpenedFid(fid);
+
+	ssize_t ret;
+
+	do
+	{
+		ret = preadv(fidPtr->fd, iov, count, offset);
+	}
+	while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+	{
+		throwErrno("Can't read " + fidPtr->path);
+	}
+
+	return ret;
+}
+
+size_t P9fsSession::writev(uint32_t fid, uint64_t offset, const iovec* iov,
+						   int count)
+{
+	auto fidPtr = getOpenedFid(fid);
+
+	ssize_t ret;
+
+	do
+	{
+		ret = pwritev(fidPtr->fd, iov, count, offset);
+	}
+	while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+	{
+		throwErrno("Can't write " + fidPtr->path);
+	}
+
+	return ret;
+}
+
+void P9fsSession::readdir(uint32_t fid, uint64_t offset, uint32_t count,
+						  P9fsWriter& writer)
+{
+	auto fidPtr = getOpenedFid(fid);
+
+	lock_guard<mutex> lock(fidPtr->mutex);
+
+	if (!fidPtr->dir)
+	{
+		// closedir() closes the fd, so the stream gets its own copy
+
+		auto fd = dup(fidPtr->fd);
+
+		if (fd < 0)
+		{
+			throwErrno("Can't open directory " + fidPtr->path);
+		}
+
+		fidPtr->dir = fdopendir(fd);
+
+		if (!fidPtr->dir)
+		{
+			close(fd);
+
+			throwErrno("Can't open directory " + fidPtr->path);
+		}
+	}
+
+	if (offset == 0)
+	{
+		rewinddir(fidPtr->dir);
+	}
+	else
+	{
+		seekdir(fidPtr->dir, offset);
+	}
+
+	size_t size = 0;
+
+	while (true)
+	{
+		errno = 0;
+
+		auto entry = ::readdir(fidPtr->dir);
+
+		if (!entry)
+		{
+			if (errno)
+			{
+				throwErrno("Can't read directory " + fidPtr->path);
+			}
+
+			break;
+		}
+
+		auto nameSize = strlen(entry->d_name);
+
+		// qid[13] offset[8] type[1] name[s]
+		auto entrySize = 13 + 8 + 1 + 2 + nameSize;
+
+		if (size + entrySize > count)
+		{
+			break;
+		}
+
+		P9fsQid qid;
+
+		qid.type = entry->d_type == DT_DIR ? P9fsQid::cTypeDir :
+				   entry->d_type == DT_LNK ? P9fsQid::cTypeSymlink :
+				   P9fsQid::cTypeFile;
+		qid.version = 0;
+		qid.path = entry->d_ino;
+
+		writer.writeQid(qid);
+		writer.writeU64(telldir(fidPtr->dir));
+		writer.writeU8(entry->d_type);
+		writer.writeString(string(entry->d_name, nameSize));
+
+		size += entrySize;
+	}
+}
+
+P9fsQid P9fsSession::toQid(const struct stat& st)
+{
+	P9fsQid qid;
+
+	qid.type = S_ISDIR(st.st_mode) ? P9fsQid::cTypeDir :
+			   S_ISLNK(st.st_mode) ? P9fsQid::cTypeSymlink :
+			   P9fsQid::cTypeFile;
+	qid.version = 0;
+	qid.path = st.st_ino;
+
+	return qid;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+P9fsSession::FidPtr P9fsSession::getFid(uint32_t fid)
+{
+	lock_guard<mutex> lock(mFidsMutex);
+
+	auto it = mFids.find(fid);
+
+	if (it == mFids.end())
+	{
+		throw P9fsException("Unknown fid: " + to_string(fid), EBADF);
+	}
+
+	return it->second;
+}
+
+P9fsSession::FidPtr P9fsSession::getOpenedFid(uint32_t fid)
+{
+	auto fidPtr = getFid(fid);
+
+	if (fidPtr->fd < 0)
+	{
+		throw P9fsException("Fid is not opened: " + to_string(fid), EBADF);
+	}
+
+	return fidPtr;
+}
+
+void P9fsSession::addFid(uint32_t fid, FidPtr fidPtr)
+{
+	lock_guard<mutex> lock(mFidsMutex);
+
+	mFids[fid] = fidPtr;
+}
+
+string P9fsSession::hostPath(const string& path) const
+{
+	return path.empty() ? mRoot : mRoot + "/" + path;
+}
+
+string P9fsSession::childPath(const string& dir, const string& name) const
+{
+	if (name.empty() || name == "." || name == ".." ||
+		name.find('/') != string::npos)
+	{
+		throw P9fsException("Invalid name: " + name, EINVAL);
+	}
+
+	return dir.empty() ? name : dir + "/" + name;
+}
+
+P9fsQid P9fsSession::lookup(const string& path)
+{
+	P9fsQid qid;
+
+	if (mLookupCache.get(path, qid))
+	{
+		return qid;
+	}
+
+	struct stat st;
+
+	if (lstat(hostPath(path).c_str(), &st) < 0)
+	{
+		throwErrno("Can't stat " + path);
+	}
+
+	// fids are only created by walking looked up names, so no fid path goes
+	// through a link which may point out of the exported directory
+	if (S_ISLNK(st.st_mode) && !path.empty())
+	{
+		throw P9fsException("Symbolic links are not exported: " + path,
+							ELOOP);
+	}
+
+	qid = toQid(st);
+
+	mLookupCache.put(path, qid);
+
+	return qid;
+}
+
+/*******************************************************************************
+ * P9fsRing
+ ******************************************************************************/
+
+P9fsRing::P9fsRing(domid_t domId, evtchn_port_t port, grant_ref_t ref,
+				   P9fsSessionPtr session, const P9fsConfig& config) :
+	RingBufferBase(domId, port, ref),
+	mSession(session),
+	mConfig(config),
+	mIntf(static_cast<xen_9pfs_data_intf*>(mBuffer.get())),
+	mIn(nullptr),
+	mOut(nullptr),
+	mRingSize(0),
+	mOutParsed(0),
+	mInReserved(0),
+	mTerminate(false),
+	mInFlight(0),
+	mStats {},
+	mPool(config.workers)
+{
+	auto order = mIntf->ring_order;
+
+	if (order > mConfig.maxRingPageOrder)
+	{
+		throw P9fsException("Invalid ring order: " + to_string(order), EINVAL);
+	}
+
+	mData.reset(new XenGnttabBuffer(domId, mIntf->ref, 1 << order));
+
+	// the data pages are split into in and out rings of the same size
+
+	mRingSize = XEN_FLEX_RING_SIZE(order);
+	mIn = static_cast<uint8_t*>(mData->get());
+	mOut = mIn + mRingSize;
+
+	mOutParsed = mIntf->out_cons;
+	mInReserved = mIntf->in_prod;
+
+	LOG(mLog, DEBUG) << "Create 9pfs ring, order: " << order;
+}
+
+P9fsRing::~P9fsRing()
+{
+	stop();
+
+	{
+		lock_guard<mutex> lock(mInMutex);
+
+		mTerminate = true;
+	}
+
+	mInCondVar.notify_all();
+
+	mPool.stop();
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+P9fsStats P9fsRing::getStats() const
+{
+	lock_guard<mutex> lock(mStatsMutex);
+
+	return mStats;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void P9fsRing::onReceiveIndication()
+{
+	// the frontend may have consumed responses: wake up waiting workers
+
+	{
+		lock_guard<mutex> lock(mInMutex);
+	}
+
+	mInCondVar.notify_all();
+
+	auto prod = mIntf->out_prod;
+
+	xen_rmb();
+
+	bool released = false;
+
+	while (prod - mOutParsed >= P9fsWriter::cHeaderSize)
+	{
+		uint8_t header[P9fsWriter::cHeaderSize];
+
+		copyFromOut(mOutParsed, header, sizeof(header));
+
+		P9fsReader reader(header, sizeof(header));
+
+		auto size = reader.readU32();
+
+		RequestPtr request(new Request());
+
+		request->type = reader.readU8();
+		request->tag = reader.readU16();
+
+		if (size < P9fsWriter::cHeaderSize || size > mRingSize)
+		{
+			throw RingBufferException("Invalid message size: " +
+									  to_string(size), EPROTO);
+		}
+
+		if (prod - mOutParsed < size)
+		{
+			break;
+		}
+
+		auto body = mOutParsed + P9fsWriter::cHeaderSize;
+
+		if (request->type == P9_TWRITE && size >= cWriteHeaderSize)
+		{
+			// the payload stays in the ring till the write is done
+
+			request->body.resize(cWriteHeaderSize - P9fsWriter::cHeaderSize);
+			request->payload = mOutParsed + cWriteHeaderSize;
+			request->payloadSize = size - cWriteHeaderSize;
+			request->holdsOut = true;
+		}
+		else
+		{
+			request->body.resize(size - P9fsWriter::cHeaderSize);
+			request->payload = 0;
+			request->payloadSize = 0;
+			request->holdsOut = false;
+		}
+
+		copyFromOut(body, request->body.data(), request->body.size());
+
+		{
+			lock_guard<mutex> lock(mOutMutex);
+
+			request->outId = mOutRelease.add(mOutParsed + size);
+		}
+
+		mOutParsed += size;
+
+		if (!request->holdsOut)
+		{
+			released |= releaseOut(request->outId);
+		}
+
+		dispatch(request);
+	}
+
+	if (released)
+	{
+		notify();
+	}
+}
+
+void P9fsRing::dispatch(RequestPtr request)
+{
+	{
+		lock_guard<mutex> lock(mStatsMutex);
+
+		mStats.requests++;
+		mInFlight++;
+		mStats.maxInFlight = max<uint64_t>(mStats.maxInFlight, mInFlight);
+	}
+
+	// version resets the session and flush waits for the flushed request:
+	// both are handled when all previous requests are done
+
+	if (request->type == P9_TVERSION || request->type == P9_TFLUSH)
+	{
+		mPool.wait();
+
+		processRequest(request);
+
+		return;
+	}
+
+	// all other requests start with fid: requests of the same fid are
+	// handled in order
+
+	uint32_t fid = 0;
+
+	if (request->body.size() >= sizeof(fid))
+	{
+		memcpy(&fid, request->body.data(), sizeof(fid));
+	}
+
+	mPool.call(fid, [this, request] { processRequest(request); });
+}
+
+void P9fsRing::processRequest(RequestPtr request)
+{
+	try
+	{
+		vector<uint8_t> rsp;
+		P9fsWriter writer(rsp);
+		bool sent = false;
+
+		try
+		{
+			if (request->type == P9_TREAD)
+			{
+				sent = processRead(*request);
+			}
+
+			if (!sent)
+			{
+				P9fsReader reader(request->body.data(), request->body.size());
+
+				writer.begin(request->type + 1, request->tag);
+
+				if (request->type == P9_TWRITE)
+				{
+					processWrite(*request, writer);
+				}
+				else
+				{
+					processMessage(*request, reader, writer);
+				}
+
+				writer.end();
+			}
+		}
+		catch(const exception& e)
+		{
+			auto ex = dynamic_cast<const Exception*>(&e);
+			int err = ex && ex->getErrno() ? ex->getErrno() : EIO;
+
+			LOG(mLog, DEBUG) << "Request " << static_cast<int>(request->type)
+							 << " failed: " << e.what();
+
+			writer.begin(P9_RLERROR, request->tag);
+			writer.writeU32(err);
+			writer.end();
+
+			lock_guard<mutex> lock(mStatsMutex);
+
+			mStats.errors++;
+		}
+
+		if (request->holdsOut && releaseOut(request->outId))
+		{
+			notify();
+		}
+
+		if (!sent)
+		{
+			sendResponse(rsp);
+		}
+	}
+	catch(const exception& e)
+	{
+		LOG(mLog, ERROR) << e.what();
+	}
+
+	lock_guard<mutex> lock(mStatsMutex);
+
+	mInFlight--;
+}
+
+void P9fsRing::processMessage(const Request& request, P9fsReader& reader,
+							  P9fsWriter& writer)
+{
+	switch(request.type)
+	{
+	case P9_TVERSION:
+	{
+		auto msize = min<uint32_t>(reader.readU32(), mRingSize);
+		auto version = reader.readString();
+
+		if (msize <= cWriteHeaderSize)
+		{
+			throw P9fsException("Invalid msize: " + to_string(msize), EINVAL);
+		}
+
+		writer.writeU32(mSession->version(msize));
+		writer.writeString(version == cProtocolVersion ? version : "unknown");
+
+		break;
+	}
+
+	case P9_TATTACH:
+	{
+		auto fid = reader.readU32();
+
+		writer.writeQid(mSession->attach(fid));
+
+		break;
+	}
+
+	case P9_TWALK:
+	{
+		auto fid = reader.readU32();
+		auto newFid = reader.readU32();
+		vector<string> names(reader.readU16());
+
+		for (auto& name : names)
+		{
+			name = reader.readString();
+		}
+
+		auto qids = mSession->walk(fid, newFid, names);
+
+		writer.writeU16(qids.size());
+
+		for (auto& qid : qids)
+		{
+			writer.writeQid(qid);
+		}
+
+		break;
+	}
+
+	case P9_TLOPEN:
+	{
+		auto fid = reader.readU32();
+		auto flags = reader.readU32();
+
+		writer.writeQid(mSession->open(fid, flags));
+		// iounit 0: the frontend derives it from msize
+		writer.writeU32(0);
+
+		break;
+	}
+
+	case P9_TLCREATE:
+	{
+		auto fid = reader.readU32();
+		auto name = reader.readString();
+		auto flags = reader.readU32();
+		auto mode = reader.readU32();
+
+		writer.writeQid(mSession->create(fid, name, flags, mode));
+		writer.writeU32(0);
+
+		break;
+	}
+
+	case P9_TMKDIR:
+	{
+		auto fid = reader.readU32();
+		auto name = reader.readString();
+		auto mode = reader.readU32();
+
+		writer.writeQid(mSession->mkdir(fid, name, mode));
+
+		break;
+	}
+
+	case P9_TGETATTR:
+	{
+		struct stat st;
+		P9fsQid qid;
+
+		mSession->getattr(reader.readU32(), st, qid);
+
+		writer.writeU64(cGetattrBasic);
+		writer.writeQid(qid);
+		writer.writeU32(st.st_mode);
+		writer.writeU32(st.st_uid);
+		writer.writeU32(st.st_gid);
+		writer.writeU64(st.st_nlink);
+		writer.writeU64(st.st_rdev);
+		writer.writeU64(st.st_size);
+		writer.writeU64(st.st_blksize);
+		writer.writeU64(st.st_blocks);
+		writer.writeU64(st.st_atim.tv_sec);
+		writer.writeU64(st.st_atim.tv_nsec);
+		writer.writeU64(st.st_mtim.tv_sec);
+		writer.writeU64(st.st_mtim.tv_nsec);
+		writer.writeU64(st.st_ctim.tv_sec);
+		writer.writeU64(st.st_ctim.tv_nsec);
+		// btime, gen, data_version
+		writer.writeU64(0);
+		writer.writeU64(0);
+		writer.writeU64(0);
+		writer.writeU64(0);
+
+		break;
+	}
+
+	case P9_TSETATTR:
+	{
+		auto fid = reader.readU32();
+		auto valid = reader.readU32();
+		auto mode = reader.readU32();
+		auto uid = reader.readU32();
+		auto gid = reader.readU32();
+		auto size = reader.readU64();
+		timespec atime, mtime;
+
+		atime.tv_sec = reader.readU64();
+		atime.tv_nsec = reader.readU64();
+		mtime.tv_sec = reader.readU64();
+		mtime.tv_nsec = reader.readU64();
+
+		mSession->setattr(fid, valid, mode, uid, gid, size, atime, mtime);
+
+		break;
+	}
+
+	case P9_TSTATFS:
+	{
+		struct statvfs st;
+
+		mSession->statfs(reader.readU32(), st);
+
+		writer.writeU32(cStatfsType);
+		writer.writeU32(st.f_bsize);
+		writer.writeU64(st.f_blocks);
+		writer.writeU64(st.f_bfree);
+		writer.writeU64(st.f_bavail);
+		writer.writeU64(st.f_files);
+		writer.writeU64(st.f_ffree);
+		writer.writeU64(st.f_fsid);
+		writer.writeU32(st.f_namemax);
+
+		break;
+	}
+
+	case P9_TREADDIR:
+	{
+		auto fid = reader.readU32();
+		auto offset = reader.readU64();
+		auto count = getMaxCount(reader.readU32());
+		auto pos = writer.size();
+
+		writer.writeU32(0);
+
+		mSession->readdir(fid, offset, count, writer);
+
+		writer.setU32(pos, writer.size() - pos - sizeof(uint32_t));
+
+		break;
+	}
+
+	case P9_TREAD:
+	{
+		// not a regular file: read through a bounce buffer
+
+		auto fid = reader.readU32();
+		auto offset = reader.readU64();
+		auto count = getMaxCount(reader.readU32());
+		auto data = StagingPool::getInstance().alloc(count);
+		iovec iov = {data.get(), data.size()};
+
+		auto size = mSession->readv(fid, offset, &iov, 1);
+
+		writer.writeU32(size);
+		writer.writeData(data.get(), size);
+
+		lock_guard<mutex> lock(mStatsMutex);
+
+		mStats.reads++;
+		mStats.readBytes += size;
+
+		break;
+	}
+
+	case P9_TFSYNC:
+		mSession->fsync(reader.readU32());
+
+		break;
+
+	case P9_TRENAMEAT:
+	{
+		auto oldDirFid = reader.readU32();
+		auto oldName = reader.readString();
+		auto newDirFid = reader.readU32();
+		auto newName = reader.readString();
+
+		mSession->renameat(oldDirFid, oldName, newDirFid, newName);
+
+		break;
+	}
+
+	case P9_TUNLINKAT:
+	{
+		auto fid = reader.readU32();
+		auto name = reader.readString();
+		auto flags = reader.readU32();
+
+		mSession->unlinkat(fid, name, flags);
+
+		break;
+	}
+
+	case P9_TFLUSH:
+		// all previous requests are done already
+		reader.readU16();
+
+		break;
+
+	case P9_TCLUNK:
+		mSession->clunk(reader.readU32());
+
+		break;
+
+	case P9_TREMOVE:
+		mSession->remove(reader.readU32());
+
+		break;
+
+	default:
+		throw P9fsException("Unsupported message: " +
+							to_string(request.type), EOPNOTSUPP);
+	}
+}
+
+bool P9fsRing::processRead(const Request& request)
+{
+	P9fsReader reader(request.body.data(), request.body.size());
+
+	auto fid = reader.readU32();
+	auto offset = reader.readU64();
+	auto count = getMaxCount(reader.readU32());
+
+	auto size = mSession->getReadSize(fid, offset, count);
+
+	if (size < 0)
+	{
+		return false;
+	}
+
+	uint64_t id;
+	auto index = reserve(cReadHeaderSize + size, id);
+
+	iovec iov[2];
+	auto iovCount = getIov(mIn, index + cReadHeaderSize, size, iov);
+
+	size_t read = 0;
+	int err = 0;
+
+	try
+	{
+		if (size)
+		{
+			read = mSession->readv(fid, offset, iov, iovCount);
+		}
+	}
+	catch(const Exception& e)
+	{
+		err = e.getErrno() ? e.getErrno() : EIO;
+	}
+
+	// the reserved size can't be changed: the rest of the space is zeroed
+	// and the message keeps the reserved size
+
+	size_t pos = 0;
+
+	for (int i = 0; i < iovCount; i++)
+	{
+		auto skip = min(iov[i].iov_len, read > pos ? read - pos : 0);
+
+		memset(static_cast<uint8_t*>(iov[i].iov_base) + skip, 0,
+			   iov[i].iov_len - skip);
+
+		pos += iov[i].iov_len;
+	}
+
+	uint8_t header[cReadHeaderSize];
+
+	P9fsWriter::encodeHeader(header, cReadHeaderSize + size,
+							 err ? P9_RLERROR : P9_RREAD, request.tag);
+
+	uint32_t value = err ? err : read;
+
+	memcpy(&header[P9fsWriter::cHeaderSize], &value, sizeof(value));
+
+	copyToIn(index, header, sizeof(header));
+
+	commit(id);
+
+	lock_guard<mutex> lock(mStatsMutex);
+
+	mStats.reads++;
+	mStats.readBytes += read;
+	mStats.zeroCopyReads++;
+
+	if (err)
+	{
+		mStats.errors++;
+	}
+
+	return true;
+}
+
+void P9fsRing::processWrite(const Request& request, P9fsWriter& writer)
+{
+	P9fsReader reader(request.body.data(), request.body.size());
+
+	auto fid = reader.readU32();
+	auto offset = reader.readU64();
+	auto count = reader.readU32();
+
+	if (count != request.payloadSize)
+	{
+		throw P9fsException("Invalid write count: " + to_string(count),
+							EPROTO);
+	}
+
+	iovec iov[2];
+	auto iovCount = getIov(mOut, request.payload, count, iov);
+
+	auto size = mSession->writev(fid, offset, iov, iovCount);
+
+	writer.writeU32(size);
+
+	lock_guard<mutex> lock(mStatsMutex);
+
+	mStats.writes++;
+	mStats.writtenBytes += size;
+}
+
+uint32_t P9fsRing::getMaxCount(uint32_t count)
+{
+	auto msize = mSession->getMsize();
+
+	if (msize <= cWriteHeaderSize)
+	{
+		throw P9fsException("Version is not negotiated", EPROTO);
+	}
+
+	return min<uint32_t>(count, msize - cReadHeaderSize);
+}
+
+void P9fsRing::sendResponse(const vector<uint8_t>& rsp)
+{
+	uint64_t id;
+	auto index = reserve(rsp.size(), id);
+
+	copyToIn(index, rsp.data(), rsp.size());
+
+	commit(id);
+}
+
+RING_IDX P9fsRing::reserve(size_t size, uint64_t& id)
+{
+	if (size > mRingSize)
+	{
+		throw P9fsException("Response is too big: " + to_string(size),
+							EMSGSIZE);
+	}
+
+	unique_lock<mutex> lock(mInMutex);
+
+	while (true)
+	{
+		if (mTerminate)
+		{
+			throw P9fsException("Ring is terminated", ECANCELED);
+		}
+
+		auto cons = mIntf->in_cons;
+
+		xen_mb();
+
+		if (mRingSize - (mInReserved - cons) >= size)
+		{
+			break;
+		}
+
+		// the frontend doesn't have to notify when it consumes responses
+
+		mInCondVar.wait_for(lock, milliseconds(10));
+	}
+
+	auto index = mInReserved;
+
+	mInReserved += size;
+
+	id = mInRelease.add(mInReserved);
+
+	return index;
+}
+
+void P9fsRing::commit(uint64_t id)
+{
+	{
+		lock_guard<mutex> lock(mInMutex);
+
+		RING_IDX end;
+
+		if (!mInRelease.done(id, end))
+		{
+			return;
+		}
+
+		xen_wmb();
+
+		mIntf->in_prod = end;
+	}
+
+	notify();
+}
+
+bool P9fsRing::releaseOut(uint64_t id)
+{
+	lock_guard<mutex> lock(mOutMutex);
+
+	RING_IDX end;
+
+	if (!mOutRelease.done(id, end))
+	{
+		return false;
+	}
+
+	xen_mb();
+
+	mIntf->out_cons = end;
+
+	return true;
+}
+
+void P9fsRing::copyFromOut(RING_IDX index, void* data, size_t size)
+{
+	iovec iov[2];
+	auto count = getIov(mOut, index, size, iov);
+	auto dst = static_cast<uint8_t*>(data);
+
+	for (int i = 0; i < count; dst += iov[i].iov_len, i++)
+	{
+		memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+	}
+}
+
+void P9fsRing::copyToIn(RING_IDX index, const void* data, size_t size)
+{
+	iovec iov[2];
+	auto count = getIov(mIn, index, size, iov);
+	auto src = static_cast<const uint8_t*>(data);
+
+	for (int i = 0; i < count; src += iov[i].iov_len, i++)
+	{
+		memcpy(iov[i].iov_base, src, iov[i].iov_len);
+	}
+}
+
+int P9fsRing::getIov(uint8_t* ring, RING_IDX index, size_t size, iovec* iov)
+{
+	auto offset = index & (mRingSize - 1);
+	auto first = min<size_t>(size, mRingSize - offset);
+
+	iov[0].iov_base = &ring[offset];
+	iov[0].iov_len = first;
+
+	if (first == size)
+	{
+		return 1;
+	}
+
+	iov[1].iov_base = ring;
+	iov[1].iov_len = size - first;
+
+	return 2;
+}
+
+/*******************************************************************************
+ * P9fsRing::OrderedRelease
+ ******************************************************************************/
+
+uint64_t P9fsRing::OrderedRelease::add(RING_IDX end)
+{
+	mEntries.emplace_back(end, false);
+
+	return mBase + mEntries.size() - 1;
+}
+
+bool P9fsRing::OrderedRelease::done(uint64_t id, RING_IDX& end)
+{
+	mEntries.at(id - mBase).second = true;
+
+	bool released = false;
+
+	while (!mEntries.empty() && mEntries.front().second)
+	{
+		end = mEntries.front().first;
+
+		mEntries.pop_front();
+		mBase++;
+
+		released = true;
+	}
+
+	return released;
+}
+
+/*******************************************************************************
+ * P9fsFrontendHandler
+ ******************************************************************************/
+
+P9fsFrontendHandler::P9fsFrontendHandler(const string& devName,
+										 domid_t beDomId, domid_t feDomId,
+										 uint16_t devId,
+										 const P9fsConfig& config) :
+	FrontendHandlerBase("P9fsFrontend", devName, beDomId, feDomId, devId),
+	mConfig(config),
+	mLog("P9fsFrontend")
+{
+	writeFeatures();
+}
+
+P9fsFrontendHandler::~P9fsFrontendHandler()
+{
+	stop();
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+vector<P9fsStats> P9fsFrontendHandler::getStats()
+{
+	lock_guard<mutex> lock(mRingsMutex);
+
+	vector<P9fsStats> stats;
+
+	for (auto ring : mRings)
+	{
+		stats.push_back(ring->getStats());
+	}
+
+	return stats;
+}
+
+/*******************************************************************************
+ * Protected
+ ******************************************************************************/
+
+void P9fsFrontendHandler::onBind()
+{
+	auto& xenStore = getXenStore();
+	auto fePath = getXsFrontendPath();
+
+	auto version = xenStore.readString(fePath + "/version");
+
+	if (version != "1")
+	{
+		throw P9fsException("Unsupported transport version: " + version,
+							EINVAL);
+	}
+
+	auto numRings = xenStore.readUint(fePath + "/num-rings");
+
+	if (numRings == 0 || numRings > mConfig.maxRings)
+	{
+		throw P9fsException("Invalid number of rings: " +
+							to_string(numRings), EINVAL);
+	}
+
+	auto root = xenStore.readString(getXsBackendPath() + "/path");
+
+	LOG(mLog, DEBUG) << Utils::logDomId(getDomId(), getDevId())
+					 << "Bind, rings: " << numRings << ", path: " << root;
+
+	lock_guard<mutex> lock(mRingsMutex);
+
+	mSession.reset(new P9fsSession(root, mConfig));
+
+	for (unsigned int i = 0; i < numRings; i++)
+	{
+		auto index = to_string(i);
+
+		auto ring = makeShared<P9fsRing>(
+				getDomId(),
+				xenStore.readUint(fePath + "/event-channel-" + index),
+				xenStore.readUint(fePath + "/ring-ref" + index),
+				mSession, mConfig);
+
+		addRingBuffer(ring);
+
+		mRings.push_back(ring);
+	}
+}
+
+void P9fsFrontendHandler::onClosing()
+{
+	lock_guard<mutex> lock(mRingsMutex);
+
+	mRings.clear();
+	mSession.reset();
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void P9fsFrontendHandler::writeFeatures()
+{
+	auto& xenStore = getXenStore();
+	auto bePath = getXsBackendPath();
+
+	xenStore.writeString(bePath + "/versions", "1");
+	xenStore.writeUint(bePath + "/max-rings", mConfig.maxRings);
+	xenStore.writeUint(bePath + "/max-ring-page-order",
+					   mConfig.maxRingPageOrder);
+}
+
+/*******************************************************************************
+ * P9fsBackend
+ ******************************************************************************/
+
+P9fsBackend::P9fsBackend(const string& name, const P9fsConfig& config,
+						 const string& devName) :
+	BackendBase(name, devName),
+	mConfig(config)
+{
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void P9fsBackend::onNewFrontend(domid_t domId, uint16_t devId)
+{
+	addFrontendHandler(FrontendHandlerPtr(
+			new P9fsFrontendHandler(getDeviceName(), getDomId(), domId,
+									devId, mConfig)));
+}
+
+}
@@ -0,0 +1,1432 @@
+/*
+ *  Xen pvcalls backend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include "PvcallsBackend.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "XenStore.hpp"
+
+using std::condition_variable;
+using std::exception;
+using std::lock_guard;
+using std::max;
+using std::min;
+using std::mutex;
+using std::string;
+using std::thread;
+using std::to_string;
+using std::unique_lock;
+using std::vector;
+
+namespace XenBackend {
+
+namespace {
+
+const char* cProtocolVersion = "1";
+
+// size of the address field of connect and bind commands
+const size_t cMaxAddrLen = sizeof(xen_pvcalls_request().u.connect.addr);
+
+int getErrno(const exception& e)
+{
+	auto ex = dynamic_cast<const Exception*>(&e);
+
+	return ex && ex->getErrno() ? ex->getErrno() : EIO;
+}
+
+}
+
+/*******************************************************************************
+ * PvcallsEventLoop
+ ******************************************************************************/
+
+PvcallsEventLoop::PvcallsEventLoop(unsigned int maxEvents) :
+	mMaxEvents(maxEvents ? maxEvents : 1),
+	mEpollFd(-1),
+	mWakeFd(-1),
+	mHandle(nullptr),
+	mEvtchnFd(-1),
+	mTerminate(false),
+	mLog("PvcallsEventLoop")
+{
+	try
+	{
+		init();
+	}
+	catch(const exception& e)
+	{
+		release();
+
+		throw;
+	}
+}
+
+PvcallsEventLoop::~PvcallsEventLoop()
+{
+	{
+		lock_guard<mutex> lock(mTasksMutex);
+
+		mTerminate = true;
+	}
+
+	uint64_t value = 1;
+
+	if (write(mWakeFd, &value, sizeof(value)) < 0)
+	{
+		LOG(mLog, ERROR) << "Can't wake up loop";
+	}
+
+	if (mThread.joinable())
+	{
+		mThread.join();
+	}
+
+	release();
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+void PvcallsEventLoop::post(Task task)
+{
+	{
+		lock_guard<mutex> lock(mTasksMutex);
+
+		mTasks.push_back(task);
+	}
+
+	uint64_t value = 1;
+
+	if (write(mWakeFd, &value, sizeof(value)) < 0)
+	{
+		throw PvcallsException("Can't wake up loop", errno);
+	}
+}
+
+void PvcallsEventLoop::sync()
+{
+	if (std::this_thread::get_id() == mThread.get_id())
+	{
+		throw PvcallsException("Can't sync from loop thread", EDEADLK);
+	}
+
+	mutex doneMutex;
+	condition_variable doneCondVar;
+	bool done = false;
+
+	post([&doneMutex, &doneCondVar, &done] {
+		lock_guard<mutex> lock(doneMutex);
+
+		done = true;
+
+		doneCondVar.notify_all();
+	});
+
+	unique_lock<mutex> lock(doneMutex);
+
+	doneCondVar.wait(lock, [&done] { return done; });
+}
+
+void PvcallsEventLoop::addFd(int fd, uint32_t events, FdCallback callback)
+{
+	epoll_event event {};
+
+	event.events = events;
+	event.data.fd = fd;
+
+	if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, fd, &event) < 0)
+	{
+		throw PvcallsException("Can't add fd to epoll", errno);
+	}
+
+	mFds[fd] = callback;
+}
+
+void PvcallsEventLoop::removeFd(int fd)
+{
+	if (mFds.erase(fd) == 0)
+	{
+		return;
+	}
+
+	if (epoll_ctl(mEpollFd, EPOLL_CTL_DEL, fd, nullptr) < 0)
+	{
+		LOG(mLog, ERROR) << "Can't remove fd from epoll: " << strerror(errno);
+	}
+}
+
+evtchn_port_t PvcallsEventLoop::bindPort(domid_t domId, evtchn_port_t port,
+										 PortCallback callback)
+{
+	auto localPort = xenevtchn_bind_interdomain(mHandle, domId, port);
+
+	if (localPort < 0)
+	{
+		throw PvcallsException("Can't bind event channel: " + to_string(port),
+							   errno);
+	}
+
+	mPorts[localPort] = callback;
+
+	DLOG(mLog, DEBUG) << "Bind event channel, dom: " << domId
+					  << ", remote port: " << port << ", local port: "
+					  << localPort;
+
+	return localPort;
+}
+
+void PvcallsEventLoop::unbindPort(evtchn_port_t port)
+{
+	mPorts.erase(port);
+
+	if (xenevtchn_unbind(mHandle, port) < 0)
+	{
+		LOG(mLog, ERROR) << "Can't unbind event channel: " << port;
+	}
+}
+
+void PvcallsEventLoop::notifyPort(evtchn_port_t port)
+{
+	if (xenevtchn_notify(mHandle, port) < 0)
+	{
+		throw PvcallsException("Can't notify event channel", errno);
+	}
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void PvcallsEventLoop::init()
+{
+	mEpollFd = epoll_create1(EPOLL_CLOEXEC);
+
+	if (mEpollFd < 0)
+	{
+		throw PvcallsException("Can't create epoll", errno);
+	}
+
+	mWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (mWakeFd < 0)
+	{
+		throw PvcallsException("Can't create eventfd", errno);
+	}
+
+	mHandle = xenevtchn_open(nullptr, 0);
+
+	if (!mHandle)
+	{
+		throw PvcallsException("Can't open event channel", errno);
+	}
+
+	mEvtchnFd = xenevtchn_fd(mHandle);
+
+	if (mEvtchnFd < 0)
+	{
+		throw PvcallsException("Can't get event channel fd", errno);
+	}
+
+	for (auto fd : { mWakeFd, mEvtchnFd })
+	{
+		epoll_event event {};
+
+		event.events = EPOLLIN;
+		event.data.fd = fd;
+
+		if (epoll_ctl(mEpollFd, EPOLL_CTL_ADD, fd, &event) < 0)
+		{
+			throw PvcallsException("Can't add fd to epoll", errno);
+		}
+	}
+
+	mThread = thread(&PvcallsEventLoop::run, this);
+}
+
+void PvcallsEventLoop::release()
+{
+	if (mHandle)
+	{
+		xenevtchn_close(mHandle);
+	}
+
+	if (mWakeFd >= 0)
+	{
+		close(mWakeFd);
+	}
+
+	if (mEpollFd >= 0)
+	{
+		close(mEpollFd);
+	}
+}
+
+void PvcallsEventLoop::run()
+{
+	vector<epoll_event> events(mMaxEvents);
+
+	try
+	{
+		while (true)
+		{
+			auto count = epoll_wait(mEpollFd, events.data(), events.size(),
+									-1);
+
+			if (count < 0)
+			{
+				if (errno == EINTR)
+				{
+					continue;
+				}
+
+				throw PvcallsException("Can't wait for events", errno);
+			}
+
+			for (int i = 0; i < count; i++)
+			{
+				auto fd = events[i].data.fd;
+
+				if (fd == mWakeFd)
+				{
+					uint64_t value;
+
+					if (read(mWakeFd, &value, sizeof(value)) < 0 &&
+						errno != EAGAIN)
+					{
+						throw PvcallsException("Can't read eventfd", errno);
+					}
+
+					continue;
+				}
+
+				if (fd == mEvtchnFd)
+				{
+					handlePort();
+
+					continue;
+				}
+
+				auto it = mFds.find(fd);
+
+				if (it == mFds.end())
+				{
+					continue;
+				}
+
+				// the callback may add fds
+				auto callback = it->second;
+
+				try
+				{
+					callback(events[i].events);
+				}
+				catch(const exception& e)
+				{
+					LOG(mLog, ERROR) << e.what();
+				}
+			}
+
+			// fds are closed by tasks only, so events of this batch never
+			// refer to reused fd numbers
+
+			runTasks();
+
+			lock_guard<mutex> lock(mTasksMutex);
+
+			if (mTerminate)
+			{
+				break;
+			}
+		}
+	}
+	catch(const exception& e)
+	{
+		LOG(mLog, ERROR) << e.what();
+	}
+}
+
+void PvcallsEventLoop::runTasks()
+{
+	std::deque<Task> tasks;
+
+	{
+		lock_guard<mutex> lock(mTasksMutex);
+
+		tasks.swap(mTasks);
+	}
+
+	for (auto& task : tasks)
+	{
+		try
+		{
+			task();
+		}
+		catch(const exception& e)
+		{
+			LOG(mLog, ERROR) << e.what();
+		}
+	}
+}
+
+void PvcallsEventLoop::handlePort()
+{
+	auto port = xenevtchn_pending(mHandle);
+
+	if (port < 0)
+	{
+		throw PvcallsException("Can't get pending port", errno);
+	}
+
+	if (xenevtchn_unmask(mHandle, port) < 0)
+	{
+		throw PvcallsException("Can't unmask event channel", errno);
+	}
+
+	auto it = mPorts.find(port);
+
+	if (it == mPorts.end())
+	{
+		return;
+	}
+
+	auto callback = it->second;
+
+	try
+	{
+		callback();
+	}
+	catch(const exception& e)
+	{
+		LOG(mLog, ERROR) << e.what();
+	}
+}
+
+/*******************************************************************************
+ * PvcallsDataRing
+ ******************************************************************************/
+
+PvcallsDataRing::PvcallsDataRing(domid_t domId, grant_ref_t ref,
+								 evtchn_port_t port, PvcallsEventLoop& loop,
+								 unsigned int maxPageOrder,
+								 PvcallsEventLoop::PortCallback callback) :
+	mLoop(loop),
+	mIntfBuffer(domId, ref),
+	mIntf(static_cast<pvcalls_data_intf*>(mIntfBuffer.get())),
+	mIn(nullptr),
+	mOut(nullptr),
+	mSize(0),
+	mPort(0)
+{
+	auto order = mIntf->ring_order;
+
+	if (order > maxPageOrder)
+	{
+		throw PvcallsException("Invalid ring order: " + to_string(order),
+							   EINVAL);
+	}
+
+	// copy refs as the frontend may change the page at any time
+	vector<grant_ref_t> refs(mIntf->ref, mIntf->ref + (1 << order));
+
+	mData.reset(new XenGnttabBuffer(domId, refs.data(), refs.size()));
+
+	// the data pages are split into in and out rings of the same size
+
+	mSize = XEN_FLEX_RING_SIZE(order);
+	mIn = static_cast<uint8_t*>(mData->get());
+	mOut = mIn + mSize;
+
+	mPort = mLoop.bindPort(domId, port, callback);
+}
+
+PvcallsDataRing::~PvcallsDataRing()
+{
+	mLoop.unbindPort(mPort);
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+int PvcallsDataRing::getIov(uint8_t* ring, RING_IDX index, size_t size,
+							iovec* iov) const
+{
+	auto offset = index & (mSize - 1);
+	auto first = min<size_t>(size, mSize - offset);
+
+	iov[0].iov_base = &ring[offset];
+	iov[0].iov_len = first;
+
+	if (first == size)
+	{
+		return 1;
+	}
+
+	iov[1].iov_base = ring;
+	iov[1].iov_len = size - first;
+
+	return 2;
+}
+
+void PvcallsDataRing::notify()
+{
+	mLoop.notifyPort(mPort);
+}
+
+/*******************************************************************************
+ * PvcallsSocket
+ ******************************************************************************/
+
+PvcallsSocket::PvcallsSocket(uint64_t id, int fd, PvcallsEventLoop& loop,
+							 PvcallsCommandRing& owner) :
+	mId(id),
+	mFd(fd),
+	mLoop(loop),
+	mOwner(owner),
+	mState(State::CREATED),
+	mInClosed(false),
+	mOutClosed(false),
+	mAcceptPending(false),
+	mAcceptReq {},
+	mPollPending(false),
+	mPollReq {},
+	mConnectReq {},
+	mLog("PvcallsSocket")
+{
+}
+
+PvcallsSocket::~PvcallsSocket()
+{
+	if (mFd >= 0)
+	{
+		::close(mFd);
+	}
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+void PvcallsSocket::connect(const xen_pvcalls_request& req)
+{
+	if (mState != State::CREATED)
+	{
+		respond(req, mState == State::CONNECTING ? -EALREADY :
+					 mState == State::CONNECTED ? -EISCONN : -EINVAL);
+
+		return;
+	}
+
+	if (req.u.connect.len > cMaxAddrLen)
+	{
+		respond(req, -EINVAL);
+
+		return;
+	}
+
+	try
+	{
+		mRing.reset(new PvcallsDataRing(mOwner.getDomId(), req.u.connect.ref,
+										req.u.connect.evtchn, mLoop,
+										mOwner.getConfig().maxPageOrder,
+										[this] { transfer(); }));
+	}
+	catch(const exception& e)
+	{
+		LOG(mLog, ERROR) << e.what();
+
+		respond(req, -getErrno(e));
+
+		return;
+	}
+
+	if (::connect(mFd, reinterpret_cast<const sockaddr*>(req.u.connect.addr),
+				  req.u.connect.len) < 0 && errno != EINPROGRESS)
+	{
+		auto error = errno;
+
+		mRing.reset();
+
+		respond(req, -error);
+
+		return;
+	}
+
+	mConnectReq = req;
+	mState = State::CONNECTING;
+
+	mLoop.addFd(mFd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+				[this] (uint32_t events) { onSocketEvent(events); });
+}
+
+void PvcallsSocket::bind(const xen_pvcalls_request& req)
+{
+	if (mState != State::CREATED)
+	{
+		respond(req, -EINVAL);
+
+		return;
+	}
+
+	if (req.u.bind.len > cMaxAddrLen)
+	{
+		respond(req, -EINVAL);
+
+		return;
+	}
+
+	int enable = 1;
+
+	setsockopt(mFd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+	if (::bind(mFd, reinterpret_cast<const sockaddr*>(req.u.bind.addr),
+			   req.u.bind.len) < 0)
+	{
+		respond(req, -errno);
+
+		return;
+	}
+
+	mState = State::BOUND;
+
+	respond(req, 0);
+}
+
+void PvcallsSocket::listen(const xen_pvcalls_request& req)
+{
+	if (mState != State::BOUND)
+	{
+		respond(req, -EINVAL);
+
+		return;
+	}
+
+	if (::listen(mFd, req.u.listen.backlog) < 0)
+	{
+		respond(req, -errno);
+
+		return;
+	}
+
+	mState = State::LISTENING;
+
+	mLoop.addFd(mFd, EPOLLIN | EPOLLET,
+				[this] (uint32_t events) { onListenEvent(events); });
+
+	respond(req, 0);
+}
+
+void PvcallsSocket::accept(const xen_pvcalls_request& req)
+{
+	if (mState != State::LISTENING)
+	{
+		respond(req, -EINVAL);
+
+		return;
+	}
+
+	if (mAcceptPending)
+	{
+		respond(req, -EBUSY);
+
+		return;
+	}
+
+	if (mOwner.hasSocket(req.u.accept.id_new))
+	{
+		respond(req, -EEXIST);
+
+		return;
+	}
+
+	mAcceptReq = req;
+	mAcceptPending = true;
+
+	doAccept();
+}
+
+void PvcallsSocket::poll(const xen_pvcalls_request& req)
+{
+	if (mState != State::LISTENING)
+	{
+		respond(req, -EINVAL);
+
+		return;
+	}
+
+	if (mPollPending)
+	{
+		respond(req, -EBUSY);
+
+		return;
+	}
+
+	mPollReq = req;
+	mPollPending = true;
+
+	doAccept();
+}
+
+void PvcallsSocket::close()
+{
+	if (mState == State::CLOSED)
+	{
+		return;
+	}
+
+	mLoop.removeFd(mFd);
+
+	mRing.reset();
+
+	if (mAcceptPending)
+	{
+		mAcceptPending = false;
+
+		respond(mAcceptReq, -EINTR);
+	}
+
+	if (mPollPending)
+	{
+		mPollPending = false;
+
+		respond(mPollReq, -EINTR);
+	}
+
+	if (mState == State::CONNECTING)
+	{
+		respond(mConnectReq, -EINTR);
+	}
+
+	::close(mFd);
+
+	mFd = -1;
+	mState = State::CLOSED;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void PvcallsSocket::attach(int fd, grant_ref_t ref, evtchn_port_t port)
+{
+	mFd = fd;
+
+	mRing.reset(new PvcallsDataRing(mOwner.getDomId(), ref, port, mLoop,
+									mOwner.getConfig().maxPageOrder,
+									[this] { transfer(); }));
+
+	mState = State::CONNECTED;
+
+	mLoop.addFd(mFd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+				[this] (uint32_t events) { onSocketEvent(events); });
+}
+
+void PvcallsSocket::onSocketEvent(uint32_t events)
+{
+	if (mState == State::CONNECTING)
+	{
+		if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+		{
+			return;
+		}
+
+		int error = 0;
+		socklen_t len = sizeof(error);
+
+		if (getsockopt(mFd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+		{
+			error = errno;
+		}
+
+		onConnected(error);
+
+		return;
+	}
+
+	if (mState != State::CONNECTED)
+	{
+		return;
+	}
+
+	if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+	{
+		send();
+	}
+
+	if (events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+	{
+		receive();
+	}
+}
+
+void PvcallsSocket::onListenEvent(uint32_t events)
+{
+	doAccept();
+}
+
+void PvcallsSocket::onConnected(int error)
+{
+	if (error)
+	{
+		// the frontend has to release the socket
+
+		mLoop.removeFd(mFd);
+		mRing.reset();
+
+		mState = State::CREATED;
+
+		respond(mConnectReq, -error);
+
+		return;
+	}
+
+	DLOG(mLog, DEBUG) << "Socket connected, id: " << mId;
+
+	mState = State::CONNECTED;
+
+	respond(mConnectReq, 0);
+
+	// the frontend may have written data before the connect response
+
+	transfer();
+}
+
+void PvcallsSocket::doAccept()
+{
+	if (mAcceptPending)
+	{
+		auto fd = accept4(mFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+		if (fd < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			{
+				// the next connection triggers onListenEvent
+
+				return;
+			}
+
+			mAcceptPending = false;
+
+			respond(mAcceptReq, -errno);
+
+			return;
+		}
+
+		auto& cmd = mAcceptReq.u.accept;
+
+		PvcallsSocketPtr socket(new PvcallsSocket(cmd.id_new, -1, mLoop,
+												  mOwner));
+		int32_t ret = 0;
+
+		try
+		{
+			socket->attach(fd, cmd.ref, cmd.evtchn);
+
+			if (!mOwner.addSocket(socket))
+			{
+				socket->close();
+
+				ret = -EEXIST;
+			}
+		}
+		catch(const exception& e)
+		{
+			LOG(mLog, ERROR) << e.what();
+
+			socket->close();
+
+			ret = -getErrno(e);
+		}
+
+		mAcceptPending = false;
+
+		respond(mAcceptReq, ret);
+
+		if (ret == 0)
+		{
+			DLOG(mLog, DEBUG) << "Socket accepted, id: " << cmd.id_new;
+
+			socket->transfer();
+		}
+
+		// poll is answered only when there is one more connection
+	}
+
+	if (mPollPending)
+	{
+		pollfd pfd = { mFd, POLLIN, 0 };
+
+		if (::poll(&pfd, 1, 0) > 0)
+		{
+			mPollPending = false;
+
+			respond(mPollReq, 0);
+		}
+	}
+}
+
+void PvcallsSocket::transfer()
+{
+	if (mState != State::CONNECTED)
+	{
+		return;
+	}
+
+	send();
+	receive();
+}
+
+void PvcallsSocket::receive()
+{
+	auto intf = mRing->getIntf();
+	auto size = mRing->getSize();
+	bool notify = false;
+
+	while (!mInClosed)
+	{
+		RING_IDX cons = intf->in_cons;
+		RING_IDX prod = intf->in_prod;
+
+		xen_mb();
+
+		auto used = prod - cons;
+
+		if (used > size)
+		{
+			LOG(mLog, ERROR) << "In ring consumer overflow, id: " << mId;
+
+			break;
+		}
+
+		if (used == size)
+		{
+			// the frontend notifies when it consumes data
+
+			break;
+		}
+
+		iovec iov[2];
+		auto count = mRing->getIov(mRing->getIn(), prod, size - used, iov);
+		auto ret = readv(mFd, iov, count);
+
+		if (ret > 0)
+		{
+			xen_wmb();
+
+			intf->in_prod = prod + ret;
+
+			mOwner.addReceivedBytes(ret);
+
+			notify = true;
+
+			continue;
+		}
+
+		if (ret < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			break;
+		}
+
+		xen_wmb();
+
+		intf->in_error = ret == 0 ? -ENOTCONN : -errno;
+
+		mInClosed = true;
+
+		notify = true;
+	}
+
+	if (notify)
+	{
+		mRing->notify();
+	}
+}
+
+void PvcallsSocket::send()
+{
+	auto intf = mRing->getIntf();
+	auto size = mRing->getSize();
+	bool notify = false;
+
+	while (!mOutClosed)
+	{
+		RING_IDX prod = intf->out_prod;
+
+		xen_rmb();
+
+		RING_IDX cons = intf->out_cons;
+		auto pending = prod - cons;
+
+		if (pending > size)
+		{
+			LOG(mLog, ERROR) << "Out ring producer overflow, id: " << mId;
+
+			intf->out_error = -EINVAL;
+
+			mOutClosed = true;
+
+			notify = true;
+
+			break;
+		}
+
+		if (pending == 0)
+		{
+			break;
+		}
+
+		iovec iov[2];
+		msghdr msg {};
+
+		msg.msg_iov = iov;
+		msg.msg_iovlen = mRing->getIov(mRing->getOut(), cons, pending, iov);
+
+		auto ret = sendmsg(mFd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+		if (ret > 0)
+		{
+			xen_mb();
+
+			intf->out_cons = cons + ret;
+
+			mOwner.addSentBytes(ret);
+
+			notify = true;
+
+			continue;
+		}
+
+		if (ret < 0 && errno == EINTR)
+		{
+			continue;
+		}
+
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			// EPOLLOUT calls send() again
+
+			break;
+		}
+
+		xen_wmb();
+
+		intf->out_error = ret < 0 ? -errno : -EIO;
+
+		mOutClosed = true;
+
+		notify = true;
+	}
+
+	if (notify)
+	{
+		mRing->notify();
+	}
+}
+
+void PvcallsSocket::respond(const xen_pvcalls_request& req, int32_t ret)
+{
+	mOwner.respond(req, ret);
+}
+
+/*******************************************************************************
+ * PvcallsCommandRing
+ ******************************************************************************/
+
+PvcallsCommandRing::PvcallsCommandRing(
+		domid_t domId, evtchn_port_t port, grant_ref_t ref,
+		const vector<PvcallsEventLoopPtr>& loops,
+		const PvcallsConfig& config) :
+	RingBufferInBase<xen_pvcalls_back_ring, xen_pvcalls_sring,
+					 xen_pvcalls_request, xen_pvcalls_response>(domId, port,
+																 ref),
+	mDomId(domId),
+	mLoops(loops),
+	mConfig(config),
+	mNextLoop(0),
+	mCommands(0),
+	mErrors(0),
+	mSentBytes(0),
+	mReceivedBytes(0)
+{
+	if (mLoops.empty())
+	{
+		throw PvcallsException("No event loops", EINVAL);
+	}
+}
+
+PvcallsCommandRing::~PvcallsCommandRing()
+{
+	stop();
+
+	// sockets accepted while closing are added to the map, so repeat
+	// till the map is empty. Syncing the loops also waits for the tasks
+	// which refer to this ring.
+
+	vector<PvcallsSocketPtr> sockets;
+
+	do
+	{
+		sockets.clear();
+
+		{
+			lock_guard<mutex> lock(mSocketsMutex);
+
+			for (auto& socket : mSockets)
+			{
+				sockets.push_back(socket.second);
+			}
+
+			mSockets.clear();
+		}
+
+		for (auto& socket : sockets)
+		{
+			socket->getLoop().post([socket] { socket->close(); });
+		}
+
+		for (auto& loop : mLoops)
+		{
+			loop->sync();
+		}
+	}
+	while (!sockets.empty());
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+PvcallsStats PvcallsCommandRing::getStats()
+{
+	PvcallsStats stats {};
+
+	stats.commands = mCommands;
+	stats.errors = mErrors;
+	stats.sentBytes = mSentBytes;
+	stats.receivedBytes = mReceivedBytes;
+
+	lock_guard<mutex> lock(mSocketsMutex);
+
+	stats.sockets = mSockets.size();
+
+	return stats;
+}
+
+void PvcallsCommandRing::respond(const xen_pvcalls_request& req, int32_t ret)
+{
+	xen_pvcalls_response rsp {};
+
+	rsp.req_id = req.req_id;
+	rsp.cmd = req.cmd;
+	rsp.ret = ret;
+	// all commands have the socket id at the same place
+	rsp.u.socket.id = req.u.socket.id;
+
+	if (ret < 0)
+	{
+		mErrors++;
+
+		DLOG(mLog, DEBUG) << "Command " << req.cmd << " failed, id: "
+						  << req.u.socket.id << ", ret: " << ret;
+	}
+
+	lock_guard<mutex> lock(mResponseMutex);
+
+	sendResponse(rsp);
+}
+
+bool PvcallsCommandRing::addSocket(PvcallsSocketPtr socket)
+{
+	lock_guard<mutex> lock(mSocketsMutex);
+
+	return mSockets.emplace(socket->getId(), socket).second;
+}
+
+bool PvcallsCommandRing::hasSocket(uint64_t id)
+{
+	lock_guard<mutex> lock(mSocketsMutex);
+
+	return mSockets.find(id) != mSockets.end();
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void PvcallsCommandRing::processRequest(const xen_pvcalls_request& req)
+{
+	DLOG(mLog, DEBUG) << "Command " << req.cmd << ", id: " << req.u.socket.id;
+
+	mCommands++;
+
+	if (req.cmd == PVCALLS_SOCKET)
+	{
+		createSocket(req);
+
+		return;
+	}
+
+	auto socket = getSocket(req.u.socket.id);
+
+	if (!socket)
+	{
+		respond(req, -EBADF);
+
+		return;
+	}
+
+	switch (req.cmd)
+	{
+	case PVCALLS_CONNECT:
+		socket->getLoop().post([socket, req] { socket->connect(req); });
+		break;
+
+	case PVCALLS_RELEASE:
+		releaseSocket(socket, req);
+		break;
+
+	case PVCALLS_BIND:
+		socket->getLoop().post([socket, req] { socket->bind(req); });
+		break;
+
+	case PVCALLS_LISTEN:
+		socket->getLoop().post([socket, req] { socket->listen(req); });
+		break;
+
+	case PVCALLS_ACCEPT:
+		socket->getLoop().post([socket, req] { socket->accept(req); });
+		break;
+
+	case PVCALLS_POLL:
+		socket->getLoop().post([socket, req] { socket->poll(req); });
+		break;
+
+	default:
+		respond(req, -ENOTSUP);
+		break;
+	}
+}
+
+void PvcallsCommandRing::createSocket(const xen_pvcalls_request& req)
+{
+	auto& cmd = req.u.socket;
+
+	if (cmd.domain != AF_INET && cmd.domain != AF_INET6)
+	{
+		respond(req, -EAFNOSUPPORT);
+
+		return;
+	}
+
+	if (cmd.type != SOCK_STREAM || (cmd.protocol != 0 &&
+									cmd.protocol != IPPROTO_TCP))
+	{
+		respond(req, -EINVAL);
+
+		return;
+	}
+
+	if (hasSocket(cmd.id))
+	{
+		respond(req, -EEXIST);
+
+		return;
+	}
+
+	auto fd = ::socket(cmd.domain, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+					   cmd.protocol);
+
+	if (fd < 0)
+	{
+		respond(req, -errno);
+
+		return;
+	}
+
+	auto& loop = *mLoops[mNextLoop++ % mLoops.size()];
+
+	addSocket(PvcallsSocketPtr(new PvcallsSocket(cmd.id, fd, loop, *this)));
+
+	respond(req, 0);
+}
+
+void PvcallsCommandRing::releaseSocket(PvcallsSocketPtr socket,
+									   const xen_pvcalls_request& req)
+{
+	socket->getLoop().post([this, socket, req] {
+		socket->close();
+
+		{
+			lock_guard<mutex> lock(mSocketsMutex);
+
+			mSockets.erase(socket->getId());
+		}
+
+		respond(req, 0);
+	});
+}
+
+PvcallsSocketPtr PvcallsCommandRing::getSocket(uint64_t id)
+{
+	lock_guard<mutex> lock(mSocketsMutex);
+
+	auto it = mSockets.find(id);
+
+	if (it == mSockets.end())
+	{
+		return nullptr;
+	}
+
+	return it->second;
+}
+
+/*******************************************************************************
+ * PvcallsFrontendHandler
+ ******************************************************************************/
+
+PvcallsFrontendHandler::PvcallsFrontendHandler(
+		const string& devName, domid_t beDomId, domid_t feDomId,
+		uint16_t devId, const vector<PvcallsEventLoopPtr>& loops,
+		const PvcallsConfig& config) :
+	FrontendHandlerBase("PvcallsFrontend", devName, beDomId, feDomId, devId),
+	mLoops(loops),
+	mConfig(config),
+	mLog("PvcallsFrontend")
+{
+	writeFeatures();
+}
+
+PvcallsFrontendHandler::~PvcallsFrontendHandler()
+{
+	stop();
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+PvcallsStats PvcallsFrontendHandler::getStats()
+{
+	lock_guard<mutex> lock(mRingMutex);
+
+	if (!mRing)
+	{
+		return PvcallsStats {};
+	}
+
+	return mRing->getStats();
+}
+
+/*******************************************************************************
+ * Protected
+ ******************************************************************************/
+
+void PvcallsFrontendHandler::onBind()
+{
+	auto& xenStore = getXenStore();
+	auto fePath = getXsFrontendPath();
+
+	auto version = xenStore.readString(fePath + "/version");
+
+	if (version != cProtocolVersion)
+	{
+		throw PvcallsException("Unsupported version: " + version, EINVAL);
+	}
+
+	evtchn_port_t port = xenStore.readUint(fePath + "/port");
+	grant_ref_t ref = xenStore.readUint(fePath + "/ring-ref");
+
+	LOG(mLog, DEBUG) << Utils::logDomId(getDomId(), getDevId())
+					 << "Bind, ref: " << ref << ", port: " << port;
+
+	lock_guard<mutex> lock(mRingMutex);
+
+	mRing.reset(new PvcallsCommandRing(getDomId(), port, ref, mLoops,
+									   mConfig));
+
+	addRingBuffer(mRing);
+}
+
+void PvcallsFrontendHandler::onClosing()
+{
+	lock_guard<mutex> lock(mRingMutex);
+
+	mRing.reset();
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void PvcallsFrontendHandler::writeFeatures()
+{
+	auto& xenStore = getXenStore();
+	auto bePath = getXsBackendPath();
+
+	xenStore.writeString(bePath + "/versions", cProtocolVersion);
+	xenStore.writeUint(bePath + "/max-page-order", mConfig.maxPageOrder);
+	xenStore.writeString(bePath + "/function-calls", "1");
+}
+
+/*******************************************************************************
+ * PvcallsBackend
+ ******************************************************************************/
+
+PvcallsBackend::PvcallsBackend(const string& name, const PvcallsConfig& config,
+							   const string& devName) :
+	BackendBase(name, devName),
+	mConfig(config)
+{
+	for (unsigned int i = 0; i < max(mConfig.numLoops, 1u); i++)
+	{
+		mLoops.emplace_back(new PvcallsEventLoop(mConfig.maxEvents));
+	}
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void PvcallsBackend::onNewFrontend(domid_t domId, uint16_t devId)
+{
+	addFrontendHandler(FrontendHandlerPtr(
+			new PvcallsFrontendHandler(getDeviceName(), getDomId(), domId,
+									   devId, mLoops, mConfig)));
+}
+
+}
@@ -20,9 +20,15 @@
 
 #include "RingBufferBase.hpp"
 
+#include <cstdlib>
+#include <new>
+
 #include "Log.hpp"
 
+using std::bad_alloc;
 using std::bind;
+using std::lock_guard;
+using std::mutex;
 
 namespace XenBackend {
 
@@ -32,16 +38,48 @@ namespace XenBackend {
 
 RingBufferBase::RingBufferBase(domid_t domId, evtchn_port_t port,
 							   grant_ref_t ref) :
-	mEventChannel(domId, port, [this] { onReceiveIndication(); }),
+	mEventChannel(domId, port, [this] { onIndication(); }),
 	mBuffer(domId, ref, PROT_READ | PROT_WRITE),
 	mLog("RingBuffer"),
+	mMaxBatch(0),
+	mPollError(false),
+	mRequests(0),
+	mPasses(0),
+	mOccupancy(0),
 	mPort(port),
-	mRef(ref)
+	mRef(ref),
+	mErrors(0),
+	mEpisodes(0),
+	mLastError(0)
 {
+	initErrorEpisodes();
+
 	LOG(mLog, DEBUG) << "Create ring buffer, port: " << mPort
 					 << ", ref: " << mRef;
 }
 
+RingBufferBase::RingBufferBase(domid_t domId, evtchn_port_t port,
+							   const GrantRefs& refs) :
+	mEventChannel(domId, port, [this] { onIndication(); }),
+	mBuffer(domId, refs.data(), refs.size(), PROT_READ | PROT_WRITE),
+	mLog("RingBuffer"),
+	mMaxBatch(0),
+	mPollError(false),
+	mRequests(0),
+	mPasses(0),
+	mOccupancy(0),
+	mPort(port),
+	mRef(refs.front()),
+	mErrors(0),
+	mEpisodes(0),
+	mLastError(0)
+{
+	initErrorEpisodes();
+
+	LOG(mLog, DEBUG) << "Create ring buffer, port: " << mPort
+					 << ", ref: " << mRef << ", pages: " << refs.size();
+}
+
 RingBufferBase::~RingBufferBase()
 {
 	stop();
@@ -54,6 +92,23 @@ RingBufferBase::~RingBufferBase()
  * Public
  ******************************************************************************/
 
+void* RingBufferBase::operator new(size_t size)
+{
+	void* ptr = nullptr;
+
+	if (posix_memalign(&ptr, Utils::cCacheLineSize, size) != 0)
+	{
+		throw bad_alloc();
+	}
+
+	return ptr;
+}
+
+void RingBufferBase::operator delete(void* ptr) noexcept
+{
+	free(ptr);
+}
+
 void RingBufferBase::start()
 {
 	mEventChannel.start();
@@ -62,11 +117,227 @@ void RingBufferBase::start()
 void RingBufferBase::stop()
 {
 	mEventChannel.stop();
+
+	onStop();
 }
 
 void RingBufferBase::setErrorCallback(ErrorCallback errorCallback)
 {
+	mErrorCallback = errorCallback;
+
 	mEventChannel.setErrorCallback(errorCallback);
 }
 
+RingLoadStats RingBufferBase::getLoadStats() const
+{
+	RingLoadStats stats;
+
+	stats.requests = mRequests;
+	stats.passes = mPasses;
+	stats.occupancy = mOccupancy;
+
+	return stats;
+}
+
+RingErrorStats RingBufferBase::getErrorStats() const
+{
+	RingErrorStats stats;
+
+	stats.errors = mErrors;
+	stats.episodes = mEpisodes;
+	stats.lastError = mLastError;
+
+	return stats;
+}
+
+void RingBufferBase::setWakeCallback(WakeCallback wakeCallback)
+{
+	lock_guard<mutex> lock(mWakeMutex);
+
+	mWakeCallback = wakeCallback;
+}
+
+bool RingBufferBase::poll()
+{
+	if (mPollError)
+	{
+		return false;
+	}
+
+	try
+	{
+		return onPoll();
+	}
+	catch(const std::exception& e)
+	{
+		onPollError(e);
+	}
+
+	return false;
+}
+
+bool RingBufferBase::prepareSleep()
+{
+	if (mPollError)
+	{
+		return false;
+	}
+
+	try
+	{
+		return onPrepareSleep();
+	}
+	catch(const std::exception& e)
+	{
+		onPollError(e);
+	}
+
+	return false;
+}
+
+/*******************************************************************************
+ * Protected
+ ******************************************************************************/
+
+void RingBufferBase::onError(const std::exception& e)
+{
+	if (mErrorCallback)
+	{
+		mErrorCallback(e);
+	}
+	else
+	{
+		LOG(mLog, ERROR) << e.what();
+	}
+}
+
+void RingBufferBase::reportError(ErrorSource source, int errCode,
+								 const char* msg) noexcept
+{
+	if (!accountError(source, errCode))
+	{
+		return;
+	}
+
+	try
+	{
+		onError(RingBufferException(msg, errCode));
+	}
+	catch(...)
+	{
+	}
+}
+
+void RingBufferBase::reportError(ErrorSource source,
+								 const std::exception& e) noexcept
+{
+	auto xenException = dynamic_cast<const Exception*>(&e);
+
+	if (!accountError(source, xenException ? xenException->getErrno() : EIO))
+	{
+		return;
+	}
+
+	try
+	{
+		onError(e);
+	}
+	catch(...)
+	{
+	}
+}
+
+int RingBufferBase::notify() noexcept
+{
+	auto ret = mEventChannel.tryNotify();
+
+	if (ret)
+	{
+		reportError(ErrorSource::NOTIFY, ret, "Can't notify event channel");
+	}
+	else
+	{
+		clearError(ErrorSource::NOTIFY);
+	}
+
+	return ret;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void RingBufferBase::onIndication()
+{
+	{
+		lock_guard<mutex> lock(mWakeMutex);
+
+		if (mWakeCallback)
+		{
+			mWakeCallback();
+
+			return;
+		}
+	}
+
+	onReceiveIndication();
+}
+
+void RingBufferBase::onPollError(const std::exception& e)
+{
+	mPollError = true;
+
+	onError(e);
+}
+
+void RingBufferBase::initErrorEpisodes()
+{
+	for (int i = 0; i < cNumErrorSources; i++)
+	{
+		mErrorEpisodes[i] = false;
+		mSuppressed[i] = 0;
+	}
+}
+
+bool RingBufferBase::accountError(ErrorSource source, int errCode) noexcept
+{
+	auto index = static_cast<int>(source);
+
+	mErrors++;
+	mLastError = errCode;
+
+	// only the first error of the episode is reported, exchange makes it
+	// reported once if several threads fail at the same time
+	if (mErrorEpisodes[index].exchange(true))
+	{
+		mSuppressed[index]++;
+
+		return false;
+	}
+
+	mEpisodes++;
+
+	return true;
+}
+
+void RingBufferBase::endErrorEpisode(ErrorSource source) noexcept
+{
+	auto index = static_cast<int>(source);
+
+	if (!mErrorEpisodes[index].exchange(false))
+	{
+		return;
+	}
+
+	try
+	{
+		LOG(mLog, INFO) << "Ring buffer recovered, port: " << mPort
+						<< ", suppressed errors: "
+						<< mSuppressed[index].exchange(0);
+	}
+	catch(...)
+	{
+	}
+}
+
 }
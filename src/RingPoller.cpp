@@ -0,0 +1,285 @@
+/*
+ *  Ring buffer poller
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include "RingPoller.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "Utils.hpp"
+
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+using std::find;
+using std::lock_guard;
+using std::mutex;
+using std::thread;
+using std::unique_lock;
+using std::vector;
+
+namespace XenBackend {
+
+/*******************************************************************************
+ * RingPoller
+ ******************************************************************************/
+
+RingPoller::RingPoller(int cpu, microseconds idleTimeout) :
+	mCpu(cpu),
+	mIdleTimeoutUs(idleTimeout.count()),
+	mTerminate(false),
+	mWakeup(false),
+	mPolls(0),
+	mBusyPolls(0),
+	mSleeps(0),
+	mBusyTimeNs(0),
+	mLog("RingPoller")
+{
+	LOG(mLog, DEBUG) << "Create poller, cpu: " << mCpu;
+}
+
+RingPoller::~RingPoller()
+{
+	stop();
+
+	lock_guard<mutex> lock(mMutex);
+
+	for (auto ring : mRings)
+	{
+		ring->setWakeCallback(nullptr);
+	}
+
+	LOG(mLog, DEBUG) << "Delete poller, cpu: " << mCpu;
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+void RingPoller::start()
+{
+	if (mThread.joinable())
+	{
+		return;
+	}
+
+	mTerminate = false;
+	mStartTime = steady_clock::now();
+
+	mThread = thread(&RingPoller::run, this);
+
+	if (mCpu >= 0)
+	{
+		auto ret = Utils::setThreadCpu(mThread, mCpu);
+
+		if (ret != 0)
+		{
+			LOG(mLog, WARNING) << "Can't bind poller to cpu: " << mCpu
+							   << ", " << strerror(ret);
+		}
+	}
+}
+
+void RingPoller::stop()
+{
+	if (!mThread.joinable())
+	{
+		return;
+	}
+
+	mTerminate = true;
+
+	wake();
+
+	mThread.join();
+}
+
+void RingPoller::addRing(RingBufferPtr ringBuffer)
+{
+	if (!ringBuffer->isPollable())
+	{
+		throw RingBufferException("Ring buffer can't be polled", EINVAL);
+	}
+
+	ringBuffer->setWakeCallback([this] { wake(); });
+
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		mRings.push_back(ringBuffer);
+	}
+
+	LOG(mLog, DEBUG) << "Add ring buffer, port: " << ringBuffer->getPort()
+					 << ", cpu: " << mCpu;
+
+	wake();
+}
+
+void RingPoller::removeRing(RingBufferPtr ringBuffer)
+{
+	// the ring buffers are polled with the mutex locked
+	lock_guard<mutex> lock(mMutex);
+
+	auto it = find(mRings.begin(), mRings.end(), ringBuffer);
+
+	if (it != mRings.end())
+	{
+		mRings.erase(it);
+
+		// waits till a running wake() returns, wake() doesn't lock mMutex
+		ringBuffer->setWakeCallback(nullptr);
+
+		LOG(mLog, DEBUG) << "Remove ring buffer, port: "
+						 << ringBuffer->getPort() << ", cpu: " << mCpu;
+	}
+}
+
+size_t RingPoller::getNumRings() const
+{
+	lock_guard<mutex> lock(mMutex);
+
+	return mRings.size();
+}
+
+vector<RingBufferPtr> RingPoller::getRings() const
+{
+	lock_guard<mutex> lock(mMutex);
+
+	return mRings;
+}
+
+RingPollerStats RingPoller::getStats() const
+{
+	RingPollerStats stats;
+
+	stats.cpu = mCpu;
+	stats.numRings = getNumRings();
+	stats.polls = mPolls;
+	stats.busyPolls = mBusyPolls;
+	stats.sleeps = mSleeps;
+	stats.busyTime = duration_cast<microseconds>(nanoseconds(mBusyTimeNs));
+
+	if (mStartTime != TimePoint())
+	{
+		stats.runTime = duration_cast<microseconds>(steady_clock::now() -
+													mStartTime);
+	}
+	else
+	{
+		stats.runTime = microseconds::zero();
+	}
+
+	stats.utilization = stats.runTime.count() ?
+		static_cast<double>(stats.busyTime.count()) / stats.runTime.count() :
+		0.0;
+
+	return stats;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void RingPoller::wake()
+{
+	lock_guard<mutex> lock(mWakeMutex);
+
+	mWakeup = true;
+
+	mCondVar.notify_one();
+}
+
+bool RingPoller::pollRings()
+{
+	lock_guard<mutex> lock(mMutex);
+
+	bool busy = false;
+
+	for (auto& ring : mRings)
+	{
+		busy |= ring->poll();
+	}
+
+	return busy;
+}
+
+bool RingPoller::prepareSleep()
+{
+	lock_guard<mutex> lock(mMutex);
+
+	bool pending = false;
+
+	for (auto& ring : mRings)
+	{
+		pending |= ring->prepareSleep();
+	}
+
+	return pending;
+}
+
+void RingPoller::sleep()
+{
+	unique_lock<mutex> lock(mWakeMutex);
+
+	mSleeps++;
+
+	// a notification received after prepareSleep() leaves mWakeup set
+	mCondVar.wait(lock, [this] { return mWakeup || mTerminate; });
+
+	mWakeup = false;
+}
+
+void RingPoller::run()
+{
+	auto lastBusyTime = steady_clock::now();
+
+	while (!mTerminate)
+	{
+		auto startTime = steady_clock::now();
+
+		mPolls++;
+
+		if (pollRings())
+		{
+			lastBusyTime = steady_clock::now();
+
+			mBusyPolls++;
+			mBusyTimeNs += duration_cast<nanoseconds>(lastBusyTime -
+													  startTime).count();
+
+			continue;
+		}
+
+		if (startTime - lastBusyTime < getIdleTimeout())
+		{
+			continue;
+		}
+
+		if (!prepareSleep())
+		{
+			sleep();
+		}
+
+		lastBusyTime = steady_clock::now();
+	}
+}
+
+}
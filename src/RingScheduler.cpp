@@ -0,0 +1,426 @@
+/*
+ *  Ring buffer scheduler
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include "RingScheduler.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "Utils.hpp"
+
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::nanoseconds;
+using std::chrono::steady_clock;
+using std::lock_guard;
+using std::max;
+using std::mutex;
+using std::string;
+using std::thread;
+using std::unique_lock;
+using std::vector;
+
+namespace XenBackend {
+
+/*******************************************************************************
+ * RingScheduler
+ ******************************************************************************/
+
+RingScheduler::RingScheduler(size_t numWorkers, const vector<int>& cpus) :
+	mNumWorkers(max<size_t>(numWorkers, 1)),
+	mCpus(cpus),
+	mTerminate(false),
+	mSeq(0),
+	mDispatches(0),
+	mLog("RingScheduler")
+{
+	LOG(mLog, DEBUG) << "Create scheduler, workers: " << mNumWorkers;
+}
+
+RingScheduler::~RingScheduler()
+{
+	stop();
+
+	vector<RingBufferPtr> rings;
+
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		for (auto& entry : mEntries)
+		{
+			entry.second->removed = true;
+
+			rings.push_back(entry.second->ring);
+		}
+	}
+
+	// setWakeCallback() waits for a running wake() which locks the mutex
+	for (auto& ring : rings)
+	{
+		ring->setWakeCallback(nullptr);
+	}
+
+	LOG(mLog, DEBUG) << "Delete scheduler";
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+void RingScheduler::start()
+{
+	if (!mThreads.empty())
+	{
+		return;
+	}
+
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		mTerminate = false;
+	}
+
+	for (size_t i = 0; i < mNumWorkers; i++)
+	{
+		mThreads.push_back(thread(&RingScheduler::run, this));
+
+		if (mCpus.empty())
+		{
+			continue;
+		}
+
+		auto cpu = mCpus[i % mCpus.size()];
+		auto ret = Utils::setThreadCpu(mThreads.back(), cpu);
+
+		if (ret != 0)
+		{
+			LOG(mLog, WARNING) << "Can't bind worker to cpu: " << cpu
+							   << ", " << strerror(ret);
+		}
+	}
+}
+
+void RingScheduler::stop()
+{
+	if (mThreads.empty())
+	{
+		return;
+	}
+
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		mTerminate = true;
+	}
+
+	mCondVar.notify_all();
+
+	for (auto& thread : mThreads)
+	{
+		thread.join();
+	}
+
+	mThreads.clear();
+}
+
+int RingScheduler::addClass(const string& name, microseconds deadline)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	Class latencyClass {};
+
+	latencyClass.name = name;
+	latencyClass.deadline = deadline;
+
+	mClasses.push_back(latencyClass);
+
+	LOG(mLog, DEBUG) << "Add class: " << name << ", deadline: "
+					 << deadline.count() << " us";
+
+	return mClasses.size() - 1;
+}
+
+void RingScheduler::setDeadline(int latencyClass, microseconds deadline)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	if (latencyClass < 0 ||
+		static_cast<size_t>(latencyClass) >= mClasses.size())
+	{
+		throw RingBufferException("Invalid latency class", EINVAL);
+	}
+
+	mClasses[latencyClass].deadline = deadline;
+}
+
+size_t RingScheduler::getNumClasses() const
+{
+	lock_guard<mutex> lock(mMutex);
+
+	return mClasses.size();
+}
+
+void RingScheduler::addRing(RingBufferPtr ringBuffer, int latencyClass)
+{
+	if (!ringBuffer->isPollable())
+	{
+		throw RingBufferException("Ring buffer can't be polled", EINVAL);
+	}
+
+	EntryPtr entry(new Entry {ringBuffer, latencyClass, State::IDLE,
+							  false, false, TimePoint(), TimePoint()});
+
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		if (latencyClass < 0 ||
+			static_cast<size_t>(latencyClass) >= mClasses.size())
+		{
+			throw RingBufferException("Invalid latency class", EINVAL);
+		}
+
+		mEntries[ringBuffer.get()] = entry;
+		mClasses[latencyClass].numRings++;
+	}
+
+	ringBuffer->setWakeCallback([this, entry] { wake(entry); });
+
+	LOG(mLog, DEBUG) << "Add ring buffer, port: " << ringBuffer->getPort()
+					 << ", class: " << latencyClass;
+
+	// requests written before the ring is added don't fire the event
+	wake(entry);
+}
+
+void RingScheduler::removeRing(RingBufferPtr ringBuffer)
+{
+	{
+		unique_lock<mutex> lock(mMutex);
+
+		auto it = mEntries.find(ringBuffer.get());
+
+		if (it == mEntries.end())
+		{
+			return;
+		}
+
+		auto entry = it->second;
+
+		entry->removed = true;
+
+		mEntries.erase(it);
+		mClasses[entry->latencyClass].numRings--;
+
+		if (entry->state == State::QUEUED)
+		{
+			dequeue(entry);
+		}
+
+		mIdleCondVar.wait(lock, [&entry]
+						  { return entry->state != State::RUNNING; });
+	}
+
+	// setWakeCallback() waits for a running wake() which locks the mutex,
+	// so it is reset outside of it. When it returns, wake() is not called
+	// any more.
+	ringBuffer->setWakeCallback(nullptr);
+
+	LOG(mLog, DEBUG) << "Remove ring buffer, port: " << ringBuffer->getPort();
+}
+
+size_t RingScheduler::getNumRings() const
+{
+	lock_guard<mutex> lock(mMutex);
+
+	return mEntries.size();
+}
+
+RingSchedulerStats RingScheduler::getStats() const
+{
+	lock_guard<mutex> lock(mMutex);
+
+	RingSchedulerStats stats {};
+
+	stats.numWorkers = mNumWorkers;
+	stats.numRings = mEntries.size();
+	stats.dispatches = mDispatches;
+
+	for (auto& entry : mEntries)
+	{
+		if (entry.second->state == State::QUEUED)
+		{
+			stats.pending++;
+		}
+	}
+
+	for (auto& latencyClass : mClasses)
+	{
+		LatencyClassStats classStats;
+
+		classStats.name = latencyClass.name;
+		classStats.deadline = latencyClass.deadline;
+		classStats.numRings = latencyClass.numRings;
+		classStats.passes = latencyClass.passes;
+		classStats.misses = latencyClass.misses;
+		classStats.avgWait = latencyClass.passes ?
+			duration_cast<microseconds>(latencyClass.waitTime /
+										latencyClass.passes) :
+			microseconds::zero();
+		classStats.maxLateness =
+			duration_cast<microseconds>(latencyClass.maxLateness);
+
+		stats.classes.push_back(classStats);
+	}
+
+	return stats;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void RingScheduler::wake(EntryPtr entry)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	if (entry->removed)
+	{
+		return;
+	}
+
+	if (entry->state == State::RUNNING)
+	{
+		// the worker queues the ring again when the pass is over
+		entry->rearm = true;
+
+		return;
+	}
+
+	if (entry->state == State::IDLE)
+	{
+		queue(entry, steady_clock::now());
+	}
+}
+
+void RingScheduler::queue(EntryPtr entry, TimePoint now)
+{
+	entry->state = State::QUEUED;
+	entry->release = now;
+	entry->deadline = now + mClasses[entry->latencyClass].deadline;
+
+	mQueue.push(Job {entry->deadline, mSeq++, entry});
+
+	mCondVar.notify_one();
+}
+
+void RingScheduler::dequeue(EntryPtr entry)
+{
+	// the queue can't remove an element in the middle, it is rebuilt
+	// without the jobs of the entry
+	std::priority_queue<Job> queue;
+
+	while (!mQueue.empty())
+	{
+		if (mQueue.top().entry != entry)
+		{
+			queue.push(mQueue.top());
+		}
+
+		mQueue.pop();
+	}
+
+	mQueue.swap(queue);
+}
+
+void RingScheduler::account(Entry& entry, TimePoint start, TimePoint end)
+{
+	auto& latencyClass = mClasses[entry.latencyClass];
+
+	latencyClass.passes++;
+	latencyClass.waitTime += duration_cast<nanoseconds>(start - entry.release);
+
+	if (end > entry.deadline)
+	{
+		latencyClass.misses++;
+		latencyClass.maxLateness = max(latencyClass.maxLateness,
+			duration_cast<nanoseconds>(end - entry.deadline));
+	}
+}
+
+void RingScheduler::run()
+{
+	unique_lock<mutex> lock(mMutex);
+
+	while (!mTerminate)
+	{
+		if (mQueue.empty())
+		{
+			mCondVar.wait(lock);
+
+			continue;
+		}
+
+		auto entry = mQueue.top().entry;
+
+		mQueue.pop();
+
+		if (entry->removed)
+		{
+			continue;
+		}
+
+		entry->state = State::RUNNING;
+		entry->rearm = false;
+
+		mDispatches++;
+
+		lock.unlock();
+
+		auto start = steady_clock::now();
+
+		bool busy = entry->ring->poll();
+
+		// the notifications are re-enabled only when the ring is drained,
+		// prepareSleep() returns true if requests arrived meanwhile
+		bool pending = busy || entry->ring->prepareSleep();
+
+		auto end = steady_clock::now();
+
+		lock.lock();
+
+		if (busy)
+		{
+			account(*entry, start, end);
+		}
+
+		entry->state = State::IDLE;
+
+		if (entry->removed)
+		{
+			mIdleCondVar.notify_all();
+		}
+		else if (pending || entry->rearm)
+		{
+			queue(entry, end);
+		}
+	}
+}
+
+}
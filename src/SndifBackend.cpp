@@ -0,0 +1,1221 @@
+/*
+ *  Xen sound device backend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include "SndifBackend.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "XenStore.hpp"
+
+using std::all_of;
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::nanoseconds;
+using std::fill;
+using std::lock_guard;
+using std::min;
+using std::mutex;
+using std::string;
+using std::thread;
+using std::to_string;
+
+namespace XenBackend {
+
+/*******************************************************************************
+ * SndifMixer
+ ******************************************************************************/
+
+namespace {
+
+typedef float FloatVec __attribute__((vector_size(16)));
+typedef int32_t Int32Vec __attribute__((vector_size(16)));
+typedef int16_t Int16Vec __attribute__((vector_size(8)));
+typedef uint8_t Uint8Vec __attribute__((vector_size(4)));
+
+const size_t cVecLen = sizeof(FloatVec) / sizeof(float);
+
+/*
+ * Integer formats are scaled by 2^(bits - 1). The upper clip value is the
+ * largest float which is converted to the max integer without overflow.
+ */
+const float cU8Scale = 128.0f;
+const float cU8Max = 127.0f / 128.0f;
+const float cS16Scale = 32768.0f;
+const float cS16Max = 32767.0f / 32768.0f;
+const float cS32Scale = 2147483648.0f;
+const float cS32Max = 0.99999994f;
+
+inline FloatVec loadVec(const float* src)
+{
+	FloatVec v;
+
+	memcpy(&v, src, sizeof(v));
+
+	return v;
+}
+
+inline void storeVec(float* dst, FloatVec v)
+{
+	memcpy(dst, &v, sizeof(v));
+}
+
+inline FloatVec clipVec(FloatVec v, float max)
+{
+	FloatVec lo = {-1.0f, -1.0f, -1.0f, -1.0f};
+	FloatVec hi = {max, max, max, max};
+
+	v = v < lo ? lo : v;
+
+	return v > hi ? hi : v;
+}
+
+inline float clip(float v, float max)
+{
+	return v < -1.0f ? -1.0f : (v > max ? max : v);
+}
+
+}
+
+uint64_t SndifMixer::getFormats()
+{
+	return (1ULL << XENSND_PCM_FORMAT_U8) |
+		   (1ULL << XENSND_PCM_FORMAT_S16_LE) |
+		   (1ULL << XENSND_PCM_FORMAT_S32_LE) |
+		   (1ULL << XENSND_PCM_FORMAT_F32_LE);
+}
+
+size_t SndifMixer::getSampleSize(uint8_t format)
+{
+	switch(format)
+	{
+	case XENSND_PCM_FORMAT_U8:
+		return sizeof(uint8_t);
+
+	case XENSND_PCM_FORMAT_S16_LE:
+		return sizeof(int16_t);
+
+	case XENSND_PCM_FORMAT_S32_LE:
+		return sizeof(int32_t);
+
+	case XENSND_PCM_FORMAT_F32_LE:
+		return sizeof(float);
+
+	default:
+		return 0;
+	}
+}
+
+void SndifMixer::toFloat(uint8_t format, const void* src, float* dst,
+						 size_t samples)
+{
+	size_t i = 0;
+	auto bulk = samples - samples % cVecLen;
+
+	switch(format)
+	{
+	case XENSND_PCM_FORMAT_U8:
+	{
+		auto s = static_cast<const uint8_t*>(src);
+
+		for (; i < bulk; i += cVecLen)
+		{
+			Uint8Vec in;
+
+			memcpy(&in, &s[i], sizeof(in));
+
+			storeVec(&dst[i], (__builtin_convertvector(in, FloatVec) -
+							   cU8Scale) / cU8Scale);
+		}
+
+		for (; i < samples; i++)
+		{
+			dst[i] = (s[i] - cU8Scale) / cU8Scale;
+		}
+
+		break;
+	}
+
+	case XENSND_PCM_FORMAT_S16_LE:
+	{
+		auto s = static_cast<const int16_t*>(src);
+
+		for (; i < bulk; i += cVecLen)
+		{
+			Int16Vec in;
+
+			memcpy(&in, &s[i], sizeof(in));
+
+			storeVec(&dst[i], __builtin_convertvector(in, FloatVec) /
+							  cS16Scale);
+		}
+
+		for (; i < samples; i++)
+		{
+			dst[i] = s[i] / cS16Scale;
+		}
+
+		break;
+	}
+
+	case XENSND_PCM_FORMAT_S32_LE:
+	{
+		auto s = static_cast<const int32_t*>(src);
+
+		for (; i < bulk; i += cVecLen)
+		{
+			Int32Vec in;
+
+			memcpy(&in, &s[i], sizeof(in));
+
+			storeVec(&dst[i], __builtin_convertvector(in, FloatVec) /
+							  cS32Scale);
+		}
+
+		for (; i < samples; i++)
+		{
+			dst[i] = s[i] / cS32Scale;
+		}
+
+		break;
+	}
+
+	case XENSND_PCM_FORMAT_F32_LE:
+
+		memcpy(dst, src, samples * sizeof(float));
+
+		break;
+
+	default:
+		throw SndifException("Unsupported format: " + to_string(format),
+							 EINVAL);
+	}
+}
+
+void SndifMixer::fromFloat(uint8_t format, const float* src, void* dst,
+						   size_t samples)
+{
+	size_t i = 0;
+	auto bulk = samples - samples % cVecLen;
+
+	switch(format)
+	{
+	case XENSND_PCM_FORMAT_U8:
+	{
+		auto d = static_cast<uint8_t*>(dst);
+
+		for (; i < bulk; i += cVecLen)
+		{
+			auto v = clipVec(loadVec(&src[i]), cU8Max) * cU8Scale + cU8Scale;
+			auto out = __builtin_convertvector(v, Uint8Vec);
+
+			memcpy(&d[i], &out, sizeof(out));
+		}
+
+		for (; i < samples; i++)
+		{
+			d[i] = clip(src[i], cU8Max) * cU8Scale + cU8Scale;
+		}
+
+		break;
+	}
+
+	case XENSND_PCM_FORMAT_S16_LE:
+	{
+		auto d = static_cast<int16_t*>(dst);
+
+		for (; i < bulk; i += cVecLen)
+		{
+			auto v = clipVec(loadVec(&src[i]), cS16Max) * cS16Scale;
+			auto out = __builtin_convertvector(v, Int16Vec);
+
+			memcpy(&d[i], &out, sizeof(out));
+		}
+
+		for (; i < samples; i++)
+		{
+			d[i] = clip(src[i], cS16Max) * cS16Scale;
+		}
+
+		break;
+	}
+
+	case XENSND_PCM_FORMAT_S32_LE:
+	{
+		auto d = static_cast<int32_t*>(dst);
+
+		for (; i < bulk; i += cVecLen)
+		{
+			auto v = clipVec(loadVec(&src[i]), cS32Max) * cS32Scale;
+			auto out = __builtin_convertvector(v, Int32Vec);
+
+			memcpy(&d[i], &out, sizeof(out));
+		}
+
+		for (; i < samples; i++)
+		{
+			d[i] = clip(src[i], cS32Max) * cS32Scale;
+		}
+
+		break;
+	}
+
+	case XENSND_PCM_FORMAT_F32_LE:
+	{
+		auto d = static_cast<float*>(dst);
+
+		for (; i < bulk; i += cVecLen)
+		{
+			storeVec(&d[i], clipVec(loadVec(&src[i]), 1.0f));
+		}
+
+		for (; i < samples; i++)
+		{
+			d[i] = clip(src[i], 1.0f);
+		}
+
+		break;
+	}
+
+	default:
+		throw SndifException("Unsupported format: " + to_string(format),
+							 EINVAL);
+	}
+}
+
+void SndifMixer::mix(float* acc, const float* src, size_t samples)
+{
+	size_t i = 0;
+	auto bulk = samples - samples % cVecLen;
+
+	for (; i < bulk; i += cVecLen)
+	{
+		storeVec(&acc[i], loadVec(&acc[i]) + loadVec(&src[i]));
+	}
+
+	for (; i < samples; i++)
+	{
+		acc[i] += src[i];
+	}
+}
+
+/*******************************************************************************
+ * SndifPeriodClock
+ ******************************************************************************/
+
+SndifPeriodClock::SndifPeriodClock(Callback callback, bool realtime) :
+	mCallback(callback),
+	mRealtime(realtime),
+	mFd(-1),
+	mPeriod(0),
+	mDeadline(0),
+	mPeriods(0),
+	mMissedPeriods(0),
+	mMaxLatenessUs(0),
+	mLog("SndifClock")
+{
+	mFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	if (mFd < 0)
+	{
+		throw SndifException("Can't create timer", errno);
+	}
+}
+
+SndifPeriodClock::~SndifPeriodClock()
+{
+	stop();
+
+	close(mFd);
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+void SndifPeriodClock::start(nanoseconds period)
+{
+	stop();
+
+	if (period.count() <= 0)
+	{
+		throw SndifException("Invalid clock period", EINVAL);
+	}
+
+	mPeriod = period;
+
+	timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	mDeadline = now.tv_sec * 1000000000ULL + now.tv_nsec + period.count();
+
+	itimerspec spec {};
+
+	spec.it_value.tv_sec = mDeadline / 1000000000ULL;
+	spec.it_value.tv_nsec = mDeadline % 1000000000ULL;
+	spec.it_interval.tv_sec = period.count() / 1000000000LL;
+	spec.it_interval.tv_nsec = period.count() % 1000000000LL;
+
+	if (timerfd_settime(mFd, TFD_TIMER_ABSTIME, &spec, nullptr) < 0)
+	{
+		throw SndifException("Can't start timer", errno);
+	}
+
+	mPollFd.reset(new PollFd(mFd, POLLIN));
+
+	mThread = thread(&SndifPeriodClock::run, this);
+
+	LOG(mLog, DEBUG) << "Start, period: "
+					 << duration_cast<microseconds>(period).count() << " us";
+}
+
+void SndifPeriodClock::stop()
+{
+	if (mPollFd)
+	{
+		mPollFd->stop();
+	}
+
+	if (mThread.joinable())
+	{
+		mThread.join();
+	}
+
+	mPollFd.reset();
+
+	itimerspec spec {};
+
+	timerfd_settime(mFd, 0, &spec, nullptr);
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void SndifPeriodClock::run()
+{
+	if (mRealtime)
+	{
+		setRealtime();
+	}
+
+	try
+	{
+		while(mPollFd->poll())
+		{
+			uint64_t expirations = 0;
+
+			if (read(mFd, &expirations, sizeof(expirations)) < 0)
+			{
+				if (errno == EAGAIN)
+				{
+					continue;
+				}
+
+				throw SndifException("Can't read timer", errno);
+			}
+
+			timespec now;
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+
+			uint64_t nowNs = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+			// lateness of the first expired deadline
+			if (nowNs > mDeadline)
+			{
+				uint64_t lateness = (nowNs - mDeadline) / 1000;
+
+				if (lateness > mMaxLatenessUs)
+				{
+					mMaxLatenessUs = lateness;
+				}
+			}
+
+			mDeadline += expirations * mPeriod.count();
+
+			if (expirations > 1)
+			{
+				mMissedPeriods += expirations - 1;
+			}
+
+			for (uint64_t i = 0; i < expirations; i++)
+			{
+				mCallback();
+
+				mPeriods++;
+			}
+		}
+	}
+	catch(const std::exception& e)
+	{
+		LOG(mLog, ERROR) << e.what();
+	}
+}
+
+void SndifPeriodClock::setRealtime()
+{
+	sched_param param {};
+
+	param.sched_priority = sched_get_priority_min(SCHED_FIFO) + 1;
+
+	auto ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+
+	if (ret)
+	{
+		LOG(mLog, WARNING) << "Can't set realtime priority: "
+						   << strerror(ret);
+	}
+}
+
+/*******************************************************************************
+ * SndifFileSink
+ ******************************************************************************/
+
+SndifFileSink::SndifFileSink(const string& path) :
+	mFd(-1),
+	mPath(path),
+	mLog("SndifFileSink")
+{
+	mFd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+	if (mFd < 0)
+	{
+		throw SndifException("Can't open sink: " + path, errno);
+	}
+
+	LOG(mLog, DEBUG) << "Open sink: " << path;
+}
+
+SndifFileSink::~SndifFileSink()
+{
+	close(mFd);
+}
+
+void SndifFileSink::write(const void* data, size_t size)
+{
+	auto buffer = static_cast<const uint8_t*>(data);
+
+	while (size)
+	{
+		auto ret = ::write(mFd, buffer, size);
+
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			// dropping the period keeps the clock running
+
+			LOG(mLog, ERROR) << "Can't write sink: " << mPath << ", "
+							 << strerror(errno);
+
+			return;
+		}
+
+		buffer += ret;
+		size -= ret;
+	}
+}
+
+/*******************************************************************************
+ * SndifStream
+ ******************************************************************************/
+
+const size_t SndifStream::cGrefsPerDirPage;
+
+SndifStream::SndifStream(domid_t domId, bool playback,
+						 const SndifConfig& config) :
+	mDomId(domId),
+	mPlayback(playback),
+	mConfig(config),
+	mBufferSize(0),
+	mPeriodSize(0),
+	mFormat(0),
+	mChannels(0),
+	mFrameSize(0),
+	mRunning(false),
+	mWritten(0),
+	mPosition(0),
+	mEventPosition(0),
+	mQueuedEvents(0),
+	mEventId(0),
+	mUnderruns(0),
+	mLog("SndifStream")
+{
+	LOG(mLog, DEBUG) << "Create stream, "
+					 << (mPlayback ? "playback" : "capture");
+}
+
+SndifStream::~SndifStream()
+{
+	LOG(mLog, DEBUG) << "Delete stream, "
+					 << (mPlayback ? "playback" : "capture");
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+void SndifStream::setEventRing(SndifEventRingBufferPtr eventRing)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	mEventRing = eventRing;
+}
+
+void SndifStream::processRequest(const xensnd_req& req, xensnd_resp& rsp)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	rsp.id = req.id;
+	rsp.operation = req.operation;
+	rsp.status = 0;
+
+	try
+	{
+		switch(req.operation)
+		{
+		case XENSND_OP_OPEN:
+			rsp.status = open(req.op.open);
+			break;
+
+		case XENSND_OP_CLOSE:
+			close();
+			break;
+
+		case XENSND_OP_WRITE:
+			rsp.status = write(req.op.rw);
+			break;
+
+		case XENSND_OP_READ:
+			rsp.status = read(req.op.rw);
+			break;
+
+		case XENSND_OP_TRIGGER:
+			rsp.status = trigger(req.op.trigger);
+			break;
+
+		case XENSND_OP_HW_PARAM_QUERY:
+			queryHwParam(req.op.hw_param, rsp.resp.hw_param);
+			break;
+
+		default:
+			rsp.status = -ENOTSUP;
+			break;
+		}
+	}
+	catch(const Exception& e)
+	{
+		LOG(mLog, ERROR) << e.what();
+
+		rsp.status = -e.getErrno();
+	}
+
+	LOG(mLog, DEBUG) << "Request, operation: "
+					 << static_cast<int>(req.operation)
+					 << ", status: " << rsp.status;
+}
+
+void SndifStream::mixPeriod(float* acc, float* scratch, size_t frames)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	if (!mRunning || !mBuffer)
+	{
+		return;
+	}
+
+	size_t needed = frames * mFrameSize;
+	size_t available = mWritten - mPosition;
+	size_t size = min(needed, available - available % mFrameSize);
+
+	if (size < needed)
+	{
+		mUnderruns++;
+	}
+
+	if (!size)
+	{
+		return;
+	}
+
+	// the data is taken directly from the mapped buffer, it may wrap
+
+	auto buffer = static_cast<const uint8_t*>(mBuffer->get());
+	auto sampleSize = SndifMixer::getSampleSize(mFormat);
+	auto offset = mPosition % mBufferSize;
+	auto first = min(size, mBufferSize - offset);
+
+	SndifMixer::toFloat(mFormat, &buffer[offset], scratch,
+						first / sampleSize);
+
+	if (first < size)
+	{
+		SndifMixer::toFloat(mFormat, buffer, &scratch[first / sampleSize],
+							(size - first) / sampleSize);
+	}
+
+	auto numFrames = size / mFrameSize;
+
+	if (mChannels == mConfig.channels)
+	{
+		SndifMixer::mix(acc, scratch, numFrames * mChannels);
+	}
+	else
+	{
+		// mono stream goes to all channels
+
+		for (size_t i = 0; i < numFrames; i++)
+		{
+			for (size_t j = 0; j < mConfig.channels; j++)
+			{
+				acc[i * mConfig.channels + j] += scratch[i];
+			}
+		}
+	}
+
+	advance(size);
+
+	// report the drained stream even if the period is not passed
+	if (mPosition == mWritten && mEventPosition != mPosition)
+	{
+		queueEvent();
+	}
+}
+
+void SndifStream::capturePeriod(size_t frames)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	if (!mRunning || !mBuffer)
+	{
+		return;
+	}
+
+	// there is no capture source, the frontend gets silence
+
+	auto buffer = static_cast<uint8_t*>(mBuffer->get());
+	int silence = mFormat == XENSND_PCM_FORMAT_U8 ? 0x80 : 0;
+	size_t size = frames * mFrameSize;
+	auto offset = mPosition % mBufferSize;
+	auto first = min(size, mBufferSize - offset);
+
+	memset(&buffer[offset], silence, first);
+	memset(buffer, silence, size - first);
+
+	advance(size);
+}
+
+size_t SndifStream::flushEvents()
+{
+	lock_guard<mutex> lock(mMutex);
+
+	auto count = mQueuedEvents;
+
+	if (count && mEventRing)
+	{
+		mEventRing->flushEvents();
+	}
+
+	mQueuedEvents = 0;
+
+	return count;
+}
+
+uint64_t SndifStream::getUnderruns() const
+{
+	lock_guard<mutex> lock(mMutex);
+
+	return mUnderruns;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+int SndifStream::open(const xensnd_open_req& req)
+{
+	close();
+
+	auto sampleSize = SndifMixer::getSampleSize(req.pcm_format);
+
+	if (!sampleSize || req.pcm_rate != mConfig.rate ||
+		(req.pcm_channels != mConfig.channels && req.pcm_channels != 1))
+	{
+		LOG(mLog, ERROR) << "Unsupported parameters, rate: " << req.pcm_rate
+						 << ", format: " << static_cast<int>(req.pcm_format)
+						 << ", channels: "
+						 << static_cast<int>(req.pcm_channels);
+
+		return -EINVAL;
+	}
+
+	size_t frameSize = sampleSize * req.pcm_channels;
+
+	if (!req.buffer_sz || req.buffer_sz % frameSize)
+	{
+		return -EINVAL;
+	}
+
+	auto numPages = (req.buffer_sz + XC_PAGE_SIZE - 1) / XC_PAGE_SIZE;
+	auto refs = readDirectory(req.gref_directory, numPages);
+
+	mBuffer.reset(new XenGnttabBuffer(mDomId, refs.data(), refs.size()));
+
+	mBufferSize = req.buffer_sz;
+	mFormat = req.pcm_format;
+	mChannels = req.pcm_channels;
+	mFrameSize = frameSize;
+
+	// period size is sent by protocol version 2 frontends only
+	mPeriodSize = req.period_sz ? req.period_sz :
+				  mConfig.periodFrames * frameSize;
+
+	reset();
+
+	LOG(mLog, DEBUG) << "Open, rate: " << req.pcm_rate
+					 << ", format: " << static_cast<int>(mFormat)
+					 << ", channels: " << mChannels
+					 << ", buffer: " << mBufferSize
+					 << ", period: " << mPeriodSize;
+
+	return 0;
+}
+
+void SndifStream::close()
+{
+	if (mBuffer)
+	{
+		LOG(mLog, DEBUG) << "Close";
+	}
+
+	mRunning = false;
+
+	mBuffer.reset();
+}
+
+int SndifStream::write(const xensnd_rw_req& req)
+{
+	if (!mBuffer || !mPlayback ||
+		static_cast<uint64_t>(req.offset) + req.length > mBufferSize)
+	{
+		return -EINVAL;
+	}
+
+	// the samples stay in the buffer till the mixer takes them
+
+	mWritten += req.length;
+
+	if (mWritten - mPosition > mBufferSize)
+	{
+		LOG(mLog, WARNING) << "Buffer overrun";
+
+		mWritten = mPosition + mBufferSize;
+	}
+
+	return 0;
+}
+
+int SndifStream::read(const xensnd_rw_req& req)
+{
+	if (!mBuffer || mPlayback ||
+		static_cast<uint64_t>(req.offset) + req.length > mBufferSize)
+	{
+		return -EINVAL;
+	}
+
+	// the samples are already put into the buffer by capturePeriod()
+
+	return 0;
+}
+
+int SndifStream::trigger(const xensnd_trigger_req& req)
+{
+	if (!mBuffer)
+	{
+		return -EINVAL;
+	}
+
+	switch(req.type)
+	{
+	case XENSND_OP_TRIGGER_START:
+	case XENSND_OP_TRIGGER_RESUME:
+		mRunning = true;
+		break;
+
+	case XENSND_OP_TRIGGER_PAUSE:
+		mRunning = false;
+		break;
+
+	case XENSND_OP_TRIGGER_STOP:
+		reset();
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+void SndifStream::queryHwParam(const xensnd_query_hw_param& req,
+							   xensnd_query_hw_param& rsp)
+{
+	rsp = req;
+
+	rsp.formats = req.formats & SndifMixer::getFormats();
+
+	rsp.rates.min = mConfig.rate;
+	rsp.rates.max = mConfig.rate;
+
+	rsp.channels.min = 1;
+	rsp.channels.max = mConfig.channels;
+}
+
+GrantRefs SndifStream::readDirectory(grant_ref_t dirRef, size_t numPages)
+{
+	GrantRefs refs;
+
+	while (refs.size() < numPages)
+	{
+		if (dirRef == 0)
+		{
+			throw SndifException("Gref directory is too short", EINVAL);
+		}
+
+		XenGnttabBuffer dirBuffer(mDomId, dirRef, PROT_READ);
+
+		auto dir = static_cast<const xensnd_page_directory*>(dirBuffer.get());
+		size_t count = dir->num_grefs;
+
+		if (count > cGrefsPerDirPage || count > numPages - refs.size())
+		{
+			throw SndifException("Invalid gref directory", EINVAL);
+		}
+
+		refs.insert(refs.end(), dir->gref, dir->gref + count);
+
+		dirRef = dir->gref_dir_next_page;
+	}
+
+	return refs;
+}
+
+void SndifStream::advance(size_t bytes)
+{
+	mPosition += bytes;
+
+	if (mPosition - mEventPosition >= mPeriodSize)
+	{
+		queueEvent();
+	}
+}
+
+void SndifStream::queueEvent()
+{
+	if (!mEventRing)
+	{
+		return;
+	}
+
+	xensnd_evt evt {};
+
+	evt.id = mEventId++;
+	evt.type = XENSND_EVT_CUR_POS;
+	evt.op.cur_pos.position = mPosition;
+
+	// the event is made visible by flushEvents() after the mixer period
+
+	if (mEventRing->queueEvent(evt))
+	{
+		mEventPosition = mPosition;
+		mQueuedEvents++;
+	}
+}
+
+void SndifStream::reset()
+{
+	mRunning = false;
+	mWritten = 0;
+	mPosition = 0;
+	mEventPosition = 0;
+}
+
+/*******************************************************************************
+ * SndifRingBuffer
+ ******************************************************************************/
+
+SndifRingBuffer::SndifRingBuffer(domid_t domId, evtchn_port_t port,
+								 grant_ref_t ref, SndifStreamPtr stream) :
+	RingBufferInBase<xen_sndif_back_ring, xen_sndif_sring, xensnd_req,
+					 xensnd_resp>(domId, port, ref),
+	mStream(stream)
+{
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void SndifRingBuffer::processRequest(const xensnd_req& req)
+{
+	xensnd_resp rsp {};
+
+	mStream->processRequest(req, rsp);
+
+	sendResponse(rsp);
+}
+
+/*******************************************************************************
+ * SndifFrontendHandler
+ ******************************************************************************/
+
+SndifFrontendHandler::SndifFrontendHandler(const string& devName,
+										   domid_t beDomId, domid_t feDomId,
+										   uint16_t devId,
+										   const SndifConfig& config) :
+	FrontendHandlerBase("SndifFrontend", devName, beDomId, feDomId, devId),
+	mConfig(config),
+	mPosEvents(0),
+	mEventBatches(0),
+	mClock([this] { onPeriod(); }, config.realtime),
+	mLog("SndifFrontend")
+{
+	if (!SndifMixer::getSampleSize(mConfig.format) || !mConfig.channels ||
+		!mConfig.rate || !mConfig.periodFrames)
+	{
+		throw SndifException("Invalid mixer configuration", EINVAL);
+	}
+}
+
+SndifFrontendHandler::~SndifFrontendHandler()
+{
+	mClock.stop();
+
+	stop();
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+SndifStats SndifFrontendHandler::getStats()
+{
+	lock_guard<mutex> lock(mStreamsMutex);
+
+	SndifStats stats {};
+
+	stats.periods = mClock.getPeriods();
+	stats.missedPeriods = mClock.getMissedPeriods();
+	stats.maxLatenessUs = mClock.getMaxLateness().count();
+	stats.posEvents = mPosEvents;
+	stats.eventBatches = mEventBatches;
+
+	for (auto stream : mStreams)
+	{
+		stats.underruns += stream->getUnderruns();
+	}
+
+	return stats;
+}
+
+/*******************************************************************************
+ * Protected
+ ******************************************************************************/
+
+void SndifFrontendHandler::onBind()
+{
+	auto& xenStore = getXenStore();
+	auto fePath = getXsFrontendPath();
+
+	auto isIndex = [] (const string& name)
+		{ return !name.empty() &&
+				 all_of(name.begin(), name.end(), ::isdigit); };
+
+	{
+		lock_guard<mutex> lock(mStreamsMutex);
+
+		// <frontend>/<pcm device>/<stream>
+
+		for (auto& device : xenStore.readDirectory(fePath))
+		{
+			if (!isIndex(device))
+			{
+				continue;
+			}
+
+			for (auto& stream : xenStore.readDirectory(fePath + "/" + device))
+			{
+				if (isIndex(stream))
+				{
+					createStream(fePath + "/" + device + "/" + stream);
+				}
+			}
+		}
+
+		if (mStreams.empty())
+		{
+			throw SndifException("No streams found", EINVAL);
+		}
+
+		auto samples = mConfig.periodFrames * mConfig.channels;
+
+		mAcc.resize(samples);
+		mScratch.resize(samples);
+		mOutput.resize(samples * SndifMixer::getSampleSize(mConfig.format));
+
+		mSink = createSink();
+	}
+
+	LOG(mLog, DEBUG) << Utils::logDomId(getDomId(), getDevId())
+					 << "Bind, streams: " << mStreams.size();
+
+	mClock.start(nanoseconds(1000000000ULL * mConfig.periodFrames /
+							 mConfig.rate));
+}
+
+void SndifFrontendHandler::onClosing()
+{
+	mClock.stop();
+
+	lock_guard<mutex> lock(mStreamsMutex);
+
+	mStreams.clear();
+
+	mSink.reset();
+}
+
+SndifSinkPtr SndifFrontendHandler::createSink()
+{
+	return SndifSinkPtr(new SndifFileSink(mConfig.sinkPath));
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void SndifFrontendHandler::createStream(const string& path)
+{
+	auto& xenStore = getXenStore();
+
+	auto type = xenStore.readString(path + "/type");
+
+	if (type != XENSND_STREAM_TYPE_PLAYBACK &&
+		type != XENSND_STREAM_TYPE_CAPTURE)
+	{
+		throw SndifException("Invalid stream type: " + type, EINVAL);
+	}
+
+	auto stream = makeShared<SndifStream>(
+			getDomId(), type == XENSND_STREAM_TYPE_PLAYBACK, mConfig);
+
+	auto eventRing = makeShared<SndifEventRingBuffer>(
+			getDomId(), xenStore.readUint(path + "/evt-event-channel"),
+			xenStore.readUint(path + "/evt-ring-ref"),
+			XENSND_IN_RING_OFFS, XENSND_IN_RING_SIZE);
+
+	stream->setEventRing(eventRing);
+
+	addRingBuffer(eventRing);
+
+	addRingBuffer(makeShared<SndifRingBuffer>(
+			getDomId(), xenStore.readUint(path + "/event-channel"),
+			xenStore.readUint(path + "/ring-ref"), stream));
+
+	mStreams.push_back(stream);
+}
+
+void SndifFrontendHandler::onPeriod()
+{
+	lock_guard<mutex> lock(mStreamsMutex);
+
+	if (!mSink)
+	{
+		return;
+	}
+
+	fill(mAcc.begin(), mAcc.end(), 0.0f);
+
+	for (auto stream : mStreams)
+	{
+		if (stream->isPlayback())
+		{
+			stream->mixPeriod(mAcc.data(), mScratch.data(),
+							  mConfig.periodFrames);
+		}
+		else
+		{
+			stream->capturePeriod(mConfig.periodFrames);
+		}
+	}
+
+	SndifMixer::fromFloat(mConfig.format, mAcc.data(), mOutput.data(),
+						  mAcc.size());
+
+	mSink->write(mOutput.data(), mOutput.size());
+
+	// position events are sent when the period is completely done
+
+	for (auto stream : mStreams)
+	{
+		auto count = stream->flushEvents();
+
+		if (count)
+		{
+			mPosEvents += count;
+			mEventBatches++;
+		}
+	}
+}
+
+/*******************************************************************************
+ * SndifBackend
+ ******************************************************************************/
+
+SndifBackend::SndifBackend(const string& name, const SndifConfig& config,
+						   const string& devName) :
+	BackendBase(name, devName),
+	mConfig(config)
+{
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void SndifBackend::onNewFrontend(domid_t domId, uint16_t devId)
+{
+	addFrontendHandler(FrontendHandlerPtr(
+			new SndifFrontendHandler(getDeviceName(), getDomId(), domId,
+									 devId, mConfig)));
+}
+
+}
@@ -0,0 +1,503 @@
+/*
+ *  Staging buffer pool
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include "StagingPool.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <string>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using std::ifstream;
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::vector;
+
+namespace XenBackend {
+
+namespace {
+
+const size_t cPageSize = 4096;
+
+// one page, BLKIF_MAX_SEGMENTS_PER_REQUEST pages, max netif packet,
+// max 9pfs message
+const size_t cClassSizes[StagingPool::cNumClasses] =
+{
+	cPageSize,
+	11 * cPageSize,
+	64 * 1024,
+	512 * 1024
+};
+
+int getNumNodes()
+{
+	// "0" or "0-N"
+	ifstream file("/sys/devices/system/node/possible");
+	string value;
+
+	if (!(file >> value))
+	{
+		return 1;
+	}
+
+	auto pos = value.find_last_of("-,");
+	auto last = strtol(value.substr(pos == string::npos ? 0 : pos + 1).c_str(),
+					   nullptr, 10);
+
+	return last >= 0 ? last + 1 : 1;
+}
+
+}
+
+/*******************************************************************************
+ * StagingBuffer
+ ******************************************************************************/
+
+StagingBuffer::StagingBuffer(StagingBuffer&& other) noexcept :
+	mData(other.mData),
+	mSize(other.mSize),
+	mClass(other.mClass),
+	mNode(other.mNode)
+{
+	other.mData = nullptr;
+	other.mSize = 0;
+}
+
+StagingBuffer& StagingBuffer::operator=(StagingBuffer&& other) noexcept
+{
+	if (this != &other)
+	{
+		release();
+
+		mData = other.mData;
+		mSize = other.mSize;
+		mClass = other.mClass;
+		mNode = other.mNode;
+
+		other.mData = nullptr;
+		other.mSize = 0;
+	}
+
+	return *this;
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+void StagingBuffer::release()
+{
+	if (mData)
+	{
+		StagingPool::getInstance().free(mData, mClass, mNode);
+
+		mData = nullptr;
+		mSize = 0;
+	}
+}
+
+/*******************************************************************************
+ * StagingPool
+ ******************************************************************************/
+
+StagingPool::StagingPool() :
+	mMaxReserved(cDefaultMaxReserved),
+	mReserved(0),
+	mChunks(0),
+	mHugeChunks(0),
+	mFallbacks(0),
+	mHugeWarned(false),
+	mLog("StagingPool")
+{
+	for (int i = getNumNodes(); i > 0; i--)
+	{
+		mNodes.emplace_back(new Node());
+	}
+
+	for (auto& counters : mCounters)
+	{
+		counters.hits = 0;
+		counters.misses = 0;
+		counters.inUse = 0;
+		counters.free = 0;
+	}
+}
+
+StagingPool::ThreadCache::~ThreadCache()
+{
+	auto& pool = StagingPool::getInstance();
+
+	for (int i = 0; i < cNumClasses; i++)
+	{
+		pool.flush(lists[i], i, node, lists[i].size());
+	}
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+StagingPool& StagingPool::getInstance()
+{
+	// never destroyed: thread caches return the buffers on the thread exit,
+	// which may happen after the static objects are destroyed
+	static StagingPool* pool = new StagingPool();
+
+	return *pool;
+}
+
+StagingBuffer StagingPool::alloc(size_t size)
+{
+	auto sizeClass = getSizeClass(size);
+
+	if (sizeClass < 0)
+	{
+		return allocFallback(size, sizeClass);
+	}
+
+	auto& counters = mCounters[sizeClass];
+	auto& cache = getThreadCache();
+	auto& list = cache.lists[sizeClass];
+	void* data = nullptr;
+
+	if (!list.empty())
+	{
+		data = list.back();
+
+		list.pop_back();
+
+		counters.hits++;
+		counters.free--;
+	}
+	else
+	{
+		data = allocFromNode(sizeClass, cache.node);
+	}
+
+	if (!data)
+	{
+		return allocFallback(size, sizeClass);
+	}
+
+	counters.inUse++;
+
+	return StagingBuffer(data, size, sizeClass, cache.node);
+}
+
+void StagingPool::setMaxReserved(size_t maxReserved)
+{
+	mMaxReserved = maxReserved;
+
+	LOG(mLog, INFO) << "Set max reserved: " << maxReserved;
+}
+
+size_t StagingPool::getClassSize(int sizeClass)
+{
+	return cClassSizes[sizeClass];
+}
+
+StagingStats StagingPool::getStats() const
+{
+	StagingStats stats {};
+
+	for (int i = 0; i < cNumClasses; i++)
+	{
+		auto& counters = mCounters[i];
+		StagingClassStats classStats;
+
+		classStats.size = cClassSizes[i];
+		classStats.hits = counters.hits;
+		classStats.misses = counters.misses;
+		classStats.inUse = counters.inUse;
+		classStats.free = counters.free;
+
+		stats.hits += classStats.hits;
+		stats.misses += classStats.misses;
+		stats.inUseBytes += classStats.inUse * classStats.size;
+
+		stats.classes.push_back(classStats);
+	}
+
+	stats.fallbacks = mFallbacks;
+	stats.reservedBytes = mReserved;
+	stats.chunks = mChunks;
+	stats.hugeChunks = mHugeChunks;
+
+	return stats;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+int StagingPool::getSizeClass(size_t size)
+{
+	for (int i = 0; i < cNumClasses; i++)
+	{
+		if (size <= cClassSizes[i])
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+size_t StagingPool::getCacheSize(int sizeClass)
+{
+	return std::max<size_t>(cThreadCacheBytes / cClassSizes[sizeClass], 2);
+}
+
+int StagingPool::getCurrentNode() const
+{
+	unsigned int cpu = 0, node = 0;
+
+	if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0)
+	{
+		return 0;
+	}
+
+	return node % mNodes.size();
+}
+
+StagingPool::ThreadCache& StagingPool::getThreadCache()
+{
+	// the node is sampled once: the thread is expected to stay on it, buffers
+	// taken after migration are still valid but remote
+	static thread_local ThreadCache cache(getCurrentNode());
+
+	return cache;
+}
+
+StagingBuffer StagingPool::allocFallback(size_t size, int sizeClass)
+{
+	void* data = nullptr;
+
+	if (posix_memalign(&data, cPageSize, size ? size : 1) != 0)
+	{
+		throw std::bad_alloc();
+	}
+
+	mFallbacks++;
+
+	if (sizeClass >= 0)
+	{
+		mCounters[sizeClass].misses++;
+	}
+
+	return StagingBuffer(data, size, -1, 0);
+}
+
+void* StagingPool::allocFromNode(int sizeClass, int nodeIndex)
+{
+	auto& node = *mNodes[nodeIndex];
+	auto& counters = mCounters[sizeClass];
+	auto& freeList = node.freeLists[sizeClass];
+
+	lock_guard<mutex> lock(node.mutex);
+
+	if (!freeList.empty())
+	{
+		auto data = freeList.back();
+
+		freeList.pop_back();
+
+		counters.hits++;
+		counters.free--;
+
+		return data;
+	}
+
+	if (node.chunkLeft < cClassSizes[sizeClass])
+	{
+		// the chunk tail is not wasted: it is carved to the smaller classes
+		for (int i = sizeClass - 1; i >= 0; i--)
+		{
+			while (node.chunkLeft >= cClassSizes[i])
+			{
+				carve(node, i);
+			}
+		}
+
+		if (!mapChunk(node))
+		{
+			return nullptr;
+		}
+	}
+
+	auto data = node.chunk;
+
+	node.chunk += cClassSizes[sizeClass];
+	node.chunkLeft -= cClassSizes[sizeClass];
+
+	counters.misses++;
+
+	return data;
+}
+
+void StagingPool::carve(Node& node, int sizeClass)
+{
+	node.freeLists[sizeClass].push_back(node.chunk);
+
+	node.chunk += cClassSizes[sizeClass];
+	node.chunkLeft -= cClassSizes[sizeClass];
+
+	mCounters[sizeClass].free++;
+}
+
+bool StagingPool::mapChunk(Node& node)
+{
+	if (mReserved + cChunkSize > mMaxReserved)
+	{
+		return false;
+	}
+
+	// MAP_POPULATE faults the pages in by this thread, the first touch
+	// places them on the node it runs on
+	auto chunk = mmap(nullptr, cChunkSize, PROT_READ | PROT_WRITE,
+					  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE,
+					  -1, 0);
+
+	bool huge = chunk != MAP_FAILED;
+
+	if (!huge)
+	{
+		if (!mHugeWarned.exchange(true))
+		{
+			LOG(mLog, WARNING) << "Huge pages are not available, "
+							   << "use transparent huge pages";
+		}
+
+		// map twice the size to align the chunk to the huge page
+		auto area = mmap(nullptr, 2 * cChunkSize, PROT_READ | PROT_WRITE,
+						 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (area == MAP_FAILED)
+		{
+			LOG(mLog, ERROR) << "Can't map chunk, err: " << errno;
+
+			return false;
+		}
+
+		auto start = reinterpret_cast<uintptr_t>(area);
+		auto aligned = (start + cChunkSize - 1) & ~(cChunkSize - 1);
+
+		if (aligned > start)
+		{
+			munmap(area, aligned - start);
+		}
+
+		if (start + cChunkSize > aligned)
+		{
+			munmap(reinterpret_cast<void*>(aligned + cChunkSize),
+				   start + cChunkSize - aligned);
+		}
+
+		chunk = reinterpret_cast<void*>(aligned);
+
+#ifdef MADV_HUGEPAGE
+		madvise(chunk, cChunkSize, MADV_HUGEPAGE);
+#endif
+
+		auto bytes = static_cast<volatile uint8_t*>(chunk);
+
+		for (size_t offset = 0; offset < cChunkSize; offset += cPageSize)
+		{
+			bytes[offset] = 0;
+		}
+	}
+
+	node.chunk = static_cast<uint8_t*>(chunk);
+	node.chunkLeft = cChunkSize;
+
+	mReserved += cChunkSize;
+	mChunks++;
+
+	if (huge)
+	{
+		mHugeChunks++;
+	}
+
+	DLOG(mLog, DEBUG) << "Map chunk, huge: " << huge
+					  << ", reserved: " << mReserved;
+
+	return true;
+}
+
+void StagingPool::free(void* data, int sizeClass, int node)
+{
+	if (sizeClass < 0)
+	{
+		::free(data);
+
+		return;
+	}
+
+	auto& counters = mCounters[sizeClass];
+
+	counters.inUse--;
+	counters.free++;
+
+	auto& cache = getThreadCache();
+
+	if (node != cache.node)
+	{
+		vector<void*> list { data };
+
+		flush(list, sizeClass, node, 1);
+
+		return;
+	}
+
+	auto& list = cache.lists[sizeClass];
+
+	// the overflow goes back in batches to take the node lock less often
+	if (list.size() >= getCacheSize(sizeClass))
+	{
+		flush(list, sizeClass, node, list.size() / 2);
+	}
+
+	list.push_back(data);
+}
+
+void StagingPool::flush(vector<void*>& list, int sizeClass, int nodeIndex,
+						size_t count)
+{
+	if (!count)
+	{
+		return;
+	}
+
+	auto& node = *mNodes[nodeIndex];
+	auto& freeList = node.freeLists[sizeClass];
+
+	lock_guard<mutex> lock(node.mutex);
+
+	freeList.insert(freeList.end(), list.end() - count, list.end());
+	list.resize(list.size() - count);
+}
+
+}
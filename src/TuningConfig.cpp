@@ -0,0 +1,652 @@
+/*
+ *  Runtime tuning configuration
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include "TuningConfig.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include <sched.h>
+
+using std::bind;
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+using std::exception;
+using std::getline;
+using std::ifstream;
+using std::lock_guard;
+using std::mutex;
+using std::placeholders::_1;
+using std::string;
+using std::stringstream;
+using std::to_string;
+using std::vector;
+
+namespace XenBackend {
+
+namespace {
+
+enum class ValueType
+{
+	LOG_LEVEL, STRING, UINT, CPU, CPU_LIST
+};
+
+struct Knob
+{
+	const char* name;
+	// the most specific scope level: 0 - global, 1 - dom, 2 - dev, 3 - ring
+	size_t maxLevel;
+	ValueType type;
+};
+
+const Knob cKnobs[] =
+{
+	{ "log-level",           0, ValueType::LOG_LEVEL },
+	{ "log-mask",            0, ValueType::STRING },
+	{ "poller-idle-timeout", 2, ValueType::UINT },
+	{ "queue-cpus",          2, ValueType::CPU_LIST },
+	{ "ring-max-batch",      3, ValueType::UINT },
+	{ "ring-cpu",            3, ValueType::CPU },
+};
+
+const char* cScopePrefixes[] = { "dom-", "dev-", "ring-" };
+
+string trim(const string& str)
+{
+	auto begin = str.find_first_not_of(" \t\r\n");
+
+	if (begin == string::npos)
+	{
+		return "";
+	}
+
+	auto end = str.find_last_not_of(" \t\r\n");
+
+	return str.substr(begin, end - begin + 1);
+}
+
+bool parseUint(const string& str, uint64_t& value)
+{
+	if (str.empty() || str.find_first_not_of("0123456789") != string::npos)
+	{
+		return false;
+	}
+
+	errno = 0;
+
+	value = strtoull(str.c_str(), nullptr, 10);
+
+	return errno == 0;
+}
+
+bool parseCpu(const string& str, int& cpu)
+{
+	uint64_t value;
+
+	if (!parseUint(str, value) || value >= CPU_SETSIZE)
+	{
+		return false;
+	}
+
+	cpu = value;
+
+	return true;
+}
+
+bool parseCpuList(const string& str, vector<int>& cpus)
+{
+	stringstream ss(str);
+	string item;
+
+	cpus.clear();
+
+	while (getline(ss, item, ','))
+	{
+		int cpu;
+
+		if (!parseCpu(trim(item), cpu))
+		{
+			return false;
+		}
+
+		cpus.push_back(cpu);
+	}
+
+	return !cpus.empty();
+}
+
+bool isLogLevel(const string& str)
+{
+	string level = str;
+
+	std::transform(level.begin(), level.end(), level.begin(), ::tolower);
+
+	return level == "disable" || level == "error" || level == "warning" ||
+		   level == "info" || level == "debug";
+}
+
+bool isValid(ValueType type, const string& value)
+{
+	uint64_t uintValue;
+	int cpu;
+	vector<int> cpus;
+
+	switch(type)
+	{
+	case ValueType::LOG_LEVEL:
+		return isLogLevel(value);
+
+	case ValueType::UINT:
+		return parseUint(value, uintValue);
+
+	case ValueType::CPU:
+		return parseCpu(value, cpu);
+
+	case ValueType::CPU_LIST:
+		return parseCpuList(value, cpus);
+
+	default:
+		return !value.empty();
+	}
+}
+
+// converts "dom-05/dev-0" to "dom-5/dev-0" and returns number of levels,
+// throws if the scope is malformed
+size_t normalizeScope(const string& scope, string& normalized)
+{
+	normalized.clear();
+
+	if (scope.empty())
+	{
+		return 0;
+	}
+
+	stringstream ss(scope);
+	string item;
+	size_t level = 0;
+
+	while (getline(ss, item, '/'))
+	{
+		uint64_t id;
+		auto prefix = cScopePrefixes[level];
+
+		if (level == 3 || item.compare(0, strlen(prefix), prefix) != 0 ||
+			!parseUint(item.substr(strlen(prefix)), id))
+		{
+			throw TuningConfigException("Invalid scope: " + scope, EINVAL);
+		}
+
+		normalized += (level ? "/" : "") + string(prefix) + to_string(id);
+
+		level++;
+	}
+
+	return level;
+}
+
+}
+
+/*******************************************************************************
+ * TuningConfig
+ ******************************************************************************/
+
+TuningConfig::TuningConfig(const string& fileName, const string& xsPath) :
+	mFileName(fileName),
+	mXsPath(xsPath),
+	mTimer([this] { onFileTimer(); }, true),
+	mNumReloads(0),
+	mLog("TuningConfig")
+{
+	if (!mXsPath.empty())
+	{
+		mXenStore.reset(new XenStore(bind(&TuningConfig::onError, this, _1)));
+
+		// changes made while the connection was lost are not watched
+		mXenStore->setReconnectCallback(
+				bind(&TuningConfig::onXenStoreChanged, this));
+	}
+
+	memset(&mFileStat, 0, sizeof(mFileStat));
+
+	isFileChanged();
+
+	mScopes = load();
+
+	applyGlobal();
+
+	LOG(mLog, DEBUG) << "Create tuning config, file: " << mFileName
+					 << ", xs path: " << mXsPath;
+}
+
+TuningConfig::~TuningConfig()
+{
+	stop();
+
+	lock_guard<mutex> lock(mMutex);
+
+	for (auto backend : mBackends)
+	{
+		backend->setConnectCallback(nullptr);
+	}
+
+	LOG(mLog, DEBUG) << "Delete tuning config";
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+void TuningConfig::start(milliseconds period)
+{
+	LOG(mLog, DEBUG) << "Start";
+
+	if (!mFileName.empty())
+	{
+		mTimer.start(period);
+	}
+
+	if (mXenStore)
+	{
+		mXenStore->setWatch(mXsPath,
+							bind(&TuningConfig::onXenStoreChanged, this));
+
+		mXenStore->start();
+	}
+}
+
+void TuningConfig::stop()
+{
+	LOG(mLog, DEBUG) << "Stop";
+
+	mTimer.stop();
+
+	if (mXenStore)
+	{
+		mXenStore->clearWatches();
+
+		mXenStore->stop();
+	}
+}
+
+bool TuningConfig::reload()
+{
+	Scopes scopes;
+
+	try
+	{
+		scopes = load();
+	}
+	catch(const exception& e)
+	{
+		LOG(mLog, ERROR) << "Configuration is not reloaded: " << e.what();
+
+		return false;
+	}
+
+	lock_guard<mutex> lock(mMutex);
+
+	if (scopes == mScopes)
+	{
+		return false;
+	}
+
+	mScopes = scopes;
+
+	applyGlobal();
+
+	for (auto backend : mBackends)
+	{
+		for (auto frontendHandler : backend->getFrontendHandlers())
+		{
+			applyHandler(*frontendHandler);
+		}
+	}
+
+	mNumReloads++;
+
+	LOG(mLog, INFO) << "Configuration is reloaded";
+
+	return true;
+}
+
+void TuningConfig::attach(BackendBase& backend)
+{
+	backend.setConnectCallback(bind(&TuningConfig::apply, this, _1));
+
+	lock_guard<mutex> lock(mMutex);
+
+	mBackends.push_back(&backend);
+
+	for (auto frontendHandler : backend.getFrontendHandlers())
+	{
+		applyHandler(*frontendHandler);
+	}
+}
+
+void TuningConfig::apply(FrontendHandlerBase& frontendHandler)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	applyHandler(frontendHandler);
+}
+
+bool TuningConfig::getValue(const string& key, string& value,
+							int domId, int devId, int ring) const
+{
+	lock_guard<mutex> lock(mMutex);
+
+	return findValue(key, value, domId, devId, ring);
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+TuningConfig::Scopes TuningConfig::load()
+{
+	Scopes scopes;
+
+	if (!mFileName.empty())
+	{
+		readFile(scopes);
+	}
+
+	if (mXenStore && mXenStore->checkIfExist(mXsPath))
+	{
+		readXenStore(scopes, mXsPath, "");
+	}
+
+	return scopes;
+}
+
+void TuningConfig::readFile(Scopes& scopes)
+{
+	ifstream file(mFileName);
+
+	if (!file.is_open())
+	{
+		throw TuningConfigException("Can't open file: " + mFileName, errno);
+	}
+
+	string line;
+	string scope;
+	int lineNumber = 0;
+
+	while (getline(file, line))
+	{
+		lineNumber++;
+
+		line = trim(line.substr(0, line.find('#')));
+
+		if (line.empty())
+		{
+			continue;
+		}
+
+		if (line.front() == '[')
+		{
+			if (line.back() != ']')
+			{
+				throw TuningConfigException(mFileName + ":" +
+											to_string(lineNumber) +
+											": invalid section", EINVAL);
+			}
+
+			scope = trim(line.substr(1, line.length() - 2));
+
+			continue;
+		}
+
+		auto pos = line.find('=');
+
+		if (pos == string::npos)
+		{
+			throw TuningConfigException(mFileName + ":" +
+										to_string(lineNumber) +
+										": '=' expected", EINVAL);
+		}
+
+		setValue(scopes, scope, trim(line.substr(0, pos)),
+				 trim(line.substr(pos + 1)));
+	}
+}
+
+void TuningConfig::readXenStore(Scopes& scopes, const string& path,
+								const string& scope)
+{
+	for (auto& name : mXenStore->readDirectory(path))
+	{
+		auto childPath = path + "/" + name;
+		bool isScope = false;
+
+		uint64_t id;
+
+		// "ring-" is also the prefix of the ring knobs
+		for (auto prefix : cScopePrefixes)
+		{
+			isScope |= name.compare(0, strlen(prefix), prefix) == 0 &&
+					   parseUint(name.substr(strlen(prefix)), id);
+		}
+
+		if (isScope)
+		{
+			readXenStore(scopes, childPath,
+						 scope.empty() ? name : scope + "/" + name);
+		}
+		else
+		{
+			setValue(scopes, scope, name, mXenStore->readString(childPath));
+		}
+	}
+}
+
+void TuningConfig::setValue(Scopes& scopes, const string& scope,
+							const string& key, const string& value)
+{
+	string normalized;
+
+	auto level = normalizeScope(scope, normalized);
+
+	auto knob = std::find_if(std::begin(cKnobs), std::end(cKnobs),
+							 [&key](const Knob& knob)
+							 { return key == knob.name; });
+
+	if (knob == std::end(cKnobs))
+	{
+		throw TuningConfigException("Unknown key: " + key, EINVAL);
+	}
+
+	if (level > knob->maxLevel)
+	{
+		throw TuningConfigException("Key " + key + " can't be set in scope: " +
+									scope, EINVAL);
+	}
+
+	if (!isValid(knob->type, value))
+	{
+		throw TuningConfigException("Invalid value of " + key + ": " + value,
+									EINVAL);
+	}
+
+	scopes[normalized][key] = value;
+}
+
+void TuningConfig::applyGlobal()
+{
+	string value;
+
+	if (findValue("log-level", value, -1, -1, -1))
+	{
+		Log::setLogLevel(value);
+	}
+
+	if (findValue("log-mask", value, -1, -1, -1) &&
+		!Log::setLogMask(value))
+	{
+		LOG(mLog, WARNING) << "Invalid log mask: " << value;
+	}
+}
+
+void TuningConfig::applyHandler(FrontendHandlerBase& frontendHandler)
+{
+	int domId = frontendHandler.getDomId();
+	int devId = frontendHandler.getDevId();
+	string value;
+
+	if (findValue("queue-cpus", value, domId, devId, -1))
+	{
+		vector<int> cpus;
+
+		parseCpuList(value, cpus);
+
+		frontendHandler.setQueueCpus(cpus);
+	}
+
+	if (findValue("poller-idle-timeout", value, domId, devId, -1))
+	{
+		uint64_t timeout;
+
+		parseUint(value, timeout);
+
+		for (auto& poller : frontendHandler.getPollers())
+		{
+			poller->setIdleTimeout(microseconds(timeout));
+		}
+	}
+
+	auto ringBuffers = frontendHandler.getRingBuffers();
+
+	for (size_t i = 0; i < ringBuffers.size(); i++)
+	{
+		if (findValue("ring-max-batch", value, domId, devId, i))
+		{
+			uint64_t maxBatch;
+
+			parseUint(value, maxBatch);
+
+			ringBuffers[i]->setMaxBatch(maxBatch);
+		}
+
+		if (findValue("ring-cpu", value, domId, devId, i))
+		{
+			int cpu;
+
+			parseCpu(value, cpu);
+
+			ringBuffers[i]->setCpu(cpu);
+		}
+	}
+
+	LOG(mLog, DEBUG) << Utils::logDomId(domId, devId)
+					 << "Apply configuration, rings: " << ringBuffers.size();
+}
+
+bool TuningConfig::findValue(const string& key, string& value,
+							 int domId, int devId, int ring) const
+{
+	vector<string> scopes;
+
+	if (domId >= 0)
+	{
+		auto domScope = "dom-" + to_string(domId);
+
+		if (devId >= 0)
+		{
+			auto devScope = domScope + "/dev-" + to_string(devId);
+
+			if (ring >= 0)
+			{
+				scopes.push_back(devScope + "/ring-" + to_string(ring));
+			}
+
+			scopes.push_back(devScope);
+		}
+
+		scopes.push_back(domScope);
+	}
+
+	scopes.push_back("");
+
+	for (auto& scope : scopes)
+	{
+		auto scopeIt = mScopes.find(scope);
+
+		if (scopeIt == mScopes.end())
+		{
+			continue;
+		}
+
+		auto valueIt = scopeIt->second.find(key);
+
+		if (valueIt != scopeIt->second.end())
+		{
+			value = valueIt->second;
+
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool TuningConfig::isFileChanged()
+{
+	struct stat st;
+
+	if (stat(mFileName.c_str(), &st) < 0)
+	{
+		memset(&st, 0, sizeof(st));
+	}
+
+	bool changed = st.st_ino != mFileStat.st_ino ||
+				   st.st_size != mFileStat.st_size ||
+				   st.st_mtim.tv_sec != mFileStat.st_mtim.tv_sec ||
+				   st.st_mtim.tv_nsec != mFileStat.st_mtim.tv_nsec;
+
+	mFileStat = st;
+
+	return changed;
+}
+
+void TuningConfig::onFileTimer()
+{
+	if (isFileChanged())
+	{
+		LOG(mLog, DEBUG) << "File changed: " << mFileName;
+
+		reload();
+	}
+}
+
+void TuningConfig::onXenStoreChanged()
+{
+	LOG(mLog, DEBUG) << "Xen store changed: " << mXsPath;
+
+	reload();
+}
+
+void TuningConfig::onError(const exception& e)
+{
+	LOG(mLog, ERROR) << e.what();
+}
+
+}
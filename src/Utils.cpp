@@ -23,6 +23,8 @@
 #include <cstring>
 #include <vector>
 
+#include <pthread.h>
+
 #include "Exception.hpp"
 #include "Version.hpp"
 
@@ -71,6 +73,17 @@ string Utils::getVersion()
 	return VERSION;
 }
 
+int Utils::setThreadCpu(thread& thread, int cpu)
+{
+	cpu_set_t cpuSet;
+
+	CPU_ZERO(&cpuSet);
+	CPU_SET(cpu, &cpuSet);
+
+	return pthread_setaffinity_np(thread.native_handle(), sizeof(cpuSet),
+								  &cpuSet);
+}
+
 /*******************************************************************************
  * PollFd
  ******************************************************************************/
@@ -245,6 +258,154 @@ void AsyncContext::run()
 	}
 }
 
+/*******************************************************************************
+ * ThreadPool
+ ******************************************************************************/
+
+ThreadPool::ThreadPool(size_t numThreads) :
+	mTerminate(false),
+	mNumPending(0)
+{
+	for (size_t i = 0; i < numThreads; i++)
+	{
+		mThreads.push_back(thread(&ThreadPool::run, this));
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	stop();
+}
+
+void ThreadPool::stop()
+{
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		mTerminate = true;
+
+		mCondVar.notify_all();
+	}
+
+	for (auto& worker : mThreads)
+	{
+		if (worker.joinable())
+		{
+			worker.join();
+		}
+	}
+
+	lock_guard<mutex> lock(mMutex);
+
+	mTasks.clear();
+	mKeyedTasks.clear();
+	mNumPending = 0;
+
+	mIdleCondVar.notify_all();
+}
+
+void ThreadPool::call(Task task)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	mNumPending++;
+
+	mTasks.push_back(task);
+
+	mCondVar.notify_one();
+}
+
+void ThreadPool::call(uint64_t key, Task task)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	mNumPending++;
+
+	auto& tasks = mKeyedTasks[key];
+
+	tasks.push_back(task);
+
+	// the next task of the key is scheduled when the previous one is done
+	if (tasks.size() == 1)
+	{
+		mTasks.push_back([this, key] { runKeyed(key); });
+
+		mCondVar.notify_one();
+	}
+}
+
+void ThreadPool::wait()
+{
+	unique_lock<mutex> lock(mMutex);
+
+	mIdleCondVar.wait(lock, [this] { return mNumPending == 0; });
+}
+
+void ThreadPool::run()
+{
+	unique_lock<mutex> lock(mMutex);
+
+	while(true)
+	{
+		mCondVar.wait(lock, [this] { return mTerminate || !mTasks.empty(); });
+
+		if (mTerminate)
+		{
+			return;
+		}
+
+		auto task = mTasks.front();
+
+		mTasks.pop_front();
+
+		lock.unlock();
+
+		task();
+
+		lock.lock();
+
+		done();
+	}
+}
+
+void ThreadPool::runKeyed(uint64_t key)
+{
+	Task task;
+
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		task = mKeyedTasks[key].front();
+	}
+
+	task();
+
+	lock_guard<mutex> lock(mMutex);
+
+	auto& tasks = mKeyedTasks[key];
+
+	tasks.pop_front();
+
+	if (tasks.empty())
+	{
+		mKeyedTasks.erase(key);
+	}
+	else
+	{
+		mTasks.push_back([this, key] { runKeyed(key); });
+
+		mCondVar.notify_one();
+	}
+}
+
+void ThreadPool::done()
+{
+	if (--mNumPending == 0)
+	{
+		mIdleCondVar.notify_all();
+	}
+}
+
 /*******************************************************************************
  * Timer
  ******************************************************************************/
@@ -54,34 +54,36 @@ XenInterface::~XenInterface()
 
 void XenInterface::getDomainsInfo(vector<xc_domaininfo_t>& infos)
 {
-	vector<xc_domaininfo_t> domainInfo(cDomInfoChunkSize);
-
+	// the chunks are read directly into the output vector, so a vector
+	// reused between calls is not reallocated once it has grown
+	size_t count = 0;
 	int newDomains = cDomInfoChunkSize;
 	int startDomain = 0;
 
-	infos.clear();
-
 	while(newDomains == cDomInfoChunkSize)
 	{
+		infos.resize(count + cDomInfoChunkSize);
+
 		newDomains = xc_domain_getinfolist(mHandle, startDomain,
 										   cDomInfoChunkSize,
-										   domainInfo.data());
+										   &infos[count]);
 
 		if (newDomains < 0)
 		{
+			infos.clear();
+
 			throw XenCtrlException("Can't get domain info", errno);
 		}
 
-		if (newDomains)
-		{
-			startDomain = domainInfo[newDomains - 1].domain + 1;
-		}
+		count += newDomains;
 
-		for(auto i = 0; i < newDomains; i++)
+		if (newDomains)
 		{
-			infos.push_back(domainInfo[i]);
+			startDomain = infos[count - 1].domain + 1;
 		}
 	}
+
+	infos.resize(count);
 }
 
 /*******************************************************************************
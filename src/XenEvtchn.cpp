@@ -20,15 +20,249 @@
 
 #include "XenEvtchn.hpp"
 
+#include <cstring>
+
 #include <poll.h>
 
+using std::function;
 using std::lock_guard;
+using std::move;
 using std::mutex;
 using std::thread;
 using std::to_string;
+using std::unique_lock;
+using std::unique_ptr;
 
 namespace XenBackend {
 
+/*******************************************************************************
+ * XenEvtchnHandle
+ ******************************************************************************/
+
+XenEvtchnHandle::XenEvtchnHandle() :
+	mHandle(nullptr),
+	mTerminate(false)
+{
+	try
+	{
+		init();
+	}
+	catch(const std::exception& e)
+	{
+		release();
+
+		throw;
+	}
+}
+
+XenEvtchnHandle::~XenEvtchnHandle()
+{
+	release();
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+void XenEvtchnHandle::run(function<void()> loop)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	mLoop = loop;
+
+	mCondVar.notify_all();
+}
+
+void XenEvtchnHandle::stop()
+{
+	if (std::this_thread::get_id() == mThread.get_id())
+	{
+		throw XenEvtchnException("Can't stop event loop from its thread",
+								 EDEADLK);
+	}
+
+	unique_lock<mutex> lock(mMutex);
+
+	if (!mLoop)
+	{
+		return;
+	}
+
+	mPollFd->stop();
+
+	mCondVar.wait(lock, [this] { return !mLoop; });
+}
+
+void XenEvtchnHandle::resetCpu()
+{
+	pthread_setaffinity_np(mThread.native_handle(), sizeof(mCpuSet),
+						   &mCpuSet);
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void XenEvtchnHandle::init()
+{
+	mHandle = xenevtchn_open(nullptr, 0);
+
+	if (!mHandle)
+	{
+		throw XenEvtchnException("Can't open event channel", errno);
+	}
+
+	mPollFd.reset(new PollFd(xenevtchn_fd(mHandle), POLLIN));
+
+	mThread = thread(&XenEvtchnHandle::eventThread, this);
+
+	pthread_getaffinity_np(mThread.native_handle(), sizeof(mCpuSet),
+						   &mCpuSet);
+}
+
+void XenEvtchnHandle::release()
+{
+	if (mThread.joinable())
+	{
+		{
+			lock_guard<mutex> lock(mMutex);
+
+			mTerminate = true;
+
+			mCondVar.notify_all();
+		}
+
+		mThread.join();
+	}
+
+	if (mHandle)
+	{
+		xenevtchn_close(mHandle);
+	}
+}
+
+void XenEvtchnHandle::eventThread()
+{
+	unique_lock<mutex> lock(mMutex);
+
+	while(true)
+	{
+		mCondVar.wait(lock, [this] { return mLoop || mTerminate; });
+
+		if (!mLoop)
+		{
+			return;
+		}
+
+		auto loop = mLoop;
+
+		lock.unlock();
+
+		loop();
+
+		lock.lock();
+
+		mLoop = nullptr;
+
+		mCondVar.notify_all();
+	}
+}
+
+/*******************************************************************************
+ * XenEvtchnPool
+ ******************************************************************************/
+
+XenEvtchnPool::XenEvtchnPool() :
+	mMaxSize(cDefaultMaxSize),
+	mNumReused(0)
+{
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+XenEvtchnPool& XenEvtchnPool::getInstance()
+{
+	static XenEvtchnPool pool;
+
+	return pool;
+}
+
+void XenEvtchnPool::setMaxSize(size_t maxSize)
+{
+	// handles are closed without the lock, closing joins the event thread
+	decltype(mHandles) extraHandles;
+
+	lock_guard<mutex> lock(mMutex);
+
+	mMaxSize = maxSize;
+
+	while (mHandles.size() > mMaxSize)
+	{
+		extraHandles.push_back(move(mHandles.back()));
+
+		mHandles.pop_back();
+	}
+}
+
+size_t XenEvtchnPool::getMaxSize() const
+{
+	lock_guard<mutex> lock(mMutex);
+
+	return mMaxSize;
+}
+
+size_t XenEvtchnPool::getSize() const
+{
+	lock_guard<mutex> lock(mMutex);
+
+	return mHandles.size();
+}
+
+uint64_t XenEvtchnPool::getNumReused() const
+{
+	lock_guard<mutex> lock(mMutex);
+
+	return mNumReused;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+unique_ptr<XenEvtchnHandle> XenEvtchnPool::acquire()
+{
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		if (!mHandles.empty())
+		{
+			auto handle = move(mHandles.back());
+
+			mHandles.pop_back();
+
+			mNumReused++;
+
+			return handle;
+		}
+	}
+
+	return unique_ptr<XenEvtchnHandle>(new XenEvtchnHandle());
+}
+
+void XenEvtchnPool::release(unique_ptr<XenEvtchnHandle> handle)
+{
+	handle->resetCpu();
+
+	lock_guard<mutex> lock(mMutex);
+
+	if (mHandles.size() < mMaxSize)
+	{
+		mHandles.push_back(move(handle));
+	}
+}
+
 /*******************************************************************************
  * XenEvtchn
  ******************************************************************************/
@@ -36,10 +270,12 @@ namespace XenBackend {
 XenEvtchn::XenEvtchn(domid_t domId, evtchn_port_t port, Callback callback,
 					 ErrorCallback errorCallback) :
 	mPort(-1),
-	mHandle(nullptr),
 	mCallback(callback),
 	mErrorCallback(errorCallback),
 	mStarted(false),
+	mCpu(-1),
+	mNumEvents(0),
+	mReusable(true),
 	mLog("XenEvtchn")
 {
 	try
@@ -74,8 +310,24 @@ void XenEvtchn::start()
 	}
 
 	mStarted = true;
+	mReusable = false;
+
+	mHandle->run([this] { eventThread(); });
 
-	mThread = thread(&XenEvtchn::eventThread, this);
+	if (mCpu >= 0)
+	{
+		bindCpu();
+	}
+}
+
+void XenEvtchn::setCpu(int cpu)
+{
+	mCpu = cpu;
+
+	if (mStarted && mCpu >= 0)
+	{
+		bindCpu();
+	}
 }
 
 void XenEvtchn::stop()
@@ -87,27 +339,31 @@ void XenEvtchn::stop()
 
 	DLOG(mLog, DEBUG) << "Stop event channel, port: " << mPort;
 
-	if (mPollFd)
-	{
-		mPollFd->stop();
-	}
-
-	if (mThread.joinable())
-	{
-		mThread.join();
-	}
+	mHandle->stop();
 
 	mStarted = false;
 }
 
 void XenEvtchn::notify()
+{
+	auto ret = tryNotify();
+
+	if (ret)
+	{
+		throw XenEvtchnException("Can't notify event channel", ret);
+	}
+}
+
+int XenEvtchn::tryNotify() noexcept
 {
 	DLOG(mLog, DEBUG) << "Notify event channel, port: " << mPort;
 
-	if (xenevtchn_notify(mHandle, mPort) < 0)
+	if (xenevtchn_notify(mHandle->get(), mPort) < 0)
 	{
-		throw XenEvtchnException("Can't notify event channel", errno);
+		return errno ? errno : EIO;
 	}
+
+	return 0;
 }
 
 void XenEvtchn::setErrorCallback(ErrorCallback errorCallback)
@@ -123,14 +379,9 @@ void XenEvtchn::setErrorCallback(ErrorCallback errorCallback)
 
 void XenEvtchn::init(domid_t domId, evtchn_port_t port)
 {
-	mHandle = xenevtchn_open(nullptr, 0);
+	mHandle = XenEvtchnPool::getInstance().acquire();
 
-	if (!mHandle)
-	{
-		throw XenEvtchnException("Can't open event channel", errno);
-	}
-
-	mPort = xenevtchn_bind_interdomain(mHandle, domId, port);
+	mPort = xenevtchn_bind_interdomain(mHandle->get(), domId, port);
 
 	if (mPort == -1)
 	{
@@ -138,8 +389,6 @@ void XenEvtchn::init(domid_t domId, evtchn_port_t port)
 								 errno);
 	}
 
-	mPollFd.reset(new PollFd(xenevtchn_fd(mHandle), POLLIN));
-
 	DLOG(mLog, DEBUG) << "Create event channel, dom: " << domId
 					  << ", remote port: " << port << ", local port: "
 					  << mPort;
@@ -147,16 +396,40 @@ void XenEvtchn::init(domid_t domId, evtchn_port_t port)
 
 void XenEvtchn::release()
 {
-	if (mPort != -1)
+	if (!mHandle)
 	{
-		xenevtchn_unbind(mHandle, mPort);
+		return;
 	}
 
-	if (mHandle)
+	// the handle which port is not unbound or which event loop failed may
+	// keep the port or the stop request, so it is closed
+	if (mPort != -1 && xenevtchn_unbind(mHandle->get(), mPort) < 0)
 	{
-		xenevtchn_close(mHandle);
+		mReusable = false;
+	}
+
+	DLOG(mLog, DEBUG) << "Delete event channel, port: " << mPort;
+
+	if (mReusable)
+	{
+		XenEvtchnPool::getInstance().release(move(mHandle));
+	}
+}
 
-		DLOG(mLog, DEBUG) << "Delete event channel, port: " << mPort;
+void XenEvtchn::bindCpu()
+{
+	// not fatal: the thread keeps running on any core
+	auto ret = Utils::setThreadCpu(mHandle->getThread(), mCpu);
+
+	if (ret != 0)
+	{
+		LOG(mLog, WARNING) << "Can't bind event channel, port: " << mPort
+						   << " to cpu: " << mCpu << ", " << strerror(ret);
+	}
+	else
+	{
+		DLOG(mLog, DEBUG) << "Bind event channel, port: " << mPort
+						  << " to cpu: " << mCpu;
 	}
 }
 
@@ -164,31 +437,41 @@ void XenEvtchn::eventThread()
 {
 	try
 	{
-		while(mCallback && mPollFd->poll())
+		auto handle = mHandle->get();
+
+		while(mCallback && mHandle->getPollFd().poll())
 		{
-			auto port = xenevtchn_pending(mHandle);
+			auto port = xenevtchn_pending(handle);
 
 			if (port < 0)
 			{
 				throw XenEvtchnException("Can't get pending port", errno);
 			}
 
-			if (xenevtchn_unmask(mHandle, port) < 0)
+			// the reused handle may still have pending events of the port
+			// it was bound to before
+			if (port != mPort)
 			{
-				throw XenEvtchnException("Can't unmask event channel", errno);
+				LOG(mLog, WARNING) << "Skip event of not bound port: " << port
+								   << ", expected: " << mPort;
+
+				continue;
 			}
 
-			if (port != mPort)
+			if (xenevtchn_unmask(handle, port) < 0)
 			{
-				throw XenEvtchnException("Error port number: " +
-										 to_string(port) + ", expected: " +
-										 to_string(mPort), EINVAL);
+				throw XenEvtchnException("Can't unmask event channel", errno);
 			}
 
 			DLOG(mLog, DEBUG) << "Event received, port: " << mPort;
 
+			mNumEvents++;
+
 			mCallback();
 		}
+
+		// the stop request is consumed by the poll
+		mReusable = static_cast<bool>(mCallback);
 	}
 	catch(const std::exception& e)
 	{
@@ -48,14 +48,19 @@ XenGnttab::~XenGnttab()
  * XenGnttabBuffer
  ******************************************************************************/
 
-XenGnttabBuffer::XenGnttabBuffer(domid_t domId, grant_ref_t ref, int prot) :
-		XenGnttabBuffer(domId, &ref, 1, prot)
+XenGnttabBuffer::XenGnttabBuffer(domid_t domId, grant_ref_t ref, int prot,
+								 GrantAccount* account) :
+		XenGnttabBuffer(domId, &ref, 1, prot, account)
 {
 
 }
 
 XenGnttabBuffer::XenGnttabBuffer(domid_t domId, const grant_ref_t* refs,
-								 size_t count, int prot) :
+								 size_t count, int prot,
+								 GrantAccount* account) :
+	mDomId(domId),
+	mAccount(account),
+	mAccounted(false),
 	mLog("XenGnttabBuffer")
 {
 	init(domId, refs, count, prot);
@@ -82,6 +87,13 @@ void XenGnttabBuffer::init(domid_t domId, const grant_ref_t* refs,
 	DLOG(mLog, DEBUG) << "Create grant table buffer, dom: " << domId
 					  << ", count: " << count << ", ref: " << *refs;
 
+	auto& budget = GrantBudget::getInstance();
+
+	if (!budget.acquire(domId, mAccount, count, mAccounted))
+	{
+		throw XenGnttabException("Grant budget exceeded, dom: " +
+								 std::to_string(domId), ENOMEM);
+	}
 
 	mBuffer = xengnttab_map_domain_grant_refs(mHandle, count, domId,
 											  const_cast<grant_ref_t*>(refs),
@@ -89,7 +101,11 @@ void XenGnttabBuffer::init(domid_t domId, const grant_ref_t* refs,
 
 	if (!mBuffer)
 	{
-		throw XenGnttabException("Can't map buffer", errno);
+		auto err = errno;
+
+		budget.release(domId, mAccount, count, mAccounted);
+
+		throw XenGnttabException("Can't map buffer", err);
 	}
 
 }
@@ -101,6 +117,74 @@ void XenGnttabBuffer::release()
 	if (mBuffer)
 	{
 		xengnttab_unmap(mHandle, mBuffer, mCount);
+
+		GrantBudget::getInstance().release(mDomId, mAccount, mCount,
+						   mAccounted);
+	}
+}
+
+/*******************************************************************************
+ * XenGnttabCopy
+ ******************************************************************************/
+
+XenGnttabCopy::XenGnttabCopy() :
+	mLog("XenGnttabCopy")
+{
+	static XenGnttab gnttab;
+
+	mHandle = gnttab.getHandle();
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+size_t XenGnttabCopy::fromRef(domid_t domId, grant_ref_t ref, uint16_t offset,
+							  void* dst, uint16_t len)
+{
+	xengnttab_grant_copy_segment_t segment {};
+
+	segment.source.foreign.ref = ref;
+	segment.source.foreign.offset = offset;
+	segment.source.foreign.domid = domId;
+	segment.dest.virt = dst;
+	segment.len = len;
+	segment.flags = GNTCOPY_source_gref;
+
+	mSegments.push_back(segment);
+
+	return mSegments.size() - 1;
+}
+
+size_t XenGnttabCopy::toRef(domid_t domId, grant_ref_t ref, uint16_t offset,
+							const void* src, uint16_t len)
+{
+	xengnttab_grant_copy_segment_t segment {};
+
+	segment.source.virt = const_cast<void*>(src);
+	segment.dest.foreign.ref = ref;
+	segment.dest.foreign.offset = offset;
+	segment.dest.foreign.domid = domId;
+	segment.len = len;
+	segment.flags = GNTCOPY_dest_gref;
+
+	mSegments.push_back(segment);
+
+	return mSegments.size() - 1;
+}
+
+void XenGnttabCopy::copy()
+{
+	if (mSegments.empty())
+	{
+		return;
+	}
+
+	DLOG(mLog, DEBUG) << "Grant copy, count: " << mSegments.size();
+
+	if (xengnttab_grant_copy(mHandle, mSegments.size(), mSegments.data()) < 0)
+	{
+		throw XenGnttabException("Can't perform grant copy", errno);
 	}
 }
 
@@ -20,15 +20,35 @@
 
 #include "XenStat.hpp"
 
+#include <algorithm>
+
+using std::chrono::duration;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::exception;
+using std::lock_guard;
+using std::lower_bound;
+using std::mutex;
 using std::vector;
 
 namespace XenBackend {
 
+namespace {
+
+// running and blocked flags follow the vCPUs scheduling and change too often
+// to be reported
+const uint32_t cStateFlags = XEN_DOMINF_dying | XEN_DOMINF_shutdown |
+							 XEN_DOMINF_paused;
+
+}
+
 /*******************************************************************************
  * XenStat
  ******************************************************************************/
 
 XenStat::XenStat() :
+	mNumSamples(0),
+	mTimer([this] { onTimer(); }, true),
 	mLog("XenStat")
 {
 	LOG(mLog, DEBUG) << "Create xen stat";
@@ -36,6 +56,8 @@ XenStat::XenStat() :
 
 XenStat::~XenStat()
 {
+	stop();
+
 	LOG(mLog, DEBUG) << "Delete xen stat";
 }
 
@@ -45,17 +67,17 @@ XenStat::~XenStat()
 
 vector<domid_t> XenStat::getRunningDoms()
 {
-	vector<domid_t> runningDomains;
+	sample();
 
-	vector<xc_domaininfo_t> domInfos;
+	lock_guard<mutex> lock(mMutex);
 
-	mInterface.getDomainsInfo(domInfos);
+	vector<domid_t> runningDomains;
 
-	for(auto info : domInfos)
+	for(auto& stats : mSnapshot)
 	{
-		if (info.flags & XEN_DOMINF_running)
+		if (stats.flags & XEN_DOMINF_running)
 		{
-			runningDomains.push_back(info.domain);
+			runningDomains.push_back(stats.domId);
 		}
 	}
 
@@ -64,18 +86,218 @@ vector<domid_t> XenStat::getRunningDoms()
 
 vector<domid_t> XenStat::getExistingDoms()
 {
-	vector<domid_t> existingDomains;
+	sample();
+
+	lock_guard<mutex> lock(mMutex);
 
-	vector<xc_domaininfo_t> domInfos;
+	vector<domid_t> existingDomains;
 
-	mInterface.getDomainsInfo(domInfos);
+	existingDomains.reserve(mSnapshot.size());
 
-	for(auto info : domInfos)
+	for(auto& stats : mSnapshot)
 	{
-		existingDomains.push_back(info.domain);
+		existingDomains.push_back(stats.domId);
 	}
 
 	return existingDomains;
 }
 
+void XenStat::sample()
+{
+	lock_guard<mutex> sampleLock(mSampleMutex);
+
+	mInterface.getDomainsInfo(mInfos);
+
+	auto now = steady_clock::now();
+
+	ChangeCallback callback;
+
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		double period = mNumSamples ?
+						duration<double>(now - mSampleTime).count() : 0.0;
+
+		update(period);
+
+		mSampleTime = now;
+		mNumSamples++;
+
+		callback = mChangeCallback;
+	}
+
+	// the snapshot lock is released, so the callback may read it
+
+	if (callback)
+	{
+		for(auto& change : mChanges)
+		{
+			callback(change);
+		}
+	}
+}
+
+void XenStat::start(milliseconds period)
+{
+	LOG(mLog, DEBUG) << "Start sampling, period: " << period.count() << " ms";
+
+	mTimer.start(period);
+}
+
+void XenStat::stop()
+{
+	mTimer.stop();
+}
+
+vector<DomainStats> XenStat::getSnapshot() const
+{
+	lock_guard<mutex> lock(mMutex);
+
+	return mSnapshot;
+}
+
+bool XenStat::getDomainStats(domid_t domId, DomainStats& stats) const
+{
+	lock_guard<mutex> lock(mMutex);
+
+	auto it = lower_bound(mSnapshot.begin(), mSnapshot.end(), domId,
+						  [](const DomainStats& stats, domid_t domId)
+						  { return stats.domId < domId; });
+
+	if (it == mSnapshot.end() || it->domId != domId)
+	{
+		return false;
+	}
+
+	stats = *it;
+
+	return true;
+}
+
+void XenStat::setChangeCallback(ChangeCallback callback)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	mChangeCallback = callback;
+}
+
+uint64_t XenStat::getNumSamples() const
+{
+	lock_guard<mutex> lock(mMutex);
+
+	return mNumSamples;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void XenStat::update(double period)
+{
+	// both the infos and the snapshot are sorted by domain id, so the
+	// previous snapshot is merged in one pass
+
+	mSnapshot.swap(mPrevSnapshot);
+	mSnapshot.clear();
+	mChanges.clear();
+
+	size_t prev = 0;
+
+	for(auto& info : mInfos)
+	{
+		while (prev < mPrevSnapshot.size() &&
+			   mPrevSnapshot[prev].domId < info.domain)
+		{
+			addChange(DomainChange::Event::DESTROYED, mPrevSnapshot[prev++]);
+		}
+
+		DomainStats stats = {};
+
+		stats.domId = info.domain;
+		stats.flags = info.flags;
+		stats.cpuTime = info.cpu_time;
+		stats.totPages = info.tot_pages;
+		stats.numVcpus = info.nr_online_vcpus;
+
+		const DomainStats* last = nullptr;
+
+		if (prev < mPrevSnapshot.size() &&
+			mPrevSnapshot[prev].domId == info.domain)
+		{
+			last = &mPrevSnapshot[prev++];
+
+			// CPU time can't go back unless the id is reused by a new domain
+			if (stats.cpuTime < last->cpuTime)
+			{
+				addChange(DomainChange::Event::DESTROYED, *last);
+
+				last = nullptr;
+			}
+		}
+
+		if (!last)
+		{
+			mSnapshot.push_back(stats);
+
+			addChange(DomainChange::Event::CREATED, stats);
+
+			continue;
+		}
+
+		stats.pagesDelta = stats.totPages - last->totPages;
+		stats.vcpusDelta = stats.numVcpus - last->numVcpus;
+		stats.changedFlags = (stats.flags ^ last->flags) & cStateFlags;
+
+		if (period > 0.0)
+		{
+			stats.cpuUsage = (stats.cpuTime - last->cpuTime) / 1e9 / period;
+			stats.pagesRate = stats.pagesDelta / period;
+		}
+
+		mSnapshot.push_back(stats);
+
+		if (stats.changedFlags)
+		{
+			addChange(DomainChange::Event::STATE_CHANGED, stats);
+		}
+
+		if (stats.vcpusDelta)
+		{
+			addChange(DomainChange::Event::VCPUS_CHANGED, stats);
+		}
+
+		if (stats.pagesDelta)
+		{
+			addChange(DomainChange::Event::MEMORY_CHANGED, stats);
+		}
+	}
+
+	while (prev < mPrevSnapshot.size())
+	{
+		addChange(DomainChange::Event::DESTROYED, mPrevSnapshot[prev++]);
+	}
+}
+
+void XenStat::addChange(DomainChange::Event event, const DomainStats& stats)
+{
+	DomainChange change;
+
+	change.event = event;
+	change.stats = stats;
+
+	mChanges.push_back(change);
+}
+
+void XenStat::onTimer()
+{
+	try
+	{
+		sample();
+	}
+	catch(const exception& e)
+	{
+		LOG(mLog, ERROR) << e.what();
+	}
+}
+
 }
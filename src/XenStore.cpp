@@ -19,13 +19,22 @@
  */
 #include "XenStore.hpp"
 
+#include <algorithm>
+
 #include <poll.h>
 
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
 using std::lock_guard;
+using std::min;
 using std::mutex;
+using std::shared_ptr;
 using std::string;
 using std::thread;
 using std::to_string;
+using std::unique_lock;
 using std::vector;
 
 namespace XenBackend {
@@ -34,10 +43,16 @@ namespace XenBackend {
  * XenStore
  ******************************************************************************/
 
+const milliseconds XenStore::cMinReconnectDelay(10);
+const milliseconds XenStore::cMaxReconnectDelay(5000);
+
 XenStore::XenStore(ErrorCallback errorCallback) :
-	mXsHandle(nullptr),
 	mErrorCallback(errorCallback),
 	mStarted(false),
+	mStopping(false),
+	mMinReconnectDelay(cMinReconnectDelay),
+	mMaxReconnectDelay(cMaxReconnectDelay),
+	mStats(),
 	mLog("XenStore")
 {
 	try
@@ -67,7 +82,8 @@ XenStore::~XenStore()
 
 string XenStore::getDomainPath(domid_t domId)
 {
-	auto domPath = xs_get_domain_path(mXsHandle, domId);
+	auto handle = getHandle();
+	auto domPath = xs_get_domain_path(handle.get(), domId);
 
 	if (!domPath)
 	{
@@ -101,9 +117,10 @@ unsigned int XenStore::readUint(const string& path)
 
 string XenStore::readString(const string& path)
 {
+	auto handle = getHandle();
 	unsigned length;
-	auto pData = static_cast<char*>(xs_read(mXsHandle, XBT_NULL, path.c_str(),
-											&length));
+	auto pData = static_cast<char*>(xs_read(handle.get(), XBT_NULL,
+											path.c_str(), &length));
 
 	if (!pData)
 	{
@@ -119,6 +136,43 @@ string XenStore::readString(const string& path)
 	return result;
 }
 
+bool XenStore::readIntIfExist(const string& path, int& value)
+{
+	string strValue;
+
+	if (!readStringIfExist(path, strValue))
+	{
+		return false;
+	}
+
+	value = stoi(strValue);
+
+	LOG(mLog, DEBUG) << "Read int " << path << " : " << value;
+
+	return true;
+}
+
+bool XenStore::readStringIfExist(const string& path, string& value)
+{
+	auto handle = getHandle();
+	unsigned length;
+	auto pData = static_cast<char*>(xs_read(handle.get(), XBT_NULL,
+											path.c_str(), &length));
+
+	if (!pData)
+	{
+		return false;
+	}
+
+	value = pData;
+
+	free(pData);
+
+	LOG(mLog, DEBUG) << "Read string " << path << " : " << value;
+
+	return true;
+}
+
 void XenStore::writeInt(const string& path, int value)
 {
 	auto strValue = to_string(value);
@@ -141,7 +195,9 @@ void XenStore::writeString(const string& path, const string& value)
 {
 	LOG(mLog, DEBUG) << "Write string " << path << " : " << value;
 
-	if (!xs_write(mXsHandle, XBT_NULL, path.c_str(), value.c_str(),
+	auto handle = getHandle();
+
+	if (!xs_write(handle.get(), XBT_NULL, path.c_str(), value.c_str(),
 				  value.length()))
 	{
 		throw XenStoreException("Can't write value to " + path, errno);
@@ -152,7 +208,9 @@ void XenStore::removePath(const string& path)
 {
 	LOG(mLog, DEBUG) << "Remove path " << path;
 
-	if (!xs_rm(mXsHandle, XBT_NULL, path.c_str()))
+	auto handle = getHandle();
+
+	if (!xs_rm(handle.get(), XBT_NULL, path.c_str()))
 	{
 		throw XenStoreException("Can't remove path " + path, errno);
 	}
@@ -160,8 +218,9 @@ void XenStore::removePath(const string& path)
 
 vector<string> XenStore::readDirectory(const string& path)
 {
+	auto handle = getHandle();
 	unsigned int num;
-	auto items = xs_directory(mXsHandle, XBT_NULL, path.c_str(), &num);
+	auto items = xs_directory(handle.get(), XBT_NULL, path.c_str(), &num);
 
 	if (items && num)
 	{
@@ -184,8 +243,9 @@ vector<string> XenStore::readDirectory(const string& path)
 
 bool XenStore::checkIfExist(const string& path)
 {
+	auto handle = getHandle();
 	unsigned length;
-	auto pData = xs_read(mXsHandle, XBT_NULL, path.c_str(), &length);
+	auto pData = xs_read(handle.get(), XBT_NULL, path.c_str(), &length);
 
 	if (!pData)
 	{
@@ -203,7 +263,7 @@ void XenStore::setWatch(const string& path, WatchCallback callback)
 
 	LOG(mLog, DEBUG) << "Set watch: " << path;
 
-	if (!xs_watch(mXsHandle, path.c_str(), path.c_str()))
+	if (!xs_watch(getHandle().get(), path.c_str(), path.c_str()))
 	{
 		throw XenStoreException("Can't set xs watch for " + path, errno);
 	}
@@ -217,7 +277,7 @@ void XenStore::clearWatch(const string& path)
 
 	LOG(mLog, DEBUG) << "Clear watch: " << path;
 
-	if (!xs_unwatch(mXsHandle, path.c_str(), path.c_str()))
+	if (!xs_unwatch(getHandle().get(), path.c_str(), path.c_str()))
 	{
 		LOG(mLog, ERROR) << "Failed to clear watch: " << path;
 	}
@@ -233,9 +293,12 @@ void XenStore::clearWatches()
 	{
 		LOG(mLog, DEBUG) << "Clear watches";
 
+		auto handle = getHandle();
+
 		for (auto watch : mWatches)
 		{
-			if (!xs_unwatch(mXsHandle, watch.first.c_str(), watch.first.c_str()))
+			if (!xs_unwatch(handle.get(), watch.first.c_str(),
+							watch.first.c_str()))
 			{
 				LOG(mLog, ERROR) << "Failed to clear watch: " << watch.first;
 			}
@@ -268,9 +331,18 @@ void XenStore::stop()
 
 	DLOG(mLog, DEBUG) << "Stop";
 
-	if (mPollFd)
 	{
-		mPollFd->stop();
+		// the poll fd is replaced on reconnect under the same lock
+		lock_guard<mutex> lock(mMutex);
+
+		mStopping = true;
+
+		if (mPollFd)
+		{
+			mPollFd->stop();
+		}
+
+		mCondVar.notify_all();
 	}
 
 	if (mThread.joinable())
@@ -278,23 +350,41 @@ void XenStore::stop()
 		mThread.join();
 	}
 
+	mStopping = false;
 	mStarted = false;
 }
 
+void XenStore::setReconnectCallback(ReconnectCallback reconnectCallback)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	mReconnectCallback = reconnectCallback;
+}
+
+void XenStore::setReconnectDelay(milliseconds minDelay, milliseconds maxDelay)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	mMinReconnectDelay = minDelay;
+	mMaxReconnectDelay = maxDelay;
+}
+
+XenStoreStats XenStore::getStats() const
+{
+	lock_guard<mutex> lock(mMutex);
+
+	return mStats;
+}
+
 /*******************************************************************************
  * Private
  ******************************************************************************/
 
 void XenStore::init()
 {
-	mXsHandle = xs_open(0);
+	mXsHandle = openHandle();
 
-	if (!mXsHandle)
-	{
-		throw XenStoreException("Can't open xs daemon", errno);
-	}
-
-	mPollFd.reset(new PollFd(xs_fileno(mXsHandle), POLLIN));
+	mPollFd.reset(new PollFd(xs_fileno(mXsHandle.get()), POLLIN));
 
 	LOG(mLog, DEBUG) << "Create xen store";
 }
@@ -303,18 +393,181 @@ void XenStore::release()
 {
 	if (mXsHandle)
 	{
-		xs_close(mXsHandle);
+		// closed by the last request which uses it
+		std::atomic_store(&mXsHandle, shared_ptr<xs_handle>());
 
 		LOG(mLog, DEBUG) << "Delete xen store";
 	}
 }
 
+shared_ptr<xs_handle> XenStore::openHandle()
+{
+	auto handle = xs_open(0);
+
+	if (!handle)
+	{
+		throw XenStoreException("Can't open xs daemon", errno);
+	}
+
+	return shared_ptr<xs_handle>(handle, xs_close);
+}
+
+bool XenStore::waitWatch()
+{
+	while(true)
+	{
+		try
+		{
+			return mPollFd->poll();
+		}
+		catch(const std::exception& e)
+		{
+			lock_guard<mutex> lock(mMutex);
+
+			if (mMaxReconnectDelay == milliseconds::zero())
+			{
+				throw;
+			}
+
+			LOG(mLog, WARNING) << "Connection lost: " << e.what();
+		}
+
+		if (!reconnect())
+		{
+			return false;
+		}
+	}
+}
+
+bool XenStore::reconnect()
+{
+	auto lostTime = steady_clock::now();
+	milliseconds delay, maxDelay;
+
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		delay = mMinReconnectDelay;
+		maxDelay = mMaxReconnectDelay;
+	}
+
+	while(!restoreConnection())
+	{
+		unique_lock<mutex> lock(mMutex);
+
+		if (mStopping)
+		{
+			return false;
+		}
+
+		mStats.failedAttempts++;
+
+		LOG(mLog, WARNING) << "Reconnect failed, retry in: " << delay.count()
+						   << " ms";
+
+		if (mCondVar.wait_for(lock, delay, [this] { return mStopping; }))
+		{
+			return false;
+		}
+
+		delay = min(delay * 2, maxDelay);
+	}
+
+	ReconnectCallback callback;
+
+	{
+		lock_guard<mutex> lock(mMutex);
+
+		if (mStopping)
+		{
+			return false;
+		}
+
+		// the stats are published before the callback, so the client sees
+		// the reconnect counted when it resyncs
+
+		auto recoveryTime = duration_cast<microseconds>(steady_clock::now() -
+														lostTime);
+
+		mStats.reconnects++;
+		mStats.lastRecoveryTime = recoveryTime;
+
+		if (recoveryTime > mStats.maxRecoveryTime)
+		{
+			mStats.maxRecoveryTime = recoveryTime;
+		}
+
+		LOG(mLog, INFO) << "Connection restored in: " << recoveryTime.count()
+						<< " us, watches: " << mWatches.size();
+
+		callback = mReconnectCallback;
+	}
+
+	if (callback)
+	{
+		// watch events may be lost while the connection was down
+		try
+		{
+			callback();
+		}
+		catch(const std::exception& e)
+		{
+			LOG(mLog, ERROR) << "Resync failed: " << e.what();
+		}
+	}
+
+	return true;
+}
+
+bool XenStore::restoreConnection()
+{
+	shared_ptr<xs_handle> handle;
+	std::unique_ptr<PollFd> pollFd;
+
+	try
+	{
+		handle = openHandle();
+
+		pollFd.reset(new PollFd(xs_fileno(handle.get()), POLLIN));
+	}
+	catch(const std::exception& e)
+	{
+		LOG(mLog, DEBUG) << e.what();
+
+		return false;
+	}
+
+	lock_guard<mutex> lock(mMutex);
+
+	// stop() has to find the new poll fd, otherwise it stays in poll
+	if (mStopping)
+	{
+		return true;
+	}
+
+	for (auto watch : mWatches)
+	{
+		if (!xs_watch(handle.get(), watch.first.c_str(), watch.first.c_str()))
+		{
+			LOG(mLog, DEBUG) << "Can't set xs watch for " << watch.first;
+
+			return false;
+		}
+	}
+
+	std::atomic_store(&mXsHandle, handle);
+
+	mPollFd.swap(pollFd);
+
+	return true;
+}
+
 string XenStore::readXsWatch(string& token)
 {
 	string path;
 	unsigned int num;
 
-	auto result = xs_read_watch(mXsHandle, &num);
+	auto result = xs_read_watch(getHandle().get(), &num);
 
 	if (result)
 	{
@@ -352,7 +605,7 @@ void XenStore::watchesThread()
 {
 	try
 	{
-		while(mPollFd->poll())
+		while(waitWatch())
 		{
 			string token;
 
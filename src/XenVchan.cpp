@@ -0,0 +1,423 @@
+/*
+ *  Xen vchan wrapper
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include "XenVchan.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+using std::chrono::milliseconds;
+using std::exception;
+using std::lock_guard;
+using std::min;
+using std::mutex;
+using std::to_string;
+using std::unique_lock;
+
+namespace XenBackend {
+
+namespace {
+
+// libxenvchan ring placement
+
+const uint16_t cSmallRingOrder = 10;
+const uint16_t cLargeRingOrder = 11;
+const uint16_t cPageOrder = 12;
+const uint16_t cMaxRingOrder = 24;
+
+const size_t cSmallRingOffset = 1024;
+const size_t cLargeRingOffset = 2048;
+
+size_t getNumPages(uint16_t order)
+{
+	return order < cPageOrder ? 0 : 1 << (order - cPageOrder);
+}
+
+}
+
+/*******************************************************************************
+ * XenVchan
+ ******************************************************************************/
+
+XenVchan::XenVchan(domid_t domId, grant_ref_t ref, evtchn_port_t port,
+				   Callback callback, ErrorCallback errorCallback) :
+	mIntfBuffer(domId, ref),
+	mIntf(static_cast<vchan_interface*>(mIntfBuffer.get())),
+	mCallback(callback),
+	mBytesRead(0),
+	mBytesWritten(0),
+	mEvents(0),
+	mNotifications(0),
+	mLog("XenVchan"),
+	mEventChannel(domId, port, [this] { onEvent(); }, errorCallback)
+{
+	uint16_t leftOrder = mIntf->left_order;
+	uint16_t rightOrder = mIntf->right_order;
+
+	for (auto order : { leftOrder, rightOrder })
+	{
+		if (order < cSmallRingOrder || order > cMaxRingOrder)
+		{
+			throw XenVchanException("Invalid ring order: " + to_string(order),
+									EINVAL);
+		}
+	}
+
+	auto leftPages = getNumPages(leftOrder);
+	auto rightPages = getNumPages(rightOrder);
+
+	if (leftOrder == cLargeRingOrder && rightOrder == cLargeRingOrder)
+	{
+		throw XenVchanException("Both rings can't be in the interface page",
+								EINVAL);
+	}
+
+	if ((leftPages + rightPages) * sizeof(mIntf->grants[0]) >
+		XC_PAGE_SIZE - sizeof(vchan_interface))
+	{
+		throw XenVchanException("Too many ring pages", EINVAL);
+	}
+
+	GrantRefs refs(&mIntf->grants[0], &mIntf->grants[leftPages + rightPages]);
+
+	// the peer reads left ring and writes right ring
+
+	initRing(domId, mWrite, &mIntf->left, leftOrder, refs.data());
+	initRing(domId, mRead, &mIntf->right, rightOrder,
+			 refs.data() + leftPages);
+
+	mIntf->srv_notify = VCHAN_NOTIFY_WRITE;
+
+	xen_mb();
+
+	mIntf->cli_live = 1;
+
+	LOG(mLog, DEBUG) << "Connected, dom: " << domId << ", ref: " << ref
+					 << ", port: " << port << ", read size: " << mRead.size
+					 << ", write size: " << mWrite.size;
+}
+
+XenVchan::~XenVchan()
+{
+	mIntf->cli_live = 0;
+
+	xen_mb();
+
+	try
+	{
+		mEventChannel.notify();
+	}
+	catch(const exception& e)
+	{
+		LOG(mLog, ERROR) << e.what();
+	}
+
+	mEventChannel.stop();
+
+	{
+		lock_guard<mutex> lock(mMutex);
+	}
+
+	mCondVar.notify_all();
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+void XenVchan::start()
+{
+	mEventChannel.start();
+}
+
+void XenVchan::stop()
+{
+	mEventChannel.stop();
+}
+
+bool XenVchan::isOpen() const
+{
+	return mIntf->srv_live == 1;
+}
+
+size_t XenVchan::getReadSize() const
+{
+	return getUsed(mRead);
+}
+
+size_t XenVchan::getWriteSize() const
+{
+	return mWrite.size - getUsed(mWrite);
+}
+
+size_t XenVchan::getReadSpans(iovec* iov, int& count)
+{
+	auto size = getUsed(mRead);
+
+	count = getSpans(mRead, mRead.shared->cons, size, iov);
+
+	return size;
+}
+
+void XenVchan::consume(size_t size)
+{
+	xen_mb();
+
+	mRead.shared->cons += size;
+
+	mBytesRead += size;
+
+	sendNotify(VCHAN_NOTIFY_READ);
+}
+
+size_t XenVchan::getWriteSpans(iovec* iov, int& count)
+{
+	auto size = mWrite.size - getUsed(mWrite);
+
+	count = getSpans(mWrite, mWrite.shared->prod, size, iov);
+
+	return size;
+}
+
+void XenVchan::produce(size_t size)
+{
+	xen_wmb();
+
+	mWrite.shared->prod += size;
+
+	mBytesWritten += size;
+
+	sendNotify(VCHAN_NOTIFY_WRITE);
+}
+
+size_t XenVchan::read(void* data, size_t size)
+{
+	iovec iov[2];
+	int count;
+
+	size = min(size, getReadSpans(iov, count));
+
+	auto dst = static_cast<uint8_t*>(data);
+	size_t copied = 0;
+
+	for (int i = 0; i < count && copied < size; i++)
+	{
+		auto chunk = min(iov[i].iov_len, size - copied);
+
+		memcpy(&dst[copied], iov[i].iov_base, chunk);
+
+		copied += chunk;
+	}
+
+	if (size)
+	{
+		consume(size);
+	}
+
+	return size;
+}
+
+size_t XenVchan::write(const void* data, size_t size)
+{
+	iovec iov[2];
+	int count;
+
+	size = min(size, getWriteSpans(iov, count));
+
+	auto src = static_cast<const uint8_t*>(data);
+	size_t copied = 0;
+
+	for (int i = 0; i < count && copied < size; i++)
+	{
+		auto chunk = min(iov[i].iov_len, size - copied);
+
+		memcpy(iov[i].iov_base, &src[copied], chunk);
+
+		copied += chunk;
+	}
+
+	if (size)
+	{
+		produce(size);
+	}
+
+	return size;
+}
+
+bool XenVchan::waitRead(size_t size, int timeoutMs)
+{
+	unique_lock<mutex> lock(mMutex);
+
+	mCondVar.wait_for(lock, milliseconds(timeoutMs), [this, size] {
+		if (getReadSize() >= size || !isOpen())
+		{
+			return true;
+		}
+
+		// the notification is requested before indexes are checked again,
+		// so the peer write between the checks is not missed
+
+		requestNotify(VCHAN_NOTIFY_WRITE);
+
+		return getReadSize() >= size || !isOpen();
+	});
+
+	return getReadSize() >= size;
+}
+
+bool XenVchan::waitWrite(size_t size, int timeoutMs)
+{
+	unique_lock<mutex> lock(mMutex);
+
+	mCondVar.wait_for(lock, milliseconds(timeoutMs), [this, size] {
+		if (getWriteSize() >= size || !isOpen())
+		{
+			return true;
+		}
+
+		requestNotify(VCHAN_NOTIFY_READ);
+
+		return getWriteSize() >= size || !isOpen();
+	});
+
+	return getWriteSize() >= size && isOpen();
+}
+
+XenVchanStats XenVchan::getStats() const
+{
+	XenVchanStats stats;
+
+	stats.bytesRead = mBytesRead;
+	stats.bytesWritten = mBytesWritten;
+	stats.events = mEvents;
+	stats.notifications = mNotifications;
+
+	return stats;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void XenVchan::initRing(domid_t domId, Ring& ring, ring_shared* shared,
+						uint16_t order, const grant_ref_t* refs)
+{
+	ring.shared = shared;
+	ring.size = static_cast<size_t>(1) << order;
+
+	if (order == cSmallRingOrder)
+	{
+		ring.buffer = static_cast<uint8_t*>(mIntfBuffer.get()) +
+					  cSmallRingOffset;
+	}
+	else if (order == cLargeRingOrder)
+	{
+		ring.buffer = static_cast<uint8_t*>(mIntfBuffer.get()) +
+					  cLargeRingOffset;
+	}
+	else
+	{
+		ring.pages.reset(new XenGnttabBuffer(domId, refs,
+											 getNumPages(order)));
+
+		ring.buffer = static_cast<uint8_t*>(ring.pages->get());
+	}
+}
+
+void XenVchan::requestNotify(uint8_t bit)
+{
+	__sync_or_and_fetch(&mIntf->srv_notify, bit);
+
+	xen_mb();
+}
+
+void XenVchan::sendNotify(uint8_t bit)
+{
+	xen_mb();
+
+	auto prev = __sync_fetch_and_and(&mIntf->cli_notify, ~bit);
+
+	if (prev & bit)
+	{
+		mEventChannel.notify();
+
+		mNotifications++;
+	}
+}
+
+void XenVchan::onEvent()
+{
+	mEvents++;
+
+	{
+		lock_guard<mutex> lock(mMutex);
+	}
+
+	mCondVar.notify_all();
+
+	if (mCallback)
+	{
+		mCallback();
+	}
+}
+
+size_t XenVchan::getUsed(const Ring& ring) const
+{
+	uint32_t cons = ring.shared->cons;
+	uint32_t prod = ring.shared->prod;
+
+	xen_rmb();
+
+	size_t used = prod - cons;
+
+	if (used > ring.size)
+	{
+		throw XenVchanException("Ring indexes are corrupted", EIO);
+	}
+
+	return used;
+}
+
+int XenVchan::getSpans(const Ring& ring, uint32_t index, size_t size,
+					   iovec* iov)
+{
+	if (size == 0)
+	{
+		return 0;
+	}
+
+	auto offset = index & (ring.size - 1);
+	auto first = min(size, ring.size - offset);
+
+	iov[0].iov_base = &ring.buffer[offset];
+	iov[0].iov_len = first;
+
+	if (first == size)
+	{
+		return 1;
+	}
+
+	iov[1].iov_base = ring.buffer;
+	iov[1].iov_len = size - first;
+
+	return 2;
+}
+
+}
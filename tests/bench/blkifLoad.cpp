@@ -0,0 +1,372 @@
+/*
+ *  Blkif load generator
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+/*******************************************************************************
+ * fio like load generator for the blkif backend running on the loopback
+ * harness (Xen mocks). Usage:
+ *
+ * blkifLoad [--rw read|write|randread|randwrite|randrw] [--bs KB] [--qd N]
+ *           [--queues N] [--order N] [--runtime S] [--size MB]
+ *           [--no-persistent] [--file PATH]
+ ******************************************************************************/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "BlkifBackend.hpp"
+#include "Log.hpp"
+#include "loopback/BlkifFrontend.hpp"
+
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::cout;
+using std::endl;
+using std::mt19937_64;
+using std::sort;
+using std::string;
+using std::thread;
+using std::vector;
+
+using XenBackend::BlkifConfig;
+using XenBackend::BlkifFrontendHandler;
+using XenBackend::Log;
+
+struct Options
+{
+	string rw = "randread";
+	size_t bs = 4;
+	unsigned int qd = 32;
+	unsigned int queues = 1;
+	unsigned int order = 2;
+	unsigned int runtime = 5;
+	size_t size = 256;
+	bool persistent = true;
+	string file;
+};
+
+struct Result
+{
+	uint64_t reads = 0;
+	uint64_t writes = 0;
+	uint64_t errors = 0;
+	vector<uint32_t> latencies;
+};
+
+static bool parseOptions(int argc, char* argv[], Options& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+
+		if (arg == "--rw" && hasValue)
+		{
+			options.rw = argv[++i];
+		}
+		else if (arg == "--bs" && hasValue)
+		{
+			options.bs = strtoul(argv[++i], nullptr, 0);
+		}
+		else if (arg == "--qd" && hasValue)
+		{
+			options.qd = strtoul(argv[++i], nullptr, 0);
+		}
+		else if (arg == "--queues" && hasValue)
+		{
+			options.queues = strtoul(argv[++i], nullptr, 0);
+		}
+		else if (arg == "--order" && hasValue)
+		{
+			options.order = strtoul(argv[++i], nullptr, 0);
+		}
+		else if (arg == "--runtime" && hasValue)
+		{
+			options.runtime = strtoul(argv[++i], nullptr, 0);
+		}
+		else if (arg == "--size" && hasValue)
+		{
+			options.size = strtoul(argv[++i], nullptr, 0);
+		}
+		else if (arg == "--file" && hasValue)
+		{
+			options.file = argv[++i];
+		}
+		else if (arg == "--no-persistent")
+		{
+			options.persistent = false;
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	return options.bs > 0 && options.bs % 4 == 0 && options.qd > 0 &&
+		   options.queues > 0;
+}
+
+static void runQueue(BlkifFrontend& frontend, unsigned int queue,
+					 const Options& options, Result& result)
+{
+	mt19937_64 random(queue + 1);
+
+	uint64_t sectorsPerIo = options.bs * 2;
+	uint64_t numBlocks = frontend.getSectors() / sectorsPerIo;
+	uint64_t nextBlock = queue * numBlocks / options.queues;
+	bool randomAccess = options.rw.compare(0, 4, "rand") == 0;
+
+	vector<steady_clock::time_point> submitTimes(256);
+	vector<uint8_t> operations(256);
+	vector<BlkifFrontend::Response> rsps;
+
+	unsigned int inFlight = 0;
+	auto end = steady_clock::now() + seconds(options.runtime);
+
+	while (true)
+	{
+		bool running = steady_clock::now() < end;
+
+		while (running && inFlight < options.qd)
+		{
+			uint64_t block = randomAccess ? random() % numBlocks :
+											nextBlock++ % numBlocks;
+			uint8_t op = BLKIF_OP_READ;
+
+			if (options.rw == "write" || options.rw == "randwrite" ||
+				(options.rw == "randrw" && random() % 2))
+			{
+				op = BLKIF_OP_WRITE;
+			}
+
+			uint64_t id;
+
+			if (!frontend.queueRequest(queue, op, block * sectorsPerIo,
+									   sectorsPerIo, id))
+			{
+				break;
+			}
+
+			submitTimes.at(id) = steady_clock::now();
+			operations.at(id) = op;
+
+			inFlight++;
+		}
+
+		frontend.kick(queue);
+
+		if (!inFlight)
+		{
+			break;
+		}
+
+		rsps.clear();
+
+		if (!frontend.getResponses(queue, rsps))
+		{
+			cout << "Queue " << queue << ": response timeout" << endl;
+
+			break;
+		}
+
+		auto now = steady_clock::now();
+
+		for (auto& rsp : rsps)
+		{
+			result.latencies.push_back(duration_cast<microseconds>(
+					now - submitTimes[rsp.id]).count());
+
+			if (rsp.status != BLKIF_RSP_OKAY)
+			{
+				result.errors++;
+			}
+			else if (operations[rsp.id] == BLKIF_OP_READ)
+			{
+				result.reads++;
+			}
+			else
+			{
+				result.writes++;
+			}
+		}
+
+		inFlight -= rsps.size();
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	Options options;
+
+	if (!parseOptions(argc, argv, options))
+	{
+		cout << "Usage: " << argv[0]
+			 << " [--rw read|write|randread|randwrite|randrw] [--bs KB]"
+			 << " [--qd N] [--queues N] [--order N] [--runtime S]"
+			 << " [--size MB] [--no-persistent] [--file PATH]" << endl;
+
+		return 1;
+	}
+
+	Log::setLogMask("*:Disable");
+
+	string image = options.file;
+
+	if (image.empty())
+	{
+		char path[] = "/tmp/blkifLoadXXXXXX";
+
+		int fd = mkstemp(path);
+
+		if (fd < 0 || ftruncate(fd, options.size << 20) < 0)
+		{
+			cout << "Can't create image: " << strerror(errno) << endl;
+
+			return 1;
+		}
+
+		close(fd);
+
+		image = path;
+	}
+
+	BlkifFrontend::Config feConfig;
+
+	feConfig.image = image;
+	feConfig.numQueues = options.queues;
+	feConfig.ringPageOrder = options.order;
+	feConfig.persistent = options.persistent;
+	feConfig.maxPages = options.bs / 4;
+
+	BlkifConfig beConfig;
+
+	beConfig.maxQueues = std::max(beConfig.maxQueues, options.queues);
+	beConfig.ioDepth = std::max(beConfig.ioDepth, options.qd);
+
+	vector<Result> results(options.queues);
+	uint64_t batches = 0, responses = 0, hits = 0, maps = 0;
+	microseconds elapsed;
+
+	try
+	{
+		BlkifFrontend frontend(0, 1, 0, feConfig);
+		BlkifFrontendHandler handler("vbd", 0, 1, 0, beConfig);
+
+		handler.start();
+
+		if (!frontend.connect())
+		{
+			cout << "Can't connect to backend" << endl;
+
+			return 1;
+		}
+
+		vector<thread> threads;
+
+		auto start = steady_clock::now();
+
+		for (unsigned int i = 0; i < options.queues; i++)
+		{
+			threads.emplace_back(runQueue, std::ref(frontend), i,
+								 std::cref(options), std::ref(results[i]));
+		}
+
+		for (auto& t : threads)
+		{
+			t.join();
+		}
+
+		elapsed = duration_cast<microseconds>(steady_clock::now() - start);
+
+		for (auto& stats : handler.getStats())
+		{
+			batches += stats.responseBatches;
+			responses += stats.responses;
+			hits += stats.persistentHits;
+			maps += stats.persistentMaps;
+		}
+	}
+	catch(const std::exception& e)
+	{
+		cout << "Error: " << e.what() << endl;
+
+		return 1;
+	}
+
+	if (options.file.empty())
+	{
+		unlink(image.c_str());
+	}
+
+	Result total;
+
+	for (auto& result : results)
+	{
+		total.reads += result.reads;
+		total.writes += result.writes;
+		total.errors += result.errors;
+		total.latencies.insert(total.latencies.end(),
+							   result.latencies.begin(),
+							   result.latencies.end());
+	}
+
+	sort(total.latencies.begin(), total.latencies.end());
+
+	auto ios = total.reads + total.writes;
+	double secs = elapsed.count() / 1e6;
+	uint64_t sum = 0;
+
+	for (auto latency : total.latencies)
+	{
+		sum += latency;
+	}
+
+	auto percentile = [&total] (double p) -> uint32_t {
+		if (total.latencies.empty()) return 0;
+		return total.latencies[(total.latencies.size() - 1) * p];
+	};
+
+	cout << "rw=" << options.rw << " bs=" << options.bs << "k qd="
+		 << options.qd << " queues=" << options.queues << " order="
+		 << options.order << " persistent=" << options.persistent << endl;
+	cout << "  reads: " << total.reads << ", writes: " << total.writes
+		 << ", errors: " << total.errors << endl;
+	cout << "  iops: " << static_cast<uint64_t>(ios / secs)
+		 << ", bw: " << (ios * options.bs / 1024.0) / secs << " MiB/s" << endl;
+	cout << "  lat (us): avg " << (ios ? sum / total.latencies.size() : 0)
+		 << ", p50 " << percentile(0.5) << ", p99 " << percentile(0.99)
+		 << ", max " << percentile(1.0) << endl;
+	cout << "  responses per batch: "
+		 << (batches ? static_cast<double>(responses) / batches : 0)
+		 << ", persistent hits: " << hits << ", maps: " << maps << endl;
+
+	return total.errors ? 1 : 0;
+}
@@ -0,0 +1,297 @@
+/*
+ *  Frontend connect churn generator
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+/*******************************************************************************
+ * Frontend churn on the blkif backend running on the loopback harness (Xen
+ * mocks): --frontends devices are kept connected, each step replaces the
+ * oldest one with a new frontend and handler. Usage:
+ *
+ * connectChurn [--frontends N] [--steps N] [--queues N] [--arena KB]
+ *              [--size MB]
+ *
+ * --arena enables the per connection arena with the given chunk size. RSS and
+ * the heap statistics are printed after the warm up (the first --frontends
+ * steps) and at the end, compare the runs with and without the arena.
+ ******************************************************************************/
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <malloc.h>
+#include <unistd.h>
+
+#include "BlkifBackend.hpp"
+#include "Log.hpp"
+#include "loopback/BlkifFrontend.hpp"
+
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::steady_clock;
+using std::cout;
+using std::endl;
+using std::ifstream;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+using XenBackend::ArenaStats;
+using XenBackend::BlkifConfig;
+using XenBackend::BlkifFrontendHandler;
+using XenBackend::Log;
+
+struct Options
+{
+	unsigned int frontends = 16;
+	unsigned int steps = 1000;
+	unsigned int queues = 4;
+	size_t arena = 0;
+	size_t size = 16;
+};
+
+struct Device
+{
+	unique_ptr<BlkifFrontend> frontend;
+	unique_ptr<BlkifFrontendHandler> handler;
+};
+
+struct Memory
+{
+	size_t rss;
+	size_t heap;
+	size_t inUse;
+	size_t free;
+	size_t freeChunks;
+};
+
+static bool parseOptions(int argc, char* argv[], Options& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+
+		if (arg == "--frontends" && hasValue)
+		{
+			options.frontends = strtoul(argv[++i], nullptr, 0);
+		}
+		else if (arg == "--steps" && hasValue)
+		{
+			options.steps = strtoul(argv[++i], nullptr, 0);
+		}
+		else if (arg == "--queues" && hasValue)
+		{
+			options.queues = strtoul(argv[++i], nullptr, 0);
+		}
+		else if (arg == "--arena" && hasValue)
+		{
+			options.arena = strtoul(argv[++i], nullptr, 0);
+		}
+		else if (arg == "--size" && hasValue)
+		{
+			options.size = strtoul(argv[++i], nullptr, 0);
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	return options.frontends > 0 && options.frontends < 256 &&
+		   options.queues > 0;
+}
+
+static Memory getMemory()
+{
+	Memory memory {};
+
+	ifstream statm("/proc/self/statm");
+	size_t size = 0, resident = 0;
+
+	if (statm >> size >> resident)
+	{
+		memory.rss = resident * sysconf(_SC_PAGESIZE);
+	}
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+	auto info = mallinfo2();
+#else
+	auto info = mallinfo();
+#endif
+
+	memory.heap = info.arena + info.hblkhd;
+	memory.inUse = info.uordblks + info.hblkhd;
+	memory.free = info.fordblks;
+	memory.freeChunks = info.ordblks;
+
+	return memory;
+}
+
+static void printMemory(const string& name, const Memory& memory)
+{
+	cout << "  " << name << ": rss " << memory.rss / 1024
+		 << " KiB, heap " << memory.heap / 1024
+		 << " KiB, in use " << memory.inUse / 1024
+		 << " KiB, free " << memory.free / 1024
+		 << " KiB in " << memory.freeChunks << " chunks" << endl;
+}
+
+static void replaceDevice(Device& device, uint16_t devId,
+						  const string& image, const Options& options)
+{
+	// the handler closes the connection on deletion
+	device.handler.reset();
+	device.frontend.reset();
+
+	BlkifFrontend::Config feConfig;
+
+	feConfig.image = image;
+	feConfig.numQueues = options.queues;
+
+	BlkifConfig beConfig;
+
+	beConfig.maxQueues = std::max(beConfig.maxQueues, options.queues);
+
+	device.frontend.reset(new BlkifFrontend(0, 1, devId, feConfig));
+	device.handler.reset(new BlkifFrontendHandler("vbd", 0, 1, devId,
+												  beConfig));
+
+	device.handler->setArenaChunkSize(options.arena * 1024);
+	device.handler->start();
+
+	if (!device.frontend->connect())
+	{
+		throw std::runtime_error("Can't connect to backend");
+	}
+
+	char sector[512];
+
+	if (device.frontend->read(0, sector, 1) != BLKIF_RSP_OKAY)
+	{
+		throw std::runtime_error("Read failed");
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	Options options;
+
+	if (!parseOptions(argc, argv, options))
+	{
+		cout << "Usage: " << argv[0]
+			 << " [--frontends N] [--steps N] [--queues N] [--arena KB]"
+			 << " [--size MB]" << endl;
+
+		return 1;
+	}
+
+	Log::setLogMask("*:Disable");
+
+	char path[] = "/tmp/connectChurnXXXXXX";
+
+	int fd = mkstemp(path);
+
+	if (fd < 0 || ftruncate(fd, options.size << 20) < 0)
+	{
+		cout << "Can't create image: " << strerror(errno) << endl;
+
+		return 1;
+	}
+
+	close(fd);
+
+	Memory warm {}, end {};
+	ArenaStats arenaStats {};
+	microseconds elapsed;
+	int result = 0;
+
+	try
+	{
+		vector<Device> devices(options.frontends);
+
+		for (unsigned int i = 0; i < options.frontends; i++)
+		{
+			replaceDevice(devices[i], i, path, options);
+		}
+
+		warm = getMemory();
+
+		auto start = steady_clock::now();
+
+		for (unsigned int i = 0; i < options.steps; i++)
+		{
+			auto index = i % options.frontends;
+
+			replaceDevice(devices[index], index, path, options);
+		}
+
+		elapsed = duration_cast<microseconds>(steady_clock::now() - start);
+
+		end = getMemory();
+
+		arenaStats = devices[0].handler->getArenaStats();
+	}
+	catch(const std::exception& e)
+	{
+		cout << "Error: " << e.what() << endl;
+
+		result = 1;
+	}
+
+	unlink(path);
+
+	if (result)
+	{
+		return result;
+	}
+
+	cout << "frontends=" << options.frontends << " steps=" << options.steps
+		 << " queues=" << options.queues << " arena=" << options.arena
+		 << "k" << endl;
+	cout << "  connects: " << options.steps << ", rate: "
+		 << options.steps / (elapsed.count() / 1e6) << " /s" << endl;
+
+	printMemory("warm", warm);
+	printMemory("end ", end);
+
+	cout << "  rss growth: "
+		 << (static_cast<long>(end.rss) - static_cast<long>(warm.rss)) / 1024
+		 << " KiB, heap growth: "
+		 << (static_cast<long>(end.heap) - static_cast<long>(warm.heap)) / 1024
+		 << " KiB" << endl;
+
+	if (options.arena)
+	{
+		cout << "  arena per connection: " << arenaStats.chunks
+			 << " chunks, " << arenaStats.usedBytes << " of "
+			 << arenaStats.reservedBytes << " bytes, "
+			 << arenaStats.allocations << " allocations" << endl;
+	}
+
+	return 0;
+}
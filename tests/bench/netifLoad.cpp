@@ -0,0 +1,396 @@
+/*
+ *  Netif load generator
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+/*******************************************************************************
+ * Packet load generator for the netif backend running on the loopback
+ * harness (Xen mocks). Usage:
+ *
+ * netifLoad [--dir tx|rx] [--size BYTES] [--queues N] [--flows N]
+ *           [--batch N] [--runtime S] [--tap NAME]
+ *
+ * tx: the frontend sends packets to the device, rx: the device sends packets
+ * to the frontend. By default the device is in memory. With --tap the TAP
+ * interface is created; in rx direction packets are injected into it with
+ * AF_PACKET socket.
+ ******************************************************************************/
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "NetifBackend.hpp"
+#include "Log.hpp"
+#include "loopback/NetifFrontend.hpp"
+
+using std::atomic;
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::cout;
+using std::endl;
+using std::make_shared;
+using std::shared_ptr;
+using std::string;
+using std::thread;
+using std::unique_ptr;
+using std::vector;
+
+using XenBackend::Log;
+using XenBackend::NetifConfig;
+using XenBackend::NetifFrontendHandler;
+using XenBackend::NetifPacket;
+
+struct Options
+{
+	string dir = "tx";
+	size_t size = 1500;
+	unsigned int queues = 1;
+	unsigned int flows = 16;
+	unsigned int batch = 64;
+	unsigned int runtime = 5;
+	string tap;
+};
+
+static bool parseOptions(int argc, char* argv[], Options& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+
+		if (arg == "--dir" && hasValue)
+		{
+			options.dir = argv[++i];
+		}
+		else if (arg == "--size" && hasValue)
+		{
+			options.size = strtoul(argv[++i], nullptr, 0);
+		}
+		else if (arg == "--queues" && hasValue)
+		{
+			options.queues = strtoul(argv[++i], nullptr, 0);
+		}
+		else if (arg == "--flows" && hasValue)
+		{
+			options.flows = strtoul(argv[++i], nullptr, 0);
+		}
+		else if (arg == "--batch" && hasValue)
+		{
+			options.batch = strtoul(argv[++i], nullptr, 0);
+		}
+		else if (arg == "--runtime" && hasValue)
+		{
+			options.runtime = strtoul(argv[++i], nullptr, 0);
+		}
+		else if (arg == "--tap" && hasValue)
+		{
+			options.tap = argv[++i];
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	return (options.dir == "tx" || options.dir == "rx") &&
+		   options.size >= 64 && options.size <= 65000 &&
+		   options.queues > 0 && options.flows > 0 && options.batch > 0;
+}
+
+static vector<vector<uint8_t>> makeFrames(const Options& options)
+{
+	vector<vector<uint8_t>> frames;
+
+	for (unsigned int i = 0; i < options.flows; i++)
+	{
+		frames.push_back(NetifFrontend::makeFrame(IPPROTO_UDP, 10000 + i, 9,
+												  options.size - 42));
+	}
+
+	return frames;
+}
+
+static void runTx(NetifFrontend& frontend, unsigned int queue,
+				  const Options& options, atomic<bool>& running,
+				  uint64_t& packets)
+{
+	auto frames = makeFrames(options);
+	vector<int16_t> statuses;
+
+	// every data slot gets a response
+	size_t slotsPerPacket = (options.size + XC_PAGE_SIZE - 1) / XC_PAGE_SIZE;
+	size_t inFlight = 0, next = queue, completed = 0;
+
+	while (running || inFlight)
+	{
+		while (running && frontend.queuePacket(
+				queue, frames[next % frames.size()].data(),
+				frames[next % frames.size()].size()))
+		{
+			next++;
+			inFlight += slotsPerPacket;
+		}
+
+		frontend.kick(queue);
+
+		statuses.clear();
+
+		if (!frontend.getTxResponses(queue, statuses, 1000))
+		{
+			cout << "Queue " << queue << ": response timeout" << endl;
+
+			break;
+		}
+
+		for (auto status : statuses)
+		{
+			if (status == NETIF_RSP_OKAY)
+			{
+				completed++;
+			}
+		}
+
+		inFlight -= statuses.size();
+	}
+
+	packets = completed / slotsPerPacket;
+}
+
+static void runRx(NetifFrontend& frontend, unsigned int queue,
+				  atomic<bool>& running, uint64_t& packets)
+{
+	vector<NetifFrontend::Packet> received;
+
+	while (running)
+	{
+		received.clear();
+
+		packets += frontend.receivePackets(queue, received, 100);
+	}
+}
+
+static void injectMemory(NetifMemoryDevice& device, const Options& options,
+						 atomic<bool>& running)
+{
+	auto frames = makeFrames(options);
+	vector<NetifPacket> packets;
+
+	for (size_t i = 0; i < options.batch; i++)
+	{
+		auto& frame = frames[i % frames.size()];
+
+		NetifPacket packet {};
+
+		packet.data = frame.data();
+		packet.size = frame.size();
+
+		packets.push_back(packet);
+	}
+
+	while (running)
+	{
+		device.inject(packets.data(), packets.size());
+	}
+}
+
+static void injectTap(const Options& options, atomic<bool>& running)
+{
+	int fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+
+	sockaddr_ll addr {};
+
+	addr.sll_family = AF_PACKET;
+	addr.sll_protocol = htons(ETH_P_ALL);
+	addr.sll_ifindex = if_nametoindex(options.tap.c_str());
+
+	if (fd < 0 || bind(fd, reinterpret_cast<sockaddr*>(&addr),
+					   sizeof(addr)) < 0)
+	{
+		cout << "Can't create injector: " << strerror(errno) << endl;
+
+		return;
+	}
+
+	auto frames = makeFrames(options);
+	size_t next = 0;
+
+	while (running)
+	{
+		auto& frame = frames[next++ % frames.size()];
+
+		if (send(fd, frame.data(), frame.size(), 0) < 0 && errno == ENOBUFS)
+		{
+			std::this_thread::yield();
+		}
+	}
+
+	close(fd);
+}
+
+int main(int argc, char* argv[])
+{
+	Options options;
+
+	if (!parseOptions(argc, argv, options))
+	{
+		cout << "Usage: " << argv[0]
+			 << " [--dir tx|rx] [--size BYTES] [--queues N] [--flows N]"
+			 << " [--batch N] [--runtime S] [--tap NAME]" << endl;
+
+		return 1;
+	}
+
+	Log::setLogMask("*:Disable");
+
+	NetifFrontend::Config feConfig;
+
+	feConfig.numQueues = options.queues;
+
+	NetifConfig beConfig;
+
+	beConfig.maxQueues = std::max(beConfig.maxQueues, options.queues);
+	beConfig.rxBatch = options.batch;
+	beConfig.txBatch = options.batch;
+	beConfig.ifName = options.tap;
+
+	vector<uint64_t> packets(options.queues);
+	uint64_t grantCopies = 0, copyBatches = 0, dropped = 0;
+	microseconds elapsed;
+
+	try
+	{
+		NetifFrontend frontend(0, 1, 0, feConfig);
+
+		auto device = make_shared<NetifMemoryDevice>(false);
+		unique_ptr<NetifFrontendHandler> handler;
+
+		if (options.tap.empty())
+		{
+			handler.reset(new NetifLoopbackHandler(0, 1, 0, device, beConfig));
+		}
+		else
+		{
+			handler.reset(new NetifFrontendHandler("vif", 0, 1, 0, beConfig));
+		}
+
+		handler->start();
+
+		if (!frontend.connect())
+		{
+			cout << "Can't connect to backend" << endl;
+
+			return 1;
+		}
+
+		atomic<bool> running(true);
+		vector<thread> threads;
+
+		auto start = steady_clock::now();
+
+		for (unsigned int i = 0; i < options.queues; i++)
+		{
+			if (options.dir == "tx")
+			{
+				threads.emplace_back(runTx, std::ref(frontend), i,
+									 std::cref(options), std::ref(running),
+									 std::ref(packets[i]));
+			}
+			else
+			{
+				threads.emplace_back(runRx, std::ref(frontend), i,
+									 std::ref(running), std::ref(packets[i]));
+			}
+		}
+
+		if (options.dir == "rx")
+		{
+			if (options.tap.empty())
+			{
+				threads.emplace_back(injectMemory, std::ref(*device),
+									 std::cref(options), std::ref(running));
+			}
+			else
+			{
+				threads.emplace_back(injectTap, std::cref(options),
+									 std::ref(running));
+			}
+		}
+
+		std::this_thread::sleep_for(seconds(options.runtime));
+
+		running = false;
+
+		for (auto& t : threads)
+		{
+			t.join();
+		}
+
+		elapsed = duration_cast<microseconds>(steady_clock::now() - start);
+
+		for (auto& stats : handler->getStats())
+		{
+			grantCopies += stats.grantCopies;
+			copyBatches += stats.copyBatches;
+			dropped += stats.rxDropped;
+		}
+	}
+	catch(const std::exception& e)
+	{
+		cout << "Error: " << e.what() << endl;
+
+		return 1;
+	}
+
+	uint64_t total = 0;
+
+	for (auto count : packets)
+	{
+		total += count;
+	}
+
+	double secs = elapsed.count() / 1e6;
+
+	cout << "dir=" << options.dir << " size=" << options.size << " queues="
+		 << options.queues << " flows=" << options.flows << " batch="
+		 << options.batch << " device="
+		 << (options.tap.empty() ? "memory" : options.tap) << endl;
+	cout << "  packets: " << total << ", dropped: " << dropped << endl;
+	cout << "  pps: " << static_cast<uint64_t>(total / secs) << ", bw: "
+		 << (total * options.size * 8 / 1e9) / secs << " Gbit/s" << endl;
+	cout << "  grant copies per batch: "
+		 << (copyBatches ? static_cast<double>(grantCopies) / copyBatches : 0)
+		 << endl;
+
+	return 0;
+}
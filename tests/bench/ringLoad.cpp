@@ -0,0 +1,388 @@
+/*
+ *  Ring buffer cross-core load generator
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+/*******************************************************************************
+ * Throughput of RingBufferInBase and RingBufferOutBase when the frontend and
+ * the backend threads run on different cores (Xen mocks, spinning frontend).
+ * Usage:
+ *
+ * ringLoad [--mode requests|events] [--fe-cpu N] [--be-cpu N]
+ *          [--producers N] [--urgent N] [--runtime S]
+ *
+ * requests: the frontend keeps the request ring full, the backend event
+ * thread bound to --be-cpu responds inline.
+ * events: --producers threads bound to the cores starting from --be-cpu send
+ * events, the frontend consumes them. With --urgent each Nth event is sent
+ * through the urgent lane and the per lane delays are printed.
+ *
+ * The frontend is bound to --fe-cpu. Run the same build with different core
+ * pairs (same core, siblings, different sockets) and compare the builds to
+ * see the effect of the ring buffer state layout on the cross-core traffic.
+ ******************************************************************************/
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Log.hpp"
+#include "RingBufferBase.hpp"
+#include "Utils.hpp"
+#include "loopback/LoopbackFrontend.hpp"
+#include "mocks/XenEvtchnMock.hpp"
+#include "mocks/XenGnttabMock.hpp"
+
+extern "C" {
+#include "testProtocol.h"
+}
+
+using std::atomic;
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::cout;
+using std::endl;
+using std::string;
+using std::thread;
+using std::vector;
+
+using XenBackend::EventLane;
+using XenBackend::Log;
+using XenBackend::RingBufferInBase;
+using XenBackend::RingBufferOutBase;
+using XenBackend::Utils;
+
+static const domid_t cFeDomId = 1;
+
+struct Options
+{
+	string mode = "requests";
+	int feCpu = 0;
+	int beCpu = 1;
+	unsigned int producers = 1;
+	unsigned int urgent = 0;
+	unsigned int runtime = 5;
+};
+
+class BenchRingIn : public RingBufferInBase<xen_test_back_ring,
+											xen_test_sring,
+											xentest_req, xentest_rsp>
+{
+public:
+
+	BenchRingIn(evtchn_port_t port, grant_ref_t ref) :
+		RingBufferInBase<xen_test_back_ring, xen_test_sring,
+						 xentest_req, xentest_rsp>(cFeDomId, port, ref) {}
+
+	~BenchRingIn() { stop(); }
+
+private:
+
+	void processRequest(const xentest_req& req) override
+	{
+		xentest_rsp rsp {};
+
+		rsp.seq = req.seq;
+
+		sendResponse(rsp);
+	}
+};
+
+class BenchRingOut : public RingBufferOutBase<xentest_event_page, xentest_evt>
+{
+public:
+
+	BenchRingOut(evtchn_port_t port, grant_ref_t ref) :
+		RingBufferOutBase<xentest_event_page, xentest_evt>(
+			cFeDomId, port, ref, XENTEST_IN_RING_OFFS, XENTEST_IN_RING_SIZE)
+	{}
+
+	~BenchRingOut() { stop(); }
+};
+
+static bool parseOptions(int argc, char* argv[], Options& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+
+		if (arg == "--mode" && hasValue)
+		{
+			options.mode = argv[++i];
+		}
+		else if (arg == "--fe-cpu" && hasValue)
+		{
+			options.feCpu = strtol(argv[++i], nullptr, 0);
+		}
+		else if (arg == "--be-cpu" && hasValue)
+		{
+			options.beCpu = strtol(argv[++i], nullptr, 0);
+		}
+		else if (arg == "--producers" && hasValue)
+		{
+			options.producers = strtoul(argv[++i], nullptr, 0);
+		}
+		else if (arg == "--urgent" && hasValue)
+		{
+			options.urgent = strtoul(argv[++i], nullptr, 0);
+		}
+		else if (arg == "--runtime" && hasValue)
+		{
+			options.runtime = strtoul(argv[++i], nullptr, 0);
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	return (options.mode == "requests" || options.mode == "events") &&
+		   options.producers > 0;
+}
+
+static void bindCpu(thread& thread, int cpu)
+{
+	if (Utils::setThreadCpu(thread, cpu) != 0)
+	{
+		cout << "Can't bind thread to core: " << cpu << endl;
+	}
+}
+
+static uint64_t runRequests(const Options& options, atomic<bool>& running)
+{
+	auto ref = LoopbackFrontend::allocRefs(1);
+	auto port = LoopbackFrontend::allocPort();
+	auto sring = static_cast<xen_test_sring*>(LoopbackFrontend::getPage(ref));
+
+	SHARED_RING_INIT(sring);
+
+	xen_test_front_ring ring;
+
+	FRONT_RING_INIT(&ring, sring, XC_PAGE_SIZE);
+
+	BenchRingIn backend(port, ref);
+
+	backend.setCpu(options.beCpu);
+	backend.start();
+
+	auto localPort = XenEvtchnMock::getLocalPort(cFeDomId, port);
+	uint64_t total = 0;
+
+	thread frontend([&] {
+		uint32_t seq = 0;
+
+		while (running)
+		{
+			while (ring.req_prod_pvt - ring.rsp_cons < RING_SIZE(&ring))
+			{
+				RING_GET_REQUEST(&ring, ring.req_prod_pvt)->seq = seq++;
+
+				ring.req_prod_pvt++;
+			}
+
+			int notify = 0;
+
+			RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&ring, notify);
+
+			if (notify)
+			{
+				XenEvtchnMock::signalPort(localPort);
+			}
+
+			auto rp = ring.sring->rsp_prod;
+
+			xen_rmb();
+
+			total += rp - ring.rsp_cons;
+
+			ring.rsp_cons = rp;
+		}
+	});
+
+	bindCpu(frontend, options.feCpu);
+
+	frontend.join();
+
+	backend.stop();
+
+	return total;
+}
+
+static uint64_t runEvents(const Options& options, atomic<bool>& running)
+{
+	auto ref = LoopbackFrontend::allocRefs(1);
+	auto port = LoopbackFrontend::allocPort();
+	auto page = static_cast<xentest_event_page*>(
+			LoopbackFrontend::getPage(ref));
+
+	memset(page, 0, XC_PAGE_SIZE);
+
+	BenchRingOut backend(port, ref);
+
+	if (options.urgent)
+	{
+		backend.setUrgentReserve(4);
+	}
+
+	backend.start();
+
+	uint64_t total = 0;
+	vector<thread> producers;
+
+	for (unsigned int i = 0; i < options.producers; i++)
+	{
+		producers.emplace_back([&backend, &running, &options, i] {
+			xentest_evt event {};
+			uint64_t count = 0;
+
+			event.seq = i;
+
+			while (running)
+			{
+				auto lane = options.urgent && ++count % options.urgent == 0 ?
+							EventLane::URGENT : EventLane::BULK;
+
+				if (backend.sendEvent(event, lane) == ENOSPC)
+				{
+					std::this_thread::yield();
+				}
+			}
+		});
+
+		bindCpu(producers.back(), options.beCpu + i);
+	}
+
+	thread frontend([&] {
+		while (running)
+		{
+			auto prod = page->in_prod;
+
+			xen_rmb();
+
+			total += prod - page->in_cons;
+
+			page->in_cons = prod;
+
+			xen_mb();
+		}
+	});
+
+	bindCpu(frontend, options.feCpu);
+
+	frontend.join();
+
+	for (auto& producer : producers)
+	{
+		producer.join();
+	}
+
+	backend.stop();
+
+	if (options.urgent)
+	{
+		for (auto lane : {EventLane::BULK, EventLane::URGENT})
+		{
+			auto stats = backend.getLaneStats(lane);
+
+			cout << (lane == EventLane::URGENT ? "  urgent" : "  bulk")
+				 << ": events " << stats.events << ", dropped "
+				 << stats.dropped << ", delay avg "
+				 << stats.avgDelay.count() << " us, max "
+				 << stats.maxDelay.count() << " us" << endl;
+		}
+	}
+
+	return total;
+}
+
+int main(int argc, char* argv[])
+{
+	Options options;
+
+	if (!parseOptions(argc, argv, options))
+	{
+		cout << "Usage: " << argv[0]
+			 << " [--mode requests|events] [--fe-cpu N] [--be-cpu N]"
+			 << " [--producers N] [--urgent N] [--runtime S]" << endl;
+
+		return 1;
+	}
+
+	Log::setLogMask("*:Disable");
+
+	XenGnttabMock::setSharedMode(true);
+
+	uint64_t total = 0;
+	microseconds elapsed;
+
+	try
+	{
+		atomic<bool> running(true);
+
+		thread timer([&running, &options] {
+			std::this_thread::sleep_for(seconds(options.runtime));
+
+			running = false;
+		});
+
+		auto start = steady_clock::now();
+
+		if (options.mode == "requests")
+		{
+			total = runRequests(options, running);
+		}
+		else
+		{
+			total = runEvents(options, running);
+		}
+
+		elapsed = duration_cast<microseconds>(steady_clock::now() - start);
+
+		timer.join();
+	}
+	catch(const std::exception& e)
+	{
+		cout << "Error: " << e.what() << endl;
+
+		return 1;
+	}
+
+	double secs = elapsed.count() / 1e6;
+
+	cout << "mode=" << options.mode << " fe-cpu=" << options.feCpu
+		 << " be-cpu=" << options.beCpu;
+
+	if (options.mode == "events")
+	{
+		cout << " producers=" << options.producers;
+	}
+
+	cout << endl;
+	cout << "  ops: " << total << ", rate: " << total / secs / 1e6
+		 << " Mops/s" << endl;
+
+	return 0;
+}
@@ -0,0 +1,322 @@
+/*
+ *  Vchan load generator
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+/*******************************************************************************
+ * Stream throughput of XenVchan running on the loopback harness (Xen mocks).
+ * Usage:
+ *
+ * vchanLoad [--dir tx|rx] [--mode span|copy] [--order N] [--chunk BYTES]
+ *           [--runtime S]
+ *
+ * rx: the peer sends the data which is written to /dev/null, tx: the data
+ * read from /dev/zero is sent to the peer. The peer always copies the data
+ * as libxenvchan does.
+ *
+ * span: the data goes between the ring and the fd with single readv() /
+ * writev() on the ring spans. copy: the data is copied through the
+ * intermediate buffer with read() / write() as libxenvchan_read() /
+ * libxenvchan_write() users do, it is the reference to compare with.
+ ******************************************************************************/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "Log.hpp"
+#include "XenVchan.hpp"
+#include "loopback/VchanFrontend.hpp"
+
+using std::atomic;
+using std::chrono::duration_cast;
+using std::chrono::microseconds;
+using std::chrono::seconds;
+using std::chrono::steady_clock;
+using std::cout;
+using std::endl;
+using std::string;
+using std::thread;
+using std::vector;
+
+using XenBackend::Log;
+using XenBackend::XenVchan;
+using XenBackend::XenVchanStats;
+
+struct Options
+{
+	string dir = "rx";
+	string mode = "span";
+	unsigned int order = 16;
+	size_t chunk = 65536;
+	unsigned int runtime = 5;
+};
+
+static bool parseOptions(int argc, char* argv[], Options& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+
+		if (arg == "--dir" && hasValue)
+		{
+			options.dir = argv[++i];
+		}
+		else if (arg == "--mode" && hasValue)
+		{
+			options.mode = argv[++i];
+		}
+		else if (arg == "--order" && hasValue)
+		{
+			options.order = strtoul(argv[++i], nullptr, 0);
+		}
+		else if (arg == "--chunk" && hasValue)
+		{
+			options.chunk = strtoul(argv[++i], nullptr, 0);
+		}
+		else if (arg == "--runtime" && hasValue)
+		{
+			options.runtime = strtoul(argv[++i], nullptr, 0);
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	return (options.dir == "tx" || options.dir == "rx") &&
+		   (options.mode == "span" || options.mode == "copy") &&
+		   options.order >= 12 && options.order <= 18 && options.chunk > 0;
+}
+
+static void runPeer(VchanFrontend& peer, const Options& options,
+					atomic<bool>& running)
+{
+	vector<uint8_t> buffer(options.chunk, 0x55);
+
+	while (running)
+	{
+		if (options.dir == "rx")
+		{
+			if (peer.writeSome(buffer.data(), buffer.size()) == 0)
+			{
+				peer.waitWrite(10);
+			}
+		}
+		else
+		{
+			if (peer.readSome(buffer.data(), buffer.size()) == 0)
+			{
+				peer.waitRead(10);
+			}
+		}
+	}
+}
+
+static uint64_t runRx(XenVchan& vchan, const Options& options, int fd,
+					  atomic<bool>& running)
+{
+	vector<uint8_t> buffer(options.chunk);
+	uint64_t total = 0;
+
+	while (running)
+	{
+		if (!vchan.waitRead(1, 10))
+		{
+			continue;
+		}
+
+		if (options.mode == "span")
+		{
+			iovec iov[2];
+			int count;
+
+			auto size = vchan.getReadSpans(iov, count);
+			auto ret = writev(fd, iov, count);
+
+			if (ret < 0 || static_cast<size_t>(ret) != size)
+			{
+				throw std::runtime_error("Can't write output");
+			}
+
+			vchan.consume(size);
+
+			total += size;
+		}
+		else
+		{
+			auto size = vchan.read(buffer.data(), buffer.size());
+
+			if (write(fd, buffer.data(), size) != static_cast<ssize_t>(size))
+			{
+				throw std::runtime_error("Can't write output");
+			}
+
+			total += size;
+		}
+	}
+
+	return total;
+}
+
+static uint64_t runTx(XenVchan& vchan, const Options& options, int fd,
+					  atomic<bool>& running)
+{
+	vector<uint8_t> buffer(options.chunk);
+	uint64_t total = 0;
+
+	while (running)
+	{
+		if (!vchan.waitWrite(1, 10))
+		{
+			continue;
+		}
+
+		if (options.mode == "span")
+		{
+			iovec iov[2];
+			int count;
+
+			vchan.getWriteSpans(iov, count);
+
+			auto ret = readv(fd, iov, count);
+
+			if (ret <= 0)
+			{
+				throw std::runtime_error("Can't read input");
+			}
+
+			vchan.produce(ret);
+
+			total += ret;
+		}
+		else
+		{
+			auto size = std::min(buffer.size(), vchan.getWriteSize());
+			auto ret = read(fd, buffer.data(), size);
+
+			if (ret <= 0)
+			{
+				throw std::runtime_error("Can't read input");
+			}
+
+			total += vchan.write(buffer.data(), ret);
+		}
+	}
+
+	return total;
+}
+
+int main(int argc, char* argv[])
+{
+	Options options;
+
+	if (!parseOptions(argc, argv, options))
+	{
+		cout << "Usage: " << argv[0]
+			 << " [--dir tx|rx] [--mode span|copy] [--order 12..18]"
+			 << " [--chunk BYTES] [--runtime S]" << endl;
+
+		return 1;
+	}
+
+	Log::setLogMask("*:Disable");
+
+	uint64_t total = 0;
+	XenVchanStats stats {};
+	microseconds elapsed;
+
+	try
+	{
+		VchanFrontend peer(0, 1, options.order, options.order);
+		XenVchan vchan(1, peer.getRef(), peer.getPort());
+
+		peer.bind();
+		vchan.start();
+
+		int fd = open(options.dir == "rx" ? "/dev/null" : "/dev/zero",
+					  options.dir == "rx" ? O_WRONLY : O_RDONLY);
+
+		if (fd < 0)
+		{
+			cout << "Can't open device: " << strerror(errno) << endl;
+
+			return 1;
+		}
+
+		atomic<bool> running(true);
+
+		auto start = steady_clock::now();
+
+		thread peerThread(runPeer, std::ref(peer), std::cref(options),
+						  std::ref(running));
+
+		thread timer([&running, &options] {
+			std::this_thread::sleep_for(seconds(options.runtime));
+
+			running = false;
+		});
+
+		if (options.dir == "rx")
+		{
+			total = runRx(vchan, options, fd, running);
+		}
+		else
+		{
+			total = runTx(vchan, options, fd, running);
+		}
+
+		timer.join();
+		peerThread.join();
+
+		elapsed = duration_cast<microseconds>(steady_clock::now() - start);
+
+		stats = vchan.getStats();
+
+		close(fd);
+	}
+	catch(const std::exception& e)
+	{
+		cout << "Error: " << e.what() << endl;
+
+		return 1;
+	}
+
+	double secs = elapsed.count() / 1e6;
+
+	cout << "dir=" << options.dir << " mode=" << options.mode << " order="
+		 << options.order << " chunk=" << options.chunk << endl;
+	cout << "  bytes: " << total << ", bw: " << (total * 8 / 1e9) / secs
+		 << " Gbit/s" << endl;
+	cout << "  notifications: " << stats.notifications << ", events: "
+		 << stats.events << endl;
+
+	return 0;
+}
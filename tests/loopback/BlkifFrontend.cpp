@@ -0,0 +1,423 @@
+/*
+ *  Loopback blkif frontend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include "BlkifFrontend.hpp"
+
+#include <cstring>
+
+#include "Exception.hpp"
+
+using std::min;
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+
+using XenBackend::Exception;
+
+static const size_t cSectorSize = 512;
+static const size_t cSectorsPerPage = XC_PAGE_SIZE / cSectorSize;
+
+/*******************************************************************************
+ * BlkifFrontend
+ ******************************************************************************/
+
+BlkifFrontend::BlkifFrontend(domid_t beDomId, domid_t feDomId, uint16_t devId,
+							 const Config& config) :
+	LoopbackFrontend("vbd", beDomId, feDomId, devId),
+	mConfig(config),
+	mSectors(0),
+	mMaxIndirectSegs(0)
+{
+	writeBackend("params", config.image);
+	writeBackend("mode", config.readOnly ? "r" : "w");
+
+	for (unsigned int i = 0; i < config.numQueues; i++)
+	{
+		initQueue(i);
+	}
+}
+
+BlkifFrontend::~BlkifFrontend()
+{
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+bool BlkifFrontend::connect(int timeoutMs)
+{
+	setState(XenbusStateInitialising);
+
+	if (!waitBackendState(XenbusStateInitWait, timeoutMs))
+	{
+		return false;
+	}
+
+	string value;
+
+	if (readBackend("feature-max-indirect-segments", value) && !value.empty())
+	{
+		mMaxIndirectSegs = stoul(value);
+	}
+
+	auto numQueues = mQueues.size();
+	auto numPages = 1u << mConfig.ringPageOrder;
+
+	if (numQueues > 1)
+	{
+		writeFrontend("multi-queue-num-queues", to_string(numQueues));
+	}
+
+	if (mConfig.ringPageOrder)
+	{
+		writeFrontend("ring-page-order", to_string(mConfig.ringPageOrder));
+	}
+
+	for (size_t i = 0; i < numQueues; i++)
+	{
+		string prefix = numQueues > 1 ? "queue-" + to_string(i) + "/" : "";
+
+		if (mConfig.ringPageOrder == 0)
+		{
+			writeFrontend(prefix + "ring-ref", to_string(mQueues[i]->ringRef));
+		}
+		else
+		{
+			for (unsigned int j = 0; j < numPages; j++)
+			{
+				writeFrontend(prefix + "ring-ref" + to_string(j),
+							  to_string(mQueues[i]->ringRef + j));
+			}
+		}
+
+		writeFrontend(prefix + "event-channel", to_string(mQueues[i]->port));
+	}
+
+	writeFrontend("feature-persistent", mConfig.persistent ? "1" : "0");
+
+	setState(XenbusStateInitialised);
+
+	if (!waitBackendState(XenbusStateConnected, timeoutMs))
+	{
+		return false;
+	}
+
+	for (auto& queue : mQueues)
+	{
+		queue->channel.bind(mFeDomId, queue->port);
+	}
+
+	if (readBackend("sectors", value) && !value.empty())
+	{
+		mSectors = stoull(value);
+	}
+
+	setState(XenbusStateConnected);
+
+	return true;
+}
+
+void BlkifFrontend::disconnect()
+{
+	setState(XenbusStateClosing);
+
+	waitBackendState(XenbusStateClosed);
+
+	setState(XenbusStateClosed);
+}
+
+bool BlkifFrontend::queueRequest(unsigned int queue, uint8_t operation,
+								 uint64_t sector, size_t numSectors,
+								 uint64_t& id)
+{
+	auto& q = *mQueues.at(queue);
+
+	if (q.freeSlots.empty() || RING_FULL(&q.ring))
+	{
+		return false;
+	}
+
+	auto slotIndex = q.freeSlots.back();
+	auto& slot = q.slots[slotIndex];
+	auto numPages = (numSectors + cSectorsPerPage - 1) / cSectorsPerPage;
+
+	// discard doesn't carry data
+	if (operation != BLKIF_OP_DISCARD && numPages > mConfig.maxPages)
+	{
+		throw Exception("Request is too big", EINVAL);
+	}
+
+	auto req = RING_GET_REQUEST(&q.ring, q.ring.req_prod_pvt);
+
+	memset(req, 0, sizeof(*req));
+
+	if (operation == BLKIF_OP_DISCARD)
+	{
+		auto discard = reinterpret_cast<blkif_request_discard*>(req);
+
+		discard->operation = operation;
+		discard->id = slotIndex;
+		discard->sector_number = sector;
+		discard->nr_sectors = numSectors;
+	}
+	else if (operation == BLKIF_OP_FLUSH_DISKCACHE)
+	{
+		req->operation = operation;
+		req->id = slotIndex;
+	}
+	else
+	{
+		vector<blkif_request_segment> segs(numPages);
+
+		for (size_t i = 0; i < numPages; i++)
+		{
+			auto sectors = min(numSectors - i * cSectorsPerPage,
+							   cSectorsPerPage);
+
+			segs[i].gref = slot.dataRef + i;
+			segs[i].first_sect = 0;
+			segs[i].last_sect = sectors - 1;
+		}
+
+		if (numPages <= BLKIF_MAX_SEGMENTS_PER_REQUEST)
+		{
+			req->operation = operation;
+			req->nr_segments = numPages;
+			req->id = slotIndex;
+			req->sector_number = sector;
+
+			memcpy(req->seg, segs.data(), numPages * sizeof(segs[0]));
+		}
+		else
+		{
+			if (numPages > mMaxIndirectSegs)
+			{
+				throw Exception("Indirect segments are not supported", EINVAL);
+			}
+
+			auto indirect = reinterpret_cast<blkif_request_indirect*>(req);
+
+			indirect->operation = BLKIF_OP_INDIRECT;
+			indirect->indirect_op = operation;
+			indirect->nr_segments = numPages;
+			indirect->id = slotIndex;
+			indirect->sector_number = sector;
+			indirect->indirect_grefs[0] = slot.indirectRef;
+
+			memcpy(getPage(slot.indirectRef), segs.data(),
+				   numPages * sizeof(segs[0]));
+		}
+	}
+
+	q.ring.req_prod_pvt++;
+
+	q.freeSlots.pop_back();
+	slot.operation = operation;
+	slot.busy = true;
+
+	id = slotIndex;
+
+	return true;
+}
+
+void* BlkifFrontend::getBuffer(unsigned int queue, uint64_t id)
+{
+	return getPage(mQueues.at(queue)->slots.at(id).dataRef);
+}
+
+void BlkifFrontend::kick(unsigned int queue)
+{
+	auto& q = *mQueues.at(queue);
+	int notify = 0;
+
+	RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&q.ring, notify);
+
+	if (notify)
+	{
+		q.channel.notify();
+	}
+}
+
+size_t BlkifFrontend::getResponses(unsigned int queue, vector<Response>& rsps,
+								   int timeoutMs)
+{
+	auto& q = *mQueues.at(queue);
+	size_t count = 0;
+
+	while (true)
+	{
+		int more = 0;
+
+		do
+		{
+			auto rp = q.ring.sring->rsp_prod;
+
+			xen_rmb();
+
+			for (auto i = q.ring.rsp_cons; i != rp; i++)
+			{
+				auto rsp = RING_GET_RESPONSE(&q.ring, i);
+				auto& slot = q.slots.at(rsp->id);
+
+				// blkfront treats it as a protocol error: the indirect
+				// request is answered with its indirect operation
+				if (rsp->operation != slot.operation)
+				{
+					throw Exception("Invalid response operation", EPROTO);
+				}
+
+				rsps.push_back({rsp->id, rsp->operation, rsp->status});
+
+				slot.busy = false;
+				q.freeSlots.push_back(rsp->id);
+
+				count++;
+			}
+
+			q.ring.rsp_cons = rp;
+
+			RING_FINAL_CHECK_FOR_RESPONSES(&q.ring, more);
+		}
+		while (more);
+
+		// notification may be left from already consumed responses
+		if (count)
+		{
+			return count;
+		}
+
+		if (!q.channel.wait(timeoutMs))
+		{
+			return 0;
+		}
+	}
+}
+
+int16_t BlkifFrontend::read(uint64_t sector, void* data, size_t numSectors,
+							unsigned int queue)
+{
+	return transfer(queue, BLKIF_OP_READ, sector, numSectors, data);
+}
+
+int16_t BlkifFrontend::write(uint64_t sector, const void* data,
+							 size_t numSectors, unsigned int queue)
+{
+	return transfer(queue, BLKIF_OP_WRITE, sector, numSectors,
+					const_cast<void*>(data));
+}
+
+int16_t BlkifFrontend::flush(unsigned int queue)
+{
+	return transfer(queue, BLKIF_OP_FLUSH_DISKCACHE, 0, 0, nullptr);
+}
+
+int16_t BlkifFrontend::discard(uint64_t sector, size_t numSectors,
+							   unsigned int queue)
+{
+	return transfer(queue, BLKIF_OP_DISCARD, sector, numSectors, nullptr);
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void BlkifFrontend::initQueue(unsigned int index)
+{
+	unique_ptr<Queue> queue(new Queue());
+
+	auto numPages = 1u << mConfig.ringPageOrder;
+	auto ringSize = numPages * XC_PAGE_SIZE;
+
+	queue->ringRef = allocRefs(numPages);
+	queue->port = allocPort();
+
+	auto sring = static_cast<blkif_sring*>(getPage(queue->ringRef));
+
+	memset(sring, 0, ringSize);
+
+	SHARED_RING_INIT(sring);
+	FRONT_RING_INIT(&queue->ring, sring, ringSize);
+
+	// limit number of slots to keep the number of grant pages reasonable
+	auto numSlots = min(RING_SIZE(&queue->ring), 64u);
+
+	queue->slots.resize(numSlots);
+
+	for (unsigned int i = 0; i < numSlots; i++)
+	{
+		queue->slots[i].dataRef = allocRefs(mConfig.maxPages);
+		queue->slots[i].indirectRef = allocRefs(1);
+		queue->slots[i].operation = 0;
+		queue->slots[i].busy = false;
+
+		queue->freeSlots.push_back(numSlots - i - 1);
+	}
+
+	mQueues.push_back(move(queue));
+}
+
+int16_t BlkifFrontend::transfer(unsigned int queue, uint8_t operation,
+								uint64_t sector, size_t numSectors, void* data)
+{
+	uint64_t id;
+
+	if (!queueRequest(queue, operation, sector, numSectors, id))
+	{
+		throw Exception("No free slots", EBUSY);
+	}
+
+	auto buffer = getBuffer(queue, id);
+
+	if (operation == BLKIF_OP_WRITE)
+	{
+		memcpy(buffer, data, numSectors * cSectorSize);
+	}
+
+	kick(queue);
+
+	vector<Response> rsps;
+
+	while (true)
+	{
+		rsps.clear();
+
+		if (!getResponses(queue, rsps))
+		{
+			throw Exception("Response timeout", ETIMEDOUT);
+		}
+
+		for (auto& rsp : rsps)
+		{
+			if (rsp.id != id)
+			{
+				continue;
+			}
+
+			if (operation == BLKIF_OP_READ && rsp.status == BLKIF_RSP_OKAY)
+			{
+				memcpy(data, buffer, numSectors * cSectorSize);
+			}
+
+			return rsp.status;
+		}
+	}
+}
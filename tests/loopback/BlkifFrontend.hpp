@@ -0,0 +1,126 @@
+/*
+ *  Loopback blkif frontend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef TESTS_LOOPBACK_BLKIFFRONTEND_HPP_
+#define TESTS_LOOPBACK_BLKIFFRONTEND_HPP_
+
+#include <memory>
+#include <vector>
+
+extern "C" {
+#include <xen/io/blkif.h>
+}
+
+#include "LoopbackFrontend.hpp"
+
+/*******************************************************************************
+ * Blkif frontend simulator. Each request slot owns a fixed set of data pages,
+ * so with persistent grants the backend maps every page only once.
+ ******************************************************************************/
+class BlkifFrontend : public LoopbackFrontend
+{
+public:
+
+	struct Config
+	{
+		std::string image;
+		bool readOnly = false;
+		unsigned int numQueues = 1;
+		unsigned int ringPageOrder = 0;
+		bool persistent = true;
+		unsigned int maxPages = 32;
+	};
+
+	struct Response
+	{
+		uint64_t id;
+		uint8_t operation;
+		int16_t status;
+	};
+
+	BlkifFrontend(domid_t beDomId, domid_t feDomId, uint16_t devId,
+				  const Config& config);
+	~BlkifFrontend();
+
+	/**
+	 * Performs xenbus handshake, returns true if the backend is connected
+	 */
+	bool connect(int timeoutMs = 3000);
+	void disconnect();
+
+	uint64_t getSectors() const { return mSectors; }
+	unsigned int getNumQueues() const { return mQueues.size(); }
+	unsigned int getMaxIndirectSegments() const { return mMaxIndirectSegs; }
+
+	/**
+	 * Puts request into the ring without notifying the backend,
+	 * returns false if there is no free slot
+	 */
+	bool queueRequest(unsigned int queue, uint8_t operation, uint64_t sector,
+					  size_t numSectors, uint64_t& id);
+	void* getBuffer(unsigned int queue, uint64_t id);
+	void kick(unsigned int queue);
+
+	/**
+	 * Collects available responses, waits for notification if there are
+	 * no responses
+	 */
+	size_t getResponses(unsigned int queue, std::vector<Response>& rsps,
+						int timeoutMs = 3000);
+
+	int16_t read(uint64_t sector, void* data, size_t numSectors,
+				 unsigned int queue = 0);
+	int16_t write(uint64_t sector, const void* data, size_t numSectors,
+				  unsigned int queue = 0);
+	int16_t flush(unsigned int queue = 0);
+	int16_t discard(uint64_t sector, size_t numSectors,
+					unsigned int queue = 0);
+
+private:
+
+	struct Slot
+	{
+		grant_ref_t dataRef;
+		grant_ref_t indirectRef;
+		uint8_t operation;
+		bool busy;
+	};
+
+	struct Queue
+	{
+		blkif_front_ring ring;
+		grant_ref_t ringRef;
+		evtchn_port_t port;
+		Channel channel;
+		std::vector<Slot> slots;
+		std::vector<unsigned int> freeSlots;
+	};
+
+	Config mConfig;
+	uint64_t mSectors;
+	unsigned int mMaxIndirectSegs;
+	std::vector<std::unique_ptr<Queue>> mQueues;
+
+	void initQueue(unsigned int index);
+	int16_t transfer(unsigned int queue, uint8_t operation, uint64_t sector,
+					 size_t numSectors, void* data);
+};
+
+#endif /* TESTS_LOOPBACK_BLKIFFRONTEND_HPP_ */
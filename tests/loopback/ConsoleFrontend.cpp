@@ -0,0 +1,179 @@
+/*
+ *  Loopback console frontend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include "ConsoleFrontend.hpp"
+
+#include <chrono>
+#include <cstring>
+
+#include "Exception.hpp"
+
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::min;
+using std::string;
+using std::to_string;
+
+using XenBackend::Exception;
+
+/*******************************************************************************
+ * ConsoleFrontend
+ ******************************************************************************/
+
+ConsoleFrontend::ConsoleFrontend(domid_t beDomId, domid_t feDomId,
+								 uint16_t devId) :
+	LoopbackFrontend("console", beDomId, feDomId, devId)
+{
+	mRingRef = allocRefs(1);
+	mPort = allocPort();
+
+	mIntf = static_cast<xencons_interface*>(getPage(mRingRef));
+
+	memset(mIntf, 0, XC_PAGE_SIZE);
+}
+
+ConsoleFrontend::~ConsoleFrontend()
+{
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+bool ConsoleFrontend::connect(int timeoutMs)
+{
+	setState(XenbusStateInitialising);
+
+	if (!waitBackendState(XenbusStateInitWait, timeoutMs))
+	{
+		return false;
+	}
+
+	writeFrontend("ring-ref", to_string(mRingRef));
+	writeFrontend("port", to_string(mPort));
+
+	setState(XenbusStateInitialised);
+
+	if (!waitBackendState(XenbusStateConnected, timeoutMs))
+	{
+		return false;
+	}
+
+	mChannel.bind(mFeDomId, mPort);
+
+	setState(XenbusStateConnected);
+
+	return true;
+}
+
+void ConsoleFrontend::write(const string& data, int timeoutMs)
+{
+	auto size = sizeof(mIntf->out);
+	auto end = steady_clock::now() + milliseconds(timeoutMs);
+	size_t written = 0;
+
+	while (written < data.size())
+	{
+		XENCONS_RING_IDX cons = mIntf->out_cons;
+		XENCONS_RING_IDX prod = mIntf->out_prod;
+
+		xen_mb();
+
+		auto free = size - (prod - cons);
+
+		if (free == 0)
+		{
+			auto remaining = duration_cast<milliseconds>(
+				end - steady_clock::now()).count();
+
+			if (remaining <= 0)
+			{
+				throw Exception("No space in out ring", ETIMEDOUT);
+			}
+
+			mChannel.wait(min<int>(remaining, 10));
+
+			continue;
+		}
+
+		auto chunk = min(free, data.size() - written);
+		auto offset = prod & (size - 1);
+		auto first = min(chunk, size - offset);
+
+		memcpy(&mIntf->out[offset], &data[written], first);
+		memcpy(mIntf->out, &data[written + first], chunk - first);
+
+		xen_wmb();
+
+		mIntf->out_prod = prod + chunk;
+
+		written += chunk;
+
+		mChannel.notify();
+	}
+}
+
+string ConsoleFrontend::read(size_t size, int timeoutMs)
+{
+	auto ringSize = sizeof(mIntf->in);
+	auto end = steady_clock::now() + milliseconds(timeoutMs);
+	string data;
+
+	while (data.size() < size)
+	{
+		XENCONS_RING_IDX prod = mIntf->in_prod;
+
+		xen_rmb();
+
+		XENCONS_RING_IDX cons = mIntf->in_cons;
+		size_t available = prod - cons;
+
+		if (available)
+		{
+			auto chunk = min(available, size - data.size());
+			auto offset = cons & (ringSize - 1);
+			auto first = min(chunk, ringSize - offset);
+
+			data.append(&mIntf->in[offset], first);
+			data.append(mIntf->in, chunk - first);
+
+			xen_mb();
+
+			mIntf->in_cons = cons + chunk;
+
+			mChannel.notify();
+
+			continue;
+		}
+
+		auto remaining = duration_cast<milliseconds>(
+			end - steady_clock::now()).count();
+
+		if (remaining <= 0)
+		{
+			break;
+		}
+
+		mChannel.wait(min<int>(remaining, 10));
+	}
+
+	return data;
+}
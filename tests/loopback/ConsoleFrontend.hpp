@@ -0,0 +1,66 @@
+/*
+ *  Loopback console frontend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef TESTS_LOOPBACK_CONSOLEFRONTEND_HPP_
+#define TESTS_LOOPBACK_CONSOLEFRONTEND_HPP_
+
+#include <string>
+
+extern "C" {
+#include <xen/io/console.h>
+}
+
+#include "LoopbackFrontend.hpp"
+
+/*******************************************************************************
+ * Console frontend simulator: writes to the out ring and reads the in ring.
+ ******************************************************************************/
+class ConsoleFrontend : public LoopbackFrontend
+{
+public:
+
+	ConsoleFrontend(domid_t beDomId, domid_t feDomId, uint16_t devId);
+	~ConsoleFrontend();
+
+	/**
+	 * Performs xenbus handshake, returns true if the backend is connected
+	 */
+	bool connect(int timeoutMs = 3000);
+
+	/**
+	 * Writes the data to the out ring, waits for free space if needed
+	 */
+	void write(const std::string& data, int timeoutMs = 3000);
+
+	/**
+	 * Reads the data from the in ring. Returns less data if the timeout
+	 * expires.
+	 */
+	std::string read(size_t size, int timeoutMs = 3000);
+
+private:
+
+	grant_ref_t mRingRef;
+	evtchn_port_t mPort;
+	Channel mChannel;
+	xencons_interface* mIntf;
+};
+
+#endif /* TESTS_LOOPBACK_CONSOLEFRONTEND_HPP_ */
@@ -0,0 +1,388 @@
+/*
+ *  Loopback displif frontend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include "DisplifFrontend.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+
+#include "Exception.hpp"
+
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::min;
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+
+using XenBackend::Exception;
+
+static const size_t cGrefsPerDirPage =
+	(XC_PAGE_SIZE - offsetof(xendispl_page_directory, gref)) /
+	sizeof(grant_ref_t);
+
+/*******************************************************************************
+ * DisplifFrontend
+ ******************************************************************************/
+
+DisplifFrontend::DisplifFrontend(domid_t beDomId, domid_t feDomId,
+								 uint16_t devId,
+								 const vector<ConnectorConfig>& connectors) :
+	LoopbackFrontend("vdispl", beDomId, feDomId, devId)
+{
+	for (auto& config : connectors)
+	{
+		initConnector(config);
+	}
+}
+
+DisplifFrontend::~DisplifFrontend()
+{
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+bool DisplifFrontend::connect(int timeoutMs)
+{
+	setState(XenbusStateInitialising);
+
+	if (!waitBackendState(XenbusStateInitWait, timeoutMs))
+	{
+		return false;
+	}
+
+	writeFrontend(XENDISPL_FIELD_FE_VERSION, XENDISPL_PROTOCOL_VERSION);
+
+	for (size_t i = 0; i < mConnectors.size(); i++)
+	{
+		auto& connector = *mConnectors[i];
+		string prefix = to_string(i) + "/";
+
+		writeFrontend(prefix + XENDISPL_FIELD_RESOLUTION,
+					  to_string(connector.config.width) + "x" +
+					  to_string(connector.config.height));
+		writeFrontend(prefix + XENDISPL_FIELD_REQ_RING_REF,
+					  to_string(connector.ringRef));
+		writeFrontend(prefix + XENDISPL_FIELD_REQ_CHANNEL,
+					  to_string(connector.port));
+		writeFrontend(prefix + XENDISPL_FIELD_EVT_RING_REF,
+					  to_string(connector.evtRef));
+		writeFrontend(prefix + XENDISPL_FIELD_EVT_CHANNEL,
+					  to_string(connector.evtPort));
+	}
+
+	setState(XenbusStateInitialised);
+
+	if (!waitBackendState(XenbusStateConnected, timeoutMs))
+	{
+		return false;
+	}
+
+	for (auto& connector : mConnectors)
+	{
+		connector->channel.bind(mFeDomId, connector->port);
+		connector->evtChannel.bind(mFeDomId, connector->evtPort);
+	}
+
+	setState(XenbusStateConnected);
+
+	return true;
+}
+
+int32_t DisplifFrontend::createBuffer(unsigned int connector, uint64_t cookie,
+									  uint32_t width, uint32_t height,
+									  uint32_t bpp, uint32_t flags)
+{
+	auto& c = *mConnectors.at(connector);
+
+	uint32_t size = (width * bpp + 7) / 8 * height;
+	size_t numPages = (size + XC_PAGE_SIZE - 1) / XC_PAGE_SIZE;
+	size_t numDirPages = (numPages + cGrefsPerDirPage - 1) / cGrefsPerDirPage;
+
+	auto dirRef = allocRefs(numDirPages);
+	auto bufferRef = allocRefs(numPages);
+
+	for (size_t i = 0; i < numDirPages; i++)
+	{
+		auto dir = static_cast<xendispl_page_directory*>(getPage(dirRef + i));
+
+		dir->gref_dir_next_page = i + 1 < numDirPages ? dirRef + i + 1 : 0;
+
+		for (size_t j = 0; j < cGrefsPerDirPage; j++)
+		{
+			auto page = i * cGrefsPerDirPage + j;
+
+			if (page == numPages)
+			{
+				break;
+			}
+
+			dir->gref[j] = bufferRef + page;
+		}
+	}
+
+	memset(getPage(bufferRef), 0, numPages * XC_PAGE_SIZE);
+
+	mBuffers[cookie] = bufferRef;
+
+	xendispl_req req {};
+
+	req.operation = XENDISPL_OP_DBUF_CREATE;
+	req.op.dbuf_create.dbuf_cookie = cookie;
+	req.op.dbuf_create.width = width;
+	req.op.dbuf_create.height = height;
+	req.op.dbuf_create.bpp = bpp;
+	req.op.dbuf_create.buffer_sz = size;
+	req.op.dbuf_create.flags = flags;
+	req.op.dbuf_create.gref_directory = dirRef;
+
+	queueRequest(c, req);
+
+	return waitResponses(c, 1)[0];
+}
+
+int32_t DisplifFrontend::destroyBuffer(unsigned int connector, uint64_t cookie)
+{
+	auto& c = *mConnectors.at(connector);
+
+	xendispl_req req {};
+
+	req.operation = XENDISPL_OP_DBUF_DESTROY;
+	req.op.dbuf_destroy.dbuf_cookie = cookie;
+
+	queueRequest(c, req);
+
+	return waitResponses(c, 1)[0];
+}
+
+int32_t DisplifFrontend::attachFb(unsigned int connector, uint64_t dbufCookie,
+								  uint64_t fbCookie, uint32_t width,
+								  uint32_t height, uint32_t format)
+{
+	auto& c = *mConnectors.at(connector);
+
+	xendispl_req req {};
+
+	req.operation = XENDISPL_OP_FB_ATTACH;
+	req.op.fb_attach.dbuf_cookie = dbufCookie;
+	req.op.fb_attach.fb_cookie = fbCookie;
+	req.op.fb_attach.width = width;
+	req.op.fb_attach.height = height;
+	req.op.fb_attach.pixel_format = format;
+
+	queueRequest(c, req);
+
+	return waitResponses(c, 1)[0];
+}
+
+int32_t DisplifFrontend::detachFb(unsigned int connector, uint64_t fbCookie)
+{
+	auto& c = *mConnectors.at(connector);
+
+	xendispl_req req {};
+
+	req.operation = XENDISPL_OP_FB_DETACH;
+	req.op.fb_detach.fb_cookie = fbCookie;
+
+	queueRequest(c, req);
+
+	return waitResponses(c, 1)[0];
+}
+
+int32_t DisplifFrontend::setConfig(unsigned int connector, uint64_t fbCookie,
+								   uint32_t width, uint32_t height,
+								   uint32_t bpp)
+{
+	auto& c = *mConnectors.at(connector);
+
+	xendispl_req req {};
+
+	req.operation = XENDISPL_OP_SET_CONFIG;
+	req.op.set_config.fb_cookie = fbCookie;
+	req.op.set_config.width = width;
+	req.op.set_config.height = height;
+	req.op.set_config.bpp = bpp;
+
+	queueRequest(c, req);
+
+	return waitResponses(c, 1)[0];
+}
+
+vector<int32_t> DisplifFrontend::pageFlips(unsigned int connector,
+										   const vector<uint64_t>& fbCookies)
+{
+	auto& c = *mConnectors.at(connector);
+
+	for (auto cookie : fbCookies)
+	{
+		xendispl_req req {};
+
+		req.operation = XENDISPL_OP_PG_FLIP;
+		req.op.pg_flip.fb_cookie = cookie;
+
+		queueRequest(c, req);
+	}
+
+	return waitResponses(c, fbCookies.size());
+}
+
+size_t DisplifFrontend::waitFlipEvents(unsigned int connector, size_t count,
+									   int timeoutMs)
+{
+	auto& c = *mConnectors.at(connector);
+	auto end = steady_clock::now() + milliseconds(timeoutMs);
+
+	while (true)
+	{
+		readEvents(c);
+
+		if (c.numEvents >= count)
+		{
+			break;
+		}
+
+		auto remaining = duration_cast<milliseconds>(
+			end - steady_clock::now()).count();
+
+		if (remaining <= 0)
+		{
+			break;
+		}
+
+		c.evtChannel.wait(min<int>(remaining, 10));
+	}
+
+	return c.numEvents;
+}
+
+uint8_t* DisplifFrontend::getBuffer(uint64_t cookie)
+{
+	return static_cast<uint8_t*>(getPage(mBuffers.at(cookie)));
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void DisplifFrontend::initConnector(const ConnectorConfig& config)
+{
+	unique_ptr<Connector> connector(new Connector());
+
+	connector->config = config;
+
+	connector->ringRef = allocRefs(1);
+	connector->port = allocPort();
+
+	auto sring = static_cast<xen_displif_sring*>(
+		getPage(connector->ringRef));
+
+	SHARED_RING_INIT(sring);
+	FRONT_RING_INIT(&connector->ring, sring, XC_PAGE_SIZE);
+
+	connector->evtRef = allocRefs(1);
+	connector->evtPort = allocPort();
+
+	memset(getPage(connector->evtRef), 0, XC_PAGE_SIZE);
+
+	connector->numEvents = 0;
+	connector->id = 0;
+
+	mConnectors.push_back(std::move(connector));
+}
+
+void DisplifFrontend::queueRequest(Connector& connector, xendispl_req& req)
+{
+	req.id = connector.id++;
+
+	*RING_GET_REQUEST(&connector.ring, connector.ring.req_prod_pvt) = req;
+
+	connector.ring.req_prod_pvt++;
+}
+
+vector<int32_t> DisplifFrontend::waitResponses(Connector& connector,
+											   size_t count)
+{
+	int notify = 0;
+
+	RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&connector.ring, notify);
+
+	if (notify)
+	{
+		connector.channel.notify();
+	}
+
+	auto end = steady_clock::now() + milliseconds(3000);
+	vector<int32_t> statuses;
+
+	while (statuses.size() < count)
+	{
+		if (connector.ring.rsp_cons != connector.ring.sring->rsp_prod)
+		{
+			xen_rmb();
+
+			auto resp = *RING_GET_RESPONSE(&connector.ring,
+										   connector.ring.rsp_cons);
+
+			connector.ring.rsp_cons++;
+
+			statuses.push_back(resp.status);
+
+			continue;
+		}
+
+		auto remaining = duration_cast<milliseconds>(
+			end - steady_clock::now()).count();
+
+		if (remaining <= 0)
+		{
+			throw Exception("Response timeout", ETIMEDOUT);
+		}
+
+		connector.channel.wait(remaining);
+	}
+
+	return statuses;
+}
+
+void DisplifFrontend::readEvents(Connector& connector)
+{
+	auto page = static_cast<xendispl_event_page*>(getPage(connector.evtRef));
+
+	auto prod = page->in_prod;
+
+	xen_rmb();
+
+	for (auto cons = page->in_cons; cons != prod; cons++)
+	{
+		if (XENDISPL_IN_RING_REF(page, cons).type == XENDISPL_EVT_PG_FLIP)
+		{
+			connector.numEvents++;
+		}
+	}
+
+	xen_mb();
+
+	page->in_cons = prod;
+}
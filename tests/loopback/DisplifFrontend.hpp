@@ -0,0 +1,139 @@
+/*
+ *  Loopback displif frontend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef TESTS_LOOPBACK_DISPLIFFRONTEND_HPP_
+#define TESTS_LOOPBACK_DISPLIFFRONTEND_HPP_
+
+#include <map>
+#include <memory>
+#include <vector>
+
+extern "C" {
+#include <xen/io/displif.h>
+}
+
+#include "DisplifBackend.hpp"
+
+#include "LoopbackFrontend.hpp"
+
+/*******************************************************************************
+ * Displif frontend simulator. Each connector has its own request ring and
+ * event page, display buffers are described by gref directory pages.
+ ******************************************************************************/
+class DisplifFrontend : public LoopbackFrontend
+{
+public:
+
+	struct ConnectorConfig
+	{
+		uint32_t width = 320;
+		uint32_t height = 240;
+	};
+
+	DisplifFrontend(domid_t beDomId, domid_t feDomId, uint16_t devId,
+					const std::vector<ConnectorConfig>& connectors);
+	~DisplifFrontend();
+
+	/**
+	 * Performs xenbus handshake, returns true if the backend is connected
+	 */
+	bool connect(int timeoutMs = 3000);
+
+	/**
+	 * Allocates the buffer pages and sends dbuf create request
+	 */
+	int32_t createBuffer(unsigned int connector, uint64_t cookie,
+						 uint32_t width, uint32_t height, uint32_t bpp = 32,
+						 uint32_t flags = 0);
+	int32_t destroyBuffer(unsigned int connector, uint64_t cookie);
+	int32_t attachFb(unsigned int connector, uint64_t dbufCookie,
+					 uint64_t fbCookie, uint32_t width, uint32_t height,
+					 uint32_t format = 0x34325258 /* XR24 */);
+	int32_t detachFb(unsigned int connector, uint64_t fbCookie);
+	int32_t setConfig(unsigned int connector, uint64_t fbCookie,
+					  uint32_t width, uint32_t height, uint32_t bpp = 32);
+
+	/**
+	 * Sends the page flip requests with one notification, returns statuses
+	 */
+	std::vector<int32_t> pageFlips(unsigned int connector,
+								   const std::vector<uint64_t>& fbCookies);
+
+	/**
+	 * Waits for the number of page flip events, returns number of received
+	 * events
+	 */
+	size_t waitFlipEvents(unsigned int connector, size_t count,
+						  int timeoutMs = 3000);
+
+	/**
+	 * Returns pixels of the buffer
+	 */
+	uint8_t* getBuffer(uint64_t cookie);
+
+private:
+
+	struct Connector
+	{
+		ConnectorConfig config;
+		xen_displif_front_ring ring;
+		grant_ref_t ringRef;
+		evtchn_port_t port;
+		Channel channel;
+		grant_ref_t evtRef;
+		evtchn_port_t evtPort;
+		Channel evtChannel;
+		size_t numEvents;
+		uint16_t id;
+	};
+
+	std::vector<std::unique_ptr<Connector>> mConnectors;
+	std::map<uint64_t, grant_ref_t> mBuffers;
+
+	void initConnector(const ConnectorConfig& config);
+	void queueRequest(Connector& connector, xendispl_req& req);
+	std::vector<int32_t> waitResponses(Connector& connector, size_t count);
+	void readEvents(Connector& connector);
+};
+
+/*******************************************************************************
+ * Displif frontend handler using the given sink
+ ******************************************************************************/
+class DisplifLoopbackHandler : public XenBackend::DisplifFrontendHandler
+{
+public:
+
+	DisplifLoopbackHandler(domid_t beDomId, domid_t feDomId, uint16_t devId,
+						   XenBackend::DisplifSinkPtr sink,
+						   const XenBackend::DisplifConfig& config =
+							   XenBackend::DisplifConfig()) :
+		DisplifFrontendHandler("vdispl", beDomId, feDomId, devId, config),
+		mSink(sink) {}
+
+protected:
+
+	XenBackend::DisplifSinkPtr createSink() override { return mSink; }
+
+private:
+
+	XenBackend::DisplifSinkPtr mSink;
+};
+
+#endif /* TESTS_LOOPBACK_DISPLIFFRONTEND_HPP_ */
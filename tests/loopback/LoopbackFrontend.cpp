@@ -0,0 +1,229 @@
+/*
+ *  Loopback frontend base
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include "LoopbackFrontend.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include "mocks/XenEvtchnMock.hpp"
+#include "mocks/XenGnttabMock.hpp"
+#include "mocks/XenStoreMock.hpp"
+
+using std::atomic;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::lock_guard;
+using std::mutex;
+using std::string;
+using std::this_thread::sleep_for;
+using std::to_string;
+using std::unique_lock;
+
+static const grant_ref_t cFirstRef = 1;
+static const grant_ref_t cLastRef = 16383;
+
+static atomic<grant_ref_t> gNextRef(cFirstRef);
+static atomic<evtchn_port_t> gNextPort(1000);
+
+static mutex gMutex;
+static int gNumFrontends = 0;
+
+/*******************************************************************************
+ * LoopbackFrontend
+ ******************************************************************************/
+
+LoopbackFrontend::LoopbackFrontend(const string& devName, domid_t beDomId,
+								   domid_t feDomId, uint16_t devId) :
+	mBeDomId(beDomId),
+	mFeDomId(feDomId)
+{
+	{
+		lock_guard<mutex> lock(gMutex);
+
+		if (gNumFrontends++ == 0)
+		{
+			XenGnttabMock::setSharedMode(true);
+		}
+	}
+
+	string feDomPath = "/local/domain/" + to_string(feDomId);
+	string beDomPath = "/local/domain/" + to_string(beDomId);
+
+	XenStoreMock::writeValue("domid", to_string(beDomId));
+	XenStoreMock::setDomainPath(feDomId, feDomPath);
+	XenStoreMock::setDomainPath(beDomId, beDomPath);
+
+	mFePath = feDomPath + "/device/" + devName + "/" + to_string(devId);
+	mBePath = beDomPath + "/backend/" + devName + "/" +
+			  to_string(feDomId) + "/" + to_string(devId);
+
+	XenStoreMock::writeValue(mBePath + "/frontend", mFePath);
+	XenStoreMock::writeValue(mFePath + "/backend", mBePath);
+	XenStoreMock::writeValue(mFePath + "/state",
+							 to_string(XenbusStateInitialising));
+	XenStoreMock::writeValue(mBePath + "/state",
+							 to_string(XenbusStateClosed));
+}
+
+LoopbackFrontend::~LoopbackFrontend()
+{
+	lock_guard<mutex> lock(gMutex);
+
+	if (--gNumFrontends == 0)
+	{
+		XenGnttabMock::setSharedMode(false);
+	}
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+void LoopbackFrontend::setState(xenbus_state state)
+{
+	XenStoreMock::writeValue(mFePath + "/state", to_string(state));
+}
+
+bool LoopbackFrontend::waitBackendState(xenbus_state state, int timeoutMs)
+{
+	auto end = steady_clock::now() + milliseconds(timeoutMs);
+
+	do
+	{
+		string value;
+
+		if (readBackend("state", value) && !value.empty() &&
+			stoi(value) == state)
+		{
+			return true;
+		}
+
+		sleep_for(milliseconds(1));
+	}
+	while (steady_clock::now() < end);
+
+	return false;
+}
+
+void LoopbackFrontend::writeFrontend(const string& entry, const string& value)
+{
+	XenStoreMock::writeValue(mFePath + "/" + entry, value);
+}
+
+void LoopbackFrontend::writeBackend(const string& entry, const string& value)
+{
+	XenStoreMock::writeValue(mBePath + "/" + entry, value);
+}
+
+bool LoopbackFrontend::readBackend(const string& entry, string& value)
+{
+	auto result = XenStoreMock::readValue(mBePath + "/" + entry);
+
+	if (!result)
+	{
+		return false;
+	}
+
+	value = result;
+
+	return true;
+}
+
+grant_ref_t LoopbackFrontend::allocRefs(size_t count)
+{
+	grant_ref_t ref = gNextRef.fetch_add(count);
+
+	if (ref + count > cLastRef + 1)
+	{
+		// wrap around: the refs of previous frontends are released by now
+		gNextRef = cFirstRef + count;
+
+		ref = cFirstRef;
+	}
+
+	return ref;
+}
+
+void* LoopbackFrontend::getPage(grant_ref_t ref)
+{
+	return XenGnttabMock::getGrantPage(ref);
+}
+
+evtchn_port_t LoopbackFrontend::allocPort()
+{
+	return gNextPort++;
+}
+
+/*******************************************************************************
+ * LoopbackFrontend::Channel
+ ******************************************************************************/
+
+LoopbackFrontend::Channel::~Channel()
+{
+	if (!mBound)
+	{
+		return;
+	}
+
+	try
+	{
+		XenEvtchnMock::setNotifyCbk(mLocalPort, nullptr);
+	}
+	catch(const std::exception& e)
+	{
+		// the backend has unbound the port already
+	}
+}
+
+void LoopbackFrontend::Channel::bind(domid_t feDomId, evtchn_port_t remotePort)
+{
+	mLocalPort = XenEvtchnMock::getLocalPort(feDomId, remotePort);
+	mBound = true;
+
+	XenEvtchnMock::setNotifyCbk(mLocalPort, [this] {
+		lock_guard<mutex> lock(mMutex);
+
+		mNotified = true;
+
+		mCondVar.notify_all();
+	});
+}
+
+void LoopbackFrontend::Channel::notify()
+{
+	XenEvtchnMock::signalPort(mLocalPort);
+}
+
+bool LoopbackFrontend::Channel::wait(int timeoutMs)
+{
+	unique_lock<mutex> lock(mMutex);
+
+	if (!mCondVar.wait_for(lock, milliseconds(timeoutMs),
+						   [this] { return mNotified; }))
+	{
+		return false;
+	}
+
+	mNotified = false;
+
+	return true;
+}
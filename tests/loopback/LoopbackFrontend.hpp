@@ -0,0 +1,104 @@
+/*
+ *  Loopback frontend base
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef TESTS_LOOPBACK_LOOPBACKFRONTEND_HPP_
+#define TESTS_LOOPBACK_LOOPBACKFRONTEND_HPP_
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+
+extern "C" {
+#include <xenctrl.h>
+#include <xen/io/xenbus.h>
+}
+
+/*******************************************************************************
+ * Frontend side of the loopback harness: the frontend lives in the same
+ * process as the backend and talks to it through the Xen mocks. Grant pages
+ * are shared with the backend (XenGnttabMock shared mode), ring notifications
+ * go through XenEvtchnMock.
+ ******************************************************************************/
+class LoopbackFrontend
+{
+public:
+
+	LoopbackFrontend(const std::string& devName, domid_t beDomId,
+					 domid_t feDomId, uint16_t devId);
+	virtual ~LoopbackFrontend();
+
+	const std::string& getFrontendPath() const { return mFePath; }
+	const std::string& getBackendPath() const { return mBePath; }
+
+	void setState(xenbus_state state);
+	bool waitBackendState(xenbus_state state, int timeoutMs = 3000);
+
+	void writeFrontend(const std::string& entry, const std::string& value);
+	void writeBackend(const std::string& entry, const std::string& value);
+	bool readBackend(const std::string& entry, std::string& value);
+
+	/**
+	 * Allocates consecutive grant refs: the frontend view of them is
+	 * contiguous memory returned by getPage() of the first one
+	 */
+	static grant_ref_t allocRefs(size_t count);
+	static void* getPage(grant_ref_t ref);
+
+	/**
+	 * Allocates remote port to be written to XenStore
+	 */
+	static evtchn_port_t allocPort();
+
+protected:
+
+	class Channel
+	{
+	public:
+
+		Channel() : mBound(false), mLocalPort(0), mNotified(false) {}
+		~Channel();
+
+		/**
+		 * Should be called when the backend has bound the remote port
+		 */
+		void bind(domid_t feDomId, evtchn_port_t remotePort);
+		void notify();
+		bool wait(int timeoutMs);
+
+	private:
+
+		bool mBound;
+		evtchn_port_t mLocalPort;
+		bool mNotified;
+		std::mutex mMutex;
+		std::condition_variable mCondVar;
+	};
+
+	domid_t mBeDomId;
+	domid_t mFeDomId;
+
+private:
+
+	std::string mFePath;
+	std::string mBePath;
+};
+
+#endif /* TESTS_LOOPBACK_LOOPBACKFRONTEND_HPP_ */
@@ -0,0 +1,552 @@
+/*
+ *  Loopback netif frontend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include "NetifFrontend.hpp"
+
+#include <chrono>
+#include <cstring>
+
+#include <netinet/in.h>
+
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::lock_guard;
+using std::min;
+using std::mutex;
+using std::string;
+using std::to_string;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+
+using XenBackend::NetifPacket;
+
+// wait in slices: tx and rx share the event channel, so a notification may
+// be taken by the other direction
+static const int cWaitSliceMs = 10;
+
+/*******************************************************************************
+ * NetifFrontend
+ ******************************************************************************/
+
+NetifFrontend::NetifFrontend(domid_t beDomId, domid_t feDomId, uint16_t devId,
+							 const Config& config) :
+	LoopbackFrontend("vif", beDomId, feDomId, devId),
+	mConfig(config)
+{
+	for (unsigned int i = 0; i < config.numQueues; i++)
+	{
+		initQueue();
+	}
+}
+
+NetifFrontend::~NetifFrontend()
+{
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+bool NetifFrontend::connect(int timeoutMs)
+{
+	setState(XenbusStateInitialising);
+
+	if (!waitBackendState(XenbusStateInitWait, timeoutMs))
+	{
+		return false;
+	}
+
+	auto numQueues = mQueues.size();
+
+	if (numQueues > 1)
+	{
+		writeFrontend("multi-queue-num-queues", to_string(numQueues));
+	}
+
+	for (size_t i = 0; i < numQueues; i++)
+	{
+		string prefix = numQueues > 1 ? "queue-" + to_string(i) + "/" : "";
+
+		writeFrontend(prefix + "tx-ring-ref", to_string(mQueues[i]->txRingRef));
+		writeFrontend(prefix + "rx-ring-ref", to_string(mQueues[i]->rxRingRef));
+		writeFrontend(prefix + "event-channel", to_string(mQueues[i]->port));
+	}
+
+	writeFrontend("request-rx-copy", "1");
+	writeFrontend("feature-sg", mConfig.sg ? "1" : "0");
+	writeFrontend("feature-gso-tcpv4", mConfig.gso ? "1" : "0");
+	writeFrontend("feature-gso-tcpv6", mConfig.gso ? "1" : "0");
+	writeFrontend("feature-no-csum-offload", mConfig.csum ? "0" : "1");
+	writeFrontend("feature-ipv6-csum-offload", mConfig.csum ? "1" : "0");
+
+	setState(XenbusStateInitialised);
+
+	if (!waitBackendState(XenbusStateConnected, timeoutMs))
+	{
+		return false;
+	}
+
+	for (auto& queue : mQueues)
+	{
+		queue->channel.bind(mFeDomId, queue->port);
+
+		postRxBuffers(*queue);
+	}
+
+	setState(XenbusStateConnected);
+
+	return true;
+}
+
+void NetifFrontend::disconnect()
+{
+	setState(XenbusStateClosing);
+
+	waitBackendState(XenbusStateClosed);
+
+	setState(XenbusStateClosed);
+}
+
+bool NetifFrontend::queuePacket(unsigned int queue, const uint8_t* data,
+								size_t size, uint16_t flags, uint8_t gsoType,
+								uint16_t gsoSize)
+{
+	auto& q = *mQueues.at(queue);
+
+	size_t numChunks = (size + XC_PAGE_SIZE - 1) / XC_PAGE_SIZE;
+	size_t numSlots = numChunks + (gsoType ? 1 : 0);
+
+	if (q.freeTxIds.size() < numChunks ||
+		RING_FREE_REQUESTS(&q.tx) < numSlots)
+	{
+		return false;
+	}
+
+	size_t offset = 0;
+
+	for (size_t i = 0; i < numChunks; i++)
+	{
+		auto id = q.freeTxIds.back();
+		auto len = min(size - offset, static_cast<size_t>(XC_PAGE_SIZE));
+
+		q.freeTxIds.pop_back();
+
+		memcpy(getPage(q.txDataRef + id), data + offset, len);
+
+		auto req = RING_GET_REQUEST(&q.tx, q.tx.req_prod_pvt++);
+
+		req->gref = q.txDataRef + id;
+		req->offset = 0;
+		req->id = id;
+		req->flags = i + 1 < numChunks ? NETTXF_more_data : 0;
+
+		if (i == 0)
+		{
+			// the first slot contains the size of the whole packet
+			req->size = size;
+			req->flags |= flags;
+
+			if (gsoType)
+			{
+				req->flags |= NETTXF_extra_info;
+
+				auto extra = reinterpret_cast<netif_extra_info*>(
+						RING_GET_REQUEST(&q.tx, q.tx.req_prod_pvt++));
+
+				memset(extra, 0, sizeof(*extra));
+
+				extra->type = XEN_NETIF_EXTRA_TYPE_GSO;
+				extra->u.gso.type = gsoType;
+				extra->u.gso.size = gsoSize;
+			}
+		}
+		else
+		{
+			req->size = len;
+		}
+
+		offset += len;
+	}
+
+	return true;
+}
+
+void NetifFrontend::kick(unsigned int queue)
+{
+	auto& q = *mQueues.at(queue);
+	int notify = 0;
+
+	RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&q.tx, notify);
+
+	if (notify)
+	{
+		q.channel.notify();
+	}
+}
+
+size_t NetifFrontend::getTxResponses(unsigned int queue,
+									 vector<int16_t>& statuses, int timeoutMs)
+{
+	auto& q = *mQueues.at(queue);
+	auto end = steady_clock::now() + milliseconds(timeoutMs);
+	size_t count = 0;
+
+	while (true)
+	{
+		int more = 0;
+
+		do
+		{
+			auto rp = q.tx.sring->rsp_prod;
+
+			xen_rmb();
+
+			for (auto i = q.tx.rsp_cons; i != rp; i++)
+			{
+				auto rsp = RING_GET_RESPONSE(&q.tx, i);
+
+				if (rsp->status == NETIF_RSP_NULL)
+				{
+					continue;
+				}
+
+				statuses.push_back(rsp->status);
+
+				q.freeTxIds.push_back(rsp->id);
+
+				count++;
+			}
+
+			q.tx.rsp_cons = rp;
+
+			RING_FINAL_CHECK_FOR_RESPONSES(&q.tx, more);
+		}
+		while (more);
+
+		if (count || steady_clock::now() >= end)
+		{
+			return count;
+		}
+
+		waitQueue(q, timeoutMs);
+	}
+}
+
+size_t NetifFrontend::receivePackets(unsigned int queue,
+									 vector<Packet>& packets, int timeoutMs)
+{
+	auto& q = *mQueues.at(queue);
+	auto end = steady_clock::now() + milliseconds(timeoutMs);
+	size_t count = 0;
+
+	while (true)
+	{
+		int more = 0;
+
+		do
+		{
+			auto rp = q.rx.sring->rsp_prod;
+
+			xen_rmb();
+
+			for (auto i = q.rx.rsp_cons; i != rp; i++)
+			{
+				auto rsp = RING_GET_RESPONSE(&q.rx, i);
+
+				if (q.rxExtraPending)
+				{
+					auto extra = reinterpret_cast<netif_extra_info*>(rsp);
+
+					if (extra->type == XEN_NETIF_EXTRA_TYPE_GSO)
+					{
+						q.rxPacket.gsoType = extra->u.gso.type;
+						q.rxPacket.gsoSize = extra->u.gso.size;
+					}
+
+					q.rxExtraPending = extra->flags & XEN_NETIF_EXTRA_FLAG_MORE;
+				}
+				else
+				{
+					if (!q.rxInProgress)
+					{
+						q.rxPacket = Packet();
+						q.rxPacket.flags = rsp->flags;
+						q.rxInProgress = true;
+						q.rxExtraPending = rsp->flags & NETRXF_extra_info;
+					}
+
+					if (rsp->status > 0)
+					{
+						auto page = static_cast<uint8_t*>(getPage(
+								q.rxDataRef + (i & (RING_SIZE(&q.rx) - 1)))) +
+								rsp->offset;
+
+						q.rxPacket.data.insert(q.rxPacket.data.end(), page,
+											   page + rsp->status);
+					}
+
+					q.rxInProgress = rsp->flags & NETRXF_more_data;
+				}
+
+				if (!q.rxInProgress && !q.rxExtraPending)
+				{
+					packets.push_back(q.rxPacket);
+
+					count++;
+				}
+			}
+
+			q.rx.rsp_cons = rp;
+
+			RING_FINAL_CHECK_FOR_RESPONSES(&q.rx, more);
+		}
+		while (more);
+
+		postRxBuffers(q);
+
+		if (count || steady_clock::now() >= end)
+		{
+			return count;
+		}
+
+		waitQueue(q, timeoutMs);
+	}
+}
+
+vector<uint8_t> NetifFrontend::makeFrame(uint8_t proto, uint16_t srcPort,
+										 uint16_t dstPort, size_t payload)
+{
+	size_t l4Len = proto == IPPROTO_TCP ? 20 : 8;
+	size_t ipLen = 20 + l4Len + payload;
+
+	vector<uint8_t> frame(14 + ipLen);
+
+	for (size_t i = 0; i < payload; i++)
+	{
+		frame[14 + 20 + l4Len + i] = static_cast<uint8_t>(i * 13 + srcPort);
+	}
+
+	uint8_t* eth = frame.data();
+	uint8_t* ip = eth + 14;
+	uint8_t* l4 = ip + 20;
+
+	// destination and source MAC
+	memcpy(eth, "\x00\x16\x3e\x00\x00\x01\x00\x16\x3e\x00\x00\x02", 12);
+	eth[12] = 0x08;
+	eth[13] = 0x00;
+
+	ip[0] = 0x45;
+	ip[2] = (ipLen > 0xFFFF ? 0 : ipLen) >> 8;
+	ip[3] = ipLen & 0xFF;
+	ip[8] = 64;
+	ip[9] = proto;
+	memcpy(&ip[12], "\x0a\x00\x00\x01\x0a\x00\x00\x02", 8);
+
+	l4[0] = srcPort >> 8;
+	l4[1] = srcPort & 0xFF;
+	l4[2] = dstPort >> 8;
+	l4[3] = dstPort & 0xFF;
+
+	if (proto == IPPROTO_TCP)
+	{
+		l4[12] = 5 << 4;
+	}
+	else
+	{
+		l4[4] = (l4Len + payload) >> 8;
+		l4[5] = (l4Len + payload) & 0xFF;
+	}
+
+	return frame;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void NetifFrontend::initQueue()
+{
+	unique_ptr<Queue> queue(new Queue());
+
+	queue->txRingRef = allocRefs(1);
+	queue->rxRingRef = allocRefs(1);
+	queue->port = allocPort();
+	queue->rxInProgress = false;
+	queue->rxExtraPending = false;
+
+	auto txSring = static_cast<netif_tx_sring*>(getPage(queue->txRingRef));
+	auto rxSring = static_cast<netif_rx_sring*>(getPage(queue->rxRingRef));
+
+	memset(txSring, 0, XC_PAGE_SIZE);
+	memset(rxSring, 0, XC_PAGE_SIZE);
+
+	SHARED_RING_INIT(txSring);
+	FRONT_RING_INIT(&queue->tx, txSring, XC_PAGE_SIZE);
+
+	SHARED_RING_INIT(rxSring);
+	FRONT_RING_INIT(&queue->rx, rxSring, XC_PAGE_SIZE);
+
+	auto txSize = RING_SIZE(&queue->tx);
+
+	queue->txDataRef = allocRefs(txSize);
+	queue->rxDataRef = allocRefs(RING_SIZE(&queue->rx));
+
+	for (unsigned int i = 0; i < txSize; i++)
+	{
+		queue->freeTxIds.push_back(txSize - i - 1);
+	}
+
+	mQueues.push_back(move(queue));
+}
+
+void NetifFrontend::postRxBuffers(Queue& queue)
+{
+	auto size = RING_SIZE(&queue.rx);
+
+	while (queue.rx.req_prod_pvt - queue.rx.rsp_cons < size)
+	{
+		auto index = queue.rx.req_prod_pvt & (size - 1);
+		auto req = RING_GET_REQUEST(&queue.rx, queue.rx.req_prod_pvt++);
+
+		req->id = index;
+		req->gref = queue.rxDataRef + index;
+	}
+
+	int notify = 0;
+
+	RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&queue.rx, notify);
+
+	if (notify)
+	{
+		queue.channel.notify();
+	}
+}
+
+bool NetifFrontend::waitQueue(Queue& queue, int timeoutMs)
+{
+	return queue.channel.wait(min(timeoutMs, cWaitSliceMs));
+}
+
+/*******************************************************************************
+ * NetifMemoryDevice
+ ******************************************************************************/
+
+NetifMemoryDevice::NetifMemoryDevice(bool store) :
+	mStore(store),
+	mCsum(false),
+	mTso4(false),
+	mTso6(false),
+	mSentCount(0),
+	mSentBytes(0)
+{
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+void NetifMemoryDevice::start(ReceiveCallback callback)
+{
+	lock_guard<mutex> lock(mReceiveMutex);
+
+	mCallback = callback;
+}
+
+void NetifMemoryDevice::stop()
+{
+	lock_guard<mutex> lock(mReceiveMutex);
+
+	mCallback = nullptr;
+}
+
+size_t NetifMemoryDevice::send(const NetifPacket* packets, size_t count)
+{
+	lock_guard<mutex> lock(mSendMutex);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if (mStore)
+		{
+			mSent.push_back({packets[i].hdr,
+							 vector<uint8_t>(packets[i].data,
+											 packets[i].data +
+											 packets[i].size)});
+		}
+
+		mSentBytes += packets[i].size;
+	}
+
+	mSentCount += count;
+
+	mCondVar.notify_all();
+
+	return count;
+}
+
+void NetifMemoryDevice::setOffload(bool csum, bool tso4, bool tso6)
+{
+	mCsum = csum;
+	mTso4 = tso4;
+	mTso6 = tso6;
+}
+
+bool NetifMemoryDevice::inject(NetifPacket* packets, size_t count)
+{
+	lock_guard<mutex> lock(mReceiveMutex);
+
+	if (!mCallback)
+	{
+		return false;
+	}
+
+	mCallback(packets, count);
+
+	return true;
+}
+
+bool NetifMemoryDevice::waitSent(size_t count, int timeoutMs)
+{
+	unique_lock<mutex> lock(mSendMutex);
+
+	return mCondVar.wait_for(lock, milliseconds(timeoutMs),
+							 [this, count] { return mSentCount >= count; });
+}
+
+vector<NetifMemoryDevice::Packet> NetifMemoryDevice::getSent()
+{
+	lock_guard<mutex> lock(mSendMutex);
+
+	return mSent;
+}
+
+uint64_t NetifMemoryDevice::getSentCount()
+{
+	lock_guard<mutex> lock(mSendMutex);
+
+	return mSentCount;
+}
+
+uint64_t NetifMemoryDevice::getSentBytes()
+{
+	lock_guard<mutex> lock(mSendMutex);
+
+	return mSentBytes;
+}
@@ -0,0 +1,208 @@
+/*
+ *  Loopback netif frontend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef TESTS_LOOPBACK_NETIFFRONTEND_HPP_
+#define TESTS_LOOPBACK_NETIFFRONTEND_HPP_
+
+#include <condition_variable>
+#include <memory>
+#include <vector>
+
+extern "C" {
+#include <xen/io/netif.h>
+}
+
+#include "NetifBackend.hpp"
+
+#include "LoopbackFrontend.hpp"
+
+/*******************************************************************************
+ * Netif frontend simulator. Each queue owns one data page per ring slot:
+ * tx pages are indexed by the request id, rx pages by the ring index as
+ * Linux netfront does.
+ ******************************************************************************/
+class NetifFrontend : public LoopbackFrontend
+{
+public:
+
+	struct Config
+	{
+		unsigned int numQueues = 1;
+		bool sg = true;
+		bool gso = true;
+		bool csum = true;
+	};
+
+	struct Packet
+	{
+		std::vector<uint8_t> data;
+		uint16_t flags;
+		uint8_t gsoType;
+		uint16_t gsoSize;
+	};
+
+	NetifFrontend(domid_t beDomId, domid_t feDomId, uint16_t devId,
+				  const Config& config);
+	~NetifFrontend();
+
+	/**
+	 * Performs xenbus handshake, returns true if the backend is connected
+	 */
+	bool connect(int timeoutMs = 3000);
+	void disconnect();
+
+	unsigned int getNumQueues() const { return mQueues.size(); }
+
+	/**
+	 * Puts packet into the tx ring without notifying the backend,
+	 * returns false if there are no free slots
+	 */
+	bool queuePacket(unsigned int queue, const uint8_t* data, size_t size,
+					 uint16_t flags = 0, uint8_t gsoType = 0,
+					 uint16_t gsoSize = 0);
+	void kick(unsigned int queue);
+
+	/**
+	 * Collects tx responses (null responses are skipped), waits for
+	 * notification if there are no responses
+	 */
+	size_t getTxResponses(unsigned int queue, std::vector<int16_t>& statuses,
+						  int timeoutMs = 3000);
+
+	/**
+	 * Collects received packets and reposts rx buffers, waits for
+	 * notification if there are no packets
+	 */
+	size_t receivePackets(unsigned int queue, std::vector<Packet>& packets,
+						  int timeoutMs = 3000);
+
+	/**
+	 * Builds Ethernet/IPv4 frame with TCP or UDP header
+	 */
+	static std::vector<uint8_t> makeFrame(uint8_t proto, uint16_t srcPort,
+										  uint16_t dstPort, size_t payload);
+
+private:
+
+	struct Queue
+	{
+		netif_tx_front_ring tx;
+		netif_rx_front_ring rx;
+		grant_ref_t txRingRef;
+		grant_ref_t rxRingRef;
+		grant_ref_t txDataRef;
+		grant_ref_t rxDataRef;
+		evtchn_port_t port;
+		Channel channel;
+		std::vector<uint16_t> freeTxIds;
+		Packet rxPacket;
+		bool rxInProgress;
+		bool rxExtraPending;
+	};
+
+	Config mConfig;
+	std::vector<std::unique_ptr<Queue>> mQueues;
+
+	void initQueue();
+	void postRxBuffers(Queue& queue);
+	bool waitQueue(Queue& queue, int timeoutMs);
+};
+
+/*******************************************************************************
+ * In memory host device: packets sent by the backend are stored (or only
+ * counted), packets are injected on the device thread of the caller.
+ ******************************************************************************/
+class NetifMemoryDevice : public XenBackend::NetifDevice
+{
+public:
+
+	struct Packet
+	{
+		XenBackend::NetifVnetHdr hdr;
+		std::vector<uint8_t> data;
+	};
+
+	/**
+	 * @param store stores sent packets if true, counts them otherwise
+	 */
+	explicit NetifMemoryDevice(bool store = true);
+
+	void start(ReceiveCallback callback) override;
+	void stop() override;
+	size_t send(const XenBackend::NetifPacket* packets,
+				size_t count) override;
+	void setOffload(bool csum, bool tso4, bool tso6) override;
+
+	/**
+	 * Passes packets to the backend as if they were received by the device,
+	 * returns false if the device is not started
+	 */
+	bool inject(XenBackend::NetifPacket* packets, size_t count);
+
+	/**
+	 * Waits for the number of sent packets
+	 */
+	bool waitSent(size_t count, int timeoutMs = 3000);
+	std::vector<Packet> getSent();
+	uint64_t getSentCount();
+	uint64_t getSentBytes();
+
+	bool isCsumOffload() const { return mCsum; }
+	bool isTso4Offload() const { return mTso4; }
+
+private:
+
+	bool mStore;
+	bool mCsum;
+	bool mTso4;
+	bool mTso6;
+	ReceiveCallback mCallback;
+	std::mutex mReceiveMutex;
+	std::mutex mSendMutex;
+	std::condition_variable mCondVar;
+	std::vector<Packet> mSent;
+	uint64_t mSentCount;
+	uint64_t mSentBytes;
+};
+
+/*******************************************************************************
+ * Netif frontend handler using the given device instead of TAP
+ ******************************************************************************/
+class NetifLoopbackHandler : public XenBackend::NetifFrontendHandler
+{
+public:
+
+	NetifLoopbackHandler(domid_t beDomId, domid_t feDomId, uint16_t devId,
+						 XenBackend::NetifDevicePtr device,
+						 const XenBackend::NetifConfig& config =
+							 XenBackend::NetifConfig()) :
+		NetifFrontendHandler("vif", beDomId, feDomId, devId, config),
+		mDevice(device) {}
+
+protected:
+
+	XenBackend::NetifDevicePtr createDevice() override { return mDevice; }
+
+private:
+
+	XenBackend::NetifDevicePtr mDevice;
+};
+
+#endif /* TESTS_LOOPBACK_NETIFFRONTEND_HPP_ */
@@ -0,0 +1,248 @@
+/*
+ *  Loopback 9pfs frontend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include "P9fsFrontend.hpp"
+
+#include <chrono>
+#include <cstring>
+
+#include "Exception.hpp"
+
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::min;
+using std::string;
+using std::to_string;
+using std::unique_ptr;
+using std::vector;
+
+using XenBackend::Exception;
+using XenBackend::P9fsWriter;
+
+/*******************************************************************************
+ * P9fsFrontend
+ ******************************************************************************/
+
+P9fsFrontend::P9fsFrontend(domid_t beDomId, domid_t feDomId, uint16_t devId,
+						   unsigned int numRings, unsigned int ringOrder) :
+	LoopbackFrontend("9pfs", beDomId, feDomId, devId),
+	mRingOrder(ringOrder)
+{
+	for (unsigned int i = 0; i < numRings; i++)
+	{
+		unique_ptr<Ring> ring(new Ring());
+
+		ring->intfRef = allocRefs(1);
+		ring->dataRef = allocRefs(1 << ringOrder);
+		ring->port = allocPort();
+
+		auto intf = getIntf(*ring);
+
+		memset(intf, 0, XC_PAGE_SIZE);
+
+		intf->ring_order = ringOrder;
+
+		for (unsigned int j = 0; j < (1u << ringOrder); j++)
+		{
+			intf->ref[j] = ring->dataRef + j;
+		}
+
+		mRings.push_back(std::move(ring));
+	}
+}
+
+P9fsFrontend::~P9fsFrontend()
+{
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+bool P9fsFrontend::connect(const string& path, int timeoutMs)
+{
+	// written by the toolstack in the real system
+	writeBackend("path", path);
+
+	setState(XenbusStateInitialising);
+
+	if (!waitBackendState(XenbusStateInitWait, timeoutMs))
+	{
+		return false;
+	}
+
+	writeFrontend("version", "1");
+	writeFrontend("num-rings", to_string(mRings.size()));
+
+	for (size_t i = 0; i < mRings.size(); i++)
+	{
+		writeFrontend("ring-ref" + to_string(i),
+					  to_string(mRings[i]->intfRef));
+		writeFrontend("event-channel-" + to_string(i),
+					  to_string(mRings[i]->port));
+	}
+
+	setState(XenbusStateInitialised);
+
+	if (!waitBackendState(XenbusStateConnected, timeoutMs))
+	{
+		return false;
+	}
+
+	for (auto& ring : mRings)
+	{
+		ring->channel.bind(mFeDomId, ring->port);
+	}
+
+	setState(XenbusStateConnected);
+
+	return true;
+}
+
+void P9fsFrontend::disconnect()
+{
+	setState(XenbusStateClosing);
+
+	waitBackendState(XenbusStateClosed);
+
+	setState(XenbusStateClosed);
+}
+
+void P9fsFrontend::send(unsigned int ring, const vector<uint8_t>& msg,
+						int timeoutMs)
+{
+	auto& r = *mRings.at(ring);
+	auto intf = getIntf(r);
+	auto out = getOut(r);
+	auto ringSize = getRingSize();
+	auto end = steady_clock::now() + milliseconds(timeoutMs);
+
+	while (ringSize - (intf->out_prod - intf->out_cons) < msg.size())
+	{
+		auto remaining = duration_cast<milliseconds>(
+			end - steady_clock::now()).count();
+
+		if (remaining <= 0)
+		{
+			throw Exception("No space in out ring", ETIMEDOUT);
+		}
+
+		r.channel.wait(min<int>(remaining, 10));
+	}
+
+	xen_mb();
+
+	auto offset = intf->out_prod & (ringSize - 1);
+	auto first = min(msg.size(), ringSize - offset);
+
+	memcpy(&out[offset], msg.data(), first);
+	memcpy(out, &msg[first], msg.size() - first);
+
+	xen_wmb();
+
+	intf->out_prod += msg.size();
+
+	r.channel.notify();
+}
+
+vector<uint8_t> P9fsFrontend::receive(unsigned int ring, int timeoutMs)
+{
+	auto& r = *mRings.at(ring);
+	auto intf = getIntf(r);
+	auto in = getIn(r);
+	auto ringSize = getRingSize();
+	auto end = steady_clock::now() + milliseconds(timeoutMs);
+
+	auto copy = [in, ringSize] (RING_IDX index, void* data, size_t size)
+	{
+		auto offset = index & (ringSize - 1);
+		auto first = min(size, ringSize - offset);
+
+		memcpy(data, &in[offset], first);
+		memcpy(static_cast<uint8_t*>(data) + first, in, size - first);
+	};
+
+	while (true)
+	{
+		RING_IDX prod = intf->in_prod;
+
+		xen_rmb();
+
+		uint32_t size = 0;
+
+		if (prod - intf->in_cons >= P9fsWriter::cHeaderSize)
+		{
+			copy(intf->in_cons, &size, sizeof(size));
+		}
+
+		if (size && prod - intf->in_cons >= size)
+		{
+			vector<uint8_t> msg(size);
+
+			copy(intf->in_cons, msg.data(), size);
+
+			xen_mb();
+
+			intf->in_cons += size;
+
+			r.channel.notify();
+
+			return msg;
+		}
+
+		auto remaining = duration_cast<milliseconds>(
+			end - steady_clock::now()).count();
+
+		if (remaining <= 0)
+		{
+			throw Exception("Response timeout", ETIMEDOUT);
+		}
+
+		r.channel.wait(remaining);
+	}
+}
+
+vector<uint8_t> P9fsFrontend::transact(unsigned int ring,
+									   const vector<uint8_t>& msg)
+{
+	send(ring, msg);
+
+	return receive(ring);
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+xen_9pfs_data_intf* P9fsFrontend::getIntf(Ring& ring)
+{
+	return static_cast<xen_9pfs_data_intf*>(getPage(ring.intfRef));
+}
+
+uint8_t* P9fsFrontend::getIn(Ring& ring)
+{
+	return static_cast<uint8_t*>(getPage(ring.dataRef));
+}
+
+uint8_t* P9fsFrontend::getOut(Ring& ring)
+{
+	return getIn(ring) + getRingSize();
+}
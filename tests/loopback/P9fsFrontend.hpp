@@ -0,0 +1,92 @@
+/*
+ *  Loopback 9pfs frontend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef TESTS_LOOPBACK_P9FSFRONTEND_HPP_
+#define TESTS_LOOPBACK_P9FSFRONTEND_HPP_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <xen/io/9pfs.h>
+}
+
+#include "P9fsBackend.hpp"
+
+#include "LoopbackFrontend.hpp"
+
+/*******************************************************************************
+ * 9pfs frontend simulator. Each ring has its own data interface page and
+ * data pages. Messages are raw 9P messages encoded with P9fsWriter.
+ ******************************************************************************/
+class P9fsFrontend : public LoopbackFrontend
+{
+public:
+
+	P9fsFrontend(domid_t beDomId, domid_t feDomId, uint16_t devId,
+				 unsigned int numRings = 1, unsigned int ringOrder = 1);
+	~P9fsFrontend();
+
+	/**
+	 * Performs xenbus handshake exporting the given directory, returns true
+	 * if the backend is connected
+	 */
+	bool connect(const std::string& path, int timeoutMs = 3000);
+	void disconnect();
+
+	/**
+	 * Puts the message into the out ring, waits for free space if needed
+	 */
+	void send(unsigned int ring, const std::vector<uint8_t>& msg,
+			  int timeoutMs = 3000);
+
+	/**
+	 * Gets the next message from the in ring
+	 */
+	std::vector<uint8_t> receive(unsigned int ring, int timeoutMs = 3000);
+
+	std::vector<uint8_t> transact(unsigned int ring,
+								  const std::vector<uint8_t>& msg);
+
+	/**
+	 * Returns size of the in and out rings
+	 */
+	size_t getRingSize() const { return XEN_FLEX_RING_SIZE(mRingOrder); }
+
+private:
+
+	struct Ring
+	{
+		grant_ref_t intfRef;
+		grant_ref_t dataRef;
+		evtchn_port_t port;
+		Channel channel;
+	};
+
+	unsigned int mRingOrder;
+	std::vector<std::unique_ptr<Ring>> mRings;
+
+	xen_9pfs_data_intf* getIntf(Ring& ring);
+	uint8_t* getIn(Ring& ring);
+	uint8_t* getOut(Ring& ring);
+};
+
+#endif /* TESTS_LOOPBACK_P9FSFRONTEND_HPP_ */
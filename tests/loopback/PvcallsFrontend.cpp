@@ -0,0 +1,431 @@
+/*
+ *  Loopback pvcalls frontend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include "PvcallsFrontend.hpp"
+
+#include <chrono>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "Exception.hpp"
+
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::min;
+using std::string;
+using std::to_string;
+
+using XenBackend::Exception;
+
+/*******************************************************************************
+ * PvcallsFrontend
+ ******************************************************************************/
+
+PvcallsFrontend::PvcallsFrontend(domid_t beDomId, domid_t feDomId,
+								 uint16_t devId) :
+	LoopbackFrontend("pvcalls", beDomId, feDomId, devId),
+	mNextReqId(0)
+{
+	mRingRef = allocRefs(1);
+	mPort = allocPort();
+
+	auto sring = static_cast<xen_pvcalls_sring*>(getPage(mRingRef));
+
+	memset(sring, 0, XC_PAGE_SIZE);
+
+	SHARED_RING_INIT(sring);
+	FRONT_RING_INIT(&mRing, sring, XC_PAGE_SIZE);
+}
+
+PvcallsFrontend::~PvcallsFrontend()
+{
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+bool PvcallsFrontend::connect(int timeoutMs)
+{
+	setState(XenbusStateInitialising);
+
+	if (!waitBackendState(XenbusStateInitWait, timeoutMs))
+	{
+		return false;
+	}
+
+	writeFrontend("version", "1");
+	writeFrontend("ring-ref", to_string(mRingRef));
+	writeFrontend("port", to_string(mPort));
+
+	setState(XenbusStateInitialised);
+
+	if (!waitBackendState(XenbusStateConnected, timeoutMs))
+	{
+		return false;
+	}
+
+	mChannel.bind(mFeDomId, mPort);
+
+	setState(XenbusStateConnected);
+
+	return true;
+}
+
+void PvcallsFrontend::disconnect()
+{
+	setState(XenbusStateClosing);
+
+	waitBackendState(XenbusStateClosed);
+
+	setState(XenbusStateClosed);
+}
+
+uint32_t PvcallsFrontend::send(xen_pvcalls_request req)
+{
+	if (RING_FULL(&mRing))
+	{
+		throw Exception("Command ring is full", EBUSY);
+	}
+
+	req.req_id = mNextReqId++;
+
+	*RING_GET_REQUEST(&mRing, mRing.req_prod_pvt) = req;
+
+	mRing.req_prod_pvt++;
+
+	int notify = 0;
+
+	RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&mRing, notify);
+
+	if (notify)
+	{
+		mChannel.notify();
+	}
+
+	return req.req_id;
+}
+
+bool PvcallsFrontend::receive(uint32_t reqId, xen_pvcalls_response& rsp,
+							  int timeoutMs)
+{
+	auto end = steady_clock::now() + milliseconds(timeoutMs);
+
+	while (true)
+	{
+		int more = 0;
+
+		do
+		{
+			auto rp = mRing.sring->rsp_prod;
+
+			xen_rmb();
+
+			for (auto i = mRing.rsp_cons; i != rp; i++)
+			{
+				auto response = RING_GET_RESPONSE(&mRing, i);
+
+				mResponses[response->req_id] = *response;
+			}
+
+			mRing.rsp_cons = rp;
+
+			RING_FINAL_CHECK_FOR_RESPONSES(&mRing, more);
+		}
+		while (more);
+
+		auto it = mResponses.find(reqId);
+
+		if (it != mResponses.end())
+		{
+			rsp = it->second;
+
+			mResponses.erase(it);
+
+			return true;
+		}
+
+		auto remaining = duration_cast<milliseconds>(
+			end - steady_clock::now()).count();
+
+		if (remaining <= 0)
+		{
+			return false;
+		}
+
+		mChannel.wait(remaining);
+	}
+}
+
+int32_t PvcallsFrontend::call(const xen_pvcalls_request& req)
+{
+	xen_pvcalls_response rsp;
+
+	if (!receive(send(req), rsp))
+	{
+		throw Exception("Response timeout", ETIMEDOUT);
+	}
+
+	return rsp.ret;
+}
+
+int32_t PvcallsFrontend::socket(uint64_t id)
+{
+	xen_pvcalls_request req {};
+
+	req.cmd = PVCALLS_SOCKET;
+	req.u.socket.id = id;
+	req.u.socket.domain = AF_INET;
+	req.u.socket.type = SOCK_STREAM;
+
+	return call(req);
+}
+
+int32_t PvcallsFrontend::connectSocket(uint64_t id, uint16_t port,
+									   DataRing& ring)
+{
+	xen_pvcalls_request req {};
+
+	req.cmd = PVCALLS_CONNECT;
+	req.u.connect.id = id;
+	req.u.connect.ref = ring.intfRef;
+	req.u.connect.evtchn = ring.port;
+
+	fillAddr(req.u.connect.addr, req.u.connect.len, port);
+
+	auto ret = call(req);
+
+	if (ret == 0)
+	{
+		bindDataRing(ring);
+	}
+
+	return ret;
+}
+
+int32_t PvcallsFrontend::bind(uint64_t id, uint16_t port)
+{
+	xen_pvcalls_request req {};
+
+	req.cmd = PVCALLS_BIND;
+	req.u.bind.id = id;
+
+	fillAddr(req.u.bind.addr, req.u.bind.len, port);
+
+	return call(req);
+}
+
+int32_t PvcallsFrontend::listen(uint64_t id, uint32_t backlog)
+{
+	xen_pvcalls_request req {};
+
+	req.cmd = PVCALLS_LISTEN;
+	req.u.listen.id = id;
+	req.u.listen.backlog = backlog;
+
+	return call(req);
+}
+
+int32_t PvcallsFrontend::release(uint64_t id)
+{
+	xen_pvcalls_request req {};
+
+	req.cmd = PVCALLS_RELEASE;
+	req.u.release.id = id;
+
+	return call(req);
+}
+
+PvcallsFrontend::DataRingPtr PvcallsFrontend::allocDataRing(unsigned int order)
+{
+	DataRingPtr ring(new DataRing());
+
+	ring->order = order;
+	ring->intfRef = allocRefs(1);
+	ring->dataRef = allocRefs(1 << order);
+	ring->port = allocPort();
+
+	auto intf = getIntf(*ring);
+
+	memset(intf, 0, XC_PAGE_SIZE);
+
+	intf->ring_order = order;
+
+	for (unsigned int i = 0; i < (1u << order); i++)
+	{
+		intf->ref[i] = ring->dataRef + i;
+	}
+
+	return ring;
+}
+
+void PvcallsFrontend::bindDataRing(DataRing& ring)
+{
+	ring.channel.bind(mFeDomId, ring.port);
+}
+
+void PvcallsFrontend::write(DataRing& ring, const string& data, int timeoutMs)
+{
+	auto intf = getIntf(ring);
+	auto out = getOut(ring);
+	auto size = getRingSize(ring);
+	auto end = steady_clock::now() + milliseconds(timeoutMs);
+	size_t written = 0;
+
+	while (written < data.size())
+	{
+		RING_IDX cons = intf->out_cons;
+		RING_IDX prod = intf->out_prod;
+
+		xen_mb();
+
+		auto free = size - (prod - cons);
+
+		if (free == 0)
+		{
+			auto remaining = duration_cast<milliseconds>(
+				end - steady_clock::now()).count();
+
+			if (remaining <= 0)
+			{
+				throw Exception("No space in out ring", ETIMEDOUT);
+			}
+
+			ring.channel.wait(min<int>(remaining, 10));
+
+			continue;
+		}
+
+		auto chunk = min(free, data.size() - written);
+		auto offset = prod & (size - 1);
+		auto first = min(chunk, size - offset);
+
+		memcpy(&out[offset], &data[written], first);
+		memcpy(out, &data[written + first], chunk - first);
+
+		xen_wmb();
+
+		intf->out_prod = prod + chunk;
+
+		written += chunk;
+
+		ring.channel.notify();
+	}
+}
+
+string PvcallsFrontend::read(DataRing& ring, size_t size, int timeoutMs)
+{
+	auto intf = getIntf(ring);
+	auto in = getIn(ring);
+	auto ringSize = getRingSize(ring);
+	auto end = steady_clock::now() + milliseconds(timeoutMs);
+	string data;
+
+	while (data.size() < size)
+	{
+		RING_IDX prod = intf->in_prod;
+
+		xen_rmb();
+
+		RING_IDX cons = intf->in_cons;
+		size_t available = prod - cons;
+
+		if (available)
+		{
+			auto chunk = min(available, size - data.size());
+			auto offset = cons & (ringSize - 1);
+			auto first = min(chunk, ringSize - offset);
+
+			data.append(reinterpret_cast<char*>(&in[offset]), first);
+			data.append(reinterpret_cast<char*>(in), chunk - first);
+
+			xen_mb();
+
+			intf->in_cons = cons + chunk;
+
+			ring.channel.notify();
+
+			continue;
+		}
+
+		if (intf->in_error)
+		{
+			break;
+		}
+
+		auto remaining = duration_cast<milliseconds>(
+			end - steady_clock::now()).count();
+
+		if (remaining <= 0)
+		{
+			break;
+		}
+
+		ring.channel.wait(min<int>(remaining, 10));
+	}
+
+	return data;
+}
+
+int32_t PvcallsFrontend::getInError(DataRing& ring)
+{
+	return getIntf(ring)->in_error;
+}
+
+int32_t PvcallsFrontend::getOutError(DataRing& ring)
+{
+	return getIntf(ring)->out_error;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+pvcalls_data_intf* PvcallsFrontend::getIntf(DataRing& ring)
+{
+	return static_cast<pvcalls_data_intf*>(getPage(ring.intfRef));
+}
+
+uint8_t* PvcallsFrontend::getIn(DataRing& ring)
+{
+	return static_cast<uint8_t*>(getPage(ring.dataRef));
+}
+
+uint8_t* PvcallsFrontend::getOut(DataRing& ring)
+{
+	return getIn(ring) + getRingSize(ring);
+}
+
+void PvcallsFrontend::fillAddr(uint8_t* addr, uint32_t& len, uint16_t port)
+{
+	sockaddr_in sin {};
+
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	memcpy(addr, &sin, sizeof(sin));
+
+	len = sizeof(sin);
+}
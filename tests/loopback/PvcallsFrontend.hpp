@@ -0,0 +1,128 @@
+/*
+ *  Loopback pvcalls frontend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef TESTS_LOOPBACK_PVCALLSFRONTEND_HPP_
+#define TESTS_LOOPBACK_PVCALLSFRONTEND_HPP_
+
+#include <map>
+#include <memory>
+#include <string>
+
+extern "C" {
+#include <xen/io/pvcalls.h>
+}
+
+#include "LoopbackFrontend.hpp"
+
+/*******************************************************************************
+ * pvcalls frontend simulator. Commands go through the command ring, each
+ * connected socket has its own data ring allocated with allocDataRing().
+ ******************************************************************************/
+class PvcallsFrontend : public LoopbackFrontend
+{
+public:
+
+	struct DataRing
+	{
+		grant_ref_t intfRef;
+		grant_ref_t dataRef;
+		evtchn_port_t port;
+		unsigned int order;
+		Channel channel;
+	};
+
+	typedef std::unique_ptr<DataRing> DataRingPtr;
+
+	PvcallsFrontend(domid_t beDomId, domid_t feDomId, uint16_t devId);
+	~PvcallsFrontend();
+
+	/**
+	 * Performs xenbus handshake, returns true if the backend is connected
+	 */
+	bool connect(int timeoutMs = 3000);
+	void disconnect();
+
+	/**
+	 * Puts the command into the ring, returns request id
+	 */
+	uint32_t send(xen_pvcalls_request req);
+
+	/**
+	 * Waits for the response to the request, returns false on timeout
+	 */
+	bool receive(uint32_t reqId, xen_pvcalls_response& rsp,
+				 int timeoutMs = 3000);
+
+	/**
+	 * Sends the command and returns the result
+	 */
+	int32_t call(const xen_pvcalls_request& req);
+
+	int32_t socket(uint64_t id);
+	int32_t connectSocket(uint64_t id, uint16_t port, DataRing& ring);
+	int32_t bind(uint64_t id, uint16_t port);
+	int32_t listen(uint64_t id, uint32_t backlog = 8);
+	int32_t release(uint64_t id);
+
+	/**
+	 * Allocates data ring to be passed with connect or accept
+	 */
+	DataRingPtr allocDataRing(unsigned int order = 1);
+
+	/**
+	 * Should be called when the backend has answered connect or accept
+	 */
+	void bindDataRing(DataRing& ring);
+
+	/**
+	 * Writes the data to the out ring, waits for free space if needed
+	 */
+	void write(DataRing& ring, const std::string& data, int timeoutMs = 3000);
+
+	/**
+	 * Reads the data from the in ring. Returns less data if the backend
+	 * reports an error or the timeout expires.
+	 */
+	std::string read(DataRing& ring, size_t size, int timeoutMs = 3000);
+
+	int32_t getInError(DataRing& ring);
+	int32_t getOutError(DataRing& ring);
+
+	static size_t getRingSize(const DataRing& ring)
+	{
+		return XEN_FLEX_RING_SIZE(ring.order);
+	}
+
+private:
+
+	grant_ref_t mRingRef;
+	evtchn_port_t mPort;
+	Channel mChannel;
+	xen_pvcalls_front_ring mRing;
+	uint32_t mNextReqId;
+	std::map<uint32_t, xen_pvcalls_response> mResponses;
+
+	pvcalls_data_intf* getIntf(DataRing& ring);
+	uint8_t* getIn(DataRing& ring);
+	uint8_t* getOut(DataRing& ring);
+	void fillAddr(uint8_t* addr, uint32_t& len, uint16_t port);
+};
+
+#endif /* TESTS_LOOPBACK_PVCALLSFRONTEND_HPP_ */
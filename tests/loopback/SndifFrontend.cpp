@@ -0,0 +1,423 @@
+/*
+ *  Loopback sndif frontend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include "SndifFrontend.hpp"
+
+#include <chrono>
+#include <cstring>
+
+#include "Exception.hpp"
+
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::lock_guard;
+using std::min;
+using std::mutex;
+using std::string;
+using std::to_string;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+
+using XenBackend::Exception;
+
+/*******************************************************************************
+ * SndifFrontend
+ ******************************************************************************/
+
+SndifFrontend::SndifFrontend(domid_t beDomId, domid_t feDomId, uint16_t devId,
+							 const vector<StreamConfig>& streams) :
+	LoopbackFrontend("vsnd", beDomId, feDomId, devId)
+{
+	for (unsigned int i = 0; i < streams.size(); i++)
+	{
+		initStream(i, streams[i]);
+	}
+}
+
+SndifFrontend::~SndifFrontend()
+{
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+bool SndifFrontend::connect(int timeoutMs)
+{
+	setState(XenbusStateInitialising);
+
+	if (!waitBackendState(XenbusStateInitWait, timeoutMs))
+	{
+		return false;
+	}
+
+	// all streams belong to PCM device 0
+
+	for (size_t i = 0; i < mStreams.size(); i++)
+	{
+		auto& stream = *mStreams[i];
+		string prefix = "0/" + to_string(i) + "/";
+
+		writeFrontend(prefix + "type", stream.config.playback ? "p" : "c");
+		writeFrontend(prefix + "ring-ref", to_string(stream.ringRef));
+		writeFrontend(prefix + "event-channel", to_string(stream.port));
+		writeFrontend(prefix + "evt-ring-ref", to_string(stream.evtRef));
+		writeFrontend(prefix + "evt-event-channel",
+					  to_string(stream.evtPort));
+	}
+
+	setState(XenbusStateInitialised);
+
+	if (!waitBackendState(XenbusStateConnected, timeoutMs))
+	{
+		return false;
+	}
+
+	for (auto& stream : mStreams)
+	{
+		stream->channel.bind(mFeDomId, stream->port);
+		stream->evtChannel.bind(mFeDomId, stream->evtPort);
+	}
+
+	setState(XenbusStateConnected);
+
+	return true;
+}
+
+void SndifFrontend::disconnect()
+{
+	setState(XenbusStateClosing);
+
+	waitBackendState(XenbusStateClosed);
+
+	setState(XenbusStateClosed);
+}
+
+int32_t SndifFrontend::open(unsigned int stream)
+{
+	auto& s = *mStreams.at(stream);
+
+	xensnd_req req {};
+
+	req.operation = XENSND_OP_OPEN;
+	req.op.open.pcm_rate = s.config.rate;
+	req.op.open.pcm_format = s.config.format;
+	req.op.open.pcm_channels = s.config.channels;
+	req.op.open.buffer_sz = s.config.bufferSize;
+	req.op.open.gref_directory = s.dirRef;
+	req.op.open.period_sz = s.config.periodSize;
+
+	s.written = 0;
+	s.read = 0;
+	s.position = 0;
+
+	return request(stream, req);
+}
+
+int32_t SndifFrontend::close(unsigned int stream)
+{
+	xensnd_req req {};
+
+	req.operation = XENSND_OP_CLOSE;
+
+	return request(stream, req);
+}
+
+int32_t SndifFrontend::trigger(unsigned int stream, uint8_t type)
+{
+	xensnd_req req {};
+
+	req.operation = XENSND_OP_TRIGGER;
+	req.op.trigger.type = type;
+
+	return request(stream, req);
+}
+
+int32_t SndifFrontend::queryHwParam(unsigned int stream,
+									xensnd_query_hw_param& param)
+{
+	xensnd_req req {};
+	xensnd_resp rsp {};
+
+	req.operation = XENSND_OP_HW_PARAM_QUERY;
+	req.op.hw_param = param;
+
+	auto status = request(stream, req, &rsp);
+
+	param = rsp.resp.hw_param;
+
+	return status;
+}
+
+int32_t SndifFrontend::write(unsigned int stream, const void* data,
+							 size_t size)
+{
+	auto& s = *mStreams.at(stream);
+	auto buffer = getBuffer(s);
+	auto offset = s.written % s.config.bufferSize;
+	auto first = min<size_t>(size, s.config.bufferSize - offset);
+
+	memcpy(&buffer[offset], data, first);
+	memcpy(buffer, static_cast<const uint8_t*>(data) + first, size - first);
+
+	xensnd_req req {};
+
+	req.operation = XENSND_OP_WRITE;
+	req.op.rw.offset = offset;
+	req.op.rw.length = size;
+
+	s.written += size;
+
+	return request(stream, req);
+}
+
+int32_t SndifFrontend::read(unsigned int stream, void* data, size_t size)
+{
+	auto& s = *mStreams.at(stream);
+	auto offset = s.read % s.config.bufferSize;
+
+	xensnd_req req {};
+
+	req.operation = XENSND_OP_READ;
+	req.op.rw.offset = offset;
+	req.op.rw.length = size;
+
+	auto status = request(stream, req);
+
+	if (status == 0)
+	{
+		auto buffer = getBuffer(s);
+		auto first = min<size_t>(size, s.config.bufferSize - offset);
+
+		memcpy(data, &buffer[offset], first);
+		memcpy(static_cast<uint8_t*>(data) + first, buffer, size - first);
+
+		s.read += size;
+	}
+
+	return status;
+}
+
+size_t SndifFrontend::waitPosition(unsigned int stream, uint64_t position,
+								   int timeoutMs)
+{
+	auto& s = *mStreams.at(stream);
+	auto end = steady_clock::now() + milliseconds(timeoutMs);
+
+	readEvents(s);
+
+	while (s.position < position)
+	{
+		auto remaining = duration_cast<milliseconds>(
+			end - steady_clock::now()).count();
+
+		if (remaining <= 0 || !s.evtChannel.wait(remaining))
+		{
+			break;
+		}
+
+		readEvents(s);
+	}
+
+	return s.numEvents;
+}
+
+uint64_t SndifFrontend::getPosition(unsigned int stream)
+{
+	auto& s = *mStreams.at(stream);
+
+	readEvents(s);
+
+	return s.position;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void SndifFrontend::initStream(unsigned int index, const StreamConfig& config)
+{
+	unique_ptr<Stream> stream(new Stream());
+
+	stream->config = config;
+
+	stream->ringRef = allocRefs(1);
+	stream->port = allocPort();
+
+	auto sring = static_cast<xen_sndif_sring*>(getPage(stream->ringRef));
+
+	SHARED_RING_INIT(sring);
+	FRONT_RING_INIT(&stream->ring, sring, XC_PAGE_SIZE);
+
+	stream->evtRef = allocRefs(1);
+	stream->evtPort = allocPort();
+
+	memset(getPage(stream->evtRef), 0, XC_PAGE_SIZE);
+
+	size_t numPages = (config.bufferSize + XC_PAGE_SIZE - 1) / XC_PAGE_SIZE;
+
+	stream->dirRef = allocRefs(1);
+	stream->bufferRef = allocRefs(numPages);
+
+	auto dir = static_cast<xensnd_page_directory*>(getPage(stream->dirRef));
+
+	dir->gref_dir_next_page = 0;
+	dir->num_grefs = numPages;
+
+	for (size_t i = 0; i < numPages; i++)
+	{
+		dir->gref[i] = stream->bufferRef + i;
+	}
+
+	stream->written = 0;
+	stream->read = 0;
+	stream->position = 0;
+	stream->numEvents = 0;
+	stream->id = 0;
+
+	mStreams.push_back(std::move(stream));
+}
+
+int32_t SndifFrontend::request(unsigned int stream, xensnd_req& req,
+							   xensnd_resp* rsp)
+{
+	auto& s = *mStreams.at(stream);
+
+	req.id = s.id++;
+
+	*RING_GET_REQUEST(&s.ring, s.ring.req_prod_pvt) = req;
+
+	s.ring.req_prod_pvt++;
+
+	int notify = 0;
+
+	RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&s.ring, notify);
+
+	if (notify)
+	{
+		s.channel.notify();
+	}
+
+	auto end = steady_clock::now() + milliseconds(3000);
+
+	while (true)
+	{
+		int more = 0;
+
+		// rsp_event is set, otherwise the backend doesn't notify about the
+		// responses after the first one
+		RING_FINAL_CHECK_FOR_RESPONSES(&s.ring, more);
+
+		if (more)
+		{
+			xen_rmb();
+
+			auto resp = *RING_GET_RESPONSE(&s.ring, s.ring.rsp_cons);
+
+			s.ring.rsp_cons++;
+
+			if (resp.id != req.id)
+			{
+				throw Exception("Unexpected response id", EINVAL);
+			}
+
+			if (rsp)
+			{
+				*rsp = resp;
+			}
+
+			return resp.status;
+		}
+
+		auto remaining = duration_cast<milliseconds>(
+			end - steady_clock::now()).count();
+
+		if (remaining <= 0)
+		{
+			throw Exception("Response timeout", ETIMEDOUT);
+		}
+
+		s.channel.wait(remaining);
+	}
+}
+
+void SndifFrontend::readEvents(Stream& stream)
+{
+	auto page = static_cast<xensnd_event_page*>(getPage(stream.evtRef));
+	auto events = reinterpret_cast<xensnd_evt*>(
+		reinterpret_cast<uint8_t*>(page) + XENSND_IN_RING_OFFS);
+
+	auto prod = page->in_prod;
+
+	xen_rmb();
+
+	for (auto cons = page->in_cons; cons != prod; cons++)
+	{
+		auto& evt = events[cons % XENSND_IN_RING_LEN];
+
+		if (evt.type == XENSND_EVT_CUR_POS)
+		{
+			stream.position = evt.op.cur_pos.position;
+			stream.numEvents++;
+		}
+	}
+
+	xen_mb();
+
+	page->in_cons = prod;
+}
+
+uint8_t* SndifFrontend::getBuffer(Stream& stream)
+{
+	return static_cast<uint8_t*>(getPage(stream.bufferRef));
+}
+
+/*******************************************************************************
+ * SndifMemorySink
+ ******************************************************************************/
+
+void SndifMemorySink::write(const void* data, size_t size)
+{
+	lock_guard<mutex> lock(mMutex);
+
+	auto bytes = static_cast<const uint8_t*>(data);
+
+	mData.insert(mData.end(), bytes, bytes + size);
+	mNumPeriods++;
+
+	mCondVar.notify_all();
+}
+
+bool SndifMemorySink::waitPeriods(size_t count, int timeoutMs)
+{
+	unique_lock<mutex> lock(mMutex);
+
+	return mCondVar.wait_for(lock, milliseconds(timeoutMs),
+							 [this, count] { return mNumPeriods >= count; });
+}
+
+vector<uint8_t> SndifMemorySink::getData()
+{
+	lock_guard<mutex> lock(mMutex);
+
+	return mData;
+}
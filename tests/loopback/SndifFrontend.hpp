@@ -0,0 +1,164 @@
+/*
+ *  Loopback sndif frontend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef TESTS_LOOPBACK_SNDIFFRONTEND_HPP_
+#define TESTS_LOOPBACK_SNDIFFRONTEND_HPP_
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+extern "C" {
+#include <xen/io/sndif.h>
+}
+
+#include "SndifBackend.hpp"
+
+#include "LoopbackFrontend.hpp"
+
+/*******************************************************************************
+ * Sndif frontend simulator. Each stream has its own request ring, event
+ * page and PCM buffer described by one gref directory page.
+ ******************************************************************************/
+class SndifFrontend : public LoopbackFrontend
+{
+public:
+
+	struct StreamConfig
+	{
+		bool playback = true;
+		uint8_t format = XENSND_PCM_FORMAT_S16_LE;
+		uint8_t channels = 2;
+		uint32_t rate = 48000;
+		uint32_t bufferSize = 4 * XC_PAGE_SIZE;
+		uint32_t periodSize = XC_PAGE_SIZE;
+	};
+
+	SndifFrontend(domid_t beDomId, domid_t feDomId, uint16_t devId,
+				  const std::vector<StreamConfig>& streams);
+	~SndifFrontend();
+
+	/**
+	 * Performs xenbus handshake, returns true if the backend is connected
+	 */
+	bool connect(int timeoutMs = 3000);
+	void disconnect();
+
+	int32_t open(unsigned int stream);
+	int32_t close(unsigned int stream);
+	int32_t trigger(unsigned int stream, uint8_t type);
+	int32_t queryHwParam(unsigned int stream, xensnd_query_hw_param& param);
+
+	/**
+	 * Copies data into the PCM buffer (wraps around) and sends write request
+	 */
+	int32_t write(unsigned int stream, const void* data, size_t size);
+
+	/**
+	 * Sends read request and copies data from the PCM buffer
+	 */
+	int32_t read(unsigned int stream, void* data, size_t size);
+
+	/**
+	 * Waits till the position event reports at least the position,
+	 * returns the number of received events
+	 */
+	size_t waitPosition(unsigned int stream, uint64_t position,
+						int timeoutMs = 3000);
+	uint64_t getPosition(unsigned int stream);
+
+private:
+
+	struct Stream
+	{
+		StreamConfig config;
+		xen_sndif_front_ring ring;
+		grant_ref_t ringRef;
+		evtchn_port_t port;
+		Channel channel;
+		grant_ref_t evtRef;
+		evtchn_port_t evtPort;
+		Channel evtChannel;
+		grant_ref_t dirRef;
+		grant_ref_t bufferRef;
+		uint64_t written;
+		uint64_t read;
+		uint64_t position;
+		size_t numEvents;
+		uint16_t id;
+	};
+
+	std::vector<std::unique_ptr<Stream>> mStreams;
+
+	void initStream(unsigned int index, const StreamConfig& config);
+	int32_t request(unsigned int stream, xensnd_req& req,
+					xensnd_resp* rsp = nullptr);
+	void readEvents(Stream& stream);
+	uint8_t* getBuffer(Stream& stream);
+};
+
+/*******************************************************************************
+ * Sink storing mixed samples in memory
+ ******************************************************************************/
+class SndifMemorySink : public XenBackend::SndifSink
+{
+public:
+
+	void write(const void* data, size_t size) override;
+
+	/**
+	 * Waits for the number of written periods
+	 */
+	bool waitPeriods(size_t count, int timeoutMs = 3000);
+	std::vector<uint8_t> getData();
+
+private:
+
+	std::mutex mMutex;
+	std::condition_variable mCondVar;
+	std::vector<uint8_t> mData;
+	size_t mNumPeriods = 0;
+};
+
+/*******************************************************************************
+ * Sndif frontend handler using the given sink
+ ******************************************************************************/
+class SndifLoopbackHandler : public XenBackend::SndifFrontendHandler
+{
+public:
+
+	SndifLoopbackHandler(domid_t beDomId, domid_t feDomId, uint16_t devId,
+						 XenBackend::SndifSinkPtr sink,
+						 const XenBackend::SndifConfig& config =
+							 XenBackend::SndifConfig()) :
+		SndifFrontendHandler("vsnd", beDomId, feDomId, devId, config),
+		mSink(sink) {}
+
+protected:
+
+	XenBackend::SndifSinkPtr createSink() override { return mSink; }
+
+private:
+
+	XenBackend::SndifSinkPtr mSink;
+};
+
+#endif /* TESTS_LOOPBACK_SNDIFFRONTEND_HPP_ */
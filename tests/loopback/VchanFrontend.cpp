@@ -0,0 +1,285 @@
+/*
+ *  Loopback vchan peer
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include "VchanFrontend.hpp"
+
+#include <chrono>
+#include <cstring>
+
+#include "Exception.hpp"
+
+using std::chrono::duration_cast;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::min;
+using std::string;
+
+using XenBackend::Exception;
+
+/*******************************************************************************
+ * VchanFrontend
+ ******************************************************************************/
+
+VchanFrontend::VchanFrontend(domid_t beDomId, domid_t feDomId,
+							 uint16_t readOrder, uint16_t writeOrder) :
+	LoopbackFrontend("vchan", beDomId, feDomId, 0)
+{
+	mIntfRef = allocRefs(1);
+	mPort = allocPort();
+
+	mIntf = static_cast<vchan_interface*>(getPage(mIntfRef));
+
+	memset(mIntf, 0, XC_PAGE_SIZE);
+
+	mIntf->left_order = readOrder;
+	mIntf->right_order = writeOrder;
+
+	initRing(mRead, &mIntf->left, readOrder, mIntf->grants);
+
+	auto numGrants = readOrder < 12 ? 0 : 1 << (readOrder - 12);
+
+	initRing(mWrite, &mIntf->right, writeOrder, &mIntf->grants[numGrants]);
+
+	mIntf->cli_live = 2;
+	mIntf->srv_live = 1;
+	mIntf->cli_notify = VCHAN_NOTIFY_WRITE;
+}
+
+VchanFrontend::~VchanFrontend()
+{
+}
+
+/*******************************************************************************
+ * Public
+ ******************************************************************************/
+
+void VchanFrontend::bind()
+{
+	mChannel.bind(mFeDomId, mPort);
+}
+
+void VchanFrontend::close()
+{
+	mIntf->srv_live = 0;
+
+	xen_mb();
+
+	mChannel.notify();
+}
+
+bool VchanFrontend::isConnected()
+{
+	return mIntf->cli_live == 1;
+}
+
+size_t VchanFrontend::readSome(void* data, size_t size)
+{
+	uint32_t prod = mRead.shared->prod;
+
+	xen_rmb();
+
+	uint32_t cons = mRead.shared->cons;
+
+	size = min<size_t>(size, prod - cons);
+
+	if (size == 0)
+	{
+		return 0;
+	}
+
+	auto offset = cons & (mRead.size - 1);
+	auto first = min(size, mRead.size - offset);
+
+	memcpy(data, &mRead.buffer[offset], first);
+	memcpy(static_cast<uint8_t*>(data) + first, mRead.buffer, size - first);
+
+	xen_mb();
+
+	mRead.shared->cons = cons + size;
+
+	sendNotify(VCHAN_NOTIFY_READ);
+
+	return size;
+}
+
+size_t VchanFrontend::writeSome(const void* data, size_t size)
+{
+	uint32_t cons = mWrite.shared->cons;
+	uint32_t prod = mWrite.shared->prod;
+
+	xen_mb();
+
+	size = min<size_t>(size, mWrite.size - (prod - cons));
+
+	if (size == 0)
+	{
+		return 0;
+	}
+
+	auto offset = prod & (mWrite.size - 1);
+	auto first = min(size, mWrite.size - offset);
+
+	memcpy(&mWrite.buffer[offset], data, first);
+	memcpy(mWrite.buffer, static_cast<const uint8_t*>(data) + first,
+		   size - first);
+
+	xen_wmb();
+
+	mWrite.shared->prod = prod + size;
+
+	sendNotify(VCHAN_NOTIFY_WRITE);
+
+	return size;
+}
+
+bool VchanFrontend::waitRead(int timeoutMs)
+{
+	requestNotify(VCHAN_NOTIFY_WRITE);
+
+	if (mRead.shared->prod != mRead.shared->cons || mIntf->cli_live == 0)
+	{
+		return true;
+	}
+
+	return mChannel.wait(timeoutMs);
+}
+
+bool VchanFrontend::waitWrite(int timeoutMs)
+{
+	requestNotify(VCHAN_NOTIFY_READ);
+
+	if (mWrite.shared->prod - mWrite.shared->cons < mWrite.size ||
+		mIntf->cli_live == 0)
+	{
+		return true;
+	}
+
+	return mChannel.wait(timeoutMs);
+}
+
+void VchanFrontend::write(const string& data, int timeoutMs)
+{
+	auto end = steady_clock::now() + milliseconds(timeoutMs);
+	size_t written = 0;
+
+	while (written < data.size())
+	{
+		auto size = writeSome(&data[written], data.size() - written);
+
+		written += size;
+
+		if (size)
+		{
+			continue;
+		}
+
+		auto remaining = duration_cast<milliseconds>(
+			end - steady_clock::now()).count();
+
+		if (remaining <= 0)
+		{
+			throw Exception("No space in vchan ring", ETIMEDOUT);
+		}
+
+		waitWrite(min<int>(remaining, 10));
+	}
+}
+
+string VchanFrontend::read(size_t size, int timeoutMs)
+{
+	auto end = steady_clock::now() + milliseconds(timeoutMs);
+	string data(size, 0);
+	size_t received = 0;
+
+	while (received < size)
+	{
+		auto chunk = readSome(&data[received], size - received);
+
+		received += chunk;
+
+		if (chunk)
+		{
+			continue;
+		}
+
+		auto remaining = duration_cast<milliseconds>(
+			end - steady_clock::now()).count();
+
+		if (remaining <= 0)
+		{
+			break;
+		}
+
+		waitRead(min<int>(remaining, 10));
+	}
+
+	data.resize(received);
+
+	return data;
+}
+
+/*******************************************************************************
+ * Private
+ ******************************************************************************/
+
+void VchanFrontend::initRing(Ring& ring, ring_shared* shared, uint16_t order,
+							 uint32_t* grants)
+{
+	ring.shared = shared;
+	ring.size = static_cast<size_t>(1) << order;
+
+	if (order == 10)
+	{
+		ring.buffer = reinterpret_cast<uint8_t*>(mIntf) + 1024;
+	}
+	else if (order == 11)
+	{
+		ring.buffer = reinterpret_cast<uint8_t*>(mIntf) + 2048;
+	}
+	else
+	{
+		size_t numPages = 1 << (order - 12);
+		auto ref = allocRefs(numPages);
+
+		for (size_t i = 0; i < numPages; i++)
+		{
+			grants[i] = ref + i;
+		}
+
+		ring.buffer = static_cast<uint8_t*>(getPage(ref));
+	}
+}
+
+void VchanFrontend::requestNotify(uint8_t bit)
+{
+	__sync_or_and_fetch(&mIntf->cli_notify, bit);
+
+	xen_mb();
+}
+
+void VchanFrontend::sendNotify(uint8_t bit)
+{
+	xen_mb();
+
+	if (__sync_fetch_and_and(&mIntf->srv_notify, ~bit) & bit)
+	{
+		mChannel.notify();
+	}
+}
@@ -0,0 +1,107 @@
+/*
+ *  Loopback vchan peer
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#ifndef TESTS_LOOPBACK_VCHANFRONTEND_HPP_
+#define TESTS_LOOPBACK_VCHANFRONTEND_HPP_
+
+#include <string>
+
+extern "C" {
+#include <xen/io/libxenvchan.h>
+}
+
+#include "LoopbackFrontend.hpp"
+
+/*******************************************************************************
+ * Peer side of vchan: exports the interface and ring pages the way
+ * libxenvchan server does and moves the data with copy in / copy out as
+ * libxenvchan_read() and libxenvchan_write() do.
+ ******************************************************************************/
+class VchanFrontend : public LoopbackFrontend
+{
+public:
+
+	/**
+	 * @param[in] readOrder  order of the ring the peer reads (left)
+	 * @param[in] writeOrder order of the ring the peer writes (right)
+	 */
+	VchanFrontend(domid_t beDomId, domid_t feDomId, uint16_t readOrder,
+				  uint16_t writeOrder);
+	~VchanFrontend();
+
+	grant_ref_t getRef() const { return mIntfRef; }
+	evtchn_port_t getPort() const { return mPort; }
+
+	/**
+	 * Should be called when the other side has mapped the vchan
+	 */
+	void bind();
+
+	/**
+	 * Marks the vchan as closed and notifies the other side
+	 */
+	void close();
+
+	/**
+	 * Returns true if the other side is connected
+	 */
+	bool isConnected();
+
+	/**
+	 * Copies available data and free space, don't block
+	 */
+	size_t readSome(void* data, size_t size);
+	size_t writeSome(const void* data, size_t size);
+
+	/**
+	 * Waits for the data and the free space, return false on timeout
+	 */
+	bool waitRead(int timeoutMs);
+	bool waitWrite(int timeoutMs);
+
+	/**
+	 * Blocking copy of the whole data
+	 */
+	void write(const std::string& data, int timeoutMs = 3000);
+	std::string read(size_t size, int timeoutMs = 3000);
+
+private:
+
+	struct Ring
+	{
+		ring_shared* shared;
+		uint8_t* buffer;
+		size_t size;
+	};
+
+	grant_ref_t mIntfRef;
+	evtchn_port_t mPort;
+	Channel mChannel;
+	vchan_interface* mIntf;
+	Ring mRead;
+	Ring mWrite;
+
+	void initRing(Ring& ring, ring_shared* shared, uint16_t order,
+				  uint32_t* grants);
+	void requestNotify(uint8_t bit);
+	void sendNotify(uint8_t bit);
+};
+
+#endif /* TESTS_LOOPBACK_VCHANFRONTEND_HPP_ */
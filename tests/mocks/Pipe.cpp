@@ -81,3 +81,13 @@ void Pipe::write()
 		throw Exception("Error writing pipe", errno);
 	}
 }
+
+void Pipe::hangUp()
+{
+	if (mFds[PipeType::WRITE] >= 0)
+	{
+		close(mFds[PipeType::WRITE]);
+
+		mFds[PipeType::WRITE] = -1;
+	}
+}
@@ -35,6 +35,11 @@ public:
 	void read();
 	void write();
 
+	/**
+	 * Closes the write end: the read end polls POLLHUP
+	 */
+	void hangUp();
+
 private:
 
 	enum PipeType
@@ -97,16 +97,34 @@ void XenCtrlMock::addDomInfo(const xc_domaininfo_t& info)
 {
 	lock_guard<mutex> lock(sMutex);
 
+	// keep infos sorted by domain id as the hypervisor returns them
 	auto it = find_if(sDomInfos.begin(), sDomInfos.end(),
 					 [&info](const xc_domaininfo_t& item)
-					 { return item.domain == info.domain; });
+					 { return item.domain >= info.domain; });
 
-	if (it != sDomInfos.end())
+	if (it != sDomInfos.end() && it->domain == info.domain)
 	{
 		*it = info;
+
+		return;
 	}
 
-	sDomInfos.push_back(info);
+	sDomInfos.insert(it, info);
+}
+
+void XenCtrlMock::removeDomInfo(domid_t domId)
+{
+	lock_guard<mutex> lock(sMutex);
+
+	sDomInfos.remove_if([domId](const xc_domaininfo_t& item)
+						{ return item.domain == domId; });
+}
+
+void XenCtrlMock::clearDomInfos()
+{
+	lock_guard<mutex> lock(sMutex);
+
+	sDomInfos.clear();
 }
 
 int XenCtrlMock::getDomInfos(domid_t firstDom, unsigned int maxDoms,
@@ -118,21 +136,11 @@ int XenCtrlMock::getDomInfos(domid_t firstDom, unsigned int maxDoms,
 
 	auto it = find_if(sDomInfos.begin(), sDomInfos.end(),
 					 [&firstDom](const xc_domaininfo_t& item)
-					 { return item.domain == firstDom; });
+					 { return item.domain >= firstDom; });
 
-	if (it == sDomInfos.end())
-	{
-		it = sDomInfos.begin();
-	}
-
-	for(; it != sDomInfos.end(); it++)
+	for(; it != sDomInfos.end() && count < maxDoms; it++)
 	{
 		info[count++] = *it;
-
-		if (count == maxDoms)
-		{
-			break;
-		}
 	}
 
 	return count;
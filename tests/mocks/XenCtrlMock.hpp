@@ -46,6 +46,8 @@ public:
 	}
 
 	static void addDomInfo(const xc_domaininfo_t& info);
+	static void removeDomInfo(domid_t domId);
+	static void clearDomInfos();
 	static int getDomInfos(domid_t firstDom, unsigned int maxDoms,
 						   xc_domaininfo_t* info);
 
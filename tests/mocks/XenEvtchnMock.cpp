@@ -151,11 +151,15 @@ int XenEvtchnMock::sLastBoundPort = -1;
 
 XenEvtchnMock::XenEvtchnMock()
 {
+	lock_guard<mutex> lock(sMutex);
+
 	sClients.push_back(this);
 }
 
 XenEvtchnMock::~XenEvtchnMock()
 {
+	lock_guard<mutex> lock(sMutex);
+
 	sClients.remove(this);
 }
 
@@ -163,6 +167,28 @@ XenEvtchnMock::~XenEvtchnMock()
  * Public
  ******************************************************************************/
 
+evtchn_port_t XenEvtchnMock::getLocalPort(domid_t domId,
+										  evtchn_port_t remotePort)
+{
+	lock_guard<mutex> lock(sMutex);
+
+	for(auto client : sClients)
+	{
+		auto it = find_if(client->mBoundPorts.begin(),
+						  client->mBoundPorts.end(),
+						  [&remotePort, &domId](const BoundPort& boundPort)
+						  { return (boundPort.remotePort == remotePort) &&
+								   (boundPort.domId == domId); });
+
+		if (it != client->mBoundPorts.end())
+		{
+			return it->localPort;
+		}
+	}
+
+	throw Exception("Port not bound", ENOENT);
+}
+
 void XenEvtchnMock::signalPort(evtchn_port_t port)
 {
 	lock_guard<mutex> lock(sMutex);
@@ -176,7 +202,18 @@ void XenEvtchnMock::signalPort(evtchn_port_t port)
 
 void XenEvtchnMock::setNotifyCbk(evtchn_port_t port, NotifyCbk cbk)
 {
-	getClientByPort(port)->mNotifyCbk = cbk;
+	lock_guard<mutex> lock(sMutex);
+
+	auto client = getClientByPort(port);
+
+	if (cbk)
+	{
+		client->mNotifyCbks[port] = cbk;
+	}
+	else
+	{
+		client->mNotifyCbks.erase(port);
+	}
 }
 
 evtchn_port_t XenEvtchnMock::bind(domid_t domId, evtchn_port_t remotePort)
@@ -214,6 +251,7 @@ void XenEvtchnMock::unbind(evtchn_port_t port)
 	}
 
 	mBoundPorts.erase(it);
+	mNotifyCbks.erase(port);
 }
 
 void XenEvtchnMock::notifyPort(evtchn_port_t port)
@@ -222,9 +260,11 @@ void XenEvtchnMock::notifyPort(evtchn_port_t port)
 
 	sLastNotifiedPort = port;
 
-	if (mNotifyCbk)
+	auto it = mNotifyCbks.find(port);
+
+	if (it != mNotifyCbks.end())
 	{
-		mNotifyCbk();
+		it->second();
 	}
 }
 
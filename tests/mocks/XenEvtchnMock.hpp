@@ -23,6 +23,7 @@
 
 #include <functional>
 #include <list>
+#include <map>
 #include <mutex>
 
 extern "C" {
@@ -65,6 +66,7 @@ public:
 
 		return sLastBoundPort;
 	}
+	static evtchn_port_t getLocalPort(domid_t domId, evtchn_port_t remotePort);
 	static void signalPort(evtchn_port_t port);
 	static void setNotifyCbk(evtchn_port_t port, NotifyCbk cbk);
 
@@ -95,7 +97,8 @@ private:
 	std::list<evtchn_port_t> mSignaledPorts;
 	std::list<BoundPort> mBoundPorts;
 
-	NotifyCbk mNotifyCbk;
+	// ports of one handle may belong to different remote channels
+	std::map<evtchn_port_t, NotifyCbk> mNotifyCbks;
 
 	static XenEvtchnMock* getClientByPort(evtchn_port_t port);
 	std::list<BoundPort>::iterator getBoundPort(evtchn_port_t port);
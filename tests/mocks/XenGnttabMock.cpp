@@ -21,10 +21,15 @@
 #include "XenGnttabMock.hpp"
 
 #include <cstdlib>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <unistd.h>
 
 extern "C" {
 #include <xenctrl.h>
 #include <xengnttab.h>
+#include <xen/grant_table.h>
 }
 
 #include "Exception.hpp"
@@ -101,6 +106,69 @@ int xengnttab_unmap(xengnttab_handle* xgt, void* start_address, uint32_t count)
 	return 0;
 }
 
+int xengnttab_grant_copy(xengnttab_handle* xgt, uint32_t count,
+						 xengnttab_grant_copy_segment_t* segs)
+{
+	if (XenGnttabMock::getErrorMode())
+	{
+		errno = EINVAL;
+
+		return -1;
+	}
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		auto& seg = segs[i];
+
+		if (seg.flags & GNTCOPY_source_gref)
+		{
+			seg.status = xgt->mock->copyGrantRef(seg.source.foreign.ref,
+												 seg.source.foreign.offset,
+												 seg.dest.virt, seg.len, false);
+		}
+		else
+		{
+			seg.status = xgt->mock->copyGrantRef(seg.dest.foreign.ref,
+												 seg.dest.foreign.offset,
+												 seg.source.virt, seg.len, true);
+		}
+	}
+
+	return 0;
+}
+
+int xengnttab_dmabuf_exp_from_refs(xengnttab_handle* xgt, uint32_t domid,
+								   uint32_t flags, uint32_t count,
+								   const uint32_t* refs, uint32_t* fd)
+{
+	errno = ENOSYS;
+
+	return -1;
+}
+
+int xengnttab_dmabuf_exp_wait_released(xengnttab_handle* xgt, uint32_t fd,
+									   uint32_t wait_to_ms)
+{
+	errno = ENOSYS;
+
+	return -1;
+}
+
+int xengnttab_dmabuf_imp_to_refs(xengnttab_handle* xgt, uint32_t domid,
+								 uint32_t fd, uint32_t count, uint32_t* refs)
+{
+	errno = ENOSYS;
+
+	return -1;
+}
+
+int xengnttab_dmabuf_imp_release(xengnttab_handle* xgt, uint32_t fd)
+{
+	errno = ENOSYS;
+
+	return -1;
+}
+
 /*******************************************************************************
  * XenGnttabMock
  ******************************************************************************/
@@ -109,19 +177,118 @@ mutex XenGnttabMock::sMutex;
 void* XenGnttabMock::sLastMappedAddress = nullptr;
 unordered_map<void*, XenGnttabMock::MapBuffer> XenGnttabMock::sMapBuffers;
 bool XenGnttabMock::sErrorMode = false;
+int XenGnttabMock::sGrantFd = -1;
+void* XenGnttabMock::sGrantPages = nullptr;
 
 /*******************************************************************************
  * Public
  ******************************************************************************/
 
+void XenGnttabMock::setSharedMode(bool sharedMode)
+{
+	lock_guard<mutex> lock(sMutex);
+
+	if (sGrantPages)
+	{
+		munmap(sGrantPages, cMaxGrantRefs * XC_PAGE_SIZE);
+
+		sGrantPages = nullptr;
+	}
+
+	if (sGrantFd >= 0)
+	{
+		close(sGrantFd);
+
+		sGrantFd = -1;
+	}
+
+	if (!sharedMode)
+	{
+		return;
+	}
+
+	// grant pages are backed by memfd: each ref is the page with the same
+	// index, so the pages mapped by the backend are shared with the frontend
+	sGrantFd = memfd_create("grant_pages", 0);
+
+	if (sGrantFd < 0)
+	{
+		throw Exception("Can't create grant pages", errno);
+	}
+
+	if (ftruncate(sGrantFd, cMaxGrantRefs * XC_PAGE_SIZE) < 0)
+	{
+		throw Exception("Can't allocate grant pages", errno);
+	}
+
+	sGrantPages = mmap(nullptr, cMaxGrantRefs * XC_PAGE_SIZE,
+					   PROT_READ | PROT_WRITE, MAP_SHARED, sGrantFd, 0);
+
+	if (sGrantPages == MAP_FAILED)
+	{
+		sGrantPages = nullptr;
+
+		throw Exception("Can't map grant pages", errno);
+	}
+}
+
+void* XenGnttabMock::getGrantPage(uint32_t ref)
+{
+	lock_guard<mutex> lock(sMutex);
+
+	if (!sGrantPages || ref >= cMaxGrantRefs)
+	{
+		throw Exception("Grant page not found", ENOENT);
+	}
+
+	return static_cast<uint8_t*>(sGrantPages) + ref * XC_PAGE_SIZE;
+}
+
+void* XenGnttabMock::mapSharedRefs(uint32_t count, uint32_t *refs)
+{
+	auto size = count * XC_PAGE_SIZE;
+
+	auto address = static_cast<uint8_t*>(mmap(nullptr, size, PROT_NONE,
+											  MAP_PRIVATE | MAP_ANONYMOUS,
+											  -1, 0));
+
+	if (address == MAP_FAILED)
+	{
+		return nullptr;
+	}
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (refs[i] >= cMaxGrantRefs ||
+			mmap(address + i * XC_PAGE_SIZE, XC_PAGE_SIZE,
+				 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, sGrantFd,
+				 refs[i] * XC_PAGE_SIZE) == MAP_FAILED)
+		{
+			munmap(address, size);
+
+			errno = EINVAL;
+
+			return nullptr;
+		}
+	}
+
+	return address;
+}
+
 void* XenGnttabMock::mapGrantRefs(uint32_t count, uint32_t domId,
 								  uint32_t *refs)
 {
 	lock_guard<mutex> lock(sMutex);
 
-	MapBuffer buffer = { count, domId, count * XC_PAGE_SIZE };
+	MapBuffer buffer = { count, domId, count * XC_PAGE_SIZE, sGrantFd >= 0 };
 
-	void* address = calloc(1, buffer.size);
+	void* address = buffer.shared ? mapSharedRefs(count, refs) :
+									calloc(1, buffer.size);
+
+	if (!address)
+	{
+		return nullptr;
+	}
 
 	sMapBuffers[address] = buffer;
 
@@ -146,11 +313,47 @@ void XenGnttabMock::unmapGrantRefs(void* address, uint32_t count)
 		throw Exception("Wrong count", EINVAL);
 	}
 
-	free(it->first);
+	if (it->second.shared)
+	{
+		munmap(it->first, it->second.size);
+	}
+	else
+	{
+		free(it->first);
+	}
 
 	sMapBuffers.erase(it);
 }
 
+int16_t XenGnttabMock::copyGrantRef(uint32_t ref, uint16_t offset, void* data,
+								   uint16_t len, bool toRef)
+{
+	lock_guard<mutex> lock(sMutex);
+
+	if (!sGrantPages || ref >= cMaxGrantRefs)
+	{
+		return GNTST_bad_gntref;
+	}
+
+	if (offset + len > XC_PAGE_SIZE)
+	{
+		return GNTST_general_error;
+	}
+
+	auto page = static_cast<uint8_t*>(sGrantPages) + ref * XC_PAGE_SIZE;
+
+	if (toRef)
+	{
+		memcpy(page + offset, data, len);
+	}
+	else
+	{
+		memcpy(data, page + offset, len);
+	}
+
+	return GNTST_okay;
+}
+
 size_t XenGnttabMock::getMapBufferSize(void* address)
 {
 	lock_guard<mutex> lock(sMutex);
@@ -21,6 +21,7 @@
 #ifndef TESTS_MOCKS_XENGNTTABMOCK_HPP_
 #define TESTS_MOCKS_XENGNTTABMOCK_HPP_
 
+#include <cstdint>
 #include <mutex>
 #include <unordered_map>
 
@@ -47,11 +48,16 @@ public:
 		return sLastMappedAddress;
 	}
 
+	static void setSharedMode(bool sharedMode);
+	static void* getGrantPage(uint32_t ref);
+
 	static size_t getMapBufferSize(void* address);
 	static size_t checkMapBuffers();
 
 	void* mapGrantRefs(uint32_t count, uint32_t domId, uint32_t *refs);
 	void unmapGrantRefs(void* address, uint32_t count);
+	int16_t copyGrantRef(uint32_t ref, uint16_t offset, void* data,
+						 uint16_t len, bool toRef);
 
 private:
 
@@ -60,12 +66,19 @@ private:
 		uint32_t count;
 		uint32_t domId;
 		size_t size;
+		bool shared;
 	};
 
+	static const uint32_t cMaxGrantRefs = 16384;
+
 	static std::mutex sMutex;
 	static bool sErrorMode;
 	static void* sLastMappedAddress;
 	static std::unordered_map<void*, MapBuffer> sMapBuffers;
+	static int sGrantFd;
+	static void* sGrantPages;
+
+	void* mapSharedRefs(uint32_t count, uint32_t *refs);
 };
 
 #endif /* TESTS_MOCKS_XENGNTTABMOCK_HPP_ */
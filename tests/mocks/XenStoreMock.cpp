@@ -216,7 +216,9 @@ char **xs_read_watch(struct xs_handle *h, unsigned int *num)
 	char** value = nullptr;
 	string path;
 
-	while (h->mock->getChangedEntry(path))
+	// one event per call as xenstored does, the pipe stays readable till
+	// all events are read
+	if (h->mock->getChangedEntry(path))
 	{
 		size_t totalLength = 2 * sizeof(char*) + 2 * (path.length() + 1);
 
@@ -277,13 +279,18 @@ list<XenStoreMock*> XenStoreMock::sClients;
 XenStoreMock::Callback XenStoreMock::sCallback;
 mutex XenStoreMock::sMutex;
 
-XenStoreMock::XenStoreMock()
+XenStoreMock::XenStoreMock() :
+	mHungUp(false)
 {
+	lock_guard<mutex> lock(sMutex);
+
 	sClients.push_back(this);
 }
 
 XenStoreMock::~XenStoreMock()
 {
+	lock_guard<mutex> lock(sMutex);
+
 	sClients.remove(this);
 }
 
@@ -412,10 +419,27 @@ vector<string> XenStoreMock::readDirectory(const string& path)
 	return result;
 }
 
+void XenStoreMock::hangUp()
+{
+	lock_guard<mutex> lock(sMutex);
+
+	for(auto client : sClients)
+	{
+		client->mHungUp = true;
+		client->mWatches.clear();
+		client->mPipe.hangUp();
+	}
+}
+
 bool XenStoreMock::watch(const std::string& path)
 {
 	lock_guard<mutex> lock(sMutex);
 
+	if (mHungUp)
+	{
+		return false;
+	}
+
 	if (find(mWatches.begin(), mWatches.end(), path) == mWatches.end())
 	{
 		mWatches.push_back(path);
@@ -56,6 +56,12 @@ public:
 	static bool deleteEntry(const std::string& path);
 	static std::vector<std::string> readDirectory(const std::string& path);
 
+	/**
+	 * Drops connections of all clients as xenstored restart does: their
+	 * watches are lost and their fds poll hang up
+	 */
+	static void hangUp();
+
 	int getFd() const { return mPipe.getFd(); }
 	bool watch(const std::string& path);
 	bool unwatch(const std::string& path);
@@ -81,6 +87,7 @@ private:
 	static Callback sCallback;
 
 	Pipe mPipe;
+	bool mHungUp;
 
 	std::list<std::string> mWatches;
 	std::list<std::string> mChangedEntries;
@@ -0,0 +1,154 @@
+/*
+ *  Test AdaptiveController
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include <chrono>
+#include <memory>
+
+#include "catch.hpp"
+
+#include "AdaptiveController.hpp"
+#include "mocks/XenEvtchnMock.hpp"
+#include "mocks/XenGnttabMock.hpp"
+#include "testRingBuffer.hpp"
+
+using std::chrono::microseconds;
+using std::chrono::milliseconds;
+using std::make_shared;
+using std::shared_ptr;
+using std::this_thread::sleep_for;
+
+using XenBackend::AdaptiveConfig;
+using XenBackend::AdaptiveController;
+using XenBackend::AdaptiveControllerException;
+using XenBackend::RingPoller;
+
+TEST_CASE("AdaptiveController", "[adaptive]")
+{
+	XenEvtchnMock::setErrorMode(false);
+	XenGnttabMock::setErrorMode(false);
+
+	AdaptiveConfig config;
+
+	config.minIdleTimeout = microseconds(10);
+	config.maxIdleTimeout = microseconds(1000);
+	config.minBatch = 4;
+	config.maxBatch = 64;
+	config.batchStep = 4;
+
+	auto poller = make_shared<RingPoller>(-1, microseconds(400));
+
+	poller->start();
+
+	SECTION("Idle")
+	{
+		AdaptiveController controller(poller, config);
+
+		for (int i = 0; i < 8; i++)
+		{
+			sleep_for(milliseconds(5));
+
+			controller.update();
+		}
+
+		// 400 -> 200 -> 100 -> 50 -> 25 -> 12 -> 10
+		REQUIRE(poller->getIdleTimeout() == config.minIdleTimeout);
+
+		auto stats = controller.getStats();
+
+		REQUIRE(stats.updates == 8);
+		REQUIRE(stats.idleTimeout == config.minIdleTimeout);
+		REQUIRE(stats.decisions.size() == 6);
+		REQUIRE(stats.decisions[0].knob == "idle-timeout");
+		REQUIRE(stats.decisions[0].oldValue == 400);
+		REQUIRE(stats.decisions[0].newValue == 200);
+		REQUIRE_FALSE(stats.decisions[0].reason.empty());
+	}
+
+	SECTION("Saturated batch")
+	{
+		shared_ptr<TestRingBufferIn> ringBuffer(
+				new TestRingBufferIn(3, 67, 25));
+
+		ringBuffer->setMaxBatch(4);
+
+		poller->addRing(ringBuffer);
+
+		ringBuffer->start();
+
+		auto port = XenEvtchnMock::getLastBoundPort();
+
+		xen_test_front_ring ring;
+		auto sring = static_cast<xen_test_sring*>(
+				XenGnttabMock::getLastBuffer());
+
+		SHARED_RING_INIT(sring);
+		FRONT_RING_INIT(&ring, sring, XC_PAGE_SIZE);
+
+		AdaptiveController controller(poller, config);
+
+		// let the poller go idle, then put a burst at once
+
+		sleep_for(milliseconds(10));
+
+		for (int i = 0; i < 32; i++)
+		{
+			auto req = RING_GET_REQUEST(&ring, ring.req_prod_pvt++);
+
+			req->id = XENTEST_CMD2;
+			req->seq = i;
+		}
+
+		RING_PUSH_REQUESTS(&ring);
+
+		XenEvtchnMock::signalPort(port);
+
+		for (int i = 0; i < 100 && ring.sring->rsp_prod != 32; i++)
+		{
+			sleep_for(milliseconds(1));
+		}
+
+		REQUIRE(ring.sring->rsp_prod == 32);
+
+		controller.update();
+
+		auto stats = controller.getStats();
+
+		REQUIRE(stats.rings.size() == 1);
+		REQUIRE(stats.rings[0].port == 67);
+		REQUIRE(stats.rings[0].occupancy > 4);
+		REQUIRE(stats.rings[0].arrivalRate > 0.0);
+		REQUIRE(ringBuffer->getMaxBatch() == 8);
+
+		auto load = ringBuffer->getLoadStats();
+
+		REQUIRE(load.requests == 32);
+		REQUIRE(load.passes == 8);
+
+		poller->removeRing(ringBuffer);
+	}
+
+	SECTION("Invalid config")
+	{
+		config.minBatch = 128;
+
+		REQUIRE_THROWS_AS(AdaptiveController(poller, config),
+						  AdaptiveControllerException);
+	}
+}
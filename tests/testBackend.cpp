@@ -5,6 +5,7 @@
 #include <chrono>
 #include <condition_variable>
 #include <mutex>
+#include <thread>
 
 #include "catch.hpp"
 
@@ -107,6 +108,49 @@ TEST_CASE("BackendHandler", "[backendhandler]")
 		REQUIRE(gNewFrontDevId == gFrontDevId);
 	}
 
+	SECTION("Check resync on reconnect")
+	{
+		REQUIRE(waitForFrontend());
+
+		XenStoreMock::setErrorMode(true);
+		XenStoreMock::hangUp();
+
+		// the frontends are changed while the connection is lost
+		uint16_t newDevId = gFrontDevId + 1;
+		string bePath = "/local/domain/" + to_string(gDomId) + "/backend/" +
+						gDevName + "/" + to_string(gFrontDomId) + "/";
+
+		TestFrontendHandler::prepareXenStore(gDevName, gDomId, gFrontDomId,
+											 newDevId);
+
+		XenStoreMock::deleteEntry(bePath + to_string(gFrontDevId) +
+								  "/frontend");
+		XenStoreMock::deleteEntry(bePath + to_string(gFrontDevId) + "/state");
+
+		XenStoreMock::setErrorMode(false);
+
+		REQUIRE(waitForFrontend());
+		REQUIRE(gNewFrontDevId == newDevId);
+
+		bool resynced = false;
+
+		for (int i = 0; i < 100 && !resynced; i++)
+		{
+			auto handlers = testBackend.getFrontendHandlers();
+
+			resynced = handlers.size() == 1 &&
+					   handlers.front()->getDevId() == newDevId &&
+					   testBackend.getXenStoreStats().reconnects == 1;
+
+			std::this_thread::sleep_for(milliseconds(10));
+		}
+
+		REQUIRE(resynced);
+
+		XenStoreMock::deleteEntry(bePath + to_string(newDevId) + "/frontend");
+		XenStoreMock::deleteEntry(bePath + to_string(newDevId) + "/state");
+	}
+
 	testBackend.stop();
 }
 
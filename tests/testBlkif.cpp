@@ -0,0 +1,359 @@
+/*
+ *  Test blkif backend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <unistd.h>
+
+#include "catch.hpp"
+
+#include "BlkifBackend.hpp"
+#include "loopback/BlkifFrontend.hpp"
+#include "mocks/XenEvtchnMock.hpp"
+#include "mocks/XenGnttabMock.hpp"
+#include "mocks/XenStoreMock.hpp"
+
+using std::string;
+using std::vector;
+
+using XenBackend::BlkifConfig;
+using XenBackend::BlkifFrontendHandler;
+using XenBackend::GrantBudget;
+using XenBackend::GrantLimits;
+
+static domid_t gFeDomId = 7;
+static const size_t cImageSectors = 8192;
+
+static string createImage()
+{
+	char path[] = "/tmp/blkifXXXXXX";
+
+	int fd = mkstemp(path);
+
+	REQUIRE(fd >= 0);
+	REQUIRE(ftruncate(fd, cImageSectors * 512) == 0);
+
+	close(fd);
+
+	return path;
+}
+
+static void fillPattern(vector<uint8_t>& data, uint8_t seed)
+{
+	for (size_t i = 0; i < data.size(); i++)
+	{
+		data[i] = static_cast<uint8_t>(i * 7 + seed);
+	}
+}
+
+TEST_CASE("Blkif", "[blkif]")
+{
+	XenEvtchnMock::setErrorMode(false);
+	XenGnttabMock::setErrorMode(false);
+	XenStoreMock::setErrorMode(false);
+	XenStoreMock::setWriteValueCbk(nullptr);
+
+	static uint16_t devId = 0;
+
+	auto image = createImage();
+
+	BlkifFrontend::Config feConfig;
+	BlkifConfig beConfig;
+
+	feConfig.image = image;
+
+	SECTION("Read write")
+	{
+		BlkifFrontend frontend(0, gFeDomId, ++devId, feConfig);
+		BlkifFrontendHandler handler("vbd", 0, gFeDomId, devId, beConfig);
+
+		handler.start();
+
+		REQUIRE(frontend.connect());
+		REQUIRE(frontend.getSectors() == cImageSectors);
+
+		// the queue is not bound to a core unless the cores are set
+		auto queueStats = handler.getQueueStats();
+
+		REQUIRE(queueStats.size() == 1);
+		REQUIRE(queueStats[0].cpu == -1);
+
+		vector<uint8_t> out(16 * 512), in(16 * 512);
+
+		fillPattern(out, 1);
+
+		REQUIRE(frontend.write(100, out.data(), 16) == BLKIF_RSP_OKAY);
+		REQUIRE(frontend.read(100, in.data(), 16) == BLKIF_RSP_OKAY);
+		REQUIRE(in == out);
+
+		// partial page
+		vector<uint8_t> small(3 * 512), smallIn(3 * 512);
+
+		fillPattern(small, 5);
+
+		REQUIRE(frontend.write(7, small.data(), 3) == BLKIF_RSP_OKAY);
+		REQUIRE(frontend.read(7, smallIn.data(), 3) == BLKIF_RSP_OKAY);
+		REQUIRE(smallIn == small);
+
+		REQUIRE(frontend.flush() == BLKIF_RSP_OKAY);
+
+		// out of image
+		REQUIRE(frontend.read(cImageSectors - 4, in.data(), 16) ==
+				BLKIF_RSP_ERROR);
+
+		auto stats = handler.getStats();
+
+		REQUIRE(stats.size() == 1);
+		REQUIRE(stats[0].writes == 2);
+		REQUIRE(stats[0].reads == 2);
+		REQUIRE(stats[0].flushes == 1);
+		REQUIRE(stats[0].errors == 1);
+		REQUIRE(stats[0].writtenSectors == 19);
+		REQUIRE(stats[0].persistentHits > 0);
+	}
+
+	SECTION("Grant budget")
+	{
+		auto& budget = GrantBudget::getInstance();
+
+		// the pages are accounted while a limit is set
+		GrantLimits limits;
+
+		limits.maxPages = 1 << 20;
+
+		budget.setLimits(limits);
+
+		BlkifFrontend coldFrontend(0, gFeDomId, ++devId, feConfig);
+		BlkifFrontendHandler coldHandler("vbd", 0, gFeDomId, devId, beConfig);
+		auto coldDevId = devId;
+
+		BlkifFrontend hotFrontend(0, gFeDomId, ++devId, feConfig);
+		BlkifFrontendHandler hotHandler("vbd", 0, gFeDomId, devId, beConfig);
+		auto hotDevId = devId;
+
+		coldHandler.start();
+		hotHandler.start();
+
+		REQUIRE(coldFrontend.connect());
+		REQUIRE(hotFrontend.connect());
+
+		vector<uint8_t> out(16 * 512), in(16 * 512);
+
+		fillPattern(out, 3);
+
+		REQUIRE(coldFrontend.write(0, out.data(), 16) == BLKIF_RSP_OKAY);
+
+		REQUIRE(budget.getFrontendUsage(gFeDomId, coldDevId).pages == 2);
+
+		// the domain has room for one more page only, the second page of
+		// the hot frontend is taken from the cold frontend cache
+		limits.maxPages = 0;
+		limits.maxDomainPages = budget.getDomainUsage(gFeDomId).pages + 1;
+
+		budget.setLimits(limits);
+
+		REQUIRE(hotFrontend.write(0, out.data(), 16) == BLKIF_RSP_OKAY);
+		REQUIRE(hotFrontend.read(0, in.data(), 16) == BLKIF_RSP_OKAY);
+
+		auto coldUsage = budget.getFrontendUsage(gFeDomId, coldDevId);
+		auto hotUsage = budget.getFrontendUsage(gFeDomId, hotDevId);
+
+		budget.setLimits(GrantLimits());
+
+		REQUIRE(in == out);
+		REQUIRE(coldUsage.pages == 1);
+		REQUIRE(coldUsage.evictedPages == 1);
+		REQUIRE(hotUsage.pages == 2);
+		REQUIRE(hotUsage.rejections == 0);
+	}
+
+	SECTION("Indirect")
+	{
+		feConfig.maxPages = 64;
+
+		BlkifFrontend frontend(0, gFeDomId, ++devId, feConfig);
+		BlkifFrontendHandler handler("vbd", 0, gFeDomId, devId, beConfig);
+
+		handler.start();
+
+		REQUIRE(frontend.connect());
+		REQUIRE(frontend.getMaxIndirectSegments() ==
+				beConfig.maxIndirectSegments);
+
+		vector<uint8_t> out(64 * 8 * 512), in(64 * 8 * 512);
+
+		fillPattern(out, 3);
+
+		REQUIRE(frontend.write(1024, out.data(), 64 * 8) == BLKIF_RSP_OKAY);
+		REQUIRE(frontend.read(1024, in.data(), 64 * 8) == BLKIF_RSP_OKAY);
+		REQUIRE(in == out);
+
+		// the failed indirect request is answered with its operation too
+		REQUIRE(frontend.read(cImageSectors - 8, in.data(), 64 * 8) ==
+				BLKIF_RSP_ERROR);
+	}
+
+	SECTION("Discard")
+	{
+		BlkifFrontend frontend(0, gFeDomId, ++devId, feConfig);
+		BlkifFrontendHandler handler("vbd", 0, gFeDomId, devId, beConfig);
+
+		handler.start();
+
+		REQUIRE(frontend.connect());
+
+		string value;
+
+		REQUIRE(frontend.readBackend("feature-discard", value));
+		REQUIRE(value == "1");
+
+		vector<uint8_t> out(8 * 512, 0xA5), in(8 * 512);
+
+		REQUIRE(frontend.write(64, out.data(), 8) == BLKIF_RSP_OKAY);
+		REQUIRE(frontend.discard(64, 8) == BLKIF_RSP_OKAY);
+		REQUIRE(frontend.read(64, in.data(), 8) == BLKIF_RSP_OKAY);
+		REQUIRE(in == vector<uint8_t>(8 * 512, 0));
+
+		// sector + count wraps around
+		REQUIRE(frontend.discard(UINT64_MAX, 8) == BLKIF_RSP_ERROR);
+		REQUIRE(frontend.read(UINT64_MAX - 7, in.data(), 8) ==
+				BLKIF_RSP_ERROR);
+
+		// the byte offset and length wrap to the first sectors
+		REQUIRE(frontend.write(0, out.data(), 8) == BLKIF_RSP_OKAY);
+		REQUIRE(frontend.discard(-(1ULL << 55), (1ULL << 55) + 8) ==
+				BLKIF_RSP_ERROR);
+		REQUIRE(frontend.read(0, in.data(), 8) == BLKIF_RSP_OKAY);
+		REQUIRE(in == out);
+	}
+
+	SECTION("Read only")
+	{
+		feConfig.readOnly = true;
+
+		BlkifFrontend frontend(0, gFeDomId, ++devId, feConfig);
+		BlkifFrontendHandler handler("vbd", 0, gFeDomId, devId, beConfig);
+
+		handler.start();
+
+		REQUIRE(frontend.connect());
+
+		string value;
+
+		REQUIRE(frontend.readBackend("info", value));
+		REQUIRE(stoi(value) == VDISK_READONLY);
+
+		vector<uint8_t> data(512);
+
+		REQUIRE(frontend.write(0, data.data(), 1) == BLKIF_RSP_ERROR);
+		REQUIRE(frontend.read(0, data.data(), 1) == BLKIF_RSP_OKAY);
+	}
+
+	SECTION("Unsupported operation")
+	{
+		BlkifFrontend frontend(0, gFeDomId, ++devId, feConfig);
+		BlkifFrontendHandler handler("vbd", 0, gFeDomId, devId, beConfig);
+
+		handler.start();
+
+		REQUIRE(frontend.connect());
+
+		uint64_t id;
+		vector<BlkifFrontend::Response> rsps;
+
+		REQUIRE(frontend.queueRequest(0, BLKIF_OP_WRITE_BARRIER, 0, 1, id));
+
+		frontend.kick(0);
+
+		REQUIRE(frontend.getResponses(0, rsps) == 1);
+		REQUIRE(rsps[0].id == id);
+		REQUIRE(rsps[0].operation == BLKIF_OP_WRITE_BARRIER);
+		REQUIRE(rsps[0].status == BLKIF_RSP_EOPNOTSUPP);
+	}
+
+	SECTION("Multi queue")
+	{
+		feConfig.numQueues = 2;
+		feConfig.ringPageOrder = 2;
+		feConfig.persistent = false;
+
+		BlkifFrontend frontend(0, gFeDomId, ++devId, feConfig);
+		BlkifFrontendHandler handler("vbd", 0, gFeDomId, devId, beConfig);
+
+		handler.setQueueCpus({0, 1});
+		handler.start();
+
+		REQUIRE(frontend.connect());
+		REQUIRE(frontend.getNumQueues() == 2);
+
+		vector<uint8_t> out(8 * 512), in(8 * 512);
+
+		fillPattern(out, 9);
+
+		// queue a batch of requests and push them at once
+		for (unsigned int i = 0; i < 32; i++)
+		{
+			uint64_t id;
+
+			REQUIRE(frontend.queueRequest(1, BLKIF_OP_WRITE, i * 8, 8, id));
+
+			memcpy(frontend.getBuffer(1, id), out.data(), out.size());
+		}
+
+		frontend.kick(1);
+
+		vector<BlkifFrontend::Response> rsps;
+
+		while (rsps.size() < 32)
+		{
+			REQUIRE(frontend.getResponses(1, rsps) > 0);
+		}
+
+		for (auto& rsp : rsps)
+		{
+			REQUIRE(rsp.status == BLKIF_RSP_OKAY);
+		}
+
+		REQUIRE(frontend.read(31 * 8, in.data(), 8, 0) == BLKIF_RSP_OKAY);
+		REQUIRE(in == out);
+
+		auto stats = handler.getStats();
+
+		REQUIRE(stats.size() == 2);
+		REQUIRE(stats[1].writes == 32);
+		REQUIRE(stats[1].responses == 32);
+		REQUIRE(stats[1].responseBatches <= 32);
+		REQUIRE(stats[0].reads == 1);
+		REQUIRE(stats[0].persistentMaps == 0);
+
+		auto queueStats = handler.getQueueStats();
+
+		REQUIRE(queueStats.size() == 2);
+		REQUIRE(queueStats[0].cpu == 0);
+		REQUIRE(queueStats[1].cpu == 1);
+		REQUIRE(queueStats[0].events > 0);
+		REQUIRE(queueStats[1].events > 0);
+	}
+
+	unlink(image.c_str());
+}
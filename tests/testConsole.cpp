@@ -0,0 +1,218 @@
+/*
+ *  Test console backend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "catch.hpp"
+
+#include "ConsoleBackend.hpp"
+#include "loopback/ConsoleFrontend.hpp"
+#include "mocks/XenEvtchnMock.hpp"
+#include "mocks/XenGnttabMock.hpp"
+#include "mocks/XenStoreMock.hpp"
+
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+using std::ifstream;
+using std::ostringstream;
+using std::string;
+using std::this_thread::sleep_for;
+using std::to_string;
+
+using XenBackend::ConsoleConfig;
+using XenBackend::ConsoleFrontendHandler;
+
+static domid_t gFeDomId = 13;
+
+static string readFile(const string& path)
+{
+	ifstream file(path);
+	ostringstream data;
+
+	data << file.rdbuf();
+
+	return data.str();
+}
+
+static string readFd(int fd, size_t size, int timeoutMs = 3000)
+{
+	auto end = steady_clock::now() + milliseconds(timeoutMs);
+	string data;
+
+	while (data.size() < size && steady_clock::now() < end)
+	{
+		pollfd fds = { fd, POLLIN, 0 };
+
+		if (poll(&fds, 1, 10) <= 0)
+		{
+			continue;
+		}
+
+		char buffer[1024];
+
+		auto ret = read(fd, buffer, sizeof(buffer));
+
+		if (ret > 0)
+		{
+			data.append(buffer, ret);
+		}
+	}
+
+	return data;
+}
+
+TEST_CASE("Console", "[console]")
+{
+	XenEvtchnMock::setErrorMode(false);
+	XenGnttabMock::setErrorMode(false);
+	XenStoreMock::setErrorMode(false);
+	XenStoreMock::setWriteValueCbk(nullptr);
+
+	static uint16_t devId = 0;
+
+	ConsoleFrontend frontend(0, gFeDomId, ++devId);
+
+	SECTION("Output to log")
+	{
+		char path[] = "/tmp/consoleXXXXXX";
+
+		REQUIRE(mkdtemp(path));
+
+		ConsoleConfig beConfig;
+
+		beConfig.logDir = path;
+		beConfig.pty = false;
+
+		ConsoleFrontendHandler handler("console", 0, gFeDomId, devId,
+									   beConfig);
+
+		handler.start();
+
+		REQUIRE(frontend.connect());
+
+		// the guest is notified when the output is consumed from the ring
+		// which is not full
+
+		string expected = "first line\n";
+
+		frontend.write(expected);
+
+		auto end = steady_clock::now() + milliseconds(3000);
+
+		while (handler.getStats().notifications == 0 &&
+			   steady_clock::now() < end)
+		{
+			sleep_for(milliseconds(10));
+		}
+
+		REQUIRE(handler.getStats().notifications == 1);
+
+		const int cNumLines = 200;
+
+		// the lines wrap the out ring several times
+
+		for (int i = 0; i < cNumLines; i++)
+		{
+			auto line = "guest line " + to_string(i) + "\n";
+
+			frontend.write(line);
+
+			expected += line;
+		}
+
+		end = steady_clock::now() + milliseconds(3000);
+
+		while (handler.getStats().outBytes < expected.size() &&
+			   steady_clock::now() < end)
+		{
+			sleep_for(milliseconds(10));
+		}
+
+		auto logPath = string(path) + "/guest-" + to_string(gFeDomId) + "-" +
+					   to_string(devId) + ".log";
+
+		REQUIRE(readFile(logPath) == expected);
+
+		auto stats = handler.getStats();
+
+		REQUIRE(stats.outBytes == expected.size());
+		REQUIRE(stats.writes < cNumLines / 2);
+
+		unlink(logPath.c_str());
+		rmdir(path);
+	}
+
+	SECTION("Pty")
+	{
+		ConsoleFrontendHandler handler("console", 0, gFeDomId, devId);
+
+		handler.start();
+
+		REQUIRE(frontend.connect());
+
+		string name;
+
+		REQUIRE(frontend.readBackend("tty", name));
+
+		int fd = open(name.c_str(), O_RDWR | O_NOCTTY);
+
+		REQUIRE(fd >= 0);
+
+		termios attr;
+
+		REQUIRE(tcgetattr(fd, &attr) == 0);
+
+		cfmakeraw(&attr);
+
+		REQUIRE(tcsetattr(fd, TCSANOW, &attr) == 0);
+
+		string output = "login: ";
+
+		frontend.write(output);
+
+		REQUIRE(readFd(fd, output.size()) == output);
+
+		// more than the in ring size
+
+		string input;
+
+		for (int i = 0; input.size() < 3000; i++)
+		{
+			input += "input " + to_string(i) + "\n";
+		}
+
+		REQUIRE(write(fd, input.data(), input.size()) ==
+				static_cast<ssize_t>(input.size()));
+
+		REQUIRE(frontend.read(input.size()) == input);
+
+		REQUIRE(handler.getStats().inBytes == input.size());
+
+		close(fd);
+	}
+}
@@ -0,0 +1,307 @@
+/*
+ *  Test displif backend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "catch.hpp"
+
+#include "DisplifBackend.hpp"
+#include "loopback/DisplifFrontend.hpp"
+#include "mocks/XenEvtchnMock.hpp"
+#include "mocks/XenGnttabMock.hpp"
+#include "mocks/XenStoreMock.hpp"
+
+using std::make_shared;
+using std::vector;
+
+using XenBackend::DisplifConfig;
+using XenBackend::DisplifDamage;
+using XenBackend::DisplifFrame;
+using XenBackend::DisplifSoftwareSink;
+
+static domid_t gFeDomId = 15;
+
+static void fill(uint8_t* data, uint32_t width, uint32_t height,
+				 uint32_t seed)
+{
+	auto pixels = reinterpret_cast<uint32_t*>(data);
+
+	for (uint32_t i = 0; i < width * height; i++)
+	{
+		pixels[i] = i * 2654435761u + seed;
+	}
+}
+
+static void setPixel(uint8_t* data, uint32_t width, uint32_t x, uint32_t y,
+					 uint32_t value)
+{
+	reinterpret_cast<uint32_t*>(data)[y * width + x] = value;
+}
+
+TEST_CASE("DisplifDamage", "[displif]")
+{
+	const uint32_t cWidth = 200;
+	const uint32_t cHeight = 100;
+
+	vector<uint8_t> data(cWidth * cHeight * 4);
+
+	fill(data.data(), cWidth, cHeight, 0);
+
+	DisplifFrame frame {};
+
+	frame.data = data.data();
+	frame.width = cWidth;
+	frame.height = cHeight;
+	frame.stride = cWidth * 4;
+	frame.bpp = 32;
+
+	DisplifDamage damage(64, 16);
+
+	auto rects = damage.update(frame);
+
+	REQUIRE(rects.size() == 1);
+	REQUIRE(rects[0].x == 0);
+	REQUIRE(rects[0].y == 0);
+	REQUIRE(rects[0].width == cWidth);
+	REQUIRE(rects[0].height == cHeight);
+
+	REQUIRE(damage.update(frame).empty());
+
+	SECTION("Single tile")
+	{
+		setPixel(data.data(), cWidth, 70, 20, 0);
+
+		rects = damage.update(frame);
+
+		REQUIRE(rects.size() == 1);
+		REQUIRE(rects[0].x == 64);
+		REQUIRE(rects[0].y == 16);
+		REQUIRE(rects[0].width == 64);
+		REQUIRE(rects[0].height == 16);
+	}
+
+	SECTION("Merged tiles")
+	{
+		// vertical line through two tile rows of the last (narrow) column
+		// and a separate tile in the first column
+
+		setPixel(data.data(), cWidth, 199, 10, 0);
+		setPixel(data.data(), cWidth, 199, 20, 0);
+		setPixel(data.data(), cWidth, 0, 99, 0);
+
+		rects = damage.update(frame);
+
+		REQUIRE(rects.size() == 2);
+		REQUIRE(rects[0].x == 192);
+		REQUIRE(rects[0].y == 0);
+		REQUIRE(rects[0].width == 8);
+		REQUIRE(rects[0].height == 32);
+		REQUIRE(rects[1].x == 0);
+		REQUIRE(rects[1].y == 96);
+		REQUIRE(rects[1].height == 4);
+	}
+
+	SECTION("Reset and resize")
+	{
+		damage.reset();
+
+		REQUIRE(damage.update(frame).size() == 1);
+
+		frame.height = 50;
+
+		rects = damage.update(frame);
+
+		REQUIRE(rects.size() == 1);
+		REQUIRE(rects[0].height == 50);
+	}
+}
+
+TEST_CASE("Displif", "[displif]")
+{
+	XenEvtchnMock::setErrorMode(false);
+	XenGnttabMock::setErrorMode(false);
+	XenStoreMock::setErrorMode(false);
+	XenStoreMock::setWriteValueCbk(nullptr);
+
+	static uint16_t devId = 0;
+
+	const uint32_t cWidth = 320;
+	const uint32_t cHeight = 240;
+
+	DisplifConfig beConfig;
+
+	auto sink = make_shared<DisplifSoftwareSink>();
+
+	DisplifFrontend frontend(0, gFeDomId, ++devId, {{}, {}});
+	DisplifLoopbackHandler handler(0, gFeDomId, devId, sink, beConfig);
+
+	handler.start();
+
+	REQUIRE(frontend.connect());
+
+	// double buffering on connector 1
+
+	REQUIRE(frontend.createBuffer(1, 10, cWidth, cHeight) == 0);
+	REQUIRE(frontend.createBuffer(1, 11, cWidth, cHeight) == 0);
+	REQUIRE(frontend.attachFb(1, 10, 20, cWidth, cHeight) == 0);
+	REQUIRE(frontend.attachFb(1, 11, 21, cWidth, cHeight) == 0);
+	REQUIRE(frontend.setConfig(1, 20, cWidth, cHeight) == 0);
+
+	auto front = frontend.getBuffer(10);
+	auto back = frontend.getBuffer(11);
+	size_t frameSize = cWidth * cHeight * 4;
+
+	fill(front, cWidth, cHeight, 1);
+
+	REQUIRE(frontend.pageFlips(1, {20}) == vector<int32_t>{0});
+
+	uint32_t width, height;
+
+	REQUIRE(sink->getFrame(1, width, height) ==
+			vector<uint8_t>(front, front + frameSize));
+	REQUIRE(width == cWidth);
+	REQUIRE(height == cHeight);
+	REQUIRE(sink->getCopiedBytes() == frameSize);
+
+	SECTION("Damaged regions only")
+	{
+		memcpy(back, front, frameSize);
+
+		setPixel(back, cWidth, 100, 100, 0);
+
+		REQUIRE(frontend.pageFlips(1, {21}) == vector<int32_t>{0});
+
+		REQUIRE(sink->getFrame(1, width, height) ==
+				vector<uint8_t>(back, back + frameSize));
+
+		// one 64x16 tile
+
+		REQUIRE(sink->getCopiedBytes() == frameSize + 64 * 16 * 4);
+
+		auto stats = handler.getStats();
+
+		REQUIRE(stats.flips == 2);
+		REQUIRE(stats.dmaBufFlips == 0);
+		REQUIRE(stats.dirtyRects == 2);
+	}
+
+	SECTION("Batched flip events")
+	{
+		vector<uint64_t> flips;
+
+		for (int i = 0; i < 16; i++)
+		{
+			flips.push_back(i % 2 ? 21 : 20);
+		}
+
+		REQUIRE(frontend.pageFlips(1, flips) == vector<int32_t>(16, 0));
+
+		REQUIRE(frontend.waitFlipEvents(1, 17) == 17);
+
+		auto stats = handler.getStats();
+
+		REQUIRE(stats.flipEvents == 17);
+		REQUIRE(stats.eventBatches < stats.flipEvents);
+	}
+
+	SECTION("Errors")
+	{
+		REQUIRE(frontend.pageFlips(1, {99}) == vector<int32_t>{-ENOENT});
+		REQUIRE(frontend.pageFlips(0, {20}) == vector<int32_t>{-ENOENT});
+		REQUIRE(frontend.createBuffer(1, 10, cWidth, cHeight) == -EEXIST);
+		REQUIRE(frontend.createBuffer(1, 12, cWidth, cHeight, 32,
+				XENDISPL_DBUF_FLG_REQ_ALLOC) == -EOPNOTSUPP);
+		REQUIRE(frontend.attachFb(1, 10, 22, cWidth + 1, cHeight) == -EINVAL);
+		REQUIRE(frontend.setConfig(1, 20, cWidth * 2, cHeight) == -EINVAL);
+		REQUIRE(frontend.destroyBuffer(1, 10) == -EBUSY);
+
+		// detaching displayed framebuffer disables the connector
+
+		REQUIRE(frontend.detachFb(1, 20) == 0);
+		REQUIRE(sink->getFrame(1, width, height).empty());
+		REQUIRE(frontend.destroyBuffer(1, 10) == 0);
+		REQUIRE(frontend.pageFlips(1, {21}) == vector<int32_t>{-EINVAL});
+	}
+
+	SECTION("Multi-page directory")
+	{
+		// 1280x1024x32 takes two directory pages
+
+		REQUIRE(frontend.createBuffer(0, 30, 1280, 1024) == 0);
+		REQUIRE(frontend.attachFb(0, 30, 40, 1280, 1024) == 0);
+
+		// the connector shows part of the framebuffer
+
+		REQUIRE(frontend.setConfig(0, 40, 320, 240) == 0);
+
+		auto buffer = frontend.getBuffer(30);
+
+		fill(buffer, 1280, 1024, 2);
+
+		REQUIRE(frontend.pageFlips(0, {40}) == vector<int32_t>{0});
+
+		auto frame = sink->getFrame(0, width, height);
+
+		REQUIRE(width == 320);
+		REQUIRE(height == 240);
+		REQUIRE(memcmp(&frame[239 * 320 * 4], &buffer[239 * 1280 * 4],
+					   320 * 4) == 0);
+	}
+}
+
+TEST_CASE("DisplifDmaBufFallback", "[displif]")
+{
+	// the sink wants dma-bufs but the mocks can't export them
+
+	class DmaBufSink : public DisplifSoftwareSink
+	{
+	public:
+
+		bool supportsDmaBuf() const override { return true; }
+	};
+
+	static uint16_t devId = 100;
+
+	auto sink = make_shared<DmaBufSink>();
+
+	DisplifFrontend frontend(0, gFeDomId, ++devId, {{}});
+	DisplifLoopbackHandler handler(0, gFeDomId, devId, sink);
+
+	handler.start();
+
+	REQUIRE(frontend.connect());
+
+	REQUIRE(frontend.createBuffer(0, 1, 64, 64) == 0);
+	REQUIRE(frontend.attachFb(0, 1, 2, 64, 64) == 0);
+	REQUIRE(frontend.setConfig(0, 2, 64, 64) == 0);
+
+	fill(frontend.getBuffer(1), 64, 64, 3);
+
+	REQUIRE(frontend.pageFlips(0, {2}) == vector<int32_t>{0});
+
+	uint32_t width, height;
+
+	REQUIRE(sink->getFrame(0, width, height) ==
+			vector<uint8_t>(frontend.getBuffer(1),
+							frontend.getBuffer(1) + 64 * 64 * 4));
+	REQUIRE(handler.getStats().dmaBufFlips == 0);
+}
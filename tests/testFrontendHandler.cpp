@@ -23,6 +23,7 @@
 #include <chrono>
 #include <condition_variable>
 #include <mutex>
+#include <vector>
 
 #include "catch.hpp"
 
@@ -40,7 +41,11 @@ using std::string;
 using std::this_thread::sleep_for;
 using std::to_string;
 using std::unique_lock;
+using std::vector;
 
+using XenBackend::Arena;
+using XenBackend::ArenaAllocator;
+using XenBackend::ArenaPtr;
 using XenBackend::FrontendHandlerBase;
 using XenBackend::RingBufferInBase;
 using XenBackend::RingBufferPtr;
@@ -54,6 +59,7 @@ static const char* gDevName = "test_device";
 
 static XenbusState gBeState = XenbusStateUnknown;
 static bool gOnBind = false;
+static milliseconds gBindDelay(0);
 static std::list<XenbusState> gBeStates;
 
 TestFrontendHandler::~TestFrontendHandler()
@@ -89,9 +95,9 @@ void TestFrontendHandler::prepareXenStore(const string& devName,
 
 void TestFrontendHandler::onBind()
 {
-	RingBufferPtr ringBuffer(new TestRingBufferIn(gDomId, 12, 165));
+	addRingBuffer(makeShared<TestRingBufferIn>(gDomId, 12, 165));
 
-	addRingBuffer(ringBuffer);
+	sleep_for(gBindDelay);
 
 	gOnBind = true;
 }
@@ -125,6 +131,22 @@ bool waitBeStateChanged()
 	return true;
 }
 
+// the connect stats are updated after the Connected state is written
+bool waitConnects(FrontendHandlerBase& frontendHandler, uint32_t numConnects)
+{
+	for (int i = 0; i < 100; i++)
+	{
+		if (frontendHandler.getConnectStats().numConnects == numConnects)
+		{
+			return true;
+		}
+
+		sleep_for(milliseconds(10));
+	}
+
+	return false;
+}
+
 TEST_CASE("FrontendHandler", "[frontendhandler]")
 {
 	XenEvtchnMock::setErrorMode(false);
@@ -136,6 +158,7 @@ TEST_CASE("FrontendHandler", "[frontendhandler]")
 
 	gBeStates.clear();
 	gOnBind = false;
+	gBindDelay = milliseconds(0);
 
 	XenStoreMock storeMock;
 
@@ -150,6 +173,10 @@ TEST_CASE("FrontendHandler", "[frontendhandler]")
 
 	frontendHandler.start();
 
+	// the backend goes from Initialising to InitWait on its own
+	REQUIRE(waitBeStateChanged());
+	REQUIRE(gBeState == XenbusStateInitWait);
+
 	SECTION("Check getters")
 	{
 		REQUIRE(frontendHandler.getDomId() == gDomId);
@@ -161,13 +188,10 @@ TEST_CASE("FrontendHandler", "[frontendhandler]")
 
 	SECTION("Check states 1")
 	{
-		// Initialize -> InitWait
+		// Initialize -> InitWait, the backend is already in InitWait
 		storeMock.writeValue(fePath + "/state",
 							 to_string(XenbusStateInitialising));
 
-		REQUIRE(waitBeStateChanged());
-		REQUIRE(gBeState == XenbusStateInitWait);
-
 		// Initialized -> Connected
 		storeMock.writeValue(fePath + "/state",
 							 to_string(XenbusStateInitialised));
@@ -239,13 +263,10 @@ TEST_CASE("FrontendHandler", "[frontendhandler]")
 
 	SECTION("Check states 4")
 	{
-		// Initialize -> InitWait
+		// Initialize -> InitWait, the backend is already in InitWait
 		storeMock.writeValue(fePath + "/state",
 							 to_string(XenbusStateInitialising));
 
-		REQUIRE(waitBeStateChanged());
-		REQUIRE(gBeState == XenbusStateInitWait);
-
 		// Initialized -> Connected
 		storeMock.writeValue(fePath + "/state",
 							 to_string(XenbusStateInitialised));
@@ -267,15 +288,121 @@ TEST_CASE("FrontendHandler", "[frontendhandler]")
 		frontendHandler.stop();
 	}
 
-	SECTION("Check error")
+	SECTION("Check connect stats")
 	{
-		// Initialize -> InitWait
+		gBindDelay = milliseconds(10);
+
+		sleep_for(milliseconds(20));
+
 		storeMock.writeValue(fePath + "/state",
-							 to_string(XenbusStateInitialising));
+							 to_string(XenbusStateInitialised));
 
+		REQUIRE(waitBeStateChanged());
+		REQUIRE(gBeState == XenbusStateConnected);
+		REQUIRE(waitConnects(frontendHandler, 1));
+
+		auto stats = frontendHandler.getConnectStats();
+
+		REQUIRE(stats.initWait >= milliseconds(20));
+		REQUIRE(stats.bind >= gBindDelay);
+		REQUIRE(stats.total == stats.initWait + stats.bind + stats.connect);
+
+		// reconnect: Closing -> Closing, Closed, InitWait
+		storeMock.writeValue(fePath + "/state",
+							 to_string(XenbusStateClosing));
+
+		REQUIRE(waitBeStateChanged());
+		REQUIRE(gBeState == XenbusStateClosing);
+		REQUIRE(waitBeStateChanged());
+		REQUIRE(gBeState == XenbusStateClosed);
 		REQUIRE(waitBeStateChanged());
 		REQUIRE(gBeState == XenbusStateInitWait);
 
+		gBindDelay = milliseconds(0);
+
+		sleep_for(milliseconds(50));
+
+		storeMock.writeValue(fePath + "/state",
+							 to_string(XenbusStateInitialised));
+
+		REQUIRE(waitBeStateChanged());
+		REQUIRE(gBeState == XenbusStateConnected);
+
+		REQUIRE(waitConnects(frontendHandler, 2));
+
+		auto prevStats = stats;
+
+		stats = frontendHandler.getConnectStats();
+
+		// the phases are measured from the new InitWait
+		REQUIRE(stats.initWait >= milliseconds(50));
+		REQUIRE(stats.initWait < prevStats.total + milliseconds(50));
+		REQUIRE(stats.bind < prevStats.bind);
+		REQUIRE(stats.total == stats.initWait + stats.bind + stats.connect);
+
+		frontendHandler.stop();
+	}
+
+	SECTION("Check arena")
+	{
+		frontendHandler.setArenaChunkSize(4096);
+
+		storeMock.writeValue(fePath + "/state",
+							 to_string(XenbusStateConnected));
+
+		REQUIRE(waitBeStateChanged());
+		REQUIRE(gBeState == XenbusStateConnected);
+
+		auto stats = frontendHandler.getArenaStats();
+
+		REQUIRE(stats.chunks == 1);
+		REQUIRE(stats.allocations == 1);
+		REQUIRE(stats.liveAllocations == 1);
+
+		auto ringBuffer = frontendHandler.getRingBuffers().at(0);
+
+		REQUIRE(reinterpret_cast<uintptr_t>(ringBuffer.get()) %
+				alignof(TestRingBufferIn) == 0);
+
+		storeMock.writeValue(fePath + "/state",
+							 to_string(XenbusStateClosed));
+
+		REQUIRE(waitBeStateChanged());
+		REQUIRE(waitBeStateChanged());
+		REQUIRE(gBeState == XenbusStateClosed);
+
+		// the arena is dropped by the handler but still used by the ring
+		REQUIRE(frontendHandler.getArenaStats().chunks == 0);
+		REQUIRE(ringBuffer.use_count() == 1);
+
+		ArenaPtr arena(new Arena(256));
+
+		vector<uint64_t, ArenaAllocator<uint64_t>> values(
+				ArenaAllocator<uint64_t>{arena});
+
+		values.resize(16);
+
+		auto data = ArenaAllocator<char>(arena).allocate(1);
+
+		REQUIRE(reinterpret_cast<uintptr_t>(values.data()) % 8 == 0);
+		REQUIRE(arena->getStats().chunks == 2);
+
+		values.resize(64);
+
+		REQUIRE(arena->getStats().chunks == 3);
+		REQUIRE(arena->getStats().liveAllocations == 2);
+
+		ArenaAllocator<char>(arena).deallocate(data, 1);
+
+		frontendHandler.stop();
+	}
+
+	SECTION("Check error")
+	{
+		// Initialize -> InitWait, the backend is already in InitWait
+		storeMock.writeValue(fePath + "/state",
+							 to_string(XenbusStateInitialising));
+
 		// Initialized -> Connected
 		storeMock.writeValue(fePath + "/state",
 							 to_string(XenbusStateInitialised));
@@ -0,0 +1,355 @@
+/*
+ *  Test netif backend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include <set>
+#include <vector>
+
+#include <netinet/in.h>
+
+#include "catch.hpp"
+
+#include "NetifBackend.hpp"
+#include "loopback/NetifFrontend.hpp"
+#include "mocks/XenEvtchnMock.hpp"
+#include "mocks/XenGnttabMock.hpp"
+#include "mocks/XenStoreMock.hpp"
+
+using std::make_shared;
+using std::set;
+using std::vector;
+
+using XenBackend::NetifConfig;
+using XenBackend::NetifFlow;
+using XenBackend::NetifFlowInfo;
+using XenBackend::NetifPacket;
+using XenBackend::NetifVnetHdr;
+
+static domid_t gFeDomId = 8;
+
+static NetifPacket makePacket(vector<uint8_t>& frame, uint8_t flags = 0,
+							  uint8_t gsoType = NetifVnetHdr::cGsoNone,
+							  uint16_t gsoSize = 0)
+{
+	NetifPacket packet {};
+
+	packet.hdr.flags = flags;
+	packet.hdr.gsoType = gsoType;
+	packet.hdr.gsoSize = gsoSize;
+	packet.data = frame.data();
+	packet.size = frame.size();
+
+	return packet;
+}
+
+TEST_CASE("Netif", "[netif]")
+{
+	XenEvtchnMock::setErrorMode(false);
+	XenGnttabMock::setErrorMode(false);
+	XenStoreMock::setErrorMode(false);
+	XenStoreMock::setWriteValueCbk(nullptr);
+
+	static uint16_t devId = 0;
+
+	NetifFrontend::Config feConfig;
+	NetifConfig beConfig;
+
+	auto device = make_shared<NetifMemoryDevice>();
+
+	SECTION("Flow hash")
+	{
+		auto udp = NetifFrontend::makeFrame(IPPROTO_UDP, 1000, 53, 32);
+		auto tcp = NetifFrontend::makeFrame(IPPROTO_TCP, 1000, 80, 32);
+
+		NetifFlowInfo info;
+
+		REQUIRE(NetifFlow::parse(udp.data(), udp.size(), info));
+		REQUIRE(info.l3Offset == 14);
+		REQUIRE(info.l4Offset == 34);
+		REQUIRE(info.l4Length == 8);
+		REQUIRE(info.l4Proto == IPPROTO_UDP);
+
+		REQUIRE(NetifFlow::parse(tcp.data(), tcp.size(), info));
+		REQUIRE(info.l4Length == 20);
+
+		auto other = NetifFrontend::makeFrame(IPPROTO_UDP, 1001, 53, 64);
+
+		REQUIRE(NetifFlow::getHash(udp.data(), udp.size()) ==
+				NetifFlow::getHash(udp.data(), 42));
+		REQUIRE(NetifFlow::getHash(udp.data(), udp.size()) !=
+				NetifFlow::getHash(other.data(), other.size()));
+
+		// not IP
+		udp[12] = 0x08;
+		udp[13] = 0x06;
+
+		REQUIRE_FALSE(NetifFlow::parse(udp.data(), udp.size(), info));
+		REQUIRE(NetifFlow::getHash(udp.data(), udp.size()) == 0);
+	}
+
+	SECTION("Tx")
+	{
+		NetifFrontend frontend(0, gFeDomId, ++devId, feConfig);
+		NetifLoopbackHandler handler(0, gFeDomId, devId, device, beConfig);
+
+		handler.start();
+
+		REQUIRE(frontend.connect());
+		REQUIRE(device->isCsumOffload());
+		REQUIRE(device->isTso4Offload());
+
+		auto small = NetifFrontend::makeFrame(IPPROTO_UDP, 1, 2, 100);
+		auto big = NetifFrontend::makeFrame(IPPROTO_UDP, 3, 4, 9000);
+		auto gso = NetifFrontend::makeFrame(IPPROTO_TCP, 5, 6, 20000);
+		vector<uint8_t> runt(10);
+
+		REQUIRE(frontend.queuePacket(0, small.data(), small.size(),
+									 NETTXF_data_validated));
+		REQUIRE(frontend.queuePacket(0, big.data(), big.size()));
+		REQUIRE(frontend.queuePacket(0, gso.data(), gso.size(),
+									 NETTXF_csum_blank | NETTXF_data_validated,
+									 XEN_NETIF_GSO_TYPE_TCPV4, 1448));
+		REQUIRE(frontend.queuePacket(0, runt.data(), runt.size()));
+
+		frontend.kick(0);
+
+		REQUIRE(device->waitSent(3));
+
+		vector<int16_t> statuses;
+
+		// one response per data slot: 1 + 3 + 5 + 1
+		while (statuses.size() < 10)
+		{
+			REQUIRE(frontend.getTxResponses(0, statuses) > 0);
+		}
+
+		REQUIRE(statuses.size() == 10);
+		REQUIRE(statuses.back() == NETIF_RSP_ERROR);
+
+		for (size_t i = 0; i < statuses.size() - 1; i++)
+		{
+			REQUIRE(statuses[i] == NETIF_RSP_OKAY);
+		}
+
+		auto sent = device->getSent();
+
+		REQUIRE(sent.size() == 3);
+
+		REQUIRE(sent[0].data == small);
+		REQUIRE(sent[0].hdr.flags == NetifVnetHdr::cFlagDataValid);
+
+		REQUIRE(sent[1].data == big);
+		REQUIRE(sent[1].hdr.flags == 0);
+
+		REQUIRE(sent[2].data == gso);
+		REQUIRE(sent[2].hdr.flags == NetifVnetHdr::cFlagNeedsCsum);
+		REQUIRE(sent[2].hdr.gsoType == NetifVnetHdr::cGsoTcpV4);
+		REQUIRE(sent[2].hdr.gsoSize == 1448);
+		REQUIRE(sent[2].hdr.csumStart == 34);
+		REQUIRE(sent[2].hdr.csumOffset == 16);
+		REQUIRE(sent[2].hdr.hdrLen == 54);
+
+		auto stats = handler.getStats();
+
+		REQUIRE(stats.size() == 1);
+		REQUIRE(stats[0].txPackets == 3);
+		REQUIRE(stats[0].txErrors == 1);
+		REQUIRE(stats[0].txBytes == small.size() + big.size() + gso.size());
+		REQUIRE(stats[0].grantCopies >= 9);
+	}
+
+	SECTION("Rx")
+	{
+		NetifFrontend frontend(0, gFeDomId, ++devId, feConfig);
+		NetifLoopbackHandler handler(0, gFeDomId, devId, device, beConfig);
+
+		handler.start();
+
+		REQUIRE(frontend.connect());
+
+		auto small = NetifFrontend::makeFrame(IPPROTO_UDP, 1, 2, 200);
+		auto gso = NetifFrontend::makeFrame(IPPROTO_TCP, 5, 6, 10000);
+
+		NetifPacket packets[] = {
+			makePacket(small, NetifVnetHdr::cFlagDataValid),
+			makePacket(gso, NetifVnetHdr::cFlagNeedsCsum,
+					   NetifVnetHdr::cGsoTcpV4, 1448)
+		};
+
+		REQUIRE(device->inject(packets, 2));
+
+		vector<NetifFrontend::Packet> received;
+
+		while (received.size() < 2)
+		{
+			REQUIRE(frontend.receivePackets(0, received) > 0);
+		}
+
+		REQUIRE(received[0].data == small);
+		REQUIRE(received[0].flags == NETRXF_data_validated);
+
+		REQUIRE(received[1].data == gso);
+		REQUIRE((received[1].flags & NETRXF_csum_blank) != 0);
+		REQUIRE((received[1].flags & NETRXF_extra_info) != 0);
+		REQUIRE(received[1].gsoType == XEN_NETIF_GSO_TYPE_TCPV4);
+		REQUIRE(received[1].gsoSize == 1448);
+
+		auto stats = handler.getStats();
+
+		REQUIRE(stats[0].rxPackets == 2);
+		REQUIRE(stats[0].rxBytes == small.size() + gso.size());
+		REQUIRE(stats[0].rxDropped == 0);
+		REQUIRE(stats[0].copyBatches == 1);
+	}
+
+	SECTION("No scatter gather")
+	{
+		feConfig.sg = false;
+
+		NetifFrontend frontend(0, gFeDomId, ++devId, feConfig);
+		NetifLoopbackHandler handler(0, gFeDomId, devId, device, beConfig);
+
+		handler.start();
+
+		REQUIRE(frontend.connect());
+		REQUIRE_FALSE(device->isTso4Offload());
+
+		auto big = NetifFrontend::makeFrame(IPPROTO_UDP, 1, 2, 9000);
+		auto small = NetifFrontend::makeFrame(IPPROTO_UDP, 1, 2, 1000);
+
+		NetifPacket packets[] = { makePacket(big), makePacket(small) };
+
+		REQUIRE(device->inject(packets, 2));
+
+		vector<NetifFrontend::Packet> received;
+
+		REQUIRE(frontend.receivePackets(0, received) == 1);
+		REQUIRE(received[0].data == small);
+
+		auto stats = handler.getStats();
+
+		REQUIRE(stats[0].rxDropped == 1);
+	}
+
+	SECTION("Multi queue")
+	{
+		feConfig.numQueues = 4;
+
+		NetifFrontend frontend(0, gFeDomId, ++devId, feConfig);
+		NetifLoopbackHandler handler(0, gFeDomId, devId, device, beConfig);
+
+		handler.start();
+
+		REQUIRE(frontend.connect());
+
+		vector<vector<uint8_t>> frames;
+		vector<NetifPacket> packets;
+
+		// two packets per flow
+		for (uint16_t i = 0; i < 64; i++)
+		{
+			frames.push_back(NetifFrontend::makeFrame(IPPROTO_UDP, 2000 + i / 2,
+													  53, 64 + i));
+		}
+
+		for (auto& frame : frames)
+		{
+			packets.push_back(makePacket(frame));
+		}
+
+		REQUIRE(device->inject(packets.data(), packets.size()));
+
+		size_t total = 0;
+		set<unsigned int> usedQueues;
+
+		for (unsigned int queue = 0; queue < 4; queue++)
+		{
+			vector<NetifFrontend::Packet> received;
+
+			frontend.receivePackets(queue, received, 100);
+
+			if (received.size())
+			{
+				usedQueues.insert(queue);
+			}
+
+			for (auto& packet : received)
+			{
+				auto hash = NetifFlow::getHash(packet.data.data(),
+											   packet.data.size());
+
+				REQUIRE(hash % 4 == queue);
+			}
+
+			total += received.size();
+		}
+
+		REQUIRE(total == 64);
+		REQUIRE(usedQueues.size() > 1);
+
+		// tx on the last queue
+		auto frame = NetifFrontend::makeFrame(IPPROTO_UDP, 1, 2, 100);
+
+		REQUIRE(frontend.queuePacket(3, frame.data(), frame.size()));
+
+		frontend.kick(3);
+
+		REQUIRE(device->waitSent(1));
+
+		auto stats = handler.getStats();
+
+		REQUIRE(stats.size() == 4);
+		REQUIRE(stats[3].txPackets == 1);
+	}
+
+	SECTION("Tx batch")
+	{
+		NetifFrontend frontend(0, gFeDomId, ++devId, feConfig);
+		NetifLoopbackHandler handler(0, gFeDomId, devId, device, beConfig);
+
+		handler.start();
+
+		REQUIRE(frontend.connect());
+
+		auto frame = NetifFrontend::makeFrame(IPPROTO_UDP, 1, 2, 500);
+
+		for (int i = 0; i < 32; i++)
+		{
+			REQUIRE(frontend.queuePacket(0, frame.data(), frame.size()));
+		}
+
+		frontend.kick(0);
+
+		REQUIRE(device->waitSent(32));
+
+		vector<int16_t> statuses;
+
+		while (statuses.size() < 32)
+		{
+			REQUIRE(frontend.getTxResponses(0, statuses) > 0);
+		}
+
+		auto stats = handler.getStats();
+
+		// all packets pushed at once are copied with one grant copy call
+		REQUIRE(stats[0].txPackets == 32);
+		REQUIRE(stats[0].grantCopies == 32);
+		REQUIRE(stats[0].copyBatches == 1);
+	}
+}
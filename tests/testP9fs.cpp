@@ -0,0 +1,535 @@
+/*
+ *  Test 9pfs backend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+
+#include "catch.hpp"
+
+#include "P9fsBackend.hpp"
+#include "loopback/P9fsFrontend.hpp"
+#include "mocks/XenEvtchnMock.hpp"
+#include "mocks/XenGnttabMock.hpp"
+#include "mocks/XenStoreMock.hpp"
+
+using std::chrono::milliseconds;
+using std::count;
+using std::function;
+using std::string;
+using std::to_string;
+using std::vector;
+
+using XenBackend::P9fsConfig;
+using XenBackend::P9fsException;
+using XenBackend::P9fsFrontendHandler;
+using XenBackend::P9fsLookupCache;
+using XenBackend::P9fsQid;
+using XenBackend::P9fsReader;
+using XenBackend::P9fsSession;
+using XenBackend::P9fsWriter;
+
+using XenBackend::P9_RATTACH;
+using XenBackend::P9_RGETATTR;
+using XenBackend::P9_RLCREATE;
+using XenBackend::P9_RLERROR;
+using XenBackend::P9_RLOPEN;
+using XenBackend::P9_RMKDIR;
+using XenBackend::P9_RREAD;
+using XenBackend::P9_RREADDIR;
+using XenBackend::P9_RSTATFS;
+using XenBackend::P9_RUNLINKAT;
+using XenBackend::P9_RVERSION;
+using XenBackend::P9_RWALK;
+using XenBackend::P9_RWRITE;
+using XenBackend::P9_TATTACH;
+using XenBackend::P9_TCLUNK;
+using XenBackend::P9_TGETATTR;
+using XenBackend::P9_TLCREATE;
+using XenBackend::P9_TLOPEN;
+using XenBackend::P9_TMKDIR;
+using XenBackend::P9_TREAD;
+using XenBackend::P9_TREADDIR;
+using XenBackend::P9_TSTATFS;
+using XenBackend::P9_TUNLINKAT;
+using XenBackend::P9_TVERSION;
+using XenBackend::P9_TWALK;
+using XenBackend::P9_TWRITE;
+
+static domid_t gFeDomId = 11;
+
+static string createDir()
+{
+	char path[] = "/tmp/p9fsXXXXXX";
+
+	REQUIRE(mkdtemp(path));
+
+	return path;
+}
+
+static void removeDir(const string& path)
+{
+	nftw(path.c_str(), [] (const char* path, const struct stat*, int,
+						   struct FTW*) { return remove(path); },
+		 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static vector<uint8_t> makeMsg(uint8_t type, uint16_t tag,
+							   function<void(P9fsWriter&)> body)
+{
+	vector<uint8_t> msg;
+	P9fsWriter writer(msg);
+
+	writer.begin(type, tag);
+
+	body(writer);
+
+	writer.end();
+
+	return msg;
+}
+
+/*
+ * Returns -ecode for Rlerror, response type otherwise. The reader is
+ * positioned at the response body.
+ */
+static int parseMsg(P9fsReader& reader, uint16_t* tag = nullptr)
+{
+	reader.readU32();
+
+	auto type = reader.readU8();
+	auto msgTag = reader.readU16();
+
+	if (tag)
+	{
+		*tag = msgTag;
+	}
+
+	if (type == P9_RLERROR)
+	{
+		return -static_cast<int>(reader.readU32());
+	}
+
+	return type;
+}
+
+TEST_CASE("P9fsLookupCache", "[p9fs]")
+{
+	P9fsQid qid {P9fsQid::cTypeFile, 0, 42};
+	P9fsQid result {};
+
+	SECTION("Invalidate")
+	{
+		P9fsLookupCache cache(16, milliseconds(1000));
+
+		cache.put("a", qid);
+		cache.put("a/b", qid);
+		cache.put("ab", qid);
+
+		REQUIRE(cache.get("a/b", result));
+		REQUIRE(result.path == 42);
+		REQUIRE_FALSE(cache.get("c", result));
+
+		cache.invalidate("a");
+
+		REQUIRE_FALSE(cache.get("a", result));
+		REQUIRE_FALSE(cache.get("a/b", result));
+		REQUIRE(cache.get("ab", result));
+
+		REQUIRE(cache.getHits() == 2);
+		REQUIRE(cache.getMisses() == 3);
+	}
+
+	SECTION("Expire")
+	{
+		P9fsLookupCache cache(16, milliseconds(0));
+
+		cache.put("a", qid);
+
+		REQUIRE_FALSE(cache.get("a", result));
+	}
+}
+
+TEST_CASE("P9fsSession", "[p9fs]")
+{
+	auto dir = createDir();
+
+	P9fsSession session(dir, P9fsConfig());
+
+	REQUIRE(session.version(8192) == 8192);
+
+	auto root = session.attach(0);
+
+	REQUIRE(root.type == P9fsQid::cTypeDir);
+
+	SECTION("Create, write and read")
+	{
+		REQUIRE(session.walk(0, 1, {}).empty());
+
+		auto qid = session.create(1, "file", O_RDWR, 0644);
+
+		REQUIRE(qid.type == P9fsQid::cTypeFile);
+
+		char out[] = "hello";
+		char in[sizeof(out)] = {};
+		iovec iov = {out, sizeof(out)};
+
+		REQUIRE(session.writev(1, 0, &iov, 1) == sizeof(out));
+		REQUIRE(session.getReadSize(1, 2, 100) == sizeof(out) - 2);
+
+		iov = {in, sizeof(in)};
+
+		REQUIRE(session.readv(1, 0, &iov, 1) == sizeof(out));
+		REQUIRE(strcmp(in, out) == 0);
+
+		auto qids = session.walk(0, 2, {"file"});
+
+		REQUIRE(qids.size() == 1);
+		REQUIRE(qids[0].path == qid.path);
+	}
+
+	SECTION("Walk")
+	{
+		session.mkdir(0, "dir", 0755);
+
+		// partial walk: the new fid is not created
+		REQUIRE(session.walk(0, 1, {"dir", "none"}).size() == 1);
+		REQUIRE_THROWS_AS(session.clunk(1), P9fsException);
+
+		// can't walk above the exported directory
+		auto qids = session.walk(0, 1, {"dir", "..", ".."});
+
+		REQUIRE(qids.size() == 3);
+		REQUIRE(qids[2].path == root.path);
+
+		REQUIRE_THROWS_AS(session.walk(0, 2, {"none"}), P9fsException);
+		REQUIRE_THROWS_AS(session.walk(0, 2, {"a/b"}), P9fsException);
+	}
+
+	SECTION("Remove and rename")
+	{
+		session.mkdir(0, "dir", 0755);
+
+		REQUIRE(session.walk(0, 1, {"dir"}).size() == 1);
+
+		session.renameat(0, "dir", 0, "moved");
+
+		REQUIRE_THROWS_AS(session.walk(0, 2, {"dir"}), P9fsException);
+		REQUIRE(session.walk(0, 2, {"moved"}).size() == 1);
+
+		session.unlinkat(0, "moved", AT_REMOVEDIR);
+
+		REQUIRE_THROWS_AS(session.walk(0, 3, {"moved"}), P9fsException);
+	}
+
+	SECTION("Symbolic links")
+	{
+		auto outside = createDir();
+		auto file = outside + "/file";
+
+		close(::open(file.c_str(), O_CREAT | O_WRONLY, 0600));
+
+		REQUIRE(symlink(file.c_str(), (dir + "/link").c_str()) == 0);
+		REQUIRE(symlink(outside.c_str(), (dir + "/dirlink").c_str()) == 0);
+
+		// neither the link nor a path through it can be walked
+		REQUIRE_THROWS_AS(session.walk(0, 1, {"link"}), P9fsException);
+		REQUIRE_THROWS_AS(session.walk(0, 1, {"dirlink"}), P9fsException);
+		REQUIRE_THROWS_AS(session.walk(0, 1, {"dirlink", "file"}),
+						  P9fsException);
+		REQUIRE_THROWS_AS(session.clunk(1), P9fsException);
+
+		// a fid can't be created through the link either
+		REQUIRE(session.walk(0, 2, {}).empty());
+		REQUIRE_THROWS_AS(session.create(2, "link", O_RDWR, 0666),
+						  P9fsException);
+
+		struct stat st;
+
+		REQUIRE(stat(file.c_str(), &st) == 0);
+		REQUIRE((st.st_mode & 07777) == 0600);
+
+		// the links may be removed
+		session.unlinkat(0, "link", 0);
+		session.unlinkat(0, "dirlink", 0);
+
+		REQUIRE(stat(file.c_str(), &st) == 0);
+
+		removeDir(outside);
+	}
+
+	removeDir(dir);
+}
+
+TEST_CASE("P9fs", "[p9fs]")
+{
+	XenEvtchnMock::setErrorMode(false);
+	XenGnttabMock::setErrorMode(false);
+	XenStoreMock::setErrorMode(false);
+	XenStoreMock::setWriteValueCbk(nullptr);
+
+	static uint16_t devId = 0;
+
+	auto dir = createDir();
+
+	P9fsConfig beConfig;
+
+	P9fsFrontend frontend(0, gFeDomId, ++devId);
+	P9fsFrontendHandler handler("9pfs", 0, gFeDomId, devId, beConfig);
+
+	handler.start();
+
+	REQUIRE(frontend.connect(dir));
+
+	uint16_t tag = 0;
+
+	auto call = [&frontend, &tag] (uint8_t type,
+								   function<void(P9fsWriter&)> body)
+		{ return frontend.transact(0, makeMsg(type, tag++, body)); };
+
+	auto rsp = call(P9_TVERSION, [] (P9fsWriter& w)
+		{ w.writeU32(65536); w.writeString("9P2000.L"); });
+
+	P9fsReader reader(rsp.data(), rsp.size());
+
+	REQUIRE(parseMsg(reader) == P9_RVERSION);
+	// limited by the ring size
+	REQUIRE(reader.readU32() == frontend.getRingSize());
+	REQUIRE(reader.readString() == "9P2000.L");
+
+	rsp = call(P9_TATTACH, [] (P9fsWriter& w)
+		{ w.writeU32(0); w.writeU32(~0u); w.writeString("root");
+		  w.writeString(""); w.writeU32(0); });
+
+	reader = P9fsReader(rsp.data(), rsp.size());
+
+	REQUIRE(parseMsg(reader) == P9_RATTACH);
+	REQUIRE(reader.readQid().type == P9fsQid::cTypeDir);
+
+	auto create = [&call] (uint32_t fid, const string& name)
+	{
+		auto rsp = call(P9_TWALK, [fid] (P9fsWriter& w)
+			{ w.writeU32(0); w.writeU32(fid); w.writeU16(0); });
+
+		P9fsReader reader(rsp.data(), rsp.size());
+
+		REQUIRE(parseMsg(reader) == P9_RWALK);
+
+		rsp = call(P9_TLCREATE, [fid, &name] (P9fsWriter& w)
+			{ w.writeU32(fid); w.writeString(name); w.writeU32(O_RDWR);
+			  w.writeU32(0644); w.writeU32(0); });
+
+		reader = P9fsReader(rsp.data(), rsp.size());
+
+		REQUIRE(parseMsg(reader) == P9_RLCREATE);
+	};
+
+	auto write = [&call] (uint32_t fid, uint64_t offset,
+						  const vector<uint8_t>& data)
+	{
+		auto rsp = call(P9_TWRITE, [&] (P9fsWriter& w)
+			{ w.writeU32(fid); w.writeU64(offset); w.writeU32(data.size());
+			  w.writeData(data.data(), data.size()); });
+
+		P9fsReader reader(rsp.data(), rsp.size());
+
+		REQUIRE(parseMsg(reader) == P9_RWRITE);
+		REQUIRE(reader.readU32() == data.size());
+	};
+
+	auto readMsg = [] (uint32_t fid, uint64_t offset, uint32_t count,
+					   uint16_t tag)
+	{
+		return makeMsg(P9_TREAD, tag, [=] (P9fsWriter& w)
+			{ w.writeU32(fid); w.writeU64(offset); w.writeU32(count); });
+	};
+
+	SECTION("Read and write")
+	{
+		create(1, "file");
+
+		vector<uint8_t> out(1000);
+
+		for (size_t i = 0; i < out.size(); i++)
+		{
+			out[i] = i * 7;
+		}
+
+		write(1, 0, out);
+
+		rsp = frontend.transact(0, readMsg(1, 0, 4096, tag++));
+		reader = P9fsReader(rsp.data(), rsp.size());
+
+		REQUIRE(parseMsg(reader) == P9_RREAD);
+
+		auto count = reader.readU32();
+
+		REQUIRE(count == out.size());
+		REQUIRE(memcmp(&rsp[11], out.data(), count) == 0);
+
+		rsp = call(P9_TGETATTR, [] (P9fsWriter& w)
+			{ w.writeU32(1); w.writeU64(0x7ff); });
+		reader = P9fsReader(rsp.data(), rsp.size());
+
+		REQUIRE(parseMsg(reader) == P9_RGETATTR);
+
+		reader.readU64();
+		reader.readQid();
+
+		REQUIRE((reader.readU32() & 0777) == 0644);
+
+		reader.readU32();
+		reader.readU32();
+		reader.readU64();
+		reader.readU64();
+
+		REQUIRE(reader.readU64() == out.size());
+
+		auto stats = handler.getStats();
+
+		REQUIRE(stats.size() == 1);
+		REQUIRE(stats[0].zeroCopyReads == 1);
+		REQUIRE(stats[0].writtenBytes == out.size());
+	}
+
+	SECTION("Errors")
+	{
+		rsp = call(P9_TWALK, [] (P9fsWriter& w)
+			{ w.writeU32(0); w.writeU32(1); w.writeU16(1);
+			  w.writeString("none"); });
+		reader = P9fsReader(rsp.data(), rsp.size());
+
+		REQUIRE(parseMsg(reader) == -ENOENT);
+
+		rsp = call(P9_TCLUNK, [] (P9fsWriter& w) { w.writeU32(5); });
+		reader = P9fsReader(rsp.data(), rsp.size());
+
+		REQUIRE(parseMsg(reader) == -EBADF);
+
+		rsp = call(P9_TSTATFS, [] (P9fsWriter& w) { w.writeU32(0); });
+		reader = P9fsReader(rsp.data(), rsp.size());
+
+		REQUIRE(parseMsg(reader) == P9_RSTATFS);
+		REQUIRE(handler.getStats()[0].errors == 2);
+	}
+
+	SECTION("Directories")
+	{
+		rsp = call(P9_TMKDIR, [] (P9fsWriter& w)
+			{ w.writeU32(0); w.writeString("dir"); w.writeU32(0755);
+			  w.writeU32(0); });
+		reader = P9fsReader(rsp.data(), rsp.size());
+
+		REQUIRE(parseMsg(reader) == P9_RMKDIR);
+
+		create(1, "file");
+
+		rsp = call(P9_TWALK, [] (P9fsWriter& w)
+			{ w.writeU32(0); w.writeU32(2); w.writeU16(0); });
+		rsp = call(P9_TLOPEN, [] (P9fsWriter& w)
+			{ w.writeU32(2); w.writeU32(O_RDONLY); });
+		reader = P9fsReader(rsp.data(), rsp.size());
+
+		REQUIRE(parseMsg(reader) == P9_RLOPEN);
+
+		rsp = call(P9_TREADDIR, [] (P9fsWriter& w)
+			{ w.writeU32(2); w.writeU64(0); w.writeU32(4096); });
+		reader = P9fsReader(rsp.data(), rsp.size());
+
+		REQUIRE(parseMsg(reader) == P9_RREADDIR);
+
+		reader.readU32();
+
+		vector<string> names;
+
+		while (reader.getRemaining())
+		{
+			reader.readQid();
+			reader.readU64();
+			reader.readU8();
+
+			names.push_back(reader.readString());
+		}
+
+		REQUIRE(count(names.begin(), names.end(), "dir") == 1);
+		REQUIRE(count(names.begin(), names.end(), "file") == 1);
+
+		rsp = call(P9_TUNLINKAT, [] (P9fsWriter& w)
+			{ w.writeU32(0); w.writeString("dir"); w.writeU32(AT_REMOVEDIR); });
+		reader = P9fsReader(rsp.data(), rsp.size());
+
+		REQUIRE(parseMsg(reader) == P9_RUNLINKAT);
+	}
+
+	SECTION("Parallel requests and ring wrap")
+	{
+		const unsigned int cNumFiles = 4;
+
+		vector<uint8_t> data(1500, 0x5A);
+
+		for (unsigned int i = 0; i < cNumFiles; i++)
+		{
+			create(i + 1, "file" + to_string(i));
+			write(i + 1, 0, data);
+		}
+
+		// responses of one round don't fit into the in ring together
+
+		for (int round = 0; round < 8; round++)
+		{
+			for (unsigned int i = 0; i < cNumFiles; i++)
+			{
+				frontend.send(0, readMsg(i + 1, 0, data.size(), i));
+			}
+
+			unsigned int received = 0;
+
+			for (unsigned int i = 0; i < cNumFiles; i++)
+			{
+				rsp = frontend.receive(0);
+				reader = P9fsReader(rsp.data(), rsp.size());
+
+				uint16_t rspTag;
+
+				REQUIRE(parseMsg(reader, &rspTag) == P9_RREAD);
+				REQUIRE(reader.readU32() == data.size());
+				REQUIRE(memcmp(&rsp[11], data.data(), data.size()) == 0);
+
+				received |= 1 << rspTag;
+			}
+
+			REQUIRE(received == (1u << cNumFiles) - 1);
+		}
+
+		auto stats = handler.getStats();
+
+		REQUIRE(stats[0].zeroCopyReads == 8 * cNumFiles);
+		REQUIRE(stats[0].maxInFlight >= 1);
+	}
+
+	removeDir(dir);
+}
@@ -0,0 +1,230 @@
+/*
+ *  Test Pipeline
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+#include "catch.hpp"
+
+#include "Pipeline.hpp"
+#include "RingBufferBase.hpp"
+#include "mocks/XenEvtchnMock.hpp"
+#include "mocks/XenGnttabMock.hpp"
+
+extern "C" {
+#include "testProtocol.h"
+}
+
+using std::atomic;
+using std::chrono::milliseconds;
+using std::lock_guard;
+using std::mutex;
+using std::sort;
+using std::this_thread::sleep_for;
+using std::vector;
+
+using XenBackend::Pipeline;
+using XenBackend::PipelineException;
+using XenBackend::RingBufferInBase;
+
+typedef Pipeline<int> IntPipeline;
+
+static IntPipeline::Stage createStage(const char* name, size_t numThreads,
+									  size_t queueSize, size_t batchSize,
+									  IntPipeline::Handler handler)
+{
+	IntPipeline::Stage stage;
+
+	stage.config.name = name;
+	stage.config.numThreads = numThreads;
+	stage.config.queueSize = queueSize;
+	stage.config.batchSize = batchSize;
+	stage.handler = handler;
+
+	return stage;
+}
+
+class TestPipelineRing : public RingBufferInBase<xen_test_back_ring,
+												 xen_test_sring, xentest_req,
+												 xentest_rsp>
+{
+public:
+
+	TestPipelineRing(domid_t domId, evtchn_port_t port, grant_ref_t ref) :
+		RingBufferInBase<xen_test_back_ring, xen_test_sring, xentest_req,
+						 xentest_rsp>(domId, port, ref),
+		mPipeline({
+			createStage("decode", 1, 2, 1, [](vector<int>&) {}),
+			createStage("execute", 2, 4, 1, [](vector<int>&) {
+				sleep_for(milliseconds(1));
+			}),
+			createStage("respond", 1, 16, 8, [this](vector<int>& batch) {
+				for (auto seq : batch)
+				{
+					xentest_rsp rsp {};
+
+					rsp.seq = seq;
+
+					queueResponse(rsp);
+				}
+
+				pushResponses();
+			})})
+	{
+		setConcurrentResponses();
+
+		mPipeline.start();
+	}
+
+	~TestPipelineRing()
+	{
+		stop();
+
+		mPipeline.stop();
+	}
+
+	vector<XenBackend::StageStats> getStats() const
+	{
+		return mPipeline.getStats();
+	}
+
+private:
+
+	IntPipeline mPipeline;
+
+	void processRequest(const xentest_req& req) override
+	{
+		mPipeline.push(req.seq);
+	}
+};
+
+TEST_CASE("Pipeline", "[pipeline]")
+{
+	SECTION("Stages")
+	{
+		mutex outMutex;
+		vector<int> out;
+
+		IntPipeline pipeline({
+			// drops odd items
+			createStage("filter", 1, 8, 4, [](vector<int>& batch) {
+				batch.erase(remove_if(batch.begin(), batch.end(),
+									  [](int i) { return i % 2; }),
+							batch.end());
+			}),
+			createStage("slow", 2, 2, 1, [](vector<int>&) {
+				sleep_for(milliseconds(1));
+			}),
+			createStage("collect", 1, 16, 16,
+						[&outMutex, &out](vector<int>& batch) {
+				lock_guard<mutex> lock(outMutex);
+
+				out.insert(out.end(), batch.begin(), batch.end());
+			})});
+
+		pipeline.start();
+
+		for (int i = 0; i < 200; i++)
+		{
+			pipeline.push(i);
+		}
+
+		// stop drains all stages
+		pipeline.stop();
+
+		sort(out.begin(), out.end());
+
+		REQUIRE(out.size() == 100);
+
+		for (int i = 0; i < 100; i++)
+		{
+			REQUIRE(out[i] == i * 2);
+		}
+
+		auto stats = pipeline.getStats();
+
+		REQUIRE(stats.size() == 3);
+		REQUIRE(stats[0].name == "filter");
+		REQUIRE(stats[0].items == 200);
+		REQUIRE(stats[0].batches < 200);
+		REQUIRE(stats[0].maxQueued <= 8);
+		REQUIRE(stats[1].items == 100);
+		REQUIRE(stats[1].batches == 100);
+		REQUIRE(stats[1].serviceTime >= milliseconds(1));
+		REQUIRE(stats[1].blocked > 0);
+		REQUIRE(stats[2].items == 100);
+		REQUIRE(stats[2].queued == 0);
+	}
+
+	SECTION("Invalid config")
+	{
+		REQUIRE_THROWS_AS(IntPipeline({}), PipelineException);
+		REQUIRE_THROWS_AS(IntPipeline({createStage("empty", 0, 1, 1,
+								[](vector<int>&) {})}), PipelineException);
+	}
+
+	SECTION("Ring buffer backpressure")
+	{
+		XenEvtchnMock::setErrorMode(false);
+		XenGnttabMock::setErrorMode(false);
+
+		TestPipelineRing ringBuffer(3, 66, 24);
+
+		ringBuffer.start();
+
+		xen_test_front_ring ring;
+		auto sring = static_cast<xen_test_sring*>(
+				XenGnttabMock::getLastBuffer());
+
+		SHARED_RING_INIT(sring);
+		FRONT_RING_INIT(&ring, sring, XC_PAGE_SIZE);
+
+		const int cNumReqs = 32;
+
+		for (int i = 0; i < cNumReqs; i++)
+		{
+			RING_GET_REQUEST(&ring, ring.req_prod_pvt++)->seq = i;
+		}
+
+		RING_PUSH_REQUESTS(&ring);
+
+		XenEvtchnMock::signalPort(XenEvtchnMock::getLastBoundPort());
+
+		int numRsps = 0;
+
+		for (int i = 0; i < 200 && numRsps < cNumReqs; i++)
+		{
+			sleep_for(milliseconds(5));
+
+			numRsps = ring.sring->rsp_prod;
+		}
+
+		REQUIRE(numRsps == cNumReqs);
+
+		auto stats = ringBuffer.getStats();
+
+		// the ring is consumed as fast as the pipeline goes
+		REQUIRE(stats[0].blocked > 0);
+		REQUIRE(stats[2].items == cNumReqs);
+	}
+}
@@ -0,0 +1,515 @@
+/*
+ *  Test pvcalls backend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "catch.hpp"
+
+#include "PvcallsBackend.hpp"
+#include "loopback/PvcallsFrontend.hpp"
+#include "mocks/XenEvtchnMock.hpp"
+#include "mocks/XenGnttabMock.hpp"
+#include "mocks/XenStoreMock.hpp"
+
+using std::atomic;
+using std::chrono::milliseconds;
+using std::min;
+using std::string;
+using std::this_thread::sleep_for;
+using std::thread;
+using std::vector;
+
+using XenBackend::PvcallsConfig;
+using XenBackend::PvcallsEventLoop;
+using XenBackend::PvcallsEventLoopPtr;
+using XenBackend::PvcallsFrontendHandler;
+
+static domid_t gFeDomId = 12;
+
+static int createListener(uint16_t& port)
+{
+	auto fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	REQUIRE(fd >= 0);
+
+	sockaddr_in addr {};
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	REQUIRE(bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0);
+	REQUIRE(listen(fd, 16) == 0);
+
+	socklen_t len = sizeof(addr);
+
+	REQUIRE(getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len) == 0);
+
+	port = ntohs(addr.sin_port);
+
+	return fd;
+}
+
+static uint16_t getFreePort()
+{
+	uint16_t port;
+
+	close(createListener(port));
+
+	return port;
+}
+
+static int acceptHost(int fd)
+{
+	pollfd pfd = { fd, POLLIN, 0 };
+
+	REQUIRE(poll(&pfd, 1, 3000) == 1);
+
+	auto conn = accept(fd, nullptr, nullptr);
+
+	REQUIRE(conn >= 0);
+
+	return conn;
+}
+
+static int connectHost(uint16_t port)
+{
+	auto fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	REQUIRE(fd >= 0);
+
+	sockaddr_in addr {};
+
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	REQUIRE(connect(fd, reinterpret_cast<sockaddr*>(&addr),
+					sizeof(addr)) == 0);
+
+	return fd;
+}
+
+static string readHost(int fd, size_t size)
+{
+	string data;
+
+	while (data.size() < size)
+	{
+		pollfd pfd = { fd, POLLIN, 0 };
+
+		if (poll(&pfd, 1, 3000) != 1)
+		{
+			break;
+		}
+
+		char buffer[4096];
+
+		auto ret = recv(fd, buffer, min(sizeof(buffer), size - data.size()),
+						0);
+
+		if (ret <= 0)
+		{
+			break;
+		}
+
+		data.append(buffer, ret);
+	}
+
+	return data;
+}
+
+static bool writeHost(int fd, const string& data)
+{
+	size_t written = 0;
+
+	while (written < data.size())
+	{
+		auto ret = send(fd, &data[written], data.size() - written,
+						MSG_NOSIGNAL);
+
+		if (ret <= 0)
+		{
+			return false;
+		}
+
+		written += ret;
+	}
+
+	return true;
+}
+
+static string makeData(size_t size, unsigned int seed)
+{
+	string data(size, 0);
+
+	for (size_t i = 0; i < size; i++)
+	{
+		data[i] = (i * 7 + seed) & 0xFF;
+	}
+
+	return data;
+}
+
+TEST_CASE("PvcallsEventLoop", "[pvcalls]")
+{
+	XenEvtchnMock::setErrorMode(false);
+
+	PvcallsEventLoop loop;
+
+	SECTION("Tasks")
+	{
+		vector<int> order;
+
+		for (int i = 0; i < 100; i++)
+		{
+			loop.post([&order, i] { order.push_back(i); });
+		}
+
+		loop.sync();
+
+		REQUIRE(order.size() == 100);
+
+		for (int i = 0; i < 100; i++)
+		{
+			REQUIRE(order[i] == i);
+		}
+	}
+
+	SECTION("Fds")
+	{
+		auto fd = eventfd(0, EFD_NONBLOCK);
+		atomic<int> count(0);
+
+		REQUIRE(fd >= 0);
+
+		loop.post([&loop, fd, &count] {
+			loop.addFd(fd, EPOLLIN | EPOLLET,
+					   [fd, &count] (uint32_t events) {
+				uint64_t value;
+
+				if (read(fd, &value, sizeof(value)) == sizeof(value))
+				{
+					count += value;
+				}
+			});
+		});
+
+		loop.sync();
+
+		uint64_t value = 3;
+
+		REQUIRE(write(fd, &value, sizeof(value)) == sizeof(value));
+
+		for (int i = 0; i < 3000 && count != 3; i++)
+		{
+			sleep_for(milliseconds(1));
+		}
+
+		REQUIRE(count == 3);
+
+		loop.post([&loop, fd] { loop.removeFd(fd); });
+
+		loop.sync();
+
+		close(fd);
+	}
+}
+
+TEST_CASE("Pvcalls", "[pvcalls]")
+{
+	XenEvtchnMock::setErrorMode(false);
+	XenGnttabMock::setErrorMode(false);
+	XenStoreMock::setErrorMode(false);
+	XenStoreMock::setWriteValueCbk(nullptr);
+
+	static uint16_t devId = 0;
+
+	PvcallsConfig beConfig;
+	vector<PvcallsEventLoopPtr> loops;
+
+	for (unsigned int i = 0; i < beConfig.numLoops; i++)
+	{
+		loops.emplace_back(new PvcallsEventLoop(beConfig.maxEvents));
+	}
+
+	PvcallsFrontend frontend(0, gFeDomId, ++devId);
+	PvcallsFrontendHandler handler("pvcalls", 0, gFeDomId, devId, loops,
+								   beConfig);
+
+	handler.start();
+
+	REQUIRE(frontend.connect());
+
+	string value;
+
+	REQUIRE(frontend.readBackend("function-calls", value));
+	REQUIRE(value == "1");
+
+	SECTION("Connect and transfer")
+	{
+		uint16_t port;
+		auto listener = createListener(port);
+		auto ring = frontend.allocDataRing(1);
+
+		REQUIRE(frontend.socket(1) == 0);
+		REQUIRE(frontend.connectSocket(1, port, *ring) == 0);
+
+		auto conn = acceptHost(listener);
+
+		// bigger than the ring, so both sides wait for each other
+
+		auto out = makeData(5 * frontend.getRingSize(*ring) + 123, 1);
+		auto in = makeData(7 * frontend.getRingSize(*ring) + 45, 2);
+		string received;
+
+		thread host([conn, &out, &in, &received] {
+			received = readHost(conn, out.size());
+			writeHost(conn, in);
+		});
+
+		frontend.write(*ring, out);
+
+		auto data = frontend.read(*ring, in.size());
+
+		host.join();
+
+		REQUIRE(received == out);
+		REQUIRE(data == in);
+
+		close(conn);
+
+		REQUIRE(frontend.read(*ring, 1).empty());
+		REQUIRE(frontend.getInError(*ring) == -ENOTCONN);
+
+		auto stats = handler.getStats();
+
+		REQUIRE(stats.sockets == 1);
+		REQUIRE(stats.sentBytes == out.size());
+		REQUIRE(stats.receivedBytes == in.size());
+
+		REQUIRE(frontend.release(1) == 0);
+		REQUIRE(handler.getStats().sockets == 0);
+
+		close(listener);
+	}
+
+	SECTION("Listen, poll and accept")
+	{
+		auto port = getFreePort();
+
+		REQUIRE(frontend.socket(1) == 0);
+		REQUIRE(frontend.bind(1, port) == 0);
+		REQUIRE(frontend.listen(1) == 0);
+
+		xen_pvcalls_request req {};
+		xen_pvcalls_response rsp;
+
+		req.cmd = PVCALLS_POLL;
+		req.u.poll.id = 1;
+
+		auto pollId = frontend.send(req);
+
+		// no connection yet
+		REQUIRE_FALSE(frontend.receive(pollId, rsp, 50));
+
+		auto conn = connectHost(port);
+
+		REQUIRE(frontend.receive(pollId, rsp));
+		REQUIRE(rsp.ret == 0);
+		REQUIRE(rsp.u.poll.id == 1);
+
+		auto ring = frontend.allocDataRing(0);
+
+		req = {};
+		req.cmd = PVCALLS_ACCEPT;
+		req.u.accept.id = 1;
+		req.u.accept.id_new = 2;
+		req.u.accept.ref = ring->intfRef;
+		req.u.accept.evtchn = ring->port;
+
+		REQUIRE(frontend.call(req) == 0);
+
+		frontend.bindDataRing(*ring);
+
+		REQUIRE(writeHost(conn, "ping"));
+		REQUIRE(frontend.read(*ring, 4) == "ping");
+
+		frontend.write(*ring, "pong");
+
+		REQUIRE(readHost(conn, 4) == "pong");
+
+		// accept waits for the next connection
+
+		auto ring2 = frontend.allocDataRing(0);
+
+		req.u.accept.id_new = 3;
+		req.u.accept.ref = ring2->intfRef;
+		req.u.accept.evtchn = ring2->port;
+
+		auto acceptId = frontend.send(req);
+
+		REQUIRE_FALSE(frontend.receive(acceptId, rsp, 50));
+
+		auto conn2 = connectHost(port);
+
+		REQUIRE(frontend.receive(acceptId, rsp));
+		REQUIRE(rsp.ret == 0);
+
+		frontend.bindDataRing(*ring2);
+
+		REQUIRE(writeHost(conn2, "second"));
+		REQUIRE(frontend.read(*ring2, 6) == "second");
+
+		REQUIRE(handler.getStats().sockets == 3);
+
+		REQUIRE(frontend.release(3) == 0);
+		REQUIRE(frontend.release(2) == 0);
+		REQUIRE(frontend.release(1) == 0);
+
+		close(conn);
+		close(conn2);
+	}
+
+	SECTION("Release pending accept")
+	{
+		auto port = getFreePort();
+
+		REQUIRE(frontend.socket(1) == 0);
+		REQUIRE(frontend.bind(1, port) == 0);
+		REQUIRE(frontend.listen(1) == 0);
+
+		auto ring = frontend.allocDataRing(0);
+
+		xen_pvcalls_request req {};
+		xen_pvcalls_response rsp;
+
+		req.cmd = PVCALLS_ACCEPT;
+		req.u.accept.id = 1;
+		req.u.accept.id_new = 2;
+		req.u.accept.ref = ring->intfRef;
+		req.u.accept.evtchn = ring->port;
+
+		auto acceptId = frontend.send(req);
+
+		REQUIRE(frontend.call(req) == -EBUSY);
+		REQUIRE(frontend.release(1) == 0);
+		REQUIRE(frontend.receive(acceptId, rsp));
+		REQUIRE(rsp.ret == -EINTR);
+	}
+
+	SECTION("Errors")
+	{
+		xen_pvcalls_request req {};
+
+		req.cmd = PVCALLS_SOCKET;
+		req.u.socket.id = 1;
+		req.u.socket.domain = AF_UNIX;
+		req.u.socket.type = SOCK_STREAM;
+
+		REQUIRE(frontend.call(req) == -EAFNOSUPPORT);
+
+		REQUIRE(frontend.socket(1) == 0);
+		REQUIRE(frontend.socket(1) == -EEXIST);
+		REQUIRE(frontend.listen(2) == -EBADF);
+		REQUIRE(frontend.listen(1) == -EINVAL);
+
+		auto ring = frontend.allocDataRing(1);
+
+		REQUIRE(frontend.connectSocket(1, getFreePort(), *ring) ==
+				-ECONNREFUSED);
+
+		REQUIRE(frontend.release(1) == 0);
+
+		// too big ring order
+		ring = frontend.allocDataRing(beConfig.maxPageOrder + 1);
+
+		REQUIRE(frontend.socket(1) == 0);
+		REQUIRE(frontend.connectSocket(1, getFreePort(), *ring) == -EINVAL);
+		REQUIRE(frontend.release(1) == 0);
+
+		req = {};
+		req.cmd = 100;
+
+		REQUIRE(frontend.call(req) == -EBADF);
+
+		REQUIRE(handler.getStats().errors == 7);
+	}
+
+	SECTION("Many sockets")
+	{
+		const size_t cNumSockets = 16;
+
+		uint16_t port;
+		auto listener = createListener(port);
+		vector<PvcallsFrontend::DataRingPtr> rings;
+		vector<int> conns;
+
+		for (size_t i = 0; i < cNumSockets; i++)
+		{
+			rings.push_back(frontend.allocDataRing(0));
+
+			REQUIRE(frontend.socket(i) == 0);
+			REQUIRE(frontend.connectSocket(i, port, *rings[i]) == 0);
+
+			conns.push_back(acceptHost(listener));
+		}
+
+		for (size_t i = 0; i < cNumSockets; i++)
+		{
+			frontend.write(*rings[i], makeData(1000, i));
+		}
+
+		for (size_t i = 0; i < cNumSockets; i++)
+		{
+			auto data = readHost(conns[i], 1000);
+
+			REQUIRE(data == makeData(1000, i));
+			REQUIRE(writeHost(conns[i], data));
+		}
+
+		for (size_t i = 0; i < cNumSockets; i++)
+		{
+			REQUIRE(frontend.read(*rings[i], 1000) == makeData(1000, i));
+		}
+
+		// the rest are released when the handler is closed
+
+		REQUIRE(frontend.release(0) == 0);
+
+		for (auto conn : conns)
+		{
+			close(conn);
+		}
+
+		close(listener);
+	}
+}
@@ -20,23 +20,38 @@
 
 #include "testRingBuffer.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <mutex>
+#include <thread>
+#include <vector>
 
 #include "catch.hpp"
 
+#include "RingPoller.hpp"
+#include "RingScheduler.hpp"
 #include "mocks/XenEvtchnMock.hpp"
 #include "mocks/XenGnttabMock.hpp"
 
+using std::atomic_bool;
+using std::chrono::microseconds;
 using std::chrono::milliseconds;
 using std::condition_variable;
+using std::is_sorted;
 using std::mutex;
 using std::this_thread::sleep_for;
+using std::thread;
 using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
 
+using XenBackend::EventLane;
 using XenBackend::RingBufferInBase;
 using XenBackend::RingBufferOutBase;
+using XenBackend::RingPoller;
+using XenBackend::RingScheduler;
 
 static domid_t gDomId = 3;
 static evtchn_port_t gPort = 65;
@@ -48,7 +63,8 @@ static condition_variable gCondVar;
 
 static bool gError = false;
 
-void sendReq(xentest_req& req, xen_test_front_ring& ring)
+bool sendReq(xentest_req& req, xen_test_front_ring& ring,
+			 evtchn_port_t port = XenEvtchnMock::getLastBoundPort())
 {
 	*RING_GET_REQUEST(&ring, ring.req_prod_pvt) = req;
 
@@ -60,8 +76,10 @@ void sendReq(xentest_req& req, xen_test_front_ring& ring)
 
 	if (notify)
 	{
-		XenEvtchnMock::signalPort(XenEvtchnMock::getLastBoundPort());
+		XenEvtchnMock::signalPort(port);
 	}
+
+	return notify;
 }
 
 bool receiveResp(xentest_rsp& rsp, xen_test_front_ring& ring)
@@ -271,6 +289,451 @@ TEST_CASE("RingBufferIn", "[ringbuffer]")
 	}
 }
 
+TEST_CASE("RingPoller", "[ringbuffer]")
+{
+	XenEvtchnMock::setErrorMode(false);
+	XenGnttabMock::setErrorMode(false);
+
+	gError = false;
+
+	const int cNumRings = 2;
+
+	std::shared_ptr<TestRingBufferIn> ringBuffers[cNumRings];
+	xen_test_front_ring rings[cNumRings];
+	evtchn_port_t ports[cNumRings];
+
+	RingPoller poller(0, microseconds(1000));
+
+	poller.start();
+
+	for (int i = 0; i < cNumRings; i++)
+	{
+		ringBuffers[i].reset(new TestRingBufferIn(gDomId, gPort + i,
+												  gRef + i));
+
+		ringBuffers[i]->setErrorCallback(errorCallback);
+
+		poller.addRing(ringBuffers[i]);
+
+		ringBuffers[i]->start();
+
+		ports[i] = XenEvtchnMock::getLastBoundPort();
+
+		XenEvtchnMock::setNotifyCbk(ports[i], respNotification);
+
+		auto sring = static_cast<xen_test_sring*>(
+				XenGnttabMock::getLastBuffer());
+
+		SHARED_RING_INIT(sring);
+		FRONT_RING_INIT(&rings[i], sring, XC_PAGE_SIZE);
+	}
+
+	REQUIRE(poller.getNumRings() == cNumRings);
+
+	xentest_req req {XENTEST_CMD2};
+
+	SECTION("Send and receive")
+	{
+		int numNotifications = 0;
+
+		for (int i = 0; i < 1000; i++)
+		{
+			auto& ring = rings[i % cNumRings];
+
+			req.seq = i;
+			req.op.command2.u64data1 = i;
+
+			numNotifications += sendReq(req, ring, ports[i % cNumRings]);
+
+			xentest_rsp rsp {};
+
+			REQUIRE(receiveResp(rsp, ring));
+			REQUIRE(rsp.seq == req.seq);
+			REQUIRE(rsp.u32data == calculateCommand(req));
+		}
+
+		// the frontend notifies only when the poller goes idle
+		REQUIRE(numNotifications < 1000);
+
+		// wait till the poller goes idle
+		sleep_for(milliseconds(100));
+
+		auto stats = poller.getStats();
+
+		REQUIRE(stats.numRings == cNumRings);
+		REQUIRE(stats.cpu == 0);
+		REQUIRE(stats.busyPolls >= 1);
+		REQUIRE(stats.polls > stats.busyPolls);
+		REQUIRE(stats.sleeps >= 1);
+		REQUIRE(stats.utilization <= 1.0);
+
+		// the idle poller is woken up by the event channel
+
+		req.seq = 1000;
+
+		REQUIRE(sendReq(req, rings[1], ports[1]));
+
+		xentest_rsp rsp {};
+
+		REQUIRE(receiveResp(rsp, rings[1]));
+		REQUIRE(rsp.seq == req.seq);
+		REQUIRE_FALSE(gError);
+	}
+
+	SECTION("Check overflow")
+	{
+		rings[0].sring->req_prod = rings[0].nr_ents + 1;
+
+		XenEvtchnMock::signalPort(ports[0]);
+
+		sleep_for(milliseconds(100));
+
+		REQUIRE(gError);
+
+		// the other ring is still serviced
+
+		req.seq = 1;
+
+		sendReq(req, rings[1], ports[1]);
+
+		xentest_rsp rsp {};
+
+		REQUIRE(receiveResp(rsp, rings[1]));
+		REQUIRE(rsp.seq == req.seq);
+	}
+
+	SECTION("Remove while notified")
+	{
+		atomic_bool terminate(false);
+
+		thread signaller([&terminate, &ports] {
+			while (!terminate)
+			{
+				XenEvtchnMock::signalPort(ports[0]);
+
+				sleep_for(microseconds(10));
+			}
+		});
+
+		poller.removeRing(ringBuffers[0]);
+
+		// the poller is deleted right after the removal while the event
+		// channel keeps calling the wake callback
+
+		for (int i = 0; i < 100; i++)
+		{
+			unique_ptr<RingPoller> other(new RingPoller());
+
+			other->start();
+			other->addRing(ringBuffers[0]);
+
+			sleep_for(microseconds(200));
+
+			other->removeRing(ringBuffers[0]);
+		}
+
+		terminate = true;
+
+		signaller.join();
+
+		REQUIRE_FALSE(gError);
+	}
+
+	for (int i = 0; i < cNumRings; i++)
+	{
+		poller.removeRing(ringBuffers[i]);
+	}
+
+	REQUIRE(poller.getNumRings() == 0);
+}
+
+TEST_CASE("RingScheduler", "[ringbuffer]")
+{
+	XenEvtchnMock::setErrorMode(false);
+	XenGnttabMock::setErrorMode(false);
+
+	gError = false;
+
+	const int cNumRings = 2;
+
+	std::shared_ptr<TestRingBufferIn> ringBuffers[cNumRings];
+	xen_test_front_ring rings[cNumRings];
+	evtchn_port_t ports[cNumRings];
+
+	RingScheduler scheduler(1);
+
+	auto relaxed = scheduler.addClass("relaxed", std::chrono::seconds(10));
+	auto strict = scheduler.addClass("strict", microseconds(0));
+
+	REQUIRE(scheduler.getNumClasses() == 2);
+
+	for (int i = 0; i < cNumRings; i++)
+	{
+		ringBuffers[i].reset(new TestRingBufferIn(gDomId, gPort + i,
+												  gRef + i));
+
+		ringBuffers[i]->setErrorCallback(errorCallback);
+
+		scheduler.addRing(ringBuffers[i], i == 0 ? relaxed : strict);
+
+		ringBuffers[i]->start();
+
+		ports[i] = XenEvtchnMock::getLastBoundPort();
+
+		auto sring = static_cast<xen_test_sring*>(
+				XenGnttabMock::getLastBuffer());
+
+		SHARED_RING_INIT(sring);
+		FRONT_RING_INIT(&rings[i], sring, XC_PAGE_SIZE);
+	}
+
+	REQUIRE(scheduler.getNumRings() == cNumRings);
+
+	xentest_req req {XENTEST_CMD2};
+
+	SECTION("Check deadline order")
+	{
+		vector<int> order;
+
+		for (int i = 0; i < cNumRings; i++)
+		{
+			XenEvtchnMock::setNotifyCbk(ports[i], [&order, i] {
+				unique_lock<mutex> lock(gMutex);
+
+				order.push_back(i);
+
+				gCondVar.notify_all();
+			});
+		}
+
+		// the relaxed ring is woken first but has the later deadline
+
+		for (int i = 0; i < cNumRings; i++)
+		{
+			req.seq = i;
+
+			REQUIRE(sendReq(req, rings[i], ports[i]));
+
+			sleep_for(milliseconds(50));
+		}
+
+		REQUIRE(scheduler.getStats().pending == cNumRings);
+
+		scheduler.start();
+
+		{
+			unique_lock<mutex> lock(gMutex);
+
+			REQUIRE(gCondVar.wait_for(lock, milliseconds(1000), [&order]
+									  { return order.size() == cNumRings; }));
+		}
+
+		REQUIRE(order == vector<int>({1, 0}));
+
+		// the response is sent before the pass is accounted
+		sleep_for(milliseconds(50));
+
+		auto stats = scheduler.getStats();
+
+		REQUIRE(stats.numWorkers == 1);
+		REQUIRE(stats.numRings == cNumRings);
+		REQUIRE(stats.dispatches >= cNumRings);
+		REQUIRE(stats.classes.size() == 2);
+		REQUIRE(stats.classes[relaxed].name == "relaxed");
+		REQUIRE(stats.classes[relaxed].numRings == 1);
+		REQUIRE(stats.classes[relaxed].passes == 1);
+		REQUIRE(stats.classes[relaxed].misses == 0);
+		REQUIRE(stats.classes[relaxed].avgWait >= milliseconds(50));
+		REQUIRE(stats.classes[strict].passes == 1);
+		REQUIRE(stats.classes[strict].misses == 1);
+		REQUIRE(stats.classes[strict].maxLateness.count() >= 0);
+	}
+
+	SECTION("Send and receive")
+	{
+		for (int i = 0; i < cNumRings; i++)
+		{
+			XenEvtchnMock::setNotifyCbk(ports[i], respNotification);
+		}
+
+		scheduler.start();
+
+		for (int i = 0; i < 1000; i++)
+		{
+			auto& ring = rings[i % cNumRings];
+
+			req.seq = i;
+			req.op.command2.u64data1 = i;
+
+			sendReq(req, ring, ports[i % cNumRings]);
+
+			xentest_rsp rsp {};
+
+			REQUIRE(receiveResp(rsp, ring));
+			REQUIRE(rsp.seq == req.seq);
+			REQUIRE(rsp.u32data == calculateCommand(req));
+		}
+
+		sleep_for(milliseconds(50));
+
+		auto stats = scheduler.getStats();
+
+		REQUIRE(stats.classes[relaxed].passes > 0);
+		REQUIRE(stats.classes[relaxed].misses == 0);
+		REQUIRE(stats.classes[strict].misses ==
+				stats.classes[strict].passes);
+		REQUIRE_FALSE(gError);
+	}
+
+	SECTION("Remove while notified")
+	{
+		atomic_bool terminate(false);
+
+		thread signaller([&terminate, &ports] {
+			while (!terminate)
+			{
+				XenEvtchnMock::signalPort(ports[0]);
+
+				sleep_for(microseconds(10));
+			}
+		});
+
+		scheduler.start();
+		scheduler.removeRing(ringBuffers[0]);
+
+		// the scheduler is deleted right after the removal or with the ring
+		// still added while the event channel keeps calling the wake
+		// callback
+
+		for (int i = 0; i < 100; i++)
+		{
+			unique_ptr<RingScheduler> other(new RingScheduler(2));
+
+			other->addRing(ringBuffers[0], other->addClass("class",
+														   microseconds(0)));
+			other->start();
+
+			sleep_for(microseconds(200));
+
+			if (i % 2)
+			{
+				other->removeRing(ringBuffers[0]);
+
+				REQUIRE(other->getNumRings() == 0);
+				REQUIRE(other->getStats().pending == 0);
+			}
+		}
+
+		terminate = true;
+
+		signaller.join();
+
+		REQUIRE_FALSE(gError);
+	}
+
+	for (int i = 0; i < cNumRings; i++)
+	{
+		scheduler.removeRing(ringBuffers[i]);
+	}
+
+	REQUIRE(scheduler.getNumRings() == 0);
+	REQUIRE(scheduler.getStats().classes[strict].numRings == 0);
+}
+
+TEST_CASE("RingBufferDispatch", "[ringbuffer]")
+{
+	XenEvtchnMock::setErrorMode(false);
+	XenGnttabMock::setErrorMode(false);
+
+	gError = false;
+
+	TestRingBufferIn ringBuffer(gDomId, gPort, gRef);
+
+	// CMD2 is offloaded, CMD1 and CMD3 are processed inline, the key is
+	// taken from the command data
+
+	ringBuffer.setDispatcher(std::make_shared<XenBackend::ThreadPool>(4),
+							 [](const xentest_req& req, uint64_t& key) {
+		key = req.op.command3.u16data1;
+
+		return req.id == XENTEST_CMD2;
+	});
+
+	ringBuffer.setErrorCallback(errorCallback);
+	ringBuffer.start();
+
+	xen_test_front_ring ring;
+	auto sring = static_cast<xen_test_sring*>(XenGnttabMock::getLastBuffer());
+
+	SHARED_RING_INIT(sring);
+	FRONT_RING_INIT(&ring, sring, XC_PAGE_SIZE);
+
+	const int cNumReqs = 30;
+
+	// key 1: CMD2, CMD1, CMD2, ... must complete in order
+	// key 2: CMD3 only, processed inline
+
+	for (int i = 0; i < cNumReqs; i++)
+	{
+		xentest_req req {};
+
+		req.seq = i;
+
+		if (i % 3 == 2)
+		{
+			req.id = XENTEST_CMD3;
+			req.op.command3.u16data1 = 2;
+		}
+		else
+		{
+			req.id = i % 3 ? XENTEST_CMD1 : XENTEST_CMD2;
+			req.op.command3.u16data1 = 1;
+		}
+
+		*RING_GET_REQUEST(&ring, ring.req_prod_pvt++) = req;
+	}
+
+	RING_PUSH_REQUESTS(&ring);
+
+	XenEvtchnMock::signalPort(XenEvtchnMock::getLastBoundPort());
+
+	vector<uint32_t> key1Seqs;
+	int numRsps = 0;
+
+	for (int i = 0; i < 100 && numRsps < cNumReqs; i++)
+	{
+		sleep_for(milliseconds(10));
+
+		auto rp = ring.sring->rsp_prod;
+
+		xen_rmb();
+
+		for (; ring.rsp_cons != rp; ring.rsp_cons++, numRsps++)
+		{
+			auto rsp = RING_GET_RESPONSE(&ring, ring.rsp_cons);
+
+			if (rsp->seq % 3 != 2)
+			{
+				key1Seqs.push_back(rsp->seq);
+			}
+		}
+	}
+
+	REQUIRE(numRsps == cNumReqs);
+	REQUIRE(is_sorted(key1Seqs.begin(), key1Seqs.end()));
+
+	ringBuffer.stop();
+
+	auto stats = ringBuffer.getDispatchStats();
+
+	REQUIRE(stats.offloadedRequests + stats.inlineRequests == cNumReqs);
+	REQUIRE(stats.inlineRequests >= cNumReqs / 3);
+	REQUIRE(stats.offloadedRequests >= cNumReqs / 3);
+	REQUIRE(stats.orderedOffloads == stats.offloadedRequests - cNumReqs / 3);
+	REQUIRE(stats.maxOffloadLatency >= stats.offloadLatency);
+	REQUIRE_FALSE(gError);
+}
+
 TEST_CASE("RingBufferOut", "[ringbuffer]")
 {
 	XenEvtchnMock::setErrorMode(false);
@@ -333,4 +796,175 @@ TEST_CASE("RingBufferOut", "[ringbuffer]")
 
 		ringBuffer.stop();
 	}
+
+	SECTION("Batch")
+	{
+		for(int j = 0; j < 3; j++)
+		{
+			events[j].seq = seqNumber++;
+
+			REQUIRE(ringBuffer.queueEvent(events[j]));
+		}
+
+		xentest_evt receivedEvt {};
+
+		// queued events are not visible until flushed
+		REQUIRE_FALSE(receiveEvent(eventPage, eventBuffer, receivedEvt));
+
+		ringBuffer.flushEvents();
+
+		for(int j = 0; j < 3; j++)
+		{
+			REQUIRE(receiveEvent(eventPage, eventBuffer, receivedEvt));
+			REQUIRE(events[j].seq == receivedEvt.seq);
+		}
+
+		REQUIRE_FALSE(receiveEvent(eventPage, eventBuffer, receivedEvt));
+
+		ringBuffer.stop();
+	}
+
+	SECTION("Urgent lane")
+	{
+		int numEvents = XENTEST_IN_RING_LEN;
+
+		ringBuffer.setUrgentReserve(2, 2);
+
+		xentest_evt event {XENTEST_EVT1};
+
+		// bulk events don't take the reserved slots
+		for (int i = 0; i < numEvents - 2; i++)
+		{
+			event.seq = seqNumber++;
+
+			REQUIRE(ringBuffer.sendEvent(event) == 0);
+		}
+
+		REQUIRE(ringBuffer.sendEvent(event) == ENOSPC);
+
+		for (int i = 0; i < 4; i++)
+		{
+			event.seq = seqNumber++;
+
+			REQUIRE(ringBuffer.sendEvent(event, EventLane::URGENT) == 0);
+		}
+
+		// the ring and the backend queue are full
+		REQUIRE(ringBuffer.sendEvent(event, EventLane::URGENT) == ENOSPC);
+		REQUIRE(ringBuffer.getLaneStats(EventLane::URGENT).pending == 2);
+
+		xentest_evt receivedEvt {};
+
+		REQUIRE(receiveEvent(eventPage, eventBuffer, receivedEvt));
+		REQUIRE(receiveEvent(eventPage, eventBuffer, receivedEvt));
+
+		// waiting urgent events go first and take the freed slots
+		REQUIRE(ringBuffer.sendEvent(event) == ENOSPC);
+
+		for (int i = 2; i < numEvents + 2; i++)
+		{
+			REQUIRE(receiveEvent(eventPage, eventBuffer, receivedEvt));
+			REQUIRE(receivedEvt.seq == i);
+		}
+
+		REQUIRE_FALSE(receiveEvent(eventPage, eventBuffer, receivedEvt));
+
+		auto bulk = ringBuffer.getLaneStats(EventLane::BULK);
+		auto urgent = ringBuffer.getLaneStats(EventLane::URGENT);
+
+		REQUIRE(bulk.events == static_cast<uint64_t>(numEvents - 2));
+		REQUIRE(bulk.dropped == 2);
+		REQUIRE(urgent.events == 4);
+		REQUIRE(urgent.dropped == 1);
+		REQUIRE(urgent.pending == 0);
+		REQUIRE(urgent.maxDelay >= urgent.avgDelay);
+
+		ringBuffer.stop();
+	}
+}
+
+static int gNumErrors = 0;
+
+void countErrorCallback(const std::exception& e)
+{
+	gNumErrors++;
+}
+
+TEST_CASE("RingBufferErrors", "[ringbuffer]")
+{
+	XenEvtchnMock::setErrorMode(false);
+	XenGnttabMock::setErrorMode(false);
+
+	gNumErrors = 0;
+
+	SECTION("Notify")
+	{
+		TestRingBufferOut ringBuffer(gDomId, gPort, gRef);
+
+		ringBuffer.setErrorCallback(countErrorCallback);
+
+		xentest_event_page* eventPage = static_cast<xentest_event_page*>(
+				XenGnttabMock::getLastBuffer());
+
+		eventPage->in_cons = 0;
+		eventPage->in_prod = 0;
+
+		xentest_evt event {XENTEST_EVT2};
+
+		// the failure episode is reported once
+		XenEvtchnMock::setErrorMode(true);
+
+		for (int i = 0; i < 10; i++)
+		{
+			REQUIRE(ringBuffer.sendEvent(event) != 0);
+		}
+
+		REQUIRE(gNumErrors == 1);
+		REQUIRE(ringBuffer.getErrorStats().errors == 10);
+		REQUIRE(ringBuffer.getErrorStats().episodes == 1);
+		REQUIRE(ringBuffer.getErrorStats().lastError != 0);
+
+		// success ends the episode, the next failure is reported again
+		XenEvtchnMock::setErrorMode(false);
+
+		REQUIRE(ringBuffer.sendEvent(event) == 0);
+
+		XenEvtchnMock::setErrorMode(true);
+
+		REQUIRE(ringBuffer.flushEvents() == 0);
+		REQUIRE(ringBuffer.sendEvent(event) != 0);
+
+		XenEvtchnMock::setErrorMode(false);
+
+		REQUIRE(gNumErrors == 2);
+		REQUIRE(ringBuffer.getErrorStats().errors == 11);
+		REQUIRE(ringBuffer.getErrorStats().episodes == 2);
+	}
+
+	SECTION("Overflow")
+	{
+		TestRingBufferIn ringBuffer(gDomId, gPort, gRef);
+
+		ringBuffer.setErrorCallback(countErrorCallback);
+
+		xen_test_front_ring ring;
+		auto sring = static_cast<xen_test_sring*>(
+				XenGnttabMock::getLastBuffer());
+
+		SHARED_RING_INIT(sring);
+		FRONT_RING_INIT(&ring, sring, XC_PAGE_SIZE);
+
+		// the frontend produces more requests than the ring holds
+		sring->req_prod = RING_SIZE(&ring) + 1;
+
+		REQUIRE_FALSE(ringBuffer.poll());
+		REQUIRE(gNumErrors == 1);
+		REQUIRE(ringBuffer.getErrorStats().errors == 1);
+		REQUIRE(ringBuffer.getErrorStats().lastError == EIO);
+
+		// the broken ring is not polled anymore
+		REQUIRE_FALSE(ringBuffer.poll());
+		REQUIRE(ringBuffer.getErrorStats().errors == 1);
+		REQUIRE(gNumErrors == 1);
+	}
 }
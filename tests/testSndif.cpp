@@ -0,0 +1,260 @@
+/*
+ *  Test sndif backend
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "catch.hpp"
+
+#include "SndifBackend.hpp"
+#include "loopback/SndifFrontend.hpp"
+#include "mocks/XenEvtchnMock.hpp"
+#include "mocks/XenGnttabMock.hpp"
+#include "mocks/XenStoreMock.hpp"
+
+using std::atomic;
+using std::chrono::milliseconds;
+using std::make_shared;
+using std::vector;
+
+using XenBackend::SndifConfig;
+using XenBackend::SndifMixer;
+using XenBackend::SndifPeriodClock;
+
+static domid_t gFeDomId = 9;
+
+TEST_CASE("SndifMixer", "[sndif]")
+{
+	SECTION("Conversion")
+	{
+		vector<int16_t> s16 = {0, 16384, -16384, 32767, -32768, 1, -1, 100, 7};
+		vector<float> f(s16.size());
+		vector<int16_t> out(s16.size());
+
+		SndifMixer::toFloat(XENSND_PCM_FORMAT_S16_LE, s16.data(), f.data(),
+							f.size());
+
+		REQUIRE(f[0] == 0.0f);
+		REQUIRE(f[1] == 0.5f);
+		REQUIRE(f[2] == -0.5f);
+		REQUIRE(f[4] == -1.0f);
+
+		SndifMixer::fromFloat(XENSND_PCM_FORMAT_S16_LE, f.data(), out.data(),
+							  out.size());
+
+		REQUIRE(out == s16);
+
+		vector<uint8_t> u8 = {0, 64, 128, 192, 255};
+		vector<uint8_t> u8Out(u8.size());
+
+		f.resize(u8.size());
+
+		SndifMixer::toFloat(XENSND_PCM_FORMAT_U8, u8.data(), f.data(),
+							f.size());
+
+		REQUIRE(f[0] == -1.0f);
+		REQUIRE(f[2] == 0.0f);
+
+		SndifMixer::fromFloat(XENSND_PCM_FORMAT_U8, f.data(), u8Out.data(),
+							  u8Out.size());
+
+		REQUIRE(u8Out == u8);
+	}
+
+	SECTION("Mixing and clipping")
+	{
+		vector<float> acc = {0.25f, 0.5f, 0.75f, -0.75f, 0.0f, 0.9f};
+		vector<float> src = {0.25f, 0.25f, 0.75f, -0.75f, 0.5f, 0.9f};
+		vector<int16_t> out(acc.size());
+
+		SndifMixer::mix(acc.data(), src.data(), acc.size());
+
+		REQUIRE(acc[0] == 0.5f);
+		REQUIRE(acc[1] == 0.75f);
+		REQUIRE(acc[4] == 0.5f);
+
+		SndifMixer::fromFloat(XENSND_PCM_FORMAT_S16_LE, acc.data(),
+							  out.data(), out.size());
+
+		REQUIRE(out[0] == 16384);
+		REQUIRE(out[2] == 32767);
+		REQUIRE(out[3] == -32768);
+		REQUIRE(out[5] == 32767);
+	}
+
+	SECTION("Formats")
+	{
+		REQUIRE(SndifMixer::getSampleSize(XENSND_PCM_FORMAT_S32_LE) == 4);
+		REQUIRE(SndifMixer::getSampleSize(XENSND_PCM_FORMAT_MU_LAW) == 0);
+		REQUIRE((SndifMixer::getFormats() &
+				 (1ULL << XENSND_PCM_FORMAT_F32_LE)) != 0);
+	}
+}
+
+TEST_CASE("SndifPeriodClock", "[sndif]")
+{
+	atomic<int> count(0);
+
+	SndifPeriodClock clock([&count] { count++; });
+
+	clock.start(milliseconds(2));
+
+	std::this_thread::sleep_for(milliseconds(50));
+
+	clock.stop();
+
+	auto periods = count.load();
+
+	REQUIRE(periods >= 10);
+	REQUIRE(clock.getPeriods() == static_cast<uint64_t>(periods));
+
+	std::this_thread::sleep_for(milliseconds(10));
+
+	REQUIRE(count == periods);
+}
+
+TEST_CASE("Sndif", "[sndif]")
+{
+	XenEvtchnMock::setErrorMode(false);
+	XenGnttabMock::setErrorMode(false);
+	XenStoreMock::setErrorMode(false);
+	XenStoreMock::setWriteValueCbk(nullptr);
+
+	static uint16_t devId = 0;
+
+	SndifConfig beConfig;
+
+	// 1 ms period to keep the test short
+	beConfig.periodFrames = 48;
+
+	auto sink = make_shared<SndifMemorySink>();
+
+	SECTION("Playback")
+	{
+		SndifFrontend::StreamConfig stream;
+
+		SndifFrontend frontend(0, gFeDomId, ++devId, {stream, stream});
+		SndifLoopbackHandler handler(0, gFeDomId, devId, sink, beConfig);
+
+		handler.start();
+
+		REQUIRE(frontend.connect());
+
+		REQUIRE(frontend.open(0) == 0);
+		REQUIRE(frontend.open(1) == 0);
+
+		// two streams of the same constant signal are summed
+		vector<int16_t> samples(stream.bufferSize / sizeof(int16_t), 1000);
+
+		REQUIRE(frontend.write(0, samples.data(), stream.bufferSize) == 0);
+		REQUIRE(frontend.write(1, samples.data(), stream.bufferSize) == 0);
+
+		REQUIRE(frontend.trigger(0, XENSND_OP_TRIGGER_START) == 0);
+		REQUIRE(frontend.trigger(1, XENSND_OP_TRIGGER_START) == 0);
+
+		REQUIRE(frontend.waitPosition(0, stream.bufferSize) > 0);
+		REQUIRE(frontend.getPosition(0) == stream.bufferSize);
+
+		auto data = sink->getData();
+		auto mixed = reinterpret_cast<const int16_t*>(data.data());
+		size_t numSamples = data.size() / sizeof(int16_t);
+		size_t numMixed = 0;
+
+		for (size_t i = 0; i < numSamples; i++)
+		{
+			// the streams may be started in different periods
+			REQUIRE((mixed[i] == 0 || mixed[i] == 1000 ||
+					 mixed[i] == 2000));
+
+			numMixed += mixed[i] == 2000;
+		}
+
+		REQUIRE(numMixed > 0);
+
+		// one event per frontend period at most
+		REQUIRE(frontend.waitPosition(1, stream.bufferSize) <=
+				stream.bufferSize / stream.periodSize);
+
+		REQUIRE(frontend.trigger(0, XENSND_OP_TRIGGER_STOP) == 0);
+		REQUIRE(frontend.close(0) == 0);
+		REQUIRE(frontend.close(1) == 0);
+
+		auto stats = handler.getStats();
+
+		REQUIRE(stats.periods > 0);
+		REQUIRE(stats.posEvents > 0);
+		REQUIRE(stats.eventBatches <= stats.posEvents);
+	}
+
+	SECTION("Capture")
+	{
+		SndifFrontend::StreamConfig stream;
+
+		stream.playback = false;
+
+		SndifFrontend frontend(0, gFeDomId, ++devId, {stream});
+		SndifLoopbackHandler handler(0, gFeDomId, devId, sink, beConfig);
+
+		handler.start();
+
+		REQUIRE(frontend.connect());
+
+		REQUIRE(frontend.open(0) == 0);
+		REQUIRE(frontend.trigger(0, XENSND_OP_TRIGGER_START) == 0);
+
+		REQUIRE(frontend.waitPosition(0, stream.periodSize) > 0);
+
+		vector<uint8_t> data(stream.periodSize, 0xFF);
+
+		REQUIRE(frontend.read(0, data.data(), data.size()) == 0);
+		REQUIRE(data == vector<uint8_t>(stream.periodSize, 0));
+	}
+
+	SECTION("Hw params and invalid open")
+	{
+		SndifFrontend::StreamConfig stream;
+
+		stream.rate = 44100;
+
+		SndifFrontend frontend(0, gFeDomId, ++devId, {stream});
+		SndifLoopbackHandler handler(0, gFeDomId, devId, sink, beConfig);
+
+		handler.start();
+
+		REQUIRE(frontend.connect());
+
+		xensnd_query_hw_param param {};
+
+		param.formats = ~0ULL;
+		param.rates.min = 8000;
+		param.rates.max = 192000;
+
+		REQUIRE(frontend.queryHwParam(0, param) == 0);
+		REQUIRE(param.rates.min == beConfig.rate);
+		REQUIRE(param.rates.max == beConfig.rate);
+		REQUIRE(param.formats == SndifMixer::getFormats());
+
+		// no resampling
+		REQUIRE(frontend.open(0) == -EINVAL);
+		REQUIRE(frontend.trigger(0, XENSND_OP_TRIGGER_START) == -EINVAL);
+	}
+}
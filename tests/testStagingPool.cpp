@@ -0,0 +1,146 @@
+/*
+ *  Test StagingPool
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "catch.hpp"
+
+#include "StagingPool.hpp"
+
+using std::thread;
+using std::vector;
+
+using XenBackend::StagingBuffer;
+using XenBackend::StagingPool;
+using XenBackend::StagingStats;
+
+TEST_CASE("StagingPool", "[stagingpool]")
+{
+	auto& pool = StagingPool::getInstance();
+
+	SECTION("Check size classes")
+	{
+		auto buffer = pool.alloc(100);
+
+		REQUIRE(buffer.get());
+		REQUIRE(buffer.size() == 100);
+		REQUIRE(buffer.getClass() == 0);
+		REQUIRE(reinterpret_cast<uintptr_t>(buffer.get()) % 4096 == 0);
+
+		buffer = pool.alloc(StagingPool::getClassSize(1));
+
+		REQUIRE(buffer.getClass() == 1);
+
+		buffer = pool.alloc(StagingPool::getClassSize(1) + 1);
+
+		REQUIRE(buffer.getClass() == 2);
+
+		memset(buffer.get(), 0xAA, buffer.size());
+	}
+
+	SECTION("Check reuse")
+	{
+		void* data = nullptr;
+
+		{
+			auto buffer = pool.alloc(4096);
+
+			data = buffer.get();
+		}
+
+		auto before = pool.getStats();
+		auto buffer = pool.alloc(4096);
+		auto after = pool.getStats();
+
+		REQUIRE(buffer.get() == data);
+		REQUIRE(after.classes[0].hits == before.classes[0].hits + 1);
+		REQUIRE(after.classes[0].inUse == before.classes[0].inUse + 1);
+		REQUIRE(after.classes[0].free == before.classes[0].free - 1);
+		REQUIRE(after.inUseBytes == before.inUseBytes + 4096);
+	}
+
+	SECTION("Check move")
+	{
+		auto buffer = pool.alloc(4096);
+		auto data = buffer.get();
+
+		StagingBuffer other(std::move(buffer));
+
+		REQUIRE(buffer.get() == nullptr);
+		REQUIRE(other.get() == data);
+
+		other.release();
+
+		REQUIRE(other.get() == nullptr);
+	}
+
+	SECTION("Check fallback")
+	{
+		auto before = pool.getStats();
+		auto maxSize = StagingPool::getClassSize(StagingPool::cNumClasses - 1);
+		auto buffer = pool.alloc(maxSize + 1);
+
+		REQUIRE(buffer.get());
+		REQUIRE(buffer.getClass() < 0);
+		REQUIRE(pool.getStats().fallbacks == before.fallbacks + 1);
+
+		// chunks are not mapped over the limit
+		auto maxReserved = pool.getMaxReserved();
+
+		pool.setMaxReserved(before.reservedBytes);
+
+		vector<StagingBuffer> buffers;
+
+		for (size_t size = 0; size <= before.reservedBytes; size += maxSize)
+		{
+			buffers.push_back(pool.alloc(maxSize));
+		}
+
+		auto after = pool.getStats();
+
+		pool.setMaxReserved(maxReserved);
+
+		REQUIRE(after.reservedBytes == before.reservedBytes);
+		REQUIRE(buffers.back().getClass() < 0);
+		REQUIRE(after.fallbacks > before.fallbacks + 1);
+	}
+
+	SECTION("Check release from other thread")
+	{
+		auto before = pool.getStats();
+		vector<StagingBuffer> buffers;
+
+		for (int i = 0; i < 64; i++)
+		{
+			buffers.push_back(pool.alloc(64 * 1024));
+		}
+
+		thread([&buffers] { buffers.clear(); }).join();
+
+		auto after = pool.getStats();
+
+		REQUIRE(after.classes[2].inUse == before.classes[2].inUse);
+		REQUIRE(after.classes[2].free >= 64);
+		REQUIRE(after.reservedBytes >= 64 * 64 * 1024);
+		REQUIRE(after.hugeChunks <= after.chunks);
+	}
+}
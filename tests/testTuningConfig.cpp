@@ -0,0 +1,256 @@
+/*
+ *  Test TuningConfig
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <thread>
+
+#include "catch.hpp"
+
+#include "TuningConfig.hpp"
+#include "mocks/XenEvtchnMock.hpp"
+#include "mocks/XenGnttabMock.hpp"
+#include "mocks/XenStoreMock.hpp"
+#include "testFrontendHandler.hpp"
+
+using std::chrono::milliseconds;
+using std::function;
+using std::make_shared;
+using std::ofstream;
+using std::string;
+using std::this_thread::sleep_for;
+using std::to_string;
+
+using XenBackend::BackendBase;
+using XenBackend::TuningConfig;
+using XenBackend::TuningConfigException;
+
+static const char* gDevName = "tuning_device";
+static const char* gFileName = "/tmp/xenbe_tuning_test.conf";
+
+static domid_t gBeDomId = 3;
+static domid_t gFeDomId = 6;
+static uint16_t gDevId = 1;
+
+class TuningBackend : public BackendBase
+{
+public:
+
+	TuningBackend() : BackendBase("TuningBackend", gDevName) {}
+
+private:
+
+	void onNewFrontend(domid_t domId, uint16_t devId) override
+	{
+		addFrontendHandler(make_shared<TestFrontendHandler>(
+				gDevName, getDomId(), domId, devId));
+	}
+};
+
+static void writeConfig(const string& content)
+{
+	string tmpName = string(gFileName) + ".tmp";
+
+	{
+		ofstream file(tmpName, std::ios::trunc);
+
+		file << content;
+	}
+
+	// replace atomically, so the partially written file is not reloaded
+	rename(tmpName.c_str(), gFileName);
+}
+
+static bool waitFor(function<bool()> condition)
+{
+	for (int i = 0; i < 200; i++)
+	{
+		if (condition())
+		{
+			return true;
+		}
+
+		sleep_for(milliseconds(10));
+	}
+
+	return false;
+}
+
+TEST_CASE("TuningConfig", "[tuning]")
+{
+	XenEvtchnMock::setErrorMode(false);
+	XenGnttabMock::setErrorMode(false);
+	XenStoreMock::setErrorMode(false);
+	XenStoreMock::setWriteValueCbk(nullptr);
+
+	string value;
+
+	SECTION("Scopes")
+	{
+		writeConfig("# global\n"
+					"ring-max-batch = 64\n"
+					"\n"
+					"[dom-6]\n"
+					"ring-max-batch = 32  # domain\n"
+					"\n"
+					"[ dom-06/dev-1/ring-0 ]\n"
+					"ring-max-batch=16\n");
+
+		string xsPath = "/local/domain/3/tuning/scopes";
+
+		XenStoreMock::writeValue(xsPath + "/dom-7/ring-max-batch", "8");
+		XenStoreMock::writeValue(xsPath + "/dom-6/dev-1/ring-cpu", "0");
+
+		TuningConfig config(gFileName, xsPath);
+
+		REQUIRE(config.getValue("ring-max-batch", value));
+		REQUIRE(value == "64");
+		REQUIRE(config.getValue("ring-max-batch", value, 6));
+		REQUIRE(value == "32");
+		REQUIRE(config.getValue("ring-max-batch", value, 6, 1));
+		REQUIRE(value == "32");
+		REQUIRE(config.getValue("ring-max-batch", value, 6, 1, 0));
+		REQUIRE(value == "16");
+		REQUIRE(config.getValue("ring-max-batch", value, 6, 1, 1));
+		REQUIRE(value == "32");
+		REQUIRE(config.getValue("ring-max-batch", value, 7, 1, 0));
+		REQUIRE(value == "8");
+		REQUIRE(config.getValue("ring-max-batch", value, 8, 1, 0));
+		REQUIRE(value == "64");
+
+		REQUIRE(config.getValue("ring-cpu", value, 6, 1, 0));
+		REQUIRE(value == "0");
+		REQUIRE_FALSE(config.getValue("ring-cpu", value, 6));
+		REQUIRE_FALSE(config.getValue("queue-cpus", value, 6, 1));
+	}
+
+	SECTION("Invalid")
+	{
+		const char* invalidConfigs[] =
+		{
+			"unknown-key = 1\n",
+			"ring-max-batch\n",
+			"ring-max-batch = -1\n",
+			"ring-cpu = 0x1\n",
+			"queue-cpus = 1,,2\n",
+			"log-level = verbose\n",
+			"[dom-6\nring-cpu = 1\n",
+			"[dev-1]\nring-cpu = 1\n",
+			"[dom-6/ring-0]\nring-cpu = 1\n",
+			"[dom-6/dev-1/ring-0]\nqueue-cpus = 1\n",
+			"[dom-6]\nlog-level = debug\n",
+		};
+
+		for (auto invalidConfig : invalidConfigs)
+		{
+			writeConfig(invalidConfig);
+
+			REQUIRE_THROWS_AS(TuningConfig(string(gFileName)),
+							  TuningConfigException);
+		}
+
+		REQUIRE_THROWS_AS(TuningConfig("/nonexistent/tuning.conf"),
+						  TuningConfigException);
+
+		writeConfig("queue-cpus = 0, 1\n");
+
+		TuningConfig config(gFileName);
+
+		// invalid reload keeps the previous configuration
+		writeConfig("queue-cpus = 0, a\n");
+
+		REQUIRE_FALSE(config.reload());
+		REQUIRE(config.getValue("queue-cpus", value));
+		REQUIRE(value == "0, 1");
+
+		writeConfig("queue-cpus = 1\n");
+
+		REQUIRE(config.reload());
+		REQUIRE(config.getValue("queue-cpus", value));
+		REQUIRE(value == "1");
+
+		// unchanged configuration is not applied again
+		REQUIRE_FALSE(config.reload());
+		REQUIRE(config.getNumReloads() == 1);
+	}
+
+	SECTION("Apply")
+	{
+		TestFrontendHandler::prepareXenStore(gDevName, gBeDomId, gFeDomId,
+											 gDevId);
+
+		writeConfig("[dom-6/dev-1/ring-0]\n"
+					"ring-max-batch = 16\n"
+					"ring-cpu = 0\n");
+
+		string xsPath = "/local/domain/3/tuning/apply";
+
+		TuningBackend backend;
+		TuningConfig config(gFileName, xsPath);
+
+		config.attach(backend);
+
+		backend.start();
+
+		REQUIRE(waitFor([&backend] {
+			return !backend.getFrontendHandlers().empty(); }));
+
+		auto frontendHandler = backend.getFrontendHandlers().front();
+
+		XenStoreMock::writeValue(frontendHandler->getXsFrontendPath() +
+								 "/state", to_string(XenbusStateConnected));
+
+		// the configuration is applied on connect
+		REQUIRE(waitFor([&frontendHandler] {
+			return frontendHandler->getBackendState() ==
+				   XenbusStateConnected; }));
+
+		auto ringBuffers = frontendHandler->getRingBuffers();
+
+		REQUIRE(ringBuffers.size() == 1);
+		REQUIRE(ringBuffers[0]->getMaxBatch() == 16);
+		REQUIRE(ringBuffers[0]->getCpu() == 0);
+
+		config.start(milliseconds(10));
+
+		// file change is applied to the connected handler
+		writeConfig("[dom-6/dev-1/ring-0]\n"
+					"ring-max-batch = 128\n");
+
+		REQUIRE(waitFor([&ringBuffers] {
+			return ringBuffers[0]->getMaxBatch() == 128; }));
+
+		// Xen store overrides the file, the mock watches are not recursive
+		// so the subtree root is touched
+		XenStoreMock::writeValue(xsPath + "/dom-6/dev-1/ring-0/ring-max-batch",
+								 "48");
+		XenStoreMock::writeValue(xsPath, "");
+
+		REQUIRE(waitFor([&ringBuffers] {
+			return ringBuffers[0]->getMaxBatch() == 48; }));
+
+		REQUIRE(config.getNumReloads() == 2);
+
+		config.stop();
+		backend.stop();
+	}
+}
@@ -21,6 +21,7 @@
 #include <chrono>
 #include <condition_variable>
 #include <mutex>
+#include <thread>
 
 #include "catch.hpp"
 
@@ -30,9 +31,11 @@
 using std::chrono::milliseconds;
 using std::condition_variable;
 using std::mutex;
+using std::this_thread::sleep_for;
 using std::unique_lock;
 
 using XenBackend::XenEvtchn;
+using XenBackend::XenEvtchnPool;
 
 static mutex gMutex;
 static condition_variable gCondVar;
@@ -124,3 +127,84 @@ TEST_CASE("XenEvtchnError", "[xenevtchn]")
 
 	REQUIRE_THROWS(XenEvtchn(3, 24, eventChannelCbk, errorHandling));
 }
+
+TEST_CASE("XenEvtchnPool", "[xenevtchn]")
+{
+	XenEvtchnMock::setErrorMode(false);
+
+	auto& pool = XenEvtchnPool::getInstance();
+
+	pool.setMaxSize(0);
+	pool.setMaxSize(XenEvtchnPool::cDefaultMaxSize);
+
+	REQUIRE(pool.getSize() == 0);
+
+	evtchn_port_t oldPort;
+
+	{
+		XenEvtchn eventChannel(3, 25, eventChannelCbk, errorHandling);
+
+		eventChannel.start();
+
+		oldPort = eventChannel.getPort();
+	}
+
+	// the stopped handle is returned to the pool
+	REQUIRE(pool.getSize() == 1);
+
+	auto numReused = pool.getNumReused();
+
+	{
+		XenEvtchn eventChannel(3, 26, eventChannelCbk, errorHandling);
+
+		REQUIRE(pool.getNumReused() == numReused + 1);
+		REQUIRE(pool.getSize() == 0);
+
+		eventChannel.start();
+
+		gEventChannelCbk = false;
+		gNumErrors = 0;
+
+		XenEvtchnMock::signalPort(eventChannel.getPort());
+
+		waitForCbk();
+
+		REQUIRE(gEventChannelCbk);
+		REQUIRE(gNumErrors == 0);
+		REQUIRE(eventChannel.getPort() != oldPort);
+	}
+
+	// the handle which event loop failed is not reused
+	{
+		XenEvtchn eventChannel(3, 27, eventChannelCbk, errorHandling);
+
+		eventChannel.start();
+
+		gNumErrors = 0;
+
+		XenEvtchnMock::setErrorMode(true);
+
+		XenEvtchnMock::signalPort(eventChannel.getPort());
+
+		for (int i = 0; i < 100 && !gNumErrors; i++)
+		{
+			sleep_for(milliseconds(10));
+		}
+
+		REQUIRE(gNumErrors == 1);
+
+		XenEvtchnMock::setErrorMode(false);
+	}
+
+	REQUIRE(pool.getSize() == 0);
+
+	pool.setMaxSize(0);
+
+	{
+		XenEvtchn eventChannel(3, 28, eventChannelCbk, errorHandling);
+	}
+
+	REQUIRE(pool.getSize() == 0);
+
+	pool.setMaxSize(XenEvtchnPool::cDefaultMaxSize);
+}
@@ -18,12 +18,29 @@
  * Copyright (C) 2016 EPAM Systems Inc.
  */
 
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 #include "catch.hpp"
 
 #include "mocks/XenGnttabMock.hpp"
 #include "XenGnttab.hpp"
 
+using std::chrono::milliseconds;
+using std::mutex;
+using std::this_thread::sleep_for;
+using std::try_to_lock;
+using std::unique_lock;
+using std::unique_ptr;
+using std::vector;
+
+using XenBackend::GrantAccount;
+using XenBackend::GrantBudget;
+using XenBackend::GrantLimits;
 using XenBackend::XenGnttabBuffer;
+using XenBackend::XenGnttabException;
 
 TEST_CASE("XenGnttab", "[xengnttab]")
 {
@@ -55,3 +72,207 @@ TEST_CASE("XenGnttab", "[xengnttab]")
 		REQUIRE_THROWS(XenGnttabBuffer(3, 14));
 	}
 }
+
+TEST_CASE("GrantBudget", "[xengnttab]")
+{
+	XenGnttabMock::setErrorMode(false);
+
+	auto& budget = GrantBudget::getInstance();
+
+	GrantLimits limits;
+
+	SECTION("Quotas")
+	{
+		domid_t domId = 50;
+
+		limits.maxDomainPages = 4;
+
+		budget.setLimits(limits);
+
+		grant_ref_t refs[] = { 1, 2, 3 };
+
+		{
+			XenGnttabBuffer buffer1(domId, refs, 3);
+			XenGnttabBuffer buffer2(domId, 4);
+
+			REQUIRE(budget.getDomainUsage(domId).pages == 4);
+
+			REQUIRE_THROWS_AS(XenGnttabBuffer(domId, 5), XenGnttabException);
+			REQUIRE(budget.getDomainUsage(domId).rejections == 1);
+			REQUIRE(budget.getDomainUsage(domId).peakPages == 4);
+
+			// other domains are not limited by the domain quota
+			XenGnttabBuffer buffer3(domId + 1, refs, 3);
+		}
+
+		// the usage of the domains without pages is dropped
+		REQUIRE(budget.getDomainUsage(domId).pages == 0);
+		REQUIRE(budget.getDomainUsage(domId).peakPages == 0);
+		REQUIRE(budget.getDomainUsage(domId).rejections == 0);
+
+		limits.maxDomainPages = 0;
+		limits.maxFrontendPages = 2;
+
+		budget.setLimits(limits);
+
+		GrantAccount account(domId, 0);
+
+		XenGnttabBuffer buffer(domId, refs, 2, PROT_READ | PROT_WRITE,
+							   &account);
+
+		REQUIRE(account.getPages() == 2);
+		REQUIRE(budget.getFrontendUsage(domId, 0).pages == 2);
+
+		REQUIRE_THROWS_AS(XenGnttabBuffer(domId, 3, PROT_READ | PROT_WRITE,
+										  &account), XenGnttabException);
+
+		// not accounted buffers are not limited by the frontend quota
+		XenGnttabBuffer notAccounted(domId, 3);
+	}
+
+	SECTION("No limits")
+	{
+		domid_t domId = 70;
+
+		auto usage = budget.getUsage();
+
+		GrantAccount account(domId, 0);
+
+		unique_ptr<XenGnttabBuffer> notAccounted(new XenGnttabBuffer(
+				domId, 1, PROT_READ | PROT_WRITE, &account));
+
+		REQUIRE(account.getPages() == 1);
+		REQUIRE(budget.getUsage().pages == usage.pages);
+		REQUIRE(budget.getDomainUsage(domId).pages == 0);
+
+		limits.maxDomainPages = 1;
+
+		budget.setLimits(limits);
+
+		XenGnttabBuffer buffer(domId, 2, PROT_READ | PROT_WRITE, &account);
+
+		REQUIRE(account.getPages() == 2);
+		REQUIRE(budget.getDomainUsage(domId).pages == 1);
+		REQUIRE(budget.getFrontendUsage(domId, 0).pages == 1);
+
+		// the pages mapped without limits are not taken from the usage
+		notAccounted.reset();
+
+		REQUIRE(account.getPages() == 1);
+		REQUIRE(budget.getDomainUsage(domId).pages == 1);
+		REQUIRE(budget.getFrontendUsage(domId, 0).pages == 1);
+	}
+
+	SECTION("Owner lock")
+	{
+		domid_t domId = 80;
+
+		limits.maxFrontendPages = 1;
+
+		budget.setLimits(limits);
+
+		GrantAccount account(domId, 0);
+		mutex cacheMutex;
+		vector<unique_ptr<XenGnttabBuffer>> cache;
+
+		account.setEvictCallback([&cacheMutex, &cache] (size_t numPages) {
+			unique_lock<mutex> lock(cacheMutex, try_to_lock);
+
+			if (!lock.owns_lock())
+			{
+				return size_t(0);
+			}
+
+			auto evicted = cache.size();
+
+			cache.clear();
+
+			return evicted;
+		});
+
+		cache.emplace_back(new XenGnttabBuffer(
+				domId, 1, PROT_READ | PROT_WRITE, &account));
+
+		{
+			// the owner maps under its lock and is its own coldest account
+			unique_lock<mutex> lock(cacheMutex);
+
+			REQUIRE_THROWS_AS(XenGnttabBuffer(domId, 2, PROT_READ | PROT_WRITE,
+											  &account), XenGnttabException);
+			REQUIRE(cache.size() == 1);
+		}
+
+		XenGnttabBuffer buffer(domId, 2, PROT_READ | PROT_WRITE, &account);
+
+		REQUIRE(cache.empty());
+		REQUIRE(account.getPages() == 1);
+
+		account.setEvictCallback(nullptr);
+	}
+
+	SECTION("Eviction")
+	{
+		domid_t domId = 60;
+
+		limits.maxPages = budget.getUsage().pages + 4;
+
+		budget.setLimits(limits);
+
+		GrantAccount coldAccount(domId, 0);
+		GrantAccount hotAccount(domId + 1, 0);
+
+		vector<unique_ptr<XenGnttabBuffer>> coldCache;
+		vector<unique_ptr<XenGnttabBuffer>> hotCache;
+
+		coldAccount.setEvictCallback([&coldCache] (size_t numPages) {
+			size_t evicted = 0;
+
+			while (!coldCache.empty() && evicted < numPages)
+			{
+				coldCache.pop_back();
+				evicted++;
+			}
+
+			return evicted;
+		});
+
+		for (grant_ref_t ref = 1; ref <= 2; ref++)
+		{
+			coldCache.emplace_back(new XenGnttabBuffer(
+					domId, ref, PROT_READ | PROT_WRITE, &coldAccount));
+		}
+
+		sleep_for(milliseconds(1));
+
+		for (grant_ref_t ref = 1; ref <= 2; ref++)
+		{
+			hotCache.emplace_back(new XenGnttabBuffer(
+					domId + 1, ref, PROT_READ | PROT_WRITE, &hotAccount));
+		}
+
+		hotAccount.touch();
+
+		// the process limit is reached, the coldest cache gives its page
+		hotCache.emplace_back(new XenGnttabBuffer(
+				domId + 1, 3, PROT_READ | PROT_WRITE, &hotAccount));
+
+		REQUIRE(coldCache.size() == 1);
+		REQUIRE(coldAccount.getPages() == 1);
+		REQUIRE(budget.getFrontendUsage(domId, 0).evictedPages == 1);
+
+		// hot account has no callback, cold cache is evicted completely and
+		// then the mapping is refused
+		hotCache.emplace_back(new XenGnttabBuffer(
+				domId + 1, 4, PROT_READ | PROT_WRITE, &hotAccount));
+
+		REQUIRE(coldCache.empty());
+
+		REQUIRE_THROWS_AS(XenGnttabBuffer(domId + 1, 5, PROT_READ | PROT_WRITE,
+										  &hotAccount), XenGnttabException);
+		REQUIRE(budget.getFrontendUsage(domId + 1, 0).rejections == 1);
+
+		coldAccount.setEvictCallback(nullptr);
+	}
+
+	budget.setLimits(GrantLimits());
+}
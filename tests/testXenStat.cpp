@@ -18,13 +18,54 @@
  * Copyright (C) 2016 EPAM Systems Inc.
  */
 
+#include <chrono>
+#include <thread>
+#include <vector>
+
 #include "catch.hpp"
 
 #include "mocks/XenCtrlMock.hpp"
 #include "XenStat.hpp"
 
+using std::chrono::milliseconds;
+using std::this_thread::sleep_for;
+using std::vector;
+
+using XenBackend::DomainChange;
+using XenBackend::DomainStats;
 using XenBackend::XenStat;
 
+static xc_domaininfo_t createDomInfo(domid_t domId, uint64_t cpuTime,
+									 uint64_t pages, uint32_t vcpus,
+									 uint32_t flags = XEN_DOMINF_running)
+{
+	xc_domaininfo_t info = {};
+
+	info.domain = domId;
+	info.cpu_time = cpuTime;
+	info.tot_pages = pages;
+	info.nr_online_vcpus = vcpus;
+	info.flags = flags;
+
+	return info;
+}
+
+static size_t countEvents(const vector<DomainChange>& changes,
+						  DomainChange::Event event, domid_t domId)
+{
+	size_t count = 0;
+
+	for (auto& change : changes)
+	{
+		if (change.event == event && change.stats.domId == domId)
+		{
+			count++;
+		}
+	}
+
+	return count;
+}
+
 TEST_CASE("XenStat", "[xenctrl]")
 {
 	XenStat xenStat;
@@ -80,3 +121,142 @@ TEST_CASE("XenStatError", "[xenctrl]")
 
 	REQUIRE_THROWS(XenStat());
 }
+
+TEST_CASE("XenStatSample", "[xenctrl]")
+{
+	XenCtrlMock::setErrorMode(false);
+	XenCtrlMock::clearDomInfos();
+
+	XenStat xenStat;
+	vector<DomainChange> changes;
+
+	xenStat.setChangeCallback([&changes](const DomainChange& change)
+							  { changes.push_back(change); });
+
+	XenCtrlMock::addDomInfo(createDomInfo(1, 0, 1000, 1));
+	XenCtrlMock::addDomInfo(createDomInfo(2, 0, 2000, 2));
+
+	xenStat.sample();
+
+	REQUIRE(changes.size() == 2);
+	REQUIRE(countEvents(changes, DomainChange::Event::CREATED, 1) == 1);
+	REQUIRE(countEvents(changes, DomainChange::Event::CREATED, 2) == 1);
+
+	SECTION("Deltas and rates")
+	{
+		changes.clear();
+
+		sleep_for(milliseconds(100));
+
+		// 50 ms of CPU time within at least 100 ms
+		XenCtrlMock::addDomInfo(createDomInfo(1, 50000000, 1500, 2));
+		XenCtrlMock::addDomInfo(createDomInfo(2, 0, 2000, 2,
+											  XEN_DOMINF_paused));
+
+		xenStat.sample();
+
+		DomainStats stats;
+
+		REQUIRE(xenStat.getDomainStats(1, stats));
+		REQUIRE(stats.cpuTime == 50000000);
+		REQUIRE(stats.cpuUsage > 0.0);
+		REQUIRE(stats.cpuUsage <= 0.5);
+		REQUIRE(stats.pagesDelta == 500);
+		REQUIRE(stats.pagesRate > 0.0);
+		REQUIRE(stats.vcpusDelta == 1);
+		REQUIRE(stats.changedFlags == 0);
+
+		REQUIRE(xenStat.getDomainStats(2, stats));
+		REQUIRE(stats.cpuUsage == 0.0);
+		REQUIRE(stats.changedFlags == XEN_DOMINF_paused);
+
+		REQUIRE_FALSE(xenStat.getDomainStats(3, stats));
+
+		REQUIRE(changes.size() == 3);
+		REQUIRE(countEvents(changes, DomainChange::Event::MEMORY_CHANGED,
+							1) == 1);
+		REQUIRE(countEvents(changes, DomainChange::Event::VCPUS_CHANGED,
+							1) == 1);
+		REQUIRE(countEvents(changes, DomainChange::Event::STATE_CHANGED,
+							2) == 1);
+
+		// running flag changes are not reported
+		changes.clear();
+
+		XenCtrlMock::addDomInfo(createDomInfo(1, 50000000, 1500, 2, 0));
+
+		xenStat.sample();
+
+		REQUIRE(changes.empty());
+	}
+
+	SECTION("Created and destroyed")
+	{
+		changes.clear();
+
+		XenCtrlMock::removeDomInfo(2);
+		XenCtrlMock::addDomInfo(createDomInfo(3, 0, 1000, 1));
+
+		xenStat.sample();
+
+		REQUIRE(changes.size() == 2);
+		REQUIRE(countEvents(changes, DomainChange::Event::DESTROYED, 2) == 1);
+		REQUIRE(countEvents(changes, DomainChange::Event::CREATED, 3) == 1);
+
+		auto snapshot = xenStat.getSnapshot();
+
+		REQUIRE(snapshot.size() == 2);
+		REQUIRE(snapshot[0].domId == 1);
+		REQUIRE(snapshot[1].domId == 3);
+
+		// CPU time goes back: the id is reused by a new domain
+		XenCtrlMock::addDomInfo(createDomInfo(1, 10, 1000, 1));
+
+		xenStat.sample();
+
+		changes.clear();
+
+		XenCtrlMock::addDomInfo(createDomInfo(1, 5, 1000, 1));
+
+		xenStat.sample();
+
+		REQUIRE(changes.size() == 2);
+		REQUIRE(countEvents(changes, DomainChange::Event::DESTROYED, 1) == 1);
+		REQUIRE(countEvents(changes, DomainChange::Event::CREATED, 1) == 1);
+	}
+
+	SECTION("Many domains")
+	{
+		for (domid_t domId = 10; domId < 210; domId++)
+		{
+			XenCtrlMock::addDomInfo(createDomInfo(domId, 0, 1000, 1));
+		}
+
+		auto existDoms = xenStat.getExistingDoms();
+
+		REQUIRE(existDoms.size() == 202);
+
+		for (size_t i = 1; i < existDoms.size(); i++)
+		{
+			REQUIRE(existDoms[i - 1] < existDoms[i]);
+		}
+
+		REQUIRE(xenStat.getSnapshot().size() == 202);
+	}
+
+	SECTION("Periodic")
+	{
+		xenStat.start(milliseconds(10));
+
+		for (int i = 0; i < 100 && xenStat.getNumSamples() < 4; i++)
+		{
+			sleep_for(milliseconds(10));
+		}
+
+		xenStat.stop();
+
+		REQUIRE(xenStat.getNumSamples() >= 4);
+	}
+
+	XenCtrlMock::clearDomInfos();
+}
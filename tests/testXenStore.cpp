@@ -22,6 +22,7 @@
 #include <chrono>
 #include <condition_variable>
 #include <mutex>
+#include <thread>
 
 #include "catch.hpp"
 
@@ -121,6 +122,24 @@ TEST_CASE("XenStore", "[xenstore]")
 		REQUIRE_THROWS(xenStore.readInt("/non/exist/entry"));
 	}
 
+	SECTION("Check read if exist")
+	{
+		string path = "/local/domain/3/value";
+		int intVal = 0;
+		string strVal;
+
+		xenStore.writeInt(path, 4567);
+		REQUIRE(xenStore.readIntIfExist(path, intVal));
+		REQUIRE(intVal == 4567);
+
+		xenStore.writeString(path, "String value");
+		REQUIRE(xenStore.readStringIfExist(path, strVal));
+		REQUIRE(strVal == "String value");
+
+		REQUIRE_FALSE(xenStore.readIntIfExist("/non/exist/entry", intVal));
+		REQUIRE_FALSE(xenStore.readStringIfExist("/non/exist/entry", strVal));
+	}
+
 	SECTION("Check read/write error")
 	{
 		XenStoreMock::setErrorMode(true);
@@ -227,6 +246,90 @@ TEST_CASE("XenStore", "[xenstore]")
 	}
 }
 
+TEST_CASE("XenStoreReconnect", "[xenstore]")
+{
+	XenStoreMock::setErrorMode(false);
+	XenStoreMock::setWriteValueCbk(nullptr);
+
+	XenStore xenStore(errorHandling);
+
+	bool reconnected = false;
+	uint64_t callbackReconnects = 0;
+
+	xenStore.setReconnectDelay(milliseconds(1), milliseconds(4));
+	xenStore.setReconnectCallback([&] {
+		// the reconnect is counted before the callback
+		auto reconnects = xenStore.getStats().reconnects;
+
+		unique_lock<mutex> lock(gMutex);
+
+		reconnected = true;
+		callbackReconnects = reconnects;
+
+		gCondVar.notify_all();
+	});
+
+	string path = "/local/domain/3/reconnect";
+
+	xenStore.setWatch(path, watchCbk1);
+	xenStore.start();
+
+	gNumErrors = 0;
+
+	SECTION("Check restoring watches")
+	{
+		// xenstored is down for a while
+		XenStoreMock::setErrorMode(true);
+		XenStoreMock::hangUp();
+
+		std::this_thread::sleep_for(milliseconds(20));
+
+		XenStoreMock::setErrorMode(false);
+
+		{
+			unique_lock<mutex> lock(gMutex);
+
+			REQUIRE(gCondVar.wait_for(lock, milliseconds(1000),
+									  [&reconnected] { return reconnected; }));
+
+			gWatchCbk1 = false;
+
+			REQUIRE(callbackReconnects == 1);
+		}
+
+		auto stats = xenStore.getStats();
+
+		REQUIRE(stats.reconnects == 1);
+		REQUIRE(stats.failedAttempts > 0);
+		REQUIRE(stats.lastRecoveryTime >= milliseconds(20));
+		REQUIRE(stats.maxRecoveryTime == stats.lastRecoveryTime);
+
+		xenStore.writeString(path, "Value");
+
+		waitForWatch();
+
+		REQUIRE(gWatchCbk1);
+		REQUIRE(gNumErrors == 0);
+	}
+
+	SECTION("Check disabled reconnect")
+	{
+		xenStore.setReconnectDelay(milliseconds(0), milliseconds(0));
+
+		XenStoreMock::hangUp();
+
+		for (int i = 0; i < 100 && gNumErrors == 0; i++)
+		{
+			std::this_thread::sleep_for(milliseconds(10));
+		}
+
+		REQUIRE(gNumErrors == 1);
+		REQUIRE(xenStore.getStats().reconnects == 0);
+	}
+
+	xenStore.stop();
+}
+
 TEST_CASE("XenStoreError", "[xenstore]")
 {
 	XenStoreMock::setErrorMode(true);
@@ -0,0 +1,288 @@
+/*
+ *  Test XenVchan
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ *
+ * Copyright (C) 2016 EPAM Systems Inc.
+ */
+
+#include <cstring>
+#include <string>
+#include <thread>
+
+#include "catch.hpp"
+
+#include "XenVchan.hpp"
+#include "loopback/VchanFrontend.hpp"
+#include "mocks/XenEvtchnMock.hpp"
+#include "mocks/XenGnttabMock.hpp"
+
+using std::string;
+using std::thread;
+using std::to_string;
+
+using XenBackend::XenVchan;
+using XenBackend::XenVchanException;
+
+static domid_t gFeDomId = 14;
+
+static string makeData(size_t size)
+{
+	string data;
+
+	for (size_t i = 0; data.size() < size; i++)
+	{
+		data += to_string(i) + ",";
+	}
+
+	data.resize(size);
+
+	return data;
+}
+
+/*
+ * Reads the data through the spans, checks that the whole ring is available
+ */
+static string readSpans(XenVchan& vchan, size_t size)
+{
+	string data;
+
+	while (data.size() < size)
+	{
+		REQUIRE(vchan.waitRead(1, 3000));
+
+		iovec iov[2];
+		int count;
+
+		auto available = vchan.getReadSpans(iov, count);
+
+		REQUIRE(available > 0);
+		REQUIRE(count >= 1);
+		REQUIRE(count <= 2);
+
+		for (int i = 0; i < count; i++)
+		{
+			data.append(static_cast<char*>(iov[i].iov_base), iov[i].iov_len);
+		}
+
+		vchan.consume(available);
+	}
+
+	return data;
+}
+
+static void writeSpans(XenVchan& vchan, const string& data)
+{
+	size_t written = 0;
+
+	while (written < data.size())
+	{
+		REQUIRE(vchan.waitWrite(1, 3000));
+
+		iovec iov[2];
+		int count;
+
+		vchan.getWriteSpans(iov, count);
+
+		size_t size = 0;
+
+		for (int i = 0; i < count && written + size < data.size(); i++)
+		{
+			auto chunk = std::min(iov[i].iov_len,
+								  data.size() - written - size);
+
+			memcpy(iov[i].iov_base, &data[written + size], chunk);
+
+			size += chunk;
+		}
+
+		vchan.produce(size);
+
+		written += size;
+	}
+}
+
+TEST_CASE("XenVchan", "[xenvchan]")
+{
+	XenEvtchnMock::setErrorMode(false);
+	XenGnttabMock::setErrorMode(false);
+
+	SECTION("Rings in interface page")
+	{
+		VchanFrontend peer(0, gFeDomId, 10, 11);
+		XenVchan vchan(gFeDomId, peer.getRef(), peer.getPort());
+
+		peer.bind();
+		vchan.start();
+
+		REQUIRE(peer.isConnected());
+		REQUIRE(vchan.isOpen());
+		REQUIRE(vchan.getWriteRingSize() == 1024);
+		REQUIRE(vchan.getReadRingSize() == 2048);
+
+		// both directions wrap around the rings several times
+
+		auto in = makeData(10000);
+		auto out = makeData(7000);
+
+		string received;
+
+		thread peerThread([&peer, &in, &out, &received] {
+			peer.write(in);
+
+			received = peer.read(out.size());
+		});
+
+		REQUIRE(readSpans(vchan, in.size()) == in);
+
+		writeSpans(vchan, out);
+
+		peerThread.join();
+
+		REQUIRE(received == out);
+
+		auto stats = vchan.getStats();
+
+		REQUIRE(stats.bytesRead == in.size());
+		REQUIRE(stats.bytesWritten == out.size());
+	}
+
+	SECTION("Multi-page rings")
+	{
+		VchanFrontend peer(0, gFeDomId, 16, 14);
+		XenVchan vchan(gFeDomId, peer.getRef(), peer.getPort());
+
+		peer.bind();
+		vchan.start();
+
+		REQUIRE(vchan.getWriteRingSize() == 65536);
+		REQUIRE(vchan.getReadRingSize() == 16384);
+
+		auto in = makeData(200000);
+		auto out = makeData(300000);
+
+		string received;
+
+		thread peerThread([&peer, &in, &out, &received] {
+			peer.write(in);
+
+			received = peer.read(out.size());
+		});
+
+		REQUIRE(readSpans(vchan, in.size()) == in);
+
+		writeSpans(vchan, out);
+
+		peerThread.join();
+
+		REQUIRE(received == out);
+	}
+
+	SECTION("Copy read and write")
+	{
+		VchanFrontend peer(0, gFeDomId, 12, 12);
+		XenVchan vchan(gFeDomId, peer.getRef(), peer.getPort());
+
+		peer.bind();
+		vchan.start();
+
+		string data = "hello";
+		char buffer[16] = {};
+
+		REQUIRE(vchan.read(buffer, sizeof(buffer)) == 0);
+
+		peer.write(data);
+
+		REQUIRE(vchan.waitRead(data.size(), 1000));
+		REQUIRE(vchan.read(buffer, sizeof(buffer)) == data.size());
+		REQUIRE(string(buffer, data.size()) == data);
+
+		REQUIRE(vchan.write(data.data(), data.size()) == data.size());
+		REQUIRE(peer.read(data.size()) == data);
+
+		// no more than the free space is written
+
+		auto big = makeData(5000);
+
+		REQUIRE(vchan.write(big.data(), big.size()) == 4096);
+		REQUIRE(vchan.getWriteSize() == 0);
+		REQUIRE_FALSE(vchan.waitWrite(1, 10));
+	}
+
+	SECTION("Notify on empty and full only")
+	{
+		VchanFrontend peer(0, gFeDomId, 12, 12);
+		XenVchan vchan(gFeDomId, peer.getRef(), peer.getPort());
+
+		peer.bind();
+		vchan.start();
+
+		// the peer has requested notification on the first write only
+
+		for (int i = 0; i < 100; i++)
+		{
+			REQUIRE(vchan.write("x", 1) == 1);
+		}
+
+		REQUIRE(vchan.getStats().notifications == 1);
+
+		REQUIRE(peer.read(100).size() == 100);
+
+		// the peer waits on the empty ring
+
+		peer.waitRead(0);
+
+		REQUIRE(vchan.write("y", 1) == 1);
+		REQUIRE(vchan.write("z", 1) == 1);
+
+		REQUIRE(vchan.getStats().notifications == 2);
+		REQUIRE(peer.waitRead(100));
+	}
+
+	SECTION("Peer close")
+	{
+		VchanFrontend peer(0, gFeDomId, 10, 10);
+		XenVchan vchan(gFeDomId, peer.getRef(), peer.getPort());
+
+		peer.bind();
+		vchan.start();
+
+		thread peerThread([&peer] { peer.close(); });
+
+		REQUIRE_FALSE(vchan.waitRead(1, 3000));
+		REQUIRE_FALSE(vchan.isOpen());
+
+		peerThread.join();
+	}
+
+	SECTION("Invalid interface")
+	{
+		VchanFrontend peer(0, gFeDomId, 10, 10);
+
+		auto intf = static_cast<vchan_interface*>(
+			VchanFrontend::getPage(peer.getRef()));
+
+		intf->left_order = 9;
+
+		REQUIRE_THROWS_AS(XenVchan(gFeDomId, peer.getRef(), peer.getPort()),
+						  XenVchanException);
+
+		intf->left_order = 11;
+		intf->right_order = 11;
+
+		REQUIRE_THROWS_AS(XenVchan(gFeDomId, peer.getRef(), peer.getPort()),
+						  XenVchanException);
+	}
+}